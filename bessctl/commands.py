@@ -15,6 +15,9 @@ import inspect
 import traceback
 import tempfile
 import signal
+import mmap
+import struct
+import json
 
 import sugar
 from port import *
@@ -155,6 +158,11 @@ def get_var_attrs(cli, var_token, partial_word):
             var_desc = 'name of an existing module instance'
             var_candidates = [m.name for m in cli.bess.list_modules()]
 
+        elif var_token == '[MODULE]':
+            var_type = 'name'
+            var_desc = 'name of an existing module instance (default all)'
+            var_candidates = [m.name for m in cli.bess.list_modules()]
+
         elif var_token == 'MODULE...':
             var_type = 'name+'
             var_desc = 'one or more module names'
@@ -178,6 +186,11 @@ def get_var_attrs(cli, var_token, partial_word):
             var_desc = 'one or more port names'
             var_candidates = [p.name for p in cli.bess.list_ports()]
 
+        elif var_token == 'TC':
+            var_type = 'name'
+            var_desc = 'name of a traffic class'
+            var_candidates = [c.name for c in cli.bess.list_tcs()]
+
         elif var_token == 'TC...':
             var_type = 'name+'
             var_desc = 'one or more traffic class names'
@@ -234,6 +247,42 @@ def get_var_attrs(cli, var_token, partial_word):
             var_type = 'int'
             var_desc = 'TCP port'
 
+        elif var_token == '[MIN_SIZE]':
+            var_type = 'int'
+            var_desc = 'batches smaller than this are merged (default 16)'
+
+        elif var_token == '[DURATION_US]':
+            var_type = 'int'
+            var_desc = 'duration in microseconds (default 1000)'
+
+        elif var_token == 'SNAPSHOT_FILE':
+            var_type = 'filename'
+            var_desc = 'pipeline snapshot file'
+            var_candidates = complete_filename(partial_word)
+
+        elif var_token == 'RESULT_FILE':
+            var_type = 'filename'
+            var_desc = 'JSON file for the results'
+            var_candidates = complete_filename(partial_word)
+
+        elif var_token == 'ADMISSION_OPTS...':
+            var_type = 'map'
+            var_desc = 'reserve_pct=PCT, watermark_pct=PCT, ' \
+                    'min_priority=PRIORITY'
+
+        elif var_token == '[PLACE_OPTS...]':
+            var_type = 'map'
+            var_desc = 'workers_per_socket=N, dry_run=1, resume=1'
+
+        elif var_token == '[PERFTEST_OPTS...]':
+            var_type = 'map'
+            var_desc = 'confs=[...], env={...}, warmup=SEC, duration=SEC, ' \
+                    'baseline=FILE, tolerance=RATIO'
+
+        elif var_token == 'SAMPLE_RATE':
+            var_type = 'int'
+            var_desc = 'capture 1 out of every N packets'
+
     except socket.error as e:
         if e.errno in [errno.ECONNRESET, errno.EPIPE]:
             cli.bess.disconnect()
@@ -384,6 +433,24 @@ def history(cli):
 def debug(cli, flag):
     cli.bess.set_debug(flag== 'enable')
 
+@cmd('track ENABLE_DISABLE [MODULE] [OGATE]', 
+        'Enable/disable batch and packet counters on gates')
+def track(cli, flag, module_name, ogate):
+    cli.bess.track_gate(flag == 'enable', module_name, ogate)
+
+@cmd('latency ENABLE_DISABLE [MODULE] [OGATE]', 
+        'Enable/disable per-hop latency probes on gates')
+def latency(cli, flag, module_name, ogate):
+    cli.bess.latency_gate(flag == 'enable', module_name, ogate)
+
+@cmd('compact ENABLE_DISABLE MODULE [OGATE] [MIN_SIZE]', 
+        'Enable/disable merging of small batches on an output gate')
+def compact(cli, flag, module_name, ogate, min_size):
+    if flag == 'enable':
+        cli.bess.compact_gate(module_name, ogate or 0, min_size or 16)
+    else:
+        cli.bess.compact_gate(module_name, ogate or 0, 0)
+
 @cmd('daemon connect [HOST] [TCP_PORT]', 'Connect to BESS daemon')
 def daemon_connect(cli, host, port):
     kwargs = {}
@@ -488,6 +555,22 @@ def _do_reset(cli):
     if cli.interactive:
         cli.fout.write('Done.\n')
 
+@cmd('daemon snapshot save SNAPSHOT_FILE',
+        'Save the pipeline to a file, for "daemon snapshot restore"')
+def daemon_snapshot_save(cli, path):
+    r = cli.bess.save_snapshot(os.path.abspath(os.path.expanduser(path)))
+    cli.fout.write('  %d requests (%d bytes) saved\n' % (r.requests, r.bytes))
+    if 'incomplete' in r and r.incomplete:
+        cli.fout.write('  WARNING: the state of these modules is not '
+                'saved: %s\n' % ', '.join(r.incomplete))
+
+@cmd('daemon snapshot restore SNAPSHOT_FILE',
+        'Rebuild the pipeline from a snapshot, on an empty daemon')
+def daemon_snapshot_restore(cli, path):
+    r = cli.bess.restore_snapshot(os.path.abspath(os.path.expanduser(path)))
+    cli.fout.write('  %d requests restored in %.1f ms\n' %
+            (r.requests, r.elapsed_us / 1000.0))
+
 @cmd('daemon reset', 'Remove all ports and modules in the pipeline')
 def daemon_reset(cli):
     if is_pipeline_empty(cli):
@@ -657,6 +740,11 @@ def add_connection(cli, m1, m2, ogate, igate):
     finally:
         cli.bess.resume_all()
 
+@cmd('set module MODULE owner TC', 
+    'Charge the cycles of a module (and downstream) to a traffic class')
+def set_module_owner(cli, module, tc):
+    cli.bess.set_module_tc(module, tc)
+
 @cmd('command module MODULE MODULE_CMD [CMD_ARGS...]', 
         'Send a command to a module')
 def command_module(cli, module, cmd, args):
@@ -682,6 +770,11 @@ def delete_module(cli, module):
     finally:
         cli.bess.resume_all()
 
+@cmd('delete module MODULE owner', 
+    'Charge the cycles of a module to the running traffic class again')
+def delete_module_owner(cli, module):
+    cli.bess.set_module_tc(module, None)
+
 @cmd('delete connection MODULE ogate [OGATE]', 
     'Delete a connection between two modules')
 def delete_connection(cli, module, ogate):
@@ -695,20 +788,33 @@ def delete_connection(cli, module, ogate):
         cli.bess.resume_all()
 
 def _show_worker_header(cli):
-    cli.fout.write('  %10s%10s%10s%10s%16s\n' % \
+    cli.fout.write('  %10s%10s%10s%10s%16s%16s\n' % \
             ('Worker ID', 
              'Status', 
              'CPU core', 
              '# of TCs',
-             'Deadend pkts'))
+             'Deadend pkts',
+             'snb cache hit'))
 
 def _show_worker(cli, w):
-    cli.fout.write('  %10d%10s%10d%10d%16d\n' % \
+    cache = w.snb_cache
+    reqs = cache.allocs + cache.frees
+    misses = cache.refills + cache.spills
+    hit = 100.0 * (reqs - misses) / reqs if reqs else 0.0
+
+    cli.fout.write('  %10d%10s%10d%10d%16d%15.1f%%\n' % \
             (w.wid, 
              'RUNNING' if w.running else 'PAUSED', 
              w.core, 
              w.num_tcs,
-             w.silent_drops))
+             w.silent_drops,
+             hit))
+
+@cmd('delete worker WORKER_ID...',
+        'Remove workers, moving their traffic classes to the others')
+def delete_worker(cli, wids):
+    for wid in wids:
+        cli.bess.remove_worker(wid)
 
 @cmd('show worker', 'Show the status of all worker threads')
 def show_worker_all(cli):
@@ -789,6 +895,155 @@ def _show_tc_list(cli, tcs):
                      _limit_to_str(tc.limit)))
 
             
+@cmd('show mempool', 'Show the usage of packet buffer pools')
+def show_mempool(cli):
+    stats = cli.bess.get_mempool_stats()
+
+    cli.fout.write('  %-20s%8s%8s%10s%10s%10s%10s%10s%10s\n' % \
+            ('Pool', 'Socket', 'Size', 'Total', 'Avail', 'Cached',
+             'In flight', 'Max used', 'Failures'))
+
+    for pool in stats.pools:
+        cli.fout.write('  %-20s%8d%8d%10d%10d%10d%10d%10d%10d\n' % \
+                (pool.name, 
+                 pool.socket, 
+                 pool.buf_size,
+                 pool.size,
+                 pool.available,
+                 pool.worker_cached,
+                 pool.in_flight,
+                 pool.max_in_use,
+                 pool.alloc_fails))
+
+    adm = stats.admission
+    if adm.reserve_pct or adm.watermark_pct:
+        cli.fout.write('\n  Admission: %d%% reserved, short refills above ' \
+                '%d%% in use, for TCs with priority < %d\n' % \
+                (adm.reserve_pct, adm.watermark_pct, adm.min_priority))
+
+        for pool in stats.pools:
+            cli.fout.write('  %-20s denied %-12d short %-12d\n' % \
+                    (pool.name, pool.alloc_denied, pool.alloc_short))
+
+    if not stats.workers:
+        return
+
+    cli.fout.write('\n  %10s%8s%10s%10s%10s\n' % \
+            ('Worker ID', 'Size', 'Cached', 'Capacity', 'Failures'))
+
+    for w in stats.workers:
+        for cache in w.snb_cache:
+            cli.fout.write('  %10d%8d%10d%10d%10d\n' % \
+                    (w.wid, 
+                     cache.buf_size,
+                     cache.cached,
+                     cache.capacity,
+                     cache.alloc_fails))
+
+@cmd('show topology', 'Show the CPUs, memory, and NICs of each socket')
+def show_topology(cli):
+    topo = cli.bess.get_topology()
+
+    cli.fout.write('  %d CPUs, %d sockets\n' % \
+            (topo.num_cpus, len(topo.sockets)))
+
+    for s in topo.sockets:
+        hp = s.hugepages
+        cores = ' '.join([','.join(map(str, c)) for c in s.cores])
+
+        cli.fout.write('\n  Socket %d%s\n' % \
+                (s.socket, '' if s.mempool else ' (no packet mempool)'))
+        cli.fout.write('    Cores:       %s\n' % (cores or '-'))
+        cli.fout.write('    Hugepages:   2MB %d (%d free), ' \
+                '1GB %d (%d free)\n' % \
+                (hp['2m_total'], hp['2m_free'],
+                 hp['1g_total'], hp['1g_free']))
+        cli.fout.write('    Workers:     %s\n' % \
+                (' '.join(map(str, s.workers)) or '-'))
+        cli.fout.write('    NICs:        %s\n' % \
+                (' '.join(['%d(%s)' % (n.port_id, n.pci if 'pci' in n else '-') \
+                 for n in s.nics]) or '-'))
+        cli.fout.write('    Ports:       %s\n' % (' '.join(s.ports) or '-'))
+
+@cmd('auto place [PLACE_OPTS...]',
+    'Put workers and tasks on the sockets of their ports')
+def auto_place(cli, opts):
+    if opts is None:
+        opts = {}
+
+    r = cli.bess.auto_place(**opts)
+    dry_run = opts.get('dry_run')
+
+    for w in r.workers:
+        cli.fout.write('  %s worker %s on core %d (socket %d)\n' % \
+                ('Would add' if dry_run else 'Added',
+                 'new' if w.wid < 0 else str(w.wid), w.core, w.socket))
+
+    for t in r.tasks:
+        cli.fout.write('  %s task %s:%d to worker %s\n' % \
+                ('Would attach' if dry_run else 'Attached',
+                 t.name, t.taskid, 'new' if t.wid < 0 else str(t.wid)))
+
+    for warning in r.warnings:
+        cli.fout.write('  Warning: %s\n' % warning)
+
+@cmd('set mempool admission ADMISSION_OPTS...', 
+    'Reserve packet buffers for high-priority traffic classes')
+def set_mempool_admission(cli, opts):
+    cli.bess.set_mempool_admission(**opts)
+
+# see enum drop_cause in core/worker.h
+DROP_CAUSES = ['deadend', 'no_mbuf', 'tx_full', 'queue_full', 'filter',
+        'invalid']
+
+def _show_latency(cli, reset):
+    probes = cli.bess.get_latency(reset)
+
+    if not probes:
+        raise cli.CommandError('There is no latency probe. ' \
+                'Use "latency enable" first.')
+
+    cli.fout.write('  %-28s%12s%10s%10s%10s%10s%10s%10s\n' % \
+            ('Gate (ns since previous probe)', 'Packets', 'Untagged',
+             'Min', 'Avg', 'P50', 'P99', 'Max'))
+
+    for p in probes:
+        lat = p.latency
+        cli.fout.write('  %-28s%12d%10d%10d%10d%10d%10d%10d\n' % \
+                ('%s:%d -> %s' % (p.name, p.ogate, p.next),
+                 lat.count,
+                 lat.untagged,
+                 lat.min_ns,
+                 lat.avg_ns,
+                 lat.p50_ns,
+                 lat.p99_ns,
+                 lat.max_ns))
+
+@cmd('show latency', 'Show per-hop latencies measured by gate probes')
+def show_latency(cli):
+    _show_latency(cli, False)
+
+@cmd('show latency reset', 'Show per-hop latencies, and clear them')
+def show_latency_reset(cli):
+    _show_latency(cli, True)
+
+@cmd('show drop', 'Show dropped packets by cause, in total and by module')
+def show_drop(cli):
+    stats = cli.bess.get_drop_stats()
+
+    cli.fout.write('  %-20s' % '' +
+            ''.join('%12s' % cause for cause in DROP_CAUSES) + '\n')
+
+    def write_row(name, drops):
+        cli.fout.write('  %-20s' % name +
+                ''.join('%12d' % drops[cause] for cause in DROP_CAUSES) +
+                '\n')
+
+    write_row('Total', stats.total)
+
+    for name in sorted(stats.modules):
+        write_row(name, stats.modules[name])
+
 @cmd('show tc', 'Show the list of traffic classes')
 def show_tc_all(cli):
     _show_tc_list(cli, cli.bess.list_tcs())
@@ -972,6 +1227,16 @@ def _show_module(cli, module_name):
     else:
         cli.fout.write('\n')
 
+    if 'variant' in info:
+        cli.fout.write('    Variant: %s\n' % info.variant)
+
+    if 'mem' in info:
+        cli.fout.write('    Memory: %d bytes (private %d, per-worker %d)\n' %
+                (info.mem.total, info.mem.priv, info.mem.priv_worker))
+
+    if 'owner_tc' in info:
+        cli.fout.write('    Cycles charged to: %s\n' % info.owner_tc)
+
     if info.igates:
         cli.fout.write('    Input gates:\n')
         for gate in info.igates:
@@ -1006,6 +1271,27 @@ def show_module_all(cli):
     for module in modules:
         _show_module(cli, module.name)
 
+@cmd('show module perf', 'Show sampled cycles/packet of all modules')
+def show_module_perf(cli):
+    modules = cli.bess.list_modules()
+
+    if not modules:
+        raise cli.CommandError('There is no active module to show.')
+
+    infos = [cli.bess.get_module_info(m.name) for m in modules]
+    total_cycles = sum(info.perf.cycles for info in infos)
+
+    cli.fout.write('  %-16s %-16s %10s %12s %12s %8s\n' % \
+            ('Module', 'Class', 'Samples', 'Cycles/pkt', 'Cycles/call',
+             'Share'))
+
+    for info in sorted(infos, key=lambda i: i.perf.cycles, reverse=True):
+        perf = info.perf
+        share = 100.0 * perf.cycles / total_cycles if total_cycles else 0.0
+        cli.fout.write('  %-16s %-16s %10d %12.1f %12.1f %7.1f%%\n' % \
+                (info.name, info.mclass, perf.samples,
+                 perf.cycles_per_packet, perf.cycles_per_call, share))
+
 @cmd('show module MODULE...', 'Show the status of specified modules')
 def show_module_list(cli, module_names):
     for module_name in module_names:
@@ -1033,6 +1319,9 @@ def show_mclass_list(cli, cls_names):
         _show_mclass(cli, cls_name)
 
 def _monitor_pipeline(cli, field):
+    # gate counters are off by default
+    cli.bess.track_gate(True)
+
     modules = sorted(cli.bess.list_modules())
    
     last_stats = {}
@@ -1245,53 +1534,421 @@ def monitor_tc_all(cli):
 def monitor_tc_all(cli, tcs):
     _monitor_tcs(cli, *tcs)
 
-# tcpdump can write pcap files, so we don't need to support it separately
-@cmd('tcpdump MODULE [OGATE] [TCPDUMP_OPTS...]', 'Capture packets on a gate')
-def tcpdump_module(cli, module_name, ogate, opts):
+# see struct dump_ring in core/utils/pcap.h
+DUMP_RING_MAGIC = 0x504d5544
+DUMP_RING_SLOTS_OFF = 192
+DUMP_RING_DEF_SNAPLEN = 2048
+
+# returns the next position
+def _drain_dump_ring(ring, pos, out):
+    num_slots, slot_size = struct.unpack_from('=II', ring, 8)
+
+    while True:
+        off = DUMP_RING_SLOTS_OFF + (pos & (num_slots - 1)) * slot_size
+        seq, = struct.unpack_from('=Q', ring, off)
+        if seq != pos + 1:
+            break
+
+        # struct pcap_rec_hdr and the data are contiguous
+        incl_len, = struct.unpack_from('=I', ring, off + 16)
+        out.write(ring[off + 8:off + 24 + incl_len])
+
+        struct.pack_into('=Q', ring, off, pos + num_slots)
+        pos += 1
+
+    return pos
+
+def _tcpdump_snaplen(opts):
+    for i, opt in enumerate(opts):
+        try:
+            if opt == '-s' and i + 1 < len(opts):
+                return int(opts[i + 1]) or 65535
+            if opt.startswith('-s') and len(opt) > 2:
+                return int(opt[2:]) or 65535
+        except ValueError:
+            pass
+
+    return DUMP_RING_DEF_SNAPLEN
+
+# Packets are copied by workers into a shared-memory ring, which is drained
+# here and fed into tcpdump. A slow tcpdump only causes overflows.
+def _tcpdump(cli, module_name, ogate, sample, opts):
     if ogate is None:
         ogate = 0
 
     if opts is None:
         opts = []
 
-    fifo = tempfile.mktemp()
-    os.mkfifo(fifo, 0600)   # random people should not see packets...
+    # -s is applied by BESS, while capturing
+    snaplen = min(_tcpdump_snaplen(opts), 65535)
 
-    fd = os.open(fifo, os.O_RDWR)
+    # random people should not see packets... (created with 0600)
+    ring_path = tempfile.mktemp(prefix='bess_tcpdump_', dir='/dev/shm')
 
     tcpdump_cmd = ['tcpdump']
-    tcpdump_cmd.extend(['-r', fifo])
+    tcpdump_cmd.extend(['-r', '-'])
     tcpdump_cmd.extend(opts)
     tcpdump_cmd = ' '.join(tcpdump_cmd)
 
     cli.fout.write('  Running: %s\n' % tcpdump_cmd)
-    proc = subprocess.Popen(tcpdump_cmd, shell=True, preexec_fn = os.setsid)
+    proc = subprocess.Popen(tcpdump_cmd, shell=True, stdin=subprocess.PIPE,
+            preexec_fn = os.setsid)
 
     cli.bess.pause_all()
     try:
-        cli.bess.enable_tcpdump(fifo, module_name, ogate)
+        cli.bess.enable_tcpdump_ring(ring_path, module_name, ogate, 
+                snaplen=snaplen, sample=sample)
+    except:
+        os.killpg(proc.pid, signal.SIGTERM)
+        raise
     finally:
         cli.bess.resume_all()
 
+    ring = None
+    overflows = 0
+    pos = 0
+
     try:
-        proc.wait()
+        f = open(ring_path, 'r+b')
+        ring = mmap.mmap(f.fileno(), 0)
+        f.close()
+
+        # struct pcap_hdr
+        proc.stdin.write(struct.pack('=IHHiIII', 0xa1b2c3d4, 2, 4, 0, 0, 
+                snaplen, 1))
+
+        while proc.poll() is None:
+            new_pos = _drain_dump_ring(ring, pos, proc.stdin)
+            if new_pos == pos:
+                proc.stdin.flush()
+                time.sleep(0.001)
+            pos = new_pos
     except KeyboardInterrupt:
-        # kill all descendants in the process group
-        os.killpg(proc.pid, signal.SIGTERM)
+        pass
+    except IOError:
+        # tcpdump went away
+        pass
     finally:
+        # kill all descendants in the process group
+        try:
+            os.killpg(proc.pid, signal.SIGTERM)
+        except OSError:
+            pass
+
         cli.bess.pause_all()
         try:
             cli.bess.disable_tcpdump(module_name, ogate)
         finally:
             cli.bess.resume_all()
 
+        if ring is not None:
+            overflows, = struct.unpack_from('=Q', ring, 64)
+            ring.close()
+
         try:
-            os.close(fd)
-            os.unlink(fifo)
+            os.unlink(ring_path)
             os.system('stty sane')  # more/less may have screwed the terminal
         except:
             pass
 
+    cli.fout.write('  %d packets captured, %d dropped by ring overflow\n' % 
+            (pos, overflows))
+
+# tcpdump can write pcap files, so we don't need to support it separately
+@cmd('tcpdump MODULE [OGATE] [TCPDUMP_OPTS...]', 'Capture packets on a gate')
+def tcpdump_module(cli, module_name, ogate, opts):
+    _tcpdump(cli, module_name, ogate, 1, opts)
+
+@cmd('tcpdump MODULE OGATE sample SAMPLE_RATE [TCPDUMP_OPTS...]', 
+        'Capture 1 out of every SAMPLE_RATE packets on a gate')
+def tcpdump_module_sample(cli, module_name, ogate, sample, opts):
+    _tcpdump(cli, module_name, ogate, sample, opts)
+
+# see enum trace_type in core/trace.h
+TRACE_TASK, TRACE_TASK_END, TRACE_CALL, TRACE_RETURN = range(4)
+
+def _show_trace_worker(cli, w, modules, tsc_hz):
+    n = len(w.tsc)
+    ends = [None] * n
+    stack = []
+
+    # match each TASK/CALL with its end, for the elapsed time
+    for i in range(n):
+        if w.type[i] in [TRACE_TASK, TRACE_CALL]:
+            stack.append(i)
+        elif stack:
+            ends[stack.pop()] = i
+
+    def us(tsc):
+        return tsc * 1e6 / tsc_hz
+
+    def name(idx):
+        return modules[idx] if idx >= 0 else '<destroyed>'
+
+    cli.fout.write('  Worker %d: %d events' % (w.wid, n))
+    if w.lost:
+        cli.fout.write(' (%d older ones overwritten)' % w.lost)
+    cli.fout.write('\n')
+
+    for i in range(n):
+        t = w.type[i]
+        end = ends[i]
+        elapsed = '%.3fus' % us(w.tsc[end] - w.tsc[i]) if end else '-'
+
+        if t == TRACE_TASK:
+            pkts = w.cnt[end] if end else 0
+            cli.fout.write('  %12.3f  %s [task] %d pkts, %s\n' % \
+                    (us(w.tsc[i]), name(w.module[i]), pkts, elapsed))
+        elif t == TRACE_CALL:
+            cli.fout.write('  %12.3f  %s--(%d)--> %s:%d, %s\n' % \
+                    (us(w.tsc[i]), '    ' * w.depth[i], w.cnt[i],
+                     name(w.module[i]), w.gate[i], elapsed))
+
+@cmd('trace [DURATION_US]',
+        'Record the packet path on all workers and show it as a timeline')
+def trace(cli, duration_us):
+    if duration_us is None:
+        duration_us = 1000
+
+    cli.bess.start_trace(duration_us)
+    time.sleep(duration_us / 1e6 + 0.1)
+    r = cli.bess.get_trace()
+
+    cli.fout.write('  Time (us) since the start, with the elapsed time of '
+            'each task run and module call\n')
+
+    for w in r.workers:
+        _show_trace_worker(cli, w, r.modules, r.tsc_hz)
+
+PERFTEST_DIR = 'perftest'
+
+# metrics of a scenario, {'ports': {name: {metric: val}}, 'tcs': ..., ...}.
+# Rates are over the measurement period, latencies are since its start
+def _perftest_measure(cli, duration):
+    def port_counters():
+        ret = {}
+        for p in cli.bess.list_ports():
+            st = cli.bess.get_port_stats(p.name)
+            ret[p.name] = (st.timestamp,
+                    st.inc.packets, st.inc.bytes, st.inc.dropped,
+                    st.out.packets, st.out.bytes, st.out.dropped)
+        return ret
+
+    def tc_counters():
+        ret = {}
+        for c in cli.bess.list_tcs():
+            st = cli.bess.get_tc_stats(c.name)
+            ret[c.name] = (st.timestamp, st.count, st.cycles, st.packets)
+        return ret
+
+    measures = [m.name for m in cli.bess.list_modules() \
+            if m.mclass == 'Measure']
+
+    # Measure commands need the workers paused
+    if measures:
+        cli.bess.pause_all()
+        try:
+            for m in measures:
+                cli.bess.run_module_command(m, 'clear', None)
+        finally:
+            cli.bess.resume_all()
+
+    ports_old = port_counters()
+    tcs_old = tc_counters()
+    time.sleep(duration)
+    ports_new = port_counters()
+    tcs_new = tc_counters()
+
+    result = {'ports': {}, 'tcs': {}, 'latency': {}}
+
+    for name, new in ports_new.iteritems():
+        if name not in ports_old:
+            continue
+        old = ports_old[name]
+        sec = new[0] - old[0]
+        d = [float(new[i] - old[i]) / sec for i in range(1, 7)]
+        result['ports'][name] = {
+                'inc_mpps': d[0] / 1e6,
+                'inc_gbps': (d[1] + d[0] * 24) * 8 / 1e9,
+                'inc_dropped_pps': d[2],
+                'out_mpps': d[3] / 1e6,
+                'out_gbps': (d[4] + d[3] * 24) * 8 / 1e9,
+                'out_dropped_pps': d[5],
+            }
+
+    for name, new in tcs_new.iteritems():
+        if name not in tcs_old:
+            continue
+        old = tcs_old[name]
+        sec = new[0] - old[0]
+        cnt, cycles, pkts = [new[i] - old[i] for i in range(1, 4)]
+        result['tcs'][name] = {
+                'mpps': pkts / sec / 1e6,
+                'cycles_per_packet': float(cycles) / pkts if pkts else 0,
+            }
+
+    if measures:
+        cli.bess.pause_all()
+        try:
+            for m in measures:
+                lat = cli.bess.run_module_command(m, 'get_summary', 
+                        None).latency
+                result['latency'][m] = {k: lat[k] for k in \
+                        ['avg_ns', 'p50_ns', 'p99_ns', 'p999_ns', 'max_ns']}
+        finally:
+            cli.bess.resume_all()
+
+    return result
+
+# larger is better for them. The others (latency, drops, and cycles) are costs
+def _perftest_higher_is_better(metric):
+    return metric.endswith('_mpps') or metric.endswith('_gbps') or \
+            metric == 'mpps'
+
+# [(conf, group, name, metric, base, new, regressed)]
+def _perftest_compare(base, new, tolerance):
+    ret = []
+
+    for conf, scenario in sorted(new.iteritems()):
+        if conf not in base:
+            continue
+
+        for group in ['ports', 'tcs', 'latency']:
+            for name, metrics in sorted(scenario.get(group, {}).iteritems()):
+                base_metrics = base[conf].get(group, {}).get(name)
+                if base_metrics is None:
+                    continue
+
+                for metric, val in sorted(metrics.iteritems()):
+                    if metric not in base_metrics:
+                        continue
+
+                    old = base_metrics[metric]
+                    if _perftest_higher_is_better(metric):
+                        regressed = val < old * (1 - tolerance)
+                    else:
+                        # not for noise around 0 (e.g., a few drops)
+                        regressed = val > old * (1 + tolerance) and \
+                                val - old > 1
+                    ret.append((conf, group, name, metric, old, val,
+                        regressed))
+
+    return ret
+
+@cmd('perftest RESULT_FILE [PERFTEST_OPTS...]',
+        'Run "conf/perftest" scenarios, save the results, ' \
+        'and compare them with a baseline')
+def perftest(cli, result_file, opts):
+    if opts is None:
+        opts = {}
+
+    confs = opts.get('confs')
+    if confs is None:
+        confs = sorted([os.path.splitext(f)[0] for f in \
+                os.listdir('%s/conf/%s' % (cli.this_dir, PERFTEST_DIR)) \
+                if f.endswith('.' + CONF_EXT)])
+
+    env = opts.get('env', {})
+    warmup = float(opts.get('warmup', 2))
+    duration = float(opts.get('duration', 10))
+    tolerance = float(opts.get('tolerance', 0.05))
+
+    results = {}
+
+    for conf in confs:
+        cli.fout.write('Running %s/%s (%.1fs warmup, %.1fs)...\n' %
+                (PERFTEST_DIR, conf, warmup, duration))
+
+        conf_file = '%s/conf/%s/%s.%s' % \
+                (cli.this_dir, PERFTEST_DIR, conf, CONF_EXT)
+
+        try:
+            if not is_pipeline_empty(cli):
+                _clear_pipeline(cli)
+                cli.bess.resume_all()
+
+            _run_file(cli, conf_file, env)
+
+            if is_pipeline_empty(cli):
+                cli.err('%s: nothing is running, skipped' % conf)
+                continue
+
+            time.sleep(warmup)
+            results[conf] = _perftest_measure(cli, duration)
+        except cli.bess.Error as e:
+            cli.err('%s: %s, skipped' % (conf, e.errmsg))
+        finally:
+            _clear_pipeline(cli)
+            cli.bess.resume_all()
+
+    output = {'timestamp': time.time(), 'warmup': warmup,
+            'duration': duration, 'env': env, 'scenarios': results}
+
+    with open(os.path.expanduser(result_file), 'w') as f:
+        json.dump(output, f, indent=2, sort_keys=True)
+
+    cli.fout.write('Results of %d scenarios saved to %s\n' %
+            (len(results), result_file))
+
+    if 'baseline' not in opts:
+        return
+
+    with open(os.path.expanduser(opts['baseline'])) as f:
+        base = json.load(f)['scenarios']
+
+    diffs = _perftest_compare(base, results, tolerance)
+    num_regressed = 0
+
+    cli.fout.write('\n  %-40s %12s %12s %8s\n' %
+            ('conf/group/name/metric', 'baseline', 'new', 'change'))
+
+    for conf, group, name, metric, old, val, regressed in diffs:
+        change = '%+.1f%%' % ((val - old) * 100.0 / old) if old else '-'
+        cli.fout.write('  %-40s %12.3f %12.3f %8s%s\n' %
+                ('/'.join([conf, group, name, metric]), old, val, change,
+                 '  REGRESSION' if regressed else ''))
+        if regressed:
+            num_regressed += 1
+
+    cli.fout.write('\n%d of %d metrics regressed by more than %.1f%%\n' %
+            (num_regressed, len(diffs), tolerance * 100))
+
+    if num_regressed:
+        cli.err('Performance regression against %s' % opts['baseline'])
+
+def _show_bench(cli, r):
+    cli.fout.write('  %-16s %10.1f %10.2f %10.2f %10.1f\n' %
+            (r.mclass, r.cycles_per_batch, r.cycles_per_packet,
+             r.ns_per_packet, r.base_cycles / float(r.batches)))
+
+def _show_bench_header(cli):
+    cli.fout.write('  %-16s %10s %10s %10s %10s\n' %
+            ('mclass', 'cyc/batch', 'cyc/pkt', 'ns/pkt', 'sink/batch'))
+
+@cmd('bench module MCLASS [MODULE_ARGS...]',
+        'Measure the cost of a module class with synthetic batches')
+def bench_module(cli, mclass, args):
+    r = cli.bess.bench_module(mclass, args)
+
+    cli.fout.write('  %d batches of %d packets on worker %d\n' %
+            (r.batches, r.packets / r.batches, r.wid))
+    _show_bench_header(cli)
+    _show_bench(cli, r)
+
+@cmd('bench modules',
+        'Measure the cost of all module classes, with no arguments')
+def bench_modules(cli):
+    _show_bench_header(cli)
+
+    for mclass in cli.bess.list_mclasses():
+        try:
+            r = cli.bess.bench_module(mclass)
+        except cli.bess.Error as e:
+            cli.fout.write('  %-16s (skipped: %s)\n' % (mclass, e.errmsg))
+            continue
+
+        _show_bench(cli, r)
+
 @cmd('interactive', 'Switch to interactive mode')
 def interactive(cli):
    cli.fin = sys.stdin
@@ -27,6 +27,9 @@ extern const struct global_opts {
 	int mb_per_socket;	/* MB per CPU socket for DPDK (0=default) */
 	char * pidfile;		/* Filename (nullptr=default; nullstr=none) */
 	int multi_instance;	/* If 1, allow multiple BESS instances */
+	int steal_idle_rounds;	/* Steal work after N idle rounds (0=never) */
+	int idle_sleep_us;	/* Sleep after idle for N us (0=always poll) */
+	int task_backoff_us;	/* Max poll backoff of idle tasks (0=none) */
 } global_opts;
 
 /* The term RX/TX could be very confusing for a virtual switch.
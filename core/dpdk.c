@@ -16,6 +16,7 @@
 #include "worker.h"
 #include "snstore.h"
 #include "dpdk.h"
+#include "topology.h"
 
 static void set_lcore_bitmap(char *buf)
 {
@@ -192,4 +193,7 @@ void init_dpdk(char *prog_name, int mb_per_socket, int multi_instance)
 	init_snstore();
 
 	announce_cpumask();
+
+	init_topology();
+	log_topology();
 }
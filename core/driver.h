@@ -36,6 +36,10 @@ struct driver {
 	/* Optional: the size of per-port private data, if any. 0 by default */
 	size_t priv_size;
 
+	/* Optional: alignment of the private data (a power of 2). 
+	 * A cache line if 0 */
+	size_t priv_align;
+
 	/* Optional. In number of packets */
 	size_t def_size_inc_q;
 	size_t def_size_out_q;
@@ -55,6 +59,10 @@ struct driver {
 	/* Optional: collect internal (HW) stats, if available */
 	void (*collect_stats)(struct port *p, int reset);
 
+	/* Optional: driver-specific stats (e.g., per queue), 
+	 * reported by get_port_stats */
+	struct snobj *(*driver_stats)(struct port *p);
+
 	/* Optional: port-specific query interface */
 	struct snobj *(*query)(struct port *p, struct snobj *q);
 	
@@ -0,0 +1,496 @@
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <linux/if.h>
+#include <arpa/inet.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+
+#include "../port.h"
+
+/* Kernel network devices through AF_PACKET (TPACKET_V3) mmap rings,
+ * for NICs without a DPDK PMD.
+ *
+ * Each queue has its own socket. RX sockets join a fanout group
+ * (PACKET_FANOUT_HASH), so that flows are spread across inc queues.
+ * RX is done without any syscall: the datapath polls the block status
+ * words of the ring, and copies packets into snbufs. TX copies packets
+ * into the ring frames, and kicks the kernel with one sendto() per batch.
+ * TX rings with TPACKET_V3 need Linux 4.11 or later. */
+
+#define AFP_DEF_BLOCK_KB	256
+#define AFP_DEF_RX_BLOCKS	32
+#define AFP_DEF_TX_FRAMES	1024
+#define AFP_DEF_RX_TIMEOUT_MS	1
+
+#define AFP_FRAME_SIZE		2048	/* TX slot, including the header */
+#define AFP_TX_BLOCK_SIZE	(AFP_FRAME_SIZE * 32)
+
+/* where the kernel expects TX frame data */
+#define AFP_TX_DATA_OFF		TPACKET_ALIGN(sizeof(struct tpacket3_hdr))
+#define AFP_TX_MAX_LEN		(AFP_FRAME_SIZE - AFP_TX_DATA_OFF)
+
+struct afp_queue {
+	int fd;
+
+	uint8_t *map;
+	size_t map_len;
+
+	/* RX (NULL ring if not an inc queue) */
+	uint8_t *rx_ring;
+	uint32_t rx_block_size;
+	uint32_t rx_num_blocks;
+	uint32_t rx_blk;		/* current block */
+	uint32_t rx_left;		/* packets left in the current block */
+	struct tpacket3_hdr *rx_next;	/* valid if rx_left > 0 */
+	uint64_t rx_oversized;
+
+	/* TX (NULL ring if not an out queue) */
+	uint8_t *tx_ring;
+	uint32_t tx_num_frames;
+	uint32_t tx_frame;		/* next frame to fill */
+} __rte_cache_aligned;
+
+struct afp_priv {
+	char ifname[IFNAMSIZ];
+	int ifindex;
+	int num_sockets;
+
+	uint64_t rx_drops;		/* accumulated PACKET_STATISTICS */
+
+	struct afp_queue q[MAX_QUEUES_PER_DIR];
+};
+
+static int afp_init_driver(struct driver *driver)
+{
+	return 0;
+}
+
+static void close_queue(struct afp_queue *q)
+{
+	if (q->map)
+		munmap(q->map, q->map_len);
+
+	if (q->fd >= 0)
+		close(q->fd);
+
+	q->map = NULL;
+	q->fd = -1;
+}
+
+static struct snobj *setup_queue(struct afp_priv *priv, struct afp_queue *q,
+		int rx, int tx, uint32_t block_size, uint32_t rx_blocks,
+		uint32_t tx_frames, uint32_t rx_timeout_ms, int fanout_id)
+{
+	struct tpacket_req3 rx_req = {0};
+	struct tpacket_req3 tx_req = {0};
+	struct sockaddr_ll sll = {0};
+	int ver = TPACKET_V3;
+	int one = 1;
+	int ret;
+
+	/* A socket with protocol 0 does not receive anything.
+	 * TX-only sockets would otherwise queue a clone of every packet. */
+	q->fd = socket(AF_PACKET, SOCK_RAW, rx ? htons(ETH_P_ALL) : 0);
+	if (q->fd < 0)
+		return snobj_err(errno, "socket(AF_PACKET) failed: %s",
+				strerror(errno));
+
+	ret = setsockopt(q->fd, SOL_PACKET, PACKET_VERSION, &ver, sizeof(ver));
+	if (ret < 0)
+		return snobj_err(errno, "TPACKET_V3 is not supported: %s",
+				strerror(errno));
+
+	if (rx) {
+		rx_req.tp_block_size = block_size;
+		rx_req.tp_block_nr = rx_blocks;
+		rx_req.tp_frame_size = AFP_FRAME_SIZE;
+		rx_req.tp_frame_nr = (block_size / AFP_FRAME_SIZE) * rx_blocks;
+		rx_req.tp_retire_blk_tov = rx_timeout_ms;
+
+		ret = setsockopt(q->fd, SOL_PACKET, PACKET_RX_RING,
+				&rx_req, sizeof(rx_req));
+		if (ret < 0)
+			return snobj_err(errno, "PACKET_RX_RING failed: %s",
+					strerror(errno));
+
+#ifdef PACKET_IGNORE_OUTGOING
+		/* do not loop back what we (or the host) send */
+		setsockopt(q->fd, SOL_PACKET, PACKET_IGNORE_OUTGOING,
+				&one, sizeof(one));
+#endif
+	}
+
+	if (tx) {
+		tx_req.tp_block_size = AFP_TX_BLOCK_SIZE;
+		tx_req.tp_frame_size = AFP_FRAME_SIZE;
+		tx_req.tp_block_nr = (tx_frames * AFP_FRAME_SIZE +
+				AFP_TX_BLOCK_SIZE - 1) / AFP_TX_BLOCK_SIZE;
+		tx_req.tp_frame_nr = tx_req.tp_block_nr *
+			(AFP_TX_BLOCK_SIZE / AFP_FRAME_SIZE);
+
+		ret = setsockopt(q->fd, SOL_PACKET, PACKET_TX_RING,
+				&tx_req, sizeof(tx_req));
+		if (ret < 0)
+			return snobj_err(errno, "PACKET_TX_RING failed "
+					"(Linux 4.11+ is required): %s",
+					strerror(errno));
+
+#ifdef PACKET_QDISC_BYPASS
+		setsockopt(q->fd, SOL_PACKET, PACKET_QDISC_BYPASS,
+				&one, sizeof(one));
+#endif
+	}
+
+	/* the RX ring comes first, then the TX ring */
+	q->map_len = (size_t)rx_req.tp_block_size * rx_req.tp_block_nr +
+		(size_t)tx_req.tp_block_size * tx_req.tp_block_nr;
+
+	q->map = mmap(NULL, q->map_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_LOCKED | MAP_POPULATE, q->fd, 0);
+	if (q->map == MAP_FAILED) {
+		q->map = NULL;
+		return snobj_err(errno, "mmap() failed: %s", strerror(errno));
+	}
+
+	if (rx) {
+		q->rx_ring = q->map;
+		q->rx_block_size = rx_req.tp_block_size;
+		q->rx_num_blocks = rx_req.tp_block_nr;
+	}
+
+	if (tx) {
+		q->tx_ring = q->map +
+			(size_t)rx_req.tp_block_size * rx_req.tp_block_nr;
+		q->tx_num_frames = tx_req.tp_frame_nr;
+	}
+
+	sll.sll_family = AF_PACKET;
+	sll.sll_protocol = rx ? htons(ETH_P_ALL) : 0;
+	sll.sll_ifindex = priv->ifindex;
+
+	ret = bind(q->fd, (struct sockaddr *)&sll, sizeof(sll));
+	if (ret < 0)
+		return snobj_err(errno, "bind() to %s failed: %s",
+				priv->ifname, strerror(errno));
+
+	if (rx && fanout_id >= 0) {
+		int arg = fanout_id | (PACKET_FANOUT_HASH << 16);
+
+		ret = setsockopt(q->fd, SOL_PACKET, PACKET_FANOUT,
+				&arg, sizeof(arg));
+		if (ret < 0)
+			return snobj_err(errno, "PACKET_FANOUT failed: %s",
+					strerror(errno));
+	}
+
+	return NULL;
+}
+
+static void afp_deinit_port(struct port *p)
+{
+	struct afp_priv *priv = get_port_priv(p);
+
+	for (int i = 0; i < priv->num_sockets; i++)
+		close_queue(&priv->q[i]);
+
+	priv->num_sockets = 0;
+}
+
+static struct snobj *afp_init_port(struct port *p, struct snobj *conf)
+{
+	struct afp_priv *priv = get_port_priv(p);
+
+	int num_rxq = p->num_queues[PACKET_DIR_INC];
+	int num_txq = p->num_queues[PACKET_DIR_OUT];
+
+	uint32_t block_size = AFP_DEF_BLOCK_KB * 1024;
+	uint32_t rx_blocks = AFP_DEF_RX_BLOCKS;
+	uint32_t tx_frames = AFP_DEF_TX_FRAMES;
+	uint32_t rx_timeout_ms = AFP_DEF_RX_TIMEOUT_MS;
+	int promisc = 1;
+	int fanout_id = -1;
+
+	const char *ifname = snobj_eval_str(conf, "ifname");
+	struct ifreq ifr;
+	struct snobj *err;
+	int fd;
+
+	if (!ifname || strlen(ifname) >= IFNAMSIZ)
+		return snobj_err(EINVAL, "'ifname' must be given");
+
+	strcpy(priv->ifname, ifname);
+
+	/* net/if.h (if_nametoindex()) does not mix with sn_common.h */
+	fd = socket(AF_PACKET, SOCK_RAW, 0);
+	if (fd < 0)
+		return snobj_err(errno, "socket(AF_PACKET) failed: %s",
+				strerror(errno));
+
+	memset(&ifr, 0, sizeof(ifr));
+	strcpy(ifr.ifr_name, ifname);
+	if (ioctl(fd, SIOCGIFINDEX, &ifr) < 0) {
+		close(fd);
+		return snobj_err(ENODEV, "Interface %s not found", ifname);
+	}
+	priv->ifindex = ifr.ifr_ifindex;
+
+	/* the MAC address of the interface, for get_port_desc */
+	if (ioctl(fd, SIOCGIFHWADDR, &ifr) == 0)
+		memcpy(p->mac_addr, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+
+	close(fd);
+
+	if (snobj_eval_exists(conf, "block_kb"))
+		block_size = snobj_eval_uint(conf, "block_kb") * 1024;
+
+	if (snobj_eval_exists(conf, "rx_blocks"))
+		rx_blocks = snobj_eval_uint(conf, "rx_blocks");
+
+	if (snobj_eval_exists(conf, "tx_frames"))
+		tx_frames = snobj_eval_uint(conf, "tx_frames");
+
+	if (snobj_eval_exists(conf, "rx_timeout_ms"))
+		rx_timeout_ms = snobj_eval_uint(conf, "rx_timeout_ms");
+
+	if (snobj_eval_exists(conf, "promisc"))
+		promisc = snobj_eval_int(conf, "promisc");
+
+	/* must be a multiple of the page size, and of AFP_FRAME_SIZE */
+	if (block_size < 4096 || block_size > (1 << 30) ||
+			(block_size & (block_size - 1)))
+		return snobj_err(EINVAL, "'block_kb' must be a power of 2, "
+				"4-1048576");
+
+	if (rx_blocks < 2 || tx_frames < 32 || rx_timeout_ms < 1)
+		return snobj_err(EINVAL, "Invalid ring configuration");
+
+	if (num_rxq > 1)
+		fanout_id = (getpid() ^ priv->ifindex ^
+				(uintptr_t)p) & 0xffff;
+
+	priv->num_sockets = RTE_MAX(num_rxq, num_txq);
+
+	for (int i = 0; i < priv->num_sockets; i++)
+		priv->q[i].fd = -1;
+
+	for (int i = 0; i < priv->num_sockets; i++) {
+		err = setup_queue(priv, &priv->q[i], i < num_rxq, i < num_txq,
+				block_size, rx_blocks, tx_frames,
+				rx_timeout_ms, fanout_id);
+		if (err) {
+			afp_deinit_port(p);
+			return err;
+		}
+	}
+
+	fd = priv->num_sockets > 0 ? priv->q[0].fd : -1;
+
+	if (promisc && fd >= 0) {
+		struct packet_mreq mreq = {
+			.mr_ifindex = priv->ifindex,
+			.mr_type = PACKET_MR_PROMISC,
+		};
+
+		/* dropped automatically, when the socket is closed */
+		if (setsockopt(fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP,
+					&mreq, sizeof(mreq)) < 0)
+			log_warn("AF_PACKET: cannot set %s promiscuous: %s\n",
+					ifname, strerror(errno));
+	}
+
+	log_info("AF_PACKET: %s with %d inc and %d out queues\n",
+			ifname, num_rxq, num_txq);
+
+	return NULL;
+}
+
+static void afp_collect_stats(struct port *p, int reset)
+{
+	struct afp_priv *priv = get_port_priv(p);
+
+	/* the kernel counters are cleared on every read */
+	for (int i = 0; i < p->num_queues[PACKET_DIR_INC]; i++) {
+		struct tpacket_stats_v3 st;
+		socklen_t len = sizeof(st);
+
+		if (getsockopt(priv->q[i].fd, SOL_PACKET, PACKET_STATISTICS,
+					&st, &len) == 0)
+			priv->rx_drops += st.tp_drops;
+	}
+
+	if (reset) {
+		priv->rx_drops = 0;
+		return;
+	}
+
+	p->port_stats[PACKET_DIR_INC].dropped = priv->rx_drops;
+}
+
+static inline struct tpacket_block_desc *rx_block(struct afp_queue *q)
+{
+	return (struct tpacket_block_desc *)(q->rx_ring +
+			(size_t)q->rx_blk * q->rx_block_size);
+}
+
+/* the kernel strips the VLAN tag into the header. Put it back. */
+static inline void copy_rx_pkt(struct snbuf *snb,
+		const struct tpacket3_hdr *h)
+{
+	const char *data = (const char *)h + h->tp_mac;
+	uint32_t len = h->tp_snaplen;
+	char *dst;
+
+	if (unlikely(h->tp_status & TP_STATUS_VLAN_VALID) && len >= 12) {
+		uint16_t tpid = (h->tp_status & TP_STATUS_VLAN_TPID_VALID) ?
+			h->hv1.tp_vlan_tpid : ETH_P_8021Q;
+		uint16_t tag[2] = {htons(tpid), htons(h->hv1.tp_vlan_tci)};
+
+		dst = snb_append(snb, len + sizeof(tag));
+		rte_memcpy(dst, data, 12);
+		rte_memcpy(dst + 12, tag, sizeof(tag));
+		rte_memcpy(dst + 12 + sizeof(tag), data + 12, len - 12);
+		return;
+	}
+
+	dst = snb_append(snb, len);
+	rte_memcpy(dst, data, len);
+}
+
+static int afp_recv_pkts(struct port *p, queue_t qid, snb_array_t pkts, int cnt)
+{
+	struct afp_priv *priv = get_port_priv(p);
+	struct afp_queue *q = &priv->q[qid];
+	int received = 0;
+
+	while (received < cnt) {
+		struct tpacket_block_desc *bd = rx_block(q);
+		int base;
+		int n;
+
+		if (q->rx_left == 0) {
+			if (!(bd->hdr.bh1.block_status & TP_STATUS_USER))
+				break;
+
+			/* read the block after its status */
+			rte_rmb();
+
+			q->rx_left = bd->hdr.bh1.num_pkts;
+			q->rx_next = (struct tpacket3_hdr *)((uint8_t *)bd +
+					bd->hdr.bh1.offset_to_first_pkt);
+		}
+
+		base = received;
+		n = RTE_MIN((uint32_t)(cnt - received), q->rx_left);
+
+		if (n > 0 && !snb_alloc_bulk(pkts + base, n, 0))
+			break;
+
+		for (int i = 0; i < n; i++) {
+			struct tpacket3_hdr *h = q->rx_next;
+			struct snbuf *snb = pkts[base + i];
+
+			snb->mbuf.pkt_len = snb->mbuf.data_len = 0;
+
+			if (likely(h->tp_snaplen + 4 <= SNBUF_DATA)) {
+				copy_rx_pkt(snb, h);
+				pkts[received++] = snb;
+			} else {
+				snb_free(snb);
+				q->rx_oversized++;
+			}
+
+			q->rx_next = (struct tpacket3_hdr *)((uint8_t *)h +
+					h->tp_next_offset);
+			q->rx_left--;
+		}
+
+		if (q->rx_left == 0) {
+			/* give the block back to the kernel */
+			rte_wmb();
+			bd->hdr.bh1.block_status = TP_STATUS_KERNEL;
+			q->rx_blk = (q->rx_blk + 1) % q->rx_num_blocks;
+		}
+	}
+
+	return received;
+}
+
+static int afp_send_pkts(struct port *p, queue_t qid, snb_array_t pkts, int cnt)
+{
+	struct afp_priv *priv = get_port_priv(p);
+	struct afp_queue *q = &priv->q[qid];
+	int sent = 0;
+
+	for (; sent < cnt; sent++) {
+		struct snbuf *snb = pkts[sent];
+		struct tpacket3_hdr *h;
+		struct rte_mbuf *seg;
+		uint8_t *dst;
+		uint32_t len = snb_total_len(snb);
+
+		if (unlikely(len > AFP_TX_MAX_LEN))
+			break;
+
+		h = (struct tpacket3_hdr *)(q->tx_ring +
+				(size_t)q->tx_frame * AFP_FRAME_SIZE);
+
+		/* the kernel has not sent the frame yet. Ring is full */
+		if (h->tp_status != TP_STATUS_AVAILABLE)
+			break;
+
+		dst = (uint8_t *)h + AFP_TX_DATA_OFF;
+		for (seg = &snb->mbuf; seg; seg = seg->next) {
+			rte_memcpy(dst, rte_pktmbuf_mtod(seg, void *),
+					seg->data_len);
+			dst += seg->data_len;
+		}
+
+		h->tp_len = len;
+		h->tp_snaplen = len;
+		h->tp_next_offset = 0;
+
+		rte_wmb();
+		h->tp_status = TP_STATUS_SEND_REQUEST;
+
+		q->tx_frame = (q->tx_frame + 1) % q->tx_num_frames;
+	}
+
+	if (sent > 0) {
+		/* non-blocking. The kernel sends all pending frames */
+		sendto(q->fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+		snb_free_bulk(pkts, sent);
+	}
+
+	return sent;
+}
+
+static struct snobj *afp_driver_stats(struct port *p)
+{
+	struct afp_priv *priv = get_port_priv(p);
+	struct snobj *r = snobj_map();
+	uint64_t oversized = 0;
+
+	for (int i = 0; i < p->num_queues[PACKET_DIR_INC]; i++)
+		oversized += priv->q[i].rx_oversized;
+
+	snobj_map_set(r, "rx_oversized", snobj_uint(oversized));
+
+	return r;
+}
+
+static const struct driver af_packet = {
+	.name 		= "AFPacket",
+	.def_port_name	= "afp",
+	.priv_size	= sizeof(struct afp_priv),
+	.init_driver	= afp_init_driver,
+	.init_port 	= afp_init_port,
+	.deinit_port	= afp_deinit_port,
+	.collect_stats	= afp_collect_stats,
+	.driver_stats	= afp_driver_stats,
+	.recv_pkts 	= afp_recv_pkts,
+	.send_pkts 	= afp_send_pkts,
+};
+
+ADD_DRIVER(af_packet)
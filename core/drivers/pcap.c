@@ -1,6 +1,9 @@
 #include <pcap/pcap.h>
 
+#include <rte_malloc.h>
+
 #include "../port.h"
+#include "../time.h"
 
 #define PCAP_IFNAME 16
 
@@ -9,9 +12,40 @@
 
 /* Experimental. Needs more tests */
 
+/* Replay mode ("file" instead of "dev"): the whole capture is loaded into
+ * a single hugepage buffer at port init, and copied into fresh snbufs by
+ * the datapath without any syscall. Each inc queue replays the capture
+ * independently. With "speed", packets are paced to their original
+ * timestamps, scaled by the factor (2.0 is twice as fast). */
+struct replay_pkt {
+	uint32_t offset;	/* in replay->data */
+	uint16_t len;
+	uint64_t due;		/* in cycles, since the first packet */
+};
+
+struct replay_queue {
+	uint32_t idx;		/* next packet to send */
+	uint64_t loops;		/* completed loops */
+	uint64_t start;		/* TSC of the first packet of this loop */
+} __rte_cache_aligned;
+
+struct pcap_replay {
+	char *data;
+	struct replay_pkt *pkts;
+	uint32_t num_pkts;
+
+	int pace;
+	uint64_t loop_cycles;	/* duration of a loop, if paced */
+	uint64_t max_loops;	/* 0 for infinite */
+
+	struct replay_queue q[MAX_QUEUES_PER_DIR];
+};
+
 struct pcap_priv {
 	pcap_t *pcap_handle;
 	char dev[PCAP_IFNAME];
+
+	struct pcap_replay *replay;	/* NULL if live */
 };
 
 static int pcap_init_driver(struct driver *driver)
@@ -19,11 +53,182 @@ static int pcap_init_driver(struct driver *driver)
 	return 0;
 }
 
+static void free_replay(struct pcap_replay *r)
+{
+	rte_free(r->data);
+	rte_free(r->pkts);
+	rte_free(r);
+}
+
+static struct snobj *load_replay(struct pcap_priv *priv, const char *file,
+		double speed)
+{
+	char errbuf[PCAP_ERRBUF_SIZE];
+	struct pcap_replay *r;
+	struct pcap_pkthdr *header;
+	const u_char *packet;
+	pcap_t *handle;
+
+	uint64_t num_pkts = 0;
+	uint64_t total_bytes = 0;
+	uint64_t skipped = 0;
+	uint64_t first_ns = 0;
+	uint64_t last_ns = 0;
+
+	/* first pass: count */
+	handle = pcap_open_offline(file, errbuf);
+	if (!handle)
+		return snobj_err(ENOENT, "PCAP open file error: %s", errbuf);
+
+	while (pcap_next_ex(handle, &header, &packet) == 1) {
+		if (header->caplen > SNBUF_DATA) {
+			skipped++;
+			continue;
+		}
+
+		num_pkts++;
+		total_bytes += header->caplen;
+	}
+
+	pcap_close(handle);
+
+	if (num_pkts == 0)
+		return snobj_err(EINVAL, "No packet to replay in %s", file);
+
+	if (num_pkts > UINT32_MAX || total_bytes > UINT32_MAX)
+		return snobj_err(EFBIG, "%s is too large to replay", file);
+
+	r = rte_zmalloc("pcap_replay", sizeof(*r), 0);
+	if (!r)
+		return snobj_err(ENOMEM, "Out of memory");
+
+	r->data = rte_malloc("pcap_replay_data", total_bytes, 0);
+	r->pkts = rte_malloc("pcap_replay_pkts", 
+			sizeof(struct replay_pkt) * num_pkts, 0);
+	if (!r->data || !r->pkts) {
+		free_replay(r);
+		return snobj_err(ENOMEM, "Out of memory (%lu bytes)",
+				total_bytes);
+	}
+
+	/* second pass: copy */
+	handle = pcap_open_offline(file, errbuf);
+	if (!handle) {
+		free_replay(r);
+		return snobj_err(ENOENT, "PCAP open file error: %s", errbuf);
+	}
+
+	total_bytes = 0;
+
+	while (r->num_pkts < num_pkts && 
+			pcap_next_ex(handle, &header, &packet) == 1) {
+		struct replay_pkt *pkt = &r->pkts[r->num_pkts];
+		uint64_t ts_ns;
+
+		if (header->caplen > SNBUF_DATA)
+			continue;
+
+		ts_ns = header->ts.tv_sec * 1000000000UL + 
+			header->ts.tv_usec * 1000UL;
+
+		if (r->num_pkts == 0)
+			first_ns = last_ns = ts_ns;
+
+		/* timestamps going backward */
+		if (ts_ns < last_ns)
+			ts_ns = last_ns;
+		last_ns = ts_ns;
+
+		pkt->offset = total_bytes;
+		pkt->len = header->caplen;
+		pkt->due = (ts_ns - first_ns) / speed * tsc_hz / 1000000000UL;
+
+		rte_memcpy(r->data + total_bytes, packet, header->caplen);
+		total_bytes += header->caplen;
+		r->num_pkts++;
+	}
+
+	pcap_close(handle);
+
+	if (r->num_pkts != num_pkts) {
+		free_replay(r);
+		return snobj_err(EIO, "%s changed while loading", file);
+	}
+
+	/* a loop takes one average inter-packet gap more than its span */
+	if (num_pkts > 1) {
+		uint64_t span = r->pkts[num_pkts - 1].due;
+
+		r->loop_cycles = span + span / (num_pkts - 1);
+	}
+
+	r->pace = (speed > 0 && r->loop_cycles > 0);
+
+	if (skipped)
+		log_warn("PCAP: %lu packets in %s are larger than %d bytes "
+				"and will not be replayed\n", 
+				skipped, file, SNBUF_DATA);
+
+	log_info("PCAP: loaded %u packets (%lu bytes) from %s\n",
+			r->num_pkts, total_bytes, file);
+
+	priv->replay = r;
+
+	return NULL;
+}
+
+static struct snobj *init_replay(struct pcap_priv *priv, struct snobj *conf)
+{
+	struct snobj *t;
+	double speed = 0.0;
+	struct snobj *err;
+
+	if ((t = snobj_eval(conf, "speed")) != NULL) {
+		if (snobj_type(t) == TYPE_INT)
+			speed = snobj_int_get(t);
+		else if (snobj_type(t) == TYPE_DOUBLE)
+			speed = snobj_double_get(t);
+		else
+			return snobj_err(EINVAL, "'speed' must be a number");
+
+		if (!(speed > 0.0))
+			return snobj_err(EINVAL, "'speed' must be positive");
+	}
+
+	err = load_replay(priv, snobj_eval_str(conf, "file"), 
+			speed > 0.0 ? speed : 1.0);
+	if (err)
+		return err;
+
+	if (speed == 0.0)
+		priv->replay->pace = 0;
+
+	if ((t = snobj_eval(conf, "loops")) != NULL) {
+		if (snobj_type(t) != TYPE_INT) {
+			free_replay(priv->replay);
+			priv->replay = NULL;
+			return snobj_err(EINVAL, "'loops' must be an integer");
+		}
+
+		priv->replay->max_loops = snobj_uint_get(t);
+	}
+
+	return NULL;
+}
+
 static struct snobj *pcap_init_port(struct port *p, struct snobj *conf)
 {
 	char errbuf[PCAP_ERRBUF_SIZE];
 	struct pcap_priv *priv = get_port_priv(p);
 
+	if (snobj_eval_str(conf, "file")) {
+		if (snobj_eval_exists(conf, "dev"))
+			return snobj_err(EINVAL, "'dev' and 'file' cannot "
+					"be used together");
+
+		return init_replay(priv, conf);
+	}
+
 	if (snobj_eval_str(conf, "dev"))
 		strncpy(priv->dev, snobj_eval_str(conf, "dev"), PCAP_IFNAME);
 	else 
@@ -53,6 +258,11 @@ static void pcap_deinit_port(struct port *p)
 		pcap_close(priv->pcap_handle);
 		priv->pcap_handle = NULL;
 	}
+
+	if (priv->replay) {
+		free_replay(priv->replay);
+		priv->replay = NULL;
+	}
 }
 
 static int pcap_rx_jumbo(struct rte_mempool *mb_pool,
@@ -96,6 +306,81 @@ static int pcap_rx_jumbo(struct rte_mempool *mb_pool,
 }
 
 
+static int 
+replay_recv_pkts(struct pcap_replay *r, queue_t qid, snb_array_t pkts, int cnt)
+{
+	struct replay_queue *q = &r->q[qid];
+	const struct replay_pkt *tmpl[MAX_PKT_BURST];
+	uint16_t max_len = 0;
+	uint64_t now = 0;
+	int n = 0;
+
+	cnt = RTE_MIN(cnt, MAX_PKT_BURST);
+
+	if (r->pace) {
+		now = rdtsc();
+		if (unlikely(!q->start))
+			q->start = now;
+	}
+
+	while (n < cnt) {
+		const struct replay_pkt *pkt;
+
+		if (unlikely(q->idx == r->num_pkts)) {
+			if (r->max_loops && q->loops + 1 >= r->max_loops)
+				break;
+
+			q->idx = 0;
+			q->loops++;
+			q->start += r->loop_cycles;
+		}
+
+		pkt = &r->pkts[q->idx];
+
+		if (r->pace) {
+			uint64_t due = q->start + pkt->due;
+
+			if (due > now)
+				break;
+
+			/* more than a second behind (e.g., the worker was
+			 * paused). Do not try to catch up */
+			if (unlikely(now - due > tsc_hz))
+				q->start = now - pkt->due;
+		}
+
+		tmpl[n++] = pkt;
+		max_len = RTE_MAX(max_len, pkt->len);
+		q->idx++;
+	}
+
+	if (n == 0)
+		return 0;
+
+	if (!snb_alloc_bulk(pkts, n, max_len)) {
+		/* retry later */
+		for (int i = n - 1; i >= 0; i--) {
+			if (q->idx == 0) {
+				q->idx = r->num_pkts;
+				q->loops--;
+				q->start -= r->loop_cycles;
+			}
+			q->idx--;
+		}
+		return 0;
+	}
+
+	for (int i = 0; i < n; i++) {
+		struct snbuf *snb = pkts[i];
+
+		snb->mbuf.pkt_len = snb->mbuf.data_len = tmpl[i]->len;
+		rte_memcpy(snb_head_data(snb), r->data + tmpl[i]->offset,
+				tmpl[i]->len);
+	}
+
+	return n;
+}
+
 static int 
 pcap_recv_pkts(struct port *p, queue_t qid, snb_array_t pkts, int cnt)
 {
@@ -106,6 +391,9 @@ pcap_recv_pkts(struct port *p, queue_t qid, snb_array_t pkts, int cnt)
 	int recv_cnt = 0;
 	struct snbuf *sbuf; 
 
+	if (priv->replay)
+		return replay_recv_pkts(priv->replay, qid, pkts, cnt);
+
 	while(recv_cnt < cnt) {
 		packet = pcap_next(priv->pcap_handle, &header);
 		if (!packet)
@@ -166,6 +454,9 @@ static int pcap_send_pkts(struct port *p, queue_t qid, snb_array_t pkts, int cnt
 	int ret;
 	int send_cnt = 0;
 
+	/* nowhere to send in replay mode. Dropped */
+	if (!priv->pcap_handle)
+		return 0;
 
 	while(send_cnt < cnt) {
 		struct snbuf *sbuf = pkts[send_cnt];
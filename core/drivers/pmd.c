@@ -3,14 +3,55 @@
 #include <rte_errno.h>
 
 #include "../port.h"
+#include "../master.h"
+#include "../time.h"
 
 #define DPDK_PORT_UNKNOWN	RTE_MAX_ETHPORTS
 
 typedef uint8_t dpdk_port_t;
 
+/* 40 bytes for most NICs, 52 bytes for i40e. 
+ * NICs with shorter keys only use the first bytes */
+#define PMD_RSS_KEY_LEN		52
+
+/* Moves RETA entries off the busiest RX queue, to the least busy one.
+ * Per-bucket load is not visible, so entries are picked round robin. */
+struct reta_balancer {
+	struct master_job job;
+
+	/* config */
+	int threshold_pct;	/* acts if (busiest - idlest) > mean * pct% */
+	int max_moves;		/* RETA entries moved per period */
+	uint64_t hold_tsc;	/* no moves for this long after a move */
+
+	uint64_t last_packets[RTE_ETHDEV_QUEUE_STAT_CNTRS];
+	uint64_t last_move_tsc;
+	int cursor;
+
+	uint64_t rounds;
+	uint64_t moves;
+};
+
 struct pmd_priv {
 	dpdk_port_t dpdk_port_id;
 	int stats;
+
+	uint16_t reta_size;		/* 0 if not supported */
+	uint8_t rss_key[PMD_RSS_KEY_LEN];
+
+	struct reta_balancer bal;
+};
+
+static const struct {
+	const char *name;
+	uint64_t hf;
+} rss_hash_fields[] = {
+	{"ip",		ETH_RSS_IP},
+	{"udp",		ETH_RSS_UDP},
+	{"tcp",		ETH_RSS_TCP},
+	{"sctp",	ETH_RSS_SCTP},
+	{"l2_payload",	ETH_RSS_L2_PAYLOAD},
+	{NULL,		0},
 };
 
 #define SN_TSO_SG		0
@@ -170,6 +211,400 @@ pci_format_err:
 	return NULL;
 }
 
+/* e.g., ["ip", "tcp", "udp"] */
+static struct snobj *parse_rss_hash(struct snobj *t, uint64_t *hf)
+{
+	*hf = 0;
+
+	if (snobj_type(t) != TYPE_LIST)
+		return snobj_err(EINVAL, "'rss_hash' must be a list of str");
+
+	for (int i = 0; i < t->size; i++) {
+		const char *name = snobj_str_get(snobj_list_get(t, i));
+		int j;
+
+		if (!name)
+			return snobj_err(EINVAL, 
+					"'rss_hash' must be a list of str");
+
+		for (j = 0; rss_hash_fields[j].name; j++)
+			if (strcmp(rss_hash_fields[j].name, name) == 0)
+				break;
+
+		if (!rss_hash_fields[j].name)
+			return snobj_err(EINVAL, "Unknown RSS hash field '%s'",
+					name);
+
+		*hf |= rss_hash_fields[j].hf;
+	}
+
+	return NULL;
+}
+
+/* "symmetric" or a list of bytes.
+ * With the symmetric key (0x6d5a repeated), Toeplitz hashing gives the same
+ * value for both directions of a flow, so that they land on the same queue */
+static struct snobj *parse_rss_key(struct snobj *t, uint8_t *key)
+{
+	const char *str = snobj_str_get(t);
+
+	if (str) {
+		if (strcmp(str, "symmetric") != 0)
+			return snobj_err(EINVAL, "Unknown RSS key '%s'", str);
+
+		for (int i = 0; i < PMD_RSS_KEY_LEN; i++)
+			key[i] = (i % 2) ? 0x5a : 0x6d;
+
+		return NULL;
+	}
+
+	if (snobj_type(t) != TYPE_LIST || t->size > PMD_RSS_KEY_LEN)
+		return snobj_err(EINVAL, "'rss_key' must be \"symmetric\" or "
+				"a list of up to %d bytes", PMD_RSS_KEY_LEN);
+
+	memset(key, 0, PMD_RSS_KEY_LEN);
+
+	for (int i = 0; i < t->size; i++) {
+		struct snobj *b = snobj_list_get(t, i);
+
+		if (snobj_type(b) != TYPE_INT || snobj_uint_get(b) > 0xff)
+			return snobj_err(EINVAL, "'rss_key' must be a list "
+					"of bytes");
+
+		key[i] = snobj_uint_get(b);
+	}
+
+	return NULL;
+}
+
+/* The list of queues is repeated to fill the redirection table,
+ * e.g., [0, 1, 1] sends 2/3 of the hash space to queue 1 */
+static struct snobj *pmd_set_reta(struct port *p, struct snobj *t)
+{
+	struct pmd_priv *priv = get_port_priv(p);
+	struct rte_eth_rss_reta_entry64 reta_conf[ETH_RSS_RETA_SIZE_512 / 
+			RTE_RETA_GROUP_SIZE];
+	int ret;
+
+	if (priv->reta_size == 0 || priv->reta_size > ETH_RSS_RETA_SIZE_512)
+		return snobj_err(ENOTSUP, "RETA is not supported by the port");
+
+	if (snobj_type(t) != TYPE_LIST || t->size == 0)
+		return snobj_err(EINVAL, "RETA must be a non-empty list of "
+				"queue IDs");
+
+	for (int i = 0; i < t->size; i++) {
+		struct snobj *q = snobj_list_get(t, i);
+
+		if (snobj_type(q) != TYPE_INT || 
+				snobj_uint_get(q) >= p->num_queues[PACKET_DIR_INC])
+			return snobj_err(EINVAL, "Invalid RX queue ID in RETA");
+	}
+
+	memset(reta_conf, 0, sizeof(reta_conf));
+
+	for (int i = 0; i < priv->reta_size; i++) {
+		struct rte_eth_rss_reta_entry64 *e;
+
+		e = &reta_conf[i / RTE_RETA_GROUP_SIZE];
+		e->mask |= (1ULL << (i % RTE_RETA_GROUP_SIZE));
+		e->reta[i % RTE_RETA_GROUP_SIZE] = 
+			snobj_uint_get(snobj_list_get(t, i % t->size));
+	}
+
+	ret = rte_eth_dev_rss_reta_update(priv->dpdk_port_id, reta_conf,
+			priv->reta_size);
+	if (ret != 0)
+		return snobj_err(-ret, "rte_eth_dev_rss_reta_update() failed");
+
+	return NULL;
+}
+
+static int pmd_read_reta(struct port *p, uint16_t *reta)
+{
+	struct pmd_priv *priv = get_port_priv(p);
+	struct rte_eth_rss_reta_entry64 reta_conf[ETH_RSS_RETA_SIZE_512 / 
+			RTE_RETA_GROUP_SIZE];
+	int ret;
+
+	memset(reta_conf, 0, sizeof(reta_conf));
+	for (int i = 0; i < priv->reta_size; i++)
+		reta_conf[i / RTE_RETA_GROUP_SIZE].mask |= 
+			(1ULL << (i % RTE_RETA_GROUP_SIZE));
+
+	ret = rte_eth_dev_rss_reta_query(priv->dpdk_port_id, reta_conf,
+			priv->reta_size);
+	if (ret != 0)
+		return ret;
+
+	for (int i = 0; i < priv->reta_size; i++)
+		reta[i] = reta_conf[i / RTE_RETA_GROUP_SIZE].
+				reta[i % RTE_RETA_GROUP_SIZE];
+
+	return 0;
+}
+
+static struct snobj *pmd_get_reta(struct port *p)
+{
+	struct pmd_priv *priv = get_port_priv(p);
+	uint16_t reta[ETH_RSS_RETA_SIZE_512];
+	struct snobj *r;
+	int ret;
+
+	if (priv->reta_size == 0 || priv->reta_size > ETH_RSS_RETA_SIZE_512)
+		return snobj_err(ENOTSUP, "RETA is not supported by the port");
+
+	ret = pmd_read_reta(p, reta);
+	if (ret != 0)
+		return snobj_err(-ret, "rte_eth_dev_rss_reta_query() failed");
+
+	r = snobj_list();
+	for (int i = 0; i < priv->reta_size; i++)
+		snobj_list_add(r, snobj_uint(reta[i]));
+
+	return r;
+}
+
+static void pmd_balance_reta(void *arg)
+{
+	struct port *p = arg;
+	struct pmd_priv *priv = get_port_priv(p);
+	struct reta_balancer *bal = &priv->bal;
+
+	struct rte_eth_rss_reta_entry64 reta_conf[ETH_RSS_RETA_SIZE_512 / 
+			RTE_RETA_GROUP_SIZE];
+	uint16_t reta[ETH_RSS_RETA_SIZE_512];
+	uint64_t load[RTE_ETHDEV_QUEUE_STAT_CNTRS];
+	uint64_t total = 0;
+	struct rte_eth_stats stats;
+
+	int num_rxq = p->num_queues[PACKET_DIR_INC];
+	int hot = 0;
+	int cold = 0;
+	int on_hot = 0;
+	int moved = 0;
+	int n;
+	int ret;
+
+	if (rte_eth_stats_get(priv->dpdk_port_id, &stats) < 0)
+		return;
+
+	for (int q = 0; q < num_rxq; q++) {
+		load[q] = stats.q_ipackets[q] - bal->last_packets[q];
+		bal->last_packets[q] = stats.q_ipackets[q];
+		total += load[q];
+
+		if (load[q] > load[hot])
+			hot = q;
+		if (load[q] < load[cold])
+			cold = q;
+	}
+
+	/* the first round only takes a snapshot */
+	if (bal->rounds++ == 0 || total == 0)
+		return;
+
+	/* hysteresis */
+	if ((load[hot] - load[cold]) * 100 <= 
+			total / num_rxq * bal->threshold_pct)
+		return;
+
+	/* rate limit, to avoid reordering storms */
+	if (rdtsc() - bal->last_move_tsc < bal->hold_tsc)
+		return;
+
+	if (pmd_read_reta(p, reta) != 0)
+		return;
+
+	for (int i = 0; i < priv->reta_size; i++)
+		on_hot += (reta[i] == hot);
+
+	memset(reta_conf, 0, sizeof(reta_conf));
+
+	/* leave at least one entry to the busiest queue */
+	for (n = 0; n < priv->reta_size; n++) {
+		int i = (bal->cursor + n) % priv->reta_size;
+
+		if (moved >= bal->max_moves || on_hot - moved <= 1)
+			break;
+
+		if (reta[i] != hot)
+			continue;
+
+		reta_conf[i / RTE_RETA_GROUP_SIZE].mask |= 
+			(1ULL << (i % RTE_RETA_GROUP_SIZE));
+		reta_conf[i / RTE_RETA_GROUP_SIZE].reta[i % RTE_RETA_GROUP_SIZE] =
+			cold;
+		moved++;
+	}
+
+	bal->cursor = (bal->cursor + n) % priv->reta_size;
+
+	if (!moved)
+		return;
+
+	ret = rte_eth_dev_rss_reta_update(priv->dpdk_port_id, reta_conf,
+			priv->reta_size);
+	if (ret != 0) {
+		log_err("%s: rte_eth_dev_rss_reta_update() failed: %s\n",
+				p->name, rte_strerror(-ret));
+		return;
+	}
+
+	bal->moves += moved;
+	bal->last_move_tsc = rdtsc();
+
+	log_debug("%s: %d RETA entries moved from RXQ %d to %d\n",
+			p->name, moved, hot, cold);
+}
+
+/* {"interval_ms": 1000, "threshold_pct": 50, "max_moves": 4, 
+ *  "hold_ms": 5000}, all optional. 0 disables the balancer. */
+static struct snobj *pmd_set_reta_balance(struct port *p, struct snobj *t)
+{
+	struct pmd_priv *priv = get_port_priv(p);
+	struct reta_balancer *bal = &priv->bal;
+	int num_rxq = p->num_queues[PACKET_DIR_INC];
+	uint64_t interval_ms = 1000;
+	uint64_t hold_ms = 5000;
+
+	remove_master_job(&bal->job);
+
+	if (snobj_type(t) == TYPE_INT && snobj_int_get(t) == 0)
+		return NULL;
+
+	if (snobj_type(t) != TYPE_MAP)
+		return snobj_err(EINVAL, "'reta_balance' must be a map or 0");
+
+	if (priv->reta_size == 0 || priv->reta_size > ETH_RSS_RETA_SIZE_512)
+		return snobj_err(ENOTSUP, "RETA is not supported by the port");
+
+	if (num_rxq < 2 || num_rxq > RTE_ETHDEV_QUEUE_STAT_CNTRS)
+		return snobj_err(EINVAL, "RETA balancing needs 2-%d RX queues",
+				RTE_ETHDEV_QUEUE_STAT_CNTRS);
+
+	if (snobj_eval(t, "interval_ms"))
+		interval_ms = snobj_eval_uint(t, "interval_ms");
+	if (snobj_eval(t, "hold_ms"))
+		hold_ms = snobj_eval_uint(t, "hold_ms");
+
+	bal->threshold_pct = 50;
+	if (snobj_eval(t, "threshold_pct"))
+		bal->threshold_pct = snobj_eval_int(t, "threshold_pct");
+
+	bal->max_moves = 4;
+	if (snobj_eval(t, "max_moves"))
+		bal->max_moves = snobj_eval_int(t, "max_moves");
+
+	if (interval_ms == 0 || bal->threshold_pct <= 0 || bal->max_moves <= 0)
+		return snobj_err(EINVAL, "'interval_ms', 'threshold_pct' and "
+				"'max_moves' must be positive");
+
+	bal->hold_tsc = hold_ms * tsc_hz / 1000;
+	bal->last_move_tsc = 0;
+	bal->rounds = 0;
+	bal->moves = 0;
+
+	init_master_job(&bal->job, pmd_balance_reta, p, 
+			interval_ms * 1000000);
+	add_master_job(&bal->job);
+
+	return NULL;
+}
+
+static struct snobj *pmd_get_reta_balance(struct port *p)
+{
+	struct pmd_priv *priv = get_port_priv(p);
+	struct reta_balancer *bal = &priv->bal;
+	struct snobj *r = snobj_map();
+
+	snobj_map_set(r, "enabled", snobj_int(is_master_job_added(&bal->job)));
+	snobj_map_set(r, "interval_ms", 
+			snobj_uint(bal->job.period_ns / 1000000));
+	snobj_map_set(r, "threshold_pct", snobj_int(bal->threshold_pct));
+	snobj_map_set(r, "max_moves", snobj_int(bal->max_moves));
+	snobj_map_set(r, "hold_ms", snobj_uint(bal->hold_tsc * 1000 / tsc_hz));
+	snobj_map_set(r, "rounds", snobj_uint(bal->rounds));
+	snobj_map_set(r, "moves", snobj_uint(bal->moves));
+
+	return r;
+}
+
+static struct snobj *pmd_get_rss(struct port *p)
+{
+	struct pmd_priv *priv = get_port_priv(p);
+	struct rte_eth_rss_conf rss_conf;
+	uint8_t key[PMD_RSS_KEY_LEN] = {};
+	struct snobj *r;
+	struct snobj *hash;
+	struct snobj *key_obj;
+	int ret;
+
+	rss_conf.rss_key = key;
+	rss_conf.rss_key_len = PMD_RSS_KEY_LEN;
+
+	ret = rte_eth_dev_rss_hash_conf_get(priv->dpdk_port_id, &rss_conf);
+	if (ret != 0)
+		return snobj_err(-ret, "rte_eth_dev_rss_hash_conf_get() failed");
+
+	hash = snobj_list();
+	for (int i = 0; rss_hash_fields[i].name; i++)
+		if ((rss_conf.rss_hf & rss_hash_fields[i].hf) == 
+				rss_hash_fields[i].hf)
+			snobj_list_add(hash, snobj_str(rss_hash_fields[i].name));
+
+	key_obj = snobj_list();
+	for (int i = 0; i < rss_conf.rss_key_len && i < PMD_RSS_KEY_LEN; i++)
+		snobj_list_add(key_obj, snobj_uint(key[i]));
+
+	r = snobj_map();
+	snobj_map_set(r, "hash", hash);
+	snobj_map_set(r, "key", key_obj);
+	snobj_map_set(r, "reta_size", snobj_uint(priv->reta_size));
+
+	return r;
+}
+
+/* change hash fields and/or the key at runtime */
+static struct snobj *pmd_set_rss(struct port *p, struct snobj *q)
+{
+	struct pmd_priv *priv = get_port_priv(p);
+	struct rte_eth_rss_conf rss_conf;
+	struct snobj *t;
+	struct snobj *err;
+	int ret;
+
+	rss_conf.rss_key = NULL;
+	rss_conf.rss_key_len = 0;
+
+	if ((t = snobj_eval(q, "rss_hash")) != NULL) {
+		err = parse_rss_hash(t, &rss_conf.rss_hf);
+		if (err)
+			return err;
+	} else {
+		ret = rte_eth_dev_rss_hash_conf_get(priv->dpdk_port_id, 
+				&rss_conf);
+		if (ret != 0)
+			return snobj_err(-ret, "rte_eth_dev_rss_hash_conf_get() "
+					"failed");
+	}
+
+	if ((t = snobj_eval(q, "rss_key")) != NULL) {
+		err = parse_rss_key(t, priv->rss_key);
+		if (err)
+			return err;
+
+		rss_conf.rss_key = priv->rss_key;
+		rss_conf.rss_key_len = PMD_RSS_KEY_LEN;
+	}
+
+	ret = rte_eth_dev_rss_hash_update(priv->dpdk_port_id, &rss_conf);
+	if (ret != 0)
+		return snobj_err(-ret, "rte_eth_dev_rss_hash_update() failed");
+
+	return NULL;
+}
+
 static struct snobj *pmd_init_port(struct port *p, struct snobj *conf)
 {
 	struct pmd_priv *priv = get_port_priv(p);
@@ -189,7 +624,10 @@ static struct snobj *pmd_init_port(struct port *p, struct snobj *conf)
 
 	struct snobj *err;
 	
+	struct snobj *t;
+
 	int ret;
+	int sid;
 
 	int i;
 
@@ -201,10 +639,46 @@ static struct snobj *pmd_init_port(struct port *p, struct snobj *conf)
 	if (snobj_eval_int(conf, "loopback"))
 		eth_conf.lpbk_mode = 1;
 
+	/* jumbo frames are received as chains of snbufs */
+	if (snobj_eval(conf, "max_frame")) {
+		int max_frame = snobj_eval_int(conf, "max_frame");
+
+		if (max_frame < ETHER_MAX_LEN || max_frame > UINT16_MAX)
+			return snobj_err(EINVAL, "'max_frame' must be between "
+					"%d and %d", ETHER_MAX_LEN, UINT16_MAX);
+
+		if (max_frame > ETHER_MAX_LEN) {
+			eth_conf.rxmode.jumbo_frame = 1;
+			eth_conf.rxmode.max_rx_pkt_len = max_frame;
+			eth_conf.rxmode.enable_scatter = 1;
+		}
+	}
+
 	/* Use defaut rx/tx configuration as provided by PMD drivers,
 	 * with minor tweaks */
 	rte_eth_dev_info_get(port_id, &dev_info);
 
+	priv->reta_size = dev_info.reta_size;
+
+	if (dev_info.flow_type_rss_offloads)
+		eth_conf.rx_adv_conf.rss_conf.rss_hf &= 
+			dev_info.flow_type_rss_offloads;
+
+	if ((t = snobj_eval(conf, "rss_hash")) != NULL) {
+		err = parse_rss_hash(t, &eth_conf.rx_adv_conf.rss_conf.rss_hf);
+		if (err)
+			return err;
+	}
+
+	if ((t = snobj_eval(conf, "rss_key")) != NULL) {
+		err = parse_rss_key(t, priv->rss_key);
+		if (err)
+			return err;
+
+		eth_conf.rx_adv_conf.rss_conf.rss_key = priv->rss_key;
+		eth_conf.rx_adv_conf.rss_conf.rss_key_len = PMD_RSS_KEY_LEN;
+	}
+
 	eth_rxconf = dev_info.default_rxconf;
 	eth_rxconf.rx_drop_en = 1;
 
@@ -213,6 +687,32 @@ static struct snobj *pmd_init_port(struct port *p, struct snobj *conf)
 			ETH_TXQ_FLAGS_NOMULTSEGS * (1 - SN_TSO_SG) | 
 			ETH_TXQ_FLAGS_NOXSUMS * (1 - SN_HW_TXCSUM);
 
+	/* chained snbufs must be sent as is, without linearizing */
+	if (eth_conf.rxmode.jumbo_frame)
+		eth_txconf.txq_flags &= ~ETH_TXQ_FLAGS_NOMULTSEGS;
+
+	/* TX offloads (requested per packet, see snbuf.h) need the
+	 * full-featured TX path of the PMD, which is slower than the simple
+	 * one for small packets. Thus they are opt-in. */
+	if (snobj_eval_int(conf, "tx_offload")) {
+		p->tx_offload_capa = dev_info.tx_offload_capa & 
+				(DEV_TX_OFFLOAD_VLAN_INSERT |
+				 DEV_TX_OFFLOAD_IPV4_CKSUM |
+				 DEV_TX_OFFLOAD_UDP_CKSUM |
+				 DEV_TX_OFFLOAD_TCP_CKSUM |
+				 DEV_TX_OFFLOAD_TCP_TSO);
+
+		if (p->tx_offload_capa & DEV_TX_OFFLOAD_VLAN_INSERT)
+			eth_txconf.txq_flags &= ~ETH_TXQ_FLAGS_NOVLANOFFL;
+
+		if (p->tx_offload_capa & ~DEV_TX_OFFLOAD_VLAN_INSERT)
+			eth_txconf.txq_flags &= ~ETH_TXQ_FLAGS_NOXSUMS;
+
+		/* TSO packets (e.g., from VPort) are chained snbufs */
+		if (p->tx_offload_capa & DEV_TX_OFFLOAD_TCP_TSO)
+			eth_txconf.txq_flags &= ~ETH_TXQ_FLAGS_NOMULTSEGS;
+	}
+
 	ret = rte_eth_dev_configure(port_id,
 				    num_rxq, num_txq, &eth_conf);
 	if (ret != 0) 
@@ -220,25 +720,28 @@ static struct snobj *pmd_init_port(struct port *p, struct snobj *conf)
 
 	rte_eth_promiscuous_enable(port_id);
 
-	for (i = 0; i < num_rxq; i++) {
-		int sid = rte_eth_dev_socket_id(port_id);
+	sid = rte_eth_dev_socket_id(port_id);
+
+	/* if socket_id is invalid, set to 0 */
+	if (sid < 0 || sid > RTE_MAX_NUMA_NODES)
+		sid = 0;
 
-		/* if socket_id is invalid, set to 0 */
-		if (sid < 0 || sid > RTE_MAX_NUMA_NODES)
-			sid = 0;
+	p->socket = sid;
 
+	/* queues and RX buffers are on the same node as the NIC.
+	 * Each RX buffer holds a standard frame, or a segment of a jumbo one */
+	for (i = 0; i < num_rxq; i++) {
 		ret = rte_eth_rx_queue_setup(port_id, i, 
 					     p->queue_size[PACKET_DIR_INC],
 					     sid, &eth_rxconf,
-					     get_pframe_pool_socket(sid));
+					     get_pframe_pool_fit(sid, 
+						     ETHER_MAX_LEN));
 		if (ret != 0) 
 			return snobj_err(-ret, 
 					"rte_eth_rx_queue_setup() failed");
 	}
 
 	for (i = 0; i < num_txq; i++) {
-		int sid = 0;		/* XXX */
-
 		ret = rte_eth_tx_queue_setup(port_id, i,
 					     p->queue_size[PACKET_DIR_OUT],
 					     sid, &eth_txconf);
@@ -265,6 +768,24 @@ static struct snobj *pmd_init_port(struct port *p, struct snobj *conf)
 
 	priv->dpdk_port_id = port_id;
 
+	init_master_job(&priv->bal.job, pmd_balance_reta, p, 0);
+
+	if ((t = snobj_eval(conf, "reta")) != NULL) {
+		err = pmd_set_reta(p, t);
+		if (err) {
+			rte_eth_dev_stop(port_id);
+			return err;
+		}
+	}
+
+	if ((t = snobj_eval(conf, "reta_balance")) != NULL) {
+		err = pmd_set_reta_balance(p, t);
+		if (err) {
+			rte_eth_dev_stop(port_id);
+			return err;
+		}
+	}
+
 	return NULL;
 }
 
@@ -272,6 +793,7 @@ static void pmd_deinit_port(struct port *p)
 {
 	struct pmd_priv *priv = get_port_priv(p);
 
+	remove_master_job(&priv->bal.job);
 	rte_eth_dev_stop(priv->dpdk_port_id);
 }
 
@@ -330,6 +852,49 @@ static void pmd_collect_stats(struct port *p, int reset)
 	}
 }
 
+/* {"cmd": "get_rss"}, {"cmd": "set_rss", "rss_hash": [...], "rss_key": ...},
+ * {"cmd": "get_reta"}, {"cmd": "set_reta", "reta": [...]},
+ * {"cmd": "get_reta_balance"}, {"cmd": "set_reta_balance", "arg": ...} */
+static struct snobj *pmd_query(struct port *p, struct snobj *q)
+{
+	const char *cmd = snobj_eval_str(q, "cmd");
+
+	if (!cmd)
+		return snobj_err(EINVAL, "Missing 'cmd' field");
+
+	if (strcmp(cmd, "get_rss") == 0)
+		return pmd_get_rss(p);
+
+	if (strcmp(cmd, "set_rss") == 0)
+		return pmd_set_rss(p, q);
+
+	if (strcmp(cmd, "get_reta") == 0)
+		return pmd_get_reta(p);
+
+	if (strcmp(cmd, "set_reta") == 0) {
+		struct snobj *t = snobj_eval(q, "reta");
+
+		if (!t)
+			return snobj_err(EINVAL, "Missing 'reta' field");
+
+		return pmd_set_reta(p, t);
+	}
+
+	if (strcmp(cmd, "get_reta_balance") == 0)
+		return pmd_get_reta_balance(p);
+
+	if (strcmp(cmd, "set_reta_balance") == 0) {
+		struct snobj *t = snobj_eval(q, "arg");
+
+		if (!t)
+			return snobj_err(EINVAL, "Missing 'arg' field");
+
+		return pmd_set_reta_balance(p, t);
+	}
+
+	return snobj_err(ENOTSUP, "Unknown command '%s'", cmd);
+}
+
 static int pmd_recv_pkts(struct port *p, queue_t qid, snb_array_t pkts, int cnt)
 {
 	struct pmd_priv *priv = get_port_priv(p);
@@ -361,6 +926,7 @@ static const struct driver pmd = {
 	.init_port 	= pmd_init_port,
 	.deinit_port	= pmd_deinit_port,
 	.collect_stats	= pmd_collect_stats,
+	.query		= pmd_query,
 	.recv_pkts 	= pmd_recv_pkts,
 	.send_pkts 	= pmd_send_pkts,
 };
@@ -77,6 +77,53 @@ static void destroy_device (volatile struct virtio_net *dev)
 #endif
 }
 
+/* Guests enable queue pairs from 0 (e.g., "ethtool -L eth0 combined N").
+ * A guest without multi-queue support never enables any, but always uses
+ * the first pair. */
+static void update_active_qp(struct vhost_dev *vdev, uint32_t virt_qp_nb)
+{
+	uint16_t active = 0;
+
+	while (active < virt_qp_nb && active < VHOST_MAX_QP &&
+			vdev->qp_state[active] == VHOST_QP_ENABLED)
+		active++;
+
+	if (active == 0 && virt_qp_nb > 0)
+		active = 1;
+
+	vdev->active_qp = active;
+}
+
+static int vring_state_changed(struct virtio_net *dev, uint16_t queue_id, 
+		int enable)
+{
+	struct vhost_dev *vdev = dev->priv;
+	uint16_t qp = queue_id / VIRTIO_QNUM;
+	int vring = queue_id % VIRTIO_QNUM;
+
+	/* not attached to a port yet. new_device() will check the vrings */
+	if (!vdev || vdev->dev != dev)
+		return 0;
+
+	if (qp >= VHOST_MAX_QP)
+		return 0;
+
+	if (enable) {
+		rte_vhost_enable_guest_notification(dev, queue_id, 0);
+		vdev->qp_state[qp] |= (1 << vring);
+	} else
+		vdev->qp_state[qp] &= ~(1 << vring);
+
+	update_active_qp(vdev, dev->virt_qp_nb);
+
+	log_info("(%lu) Queue %u %s, %u active queue pairs on %s\n",
+			dev->device_fh, queue_id, 
+			enable ? "enabled" : "disabled",
+			vdev->active_qp, dev->ifname);
+
+	return 0;
+}
+
 /*
  * A new virtio-net device is added to a vhost port.
  */
@@ -108,6 +155,21 @@ static int new_device(struct virtio_net *dev)
 		return -1;
 	}
 
+	for (uint32_t qp = 0; qp < VHOST_MAX_QP; qp++) {
+		vdev->qp_state[qp] = 0;
+		rte_spinlock_init(&vdev->locks[qp].rx);
+		rte_spinlock_init(&vdev->locks[qp].tx);
+	}
+
+	for (uint32_t i = 0; i < dev->virt_qp_nb * VIRTIO_QNUM; i++) {
+		uint32_t qp = i / VIRTIO_QNUM;
+
+		if (qp < VHOST_MAX_QP && dev->virtqueue[i]->enabled)
+			vdev->qp_state[qp] |= (1 << (i % VIRTIO_QNUM));
+	}
+
+	update_active_qp(vdev, dev->virt_qp_nb);
+
 	vdev->dev = dev;
 	dev->priv = vdev;/*Only for easy access later*/
 
@@ -116,12 +178,13 @@ static int new_device(struct virtio_net *dev)
 #endif
 
 	/* Disable notifications. */
-	rte_vhost_enable_guest_notification(dev, VIRTIO_RXQ, 0);
-	rte_vhost_enable_guest_notification(dev, VIRTIO_TXQ, 0);
+	for (uint32_t i = 0; i < dev->virt_qp_nb * VIRTIO_QNUM; i++)
+		rte_vhost_enable_guest_notification(dev, i, 0);
 	dev->flags |= VIRTIO_DEV_RUNNING;
 
-	log_info("(%lu) Device has been added at socket %s\n",
-			dev->device_fh, dev->ifname);
+	log_info("(%lu) Device has been added at socket %s "
+			"(%u queue pairs)\n",
+			dev->device_fh, dev->ifname, dev->virt_qp_nb);
 
 	return 0;
 }
@@ -134,6 +197,7 @@ static const struct virtio_net_device_ops virtio_net_device_ops =
 {
 	.new_device =  new_device,
 	.destroy_device = destroy_device,
+	.vring_state_changed = vring_state_changed,
 };
 
 static void vhost_loop(void *arg __rte_unused)
@@ -146,7 +210,9 @@ static int vhost_init_driver(struct driver *driver)
 {
 	static pthread_t vhost_user_t;
 
-	rte_vhost_feature_disable(1ULL << VIRTIO_NET_F_MRG_RXBUF);
+	/* mergeable RX buffers, for frames larger than a descriptor */
+	rte_vhost_feature_enable(1ULL << VIRTIO_NET_F_MRG_RXBUF);
+	rte_vhost_feature_enable(1ULL << VIRTIO_NET_F_MQ);
 	rte_vhost_driver_callback_register(&virtio_net_device_ops);
 
 	if (pthread_create(&vhost_user_t, NULL, (void*)vhost_loop, NULL)) {
@@ -231,15 +297,41 @@ static void vhost_deinit_port(struct port *p)
 	rte_free(ll_main_dev_cur);
 }
 
+/* BESS queue qid is served by guest queue pair (qid % active_qp).
+ * Returns -1 if the guest has no queue pair yet. */
+static inline int qid_to_qp(struct vhost_dev *vdev, queue_t qid)
+{
+	uint16_t active = vdev->active_qp;
+
+	if (unlikely(active == 0))
+		return -1;
+
+	return likely(qid < active) ? qid : qid % active;
+}
+
 static int vhost_recv_pkts(struct port *p, queue_t qid, snb_array_t pkts, int cnt)
 {
 	struct vhost_dev *vdev = get_port_priv(p);
+	struct virtio_net *dev = vdev->dev;
 	uint16_t count = 0;
+	int qp;
+
+	if (!dev || !(dev->flags & VIRTIO_DEV_RUNNING))
+		return 0;
+
+	qp = qid_to_qp(vdev, qid);
+	if (qp < 0)
+		return 0;
 
-	/*TODO: Use qid when multi-queue is available in DPDK 2.2 */
-	if (vdev->dev != NULL && (vdev->dev->flags & VIRTIO_DEV_RUNNING))
-		count = rte_vhost_dequeue_burst(vdev->dev, VIRTIO_TXQ, 
-				ctx.pframe_pool, (struct rte_mbuf **)pkts, cnt);
+	/* another queue folded onto the same pair is being polled. 
+	 * Just try again later */
+	if (!rte_spinlock_trylock(&vdev->locks[qp].tx))
+		return 0;
+
+	count = rte_vhost_dequeue_burst(dev, qp * VIRTIO_QNUM + VIRTIO_TXQ, 
+			ctx.pframe_pool, (struct rte_mbuf **)pkts, cnt);
+
+	rte_spinlock_unlock(&vdev->locks[qp].tx);
 
 	return count;
 }
@@ -250,26 +342,32 @@ vhost_send_pkts(struct port *p, queue_t qid, snb_array_t pkts, int cnt)
 	struct vhost_dev *vdev = get_port_priv(p);
 	struct virtio_net *dev = vdev->dev;
 	uint16_t count = 0;        
+	int qp;
 
-	/*TODO: Use qid when multi-queue is available in DPDK 2.2 */        
-	if (cnt && dev && (dev->flags & VIRTIO_DEV_RUNNING)) {
+	if (cnt && dev && (dev->flags & VIRTIO_DEV_RUNNING) &&
+			(qp = qid_to_qp(vdev, qid)) >= 0) {
+		uint16_t vring = qp * VIRTIO_QNUM + VIRTIO_RXQ;
+
+		rte_spinlock_lock(&vdev->locks[qp].rx);
 #ifdef ENABLE_VHOST_RETRIES
 		int available;
 		
-		available = rte_vring_available_entries(dev, VIRTIO_RXQ);
+		available = rte_vring_available_entries(dev, vring);
 		if (enable_retry && unlikely(cnt > available)) {
 			int retry;
 			for (retry = 0; retry < burst_rx_retry_num; retry++) {
 				rte_delay_us(burst_rx_delay_time);
 				if (cnt <= rte_vring_available_entries(dev, 
-							VIRTIO_RXQ))
+							vring))
 					break;
 			}
 		}
 #endif
-		count = rte_vhost_enqueue_burst(dev, VIRTIO_RXQ,
+		count = rte_vhost_enqueue_burst(dev, vring,
 				(struct rte_mbuf **)pkts, cnt);
 
+		rte_spinlock_unlock(&vdev->locks[qp].rx);
+
 		/* Free only the packets that were successfully sent */
 		snb_free_bulk(pkts, count);
 	}
@@ -5,6 +5,7 @@
 extern "C" {
 #endif
 #include <rte_ether.h>
+#include <rte_spinlock.h>
 #include "rte_virtio_net.h"
 
 #define VHOST_DIR_PREFIX "/tmp/sn_vhost_"
@@ -18,6 +19,20 @@ extern "C" {
 #define REQUEST_DEV_REMOVAL 1
 #define ACK_DEV_REMOVAL     0    
 
+/* Guest queue pairs beyond this are never used */
+#define VHOST_MAX_QP		MAX_QUEUES_PER_DIR
+
+/* Both vrings of a queue pair must be enabled by the guest */
+#define VHOST_QP_ENABLED	((1 << VIRTIO_RXQ) | (1 << VIRTIO_TXQ))
+
+/* Serializes the access to the vrings of a queue pair, since multiple BESS
+ * queues are folded onto one queue pair when the guest enables fewer pairs
+ * than the port has queues. Uncontended otherwise. */
+struct vhost_qp_lock {
+	rte_spinlock_t rx;	/* guest RX vring (BESS out queue) */
+	rte_spinlock_t tx;	/* guest TX vring (BESS inc queue) */
+} __rte_cache_aligned;
+
 /*
  * Device linked list structure for data path.
  */
@@ -34,6 +49,11 @@ struct vhost_dev {
 	volatile uint8_t ready;
 	/**< Device is marked for removal from the data core. */
 	volatile uint8_t remove;
+	/**< Enabled queue pairs, contiguous from 0. Set by the vhost thread */
+	volatile uint16_t active_qp;
+	/**< VHOST_QP_ENABLED bits of each queue pair */
+	uint8_t qp_state[VHOST_MAX_QP];
+	struct vhost_qp_lock locks[VHOST_MAX_QP];
 } __rte_cache_aligned;
 
 struct virtio_net_data_ll
@@ -3,14 +3,26 @@
 #include <sched.h>
 #include <libgen.h>
 
+#include <pthread.h>
+#include <arpa/inet.h>
+
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 #include <sys/wait.h>
+#include <sys/socket.h>
+
+#include <linux/if.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
 
 #include <rte_malloc.h>
+#include <rte_memzone.h>
+#include <rte_memory.h>
 
 #include "../port.h"
 #include "../snbuf.h"
+#include "../time.h"
+#include "../timer.h"
 
 /* TODO: Unify vport and vport_native */
 
@@ -24,10 +36,81 @@
  * Not sure how to tune this... */
 #define SLOTS_WATERMARK		((SLOTS_PER_LLRING >> 3) * 7)	/* 87.5% */
 
-/* Disable (0) single producer/consumer mode for default */
+/* Single producer/consumer mode of llrings is off by default, since 
+ * PortOut can be run by multiple workers. The kernel side is always single,
+ * as queues are protected by the TX lock or NAPI. Enable it per queue with 
+ * the "spsc_inc"/"spsc_out" options (see check_queue_owner()) */
 #define SINGLE_P		0
 #define SINGLE_C		0
 
+/* Adaptive IRQ coalescing for RX queues (BESS -> kernel).
+ *
+ * While the kernel waits for an interrupt (irq_disabled == 0), the kick is
+ * deferred until thresh packets are pending, or the timeout has passed
+ * since the first one. thresh adapts to the rate: it doubles (up to 
+ * max_pkts) if reached before the timeout, and halves (down to 1, i.e.,
+ * immediate kicks) if the timeout fires first. High-rate queues get fewer
+ * interrupts, while low-rate ones get little extra latency.
+ *
+ * The timeout is a per-worker timer, since PortOut may run on any worker.
+ * Counters are updated without atomics; they are only hints. */
+#define COALESCE_DEF_PKTS	32
+#define COALESCE_DEF_US		50
+
+struct kick_timer {
+	struct timer timer;
+	struct port *port;
+	queue_t qid;
+};
+
+struct irq_coalesce {
+	uint32_t max_pkts;	/* 0: disabled (kick for every batch) */
+	uint64_t timeout_ns;
+
+	uint32_t thresh;
+	uint32_t pending;	/* packets since the last kick */
+
+	uint64_t kicks;
+	uint64_t timer_kicks;	/* kicks by timeout */
+
+	struct kick_timer timers[MAX_WORKERS];
+};
+
+/* Zero-copy TX from the kernel ("zerocopy_tx" option: the minimum length 
+ * of packets to be zero-copied, see sn_common.h).
+ *
+ * The page frags of large skbs come as external segments: snbufs whose
+ * buf_physaddr points to the kernel pages, only good for DMA. Modules can
+ * read the head segment, which has at least the headers, but reading the
+ * rest gives garbage. Use it only for ports doing the requested TX offloads
+ * by themselves (PortOut would do them in software, reading the payload).
+ *
+ * The kernel keeps the skb until the NIC has read the pages. DPDK has no
+ * callback for that, so we hold an extra reference to each external
+ * segment. Once its refcnt drops back to 1, whoever had the packet (the PMD
+ * after TX, or a module dropping it) is done with it. Then the segment's
+ * buf_physaddr is restored, and the cookie goes back via the zc_done ring.
+ * Packets are reclaimed in order, so a packet held for long (e.g., in a 
+ * Queue module) holds back the others, then incoming packets once 
+ * ZC_MAX_PENDING are outstanding. */
+#define ZC_MAX_PENDING		SLOTS_PER_LLRING
+
+struct zc_pending {
+	uint64_t cookie;
+	int num_segs;
+	struct snbuf *segs[SN_TX_MAX_SEGS - 1];
+};
+
+struct zc_queue {
+	uint32_t head;		/* the oldest pending packet */
+	uint32_t tail;
+
+	uint64_t packets;
+	uint64_t completed;
+
+	struct zc_pending arr[ZC_MAX_PENDING];
+};
+
 struct queue {
 	union {
 		struct sn_rxq_registers *rx_regs;
@@ -35,6 +118,16 @@ struct queue {
 
 	struct llring *drv_to_sn;
 	struct llring *sn_to_drv;
+
+	union {
+		struct irq_coalesce coal;	/* RX queues only */
+
+		/* TX queues only. NULL if zero-copy TX is disabled */
+		struct {
+			struct llring *zc_done;
+			struct zc_queue *zc;
+		};
+	};
 };
 
 struct vport_priv {
@@ -48,6 +141,23 @@ struct vport_priv {
 
 	struct sn_ioc_queue_mapping map;
 
+	/* the kernel picks the queue for each CPU (see sn_auto_txq()) */
+	int auto_queue_map;
+
+	/* where the BAR is carved from. -1 if from the malloc heap */
+	int bar_chunk;
+	uint32_t bar_off;
+	uint32_t bar_len;
+
+	/* time spent in each stage of init_port(), in cycles */
+	struct init_stages {
+		uint64_t container;	/* 'docker' lookup */
+		uint64_t create;	/* the kernel netdev (into the netns) */
+		uint64_t ip_addr;
+		uint64_t queue_map;
+		uint64_t total;
+	} init_cycles;
+
 	int netns_fd;
 	int container_pid;
 };
@@ -84,7 +194,7 @@ static void refill_tx_bufs(struct llring *r)
 	for (int i = 0; i < ret; i++)
 		objs[i] = (void *)pkts[i]->immutable.paddr;
 	
-	ret = llring_mp_enqueue_bulk(r, objs, ret);
+	ret = llring_enqueue_bulk(r, objs, ret);
 	assert(ret == 0);
 }
 
@@ -118,12 +228,278 @@ static void drain_drv_to_sn_q(struct llring *q)
 	}
 }
 
+static void zc_restore_seg(struct snbuf *seg)
+{
+	struct rte_mbuf *mbuf = &seg->mbuf;
+
+	mbuf->buf_physaddr = seg->immutable.paddr + 
+			((char *)mbuf->buf_addr - (char *)seg);
+	mbuf->data_off = SNBUF_HEADROOM;
+	mbuf->next = NULL;
+	mbuf->nb_segs = 1;
+}
+
+/* All users have released the segments? */
+static inline int zc_is_done(const struct zc_pending *e)
+{
+	for (int i = 0; i < e->num_segs; i++)
+		if (rte_mbuf_refcnt_read(&e->segs[i]->mbuf) > 1)
+			return 0;
+
+	return 1;
+}
+
+/* Returns completed packets to the kernel, until one is still in use.
+ * Only the (single) consumer of the drv_to_sn llring calls this */
+static void zc_reclaim(struct queue *tx_queue)
+{
+	struct zc_queue *zc = tx_queue->zc;
+
+	while (zc->head != zc->tail) {
+		struct zc_pending *e = &zc->arr[zc->head % ZC_MAX_PENDING];
+		int ret;
+
+		if (!zc_is_done(e))
+			break;
+
+		/* retried later, after the kernel drains the ring */
+		ret = llring_sp_enqueue(tx_queue->zc_done, (void *)e->cookie);
+		if (ret == -LLRING_ERR_NOBUF)
+			break;
+
+		for (int i = 0; i < e->num_segs; i++) {
+			zc_restore_seg(e->segs[i]);
+			snb_free(e->segs[i]);
+		}
+
+		zc->head++;
+		zc->completed++;
+	}
+}
+
+/* Completed ones are returned. The skbs of the others are leaked, 
+ * since the NIC might be still reading them */
+static void zc_cancel(struct port *p, struct queue *tx_queue)
+{
+	struct zc_queue *zc = tx_queue->zc;
+
+	zc_reclaim(tx_queue);
+
+	if (zc->head != zc->tail)
+		log_warn("%s: %u zero-copy packets still in use, "
+				"leaking their skbs\n",
+				p->name, zc->tail - zc->head);
+}
+
+/* The BARs (registers and llrings) of all vports are carved from a few
+ * hugepage-backed memzones (chunks), rather than each from the malloc 
+ * heap, so that those of many vports are packed into as few pages (TLB 
+ * entries) as possible, both for BESS workers and the kernel.
+ * Memzones are physically contiguous, as the kernel expects.
+ * Only the master thread (port creation/destruction) touches them. */
+#define BAR_CHUNK_SIZE		(2 << 20)
+#define BAR_MAX_CHUNKS		64
+#define BAR_MAX_EXTENTS		256	/* free extents per chunk */
+#define BAR_ALIGN		64
+
+struct bar_extent {
+	uint32_t off;
+	uint32_t len;
+};
+
+struct bar_chunk {
+	const struct rte_memzone *mz;
+
+	int num_free;
+	struct bar_extent free[BAR_MAX_EXTENTS];	/* sorted by off */
+};
+
+static struct bar_chunk bar_chunks[BAR_MAX_CHUNKS];
+static int num_bar_chunks;
+
+/* first fit. Returns the offset, or -1 */
+static int64_t chunk_alloc(struct bar_chunk *c, uint32_t len)
+{
+	for (int i = 0; i < c->num_free; i++) {
+		struct bar_extent *e = &c->free[i];
+		uint32_t off = e->off;
+
+		if (e->len < len)
+			continue;
+
+		e->off += len;
+		e->len -= len;
+
+		if (e->len == 0) {
+			c->num_free--;
+			memmove(e, e + 1, (c->num_free - i) * sizeof(*e));
+		}
+
+		return off;
+	}
+
+	return -1;
+}
+
+static void chunk_free(struct bar_chunk *c, uint32_t off, uint32_t len)
+{
+	struct bar_extent *prev;
+	struct bar_extent *next;
+	int i;
+
+	for (i = 0; i < c->num_free; i++)
+		if (c->free[i].off > off)
+			break;
+
+	prev = (i > 0) ? &c->free[i - 1] : NULL;
+	next = (i < c->num_free) ? &c->free[i] : NULL;
+
+	if (prev && prev->off + prev->len == off) {
+		prev->len += len;
+
+		if (next && off + len == next->off) {
+			prev->len += next->len;
+			c->num_free--;
+			memmove(next, next + 1, 
+					(c->num_free - i) * sizeof(*next));
+		}
+		return;
+	}
+
+	if (next && off + len == next->off) {
+		next->off = off;
+		next->len += len;
+		return;
+	}
+
+	if (c->num_free == BAR_MAX_EXTENTS) {
+		log_warn("vport: BAR chunk %s too fragmented, "
+				"leaking %uB\n", c->mz->name, len);
+		return;
+	}
+
+	memmove(&c->free[i + 1], &c->free[i], 
+			(c->num_free - i) * sizeof(c->free[0]));
+	c->free[i].off = off;
+	c->free[i].len = len;
+	c->num_free++;
+}
+
+static struct bar_chunk *new_chunk(uint32_t len)
+{
+	struct bar_chunk *c;
+	char name[RTE_MEMZONE_NAMESIZE];
+	size_t size = RTE_ALIGN_CEIL(len, BAR_CHUNK_SIZE);
+
+	if (num_bar_chunks == BAR_MAX_CHUNKS)
+		return NULL;
+
+	c = &bar_chunks[num_bar_chunks];
+
+	snprintf(name, sizeof(name), "vport_bar%d", num_bar_chunks);
+
+	/* aligned, so that a 2MB chunk lies in a single 2MB page */
+	c->mz = rte_memzone_reserve_aligned(name, size, SOCKET_ID_ANY,
+			RTE_MEMZONE_2MB | RTE_MEMZONE_SIZE_HINT_ONLY,
+			BAR_CHUNK_SIZE);
+	if (!c->mz)
+		return NULL;
+
+	c->num_free = 1;
+	c->free[0].off = 0;
+	c->free[0].len = size;
+
+	num_bar_chunks++;
+
+	return c;
+}
+
+static void *bar_zmalloc(struct vport_priv *priv, int total_bytes)
+{
+	uint32_t len = RTE_ALIGN_CEIL(total_bytes, BAR_ALIGN);
+	struct bar_chunk *c;
+	int64_t off = -1;
+	void *bar;
+	int i;
+
+	for (i = 0; i < num_bar_chunks; i++) {
+		off = chunk_alloc(&bar_chunks[i], len);
+		if (off >= 0)
+			break;
+	}
+
+	if (off < 0 && (c = new_chunk(len)) != NULL) {
+		i = c - bar_chunks;
+		off = chunk_alloc(c, len);
+	}
+
+	if (off < 0) {
+		log_warn("vport: no hugepage memzone for the BAR, "
+				"using the malloc heap\n");
+		priv->bar_chunk = -1;
+		priv->bar_len = total_bytes;
+		return rte_zmalloc(NULL, total_bytes, 0);
+	}
+
+	priv->bar_chunk = i;
+	priv->bar_off = off;
+	priv->bar_len = len;
+
+	bar = (char *)bar_chunks[i].mz->addr + off;
+	memset(bar, 0, len);
+
+	return bar;
+}
+
+static void bar_free(struct vport_priv *priv)
+{
+	if (priv->bar_chunk < 0)
+		rte_free(priv->bar);
+	else
+		chunk_free(&bar_chunks[priv->bar_chunk], 
+				priv->bar_off, priv->bar_len);
+
+	priv->bar = NULL;
+}
+
+static phys_addr_t bar_phys(struct vport_priv *priv)
+{
+	if (priv->bar_chunk < 0)
+		return rte_malloc_virt2phy(priv->bar);
+
+	return bar_chunks[priv->bar_chunk].mz->phys_addr + priv->bar_off;
+}
+
+/* of the memory backing the BAR */
+static uint64_t bar_page_size(struct vport_priv *priv)
+{
+	const struct rte_memseg *ms;
+	uintptr_t addr = (uintptr_t)priv->bar;
+
+	if (priv->bar_chunk >= 0)
+		return bar_chunks[priv->bar_chunk].mz->hugepage_sz;
+
+	ms = rte_eal_get_physmem_layout();
+
+	for (int i = 0; i < RTE_MAX_MEMSEG && ms[i].addr; i++) {
+		uintptr_t start = (uintptr_t)ms[i].addr;
+
+		if (start <= addr && addr < start + ms[i].len)
+			return ms[i].hugepage_sz;
+	}
+
+	return getpagesize();
+}
+
 /* Free an allocated bar, freeing resources in the queues */
 static void free_bar(struct vport_priv *priv)
 {
 	int i;
 	struct sn_conf_space *conf = priv->bar;
 
+	for (i = 0; i < conf->num_txq; i++)
+		rte_free(priv->inc_qs[i].zc);
+
 	for (i = 0; i < conf->num_txq; i++) {
 		drain_drv_to_sn_q(priv->inc_qs[i].drv_to_sn);
 		drain_sn_to_drv_q(priv->inc_qs[i].sn_to_drv);
@@ -134,7 +510,7 @@ static void free_bar(struct vport_priv *priv)
 		drain_sn_to_drv_q(priv->inc_qs[i].sn_to_drv);
 	}
 
-	rte_free(priv->bar);
+	bar_free(priv);
 }
 
 static void *alloc_bar(struct port *p, 
@@ -156,10 +532,13 @@ static void *alloc_bar(struct port *p,
 
 	total_bytes = sizeof(struct sn_conf_space);
 	total_bytes += p->num_queues[PACKET_DIR_INC] * 2 * bytes_per_llring;
+	if (txq_opts->zc_min_len)
+		total_bytes += p->num_queues[PACKET_DIR_INC] * 
+				bytes_per_llring;
 	total_bytes += p->num_queues[PACKET_DIR_OUT] * 
 		(sizeof(struct sn_rxq_registers) + 2 * bytes_per_llring);
 	
-	bar = rte_zmalloc(NULL, total_bytes, 0);
+	bar = bar_zmalloc(priv, total_bytes);
 	assert(bar);
 
 	/* log_debug("vport_host_sndrv: allocated %dB BAR\n", total_bytes); */
@@ -178,6 +557,7 @@ static void *alloc_bar(struct port *p,
 	conf->num_rxq = p->num_queues[PACKET_DIR_OUT];
 	conf->link_on = 1;
 	conf->promisc_on = 1;
+	conf->auto_queue_map = priv->auto_queue_map;
 
 	conf->txq_opts = *txq_opts;
 	conf->rxq_opts = *rxq_opts;
@@ -187,35 +567,52 @@ static void *alloc_bar(struct port *p,
 	/* See sn_common.h for the llring usage */
 
 	for (i = 0; i < conf->num_txq; i++) {
+		int single = p->queue_single[PACKET_DIR_INC][i];
+		
 		/* Driver -> BESS */
 		llring_init((struct llring *)ptr, SLOTS_PER_LLRING,
-				SINGLE_P, SINGLE_C);
+				1, 1);
 		priv->inc_qs[i].drv_to_sn = (struct llring *)ptr;
 		ptr += bytes_per_llring;
 
 		/* BESS -> Driver */
 		llring_init((struct llring *)ptr, SLOTS_PER_LLRING, 
-				SINGLE_P, SINGLE_C);
+				single || SINGLE_P, 1);
 		refill_tx_bufs((struct llring *)ptr);
 		priv->inc_qs[i].sn_to_drv = (struct llring *)ptr;
 		ptr += bytes_per_llring;
+
+		if (txq_opts->zc_min_len) {
+			/* BESS -> Driver, with completed zero-copy skbs */
+			llring_init((struct llring *)ptr, SLOTS_PER_LLRING, 
+					1, 1);
+			priv->inc_qs[i].zc_done = (struct llring *)ptr;
+			ptr += bytes_per_llring;
+
+			priv->inc_qs[i].zc = rte_zmalloc(NULL, 
+					sizeof(struct zc_queue), 0);
+			assert(priv->inc_qs[i].zc);
+		}
 	}
 
 	for (i = 0; i < conf->num_rxq; i++) {
+		int single = p->queue_single[PACKET_DIR_OUT][i];
+
 		/* RX queue registers */
 		priv->out_qs[i].rx_regs = (struct sn_rxq_registers *)ptr;
+		priv->out_qs[i].rx_regs->kick_cpu = -1;
 		ptr += sizeof(struct sn_rxq_registers);
 
 		/* Driver -> BESS */
 		llring_init((struct llring *)ptr, 
 				SLOTS_PER_LLRING, 
-				SINGLE_P, SINGLE_C);
+				1, single || SINGLE_C);
 		priv->out_qs[i].drv_to_sn = (struct llring *)ptr;
 		ptr += bytes_per_llring;
 
 		/* BESS -> Driver */
 		llring_init((struct llring *)ptr, SLOTS_PER_LLRING, 
-				SINGLE_P, SINGLE_C);
+				single || SINGLE_P, 1);
 		priv->out_qs[i].sn_to_drv = (struct llring *)ptr;
 		ptr += bytes_per_llring;
 	}
@@ -309,42 +706,172 @@ static struct snobj *docker_container_pid(char *cid, int *container_pid)
 	return NULL;
 }
 
-static int set_ip_addr_single(struct port *p, char *ip_addr)
+/* "ip addr add" over rtnetlink, in the current network namespace
+ * (of the calling thread). Without a prefix length, ip_addr is a host 
+ * address (/32 or /128), as with "ip addr add". Returns 0 or -errno */
+static int set_ip_addr_single(struct port *p, const char *ip_addr)
 {
 	struct vport_priv *priv = get_port_priv(p);
 
-	FILE *fp;
+	struct {
+		struct nlmsghdr nh;
+		struct ifaddrmsg ifa;
+		char attrs[64];
+	} req;
 
-	char buf[1024];
+	struct {
+		struct nlmsghdr nh;
+		struct nlmsgerr err;
+	} ack;
+
+	struct sockaddr_nl sa = {.nl_family = AF_NETLINK};
+	struct ifreq ifr;
+	struct rtattr *rta;
+
+	char addr_str[INET6_ADDRSTRLEN];
+	unsigned char addr[sizeof(struct in6_addr)];
+	const char *slash;
+	int family;
+	int addr_len;
+	int prefix;
 
+	int fd;
 	int ret;
-	int exit_code;
 
-	ret = snprintf(buf, sizeof(buf), "ip addr add %s dev %s 2>&1",
-			ip_addr, priv->ifname);
-	if (ret >= sizeof(buf))
+	slash = strchr(ip_addr, '/');
+	if (!slash)
+		slash = ip_addr + strlen(ip_addr);
+
+	if (slash - ip_addr >= sizeof(addr_str))
 		return -EINVAL;
 
-	fp = popen(buf, "r");
-	if (!fp)
-		return -errno;
+	memcpy(addr_str, ip_addr, slash - ip_addr);
+	addr_str[slash - ip_addr] = '\0';
 
-	ret = pclose(fp);
-	exit_code = WEXITSTATUS(ret);
-	if (exit_code)
+	if (inet_pton(AF_INET, addr_str, addr) == 1) {
+		family = AF_INET;
+		addr_len = 4;
+	} else if (inet_pton(AF_INET6, addr_str, addr) == 1) {
+		family = AF_INET6;
+		addr_len = 16;
+	} else
 		return -EINVAL;
 
-	return 0;
+	prefix = *slash ? atoi(slash + 1) : addr_len * 8;
+	if (prefix < 0 || prefix > addr_len * 8)
+		return -EINVAL;
+
+	fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (fd < 0)
+		return -errno;
+
+	memset(&ifr, 0, sizeof(ifr));
+	strcpy(ifr.ifr_name, priv->ifname);
+	if (ioctl(fd, SIOCGIFINDEX, &ifr) < 0) {
+		ret = -errno;
+		goto out;
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifaddrmsg));
+	req.nh.nlmsg_type = RTM_NEWADDR;
+	req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | NLM_F_CREATE | 
+			NLM_F_EXCL;
+	req.ifa.ifa_family = family;
+	req.ifa.ifa_prefixlen = prefix;
+	req.ifa.ifa_index = ifr.ifr_ifindex;
+
+	/* as iproute2 does, IFA_LOCAL and IFA_ADDRESS are the same */
+	for (int type = IFA_LOCAL; type >= IFA_ADDRESS; type--) {
+		rta = (struct rtattr *)((char *)&req + 
+				NLMSG_ALIGN(req.nh.nlmsg_len));
+		rta->rta_type = type;
+		rta->rta_len = RTA_LENGTH(addr_len);
+		memcpy(RTA_DATA(rta), addr, addr_len);
+		req.nh.nlmsg_len = NLMSG_ALIGN(req.nh.nlmsg_len) + 
+				RTA_ALIGN(rta->rta_len);
+	}
+
+	if (sendto(fd, &req, req.nh.nlmsg_len, 0, 
+				(struct sockaddr *)&sa, sizeof(sa)) < 0) {
+		ret = -errno;
+		goto out;
+	}
+
+	ret = recv(fd, &ack, sizeof(ack), 0);
+	if (ret < 0)
+		ret = -errno;
+	else if (ret < sizeof(ack) || ack.nh.nlmsg_type != NLMSG_ERROR)
+		ret = -EPROTO;
+	else
+		ret = ack.err.error;	/* 0 or -errno */
+
+out:
+	close(fd);
+	return ret;
 }
 
-static struct snobj *set_ip_addr(struct port *p, struct snobj *arg)
+struct ip_addr_job {
+	struct port *port;
+	struct snobj *arg;	/* str or list of str */
+	int ret;
+};
+
+/* setns() only changes the namespace of this thread, so there is no need
+ * to fork BESS (with all its hugepages mapped) as before */
+static void *ip_addr_thread(void *arg)
 {
-	struct vport_priv *priv = get_port_priv(p);
+	struct ip_addr_job *job = arg;
+	struct vport_priv *priv = get_port_priv(job->port);
+	int fd = -1;
+
+	if (priv->container_pid) {
+		char buf[64];
+
+		sprintf(buf, "/proc/%d/ns/net", priv->container_pid);
+		fd = open(buf, O_RDONLY);
+		if (fd < 0) {
+			log_perr("open(/proc/pid/ns/net)");
+			job->ret = -errno;
+			return NULL;
+		}
+	}
+
+	if (priv->container_pid || priv->netns_fd >= 0) {
+		job->ret = setns(fd >= 0 ? fd : priv->netns_fd, CLONE_NEWNET);
+		if (job->ret < 0) {
+			log_perr("setns()");
+			job->ret = -errno;
+			goto out;
+		}
+	}
+
+	if (snobj_type(job->arg) == TYPE_STR) {
+		job->ret = set_ip_addr_single(job->port, 
+				snobj_str_get(job->arg));
+	} else {
+		for (int i = 0; i < job->arg->size; i++) {
+			struct snobj *addr = snobj_list_get(job->arg, i);
+
+			job->ret = set_ip_addr_single(job->port, 
+					snobj_str_get(addr));
+			if (job->ret < 0)
+				break;
+		}
+	}
 
-	int child_pid;
+out:
+	if (fd >= 0)
+		close(fd);
 
-	int ret = 0;
-	int namespace = 0;
+	return NULL;
+}
+
+static struct snobj *set_ip_addr(struct port *p, struct snobj *arg)
+{
+	struct ip_addr_job job = {.port = p, .arg = arg, .ret = 0};
+	pthread_t thread;
+	int ret;
 
 	if (snobj_type(arg) == TYPE_STR || snobj_type(arg) == TYPE_LIST) {
 		if (snobj_type(arg) == TYPE_LIST) {
@@ -360,103 +887,118 @@ static struct snobj *set_ip_addr(struct port *p, struct snobj *arg)
 	} else
 		goto invalid_type;
 
-	/* change network namespace if necessary */
-	if (priv->container_pid || priv->netns_fd >= 0) {
-		namespace = 1;
-
-		child_pid = fork();
-		if (child_pid < 0)
-			return snobj_errno(-child_pid);
-
-		if (child_pid == 0) {
-			char buf[1024];
-			int fd;
-
-			if (priv->container_pid) {
-				sprintf(buf, "/proc/%d/ns/net", priv->container_pid);
-				fd = open(buf, O_RDONLY);
-				if (fd < 0) {
-					log_perr("open(/proc/pid/ns/net)");
-					exit(errno <= 255 ? errno: ENOMSG);
-				}
-			} else
-				fd = priv->netns_fd;
-
-			ret = setns(fd, 0);
-			if (ret < 0) {
-				log_perr("setns()");
-				exit(errno <= 255 ? errno: ENOMSG);
-			}
-		} else
-			goto wait_child;
+	ret = pthread_create(&thread, NULL, ip_addr_thread, &job);
+	if (ret)
+		return snobj_errno(ret);
+
+	pthread_join(thread, NULL);
+
+	if (job.ret < 0)
+		return snobj_err(-job.ret, "Failed to set IP addresses " \
+				"(incorrect IP address format?)");
+
+	return NULL;
+
+invalid_type:
+	return snobj_err(EINVAL, "'ip_addr' must be a string or list " \
+			"of IPv4/v6 addresses (e.g., '10.0.20.1/24')");
+}
+
+static void kick_rx_queue(struct port *p, queue_t qid)
+{
+	struct vport_priv *priv = get_port_priv(p);
+	struct queue *rx_queue = &priv->out_qs[qid];
+	int cpu;
+	int ret;
+
+	rx_queue->coal.pending = 0;
+
+	/* TODO: generic notification architecture */
+	if (__sync_bool_compare_and_swap(&rx_queue->rx_regs->irq_disabled,
+				0, 1)) 
+	{
+		/* with auto_queue_map, the CPU that owns the paired TX queue */
+		cpu = rx_queue->rx_regs->kick_cpu;
+		if (cpu < 0)
+			cpu = priv->map.rxq_to_cpu[qid];
+
+		ret = ioctl(priv->fd, SN_IOC_KICK_RX, 1 << cpu);
+		if (ret)
+			log_perr("ioctl(kick_rx)");
+
+		rx_queue->coal.kicks++;
 	}
+}
 
-	switch (snobj_type(arg)) {
-	case TYPE_STR: 
-		ret = set_ip_addr_single(p, snobj_str_get(arg));
-		if (ret < 0) {
-			if (namespace) {
-				/* it must be the child */
-				assert(child_pid == 0);	
-				exit(errno <= 255 ? errno: ENOMSG);
-			}
-		}
-		break;
-
-	case TYPE_LIST: 
-		if (!arg->size)
-			goto invalid_type;
-
-		for (int i = 0; i < arg->size; i++) {
-			struct snobj *addr = snobj_list_get(arg, i);
-
-			ret = set_ip_addr_single(p, snobj_str_get(addr));
-			if (ret < 0) {
-				if (namespace) {
-					/* it must be the child */
-					assert(child_pid == 0);	
-					exit(errno <= 255 ? errno: ENOMSG);
-				} else
-					break;
-			}
-		}
+static void kick_timer_expired(struct timer *t)
+{
+	struct kick_timer *kt = container_of(t, struct kick_timer, timer);
+	struct vport_priv *priv = get_port_priv(kt->port);
+	struct irq_coalesce *coal = &priv->out_qs[kt->qid].coal;
+
+	/* already kicked by packet count */
+	if (!coal->pending)
+		return;
+
+	coal->thresh = RTE_MAX(coal->thresh / 2, 1);
+	coal->timer_kicks++;
 
-		break;
+	kick_rx_queue(kt->port, kt->qid);
+}
 
-	default:
-		assert(0);
+static struct snobj *init_coalesce(struct port *p, struct snobj *arg)
+{
+	struct vport_priv *priv = get_port_priv(p);
+
+	uint32_t max_pkts = 0;
+	uint64_t timeout_us = COALESCE_DEF_US;
+
+	if (arg) {
+		if (snobj_type(arg) != TYPE_MAP)
+			return snobj_err(EINVAL, "'irq_coalesce' must be a map "
+					"of 'max_pkts' and 'timeout_us'");
+
+		max_pkts = COALESCE_DEF_PKTS;
+
+		if (snobj_eval_exists(arg, "max_pkts"))
+			max_pkts = snobj_eval_uint(arg, "max_pkts");
+
+		if (snobj_eval_exists(arg, "timeout_us"))
+			timeout_us = snobj_eval_uint(arg, "timeout_us");
+
+		if (max_pkts > SLOTS_PER_LLRING)
+			return snobj_err(EINVAL, "'max_pkts' must be no "
+					"more than %d", SLOTS_PER_LLRING);
+
+		if (timeout_us == 0 || timeout_us > 1000000)
+			return snobj_err(EINVAL, "'timeout_us' must be "
+					"between 1 and 1000000");
 	}
 
-	if (namespace) {
-		if (child_pid == 0) {
-			if (ret < 0) {
-				ret = -ret;
-				exit(ret <= 255 ? ret: ENOMSG);
-			} else
-				exit(0);
-		} else {
-			int exit_status;
+	for (queue_t qid = 0; qid < p->num_queues[PACKET_DIR_OUT]; qid++) {
+		struct irq_coalesce *coal = &priv->out_qs[qid].coal;
 
-wait_child:
-			ret = waitpid(child_pid, &exit_status, 0);
+		coal->max_pkts = (max_pkts > 1) ? max_pkts : 0;
+		coal->timeout_ns = timeout_us * 1000;
+		coal->thresh = 1;
 
-			if (ret >= 0) {
-				assert(ret == child_pid);
-				ret = -WEXITSTATUS(exit_status);
-			} else
-				log_perr("waitpid()");
+		for (int wid = 0; wid < MAX_WORKERS; wid++) {
+			struct kick_timer *kt = &coal->timers[wid];
+
+			timer_init(&kt->timer, kick_timer_expired, NULL);
+			kt->port = p;
+			kt->qid = qid;
 		}
 	}
 
-	if (ret < 0)
-		return snobj_err(-ret, "Failed to set IP addresses " \
-				"(incorrect IP address format?)");
-
 	return NULL;
+}
 
-invalid_type:
-	return snobj_err(EINVAL, "'ip_addr' must be a string or list " \
-			"of IPv4/v6 addresses (e.g., '10.0.20.1/24')");
+/* the timer lives in the wheel of the worker */
+static int cancel_kick_timer(void *arg)
+{
+	timer_cancel(arg);
+	return 0;
 }
 
 static void deinit_port(struct port *p)
@@ -464,6 +1006,21 @@ static void deinit_port(struct port *p)
 	struct vport_priv *priv = get_port_priv(p);
 	int ret;
 
+	for (queue_t qid = 0; qid < p->num_queues[PACKET_DIR_OUT]; qid++) {
+		struct irq_coalesce *coal = &priv->out_qs[qid].coal;
+
+		for (int wid = 0; wid < MAX_WORKERS; wid++) {
+			struct timer *t = &coal->timers[wid].timer;
+
+			if (timer_is_armed(t))
+				run_on_worker(wid, cancel_kick_timer, t);
+		}
+	}
+
+	for (queue_t qid = 0; qid < p->num_queues[PACKET_DIR_INC]; qid++)
+		if (priv->inc_qs[qid].zc)
+			zc_cancel(p, &priv->inc_qs[qid]);
+
 	ret = ioctl(priv->fd, SN_IOC_RELEASE_HOSTNIC);
 	if (ret < 0)
 		log_perr("SN_IOC_RELEASE_HOSTNIC");	
@@ -491,6 +1048,10 @@ static struct snobj *init_port(struct port *p, struct snobj *conf)
 	struct tx_queue_opts txq_opts = {};
 	struct rx_queue_opts rxq_opts = {};
 
+	struct init_stages *stages = &priv->init_cycles;
+	uint64_t start = rdtsc();
+	uint64_t t = start;
+
 	priv->fd = -1;
 	priv->netns_fd = -1;
 	priv->container_pid = 0;
@@ -514,6 +1075,8 @@ static struct snobj *init_port(struct port *p, struct snobj *conf)
 
 		if (err)
 			goto fail;
+
+		stages->container = rdtsc() - t;
 	}
 
 	if (snobj_eval_exists(conf, "container_pid")) {
@@ -560,27 +1123,73 @@ static struct snobj *init_port(struct port *p, struct snobj *conf)
 		goto fail;
 	}
 
+	/* the kernel does not offload IPv4 header checksums,
+	 * and VLAN tags are pushed by txq_opts */
+	p->tx_offload_capa = DEV_TX_OFFLOAD_UDP_CKSUM |
+			DEV_TX_OFFLOAD_TCP_CKSUM |
+			DEV_TX_OFFLOAD_TCP_TSO;
+
+	/* GSO and checksum offloading from the kernel. Large packets are
+	 * dropped by PortOut, unless the port is capable of TSO */
+	txq_opts.offload = !!snobj_eval_int(conf, "tx_offload");
+
+	if (snobj_eval_exists(conf, "zerocopy_tx")) {
+		int64_t min_len = snobj_eval_int(conf, "zerocopy_tx");
+
+		if (min_len < 0 || min_len > UINT16_MAX) {
+			err = snobj_err(EINVAL, "'zerocopy_tx' (minimum packet "
+					"size) must be between 0 and %d",
+					UINT16_MAX);
+			goto fail;
+		}
+
+		txq_opts.zc_min_len = min_len;
+	}
+
+	err = parse_single_queues(p, PACKET_DIR_INC, 
+			snobj_eval(conf, "spsc_inc"));
+	if (err)
+		goto fail;
+
+	err = parse_single_queues(p, PACKET_DIR_OUT, 
+			snobj_eval(conf, "spsc_out"));
+	if (err)
+		goto fail;
+
+	err = init_coalesce(p, snobj_eval(conf, "irq_coalesce"));
+	if (err)
+		goto fail;
+
 	txq_opts.tci = snobj_eval_uint(conf, "tx_tci");
 	txq_opts.outer_tci = snobj_eval_uint(conf, "tx_outer_tci");
 	rxq_opts.loopback = snobj_eval_uint(conf, "loopback");
 
+	priv->auto_queue_map = snobj_eval_int(conf, "auto_queue_map");
+
 	priv->bar = alloc_bar(p, &txq_opts, &rxq_opts);
 
+	t = rdtsc();
+
 	ret = ioctl(priv->fd, SN_IOC_CREATE_HOSTNIC, 
-			rte_malloc_virt2phy(priv->bar));
+			bar_phys(priv));
 	if (ret < 0) {
 		err = snobj_errno_details(-ret, 
 				snobj_str("SN_IOC_CREATE_HOSTNIC failure"));
 		goto fail;
 	}
 
+	stages->create = rdtsc() - t;
+
 	if (snobj_eval_exists(conf, "ip_addr")) {
+		t = rdtsc();
 		err = set_ip_addr(p, snobj_eval(conf, "ip_addr"));
 		
 		if (err) {
 			deinit_port(p);
 			goto fail;
 		}
+
+		stages->ip_addr = rdtsc() - t;
 	}
 
 	if (priv->netns_fd >= 0) {
@@ -606,10 +1215,15 @@ static struct snobj *init_port(struct port *p, struct snobj *conf)
 		}
 	}
 
+	t = rdtsc();
+
 	ret = ioctl(priv->fd, SN_IOC_SET_QUEUE_MAPPING, &priv->map);
 	if (ret < 0)
 		log_perr("ioctl(SN_IOC_SET_QUEUE_MAPPING)");	
 
+	stages->queue_map = rdtsc() - t;
+	stages->total = rdtsc() - start;
+
 	return NULL;
 
 fail:
@@ -622,6 +1236,97 @@ fail:
 	return err;
 }
 
+/* GSO (or zero-copy) skbs from the kernel come as chains of snbufs.
+ * zc is where the external segments are recorded, NULL if none */
+static void build_chain(struct snbuf *pkt, const struct sn_tx_desc *tx_desc,
+		struct zc_pending *zc)
+{
+	struct rte_mbuf *tail = &pkt->mbuf;
+
+	tail->data_len = tx_desc->seg_len;
+
+	while (tx_desc->next) {
+		struct snbuf *seg = (struct snbuf *)tx_desc->next;
+
+		tx_desc = (const struct sn_tx_desc *)seg->_scratchpad;
+
+		if (zc && tx_desc->ext_seg) {
+			seg->mbuf.buf_physaddr = tx_desc->ext_seg;
+			seg->mbuf.data_off = 0;
+			rte_mbuf_refcnt_update(&seg->mbuf, 1);
+			zc->segs[zc->num_segs++] = seg;
+		} else
+			seg->mbuf.data_off = SNBUF_HEADROOM;
+
+		seg->mbuf.data_len = tx_desc->seg_len;
+		seg->mbuf.next = NULL;
+
+		tail->next = &seg->mbuf;
+		tail = &seg->mbuf;
+		pkt->mbuf.nb_segs++;
+	}
+}
+
+/* For protocols other than TCP/UDP. Linear packets only. */
+static void do_csum_now(struct snbuf *pkt, const struct sn_tx_metadata *meta)
+{
+	char *head = snb_head_data(pkt);
+	uint16_t sum;
+
+	if (!snb_is_linear(pkt) || meta->csum_dest + 2 > snb_head_len(pkt) ||
+			meta->csum_start >= snb_head_len(pkt))
+		return;
+
+	/* the checksum field has the pseudo header checksum */
+	sum = rte_raw_cksum(head + meta->csum_start, 
+			snb_head_len(pkt) - meta->csum_start);
+	*(uint16_t *)(head + meta->csum_dest) = ~sum;
+}
+
+/* Checksum (and GSO) requests from the kernel become TX offload requests,
+ * so that PortOut hands them to the NIC, or does them in software */
+static void process_tx_metadata(struct snbuf *pkt,
+		const struct sn_tx_metadata *meta)
+{
+	char *head = snb_head_data(pkt);
+	uint16_t csum_offset = meta->csum_dest - meta->csum_start;
+	int l2_len = 2 * ETHER_ADDR_LEN;
+	int l3_len;
+
+	/* skip VLAN tags (e.g., pushed by txq_opts) */
+	for (;;) {
+		uint16_t ethertype = rte_be_to_cpu_16(*(uint16_t *)
+				(head + l2_len));
+
+		if (ethertype != 0x8100 && ethertype != 0x88a8)
+			break;
+
+		l2_len += 4;
+	}
+
+	l2_len += 2;
+
+	l3_len = meta->csum_start - l2_len;
+	if (unlikely(l3_len <= 0 || meta->csum_start >= snb_head_len(pkt)))
+		return;
+
+	if (csum_offset == offsetof(struct tcp_hdr, cksum)) {
+		struct tcp_hdr *tcp;
+
+		if (!meta->gso_mss) {
+			snb_tx_offload_csum(pkt, l2_len, l3_len, IPPROTO_TCP);
+			return;
+		}
+
+		tcp = (struct tcp_hdr *)(head + meta->csum_start);
+		snb_tx_offload_tso(pkt, l2_len, l3_len, 
+				(tcp->data_off >> 4) * 4, meta->gso_mss);
+	} else if (csum_offset == offsetof(struct udp_hdr, dgram_cksum))
+		snb_tx_offload_csum(pkt, l2_len, l3_len, IPPROTO_UDP);
+	else 
+		do_csum_now(pkt, meta);
+}
+
 static int vport_recv_pkts(struct port *p, queue_t qid, 
 		snb_array_t pkts, int max_cnt)
 {
@@ -631,6 +1336,18 @@ static int vport_recv_pkts(struct port *p, queue_t qid,
 	int cnt;
 	int i;
 
+	if (unlikely(p->queue_single[PACKET_DIR_INC][qid]) &&
+			!check_queue_owner(p, PACKET_DIR_INC, qid))
+		return 0;
+
+	if (tx_queue->zc) {
+		zc_reclaim(tx_queue);
+
+		max_cnt = RTE_MIN(max_cnt, (int)(ZC_MAX_PENDING - 
+				(tx_queue->zc->tail - tx_queue->zc->head)));
+	}
+
+	/* always a single consumer (a PortInc or QueueInc task) */
 	cnt = llring_sc_dequeue_burst(tx_queue->drv_to_sn, 
 			(void **)pkts, max_cnt);
 
@@ -648,38 +1365,128 @@ static int vport_recv_pkts(struct port *p, queue_t qid,
 		pkt->mbuf.pkt_len = len;
 		pkt->mbuf.data_len = len;
 
-		/* TODO: process sn_tx_metadata */
+		/* as if from a NIC with RSS, so that modules can steer 
+		 * the flow without hashing the headers (e.g., HashLB) */
+		pkt->mbuf.hash.rss = tx_desc->meta.flow_hash;
+		if (tx_desc->meta.flow_hash)
+			pkt->mbuf.ol_flags |= PKT_RX_RSS_HASH;
+		else
+			pkt->mbuf.ol_flags &= ~PKT_RX_RSS_HASH;
+
+		if (unlikely(tx_desc->zc_cookie)) {
+			struct zc_queue *zc = tx_queue->zc;
+			struct zc_pending *e;
+			
+			e = &zc->arr[zc->tail++ % ZC_MAX_PENDING];
+			e->cookie = tx_desc->zc_cookie;
+			e->num_segs = 0;
+
+			build_chain(pkt, tx_desc, e);
+			zc->packets++;
+		} else if (unlikely(tx_desc->next))
+			build_chain(pkt, tx_desc, NULL);
+
+		if (tx_desc->meta.csum_start != SN_TX_CSUM_DONT)
+			process_tx_metadata(pkt, &tx_desc->meta);
 	}
 
 	return cnt;
 }
 
+/* The ring may hold thousands of packets after a burst. The rest is left
+ * for the next call if the task runs out of its cycle budget */
 static void reclaim_packets(struct llring *ring)
 {
 	void *objs[MAX_PKT_BURST];
 	int ret;
 
 	for (;;) {
-		ret = llring_mc_dequeue_burst(ring, objs, MAX_PKT_BURST);	
+		ret = llring_dequeue_burst(ring, objs, MAX_PKT_BURST);	
 		if (ret == 0)
 			break;
 
 		snb_free_bulk((snb_array_t) objs, ret);
+
+		if (task_over_budget())
+			break;
 	}
 }
 
+/* TX offloads of BESS are RX offloads for the kernel.
+ * For TSO, DPDK wants the pseudo-header checksum without the length (see
+ * snb_tx_offload_tso()), but the kernel wants it with the length for its
+ * CHECKSUM_PARTIAL GSO packets, so the TCP checksum field is re-seeded in
+ * place. Note that this is also seen by other references to the packet
+ * data (e.g., by Replicate). */
+static inline void set_rx_metadata(struct sn_rx_metadata *meta,
+		struct rte_mbuf *mbuf)
+{
+	uint64_t l4_flags = mbuf->ol_flags & PKT_TX_L4_MASK;
+	uint16_t csum_start;
+
+	*meta = (struct sn_rx_metadata){};
+
+	if (likely(!l4_flags))
+		return;
+
+	csum_start = mbuf->l2_len + mbuf->l3_len;
+
+	if (mbuf->ol_flags & PKT_TX_TCP_SEG) {
+		char *l3 = rte_pktmbuf_mtod(mbuf, char *) + mbuf->l2_len;
+		struct tcp_hdr *tcp = (struct tcp_hdr *)(l3 + mbuf->l3_len);
+
+		tcp->cksum = __snb_phdr_cksum(l3,
+				mbuf->ol_flags & ~PKT_TX_TCP_SEG);
+
+		meta->gso_mss = mbuf->tso_segsz;
+		meta->gso_tcpv6 = !!(mbuf->ol_flags & PKT_TX_IPV6);
+	}
+
+	meta->csum_state = SN_RX_CSUM_PARTIAL;
+	meta->csum_start = csum_start;
+	meta->csum_dest = csum_start + ((l4_flags == PKT_TX_TCP_CKSUM) ?
+			offsetof(struct tcp_hdr, cksum) :
+			offsetof(struct udp_hdr, dgram_cksum));
+}
+
 static int vport_send_pkts(struct port *p, queue_t qid, 
 		snb_array_t pkts, int cnt)
 {
 	struct vport_priv *priv = get_port_priv(p);
 	struct queue *rx_queue = &priv->out_qs[qid];
+	struct irq_coalesce *coal;
 
 	phys_addr_t paddr[MAX_PKT_BURST];
 
 	int ret;
 
+	if (unlikely(p->queue_single[PACKET_DIR_OUT][qid]) &&
+			!check_queue_owner(p, PACKET_DIR_OUT, qid))
+		return 0;
+
 	reclaim_packets(rx_queue->drv_to_sn);
 
+	/* The descriptor lives in the scratchpad of the snbuf, so a shared 
+	 * one (e.g., by Replicate) is sent as an indirect copy of its own */
+	for (int i = 0; i < cnt; i++) {
+		struct snbuf *clone;
+
+		if (likely(rte_mbuf_refcnt_read(&pkts[i]->mbuf) == 1))
+			continue;
+
+		clone = snb_clone(pkts[i]);
+		if (!clone) {
+			cnt = i;
+			break;
+		}
+
+		snb_free(pkts[i]);
+		pkts[i] = clone;
+	}
+
+	if (unlikely(cnt == 0))
+		return 0;
+
 	for (int i = 0; i < cnt; i++) {
 		struct snbuf *snb = pkts[i];
 
@@ -705,7 +1512,7 @@ static int vport_send_pkts(struct port *p, queue_t qid,
 		rx_desc->seg = snb_dma_addr(snb);
 		rx_desc->next = 0;
 
-		rx_desc->meta = (struct sn_rx_metadata){};
+		set_rx_metadata(&rx_desc->meta, mbuf);
 
 		for (struct rte_mbuf *seg = mbuf->next; seg; seg = seg->next) {
 			struct sn_rx_desc *next_desc;
@@ -723,24 +1530,126 @@ static int vport_send_pkts(struct port *p, queue_t qid,
 		}
 	}
 
-	ret = llring_mp_enqueue_bulk(rx_queue->sn_to_drv, (void **)paddr, cnt);
+	ret = llring_enqueue_bulk(rx_queue->sn_to_drv, (void **)paddr, cnt);
 
 	if (ret == -LLRING_ERR_NOBUF)
 		return 0;
 
-	/* TODO: generic notification architecture */
-	if (__sync_bool_compare_and_swap(&rx_queue->rx_regs->irq_disabled,
-				0, 1)) 
-	{
-		ret = ioctl(priv->fd, SN_IOC_KICK_RX, 
-				1 << priv->map.rxq_to_cpu[qid]);
-		if (ret)
-			log_perr("ioctl(kick_rx)");
+	coal = &rx_queue->coal;
+
+	if (!coal->max_pkts) {
+		kick_rx_queue(p, qid);
+		return cnt;
+	}
+
+	/* the kernel is polling, so it will see the packets anyway */
+	if (rx_queue->rx_regs->irq_disabled) {
+		coal->pending = 0;
+		return cnt;
+	}
+
+	coal->pending += cnt;
+
+	if (coal->pending >= coal->thresh) {
+		coal->thresh = RTE_MIN(coal->thresh * 2, coal->max_pkts);
+		kick_rx_queue(p, qid);
+	} else {
+		struct timer *t = &coal->timers[ctx.wid].timer;
+
+		if (!timer_is_armed(t))
+			timer_arm_ns(t, coal->timeout_ns);
 	}
 
 	return cnt;
 }
 
+static struct snobj *vport_driver_stats(struct port *p)
+{
+	struct vport_priv *priv = get_port_priv(p);
+	struct snobj *queues = snobj_list();
+	struct snobj *r = snobj_map();
+
+	for (queue_t qid = 0; qid < p->num_queues[PACKET_DIR_OUT]; qid++) {
+		const struct irq_coalesce *coal = &priv->out_qs[qid].coal;
+		struct snobj *q = snobj_map();
+
+		snobj_map_set(q, "queue", snobj_int(qid));
+		snobj_map_set(q, "max_pkts", snobj_uint(coal->max_pkts));
+		snobj_map_set(q, "timeout_us", 
+				snobj_uint(coal->timeout_ns / 1000));
+		snobj_map_set(q, "thresh", snobj_uint(coal->thresh));
+		snobj_map_set(q, "pending", snobj_uint(coal->pending));
+		snobj_map_set(q, "kicks", snobj_uint(coal->kicks));
+		snobj_map_set(q, "timer_kicks", snobj_uint(coal->timer_kicks));
+		snobj_list_add(queues, q);
+	}
+
+	snobj_map_set(r, "irq_coalesce", queues);
+
+	{
+		const struct init_stages *stages = &priv->init_cycles;
+		struct snobj *init = snobj_map();
+
+		snobj_map_set(init, "container", 
+				snobj_double(tsc_to_us(stages->container)));
+		snobj_map_set(init, "create", 
+				snobj_double(tsc_to_us(stages->create)));
+		snobj_map_set(init, "ip_addr", 
+				snobj_double(tsc_to_us(stages->ip_addr)));
+		snobj_map_set(init, "queue_map", 
+				snobj_double(tsc_to_us(stages->queue_map)));
+		snobj_map_set(init, "total", 
+				snobj_double(tsc_to_us(stages->total)));
+
+		snobj_map_set(r, "init_us", init);
+	}
+
+	/* pages (TLB entries) spanned by the registers and rings */
+	{
+		struct snobj *bar = snobj_map();
+		uint64_t pgsz = bar_page_size(priv);
+		uintptr_t start = (uintptr_t)priv->bar;
+		uintptr_t end = start + priv->bar_len;
+
+		snobj_map_set(bar, "bytes", snobj_uint(priv->bar_len));
+		snobj_map_set(bar, "page_size", snobj_uint(pgsz));
+		snobj_map_set(bar, "pages",
+				snobj_uint((end - 1) / pgsz - start / pgsz + 1));
+
+		if (priv->bar_chunk >= 0) {
+			snobj_map_set(bar, "memzone", snobj_str(
+					bar_chunks[priv->bar_chunk].mz->name));
+			snobj_map_set(bar, "offset", 
+					snobj_uint(priv->bar_off));
+		}
+
+		snobj_map_set(r, "bar", bar);
+	}
+
+	if (priv->inc_qs[0].zc) {
+		queues = snobj_list();
+
+		for (queue_t qid = 0; qid < p->num_queues[PACKET_DIR_INC]; 
+				qid++) 
+		{
+			const struct zc_queue *zc = priv->inc_qs[qid].zc;
+			struct snobj *q = snobj_map();
+
+			snobj_map_set(q, "queue", snobj_int(qid));
+			snobj_map_set(q, "packets", snobj_uint(zc->packets));
+			snobj_map_set(q, "completed", 
+					snobj_uint(zc->completed));
+			snobj_map_set(q, "pending", 
+					snobj_uint(zc->tail - zc->head));
+			snobj_list_add(queues, q);
+		}
+
+		snobj_map_set(r, "zerocopy_tx", queues);
+	}
+
+	return r;
+}
+
 static const struct driver vport_host = {
 	.name 		= "VPort",
 	.def_port_name	= "vport",
@@ -748,6 +1657,7 @@ static const struct driver vport_host = {
 	.init_driver	= init_driver,
 	.init_port 	= init_port,
 	.deinit_port	= deinit_port,
+	.driver_stats	= vport_driver_stats,
 	.recv_pkts 	= vport_recv_pkts,
 	.send_pkts 	= vport_send_pkts,
 };
@@ -19,8 +19,9 @@
  * Not sure how to tune this... */
 #define SLOTS_WATERMARK		((SLOTS_PER_LLRING >> 3) * 7)	/* 87.5% */
 
-/* Disable (0) single producer/consumer mode for now.
- * This is slower, but just to be on the safe side. :) */
+/* Disable (0) single producer/consumer mode of the other side for now.
+ * This is slower, but just to be on the safe side. :)
+ * The BESS side can be single, per queue, with "spsc_inc"/"spsc_out" */
 #define SINGLE_P		0
 #define SINGLE_C		0
 
@@ -82,6 +83,18 @@ static struct snobj *vport_init_port(struct port *p, struct snobj *arg)
 	FILE* fp;
 	size_t bar_address;
 
+	struct snobj *err;
+
+	err = parse_single_queues(p, PACKET_DIR_INC, 
+			snobj_eval(arg, "spsc_inc"));
+	if (err)
+		return err;
+
+	err = parse_single_queues(p, PACKET_DIR_OUT, 
+			snobj_eval(arg, "spsc_out"));
+	if (err)
+		return err;
+
 	bytes_per_llring = llring_bytes_with_slots(SLOTS_PER_LLRING);
 	total_bytes =	sizeof(struct vport_bar) +
 			(bytes_per_llring * (num_inc_q + num_out_q)) +
@@ -105,8 +118,8 @@ static struct snobj *vport_init_port(struct port *p, struct snobj *arg)
 			(struct vport_inc_regs*)ptr;
 		ptr += sizeof(struct vport_inc_regs);
 
-		llring_init((struct llring *)ptr, SLOTS_PER_LLRING,
-				SINGLE_P, SINGLE_C);
+		llring_init((struct llring *)ptr, SLOTS_PER_LLRING, SINGLE_P, 
+				p->queue_single[PACKET_DIR_INC][i] || SINGLE_C);
 		llring_set_water_mark((struct llring *)ptr, SLOTS_WATERMARK);
 		bar->inc_qs[i] = (struct llring *)ptr;
 		priv->inc_qs[i] = bar->inc_qs[i];
@@ -119,8 +132,9 @@ static struct snobj *vport_init_port(struct port *p, struct snobj *arg)
 			(struct vport_out_regs*)ptr;
 		ptr += sizeof(struct vport_out_regs);
 
-		llring_init((struct llring *)ptr, SLOTS_PER_LLRING,
-				SINGLE_P, SINGLE_C);
+		llring_init((struct llring *)ptr, SLOTS_PER_LLRING, 
+				p->queue_single[PACKET_DIR_OUT][i] || SINGLE_P, 
+				SINGLE_C);
 		llring_set_water_mark((struct llring *)ptr, SLOTS_WATERMARK);
 		bar->out_qs[i] = (struct llring *)ptr;
 		priv->out_qs[i] = bar->out_qs[i];
@@ -184,6 +198,10 @@ vport_send_pkts(struct port *p, queue_t qid, snb_array_t pkts, int cnt)
 	struct vport_priv *priv = get_port_priv(p);
 	struct llring* q = priv->out_qs[qid];
 	int ret;
+
+	if (unlikely(p->queue_single[PACKET_DIR_OUT][qid]) &&
+			!check_queue_owner(p, PACKET_DIR_OUT, qid))
+		return 0;
 	
 	ret = llring_enqueue_bulk(q, (void**)pkts, cnt);
 	if (ret == -LLRING_ERR_NOBUF)
@@ -205,6 +223,10 @@ vport_recv_pkts(struct port *p, queue_t qid, snb_array_t pkts, int cnt)
 	struct vport_priv *priv = get_port_priv(p);
 	struct llring* q = priv->inc_qs[qid];
 	int ret;
+
+	if (unlikely(p->queue_single[PACKET_DIR_INC][qid]) &&
+			!check_queue_owner(p, PACKET_DIR_INC, qid))
+		return 0;
 	
 	ret = llring_dequeue_burst(q, (void **)pkts, cnt);
 	return ret;
@@ -0,0 +1,695 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <rte_malloc.h>
+
+#include "common.h"
+#include "time.h"
+#include "ebpf.h"
+
+/* instruction classes */
+#define EBPF_LD		0x00
+#define EBPF_LDX	0x01
+#define EBPF_ST		0x02
+#define EBPF_STX	0x03
+#define EBPF_ALU	0x04
+#define EBPF_JMP	0x05
+#define EBPF_JMP32	0x06
+#define EBPF_ALU64	0x07
+
+/* sizes and modes for LD/LDX/ST/STX */
+#define EBPF_W		0x00
+#define EBPF_H		0x08
+#define EBPF_B		0x10
+#define EBPF_DW		0x18
+
+#define EBPF_IMM	0x00
+#define EBPF_ABS	0x20
+#define EBPF_IND	0x40
+#define EBPF_MEM	0x60
+#define EBPF_XADD	0xc0
+
+/* sources for ALU/JMP */
+#define EBPF_K		0x00
+#define EBPF_X		0x08
+
+/* ALU operations */
+#define EBPF_ADD	0x00
+#define EBPF_SUB	0x10
+#define EBPF_MUL	0x20
+#define EBPF_DIV	0x30
+#define EBPF_OR		0x40
+#define EBPF_AND	0x50
+#define EBPF_LSH	0x60
+#define EBPF_RSH	0x70
+#define EBPF_NEG	0x80
+#define EBPF_MOD	0x90
+#define EBPF_XOR	0xa0
+#define EBPF_MOV	0xb0
+#define EBPF_ARSH	0xc0
+#define EBPF_END	0xd0
+
+/* JMP operations */
+#define EBPF_JA		0x00
+#define EBPF_JEQ	0x10
+#define EBPF_JGT	0x20
+#define EBPF_JGE	0x30
+#define EBPF_JSET	0x40
+#define EBPF_JNE	0x50
+#define EBPF_JSGT	0x60
+#define EBPF_JSGE	0x70
+#define EBPF_CALL	0x80
+#define EBPF_EXIT	0x90
+#define EBPF_JLT	0xa0
+#define EBPF_JLE	0xb0
+#define EBPF_JSLT	0xc0
+#define EBPF_JSLE	0xd0
+
+#define EBPF_CLASS(code)	((code) & 0x07)
+#define EBPF_SIZE(code)		((code) & 0x18)
+#define EBPF_MODE(code)		((code) & 0xe0)
+#define EBPF_OP(code)		((code) & 0xf0)
+#define EBPF_SRC(code)		((code) & 0x08)
+
+#define EBPF_REG_FP		10
+#define EBPF_NUM_REGS		11
+
+static int size_bytes(uint8_t code)
+{
+	switch (EBPF_SIZE(code)) {
+	case EBPF_W:	return 4;
+	case EBPF_H:	return 2;
+	case EBPF_B:	return 1;
+	default:	return 8;
+	}
+}
+
+static int is_cond_jump(uint8_t op)
+{
+	switch (op) {
+	case EBPF_JEQ: case EBPF_JGT: case EBPF_JGE: case EBPF_JSET:
+	case EBPF_JNE: case EBPF_JSGT: case EBPF_JSGE:
+	case EBPF_JLT: case EBPF_JLE: case EBPF_JSLT: case EBPF_JSLE:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/* returns NULL if ok */
+static const char *check_alu(const struct ebpf_insn *ins)
+{
+	int bits = EBPF_CLASS(ins->code) == EBPF_ALU64 ? 64 : 32;
+
+	if (ins->dst_reg == EBPF_REG_FP)
+		return "write to R10";
+
+	switch (EBPF_OP(ins->code)) {
+	case EBPF_ADD: case EBPF_SUB: case EBPF_MUL: case EBPF_OR:
+	case EBPF_AND: case EBPF_XOR: case EBPF_MOV:
+		return NULL;
+
+	case EBPF_DIV:
+	case EBPF_MOD:
+		if (EBPF_SRC(ins->code) == EBPF_K && ins->imm == 0)
+			return "division by zero";
+		return NULL;
+
+	case EBPF_LSH: case EBPF_RSH: case EBPF_ARSH:
+		if (EBPF_SRC(ins->code) == EBPF_K &&
+				(ins->imm < 0 || ins->imm >= bits))
+			return "invalid shift";
+		return NULL;
+
+	case EBPF_NEG:
+		return EBPF_SRC(ins->code) == EBPF_K ? NULL : "invalid neg";
+
+	case EBPF_END:
+		if (bits != 32 || (ins->imm != 16 && ins->imm != 32 &&
+					ins->imm != 64))
+			return "invalid byte swap";
+		return NULL;
+
+	default:
+		return "unknown ALU operation";
+	}
+}
+
+static const char *check_jmp(const struct ebpf_insn *ins, int pc, int n,
+		const uint8_t *is_imm64_hi)
+{
+	uint8_t op = EBPF_OP(ins->code);
+	int target;
+
+	if (op == EBPF_EXIT)
+		return EBPF_CLASS(ins->code) == EBPF_JMP ? NULL :
+			"invalid exit";
+
+	if (op == EBPF_CALL) {
+		if (EBPF_CLASS(ins->code) != EBPF_JMP)
+			return "invalid call";
+		if (ins->imm <= 0 || ins->imm >= NUM_EBPF_FUNCS)
+			return "unknown helper function";
+		return NULL;
+	}
+
+	if (op == EBPF_JA) {
+		if (EBPF_CLASS(ins->code) != EBPF_JMP ||
+				EBPF_SRC(ins->code) != EBPF_K)
+			return "invalid ja";
+	} else if (!is_cond_jump(op))
+		return "unknown jump operation";
+
+	/* no loops */
+	if (ins->off < 0)
+		return "backward jump";
+
+	target = pc + 1 + ins->off;
+	if (target >= n || is_imm64_hi[target])
+		return "jump out of range";
+
+	return NULL;
+}
+
+static const char *check_insn(const struct ebpf_insn *insns, int pc, int n,
+		const uint8_t *is_imm64_hi)
+{
+	const struct ebpf_insn *ins = &insns[pc];
+
+	if (ins->dst_reg >= EBPF_NUM_REGS || ins->src_reg >= EBPF_NUM_REGS)
+		return "invalid register";
+
+	switch (EBPF_CLASS(ins->code)) {
+	case EBPF_ALU:
+	case EBPF_ALU64:
+		return check_alu(ins);
+
+	case EBPF_JMP:
+	case EBPF_JMP32:
+		return check_jmp(ins, pc, n, is_imm64_hi);
+
+	case EBPF_LD:
+		if (ins->code == (EBPF_LD | EBPF_DW | EBPF_IMM)) {
+			if (pc + 1 >= n || insns[pc + 1].code != 0)
+				return "incomplete 64-bit immediate";
+			if (ins->dst_reg == EBPF_REG_FP)
+				return "write to R10";
+			return NULL;
+		}
+
+		if ((EBPF_MODE(ins->code) == EBPF_ABS ||
+				EBPF_MODE(ins->code) == EBPF_IND) &&
+				EBPF_SIZE(ins->code) != EBPF_DW)
+			return NULL;
+
+		return "invalid load";
+
+	case EBPF_LDX:
+		if (EBPF_MODE(ins->code) != EBPF_MEM)
+			return "invalid load";
+		if (ins->dst_reg == EBPF_REG_FP)
+			return "write to R10";
+		return NULL;
+
+	case EBPF_ST:
+		return EBPF_MODE(ins->code) == EBPF_MEM ? NULL :
+			"invalid store";
+
+	case EBPF_STX:
+		if (EBPF_MODE(ins->code) == EBPF_MEM)
+			return NULL;
+		if (EBPF_MODE(ins->code) == EBPF_XADD &&
+				(EBPF_SIZE(ins->code) == EBPF_W ||
+				 EBPF_SIZE(ins->code) == EBPF_DW))
+			return NULL;
+		return "invalid store";
+	}
+
+	return "unknown instruction";
+}
+
+struct snobj *ebpf_load(struct ebpf_prog *prog, const void *code,
+		size_t size)
+{
+	const struct ebpf_insn *insns = code;
+	uint8_t *is_imm64_hi;
+	int n;
+
+	if (size == 0 || size % sizeof(struct ebpf_insn))
+		return snobj_err(EINVAL, "eBPF code size must be a multiple "
+				"of %zu", sizeof(struct ebpf_insn));
+
+	n = size / sizeof(struct ebpf_insn);
+	if (n > EBPF_MAX_INSNS)
+		return snobj_err(EINVAL, "eBPF program too long (max %d "
+				"instructions)", EBPF_MAX_INSNS);
+
+	if (insns[n - 1].code != (EBPF_JMP | EBPF_EXIT))
+		return snobj_err(EINVAL, "eBPF program must end with exit");
+
+	is_imm64_hi = calloc(n, 1);
+	if (!is_imm64_hi)
+		return snobj_errno(ENOMEM);
+
+	for (int i = 0; i < n - 1; i++)
+		if (insns[i].code == (EBPF_LD | EBPF_DW | EBPF_IMM))
+			is_imm64_hi[++i] = 1;
+
+	for (int i = 0; i < n; i++) {
+		const char *err;
+
+		if (is_imm64_hi[i])
+			continue;
+
+		err = check_insn(insns, i, n, is_imm64_hi);
+		if (err) {
+			free(is_imm64_hi);
+			return snobj_err(EINVAL, "eBPF instruction %d: %s",
+					i, err);
+		}
+	}
+
+	free(is_imm64_hi);
+
+	for (int i = 0; i < prog->n_maps; i++) {
+		struct ebpf_map *map = &prog->maps[i];
+
+		if (map->values)
+			continue;
+
+		if (map->n_entries == 0 ||
+				map->n_entries > EBPF_MAX_MAP_ENTRIES)
+			return snobj_err(EINVAL, "Map size must be between "
+					"1 and %d", EBPF_MAX_MAP_ENTRIES);
+
+		map->values = rte_zmalloc("ebpf_map",
+				map->n_entries * sizeof(uint64_t), 0);
+		if (!map->values)
+			return snobj_errno(ENOMEM);
+	}
+
+	prog->insns = rte_malloc("ebpf_insns", size, 0);
+	if (!prog->insns)
+		return snobj_errno(ENOMEM);
+
+	memcpy(prog->insns, code, size);
+	prog->n_insns = n;
+
+	return NULL;
+}
+
+void ebpf_unload(struct ebpf_prog *prog)
+{
+	for (int i = 0; i < prog->n_maps; i++) {
+		rte_free(prog->maps[i].values);
+		prog->maps[i].values = NULL;
+	}
+
+	rte_free(prog->insns);
+	prog->insns = NULL;
+	prog->n_insns = 0;
+}
+
+struct vm {
+	const struct ebpf_prog *prog;
+	const struct ebpf_ctx *ctx;
+	const mt_offset_t *offsets;
+	uint64_t stack_lo;
+};
+
+/* is [addr, addr + size) within [lo, lo + len)? */
+static inline int in_region(uint64_t addr, int size, uint64_t lo,
+		uint64_t len)
+{
+	return addr >= lo && addr - lo <= len && size <= len - (addr - lo);
+}
+
+static int mem_ok(const struct vm *vm, uint64_t addr, int size, int write)
+{
+	const struct ebpf_prog *prog = vm->prog;
+	const struct ebpf_ctx *ctx = vm->ctx;
+
+	if (in_region(addr, size, vm->stack_lo, EBPF_STACK_SIZE))
+		return 1;
+
+	if (in_region(addr, size, ctx->data, ctx->data_end - ctx->data))
+		return 1;
+
+	if (!write && in_region(addr, size, (uintptr_t)ctx, sizeof(*ctx)))
+		return 1;
+
+	for (int i = 0; i < prog->n_attrs; i++) {
+		mt_offset_t offset = vm->offsets[i];
+
+		if (is_valid_attr_offset(offset) &&
+				(!write || prog->attrs[i].writable) &&
+				in_region(addr, size, ctx->metadata + offset,
+					prog->attrs[i].size))
+			return 1;
+	}
+
+	for (int i = 0; i < prog->n_maps; i++) {
+		const struct ebpf_map *map = &prog->maps[i];
+
+		if (in_region(addr, size, (uintptr_t)map->values,
+					map->n_entries * sizeof(uint64_t)))
+			return 1;
+	}
+
+	return 0;
+}
+
+static uint64_t call_helper(const struct vm *vm, int32_t func,
+		const uint64_t *reg)
+{
+	const struct ebpf_prog *prog = vm->prog;
+
+	switch (func) {
+	case EBPF_FUNC_MAP_LOOKUP:
+		if (reg[1] >= prog->n_maps ||
+				reg[2] >= prog->maps[reg[1]].n_entries)
+			return 0;
+		return (uintptr_t)&prog->maps[reg[1]].values[reg[2]];
+
+	case EBPF_FUNC_GET_ATTR:
+		if (reg[1] >= prog->n_attrs ||
+				!is_valid_attr_offset(vm->offsets[reg[1]]))
+			return 0;
+		return vm->ctx->metadata + vm->offsets[reg[1]];
+
+	case EBPF_FUNC_RDTSC:
+		return rdtsc();
+	}
+
+	return 0;
+}
+
+/* for BPF_ABS/BPF_IND. returns 0 if out of bounds */
+static inline int load_pkt(const struct ebpf_ctx *ctx, uint32_t offset,
+		int size, uint64_t *val)
+{
+	const uint8_t *p = (const uint8_t *)(uintptr_t)ctx->data + offset;
+
+	if (offset > ctx->head_len || size > ctx->head_len - offset)
+		return 0;
+
+	switch (size) {
+	case 4:
+		*val = __builtin_bswap32(*(const uint32_t *)p);
+		break;
+	case 2:
+		*val = __builtin_bswap16(*(const uint16_t *)p);
+		break;
+	default:
+		*val = *p;
+	}
+
+	return 1;
+}
+
+#define ALU_OP(OP, op) 							\
+	case EBPF_ALU64 | OP | EBPF_K:					\
+		reg[ins->dst_reg] = reg[ins->dst_reg] op 		\
+				(uint64_t)(int64_t)ins->imm;		\
+		break;							\
+	case EBPF_ALU64 | OP | EBPF_X:					\
+		reg[ins->dst_reg] = reg[ins->dst_reg] op reg[ins->src_reg];\
+		break;							\
+	case EBPF_ALU | OP | EBPF_K:					\
+		reg[ins->dst_reg] = (uint32_t)((uint32_t)reg[ins->dst_reg] \
+				op (uint32_t)ins->imm);			\
+		break;							\
+	case EBPF_ALU | OP | EBPF_X:					\
+		reg[ins->dst_reg] = (uint32_t)((uint32_t)reg[ins->dst_reg] \
+				op (uint32_t)reg[ins->src_reg]);	\
+		break;
+
+#define JMP_OP(OP, type, type32, op)					\
+	case EBPF_JMP | OP | EBPF_K:					\
+		if ((type)reg[ins->dst_reg] op (type)(int64_t)ins->imm)	\
+			pc += ins->off;					\
+		break;							\
+	case EBPF_JMP | OP | EBPF_X:					\
+		if ((type)reg[ins->dst_reg] op (type)reg[ins->src_reg])	\
+			pc += ins->off;					\
+		break;							\
+	case EBPF_JMP32 | OP | EBPF_K:					\
+		if ((type32)reg[ins->dst_reg] op (type32)ins->imm)	\
+			pc += ins->off;					\
+		break;							\
+	case EBPF_JMP32 | OP | EBPF_X:					\
+		if ((type32)reg[ins->dst_reg] op 			\
+				(type32)reg[ins->src_reg])		\
+			pc += ins->off;					\
+		break;
+
+#define MEM_OP(SIZE, type)						\
+	case EBPF_LDX | EBPF_MEM | SIZE:				\
+		addr = reg[ins->src_reg] + ins->off;			\
+		if (unlikely(!mem_ok(&vm, addr, sizeof(type), 0)))	\
+			goto fault;					\
+		reg[ins->dst_reg] = *(type *)(uintptr_t)addr;		\
+		break;							\
+	case EBPF_ST | EBPF_MEM | SIZE:					\
+		addr = reg[ins->dst_reg] + ins->off;			\
+		if (unlikely(!mem_ok(&vm, addr, sizeof(type), 1)))	\
+			goto fault;					\
+		*(type *)(uintptr_t)addr = ins->imm;			\
+		break;							\
+	case EBPF_STX | EBPF_MEM | SIZE:				\
+		addr = reg[ins->dst_reg] + ins->off;			\
+		if (unlikely(!mem_ok(&vm, addr, sizeof(type), 1)))	\
+			goto fault;					\
+		*(type *)(uintptr_t)addr = reg[ins->src_reg];		\
+		break;
+
+#define LD_PKT_OP(SIZE, bytes)						\
+	case EBPF_LD | EBPF_ABS | SIZE:					\
+		if (!load_pkt(vm.ctx, ins->imm, bytes, &reg[0]))	\
+			return 0;					\
+		break;							\
+	case EBPF_LD | EBPF_IND | SIZE:					\
+		if (!load_pkt(vm.ctx, (uint32_t)reg[ins->src_reg] + 	\
+					ins->imm, bytes, &reg[0]))	\
+			return 0;					\
+		break;
+
+uint64_t ebpf_run(const struct ebpf_prog *prog, struct ebpf_ctx *ctx,
+		const mt_offset_t *offsets, int *fault)
+{
+	uint64_t stack[EBPF_STACK_SIZE / sizeof(uint64_t)];
+	uint64_t reg[EBPF_NUM_REGS] = {0};
+
+	const struct ebpf_insn *insns = prog->insns;
+	int pc = 0;
+
+	struct vm vm = {
+		.prog = prog,
+		.ctx = ctx,
+		.offsets = offsets,
+		.stack_lo = (uintptr_t)stack,
+	};
+
+	reg[1] = (uintptr_t)ctx;
+	reg[EBPF_REG_FP] = (uintptr_t)stack + sizeof(stack);
+
+	/* the verifier guarantees that pc only increases, and that
+	 * the program ends with an exit */
+	for (;;) {
+		const struct ebpf_insn *ins = &insns[pc++];
+		uint64_t addr;
+
+		switch (ins->code) {
+		ALU_OP(EBPF_ADD, +)
+		ALU_OP(EBPF_SUB, -)
+		ALU_OP(EBPF_MUL, *)
+		ALU_OP(EBPF_OR, |)
+		ALU_OP(EBPF_AND, &)
+		ALU_OP(EBPF_XOR, ^)
+
+		case EBPF_ALU64 | EBPF_MOV | EBPF_K:
+			reg[ins->dst_reg] = (int64_t)ins->imm;
+			break;
+		case EBPF_ALU64 | EBPF_MOV | EBPF_X:
+			reg[ins->dst_reg] = reg[ins->src_reg];
+			break;
+		case EBPF_ALU | EBPF_MOV | EBPF_K:
+			reg[ins->dst_reg] = (uint32_t)ins->imm;
+			break;
+		case EBPF_ALU | EBPF_MOV | EBPF_X:
+			reg[ins->dst_reg] = (uint32_t)reg[ins->src_reg];
+			break;
+
+		case EBPF_ALU64 | EBPF_LSH | EBPF_K:
+			reg[ins->dst_reg] <<= ins->imm;
+			break;
+		case EBPF_ALU64 | EBPF_LSH | EBPF_X:
+			reg[ins->dst_reg] <<= reg[ins->src_reg] & 63;
+			break;
+		case EBPF_ALU | EBPF_LSH | EBPF_K:
+			reg[ins->dst_reg] = (uint32_t)reg[ins->dst_reg] <<
+				ins->imm;
+			break;
+		case EBPF_ALU | EBPF_LSH | EBPF_X:
+			reg[ins->dst_reg] = (uint32_t)((uint32_t)
+				reg[ins->dst_reg] << (reg[ins->src_reg] & 31));
+			break;
+
+		case EBPF_ALU64 | EBPF_RSH | EBPF_K:
+			reg[ins->dst_reg] >>= ins->imm;
+			break;
+		case EBPF_ALU64 | EBPF_RSH | EBPF_X:
+			reg[ins->dst_reg] >>= reg[ins->src_reg] & 63;
+			break;
+		case EBPF_ALU | EBPF_RSH | EBPF_K:
+			reg[ins->dst_reg] = (uint32_t)reg[ins->dst_reg] >>
+				ins->imm;
+			break;
+		case EBPF_ALU | EBPF_RSH | EBPF_X:
+			reg[ins->dst_reg] = (uint32_t)reg[ins->dst_reg] >>
+				(reg[ins->src_reg] & 31);
+			break;
+
+		case EBPF_ALU64 | EBPF_ARSH | EBPF_K:
+			reg[ins->dst_reg] = (int64_t)reg[ins->dst_reg] >>
+				ins->imm;
+			break;
+		case EBPF_ALU64 | EBPF_ARSH | EBPF_X:
+			reg[ins->dst_reg] = (int64_t)reg[ins->dst_reg] >>
+				(reg[ins->src_reg] & 63);
+			break;
+		case EBPF_ALU | EBPF_ARSH | EBPF_K:
+			reg[ins->dst_reg] = (uint32_t)((int32_t)
+				reg[ins->dst_reg] >> ins->imm);
+			break;
+		case EBPF_ALU | EBPF_ARSH | EBPF_X:
+			reg[ins->dst_reg] = (uint32_t)((int32_t)
+				reg[ins->dst_reg] >> (reg[ins->src_reg] & 31));
+			break;
+
+		/* as in Linux, x / 0 == 0 and x % 0 == x */
+		case EBPF_ALU64 | EBPF_DIV | EBPF_K:
+			reg[ins->dst_reg] /= (uint64_t)(int64_t)ins->imm;
+			break;
+		case EBPF_ALU64 | EBPF_DIV | EBPF_X:
+			reg[ins->dst_reg] = reg[ins->src_reg] ?
+				reg[ins->dst_reg] / reg[ins->src_reg] : 0;
+			break;
+		case EBPF_ALU | EBPF_DIV | EBPF_K:
+			reg[ins->dst_reg] = (uint32_t)reg[ins->dst_reg] /
+				(uint32_t)ins->imm;
+			break;
+		case EBPF_ALU | EBPF_DIV | EBPF_X:
+			reg[ins->dst_reg] = (uint32_t)reg[ins->src_reg] ?
+				(uint32_t)reg[ins->dst_reg] /
+				(uint32_t)reg[ins->src_reg] : 0;
+			break;
+
+		case EBPF_ALU64 | EBPF_MOD | EBPF_K:
+			reg[ins->dst_reg] %= (uint64_t)(int64_t)ins->imm;
+			break;
+		case EBPF_ALU64 | EBPF_MOD | EBPF_X:
+			if (reg[ins->src_reg])
+				reg[ins->dst_reg] %= reg[ins->src_reg];
+			break;
+		case EBPF_ALU | EBPF_MOD | EBPF_K:
+			reg[ins->dst_reg] = (uint32_t)reg[ins->dst_reg] %
+				(uint32_t)ins->imm;
+			break;
+		case EBPF_ALU | EBPF_MOD | EBPF_X:
+			reg[ins->dst_reg] = (uint32_t)reg[ins->src_reg] ?
+				(uint32_t)reg[ins->dst_reg] %
+				(uint32_t)reg[ins->src_reg] :
+				(uint32_t)reg[ins->dst_reg];
+			break;
+
+		case EBPF_ALU64 | EBPF_NEG:
+			reg[ins->dst_reg] = -reg[ins->dst_reg];
+			break;
+		case EBPF_ALU | EBPF_NEG:
+			reg[ins->dst_reg] = (uint32_t)-reg[ins->dst_reg];
+			break;
+
+		/* x86 is little endian */
+		case EBPF_ALU | EBPF_END | EBPF_K:	/* to LE */
+			if (ins->imm == 16)
+				reg[ins->dst_reg] = (uint16_t)reg[ins->dst_reg];
+			else if (ins->imm == 32)
+				reg[ins->dst_reg] = (uint32_t)reg[ins->dst_reg];
+			break;
+		case EBPF_ALU | EBPF_END | EBPF_X:	/* to BE */
+			if (ins->imm == 16)
+				reg[ins->dst_reg] = __builtin_bswap16(
+						reg[ins->dst_reg]);
+			else if (ins->imm == 32)
+				reg[ins->dst_reg] = __builtin_bswap32(
+						reg[ins->dst_reg]);
+			else
+				reg[ins->dst_reg] = __builtin_bswap64(
+						reg[ins->dst_reg]);
+			break;
+
+		case EBPF_JMP | EBPF_JA:
+			pc += ins->off;
+			break;
+
+		JMP_OP(EBPF_JEQ, uint64_t, uint32_t, ==)
+		JMP_OP(EBPF_JNE, uint64_t, uint32_t, !=)
+		JMP_OP(EBPF_JGT, uint64_t, uint32_t, >)
+		JMP_OP(EBPF_JGE, uint64_t, uint32_t, >=)
+		JMP_OP(EBPF_JLT, uint64_t, uint32_t, <)
+		JMP_OP(EBPF_JLE, uint64_t, uint32_t, <=)
+		JMP_OP(EBPF_JSET, uint64_t, uint32_t, &)
+		JMP_OP(EBPF_JSGT, int64_t, int32_t, >)
+		JMP_OP(EBPF_JSGE, int64_t, int32_t, >=)
+		JMP_OP(EBPF_JSLT, int64_t, int32_t, <)
+		JMP_OP(EBPF_JSLE, int64_t, int32_t, <=)
+
+		case EBPF_JMP | EBPF_CALL:
+			reg[0] = call_helper(&vm, ins->imm, reg);
+			break;
+
+		case EBPF_JMP | EBPF_EXIT:
+			return reg[0];
+
+		case EBPF_LD | EBPF_DW | EBPF_IMM:
+			reg[ins->dst_reg] = (uint32_t)ins->imm |
+				((uint64_t)(uint32_t)insns[pc].imm << 32);
+			pc++;
+			break;
+
+		LD_PKT_OP(EBPF_W, 4)
+		LD_PKT_OP(EBPF_H, 2)
+		LD_PKT_OP(EBPF_B, 1)
+
+		MEM_OP(EBPF_W, uint32_t)
+		MEM_OP(EBPF_H, uint16_t)
+		MEM_OP(EBPF_B, uint8_t)
+		MEM_OP(EBPF_DW, uint64_t)
+
+		case EBPF_STX | EBPF_XADD | EBPF_W:
+			addr = reg[ins->dst_reg] + ins->off;
+			if (unlikely(!mem_ok(&vm, addr, sizeof(uint32_t), 1)))
+				goto fault;
+			__sync_fetch_and_add((uint32_t *)(uintptr_t)addr,
+					(uint32_t)reg[ins->src_reg]);
+			break;
+		case EBPF_STX | EBPF_XADD | EBPF_DW:
+			addr = reg[ins->dst_reg] + ins->off;
+			if (unlikely(!mem_ok(&vm, addr, sizeof(uint64_t), 1)))
+				goto fault;
+			__sync_fetch_and_add((uint64_t *)(uintptr_t)addr,
+					reg[ins->src_reg]);
+			break;
+
+		default:
+			/* rejected by the verifier */
+			goto fault;
+		}
+	}
+
+fault:
+	*fault = 1;
+	return 0;
+}
@@ -0,0 +1,104 @@
+#ifndef _EBPF_H_
+#define _EBPF_H_
+
+#include <stdint.h>
+
+#include "snobj.h"
+#include "metadata.h"
+
+/* A small eBPF virtual machine, for the BPF module.
+ *
+ * Programs are raw eBPF instructions, e.g., the code section of
+ * "clang -target bpf -O2 -c prog.c" as extracted by "objcopy -O binary
+ * --only-section=.text". There is no relocation, so maps and metadata
+ * attributes are referred to by their index in the configuration.
+ *
+ * ebpf_load() verifies the program: all opcodes and registers must be
+ * valid, jumps must go forward (so every program terminates within
+ * n_insns steps), and the last instruction must be "exit". Memory
+ * accesses are checked at run time against the regions the program may
+ * touch (see below); a bad access aborts the program.
+ *
+ * Calling convention (per packet):
+ *   R1: pointer to struct ebpf_ctx (read-only)
+ *   R10: frame pointer, with EBPF_STACK_SIZE bytes of stack below
+ *   R0 on exit: the result (the output gate for the BPF module)
+ *
+ * The legacy packet loads (BPF_ABS/BPF_IND) are also supported. As in
+ * classic BPF, they exit the program with 0 if out of bounds. */
+
+#define EBPF_MAX_INSNS		4096
+#define EBPF_STACK_SIZE		512
+#define EBPF_MAX_MAPS		8
+#define EBPF_MAX_MAP_ENTRIES	(1 << 20)
+
+/* Helper functions (imm of "call"). Arguments in R1-R5, result in R0 */
+enum ebpf_helper {
+	/* u64 *map_lookup(u32 map, u32 key): NULL if key is out of range */
+	EBPF_FUNC_MAP_LOOKUP = 1,
+
+	/* void *get_attr(u32 attr): the per-packet metadata attribute,
+	 * or NULL if unavailable (e.g., no upstream module writes it) */
+	EBPF_FUNC_GET_ATTR = 2,
+
+	/* u64 rdtsc(void) */
+	EBPF_FUNC_RDTSC = 3,
+
+	NUM_EBPF_FUNCS,
+};
+
+struct ebpf_insn {
+	uint8_t code;
+	uint8_t dst_reg:4;
+	uint8_t src_reg:4;
+	int16_t off;
+	int32_t imm;
+};
+
+/* R1 points to this */
+struct ebpf_ctx {
+	uint64_t data;		/* packet data (first segment) */
+	uint64_t data_end;	/* data + head_len */
+	uint32_t len;		/* total length */
+	uint32_t head_len;	/* length of the first segment */
+	uint64_t metadata;	/* snb->_metadata_buf, see EBPF_FUNC_GET_ATTR */
+};
+
+/* an array of uint64_t values, shared by all workers.
+ * Use the atomic add instruction (BPF_XADD) for counters. */
+struct ebpf_map {
+	uint64_t *values;
+	uint32_t n_entries;
+};
+
+struct ebpf_attr {
+	int size;
+	int writable;
+};
+
+struct ebpf_prog {
+	struct ebpf_insn *insns;
+	int n_insns;
+
+	int n_maps;
+	struct ebpf_map maps[EBPF_MAX_MAPS];
+
+	int n_attrs;
+	struct ebpf_attr attrs[MAX_ATTRS_PER_MODULE];
+};
+
+/* Verifies and copies the code. maps[] and attrs[] of prog must be set
+ * already, since helper calls are checked against them */
+struct snobj *ebpf_load(struct ebpf_prog *prog, const void *code,
+		size_t size);
+
+/* frees the code and the maps */
+void ebpf_unload(struct ebpf_prog *prog);
+
+/* Runs the program for a packet. offsets[] are those of prog->attrs[] in
+ * snb->_metadata_buf. Returns R0, or sets *fault and returns 0 on a bad
+ * memory access. */
+uint64_t ebpf_run(const struct ebpf_prog *prog, struct ebpf_ctx *ctx,
+		const mt_offset_t *offsets, int *fault);
+
+#endif
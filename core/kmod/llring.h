@@ -178,12 +178,14 @@ struct llring {
 	struct {
 		volatile uint32_t head;  /**< Producer head. */
 		volatile uint32_t tail;  /**< Producer tail. */
+		uint32_t cached_cons_tail; /**< Last seen cons.tail (SP only) */
 	} prod __llring_cache_aligned;
 
 	/** Ring consumer status. */
 	struct {
 		volatile uint32_t head;  /**< Consumer head. */
 		volatile uint32_t tail;  /**< Consumer tail. */
+		uint32_t cached_prod_tail; /**< Last seen prod.tail (SC only) */
 	} cons __llring_cache_aligned;
 
 #if LLRING_ENABLE_DEBUG
@@ -252,6 +254,7 @@ llring_init(struct llring *r, unsigned int slots, int sp, int sc)
 
 	r->prod.head = r->cons.head = 0;
 	r->prod.tail = r->cons.tail = 0;
+	r->prod.cached_cons_tail = r->cons.cached_prod_tail = 0;
 
 	return 0;
 }
@@ -470,14 +473,24 @@ __llring_sp_do_enqueue(struct llring *r, void * const *obj_table,
 	uint32_t mask = r->common.mask;
 	int ret;
 
+	/* The consumer's tail lives in a cache line written by the other
+	 * core. Work with the last value we saw, and touch the line only when
+	 * it does not leave enough room. Since the tail only moves forward,
+	 * a stale value just underestimates the free entries. */
 	prod_head = r->prod.head;
-	cons_tail = r->cons.tail;
+	cons_tail = r->prod.cached_cons_tail;
 	/* The subtraction is done between two unsigned 32bits value
 	 * (the result is always modulo 32 bits even if we have
 	 * prod_head > cons_tail). So 'free_entries' is always between 0
 	 * and slots(ring)-1. */
 	free_entries = mask + cons_tail - prod_head;
 
+	if (n > free_entries) {
+		cons_tail = r->cons.tail;
+		r->prod.cached_cons_tail = cons_tail;
+		free_entries = mask + cons_tail - prod_head;
+	}
+
 	/* check that we have enough room in ring */
 	if (llring_unlikely(n > free_entries)) {
 		if (behavior == LLRING_QUEUE_FIXED) {
@@ -502,7 +515,15 @@ __llring_sp_do_enqueue(struct llring *r, void * const *obj_table,
 	LLRING_ENQUEUE_PTRS();
 	COMPILER_BARRIER();
 
-	/* if we exceed the watermark */
+	/* if we exceed the watermark. Make sure it is not because of a
+	 * stale cons_tail */
+	if (llring_unlikely(((mask + 1) - free_entries + n) > 
+				r->common.watermark)) {
+		cons_tail = r->cons.tail;
+		r->prod.cached_cons_tail = cons_tail;
+		free_entries = mask + cons_tail - prod_head;
+	}
+
 	if (llring_unlikely(((mask + 1) - free_entries + n) > r->common.watermark)) {
 		ret = (behavior == LLRING_QUEUE_FIXED) ? -LLRING_ERR_QUOT :
 			(int)(n | RING_QUOT_EXCEED);
@@ -638,14 +659,22 @@ __llring_sc_do_dequeue(struct llring *r, void **obj_table,
 	unsigned i;
 	uint32_t mask = r->common.mask;
 
+	/* Same as in __llring_sp_do_enqueue(): a stale prod_tail only
+	 * underestimates the entries, so reload it only when needed. */
 	cons_head = r->cons.head;
-	prod_tail = r->prod.tail;
+	prod_tail = r->cons.cached_prod_tail;
 	/* The subtraction is done between two unsigned 32bits value
 	 * (the result is always modulo 32 bits even if we have
 	 * cons_head > prod_tail). So 'entries' is always between 0
 	 * and slots(ring)-1. */
 	entries = prod_tail - cons_head;
 
+	if (n > entries) {
+		prod_tail = r->prod.tail;
+		r->cons.cached_prod_tail = prod_tail;
+		entries = prod_tail - cons_head;
+	}
+
 	if (n > entries) {
 		if (behavior == LLRING_QUEUE_FIXED) {
 			__RING_STAT_ADD(r, deq_fail, n);
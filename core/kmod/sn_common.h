@@ -110,12 +110,27 @@ struct sn_conf_space {
 	uint8_t link_on;
 	uint8_t promisc_on;
 
+	/* If set, the driver maps CPUs to TX queues by itself, one CPU per
+	 * queue as they start sending, and RX queue i is kicked on the CPU
+	 * that owns TX queue i (see sn_rxq_registers.kick_cpu). The map of
+	 * SN_IOC_SET_QUEUE_MAPPING only sets the initial state. */
+	uint8_t auto_queue_map;
+
 	struct tx_queue_opts
 	{
 		/* If set, the driver will push tags for all xmitted packets.
 		 * Both are in host order. */
 		uint16_t tci;
 		uint16_t outer_tci;
+
+		/* If set, the driver may send GSO packets (as chains of
+		 * snbufs) and packets with pending checksums */
+		uint8_t offload;
+
+		/* If nonzero, page frags of packets at least this long are
+		 * passed by reference, not copied (host mode only). 
+		 * See "Zero-copy TX" below */
+		uint16_t zc_min_len;
 	} txq_opts;
 
 	struct rx_queue_opts
@@ -129,6 +144,10 @@ struct sn_rxq_registers {
 	/* Set by the kernel driver, to suppress bogus interrupts */
 	volatile uint32_t irq_disabled;
 
+	/* Where BESS should send the kick (IPI) for this queue, 
+	 * set by the driver with auto_queue_map. -1 otherwise */
+	volatile int32_t kick_cpu;
+
 	/* Separate this from the shared cache line */
 	uint64_t dropped __attribute__((__aligned__(64)));
 } __attribute__((__aligned__(64)));
@@ -138,18 +157,46 @@ struct sn_rxq_registers {
 
 #define SN_TX_FRAG_MAX_NUM      18/*(MAX_SKB_FRAGS + 1)*/
 
+/* Maximum number of snbufs for a TX packet (e.g., GSO) */
+#define SN_TX_MAX_SEGS		16
+
 /* Driver -> BESS metadata for TX packets */
 struct sn_tx_metadata {
 	/* Both are relative offsets from the beginning of the packet.
 	 * The sender should set csum_start to CSUM_DONT
-	 * if no checksumming is wanted (csum_dest is undefined).*/
+	 * if no checksumming is wanted (csum_dest is undefined).
+	 * The checksum field has the pseudo header checksum. */
 	uint16_t csum_start;
 	uint16_t csum_dest;
+
+	/* TCP segment size for GSO packets, 0 otherwise */
+	uint16_t gso_mss;
+	uint8_t gso_tcpv6;	/* 0 for IPv4 */
+
+	/* Flow hash of the skb (skb_get_hash()), 0 if none. Given to BESS 
+	 * as the RSS hash of the packet, e.g., for HashLB */
+	uint32_t flow_hash;
 };
 
+/* Driver -> BESS descriptor for TX packets */
 struct sn_tx_desc {
 	uint16_t total_len;
 
+	/* Only the following two fields are valid for non-head segments */
+	uint16_t seg_len;
+
+	/* The BESS virtual address of next snbuf
+	 * (forms a NULL-terminating linked list) */
+	uint64_t next;
+
+	/* Host physical address of the segment data, if zero-copied.
+	 * 0 if the data is in the snbuf itself. Only for non-head segments */
+	uint64_t ext_seg;
+
+	/* Opaque to BESS (the skb). Nonzero iff the packet has zero-copy
+	 * segments. Only for the head segment */
+	uint64_t zc_cookie;
+
 	struct sn_tx_metadata meta;
 };
 
@@ -158,13 +205,23 @@ struct sn_tx_desc {
 #define SN_RX_CSUM_INCORRECT		2
 #define SN_RX_CSUM_CORRECT		3
 #define SN_RX_CSUM_CORRECT_ENCAP	4
+#define SN_RX_CSUM_PARTIAL		5	/* see csum_start/dest */
 
 struct sn_rx_metadata {
-	/* Maximum TCP "payload" size among coalesced packets.
+	/* Maximum TCP "payload" size among coalesced packets,
+	 * or the segment size of TSO packets.
 	 * 0 for non-coalesed packets */
 	uint16_t gso_mss;	
 
 	uint8_t	csum_state;	/* SN_RX_CSUM_* */
+
+	uint8_t gso_tcpv6;	/* if gso_mss is set. 0 for IPv4 */
+
+	/* Valid only for SN_RX_CSUM_PARTIAL. Both are relative offsets 
+	 * from the beginning of the packet, as in sn_tx_metadata. The
+	 * L4 checksum field has the pseudo header checksum. */
+	uint16_t csum_start;
+	uint16_t csum_dest;
 };
 
 /* BESS -> Driver descriptor for RX packets */
@@ -187,8 +244,10 @@ struct sn_rx_desc {
  * struct sn_conf_space (set by BESS and currently read-only)
  * TX queue 0 llring (drv -> sn)
  * TX queue 0 llring (sn -> drv)
+ * TX queue 0 llring (zc_done, sn -> drv; only if txq_opts.zc_min_len)
  * TX queue 1 llring (drv -> sn)
  * TX queue 1 llring (sn -> drv)
+ * TX queue 1 llring (zc_done, sn -> drv; only if txq_opts.zc_min_len)
  * ...
  * RX queue 0 registers
  * RX queue 0 llring (drv -> sn)
@@ -226,6 +285,15 @@ struct sn_rx_desc {
  * Then the driver will copy (metadata + packet data) _from_ those buffers,
  * and writeback the cookie via the drv_to_sn.
  *   1. Cookie
+ *
+ * Zero-copy TX (txq_opts.zc_min_len):
+ * The driver copies only the linear part of the skb (headers) into the 
+ * head snbuf. Each page frag is described by snbufs with ext_seg set (up to
+ * SNBUF_DATA bytes each), whose data stays in the kernel pages. The driver
+ * keeps a reference to the skb until BESS returns its zc_cookie via the
+ * zc_done llring, after the NIC (or whoever had the packet) is done.
+ * Since NICs read those pages directly, this requires physical DMA 
+ * addressing (no IOMMU translation).
  */
 
 #endif
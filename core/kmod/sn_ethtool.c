@@ -53,8 +53,8 @@ static void sn_ethtool_get_strings(struct net_device *netdev,
 	struct sn_device *dev = netdev_priv(netdev);
 	int i;
 
-	BUILD_BUG_ON(NUM_STATS_PER_TX_QUEUE != 5);
-	BUILD_BUG_ON(NUM_STATS_PER_RX_QUEUE != 6);
+	BUILD_BUG_ON(NUM_STATS_PER_TX_QUEUE != 9);
+	BUILD_BUG_ON(NUM_STATS_PER_RX_QUEUE != 11);
 
 	if (sset != ETH_SS_STATS)
 		return;
@@ -73,6 +73,14 @@ static void sn_ethtool_get_strings(struct net_device *netdev,
 		p += ETH_GSTRING_LEN;
 		sprintf(p, "tx_queue_%u_descdropped", i);
 		p += ETH_GSTRING_LEN;
+		sprintf(p, "tx_queue_%u_snb_cache_hit", i);
+		p += ETH_GSTRING_LEN;
+		sprintf(p, "tx_queue_%u_snb_cache_miss", i);
+		p += ETH_GSTRING_LEN;
+		sprintf(p, "tx_queue_%u_snb_cache_remote", i);
+		p += ETH_GSTRING_LEN;
+		sprintf(p, "tx_queue_%u_zerocopy", i);
+		p += ETH_GSTRING_LEN;
 	}
 
 	for (i = 0; i < dev->num_rxq; i++) {
@@ -88,6 +96,16 @@ static void sn_ethtool_get_strings(struct net_device *netdev,
 		p += ETH_GSTRING_LEN;
 		sprintf(p, "rx_queue_%u_llpolls", i);
 		p += ETH_GSTRING_LEN;
+		sprintf(p, "rx_queue_%u_llhits", i);
+		p += ETH_GSTRING_LEN;
+		sprintf(p, "rx_queue_%u_llpackets", i);
+		p += ETH_GSTRING_LEN;
+		sprintf(p, "rx_queue_%u_snb_cache_spill", i);
+		p += ETH_GSTRING_LEN;
+		sprintf(p, "rx_queue_%u_page_alloc", i);
+		p += ETH_GSTRING_LEN;
+		sprintf(p, "rx_queue_%u_page_recycled", i);
+		p += ETH_GSTRING_LEN;
 	}
 }
 
@@ -98,8 +116,8 @@ static void sn_ethtool_get_ethtool_stats(struct net_device *netdev,
 	struct sn_device *dev = netdev_priv(netdev);
 	int i;
 
-	BUILD_BUG_ON(NUM_STATS_PER_TX_QUEUE != 5);
-	BUILD_BUG_ON(NUM_STATS_PER_RX_QUEUE != 6);
+	BUILD_BUG_ON(NUM_STATS_PER_TX_QUEUE != 9);
+	BUILD_BUG_ON(NUM_STATS_PER_RX_QUEUE != 11);
 
 	for (i = 0; i < dev->num_txq; i++) {
 		data[0] = dev->tx_queues[i]->tx.stats.packets;
@@ -107,6 +125,10 @@ static void sn_ethtool_get_ethtool_stats(struct net_device *netdev,
 		data[2] = dev->tx_queues[i]->tx.stats.dropped;
 		data[3] = dev->tx_queues[i]->tx.stats.throttled;
 		data[4] = dev->tx_queues[i]->tx.stats.descriptor;
+		data[5] = dev->tx_queues[i]->tx.stats.cache_hit;
+		data[6] = dev->tx_queues[i]->tx.stats.cache_miss;
+		data[7] = dev->tx_queues[i]->tx.stats.cache_remote;
+		data[8] = dev->tx_queues[i]->tx.stats.zerocopy;
 		data += NUM_STATS_PER_TX_QUEUE;
 	}
 
@@ -120,6 +142,11 @@ static void sn_ethtool_get_ethtool_stats(struct net_device *netdev,
 		data[3] = dev->rx_queues[i]->rx.stats.polls;
 		data[4] = dev->rx_queues[i]->rx.stats.interrupts;
 		data[5] = dev->rx_queues[i]->rx.stats.ll_polls;
+		data[6] = dev->rx_queues[i]->rx.stats.ll_hits;
+		data[7] = dev->rx_queues[i]->rx.stats.ll_packets;
+		data[8] = dev->rx_queues[i]->rx.stats.cache_spill;
+		data[9] = dev->rx_queues[i]->rx.stats.page_alloc;
+		data[10] = dev->rx_queues[i]->rx.stats.page_recycled;
 		data += NUM_STATS_PER_RX_QUEUE;
 	}
 }
@@ -363,15 +363,11 @@ static int sn_guest_create_netdev(void *bar,
 static struct sn_device *p_sndev = NULL;
 
 
-static void interrupt_handler(int itr, u32 msg)
+/* per-queue MSI-X vector, on the vCPU of its affinity hint.
+ * NAPI of the queue runs there, then re-enables the interrupt */
+static void interrupt_handler(int qid, u32 msg)
 {
-	int qid = sn_ivsm_irq_to_qid(itr);
-	//unsigned long flags;
-	//log_info("interrupt on qid: %d itr: %d\n", qid, itr);
-
-	//qid = qid % num_online_cpus();
 	sn_trigger_softirq_with_qid(p_sndev, qid);
-	//smp_call_function_single(qid, sn_trigger_softirq, p_sndev, 0);
 }
 
 int sn_guest_init(void)
@@ -30,17 +30,31 @@
 /* Dual BSD/GPL */
 
 #include <linux/version.h>
+#include <linux/moduleparam.h>
 
 #include "sn.h"
 
-static void 
-sn_dump_queue_mapping(struct sn_device *dev) __attribute__((unused));
+/* Free snbufs (from RX) are kept in a per-CPU cache for TX allocation, 
+ * instead of going through the drv_to_sn/sn_to_drv rings. Each CPU has a
+ * stack per NUMA node, and allocation prefers the local one, so that TX 
+ * packets are built in local memory. Buffers of other nodes are used only
+ * when the sn_to_drv ring runs dry. Nodes >= SNB_CACHE_MAX_NODES are not 
+ * cached. */
+#define SNB_CACHE_MAX_DEPTH	256
+#define SNB_CACHE_MAX_NODES	4
 
-#define BUFS_PER_CPU 32
+static unsigned int snb_cache_depth = 32;
+module_param(snb_cache_depth, uint, 0644);
+MODULE_PARM_DESC(snb_cache_depth, "snbufs cached per CPU and NUMA node "
+		"(max " __stringify(SNB_CACHE_MAX_DEPTH) ")");
 
 struct snb_cache {
-	phys_addr_t paddr[BUFS_PER_CPU];
-	int cnt;
+	struct {
+		phys_addr_t paddr[SNB_CACHE_MAX_DEPTH];
+		int cnt;
+	} node[SNB_CACHE_MAX_NODES];
+
+	int total;	/* sum of node[].cnt */
 };
 
 DEFINE_PER_CPU(struct snb_cache, snb_cache);
@@ -80,72 +94,96 @@ static int sn_host_release(struct inode *inode, struct file *filp)
 	return 0;
 }
 
-static int load_from_cache(phys_addr_t paddr[], int cnt)
+static int load_from_cache(struct snb_cache *cache, int nid, 
+		phys_addr_t paddr[], int cnt)
 {
-	struct snb_cache *cache;
 	int loaded;
 
-	cache = this_cpu_ptr(&snb_cache);
-
-	loaded = min(cnt, cache->cnt);
+	loaded = min(cnt, cache->node[nid].cnt);
 
-	memcpy(paddr, &cache->paddr[cache->cnt - loaded],
+	memcpy(paddr, &cache->node[nid].paddr[cache->node[nid].cnt - loaded],
 			loaded * sizeof(phys_addr_t));
-	cache->cnt -= loaded;
+	cache->node[nid].cnt -= loaded;
+	cache->total -= loaded;
 
 	return loaded;
 }
 
-static int store_to_cache(phys_addr_t paddr[], int cnt)
+/* returns 0 if the cache for the node is full (or not cached at all) */
+static int store_to_cache(struct snb_cache *cache, phys_addr_t paddr)
 {
-	struct snb_cache *cache;
-	int free_slots;
-	int stored;
+	int nid = pfn_to_nid(paddr >> PAGE_SHIFT);
+	int depth = min_t(int, snb_cache_depth, SNB_CACHE_MAX_DEPTH);
 
-	cache = this_cpu_ptr(&snb_cache);
-
-	free_slots = BUFS_PER_CPU - cache->cnt;
-	stored = min(cnt, free_slots);
+	if (unlikely(nid >= SNB_CACHE_MAX_NODES) || 
+			cache->node[nid].cnt >= depth)
+		return 0;
 
-	memcpy(&cache->paddr[cache->cnt], paddr, 
-			stored * sizeof(phys_addr_t));
-	cache->cnt += stored;
+	cache->node[nid].paddr[cache->node[nid].cnt++] = paddr;
+	cache->total++;
 
-	return stored;
+	return 1;
 }
 
 static int alloc_snb_burst(struct sn_queue *queue, phys_addr_t paddr[], int cnt)
 {
-	int loaded;
+	struct snb_cache *cache = this_cpu_ptr(&snb_cache);
+	int local = numa_node_id();
+	int loaded = 0;
+	int ret;
+	int nid;
+
+	if (likely(local < SNB_CACHE_MAX_NODES)) {
+		loaded = load_from_cache(cache, local, paddr, cnt);
+		queue->tx.stats.cache_hit += loaded;
+		if (loaded == cnt)
+			return cnt;
+	}
 
-	loaded = load_from_cache(paddr, cnt);
+	ret = llring_sc_dequeue_burst(queue->sn_to_drv, 
+			(void *)&paddr[loaded], cnt - loaded);
+	queue->tx.stats.cache_miss += ret;
+	loaded += ret;
 	if (loaded == cnt)
 		return cnt;
 
-	cnt = llring_sc_dequeue_burst(queue->sn_to_drv, (void *)&paddr[loaded],
-			cnt - loaded);
-	return loaded + cnt;
+	/* better remote memory than dropping the packet */
+	for (nid = 0; nid < SNB_CACHE_MAX_NODES && loaded < cnt; nid++) {
+		if (nid == local)
+			continue;
+
+		ret = load_from_cache(cache, nid, &paddr[loaded], cnt - loaded);
+		queue->tx.stats.cache_remote += ret;
+		loaded += ret;
+	}
+
+	return loaded;
 }
 
 static void free_snb_bulk(struct sn_queue *queue, phys_addr_t paddr[], int cnt)
 {
+	struct snb_cache *cache = this_cpu_ptr(&snb_cache);
 	uint64_t vaddr_user[MAX_BATCH];
 
-	int stored;
+	int spilled = 0;
 	int ret;
 	int i;
 
-	stored = store_to_cache(paddr, cnt);
-	if (stored == cnt)
-		return;
+	for (i = 0; i < cnt; i++) {
+		if (store_to_cache(cache, paddr[i]))
+			continue;
 
-	for (i = stored; i < cnt; i++)
-		vaddr_user[i] = *(uint64_t *)phys_to_virt(paddr[i] + 
+		vaddr_user[spilled++] = *(uint64_t *)phys_to_virt(paddr[i] + 
 				SNBUF_IMMUTABLE_OFF);
+	}
+
+	if (spilled == 0)
+		return;
+
+	queue->rx.stats.cache_spill += spilled;
 
 	ret = llring_sp_enqueue_bulk(queue->drv_to_sn,
-			(void **)&vaddr_user[stored],
-			cnt - stored);
+			(void **)vaddr_user, spilled);
 
 	if (ret == -LLRING_ERR_NOBUF && net_ratelimit()) {
 		log_err("%s: RX free queue overflow!\n", 
@@ -153,6 +191,120 @@ static void free_snb_bulk(struct sn_queue *queue, phys_addr_t paddr[], int cnt)
 	}
 }
 
+/* # of free snbufs that alloc_snb_burst() can return for sure.
+ * The TX queue lock must be held (we are the only consumer) */
+static int avail_snbs(struct sn_queue *queue)
+{
+	return this_cpu_ptr(&snb_cache)->total + llring_count(queue->sn_to_drv);
+}
+
+static inline uint64_t snb_vaddr_user(phys_addr_t paddr)
+{
+	return *((uint64_t *)phys_to_virt(paddr + SNBUF_IMMUTABLE_OFF));
+}
+
+/* Copies a large (e.g., GSO) skb into a chain of snbufs.
+ * The head snbuf is given, and others must be available */
+static void copy_skb_chain(struct sn_queue *queue, struct sk_buff *skb,
+		phys_addr_t head, int num_segs)
+{
+	phys_addr_t paddr_arr[SN_TX_MAX_SEGS];
+	int offset = 0;
+	int i;
+
+	paddr_arr[0] = head;
+	alloc_snb_burst(queue, &paddr_arr[1], num_segs - 1);
+
+	for (i = 0; i < num_segs; i++) {
+		struct sn_tx_desc *desc;
+		int len;
+
+		desc = phys_to_virt(paddr_arr[i] + SNBUF_SCRATCHPAD_OFF);
+		len = min_t(int, skb->len - offset, SNBUF_DATA);
+
+		/* deals with frags and frag_list */
+		skb_copy_bits(skb, offset, 
+				phys_to_virt(paddr_arr[i] + SNBUF_DATA_OFF), 
+				len);
+		offset += len;
+
+		desc->seg_len = len;
+		desc->ext_seg = 0;
+		desc->next = (i + 1 < num_segs) ? 
+				snb_vaddr_user(paddr_arr[i + 1]) : 0;
+	}
+}
+
+/* # of snbufs needed to send the skb without copying its frags, 
+ * or 0 if it should be copied */
+static int zc_num_segs(struct sn_queue *queue, struct sk_buff *skb)
+{
+	int num_segs = 1;
+	int i;
+
+	if (skb->len < queue->tx.opts.zc_min_len || 
+			!skb_shinfo(skb)->nr_frags || skb_has_frag_list(skb))
+		return 0;
+
+	/* BESS looks at the headers in the head snbuf */
+	if (skb_headlen(skb) < ETH_HLEN || skb_headlen(skb) > SNBUF_DATA)
+		return 0;
+
+	for (i = 0; i < skb_shinfo(skb)->nr_frags; i++) {
+		skb_frag_t *frag = &skb_shinfo(skb)->frags[i];
+
+		num_segs += DIV_ROUND_UP(skb_frag_size(frag), SNBUF_DATA);
+	}
+
+	return (num_segs <= SN_TX_MAX_SEGS) ? num_segs : 0;
+}
+
+/* Copies the linear part into the head snbuf, and describes the frags with
+ * ext_seg snbufs. The skb is held until BESS returns it via zc_done */
+static void build_zc_chain(struct sn_queue *queue, struct sk_buff *skb,
+		phys_addr_t head, int num_segs)
+{
+	phys_addr_t paddr_arr[SN_TX_MAX_SEGS];
+	struct sn_tx_desc *desc;
+	int n = 1;
+	int i;
+
+	paddr_arr[0] = head;
+	alloc_snb_burst(queue, &paddr_arr[1], num_segs - 1);
+
+	desc = phys_to_virt(head + SNBUF_SCRATCHPAD_OFF);
+
+	memcpy(phys_to_virt(head + SNBUF_DATA_OFF), skb->data, 
+			skb_headlen(skb));
+	desc->seg_len = skb_headlen(skb);
+	desc->zc_cookie = (uint64_t)skb_get(skb);
+
+	for (i = 0; i < skb_shinfo(skb)->nr_frags; i++) {
+		skb_frag_t *frag = &skb_shinfo(skb)->frags[i];
+		phys_addr_t base = virt_to_phys(skb_frag_address(frag));
+		int size = skb_frag_size(frag);
+		int offset = 0;
+
+		/* frags are in (compound) pages, physically contiguous */
+		while (offset < size) {
+			int len = min_t(int, size - offset, SNBUF_DATA);
+
+			desc->next = snb_vaddr_user(paddr_arr[n]);
+
+			desc = phys_to_virt(paddr_arr[n] + 
+					SNBUF_SCRATCHPAD_OFF);
+			desc->seg_len = len;
+			desc->ext_seg = base + offset;
+
+			offset += len;
+			n++;
+		}
+	}
+
+	desc->next = 0;
+	queue->tx.stats.zerocopy++;
+}
+
 static int sn_host_do_tx_batch(struct sn_queue *queue,
 		struct sk_buff *skb_arr[], 
 		struct sn_tx_metadata meta_arr[],
@@ -165,10 +317,34 @@ static int sn_host_do_tx_batch(struct sn_queue *queue,
 
 	phys_addr_t paddr_arr[MAX_BATCH];
 	uint64_t vaddr_user[MAX_BATCH];
+	int num_segs[MAX_BATCH];
+	bool zc[MAX_BATCH];
+	int avail;
+
+	if (queue->tx.zc_done)
+		sn_reclaim_zc_tx(queue);
 
 	cnt_to_send = min(cnt_requested, 
 			(int)llring_free_count(queue->drv_to_sn));
 
+	/* send only as many packets as we have snbufs for all segments */
+	avail = avail_snbs(queue);
+	for (i = 0; i < cnt_to_send; i++) {
+		num_segs[i] = queue->tx.zc_done ? 
+				zc_num_segs(queue, skb_arr[i]) : 0;
+		zc[i] = (num_segs[i] > 0);
+
+		if (!zc[i])
+			num_segs[i] = max(1, (int)DIV_ROUND_UP(skb_arr[i]->len,
+						SNBUF_DATA));
+
+		if (num_segs[i] > SN_TX_MAX_SEGS || num_segs[i] > avail)
+			break;
+
+		avail -= num_segs[i];
+	}
+	cnt_to_send = i;
+
 	cnt = alloc_snb_burst(queue, paddr_arr, cnt_to_send);
 	queue->tx.stats.descriptor += cnt_requested - cnt;
 
@@ -183,14 +359,29 @@ static int sn_host_do_tx_batch(struct sn_queue *queue,
 
 		int j;
 		
-		vaddr_user[i] = *((uint64_t *)phys_to_virt(paddr + 
-					SNBUF_IMMUTABLE_OFF));
-		dst_addr = phys_to_virt(paddr + SNBUF_DATA_OFF);
+		vaddr_user[i] = snb_vaddr_user(paddr);
 		tx_desc = phys_to_virt(paddr + SNBUF_SCRATCHPAD_OFF);
 
 		tx_desc->total_len = skb->len;
 		tx_desc->meta = meta_arr[i];
 
+		if (zc[i]) {
+			build_zc_chain(queue, skb, paddr, num_segs[i]);
+			continue;
+		}
+
+		tx_desc->zc_cookie = 0;
+
+		if (num_segs[i] > 1) {
+			copy_skb_chain(queue, skb, paddr, num_segs[i]);
+			continue;
+		}
+
+		tx_desc->seg_len = skb->len;
+		tx_desc->next = 0;
+
+		dst_addr = phys_to_virt(paddr + SNBUF_DATA_OFF);
+
 		memcpy(dst_addr, skb->data, skb_headlen(skb));
 		dst_addr += skb_headlen(skb);
 
@@ -350,14 +541,10 @@ static int sn_host_do_rx_batch(struct sn_queue *queue,
 		rx_meta[i] = rx_desc->meta;
 		total_len = rx_desc->total_len;
 
-#if (LINUX_VERSION_CODE < KERNEL_VERSION(3,19,0))
-		skb = skbs[i] = netdev_alloc_skb(queue->dev->netdev, total_len);
-#else 
-		skb = skbs[i] = napi_alloc_skb(&queue->rx.napi, total_len);
-#endif
+		skb = skbs[i] = sn_alloc_rx_skb(queue, total_len);
 		if (!skb) {
 			if (net_ratelimit())
-				log_err("napi_alloc_skb() failed\n");
+				log_err("sn_alloc_rx_skb() failed\n");
 			continue;
 		}
 
@@ -400,52 +587,6 @@ static struct sn_ops sn_host_ops = {
 	.flush_tx	= sn_host_flush_tx,
 };
 
-static void sn_dump_queue_mapping(struct sn_device *dev) 
-{
-	char buf[512];
-	int buflen;
-
-	int cpu;
-
-	buflen = sprintf(buf, "CPU->TXQ mapping: ");
-
-	for_each_online_cpu(cpu) {
-		buflen += sprintf(buf + buflen, "%d->%d ", cpu, 
-				dev->cpu_to_txq[cpu]);
-	}
-
-	log_info("%s\n", buf);
-
-	buflen = sprintf(buf, "CPU->RXQ mapping: ");
-
-	for_each_online_cpu(cpu) {
-		int i = 0;
-
-		if (dev->cpu_to_rxqs[cpu][0] == -1)
-			continue;
-
-		if (dev->cpu_to_rxqs[cpu][1] == -1) {
-			/* 1-to-1 mapping */
-			buflen += sprintf(buf + buflen, "%d->%d ", cpu, 
-					dev->cpu_to_rxqs[cpu][0]);
-
-		} else {
-			buflen += sprintf(buf + buflen, "%d->[", cpu);
-
-			while (dev->cpu_to_rxqs[cpu][i] != -1) {
-				buflen += sprintf(buf + buflen, "%s%d", 
-						i > 0 ? ", " : "",
-						dev->cpu_to_rxqs[cpu][i]);
-				i++;
-			}
-
-			buflen += sprintf(buf + buflen, "] ");
-		}
-	}
-
-	log_info("%s\n", buf);
-}
-
 static int sn_host_ioctl_create_netdev(phys_addr_t bar_phys,
 				     struct sn_device **dev_ret)
 {
@@ -468,6 +609,9 @@ static int sn_host_ioctl_create_netdev(phys_addr_t bar_phys,
 	(*dev_ret)->ops = &sn_host_ops;
 	(*dev_ret)->pdev = NULL;
 
+	if (((struct sn_conf_space *)bar)->txq_opts.offload)
+		sn_enable_tx_offloads(*dev_ret);
+
 	ret = sn_register_netdev(bar, *dev_ret);
 	if (ret)
 		*dev_ret = NULL;
@@ -560,6 +704,10 @@ static int sn_host_ioctl_set_queue_mapping(
 
 		dev->cpu_to_rxqs[cpu][cnt] = rxq;
 		dev->cpu_to_rxqs[cpu][cnt + 1] = -1;
+
+		/* the starting point. TX queue owners will take over */
+		if (dev->auto_map)
+			sn_set_auto_kick_cpu(dev, rxq, cpu);
 	}
 
 	/* sn_dump_queue_mapping(dev); */
@@ -7,6 +7,7 @@
 #include <linux/pci.h>
 #include <linux/interrupt.h>
 #include <linux/fs.h>
+#include <linux/version.h>
 
 #include "sn.h"
 #include "sn_ivshmem.h"
@@ -59,19 +60,31 @@ typedef struct sn_ivsm_device {
 
 	struct pci_dev *dev;
 	char (*msix_names)[256];
-	struct msix_entry *msix_entries;
+	struct msix_entry *msix_entries;	/* also the dev_id of each */
 	int nvectors;
+	int nqueues;
 	bool msix_enabled;
-	void (*interrupt_handler)(int irq, u32 msg);
+	void (*interrupt_handler)(int qid, u32 msg);
 } sn_ivsm_device;
 
 sn_ivsm_device sn_ivsm_dev;
 
+static void sn_ivsm_free_msix_vectors(int nr_irqs)
+{
+	int i;
+
+	for (i = 0; i < nr_irqs; i++) {
+		unsigned int irq = sn_ivsm_dev.msix_entries[i].vector;
+
+		irq_set_affinity_hint(irq, NULL);
+		free_irq(irq, &sn_ivsm_dev.msix_entries[i]);
+	}
+}
+
 static int sn_ivsm_request_msix_vectors(unsigned int nvec)
 {
 	int i, ret, cpu;
 	
-	sn_ivsm_dev.nvectors = nvec;
 	sn_ivsm_dev.msix_entries = kmalloc(nvec * sizeof(*sn_ivsm_dev.msix_entries),
 					GFP_KERNEL);
 
@@ -83,86 +96,119 @@ static int sn_ivsm_request_msix_vectors(unsigned int nvec)
 				      GFP_KERNEL);
 
 	if (!sn_ivsm_dev.msix_names) {
-		kfree(sn_ivsm_dev.msix_entries);
-		sn_ivsm_dev.msix_entries = NULL;
-		return -ENOMEM;
+		ret = -ENOMEM;
+		goto free_entries;
 	}
 
-
 	for (i = 0; i < nvec; i++)
 		sn_ivsm_dev.msix_entries[i].entry = i;
 
-	ret = pci_enable_msix(sn_ivsm_dev.dev, sn_ivsm_dev.msix_entries,
-			      sn_ivsm_dev.nvectors);
-	if (0 != ret) {
-		log_info("no MSI pci_enable_msix ret: %d\n", ret);
-		return -ENOSPC;
+	/* take fewer vectors than queues, rather than none */
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,14,0))
+	ret = pci_enable_msix_range(sn_ivsm_dev.dev, sn_ivsm_dev.msix_entries,
+			1, nvec);
+#else
+	/* >0: only that many are available */
+	ret = nvec;
+	for (;;) {
+		int avail = pci_enable_msix(sn_ivsm_dev.dev, 
+				sn_ivsm_dev.msix_entries, ret);
+		if (avail <= 0) {
+			ret = avail ? avail : ret;
+			break;
+		}
+		ret = avail;
+	}
+#endif
+	if (ret <= 0) {
+		log_info("no MSI-X pci_enable_msix ret: %d\n", ret);
+		ret = -ENOSPC;
+		goto free_names;
 	}
 
-	
+	sn_ivsm_dev.nvectors = ret;
+
+	/* spread the vectors (hence the NAPI contexts) over vCPUs.
+	 * Unlike irq_set_affinity(), the hint is exported to modules, 
+	 * and irqbalance follows it */
 	for (i = 0, cpu = cpumask_first(cpu_online_mask); 
-	     i < nvec;
-	     i++, cpu = cpumask_next(cpu, cpu_online_mask) ) {
-		//cpumask_t cpumask;
-		//int irq = sn_ivsm_dev.msix_entries[i].vector;
+	     i < sn_ivsm_dev.nvectors;
+	     i++, cpu = cpumask_next(cpu, cpu_online_mask)) {
+		unsigned int irq = sn_ivsm_dev.msix_entries[i].vector;
+
+		if (cpu >= nr_cpu_ids)
+			cpu = cpumask_first(cpu_online_mask);
 
 		snprintf(sn_ivsm_dev.msix_names[i], sizeof(*sn_ivsm_dev.msix_names),
-			 "%s-%d", DEVICE_NAME, i);
+			 "%s-rx-%d", DEVICE_NAME, i);
 
-		ret = request_irq(sn_ivsm_dev.msix_entries[i].vector,
-				  &sn_ivsm_interrupt, 0,
-				  sn_ivsm_dev.msix_names[i], &sn_ivsm_dev);
+		ret = request_irq(irq, &sn_ivsm_interrupt, 0,
+				  sn_ivsm_dev.msix_names[i], 
+				  &sn_ivsm_dev.msix_entries[i]);
 
 		if (0 != ret) {
 			log_err("couldn't allocate irq for msi-x ");
-			log_err("entry %d with vector %d\n", 
-				i, sn_ivsm_dev.msix_entries[i].vector);
-			return -ENOSPC;
+			log_err("entry %d with vector %d\n", i, irq);
+			sn_ivsm_free_msix_vectors(i);
+			pci_disable_msix(sn_ivsm_dev.dev);
+			ret = -ENOSPC;
+			goto free_names;
 		}
 
-		//map irq to the core. cannot be done due to unexported symbol irq_set_affinity
-		//leaving the code for the future :)
-		//
-		//cpumask_clear(&cpumask);
-		//cpumask_set_cpu(cpu, &cpumask);
-		//log_info("setting irq %d affinity with cpu %d\n", irq, cpu);
-		//	 ret = irq_set_affinity(irq, &cpumask);
-
+		irq_set_affinity_hint(irq, cpumask_of(cpu));
 	}
 
-	log_info("MSI-X enabled\n");
+	log_info("MSI-X enabled: %d vectors for %d queues\n", 
+			sn_ivsm_dev.nvectors, nvec);
 	sn_ivsm_dev.msix_enabled = true;
 	return 0;
+
+free_names:
+	kfree(sn_ivsm_dev.msix_names);
+	sn_ivsm_dev.msix_names = NULL;
+free_entries:
+	kfree(sn_ivsm_dev.msix_entries);
+	sn_ivsm_dev.msix_entries = NULL;
+	sn_ivsm_dev.nvectors = 0;
+	return ret;
 }
 
 
-static irqreturn_t sn_ivsm_interrupt(int irq, void *pdev_)
+static irqreturn_t sn_ivsm_interrupt(int irq, void *dev_id)
 {
 	u32 msg = 0;
-	struct sn_ivsm_device *pdev = pdev_;
+	int qid;
+	int step;
 
-	if (unlikely(pdev == NULL))
+	if (unlikely(dev_id == NULL))
 		return IRQ_NONE;
 
-	/* msg = readl(pdev->regs + INTRSTAT_OFFSET); */
-	//if (!msg || (msg == 0xFFFFFFFF))
-	//	return IRQ_NONE;
+	if (!sn_ivsm_dev.interrupt_handler)
+		return IRQ_HANDLED;
 
-	if (sn_ivsm_dev.interrupt_handler) {
-		//log_info("calling interrupt handler %p \n",pdev_);
-		sn_ivsm_dev.interrupt_handler(irq, msg);
+	if (dev_id == &sn_ivsm_dev) {
+		/* legacy IRQ: any queue */
+		qid = 0;
+		step = 1;
+	} else {
+		qid = ((struct msix_entry *)dev_id)->entry;
+		step = sn_ivsm_dev.nvectors;
 	}
 
+	for (; qid < sn_ivsm_dev.nqueues; qid += step)
+		sn_ivsm_dev.interrupt_handler(qid, msg);
 
 	return IRQ_HANDLED;
 }
 
-int sn_ivsm_register_interrupt(unsigned int nvec)
+int sn_ivsm_register_interrupt(unsigned int num_queues)
 {
 	int ret;
 
+	sn_ivsm_dev.nqueues = num_queues;
+
 	//try MSI-X
-	ret = sn_ivsm_request_msix_vectors(nvec);
+	ret = sn_ivsm_request_msix_vectors(num_queues);
 
 	/* if it doesn't work try with regular IRQ */
 	if (ret) {
@@ -182,11 +228,8 @@ int sn_ivsm_register_interrupt(unsigned int nvec)
 
 static int sn_ivsm_unregister_interrupt(void)
 {
-	int i;
 	if (sn_ivsm_dev.msix_enabled) {
-		for (i = 0; i < sn_ivsm_dev.nvectors; i++) {
-			free_irq(sn_ivsm_dev.msix_entries[i].vector, &sn_ivsm_dev);
-		}
+		sn_ivsm_free_msix_vectors(sn_ivsm_dev.nvectors);
 		pci_disable_msix(sn_ivsm_dev.dev);
 
 		//free msix kmallocs
@@ -323,7 +366,7 @@ long sn_ivsm_mmap(struct file *filp, struct vm_area_struct *vma)
 	return 0;
 }
 
-void sn_ivsm_register_ih(void (*ih)(int itr, u32 msg))
+void sn_ivsm_register_ih(void (*ih)(int qid, u32 msg))
 {
 	log_info("set interrupt handler\n");
 	sn_ivsm_dev.interrupt_handler = ih;
@@ -339,16 +382,6 @@ long sn_ivsm_get_len(void)
 	return sn_ivsm_dev.ioaddr_size;
 }
 
-int sn_ivsm_irq_to_qid(int irq)
-{
-	int irq_base = sn_ivsm_dev.msix_entries[0].vector;
-	while (sn_ivsm_dev.msix_entries[irq - irq_base].vector != irq &&
-	       (irq - irq_base) < (sn_ivsm_dev.nvectors - 1)) {
-		irq_base--;
-	} 
-	return irq - irq_base;
-}
-
 int sn_ivsm_init(void)
 {
 	int ret = -ENOMEM;
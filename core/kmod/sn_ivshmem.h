@@ -1,9 +1,11 @@
 
-int sn_ivsm_irq_to_qid(int irq);
-int sn_ivsm_register_interrupt(unsigned int nvec);
+/* One MSI-X vector per RX queue, if available. Otherwise the queues share
+ * the vectors (queue i on vector i % nvectors), or the legacy IRQ */
+int sn_ivsm_register_interrupt(unsigned int num_queues);
 long sn_ivsm_mmap(struct file *filp, struct vm_area_struct *vma);
 int sn_ivsm_init(void);
 void sn_ivsm_cleanup(void);
 void* sn_ivsm_get_start(void);
 long sn_ivsm_get_len(void);
-void sn_ivsm_register_ih(void (*ih)(int itr, u32 msg));
+/* ih is called in IRQ context, once for each queue of the vector */
+void sn_ivsm_register_ih(void (*ih)(int qid, u32 msg));
@@ -53,6 +53,17 @@
 
 #define MAX_BATCH	32
 
+/* RX skbs are built over chunks of these pages (see sn_alloc_rx_skb()).
+ * A page is reused once all skbs carved from it have been freed */
+#define SN_RX_POOL_PAGES	8
+#define SN_RX_POOL_ORDER	3	/* 32KB with 4KB pages */
+
+struct sn_rx_page_pool {
+	struct page *pages[SN_RX_POOL_PAGES];
+	int cur;		/* the page being carved */
+	unsigned int offset;	/* in pages[cur] */
+};
+
 DECLARE_PER_CPU(int, in_batched_polling);
 
 struct sn_device;
@@ -79,10 +90,19 @@ struct sn_queue {
 				u64 dropped;
 				u64 throttled;
 				u64 descriptor;
+				/* snbufs from the local node cache, 
+				 * the sn_to_drv ring, and remote node caches */
+				u64 cache_hit;
+				u64 cache_miss;
+				u64 cache_remote;
+				u64 zerocopy;
 			} stats;
 
 			struct netdev_queue *netdev_txq;
 
+			/* NULL unless opts.zc_min_len is set */
+			struct llring *zc_done;
+
 			struct tx_queue_opts opts;
 		} tx;
 
@@ -93,12 +113,23 @@ struct sn_queue {
 				u64 dropped;
 				u64 polls;
 				u64 interrupts;
-				u64 ll_polls;
+				u64 ll_polls;	/* busy polls */
+				u64 ll_hits;	/* ... that got packets */
+				u64 ll_packets;	/* received by busy polls */
+				/* freed snbufs not fitting in the cache */
+				u64 cache_spill;
+				u64 page_alloc;		/* for the pool */
+				u64 page_recycled;
 			} stats;
 
 			struct sn_rxq_registers *rx_regs;
 			struct napi_struct napi;
 
+			struct sn_rx_page_pool pool;
+
+			/* in sn_poll_ll(), which cannot use GRO */
+			bool ll_active;
+
 			spinlock_t lock; /* kernel has its own locks for TX */
 
 			struct rx_queue_opts opts;
@@ -147,6 +178,13 @@ struct sn_device {
 	/* cpu -> rxq array terminating with -1 */
 	int cpu_to_rxqs[NR_CPUS][MAX_QUEUES + 1];
 
+	/* conf->auto_queue_map. See sn_auto_txq() */
+	bool auto_map;
+	spinlock_t auto_map_lock;
+	int txq_owner[MAX_QUEUES];		/* CPU, -1 if none */
+	int auto_txq[NR_CPUS];			/* -1 if not assigned yet */
+	unsigned long cpu_last_tx[NR_CPUS];	/* in jiffies */
+
 	enum sn_dev_type type;
 	struct sn_ops *ops;
 	struct pci_dev *pdev;	/* NULL in host mode */
@@ -154,8 +192,13 @@ struct sn_device {
 
 /* function prototypes defined in sn_netdev.c */
 int sn_create_netdev(void *bar, struct sn_device **dev_ret);
+void sn_enable_tx_offloads(struct sn_device *dev);
 int sn_register_netdev(void *bar, struct sn_device *dev);
 void sn_release_netdev(struct sn_device *dev);
+void sn_reclaim_zc_tx(struct sn_queue *tx_queue);
+struct sk_buff *sn_alloc_rx_skb(struct sn_queue *rx_queue, int len);
+void sn_dump_queue_mapping(struct sn_device *dev);
+void sn_set_auto_kick_cpu(struct sn_device *dev, int rxq, int cpu);
 void sn_trigger_softirq(void *info);	/* info is (struct sn_device *) */
 void sn_trigger_softirq_with_qid(void *info, int rxq);
 
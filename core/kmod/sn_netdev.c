@@ -119,6 +119,11 @@ static int sn_alloc_queues(struct sn_device *dev,
 		queue->sn_to_drv = (struct llring *)p;
 		p += llring_bytes(queue->sn_to_drv);
 
+		if (txq_opts->zc_min_len) {
+			queue->tx.zc_done = (struct llring *)p;
+			p += llring_bytes(queue->tx.zc_done);
+		}
+
 		queue++;
 	}
 
@@ -162,13 +167,49 @@ static int sn_alloc_queues(struct sn_device *dev,
 	return 0;
 }
 
+/* Releases zero-copy skbs that BESS is done with.
+ * The TX queue lock must be held, or the device must be gone. */
+void sn_reclaim_zc_tx(struct sn_queue *tx_queue)
+{
+	struct sk_buff *skbs[MAX_BATCH];
+	int cnt;
+	int i;
+
+	do {
+		cnt = llring_sc_dequeue_burst(tx_queue->tx.zc_done, 
+				(void **)skbs, MAX_BATCH);
+
+		for (i = 0; i < cnt; i++)
+			dev_kfree_skb_any(skbs[i]);
+	} while (cnt == MAX_BATCH);
+}
+
+static void sn_free_rx_pool(struct sn_rx_page_pool *pool)
+{
+	int i;
+
+	/* skbs still in flight hold their own references */
+	for (i = 0; i < SN_RX_POOL_PAGES; i++) {
+		if (pool->pages[i])
+			put_page(pool->pages[i]);
+		pool->pages[i] = NULL;
+	}
+}
+
 static void sn_free_queues(struct sn_device *dev)
 {
 	int i;
 
+	/* skbs still in BESS at this point are leaked, rather than freed
+	 * under a NIC that may be reading them */
+	for (i = 0; i < dev->num_txq; i++)
+		if (dev->tx_queues[i]->tx.zc_done)
+			sn_reclaim_zc_tx(dev->tx_queues[i]);
+
 	for (i = 0; i < dev->num_rxq; i++) {
 		napi_hash_del(&dev->rx_queues[i]->rx.napi);
 		netif_napi_del(&dev->rx_queues[i]->rx.napi);
+		sn_free_rx_pool(&dev->rx_queues[i]->rx.pool);
 	}
 
 	/* Queues are allocated in batch,
@@ -243,7 +284,8 @@ static int sn_process_rx_metadata(struct sk_buff *skb,
 
 	if (rx_meta->gso_mss) {
 		skb_shinfo(skb)->gso_size = rx_meta->gso_mss;
-		skb_shinfo(skb)->gso_type = SKB_GSO_TCPV4;
+		skb_shinfo(skb)->gso_type = rx_meta->gso_tcpv6 ? 
+				SKB_GSO_TCPV6 : SKB_GSO_TCPV4;
 	}
 
 	/* By default, skb->ip_summed == CHECKSUM_NONE */
@@ -259,6 +301,15 @@ static int sn_process_rx_metadata(struct sk_buff *skb,
 		skb->ip_summed = CHECKSUM_UNNECESSARY;
 		break;
 
+	case SN_RX_CSUM_PARTIAL:
+		/* checksum offloading requested by BESS. 
+		 * Also required for GSO packets to be forwarded. */
+		if (!skb_partial_csum_set(skb, rx_meta->csum_start, 
+					rx_meta->csum_dest - 
+					rx_meta->csum_start))
+			ret = -EINVAL;
+		break;
+
 	case SN_RX_CSUM_INCORRECT:
 		/* Incorrect L4/IP checksum */
 		/* fall through, so that packets can be still visible */
@@ -270,6 +321,166 @@ static int sn_process_rx_metadata(struct sk_buff *skb,
 	return ret;
 }
 
+void sn_dump_queue_mapping(struct sn_device *dev) 
+{
+	char buf[512];
+	int buflen;
+
+	int cpu;
+	int i;
+
+	/* bounded, as there may be many more CPUs than fit in buf */
+	buflen = scnprintf(buf, sizeof(buf), "CPU->TXQ mapping: ");
+
+	for_each_online_cpu(cpu) {
+		buflen += scnprintf(buf + buflen, sizeof(buf) - buflen,
+				"%d->%d ", cpu, dev->cpu_to_txq[cpu]);
+	}
+
+	log_info("%s\n", buf);
+
+	buflen = scnprintf(buf, sizeof(buf), "CPU->RXQ mapping: ");
+
+	for_each_online_cpu(cpu) {
+		i = 0;
+
+		if (dev->cpu_to_rxqs[cpu][0] == -1)
+			continue;
+
+		if (dev->cpu_to_rxqs[cpu][1] == -1) {
+			/* 1-to-1 mapping */
+			buflen += scnprintf(buf + buflen, sizeof(buf) - buflen,
+					"%d->%d ", cpu,
+					dev->cpu_to_rxqs[cpu][0]);
+
+		} else {
+			buflen += scnprintf(buf + buflen, sizeof(buf) - buflen,
+					"%d->[", cpu);
+
+			while (dev->cpu_to_rxqs[cpu][i] != -1) {
+				buflen += scnprintf(buf + buflen,
+						sizeof(buf) - buflen, "%s%d",
+						i > 0 ? ", " : "",
+						dev->cpu_to_rxqs[cpu][i]);
+				i++;
+			}
+
+			buflen += scnprintf(buf + buflen, sizeof(buf) - buflen,
+					"] ");
+		}
+	}
+
+	log_info("%s\n", buf);
+
+	if (!dev->auto_map)
+		return;
+
+	buflen = scnprintf(buf, sizeof(buf), "RXQ->CPU kicks (auto): ");
+
+	for (i = 0; i < dev->num_rxq; i++)
+		buflen += scnprintf(buf + buflen, sizeof(buf) - buflen, 
+				"%d->%d ", i, 
+				dev->rx_queues[i]->rx.rx_regs->kick_cpu);
+
+	log_info("%s\n", buf);
+}
+
+
+void sn_set_auto_kick_cpu(struct sn_device *dev, int rxq, int cpu)
+{
+	dev->rx_queues[rxq]->rx.rx_regs->kick_cpu = cpu;
+}
+
+/* Automatic queue mapping (conf->auto_queue_map).
+ *
+ * The first time a CPU sends, it takes a TX queue with no owner, or one 
+ * whose owner has been idle for SN_AUTO_MAP_IDLE. If all are taken, it 
+ * shares one, and looks again once per jiffy. The owner of TX queue i also
+ * gets the kicks of RX queue i, so that each queue pair is touched by one
+ * kernel CPU (and one BESS worker, with one task per queue). */
+#define SN_AUTO_MAP_IDLE	HZ
+
+static int sn_auto_assign_txq(struct sn_device *dev, int cpu, 
+		unsigned long now)
+{
+	int txq;
+	int old;
+	int changed;
+
+	spin_lock(&dev->auto_map_lock);
+
+	old = dev->auto_txq[cpu];
+	if (old >= 0 && dev->txq_owner[old] == cpu) {
+		/* someone else did it for us? */
+		spin_unlock(&dev->auto_map_lock);
+		return old;
+	}
+
+	for (txq = 0; txq < dev->num_txq; txq++) {
+		int owner = dev->txq_owner[txq];
+
+		if (owner < 0 || time_after(now, 
+				dev->cpu_last_tx[owner] + SN_AUTO_MAP_IDLE))
+			break;
+	}
+
+	if (txq < dev->num_txq) {
+		int prev_owner = dev->txq_owner[txq];
+
+		/* it will look for a new one when it comes back */
+		if (prev_owner >= 0)
+			dev->auto_txq[prev_owner] = -1;
+
+		dev->txq_owner[txq] = cpu;
+		if (txq < dev->num_rxq)
+			sn_set_auto_kick_cpu(dev, txq, cpu);
+	} else 
+		txq = (old >= 0) ? old : cpu % dev->num_txq;
+
+	/* a new owner, or a CPU that had no queue */
+	changed = (dev->txq_owner[txq] == cpu || old < 0);
+
+	dev->auto_txq[cpu] = txq;
+	dev->cpu_to_txq[cpu] = txq;
+	dev->cpu_last_tx[cpu] = now;
+
+	spin_unlock(&dev->auto_map_lock);
+
+	/* this is on the TX path: owners may keep changing if CPUs take 
+	 * turns sending, so do not flood the log (nor spend time on it) */
+	if (changed && net_ratelimit())
+		sn_dump_queue_mapping(dev);
+
+	return txq;
+}
+
+static inline int sn_auto_txq(struct sn_device *dev, int cpu)
+{
+	unsigned long now = jiffies;
+	int txq = dev->auto_txq[cpu];
+
+	if (likely(txq >= 0)) {
+		/* write at most once per jiffy */
+		if (likely(dev->cpu_last_tx[cpu] == now))
+			return txq;
+
+		if (likely(dev->txq_owner[txq] == cpu)) {
+			dev->cpu_last_tx[cpu] = now;
+			return txq;
+		}
+	}
+
+	return sn_auto_assign_txq(dev, cpu, now);
+}
+
+static inline int sn_cpu_to_txq(struct sn_device *dev, int cpu)
+{
+	if (dev->auto_map)
+		return sn_auto_txq(dev, cpu);
+
+	return dev->cpu_to_txq[cpu];
+}
+
 static inline int sn_send_tx_queue(struct sn_queue *queue, 
 			            struct sn_device* dev, struct sk_buff* skb);
 
@@ -287,7 +498,7 @@ static void sn_process_loopback(struct sn_device *dev,
 	int lock_required;
 	
 	cpu = raw_smp_processor_id();
-	qid = dev->cpu_to_txq[cpu];
+	qid = sn_cpu_to_txq(dev, cpu);
 	tx_queue = dev->tx_queues[qid];
 
 	lock_required = (tx_queue->tx.netdev_txq->xmit_lock_owner != cpu);
@@ -307,6 +518,111 @@ static void sn_process_loopback(struct sn_device *dev,
 		HARD_TX_UNLOCK(dev->netdev, tx_queue->tx.netdev_txq);
 }
 
+#define SN_RX_POOL_BYTES	(PAGE_SIZE << SN_RX_POOL_ORDER)
+
+#define SN_RX_HEADROOM		(NET_SKB_PAD + NET_IP_ALIGN)
+
+/* bytes taken from the pool for an skb with len bytes of data */
+#define SN_RX_TRUESIZE(len) \
+	(SKB_DATA_ALIGN(SN_RX_HEADROOM + (len)) + \
+	 SKB_DATA_ALIGN(sizeof(struct skb_shared_info)))
+
+/* Returns len bytes from the page pool of the RX queue, NULL if the
+ * allocation of a new page fails. Only the queue owner (NAPI or busy
+ * polling, under rx.lock) calls this. 
+ *
+ * The pool holds a reference to each of its pages, and each chunk carved
+ * from it holds another. When the current page is used up, the next one 
+ * is reused if only the pool holds it (i.e., all its skbs are freed). 
+ * Otherwise it is left to the skbs, and replaced with a new page. */
+static void *sn_rx_pool_alloc(struct sn_queue *rx_queue, unsigned int len)
+{
+	struct sn_rx_page_pool *pool = &rx_queue->rx.pool;
+	struct page *page = pool->pages[pool->cur];
+	void *data;
+
+	if (likely(page && pool->offset + len <= SN_RX_POOL_BYTES))
+		goto carve;
+
+	if (page) {
+		pool->cur = (pool->cur + 1) % SN_RX_POOL_PAGES;
+		page = pool->pages[pool->cur];
+	}
+
+	if (page && page_count(page) == 1) {
+		rx_queue->rx.stats.page_recycled++;
+	} else {
+		if (page)
+			put_page(page);
+
+		page = alloc_pages(GFP_ATOMIC | __GFP_COMP | __GFP_NOWARN, 
+				SN_RX_POOL_ORDER);
+		pool->pages[pool->cur] = page;
+		if (unlikely(!page))
+			return NULL;
+
+		rx_queue->rx.stats.page_alloc++;
+	}
+
+	pool->offset = 0;
+
+carve:
+	data = page_address(page) + pool->offset;
+	pool->offset += len;
+	get_page(page);
+
+	return data;
+}
+
+/* Returns an empty skb with room for len bytes, built over the page pool 
+ * of the RX queue rather than a slab allocation for each packet */
+struct sk_buff *sn_alloc_rx_skb(struct sn_queue *rx_queue, int len)
+{
+	unsigned int truesize = SN_RX_TRUESIZE(len);
+	struct sk_buff *skb;
+	void *data;
+
+	if (unlikely(truesize > SN_RX_POOL_BYTES))
+		goto slow_path;
+
+	data = sn_rx_pool_alloc(rx_queue, truesize);
+	if (unlikely(!data))
+		goto slow_path;
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5,12,0))
+	skb = napi_build_skb(data, truesize);
+#else
+	skb = build_skb(data, truesize);
+#endif
+	if (unlikely(!skb)) {
+		put_page(virt_to_head_page(data));
+		return NULL;
+	}
+
+	skb_reserve(skb, SN_RX_HEADROOM);
+	skb->dev = rx_queue->dev->netdev;
+
+	return skb;
+
+slow_path:
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(3,19,0))
+	return netdev_alloc_skb(rx_queue->dev->netdev, len);
+#else 
+	return napi_alloc_skb(&rx_queue->rx.napi, len);
+#endif
+}
+
+/* GRO, unless busy polled with ndo_busy_poll: net_rx_action() may flush 
+ * the GRO list of the NAPI context at any time, without rx.lock */
+static inline void sn_deliver_skb(struct sn_queue *rx_queue, 
+		struct sk_buff *skb)
+{
+	if (unlikely(rx_queue->rx.ll_active))
+		netif_receive_skb(skb);
+	else
+		napi_gro_receive(&rx_queue->rx.napi, skb);
+}
+
 static int sn_poll_action_batch(struct sn_queue *rx_queue, int budget)
 {
 	struct napi_struct *napi = &rx_queue->rx.napi;
@@ -359,7 +675,7 @@ static int sn_poll_action_batch(struct sn_queue *rx_queue, int budget)
 				if (!skbs[i])
 					continue;
 
-				netif_receive_skb(skbs[i]);
+				sn_deliver_skb(rx_queue, skbs[i]);
 			}
 		} else
 			sn_process_loopback(dev, skbs, cnt);
@@ -400,7 +716,7 @@ static int sn_poll_action_single(struct sn_queue *rx_queue, int budget)
 		skb->protocol = eth_type_trans(skb, napi->dev);
 		skb_mark_napi_id(skb, napi);
 
-		netif_receive_skb(skb);
+		sn_deliver_skb(rx_queue, skb);
 
 		poll_cnt++;
 	}
@@ -416,11 +732,19 @@ static int sn_poll_action(struct sn_queue *rx_queue, int budget)
 		return sn_poll_action_single(rx_queue, budget);
 }
 
-/* disable for now, since it is not tested with new vport implementation */
-#undef CONFIG_NET_RX_BUSY_POLL
+/* Busy polling (SO_BUSY_POLL, or net.core.busy_read/busy_poll sysctls):
+ * the recv()/poll() of an application polls the BESS -> kernel ring
+ * directly, without waiting for the IRQ and the softirq.
+ *
+ * Kernels before 4.11 call ndo_busy_poll (sn_poll_ll() below), which may
+ * race with NAPI on other cores, hence rx.lock. Newer kernels call
+ * sn_poll() itself, owning the NAPI context (NAPI_STATE_IN_BUSY_POLL). */
+#if defined(CONFIG_NET_RX_BUSY_POLL) && \
+		LINUX_VERSION_CODE < KERNEL_VERSION(4,11,0)
+#define SN_HAVE_NDO_BUSY_POLL
 
-#ifdef CONFIG_NET_RX_BUSY_POLL
 #define SN_BUSY_POLL_BUDGET	4
+
 /* Low latency socket callback. Called with bh disabled */
 static int sn_poll_ll(struct napi_struct *napi)
 {
@@ -431,12 +755,13 @@ static int sn_poll_ll(struct napi_struct *napi)
 
 	rx_queue = container_of(napi, struct sn_queue, rx.napi);
 
-	if (!spin_trylock(&rx_queue->lock))
+	if (!spin_trylock(&rx_queue->rx.lock))
 		return LL_FLUSH_BUSY;
 
 	rx_queue->rx.stats.ll_polls++;
 
 	sn_disable_interrupt(rx_queue);
+	rx_queue->rx.ll_active = true;
 
 	/* Meh... Since there is no notification for busy loop completion,
 	 * there is no clean way to avoid race condition w.r.t. interrupts.
@@ -447,6 +772,13 @@ static int sn_poll_ll(struct napi_struct *napi)
 		if (ret == 0)
 			cpu_relax();
 	} while (ret == 0 && idle_cnt++ < 1000);
+
+	rx_queue->rx.ll_active = false;
+
+	if (ret > 0) {
+		rx_queue->rx.stats.ll_hits++;
+		rx_queue->rx.stats.ll_packets += ret;
+	}
 	
 	sn_enable_interrupt(rx_queue);
 
@@ -455,12 +787,33 @@ static int sn_poll_ll(struct napi_struct *napi)
 		napi_schedule(napi);
 	}
 
-	spin_unlock(&rx_queue->lock);
+	spin_unlock(&rx_queue->rx.lock);
 
 	return ret;
 }
 #endif
 
+static inline bool sn_in_busy_poll(struct napi_struct *napi)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,11,0)
+	return test_bit(NAPI_STATE_IN_BUSY_POLL, &napi->state);
+#else
+	return false;
+#endif
+}
+
+/* false if NAPI is still owned (e.g., by busy polling) and the interrupt
+ * should stay disabled */
+static inline bool sn_napi_complete(struct napi_struct *napi, int work_done)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,10,0)
+	return napi_complete_done(napi, work_done);
+#else
+	napi_complete(napi);
+	return true;
+#endif
+}
+
 /* NAPI callback */
 /* The return value says how many packets are actually received */
 static int sn_poll(struct napi_struct *napi, int budget)
@@ -471,15 +824,22 @@ static int sn_poll(struct napi_struct *napi, int budget)
 
 	rx_queue = container_of(napi, struct sn_queue, rx.napi);
 
+	/* being busy polled. Stay scheduled, and retry soon */
 	if (!spin_trylock(&rx_queue->rx.lock))
-		return 0;
+		return budget;
 
-	rx_queue->rx.stats.polls++;
-	
 	ret = sn_poll_action(rx_queue, budget);
 
-	if (ret < budget) {
-		napi_complete(napi);
+	if (sn_in_busy_poll(napi)) {
+		rx_queue->rx.stats.ll_polls++;
+		if (ret > 0) {
+			rx_queue->rx.stats.ll_hits++;
+			rx_queue->rx.stats.ll_packets += ret;
+		}
+	} else
+		rx_queue->rx.stats.polls++;
+
+	if (ret < budget && sn_napi_complete(napi, ret)) {
 		sn_enable_interrupt(rx_queue);
 
 		/* last check for race condition.
@@ -505,6 +865,23 @@ static void sn_set_tx_metadata(struct sk_buff *skb,
 		tx_meta->csum_start = SN_TX_CSUM_DONT;
 		tx_meta->csum_dest = SN_TX_CSUM_DONT;
 	}
+
+	if (skb_is_gso(skb)) {
+		tx_meta->gso_mss = skb_shinfo(skb)->gso_size;
+		tx_meta->gso_tcpv6 = 
+			!!(skb_shinfo(skb)->gso_type & SKB_GSO_TCPV6);
+	} else {
+		tx_meta->gso_mss = 0;
+		tx_meta->gso_tcpv6 = 0;
+	}
+
+	/* usually already there (e.g., sk_txhash of TCP sockets),
+	 * otherwise computed once and kept in the skb */
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(3,14,0))
+	tx_meta->flow_hash = skb_get_rxhash(skb);
+#else
+	tx_meta->flow_hash = skb_get_hash(skb);
+#endif
 }
 
 static inline int sn_send_tx_queue(struct sn_queue *queue, 
@@ -604,7 +981,7 @@ static u16 sn_select_queue(struct net_device *netdev,
 {
 	struct sn_device *dev = netdev_priv(netdev);
 
-	return dev->cpu_to_txq[raw_smp_processor_id()];
+	return sn_cpu_to_txq(dev, raw_smp_processor_id());
 }
 
 static struct 
@@ -642,7 +1019,7 @@ netdev_features_t sn_fix_features(struct net_device *dev,
 static const struct net_device_ops sn_netdev_ops = {
 	.ndo_open		= sn_open,
 	.ndo_stop		= sn_close,
-#ifdef CONFIG_NET_RX_BUSY_POLL
+#ifdef SN_HAVE_NDO_BUSY_POLL
 	.ndo_busy_poll		= sn_poll_ll,
 #endif
 	.ndo_start_xmit		= sn_start_xmit,
@@ -678,6 +1055,26 @@ static void sn_set_offloads(struct net_device *netdev)
 	netdev->features = netdev->hw_features | NETIF_F_NETNS_LOCAL;
 }
 
+/* Only for devices whose do_tx() takes GSO skbs with pending checksums,
+ * as chains of up to SN_TX_MAX_SEGS snbufs. Call before registration. */
+void sn_enable_tx_offloads(struct sn_device *dev)
+{
+	struct net_device *netdev = dev->netdev;
+
+	/* leave room for the VLAN tags of txq_opts */
+	netif_set_gso_max_size(netdev, 
+			SNBUF_DATA * SN_TX_MAX_SEGS - 2 * VLAN_HLEN);
+
+	netdev->hw_features |= NETIF_F_SG |
+			       NETIF_F_IP_CSUM |
+			       NETIF_F_IPV6_CSUM |
+			       NETIF_F_TSO |
+			       NETIF_F_TSO6;
+
+	netdev->hw_enc_features = netdev->hw_features;
+	netdev->features |= netdev->hw_features;
+}
+
 static void sn_set_default_queue_mapping(struct sn_device *dev)
 {
 	int cpu;
@@ -785,6 +1182,11 @@ int sn_create_netdev(void *bar, struct sn_device **dev_ret)
 
 	sn_set_default_queue_mapping(dev);
 
+	dev->auto_map = !!conf->auto_queue_map;
+	spin_lock_init(&dev->auto_map_lock);
+	memset(dev->txq_owner, -1, sizeof(dev->txq_owner));
+	memset(dev->auto_txq, -1, sizeof(dev->auto_txq));
+
 	/* This will disable the default qdisc (mq or pfifo_fast) on the 
 	 * interface. We don't need qdisc since BESS already has its own.
 	 * Also see attach_default_qdiscs() in sch_generic.c */
@@ -808,6 +1210,19 @@ int sn_create_netdev(void *bar, struct sn_device **dev_ret)
 		return ret;
 	}
 
+	if (dev->auto_map) {
+		int rxq;
+		int cpu;
+
+		/* as in sn_set_default_queue_mapping() */
+		for_each_online_cpu(cpu) {
+			for (rxq = 0; dev->cpu_to_rxqs[cpu][rxq] != -1; rxq++)
+				sn_set_auto_kick_cpu(dev, 
+						dev->cpu_to_rxqs[cpu][rxq], 
+						cpu);
+		}
+	}
+
 	*dev_ret = dev;
 	return 0;
 }
@@ -908,6 +1323,38 @@ void sn_trigger_softirq(void *info)
 	struct sn_device *dev = info;
 	int cpu = raw_smp_processor_id();
 
+	if (dev->auto_map) {
+		int found = 0;
+		int rxq;
+
+		for (rxq = 0; rxq < dev->num_rxq; rxq++) {
+			struct sn_queue *rx_queue = dev->rx_queues[rxq];
+
+			if (rx_queue->rx.rx_regs->kick_cpu != cpu)
+				continue;
+
+			rx_queue->rx.stats.interrupts++;
+			napi_schedule(&rx_queue->rx.napi);
+			found++;
+		}
+
+		if (found)
+			return;
+
+		/* the queue moved after BESS read kick_cpu */
+		for (rxq = 0; rxq < dev->num_rxq; rxq++) {
+			struct sn_queue *rx_queue = dev->rx_queues[rxq];
+
+			if (!dev->ops->pending_rx(rx_queue))
+				continue;
+
+			rx_queue->rx.stats.interrupts++;
+			napi_schedule(&rx_queue->rx.napi);
+		}
+
+		return;
+	}
+
 	if (unlikely(dev->cpu_to_rxqs[cpu][0] == -1)) {
 		struct sn_queue *rx_queue = dev->rx_queues[0];
 
@@ -18,15 +18,25 @@
 #include "worker.h"
 #include "driver.h"
 #include "log.h"
+#include "time.h"
+#include "snobj.h"
+#include "snctl.h"
 
 const struct global_opts global_opts;
 static struct global_opts *opts = (struct global_opts *)&global_opts;
 
+/* -b: run the scheduler microbenchmark (after DPDK init), then exit */
+static int run_sched_bench;
+
+/* -r: restore the pipeline from this snapshot at startup */
+static char *snapshot_file;
+
 static void print_usage(char *exec_name)
 {
 	log_info("Usage: %s" \
 		" [-h] [-t] [-c <core>] [-p <port>] [-m <MB>] [-i pidfile]" \
-		" [-f] [-k] [-s] [-d] [-a]\n\n",
+		" [-f] [-k] [-s] [-d] [-a] [-w <rounds>] [-l <us>] [-y <us>] [-b]" \
+		" [-r <snapshot>]\n\n",
 		exec_name);
 
 	log_info("  %-16s This help message\n", 
@@ -52,6 +62,20 @@ static void print_usage(char *exec_name)
 			"-d");
 	log_info("  %-16s Allow multiple instances\n",
 			"-a");
+	log_info("  %-16s Let workers idle for this many rounds steal TCs" \
+			" from busy workers\n",
+			"-w <rounds>");
+	log_info("  %-16s Let workers back off and sleep after being idle" \
+			" for this many microseconds\n",
+			"-l <us>");
+	log_info("  %-16s Autotune task bursts, and back off polling" \
+			" unproductive tasks up to this many microseconds\n",
+			"-y <us>");
+	log_info("  %-16s Run scheduler microbenchmarks and exit\n",
+			"-b");
+	log_info("  %-16s Restore the pipeline from a snapshot file" \
+			" (see \"save_snapshot\")\n",
+			"-r <file>");
 
 	exit(2);
 }
@@ -64,7 +88,7 @@ static void parse_args(int argc, char **argv)
 
 	num_workers = 0;
 
-	while ((c = getopt(argc, argv, ":htc:p:fksdm:i:a")) != -1) {
+	while ((c = getopt(argc, argv, ":htc:p:fksdm:i:aw:l:y:br:")) != -1) {
 		switch (c) {
 		case 'h':
 			print_usage(argv[0]);
@@ -121,6 +145,40 @@ static void parse_args(int argc, char **argv)
 			opts->multi_instance = 1;
 			break;
 
+		case 'w':
+			if (0 == sscanf(optarg, "%d", 
+					&opts->steal_idle_rounds) ||
+					opts->steal_idle_rounds < 0) {
+				log_err("Invalid value for -%c\n", optopt);
+				print_usage(argv[0]);
+			}
+			break;
+
+		case 'y':
+			if (0 == sscanf(optarg, "%d", &opts->task_backoff_us) ||
+					opts->task_backoff_us < 0) {
+				log_err("Invalid value for -%c\n", optopt);
+				print_usage(argv[0]);
+			}
+			break;
+
+		case 'b':
+			run_sched_bench = 1;
+			opts->foreground = 1;
+			break;
+
+		case 'r':
+			snapshot_file = optarg;
+			break;
+
+		case 'l':
+			if (0 == sscanf(optarg, "%d", &opts->idle_sleep_us) ||
+					opts->idle_sleep_us < 0) {
+				log_err("Invalid value for -%c\n", optopt);
+				print_usage(argv[0]);
+			}
+			break;
+
 		case ':':
 			log_err("Argument is required for -%c\n", optopt);
 			print_usage(argv[0]);
@@ -342,6 +400,8 @@ static void set_resource_limit()
 int main(int argc, char **argv)
 {
 	int signal_fd = -1;
+	double start_time;
+	double phase_time;
 
 	parse_args(argc, argv);
 
@@ -357,12 +417,40 @@ int main(int argc, char **argv)
 
 	start_logger();
 
+	start_time = get_epoch_time();
 	init_dpdk(argv[0], opts->mb_per_socket, opts->multi_instance);
+	log_info("DPDK initialization: %.1f ms\n", 
+			(get_epoch_time() - start_time) * 1000);
+
+	if (run_sched_bench) {
+		sched_bench();
+		exit(EXIT_SUCCESS);
+	}
+
 	init_mempool();
+
+	phase_time = get_epoch_time();
 	init_drivers();
+	log_info("Driver initialization: %.1f ms\n", 
+			(get_epoch_time() - phase_time) * 1000);
 
 	setup_master(opts->port);
 
+	if (snapshot_file) {
+		struct snobj *r = restore_snapshot(snapshot_file);
+
+		if (snobj_eval_exists(r, "err")) {
+			log_err("Restoring %s failed: %s\n", snapshot_file,
+					snobj_eval_str(r, "errmsg"));
+			exit(EXIT_FAILURE);
+		}
+
+		snobj_free(r);
+	}
+
+	log_info("BESS daemon started in %.1f ms\n", 
+			(get_epoch_time() - start_time) * 1000);
+
 	/* signal the parent that all initialization has been finished */
 	if (!opts->foreground) {
 		int ret = write(signal_fd, &(uint64_t){1}, sizeof(uint64_t));
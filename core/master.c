@@ -6,11 +6,14 @@
 #include <errno.h>
 #include <sched.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include <netinet/tcp.h>
 
 #include <sys/socket.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 
 #include <rte_config.h>
 #include <rte_lcore.h>
@@ -30,17 +33,119 @@
 #define INIT_BUF_SIZE	4096
 #define MAX_BUF_SIZE	(8 * 1048576)
 
+/* Read-only requests (listing and stats, see is_read_only_request()) are
+ * handled by a pool of reader threads, concurrently with each other, so 
+ * that a slow one (e.g., a large table dump) does not hold up the others.
+ * All other requests and the master jobs are handled by the master thread
+ * one at a time, holding state_lock for writing. So readers never see the
+ * state in the middle of a change. 
+ *
+ * Only the master thread does I/O on client sockets: readers pass the
+ * responses back through the reader_done queue, signaled with done_fd. */
+#define NUM_READERS	4
+
 static struct {
 	int listen_fd;
 	int epoll_fd;
+	int timer_fd;		/* armed only while there are jobs */
+	int done_fd;		/* eventfd, for reader_done */
+
+	pthread_rwlock_t state_lock;
+
+	/* for the two queues below */
+	pthread_mutex_t reader_lock;
+	pthread_cond_t reader_cond;
+
+	struct cdlist_head reader_todo;
+	struct cdlist_head reader_done;
 
 	struct client *lock_holder;	/* NULL if unlocked */
 
 	struct cdlist_head clients_all;
 	struct cdlist_head clients_lock_waiting;
 	struct cdlist_head clients_pause_holding;
+
+	struct cdlist_head jobs;
 } master;
 
+static uint64_t get_monotonic_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void arm_timer(int on)
+{
+	struct itimerspec its = {};
+	int ret;
+
+	if (on) {
+		its.it_value.tv_nsec = MASTER_TICK_MS * 1000000;
+		its.it_interval.tv_nsec = MASTER_TICK_MS * 1000000;
+	}
+
+	ret = timerfd_settime(master.timer_fd, 0, &its, NULL);
+	if (ret < 0)
+		log_perr("timerfd_settime()");
+}
+
+void add_master_job(struct master_job *job)
+{
+	assert(!is_master_job_added(job));
+
+	if (job->period_ns < MASTER_TICK_MS * 1000000ull)
+		job->period_ns = MASTER_TICK_MS * 1000000ull;
+
+	job->next_ns = get_monotonic_ns() + job->period_ns;
+
+	if (cdlist_is_empty(&master.jobs))
+		arm_timer(1);
+
+	cdlist_add_tail(&master.jobs, &job->master_jobs);
+}
+
+void remove_master_job(struct master_job *job)
+{
+	if (!is_master_job_added(job))
+		return;
+
+	cdlist_del(&job->master_jobs);
+	cdlist_item_init(&job->master_jobs);
+
+	if (cdlist_is_empty(&master.jobs))
+		arm_timer(0);
+}
+
+static void run_master_jobs()
+{
+	struct master_job *job;
+	struct master_job *next;
+	uint64_t expirations;
+	uint64_t now;
+	int ret;
+
+	ret = read(master.timer_fd, &expirations, sizeof(expirations));
+	if (ret < 0 && errno != EAGAIN)
+		log_perr("read(timer_fd)");
+
+	now = get_monotonic_ns();
+
+	pthread_rwlock_wrlock(&master.state_lock);
+
+	/* a job may remove itself */
+	cdlist_for_each_entry_safe(job, next, &master.jobs, master_jobs) {
+		if (now < job->next_ns)
+			continue;
+
+		job->next_ns = now + job->period_ns;
+		job->func(job->arg);
+	}
+
+	pthread_rwlock_unlock(&master.state_lock);
+}
+
 static void reset_core_affinity()
 {
 	cpu_set_t set;
@@ -53,9 +158,14 @@ static void reset_core_affinity()
 		CPU_SET(i, &set);
 
 	/* ...and then unset the ones where workers run */
-	for (i = 0; i < MAX_WORKERS; i++)
-		if (is_worker_active(i))
-			CPU_CLR(workers[i]->core, &set);
+	for (i = 0; i < MAX_WORKERS; i++) {
+		if (!is_worker_active(i))
+			continue;
+
+		for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+			if (CPU_ISSET(cpu, &workers[i]->cpuset))
+				CPU_CLR(cpu, &set);
+	}
 
 	rte_thread_set_affinity(&set);
 }
@@ -140,12 +250,21 @@ static struct client *init_client(int fd, struct sockaddr_in c_addr)
 	cdlist_add_tail(&master.clients_all, &c->master_all);
 	cdlist_item_init(&c->master_lock_waiting);
 	cdlist_item_init(&c->master_pause_holding);
+	cdlist_item_init(&c->master_reader);
 
 	return c;
 }
 
 static void close_client(struct client *c)
 {
+	/* a reader still has it. See reader_responses() */
+	if (c->in_reader) {
+		if (!c->closing)
+			epoll_ctl(master.epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+		c->closing = 1;
+		return;
+	}
+
 	log_info("Master: client %s:%hu disconnected\n", 
 			inet_ntoa(c->addr.sin_addr), c->addr.sin_port);
 
@@ -169,6 +288,9 @@ static void close_client(struct client *c)
 		cdlist_del(&c->master_pause_holding);
 	}
 
+	if (c->sub)
+		unsubscribe_stats(c);
+
 	cdlist_del(&c->master_lock_waiting);
 	cdlist_del(&c->master_all);
 
@@ -215,64 +337,216 @@ static struct client *accept_client(int listen_fd)
 	return c;
 }
 
-static void request_done(struct client *c)
+/* copies buf (msg_len bytes from snobj_encode(), freed here) into c->buf 
+ * and starts sending it. Returns -1 on error */
+static int start_send_encoded(struct client *c, char *buf, uint32_t msg_len)
 {
 	struct epoll_event ev;
 
-	struct snobj *q = NULL;
-	struct snobj *r = NULL;
-
-	char *buf;
-
 	int ret;
 
 	c->buf_off = 0;
 	c->msg_len_off = 0;
 
-	q = snobj_decode(c->buf, c->msg_len);
-	if (!q) {
-		log_err("Incorrect message\n");
-		goto err;
+	if (msg_len == 0) {
+		log_err("Encoding error\n");
+		return -1;
 	}
 
-	r = handle_request(c, q);
-
 	ev.events = EPOLLOUT;
 	ev.data.ptr = c;
 
 	ret = epoll_ctl(master.epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
 	if (ret < 0) {
 		log_perr("epoll_ctl(EPOLL_CTL_MOD, listen_fd, OUT)");
-		goto err;
+		_FREE(buf);
+		return -1;
 	}
 
-	c->msg_len = snobj_encode(r, &buf, 0);
-	if (c->msg_len == 0) {
-		log_err("Encoding error\n");
-		goto err;
-	}
+	c->msg_len = msg_len;
 
-	/* XXX: DRY */
 	if (c->msg_len > c->buf_size) {
 		char *new_buf;
 
 		if (c->msg_len > MAX_BUF_SIZE)  {
 			log_err("too large response was attempted\n");
-			goto err;
+			_FREE(buf);
+			return -1;
 		}
 
 		new_buf = rte_realloc(c->buf, c->msg_len, 0);
-		if (!new_buf)
-			goto err;
+		if (!new_buf) {
+			_FREE(buf);
+			return -1;
+		}
 
 		c->buf = new_buf;
 		c->buf_size = c->msg_len;
 	}
 
 	memcpy(c->buf, buf, c->msg_len);
+	_FREE(buf);
 
-	if (buf)
-		_FREE(buf);
+	return 0;
+}
+
+/* encodes m into c->buf and starts sending it. Returns -1 on error */
+static int start_send(struct client *c, const struct snobj *m)
+{
+	char *buf;
+	uint32_t msg_len;
+
+	msg_len = snobj_encode(m, &buf, 0);
+
+	return start_send_encoded(c, buf, msg_len);
+}
+
+/* The reader decodes the request in c->buf again, and encodes the 
+ * response by itself, since snobj nodes go back to the free list of the
+ * thread that frees them (see node_free()). Returns -1 on error */
+static int send_to_reader(struct client *c)
+{
+	struct epoll_event ev;
+
+	int ret;
+
+	/* no more requests until the response is sent */
+	ev.events = 0;
+	ev.data.ptr = c;
+
+	ret = epoll_ctl(master.epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+	if (ret < 0) {
+		log_perr("epoll_ctl(EPOLL_CTL_MOD, conn_fd, 0)");
+		return -1;
+	}
+
+	c->in_reader = 1;
+
+	pthread_mutex_lock(&master.reader_lock);
+	cdlist_add_tail(&master.reader_todo, &c->master_reader);
+	pthread_cond_signal(&master.reader_cond);
+	pthread_mutex_unlock(&master.reader_lock);
+
+	return 0;
+}
+
+static void *run_reader(void *arg)
+{
+	set_non_worker();
+
+	for (;;) {
+		struct client *c;
+		struct snobj *q;
+		struct snobj *r;
+		char *buf;
+		uint32_t msg_len;
+
+		pthread_mutex_lock(&master.reader_lock);
+
+		while (cdlist_is_empty(&master.reader_todo))
+			pthread_cond_wait(&master.reader_cond, 
+					&master.reader_lock);
+
+		c = container_of(master.reader_todo.next, struct client, 
+				master_reader);
+		cdlist_del(&c->master_reader);
+
+		pthread_mutex_unlock(&master.reader_lock);
+
+		/* nobody else touches c->buf meanwhile */
+		q = snobj_decode(c->buf, c->msg_len);
+
+		pthread_rwlock_rdlock(&master.state_lock);
+		r = handle_request(c, q);
+		pthread_rwlock_unlock(&master.state_lock);
+
+		msg_len = snobj_encode(r, &buf, 0);
+
+		snobj_free(q);
+		snobj_free(r);
+
+		pthread_mutex_lock(&master.reader_lock);
+		c->reader_buf = buf;
+		c->reader_msg_len = msg_len;
+		cdlist_add_tail(&master.reader_done, &c->master_reader);
+		pthread_mutex_unlock(&master.reader_lock);
+
+		if (write(master.done_fd, &(uint64_t){1}, sizeof(uint64_t)) < 0)
+			log_perr("write(done_fd)");
+	}
+
+	return NULL;
+}
+
+/* sends out the responses from readers */
+static void reader_responses()
+{
+	uint64_t cnt;
+	int ret;
+
+	ret = read(master.done_fd, &cnt, sizeof(cnt));
+	if (ret < 0 && errno != EAGAIN)
+		log_perr("read(done_fd)");
+
+	for (;;) {
+		struct client *c;
+		char *buf;
+
+		pthread_mutex_lock(&master.reader_lock);
+
+		if (cdlist_is_empty(&master.reader_done)) {
+			pthread_mutex_unlock(&master.reader_lock);
+			break;
+		}
+
+		c = container_of(master.reader_done.next, struct client,
+				master_reader);
+		cdlist_del(&c->master_reader);
+		cdlist_item_init(&c->master_reader);
+
+		pthread_mutex_unlock(&master.reader_lock);
+
+		buf = c->reader_buf;
+		c->reader_buf = NULL;
+		c->in_reader = 0;
+
+		if (c->closing) {
+			_FREE(buf);
+			close_client(c);
+		} else if (start_send_encoded(c, buf, c->reader_msg_len) < 0)
+			close_client(c);
+	}
+}
+
+static void request_done(struct client *c)
+{
+	struct snobj *q = NULL;
+	struct snobj *r = NULL;
+
+	c->buf_off = 0;
+	c->msg_len_off = 0;
+
+	q = snobj_decode(c->buf, c->msg_len);
+	if (!q) {
+		log_err("Incorrect message\n");
+		goto err;
+	}
+
+	if (is_read_only_request(q)) {
+		snobj_free(q);
+		q = NULL;
+
+		if (send_to_reader(c) < 0)
+			goto err;
+		return;
+	}
+
+	pthread_rwlock_wrlock(&master.state_lock);
+	r = handle_request(c, q);
+	pthread_rwlock_unlock(&master.state_lock);
+
+	if (start_send(c, r) < 0)
+		goto err;
 
 	snobj_free(q);
 	snobj_free(r);
@@ -285,6 +559,20 @@ err:
 	return;
 }
 
+int send_to_client(struct client *c, const struct snobj *m)
+{
+	/* idle: no partial request, and no response being sent */
+	if (c->msg_len || c->msg_len_off || c->buf_off)
+		return -EBUSY;
+
+	if (start_send(c, m) < 0) {
+		close_client(c);
+		return -EIO;
+	}
+
+	return 0;
+}
+
 static void response_done(struct client *c)
 {
 	struct epoll_event ev;
@@ -418,6 +706,61 @@ void init_server(uint16_t port)
 		log_perr("epoll_ctl(EPOLL_CTL_ADD, listen_fd)");
 		exit(EXIT_FAILURE);
 	}
+
+	master.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if (master.timer_fd < 0) {
+		log_perr("timerfd_create()");
+		exit(EXIT_FAILURE);
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.fd = master.timer_fd;
+
+	ret = epoll_ctl(master.epoll_fd, EPOLL_CTL_ADD, master.timer_fd, &ev);
+	if (ret < 0) {
+		log_perr("epoll_ctl(EPOLL_CTL_ADD, timer_fd)");
+		exit(EXIT_FAILURE);
+	}
+
+	master.done_fd = eventfd(0, EFD_NONBLOCK);
+	if (master.done_fd < 0) {
+		log_perr("eventfd()");
+		exit(EXIT_FAILURE);
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.fd = master.done_fd;
+
+	ret = epoll_ctl(master.epoll_fd, EPOLL_CTL_ADD, master.done_fd, &ev);
+	if (ret < 0) {
+		log_perr("epoll_ctl(EPOLL_CTL_ADD, done_fd)");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* after reset_core_affinity(), which they inherit */
+static void init_readers()
+{
+	pthread_rwlock_init(&master.state_lock, NULL);
+	pthread_mutex_init(&master.reader_lock, NULL);
+	pthread_cond_init(&master.reader_cond, NULL);
+
+	cdlist_head_init(&master.reader_todo);
+	cdlist_head_init(&master.reader_done);
+
+	for (int i = 0; i < NUM_READERS; i++) {
+		pthread_t thread;
+		int ret;
+
+		ret = pthread_create(&thread, NULL, run_reader, NULL);
+		if (ret) {
+			log_err("pthread_create(reader) failed: %s\n", 
+					strerror(ret));
+			exit(EXIT_FAILURE);
+		}
+
+		pthread_detach(thread);
+	}
 }
 
 void setup_master(uint16_t port) 
@@ -429,8 +772,10 @@ void setup_master(uint16_t port)
 	cdlist_head_init(&master.clients_all);
 	cdlist_head_init(&master.clients_lock_waiting);
 	cdlist_head_init(&master.clients_pause_holding);
+	cdlist_head_init(&master.jobs);
 
 	init_server(port);
+	init_readers();
 }
 
 void run_master() 
@@ -456,6 +801,10 @@ again:
 		log_info("Master: a new client from %s:%hu\n", 
 				inet_ntoa(c->addr.sin_addr), 
 				c->addr.sin_port);
+	} else if (ev.data.fd == master.timer_fd) {
+		run_master_jobs();
+	} else if (ev.data.fd == master.done_fd) {
+		reader_responses();
 	} else {
 		c = ev.data.ptr;
 
@@ -7,6 +7,9 @@
 
 #include "utils/cdlist.h"
 
+struct snobj;
+struct stats_sub;
+
 /* the protocol is simple for both requests and responses:
  * 4-byte length, followed by a message (encoded 'message_t') */
 
@@ -26,6 +29,17 @@ struct client {
 
 	int holding_lock;	/* 0 or the depth of nested locking */
 
+	struct stats_sub *sub;	/* stats subscription (see snctl.c), if any */
+
+	/* A read-only request is being handled by a reader thread (see 
+	 * master.c). Nothing is received from the client meanwhile, and 
+	 * closing it is deferred until the response comes back. */
+	int in_reader;
+	int closing;
+	char *reader_buf;		/* the encoded response */
+	uint32_t reader_msg_len;
+	struct cdlist_item master_reader;	/* in a queue to/from readers */
+
 	struct cdlist_item master_all;
 	struct cdlist_item master_lock_waiting;
 	struct cdlist_item master_pause_holding;
@@ -46,6 +60,43 @@ static inline int is_holding_pause(struct client *c)
 	return cdlist_is_hooked(&c->master_pause_holding);
 }
 
+/* Periodic jobs on the master thread (e.g., port controllers).
+ * They are serialized with control requests, so they need no locking
+ * against snctl handlers. The period is rounded up to MASTER_TICK_MS. */
+#define MASTER_TICK_MS		100
+
+struct master_job {
+	void (*func)(void *arg);
+	void *arg;
+	uint64_t period_ns;
+
+	/* internal */
+	uint64_t next_ns;
+	struct cdlist_item master_jobs;
+};
+
+static inline void init_master_job(struct master_job *job, 
+		void (*func)(void *arg), void *arg, uint64_t period_ns)
+{
+	job->func = func;
+	job->arg = arg;
+	job->period_ns = period_ns;
+	cdlist_item_init(&job->master_jobs);
+}
+
+static inline int is_master_job_added(const struct master_job *job)
+{
+	return cdlist_is_hooked(&job->master_jobs);
+}
+
+/* can be called only from the master thread (e.g., in snctl handlers) */
+void add_master_job(struct master_job *job);
+void remove_master_job(struct master_job *job);
+
+/* Pushes m (not freed) to c, between responses, as a regular message.
+ * Returns -EBUSY if c is in the middle of a request or response. */
+int send_to_client(struct client *c, const struct snobj *m);
+
 void setup_master(uint16_t port);
 
 /* The main run loop of the channel thread. Never returns. */
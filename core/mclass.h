@@ -23,6 +23,7 @@ ct_assert(MAX_GATES < INVALID_GATE);
 ct_assert(DROP_GATE <= MAX_GATES);
 
 #define MAX_COMMANDS		32
+#define MAX_VARIANTS		8
 
 struct module;
 struct pkt_batch;
@@ -56,6 +57,17 @@ struct mclass
 	 *   The memory region will be zero initialized. */
 	uint32_t priv_size;
 
+	/* Optional: alignment of the private data (a power of 2), e.g., 4096
+	 *   for large tables. A cache line (64B) if 0. */
+	uint32_t priv_align;
+
+	/* Optional: the size of per-worker private data. 0 by default.
+	 *   Each worker gets its own zero-initialized copy (see
+	 *   get_priv_worker()), so that the datapath can update it without
+	 *   atomics or false sharing. Commands aggregate the copies with
+	 *   for_each_priv_worker(). */
+	uint32_t priv_worker_size;
+
 	/* Optional: perform any necessary initialization.
 	 * Should return NULL if successful, or snobj_err_*() 
 	 * If this mclass implements run_task, this init function
@@ -67,6 +79,13 @@ struct mclass
 	/* Optional: cleanup internal state */
 	void (*deinit)(struct module *m);
 
+	/* Optional: free the per-worker state of worker wid (e.g., packets
+	 * held in priv_worker) and cancel the timers it armed. Called for
+	 * each worker before deinit(), and when the worker is removed
+	 * (remove_worker()). Runs on the worker or, if it is not running,
+	 * on the master thread (see run_on_worker()) */
+	void (*deinit_worker)(struct module *m, int wid);
+
 #if 0
 	/* FIXME */
 	/* Optional: Invoked on every worker */
@@ -80,6 +99,11 @@ struct mclass
 	/* Optional: return any object type. Module-specific semantics. */
 	struct snobj *(*get_dump)(const struct module *m);
 
+	/* Optional: return a list of {"cmd", "arg"} module commands that
+	 * bring a new instance (created with the same init argument) to the
+	 * current state, e.g., table entries. Used for pipeline snapshots. */
+	struct snobj *(*get_snapshot)(const struct module *m);
+
 	/* The (abstract) call stack would be:
 	 *   sched -> task -> module1.run_task -> 
 	 *   		module2.process_batch -> module3.process_batch -> ... */
@@ -90,6 +114,16 @@ struct mclass
 	/* The entry point of the packet packet processing pipeline */
 	task_func_t run_task;
 
+	/* Optional: versions of process_batch/run_task specialized for a
+	 * particular configuration (e.g., with a branch or loop compiled
+	 * out). The module switches between them with select_variant(), from
+	 * init() or commands. NULL functions fall back to the ones above */
+	const struct mclass_variant {
+		const char *name;
+		proc_func_t process_batch;
+		task_func_t run_task;
+	} variants[MAX_VARIANTS];
+
 	const struct {
 		const char *cmd;
 		cmd_func_t func;
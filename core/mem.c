@@ -0,0 +1,30 @@
+#include <rte_common.h>
+#include <rte_malloc.h>
+
+#include "mem.h"
+
+void *alloc_with_priv(const char *type, size_t hdr_size, size_t priv_size,
+		size_t priv_align, int socket, void **base, size_t *size)
+{
+	size_t offset;
+	char *p;
+
+	if (priv_align == 0)
+		priv_align = RTE_CACHE_LINE_SIZE;
+
+	if (priv_align & (priv_align - 1))
+		return NULL;
+
+	/* so that the object ends at the boundary */
+	offset = RTE_ALIGN_CEIL(hdr_size, priv_align) - hdr_size;
+
+	p = rte_zmalloc_socket(type, offset + hdr_size + priv_size, priv_align,
+			socket);
+	if (!p)
+		return NULL;
+
+	*base = p;
+	*size = offset + hdr_size + priv_size;
+
+	return p + offset;
+}
@@ -0,0 +1,17 @@
+#ifndef _MEM_H_
+#define _MEM_H_
+
+#include <stddef.h>
+
+/* For objects followed by a private area (modules and ports), from the
+ * hugepage-backed DPDK heap of the socket (SOCKET_ID_ANY for any).
+ * The object is hdr_size bytes, and the private area right after it starts
+ * at a priv_align boundary (a power of 2, or 0 for a cache line). There may
+ * be some unused room before the object for that. All is zeroed.
+ *
+ * Returns the object, or NULL if fails. *base is what to rte_free(), and 
+ * *size the number of bytes taken from the heap. */
+void *alloc_with_priv(const char *type, size_t hdr_size, size_t priv_size,
+		size_t priv_align, int socket, void **base, size_t *size);
+
+#endif
@@ -0,0 +1,290 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "module.h"
+#include "metadata.h"
+#include "worker.h"
+#include "log.h"
+
+int add_metadata_attr(struct module *m, const char *name, int size,
+		enum mt_access_mode mode)
+{
+	struct mt_attr *attr;
+
+	if (m->num_attrs >= MAX_ATTRS_PER_MODULE)
+		return -ENOSPC;
+
+	if (!name || strlen(name) >= MT_ATTR_NAME_LEN)
+		return -EINVAL;
+
+	if (size < 1 || size > MT_TOTAL_SIZE)
+		return -EINVAL;
+
+	if (mode < MT_READ || mode > MT_UPDATE)
+		return -EINVAL;
+
+	for (int i = 0; i < m->num_attrs; i++)
+		if (strcmp(m->attrs[i].name, name) == 0)
+			return -EEXIST;
+
+	attr = &m->attrs[m->num_attrs];
+	strcpy(attr->name, name);
+	attr->size = size;
+	attr->mode = mode;
+
+	m->attr_offsets[m->num_attrs] = MT_OFFSET_INVALID;
+
+	return m->num_attrs++;
+}
+
+/* an attribute, as seen by all modules in a connected component */
+struct mt_placement {
+	const char *name;
+	int size;
+	mt_offset_t offset;
+	int num_writers;	/* MT_WRITE or MT_UPDATE */
+	int num_readers;
+	int num_producers;	/* MT_WRITE only */
+};
+
+static struct mt_placement *find_placement(struct mt_placement *arr,
+		int cnt, const char *name)
+{
+	for (int i = 0; i < cnt; i++)
+		if (strcmp(arr[i].name, name) == 0)
+			return &arr[i];
+
+	return NULL;
+}
+
+/* first come, first served.
+ * Attributes are aligned to their size (up to 8 bytes). */
+static void assign_component(struct module **members, int num_members)
+{
+	struct mt_placement *arr;
+	int num_placements = 0;
+	int used = 0;
+
+	arr = malloc(sizeof(*arr) * num_members * MAX_ATTRS_PER_MODULE);
+	if (!arr)
+		oom_crash();
+
+	for (int i = 0; i < num_members; i++) {
+		struct module *m = members[i];
+
+		for (int j = 0; j < m->num_attrs; j++) {
+			const struct mt_attr *attr = &m->attrs[j];
+			struct mt_placement *p;
+
+			p = find_placement(arr, num_placements, attr->name);
+			if (!p) {
+				int align = 1;
+
+				while (align < attr->size && align < 8)
+					align *= 2;
+
+				p = &arr[num_placements++];
+				p->name = attr->name;
+				p->size = attr->size;
+				p->num_writers = 0;
+				p->num_readers = 0;
+				p->num_producers = 0;
+
+				used = (used + align - 1) & ~(align - 1);
+
+				if (used + attr->size <= MT_TOTAL_SIZE) {
+					p->offset = used;
+					used += attr->size;
+				} else {
+					log_warn("No metadata space left for "
+						"attribute '%s' (%d bytes)\n",
+						attr->name, attr->size);
+					p->offset = MT_OFFSET_INVALID;
+				}
+			}
+
+			if (p->size != attr->size) {
+				log_warn("Module '%s' expects %d bytes for "
+					"attribute '%s', but %d is used\n",
+					m->name, attr->size, attr->name,
+					p->size);
+				m->attr_offsets_new[j] = MT_OFFSET_INVALID;
+				continue;
+			}
+
+			m->attr_offsets_new[j] = p->offset;
+
+			if (attr->mode == MT_READ)
+				p->num_readers++;
+			else
+				p->num_writers++;
+
+			if (attr->mode == MT_WRITE)
+				p->num_producers++;
+		}
+	}
+
+	/* Nobody initializes the attribute, so its value would be garbage.
+	 * Invalidate it, so that modules can tell (e.g., fall back to
+	 * parsing headers by themselves if there is no Parse module) */
+	for (int i = 0; i < num_members; i++) {
+		struct module *m = members[i];
+
+		for (int j = 0; j < m->num_attrs; j++) {
+			struct mt_placement *p;
+
+			p = find_placement(arr, num_placements, 
+					m->attrs[j].name);
+			if (p && !p->num_producers)
+				m->attr_offsets_new[j] = MT_OFFSET_INVALID;
+		}
+	}
+
+	for (int i = 0; i < num_placements; i++)
+		if (arr[i].num_readers && !arr[i].num_writers)
+			log_warn("Metadata attribute '%s' is read, but no "
+					"module writes it\n", arr[i].name);
+
+	free(arr);
+}
+
+/* push all unvisited neighbors of m onto the stack */
+static int push_neighbors(struct module *m, struct module **stack, int top,
+		int component)
+{
+	for (int i = 0; i < m->ogates.curr_size; i++) {
+		struct module *next;
+
+		if (!is_active_gate(&m->ogates, i))
+			continue;
+
+		next = m->ogates.arr[i]->out.igate->m;
+		if (next->mt_component < 0) {
+			next->mt_component = component;
+			stack[top++] = next;
+		}
+	}
+
+	for (int i = 0; i < m->igates.curr_size; i++) {
+		struct gate *ogate;
+
+		if (!is_active_gate(&m->igates, i))
+			continue;
+
+		struct gate *igate = m->igates.arr[i];
+
+		cdlist_for_each_entry(ogate, &igate->in.ogates_upstream,
+				out.igate_upstream) {
+			struct module *prev = ogate->m;
+
+			if (prev->mt_component < 0) {
+				prev->mt_component = component;
+				stack[top++] = prev;
+			}
+		}
+	}
+
+	return top;
+}
+
+static int offsets_changed(struct module **all, size_t num_modules)
+{
+	for (size_t i = 0; i < num_modules; i++) {
+		const struct module *m = all[i];
+
+		if (memcmp(m->attr_offsets, m->attr_offsets_new,
+				m->num_attrs * sizeof(mt_offset_t)))
+			return 1;
+	}
+
+	return 0;
+}
+
+/* Packets in flight between two modules must see the same offset on both
+ * sides, so running workers are paused while the offsets are updated (and
+ * all at once). Most graph changes do not move any attribute, and leave 
+ * the workers alone. Packets held by modules across the change (e.g., in
+ * queues) may still carry attributes at the old offsets. */
+static void publish_offsets(struct module **all, size_t num_modules)
+{
+	int running[MAX_WORKERS];
+
+	if (!offsets_changed(all, num_modules))
+		return;
+
+	for (int wid = 0; wid < MAX_WORKERS; wid++)
+		running[wid] = is_worker_running(wid);
+
+	pause_all_workers();
+
+	for (size_t i = 0; i < num_modules; i++) {
+		struct module *m = all[i];
+
+		memcpy(m->attr_offsets, m->attr_offsets_new,
+				m->num_attrs * sizeof(mt_offset_t));
+	}
+
+	for (int wid = 0; wid < MAX_WORKERS; wid++)
+		if (running[wid])
+			resume_worker(wid);
+}
+
+void compute_metadata_offsets(void)
+{
+	struct module **all;
+	struct module **stack;
+	struct module **members;
+	size_t num_modules = 0;
+	int component = 0;
+
+	/* count first */
+	for (;;) {
+		const struct module *dummy[16];
+		size_t cnt = list_modules(dummy, 16, num_modules);
+
+		if (cnt == 0)
+			break;
+		num_modules += cnt;
+	}
+
+	if (num_modules == 0)
+		return;
+
+	all = malloc(sizeof(struct module *) * num_modules * 3);
+	if (!all)
+		oom_crash();
+
+	stack = all + num_modules;
+	members = all + num_modules * 2;
+
+	num_modules = list_modules((const struct module **)all, num_modules, 0);
+
+	for (size_t i = 0; i < num_modules; i++)
+		all[i]->mt_component = -1;
+
+	for (size_t i = 0; i < num_modules; i++) {
+		int num_members = 0;
+		int top = 0;
+
+		if (all[i]->mt_component >= 0)
+			continue;
+
+		all[i]->mt_component = component;
+		stack[top++] = all[i];
+
+		while (top > 0) {
+			struct module *m = stack[--top];
+
+			members[num_members++] = m;
+			top = push_neighbors(m, stack, top, component);
+		}
+
+		assign_component(members, num_members);
+		component++;
+	}
+
+	publish_offsets(all, num_modules);
+
+	free(all);
+}
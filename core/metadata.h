@@ -0,0 +1,75 @@
+#ifndef _METADATA_H_
+#define _METADATA_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "snbuf.h"
+
+/* Per-packet metadata attributes.
+ *
+ * Modules declare named attributes (with a size and an access mode) in
+ * their init(), with add_metadata_attr(). Whenever the pipeline graph
+ * changes, offsets in snb->_metadata_buf are assigned per connected
+ * component of the graph, so that attributes of the same name share
+ * the same offset and different attributes never overlap.
+ *
+ * The datapath reads the offset from m->attr_offsets[], so accessing an
+ * attribute is a load from the metadata cache line of the packet:
+ *
+ *	uint64_t *ts = get_attr_ptr(m, priv->attr_id, pkt, uint64_t);
+ *
+ * If no module in the component declares the attribute as MT_WRITE, the
+ * offset is MT_OFFSET_INVALID for all of the modules, since the value
+ * would never be initialized.
+ */
+
+#define MAX_ATTRS_PER_MODULE	16
+#define MT_ATTR_NAME_LEN	32
+
+/* bytes available for dynamic fields */
+#define MT_TOTAL_SIZE		(SNBUF_METADATA - \
+		(offsetof(struct snbuf, _metadata_buf) - \
+		 offsetof(struct snbuf, _metadata)))
+
+typedef int16_t mt_offset_t;
+
+/* not assigned yet (e.g., unconnected module), or no space left */
+#define MT_OFFSET_INVALID	((mt_offset_t)-1)
+
+enum mt_access_mode {
+	MT_READ,
+	MT_WRITE,
+	MT_UPDATE,		/* read and write */
+};
+
+struct mt_attr {
+	char name[MT_ATTR_NAME_LEN];
+	int size;		/* in bytes, [1, MT_TOTAL_SIZE] */
+	enum mt_access_mode mode;
+};
+
+struct module;
+
+/* Returns the attribute ID (to be used with get_attr_ptr()), or -errno */
+int add_metadata_attr(struct module *m, const char *name, int size,
+		enum mt_access_mode mode);
+
+/* (re)assign offsets of all attributes of all modules.
+ * Called whenever modules are connected or disconnected. The offsets are
+ * computed aside, and applied with the workers briefly paused, if any of 
+ * them changes. Only for the master thread */
+void compute_metadata_offsets(void);
+
+static inline int is_valid_attr_offset(mt_offset_t offset)
+{
+	return offset >= 0;
+}
+
+#define get_attr_offset(m, attr_id)	((m)->attr_offsets[attr_id])
+
+/* the attribute must have a valid offset */
+#define get_attr_ptr(m, attr_id, snb, type) \
+	((type *)((snb)->_metadata_buf + get_attr_offset(m, attr_id)))
+
+#endif
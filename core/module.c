@@ -1,13 +1,18 @@
 #include <assert.h>
+#include <sys/mman.h>
 
 #include <rte_cycles.h>
 #include <rte_malloc.h>
 
 #include "module.h"
 #include "dpdk.h"
+#include "mem.h"
 #include "time.h"
 #include "tc.h"
 #include "namespace.h"
+#include "trace.h"
+
+#include "utils/histogram.h"
 
 task_id_t register_task(struct module *m, void *arg)
 {
@@ -15,7 +20,7 @@ task_id_t register_task(struct module *m, void *arg)
 	struct task *t;
 
 	/* Module class must define run_task() to register a task */
-	if (!m->mclass->run_task)
+	if (!m->run_task)
 		return INVALID_TASK_ID;
 
 	for (id = 0; id < MAX_TASKS_PER_MODULE; id++)
@@ -139,7 +144,7 @@ static int register_module(struct module *m)
 
 void deadend(struct module *m, struct pkt_batch *batch)
 {
-	ctx.silent_drops += batch->cnt;
+	count_drops(m, DROP_DEADEND, batch->cnt);
 	snb_free_bulk(batch->pkts, batch->cnt);
 }
 
@@ -153,14 +158,49 @@ static void destroy_all_tasks(struct module *m)
 	}
 }
 
+/* each copy is placed on the socket of the worker, if it is running */
+static int alloc_priv_worker(struct module *m)
+{
+	uint32_t size = m->mclass->priv_worker_size;
+
+	if (size == 0)
+		return 0;
+
+	for (int wid = 0; wid < MAX_WORKERS; wid++) {
+		int socket = m->socket;
+
+		if (is_worker_active(wid))
+			socket = workers[wid]->socket;
+
+		/* cache-line aligned, so no false sharing across workers */
+		m->priv_worker[wid] = rte_zmalloc_socket("priv_worker", size, 
+				0, socket);
+		if (!m->priv_worker[wid])
+			return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static void free_priv_worker(struct module *m)
+{
+	for (int wid = 0; wid < MAX_WORKERS; wid++) {
+		rte_free(m->priv_worker[wid]);
+		m->priv_worker[wid] = NULL;
+	}
+}
+
 /* returns a pointer to the created module.
  * if error, returns NULL and *perr is set */
 struct module *create_module(const char *name, 
 		const struct mclass *mclass, 
 		struct snobj *arg,
+		int socket,
 		struct snobj **perr)
 {
 	struct module *m = NULL;
+	void *mem_base;
+	size_t mem_size;
 	int ret = 0;
 
 	*perr = NULL;
@@ -170,13 +210,20 @@ struct module *create_module(const char *name,
 		goto fail;
 	}
 
-	m = rte_zmalloc("module", sizeof(struct module) + mclass->priv_size, 0);
+	m = alloc_with_priv("module", sizeof(struct module), 
+			mclass->priv_size, mclass->priv_align, socket, 
+			&mem_base, &mem_size);
 	if (!m) {
 		*perr = snobj_errno(ENOMEM);
 		goto fail;
 	}
 
 	m->mclass = mclass;
+	m->socket = socket;
+	m->mem_base = mem_base;
+	m->mem_size = mem_size;
+	m->process_batch = mclass->process_batch;
+	m->run_task = mclass->run_task;
 	m->name = rte_zmalloc("name", MODULE_NAME_LEN, 0);
 
 	if (!m->name) {
@@ -189,6 +236,12 @@ struct module *create_module(const char *name,
 	else
 		snprintf(m->name, MODULE_NAME_LEN, "%s", name);
 
+	ret = alloc_priv_worker(m);
+	if (ret != 0) {
+		*perr = snobj_errno(-ret);
+		goto fail;
+	}
+
 #if 0
 	if (ops->timer) {
 		for (i = 0; i < num_workers; i++) {
@@ -214,24 +267,67 @@ struct module *create_module(const char *name,
 		goto fail;
 	}
 
+	if (arg) {
+		snobj_acquire(arg);
+		m->arg = arg;
+	}
+
 	return m;
 
 fail:
 	if (m) {
 		destroy_all_tasks(m);
+		free_priv_worker(m);
 		rte_free(m->name);
+		rte_free(m->mem_base);
 	}
 
-	rte_free(m);
-
 	return NULL;
 }
 
-void destroy_module(struct module *m)
+struct deinit_worker_arg {
+	struct module *m;
+	int wid;
+};
+
+static int do_deinit_worker(void *p)
 {
-	if (m->mclass->deinit)
-		m->mclass->deinit(m);
+	struct deinit_worker_arg *arg = p;
+
+	arg->m->mclass->deinit_worker(arg->m, arg->wid);
 
+	return 0;
+}
+
+/* workers may be running */
+static void deinit_module_worker(struct module *m, int wid)
+{
+	struct deinit_worker_arg arg = {.m = m, .wid = wid};
+
+	if (!m->mclass->deinit_worker || !m->priv_worker[wid])
+		return;
+
+	run_on_worker(wid, do_deinit_worker, &arg);
+}
+
+void deinit_modules_worker(int wid)
+{
+	struct ns_iter iter;
+	struct module *m;
+
+	ns_init_iterator(&iter, NS_TYPE_MODULE);
+
+	while ((m = (struct module *)ns_next(&iter)) != NULL)
+		deinit_module_worker(m, wid);
+
+	ns_release_iterator(&iter);
+}
+
+/* Workers may be running, as long as the tasks of m have been detached
+ * (by their owner workers). disconnect_modules() waits for a grace period, 
+ * so no worker is in m by the time deinit() is called. */
+void destroy_module(struct module *m)
+{
 	/* disconnect from upstream modules. */
 	for (int i = 0; i < m->igates.curr_size; i++) {
 		if (!is_active_gate(&m->igates, i))
@@ -252,19 +348,39 @@ void destroy_module(struct module *m)
 	for (gate_idx_t i = 0; i < m->ogates.curr_size; i++)
 		disconnect_modules(m, i);
 
+	/* a module without any connection still may have been running */
+	synchronize_workers();
+
+	for (int wid = 0; wid < MAX_WORKERS; wid++)
+		deinit_module_worker(m, wid);
+
+	if (m->mclass->deinit)
+		m->mclass->deinit(m);
+
 	destroy_all_tasks(m);
 
 	ns_remove(m->name);
 
+	if (m->arg)
+		snobj_free(m->arg);
+
+	free_priv_worker(m);
 	rte_free(m->name);
 	rte_free(m->ogates.arr);
 	rte_free(m->igates.arr);
-	rte_free(m);
+	rte_free(m->mem_base);
 }
 
 
+static int is_inline_ogate(struct module *m, struct gate *ogate)
+{
+	return ogate >= m->inline_ogates && 
+		ogate < m->inline_ogates + INLINE_OGATES;
+}
+
 static int grow_gates(struct module *m, struct gates *gates, gate_idx_t gate)
 {
+	struct gate **old_arr;
 	struct gate **new_arr;
 	gate_idx_t old_size;
 	gate_idx_t new_size;
@@ -277,23 +393,57 @@ static int grow_gates(struct module *m, struct gates *gates, gate_idx_t gate)
 	if (new_size > MAX_GATES)
 		new_size = MAX_GATES;
 
-	new_arr = rte_realloc(gates->arr, 
-			sizeof(struct gate *) * new_size, 0);
+	/* not rte_realloc(), since running workers may be reading it. 
+	 * The newly created gates are zeroed (inactive) */
+	new_arr = rte_zmalloc("gates", sizeof(struct gate *) * new_size, 0);
 	if (!new_arr)
 		return -ENOMEM;
 
-	gates->arr = new_arr;
-
+	old_arr = gates->arr;
 	old_size = gates->curr_size;
+
+	if (old_size)
+		memcpy(new_arr, old_arr, sizeof(struct gate *) * old_size);
+
+	/* the array must be visible before the workers see the new size */
+	gates->arr = new_arr;
+	STORE_BARRIER();
 	gates->curr_size = new_size;
 
-	/* initialize the newly created gates */
-	memset(&gates->arr[old_size], 0, 
-			sizeof(struct gate *) * (new_size - old_size));
+	if (old_arr) {
+		synchronize_workers();
+		rte_free(old_arr);
+	}
 
 	return 0;
 }
 
+/* Workers flush their buffers at the end of every task run, and the
+ * master waits for them to pass that point. Packets still left in the
+ * buffers (e.g., of workers that are not running) are freed here. */
+static void free_compaction(struct gate *gate)
+{
+	struct gate_compact *gc = gate->compact;
+
+	if (!gc)
+		return;
+
+	gate->compact = NULL;
+	synchronize_workers();
+
+	for (int wid = 0; wid < MAX_WORKERS; wid++) {
+		struct pkt_batch *buf = &gc->bufs[wid].batch;
+
+		/* cannot happen, unless the worker went away meanwhile */
+		if (buf->cnt) {
+			snb_free_bulk(buf->pkts, buf->cnt);
+			batch_clear(buf);
+		}
+	}
+
+	rte_free(gc);
+}
+
 /* returns -errno if fails */
 int connect_modules(struct module *m_prev, gate_idx_t ogate_idx, 
 		    struct module *m_next, gate_idx_t igate_idx)
@@ -301,7 +451,7 @@ int connect_modules(struct module *m_prev, gate_idx_t ogate_idx,
 	struct gate *ogate;
 	struct gate *igate;
 
-	if (!m_next->mclass->process_batch)
+	if (!m_next->process_batch)
 		return -EINVAL;
 
 	if (ogate_idx >= m_prev->mclass->num_ogates || ogate_idx >= MAX_GATES)
@@ -326,17 +476,20 @@ int connect_modules(struct module *m_prev, gate_idx_t ogate_idx,
 			return ret;
 	}
 
-	ogate = rte_zmalloc("gate", sizeof(struct gate), 0);
-	if (!ogate)
-		return -ENOMEM;
-
-	m_prev->ogates.arr[ogate_idx] = ogate;
+	if (ogate_idx < INLINE_OGATES)
+		ogate = &m_prev->inline_ogates[ogate_idx];
+	else {
+		ogate = rte_zmalloc("gate", sizeof(struct gate), 0);
+		if (!ogate)
+			return -ENOMEM;
+	}
 
 	igate = m_next->igates.arr[igate_idx];
 	if (!igate) {
 		igate = rte_zmalloc("gate", sizeof(struct gate), 0);
 		if (!igate) {
-			rte_free(ogate);
+			if (!is_inline_ogate(m_prev, ogate))
+				rte_free(ogate);
 			return -ENOMEM;
 		}
 
@@ -344,23 +497,121 @@ int connect_modules(struct module *m_prev, gate_idx_t ogate_idx,
 
 		igate->m = m_next;
 		igate->gate_idx = igate_idx;
-		igate->f = m_next->mclass->process_batch;
+		igate->f = m_next->process_batch;
 		igate->arg = m_next;
 		cdlist_head_init(&igate->in.ogates_upstream);
 	}
 
 	ogate->m = m_prev;
 	ogate->gate_idx = ogate_idx;
-	ogate->f = m_next->mclass->process_batch;
 	ogate->arg = m_next;
 	ogate->out.igate = igate;
 	ogate->out.igate_idx = igate_idx;
 
 	cdlist_add_tail(&igate->in.ogates_upstream, &ogate->out.igate_upstream);
 
+	/* publish the ogate only after it is fully initialized, so that a
+	 * running worker sees either no gate or a complete one. 
+	 * f does it for inline gates, and ogates.arr for the others */
+	STORE_BARRIER();
+	ogate->f = m_next->process_batch;
+	m_prev->ogates.arr[ogate_idx] = ogate;
+
+	update_fused_link(m_prev);
+	compute_metadata_offsets();
+
 	return 0;
 }
 
+static void set_process_batch(struct module *m, proc_func_t f)
+{
+	if (m->process_batch == f)
+		return;
+
+	m->process_batch = f;
+
+	for (gate_idx_t i = 0; i < m->igates.curr_size; i++) {
+		struct gate *igate = m->igates.arr[i];
+		struct gate *ogate;
+
+		if (!igate)
+			continue;
+
+		igate->f = f;
+
+		cdlist_for_each_entry(ogate, &igate->in.ogates_upstream, 
+				out.igate_upstream) {
+			ogate->f = f;
+			update_fused_link(ogate->m);
+		}
+	}
+}
+
+int select_variant(struct module *m, const char *name)
+{
+	const struct mclass_variant *v = NULL;
+	proc_func_t process_batch = m->mclass->process_batch;
+	task_func_t run_task = m->mclass->run_task;
+
+	if (name) {
+		for (int i = 0; i < MAX_VARIANTS; i++) {
+			const struct mclass_variant *curr = &m->mclass->variants[i];
+
+			if (!curr->name)
+				break;
+
+			if (strcmp(curr->name, name) == 0) {
+				v = curr;
+				break;
+			}
+		}
+
+		if (!v)
+			return -ENOENT;
+
+		if (v->process_batch)
+			process_batch = v->process_batch;
+		if (v->run_task)
+			run_task = v->run_task;
+	}
+
+	m->variant = v ? v->name : NULL;
+
+	set_process_batch(m, process_batch);
+
+	m->run_task = run_task;
+	for (int i = 0; i < MAX_TASKS_PER_MODULE; i++)
+		if (m->tasks[i])
+			m->tasks[i]->f = run_task;
+
+	return 0;
+}
+
+void update_fused_link(struct module *m)
+{
+	struct gate *ogate;
+
+	if (m->mclass->num_ogates != 1 || !is_active_gate(&m->ogates, 0)) {
+		m->fused.f = NULL;
+		return;
+	}
+
+	ogate = m->ogates.arr[0];
+
+	/* hooks must see every batch, and compaction must take them */
+	if (ogate->hooks || ogate->compact) {
+		m->fused.f = NULL;
+		return;
+	}
+
+	m->fused.arg = ogate->arg;
+	m->fused.igate_idx = ogate->out.igate_idx;
+
+	/* workers check f only */
+	STORE_BARRIER();
+	m->fused.f = ogate->f;
+}
+
 int disconnect_modules(struct module *m_prev, gate_idx_t ogate_idx)
 {
 	struct gate *ogate;
@@ -379,21 +630,53 @@ int disconnect_modules(struct module *m_prev, gate_idx_t ogate_idx)
 
 	igate = ogate->out.igate;
 
+	/* unpublish first, so that no new batch is given to the ogate */
+	m_prev->ogates.arr[ogate_idx] = NULL;
+	if (is_inline_ogate(m_prev, ogate))
+		ogate->f = NULL;
+	update_fused_link(m_prev);
+
 	/* Does the igate become inactive as well? */
 	cdlist_del(&ogate->out.igate_upstream);
 	if (cdlist_is_empty(&igate->in.ogates_upstream)) {
 		struct module *m_next = igate->m;
 		gate_idx_t igate_idx = ogate->out.igate_idx;
 		m_next->igates.arr[igate_idx] = NULL;
-		rte_free(igate);	
-	}
+	} else
+		igate = NULL;	/* still in use */
 
-	rte_free(ogate);
-	m_prev->ogates.arr[ogate_idx] = NULL;
+	/* grace period: running workers may still hold the old pointers */
+	synchronize_workers();
+
+	free_compaction(ogate);
+	remove_all_gate_hooks(ogate);
+
+	rte_free(igate);
+	if (!is_inline_ogate(m_prev, ogate))
+		rte_free(ogate);
+
+	compute_metadata_offsets();
 
 	return 0;
 }
 
+struct snobj *get_prefetch_dist(struct snobj *arg, int *dist)
+{
+	int val;
+
+	if (!arg || snobj_type(arg) != TYPE_INT)
+		return snobj_err(EINVAL, "'prefetch' must be an integer");
+
+	val = snobj_int_get(arg);
+	if (val < 0 || val >= MAX_PKT_BURST)
+		return snobj_err(EINVAL, "'prefetch' must be between 0 and %d",
+				MAX_PKT_BURST - 1);
+
+	*dist = val;
+
+	return NULL;
+}
+
 #if 0
 void init_module_worker()
 {
@@ -408,6 +691,77 @@ void init_module_worker()
 }
 #endif
 
+void __perf_call_module(proc_func_t f, struct module *m, 
+		struct pkt_batch *batch)
+{
+	uint64_t saved = ctx.perf_child_cycles;
+	uint64_t pkts = batch->cnt;	/* batch may be modified by f */
+	uint64_t start;
+	uint64_t elapsed;
+
+	const int pmu = ctx.pmu.enabled;
+	struct pmu_sample sample;
+
+	ctx.perf_child_cycles = 0;
+
+	if (pmu)
+		pmu_sample_begin(&sample);
+
+	start = rdtsc();
+	__call_module(f, m, batch);
+	elapsed = rdtsc() - start;
+
+	if (pmu) {
+		uint64_t total[NUM_PMU_EVENTS] = {};
+
+		pmu_sample_end(&sample, m->perf[ctx.wid].pmu, total);
+	}
+
+	account_module_perf(m, pkts, elapsed - ctx.perf_child_cycles);
+
+	ctx.perf_child_cycles = saved + elapsed;
+}
+
+void __trace_call_module(proc_func_t f, struct module *m, 
+		struct pkt_batch *batch)
+{
+	/* the igate has been pushed already */
+	trace_record(TRACE_CALL, m, ctx.igate_stack[ctx.stack_depth - 1],
+			batch->cnt);
+
+	if (unlikely(ctx.perf_sampling))
+		__perf_call_module(f, m, batch);
+	else
+		__call_module(f, m, batch);
+
+	trace_record(TRACE_RETURN, m, 0, 0);
+}
+
+void __charged_call_module(proc_func_t f, struct module *m, 
+		struct pkt_batch *batch, struct tc *owner)
+{
+	uint64_t saved = ctx.charged_child_cycles;
+	uint64_t start;
+	uint64_t elapsed;
+	uint64_t self;
+
+	ctx.charged_child_cycles = 0;
+
+	start = rdtsc();
+	f(m, batch);
+	elapsed = rdtsc() - start;
+
+	self = elapsed - ctx.charged_child_cycles;
+	ctx.charged_child_cycles = saved + elapsed;
+
+	/* not in a task run (e.g., timers), so no TC is charged at all */
+	if (!ctx.current_task || ctx.current_task->c == owner)
+		return;
+
+	tc_charge_cycles(owner, self);
+	ctx.cycles_transferred += self;
+}
+
 #if SN_TRACE_MODULES
 #define MAX_TRACE_DEPTH		32
 #define MAX_TRACE_BUFSIZE	4096
@@ -498,79 +852,396 @@ struct module *find_module(const char *name)
 	return (struct module *)ns_lookup(NS_TYPE_MODULE, name);
 }
 
-#if TCPDUMP_GATES
-int enable_tcpdump(const char* fifo, struct module *m, gate_idx_t ogate)
+int add_gate_hook(struct gate *gate, struct gate_hook *hook)
 {
-	static const struct pcap_hdr PCAP_FILE_HDR = {
-		.magic_number = PCAP_MAGIC_NUMBER,
-		.version_major = PCAP_VERSION_MAJOR,
-		.version_minor = PCAP_VERSION_MINOR,
-		.thiszone = PCAP_THISZONE,
-		.sigfigs = PCAP_SIGFIGS,
-		.snaplen = PCAP_SNAPLEN,
-		.network = PCAP_NETWORK,
-	};
+	struct gate_hook * volatile *p;
 
-	int fd;
+	if (find_gate_hook(gate, hook->name))
+		return -EEXIST;
+
+	/* stop bypassing the gate first */
+	gate->m->fused.f = NULL;
+
+	hook->next = NULL;
+
+	/* the hook must be fully visible before it is linked */
+	STORE_BARRIER();
+
+	for (p = &gate->hooks; *p; p = &(*p)->next)
+		;
+
+	*p = hook;
+
+	return 0;
+}
+
+struct gate_hook *find_gate_hook(struct gate *gate, const char *name)
+{
+	struct gate_hook *hook;
+
+	for (hook = gate->hooks; hook; hook = hook->next)
+		if (strcmp(hook->name, name) == 0)
+			return hook;
+
+	return NULL;
+}
+
+int remove_gate_hook(struct gate *gate, const char *name)
+{
+	struct gate_hook * volatile *p;
+	struct gate_hook *hook;
+
+	for (p = &gate->hooks; *p; p = &(*p)->next)
+		if (strcmp((*p)->name, name) == 0)
+			break;
+
+	if (!(hook = *p))
+		return -ENOENT;
+
+	/* workers may still be running the hook (or walking past it) */
+	*p = hook->next;
+	synchronize_workers();
+
+	if (hook->fini)
+		hook->fini(gate, hook);
+
+	update_fused_link(gate->m);
+
+	return 0;
+}
+
+void remove_all_gate_hooks(struct gate *gate)
+{
+	struct gate_hook *hook = gate->hooks;
+
+	if (!hook)
+		return;
+
+	gate->hooks = NULL;
+	synchronize_workers();
+
+	while (hook) {
+		struct gate_hook *next = hook->next;
+
+		if (hook->fini)
+			hook->fini(gate, hook);
+
+		hook = next;
+	}
+}
+
+static void track_hook_run(struct gate *gate, struct gate_hook *hook,
+		struct pkt_batch *batch)
+{
+	struct track_hook *t = container_of(hook, struct track_hook, hook);
+
+	t->cnt += 1;
+	t->pkts += batch->cnt;
+}
+
+static void free_hook(struct gate *gate, struct gate_hook *hook)
+{
+	rte_free(hook);
+}
+
+int enable_track(struct module *m, gate_idx_t ogate)
+{
+	struct track_hook *t;
 	int ret;
 
-	/* Don't allow tcpdump to be attached to gates that are not active */
 	if (!is_active_gate(&m->ogates, ogate))
 		return -EINVAL;
 
-	fd = open(fifo, O_WRONLY | O_NONBLOCK);
-	if (fd < 0)
-		return -errno;
+	t = rte_zmalloc("track_hook", sizeof(*t), 0);
+	if (!t)
+		return -ENOMEM;
 
-	/* Looooong time ago Linux ignored O_NONBLOCK in open().
-	 * Try again just in case. */
-	ret = fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
-	if (ret < 0) {
-		close(fd);
-		return -errno;
+	t->hook.name = TRACK_HOOK_NAME;
+	t->hook.f = track_hook_run;
+	t->hook.fini = free_hook;
+
+	ret = add_gate_hook(m->ogates.arr[ogate], &t->hook);
+	if (ret < 0)
+		rte_free(t);
+
+	return ret;
+}
+
+int disable_track(struct module *m, gate_idx_t ogate)
+{
+	if (!is_active_gate(&m->ogates, ogate))
+		return -EINVAL;
+
+	return remove_gate_hook(m->ogates.arr[ogate], TRACK_HOOK_NAME);
+}
+
+static void latency_hook_run(struct gate *gate, struct gate_hook *hook,
+		struct pkt_batch *batch)
+{
+	struct latency_hook *l = container_of(hook, struct latency_hook, hook);
+	struct latency_worker *w = &l->workers[ctx.wid];
+
+	/* once per batch: the packets enter the next module together */
+	uint64_t now = rdtsc();
+
+	for (int i = 0; i < batch->cnt; i++) {
+		struct snbuf *snb = batch->pkts[i];
+
+		if (snb->mbuf.ol_flags & SNB_LATENCY_TAGGED) {
+			/* TSCs of different cores may be slightly off */
+			uint64_t tsc = snb->latency_tsc;
+
+			histo_record(w->hist, now > tsc ? now - tsc : 0);
+		} else {
+			snb->mbuf.ol_flags |= SNB_LATENCY_TAGGED;
+			w->untagged++;
+		}
+
+		snb->latency_tsc = now;
 	}
+}
 
-	ret = write(fd, &PCAP_FILE_HDR, sizeof(PCAP_FILE_HDR));
-	if (ret < 0) {
-		close(fd);
-		return -errno;
+static void latency_hook_fini(struct gate *gate, struct gate_hook *hook)
+{
+	struct latency_hook *l = container_of(hook, struct latency_hook, hook);
+
+	for (int wid = 0; wid < MAX_WORKERS; wid++)
+		rte_free(l->workers[wid].hist);
+
+	rte_free(l);
+}
+
+int enable_latency(struct module *m, gate_idx_t ogate, int precision)
+{
+	struct latency_hook *l;
+	int ret;
+
+	if (!is_active_gate(&m->ogates, ogate))
+		return -EINVAL;
+
+	if (precision < HISTO_MIN_SUB_BITS || precision > HISTO_MAX_SUB_BITS)
+		return -EINVAL;
+
+	if (find_gate_hook(m->ogates.arr[ogate], LATENCY_HOOK_NAME))
+		return -EEXIST;
+
+	l = rte_zmalloc("latency_hook", sizeof(*l), 0);
+	if (!l)
+		return -ENOMEM;
+
+	l->hook.name = LATENCY_HOOK_NAME;
+	l->hook.f = latency_hook_run;
+	l->hook.fini = latency_hook_fini;
+	l->precision = precision;
+
+	/* for all workers, since the task may move to any of them */
+	for (int wid = 0; wid < MAX_WORKERS; wid++) {
+		struct histogram *hist;
+
+		hist = rte_malloc("latency_hist",
+				histo_size(precision, HISTO_DEFAULT_MAX_BITS),
+				64);
+		if (!hist) {
+			latency_hook_fini(NULL, &l->hook);
+			return -ENOMEM;
+		}
+
+		histo_init(hist, precision, HISTO_DEFAULT_MAX_BITS);
+		l->workers[wid].hist = hist;
 	}
 
-	m->ogates.arr[ogate]->fifo_fd = fd;
-	m->ogates.arr[ogate]->tcpdump = 1;
+	ret = add_gate_hook(m->ogates.arr[ogate], &l->hook);
+	if (ret < 0)
+		latency_hook_fini(NULL, &l->hook);
 
-	return 0;
+	return ret;
 }
 
-int disable_tcpdump(struct module *m, gate_idx_t ogate)
+int disable_latency(struct module *m, gate_idx_t ogate)
 {
 	if (!is_active_gate(&m->ogates, ogate))
 		return -EINVAL;
 
-	if (!m->ogates.arr[ogate]->tcpdump)
+	return remove_gate_hook(m->ogates.arr[ogate], LATENCY_HOOK_NAME);
+}
+
+int enable_compaction(struct module *m, gate_idx_t ogate, int min_size)
+{
+	struct gate *gate;
+	struct gate_compact *gc;
+
+	if (!is_active_gate(&m->ogates, ogate))
+		return -EINVAL;
+
+	if (min_size < 2 || min_size > MAX_PKT_BURST)
+		return -EINVAL;
+
+	gate = m->ogates.arr[ogate];
+
+	if (gate->compact) {
+		gate->compact->min_size = min_size;
+		return 0;
+	}
+
+	gc = rte_zmalloc_socket("gate_compact", sizeof(*gc), 0, m->socket);
+	if (!gc)
+		return -ENOMEM;
+
+	gc->min_size = min_size;
+	for (int wid = 0; wid < MAX_WORKERS; wid++)
+		gc->bufs[wid].gate = gate;
+
+	/* stop bypassing the gate first */
+	m->fused.f = NULL;
+
+	STORE_BARRIER();
+	gate->compact = gc;
+
+	return 0;
+}
+
+int disable_compaction(struct module *m, gate_idx_t ogate)
+{
+	struct gate *gate;
+
+	if (!is_active_gate(&m->ogates, ogate))
 		return -EINVAL;
 
-	m->ogates.arr[ogate]->tcpdump = 0;
-	close(m->ogates.arr[ogate]->fifo_fd);
+	gate = m->ogates.arr[ogate];
+	if (!gate->compact)
+		return -ENOENT;
+
+	free_compaction(gate);
+	update_fused_link(m);
 
 	return 0;
 }
 
-void dump_pcap_pkts(struct gate *gate, struct pkt_batch *batch)
+/* f may have been cleared, if the gate got disconnected meanwhile */
+static void pass_compacted(struct gate *ogate, struct pkt_batch *batch)
+{
+	proc_func_t f = ogate->f;
+
+	if (unlikely(!f)) {
+		deadend(ogate->m, batch);
+		return;
+	}
+
+	__run_gate(ogate, f, batch);
+}
+
+void compact_batch(struct gate *ogate, struct gate_compact *gc,
+		struct pkt_batch *batch)
 {
-	struct timeval tv;
+	struct compact_buf *b;
+	struct pkt_batch *buf;
+
+	snb_array_t p = batch->pkts;
+	int left = batch->cnt;
+
+	/* not a worker (e.g., the master), with no buffer nor flushing */
+	if (unlikely((unsigned)ctx.wid >= MAX_WORKERS)) {
+		pass_compacted(ogate, batch);
+		return;
+	}
+
+	b = &gc->bufs[ctx.wid];
+	buf = &b->batch;
+
+	/* big enough as it is, and no older packet to go first */
+	if (buf->cnt == 0 && left >= gc->min_size) {
+		pass_compacted(ogate, batch);
+		return;
+	}
+
+	while (left) {
+		int n = RTE_MIN(left, MAX_PKT_BURST - buf->cnt);
+
+		rte_memcpy((void *)&buf->pkts[buf->cnt], (void *)p,
+				n * sizeof(struct snbuf *));
+		buf->cnt += n;
+		p += n;
+		left -= n;
+
+		/* the callee may come back to this gate (deeper) */
+		if (batch_full(buf)) {
+			struct pkt_batch full;
+
+			batch_copy(&full, buf);
+			batch_clear(buf);
+			pass_compacted(ogate, &full);
+		}
+	}
+
+	if (buf->cnt && !b->pending) {
+		b->pending = 1;
+		b->next_pending = ctx.compact_pending;
+		ctx.compact_pending = b;
+	}
+}
+
+/* passing on a batch may buffer packets downstream, which are then
+ * flushed in the same loop */
+void __flush_compaction(void)
+{
+	struct compact_buf *b;
+
+	while ((b = ctx.compact_pending) != NULL) {
+		struct pkt_batch batch;
+
+		ctx.compact_pending = b->next_pending;
+		b->pending = 0;
+
+		if (!b->batch.cnt)
+			continue;
+
+		batch_copy(&batch, &b->batch);
+		batch_clear(&b->batch);
+		pass_compacted(b->gate, &batch);
+	}
+}
+
+struct tcpdump_hook {
+	struct gate_hook hook;
+	volatile int fifo_fd;	/* -1 after the reader went away */
+	uint32_t sample;	/* 1 out of every sample packets */
+
+	/* per worker, to avoid sharing a cache line */
+	struct {
+		uint32_t countdown;
+	} __rte_cache_aligned sampler[MAX_WORKERS];
+};
+
+static void dump_pcap_pkts(struct gate *gate, struct gate_hook *hook, 
+		struct pkt_batch *batch)
+{
+	struct tcpdump_hook *t = container_of(hook, struct tcpdump_hook, hook);
+	uint32_t *countdown = &t->sampler[ctx.wid].countdown;
+	struct timeval tv = {0, 0};
 
 	int ret = 0;
-	int fd = gate->fifo_fd;
+	int fd = t->fifo_fd;
 	int packets = 0;
 
-	gettimeofday(&tv, NULL);
+	if (fd < 0)
+		return;
 
 	for (int i = 0; i < batch->cnt; i++) {
 		struct snbuf* pkt = batch->pkts[i];
 		int len = pkt->mbuf.data_len;
-		struct pcap_rec_hdr *pkthdr = 
-			(struct pcap_rec_hdr*) snb_prepend(pkt, 
+		struct pcap_rec_hdr *pkthdr;
+
+		if (*countdown > 1) {
+			(*countdown)--;
+			continue;
+		}
+		*countdown = t->sample;
+
+		/* only for batches with a sampled packet */
+		if (!tv.tv_sec)
+			gettimeofday(&tv, NULL);
+
+		pkthdr = (struct pcap_rec_hdr*) snb_prepend(pkt, 
 				sizeof(struct pcap_rec_hdr));
 
 		pkthdr->ts_sec = tv.tv_sec;
@@ -583,8 +1254,7 @@ void dump_pcap_pkts(struct gate *gate, struct pkt_batch *batch)
 		if (ret < 0) {
 			if (errno == EPIPE) {
 				log_debug("Stopping dump\n");
-				gate->tcpdump = 0;
-				gate->fifo_fd = 0;
+				t->fifo_fd = -1;
 				close(fd);
 			}
 			return;
@@ -596,7 +1266,300 @@ void dump_pcap_pkts(struct gate *gate, struct pkt_batch *batch)
 		snb_adj(pkt, sizeof(struct pcap_rec_hdr));
 	}
 }
-#endif
+
+static void tcpdump_hook_fini(struct gate *gate, struct gate_hook *hook)
+{
+	struct tcpdump_hook *t = container_of(hook, struct tcpdump_hook, hook);
+
+	if (t->fifo_fd >= 0)
+		close(t->fifo_fd);
+
+	rte_free(t);
+}
+
+int enable_tcpdump(const char* fifo, struct module *m, gate_idx_t ogate,
+		uint32_t sample)
+{
+	static const struct pcap_hdr PCAP_FILE_HDR = {
+		.magic_number = PCAP_MAGIC_NUMBER,
+		.version_major = PCAP_VERSION_MAJOR,
+		.version_minor = PCAP_VERSION_MINOR,
+		.thiszone = PCAP_THISZONE,
+		.sigfigs = PCAP_SIGFIGS,
+		.snaplen = PCAP_SNAPLEN,
+		.network = PCAP_NETWORK,
+	};
+
+	struct tcpdump_hook *t;
+
+	int fd;
+	int ret;
+
+	/* Don't allow tcpdump to be attached to gates that are not active */
+	if (!is_active_gate(&m->ogates, ogate))
+		return -EINVAL;
+
+	if (find_gate_hook(m->ogates.arr[ogate], TCPDUMP_HOOK_NAME))
+		return -EEXIST;
+
+	if (sample == 0)
+		return -EINVAL;
+
+	fd = open(fifo, O_WRONLY | O_NONBLOCK);
+	if (fd < 0)
+		return -errno;
+
+	/* Looooong time ago Linux ignored O_NONBLOCK in open().
+	 * Try again just in case. */
+	ret = fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	if (ret < 0) {
+		close(fd);
+		return -errno;
+	}
+
+	ret = write(fd, &PCAP_FILE_HDR, sizeof(PCAP_FILE_HDR));
+	if (ret < 0) {
+		close(fd);
+		return -errno;
+	}
+
+	t = rte_zmalloc("tcpdump_hook", sizeof(*t), 0);
+	if (!t) {
+		close(fd);
+		return -ENOMEM;
+	}
+
+	t->hook.name = TCPDUMP_HOOK_NAME;
+	t->hook.f = dump_pcap_pkts;
+	t->hook.fini = tcpdump_hook_fini;
+	t->fifo_fd = fd;
+	t->sample = sample;
+
+	ret = add_gate_hook(m->ogates.arr[ogate], &t->hook);
+	if (ret < 0) {
+		close(fd);
+		rte_free(t);
+	}
+
+	return ret;
+}
+
+ct_assert(offsetof(struct dump_ring, overflows) == 64);
+ct_assert(offsetof(struct dump_ring, head) == 128);
+ct_assert(offsetof(struct dump_ring, slots) == 192);
+ct_assert(offsetof(struct dump_slot, data) == 24);
+
+struct tcpdump_ring_hook {
+	struct gate_hook hook;
+
+	struct dump_ring *ring;
+	size_t ring_len;
+	int fd;
+
+	/* per worker, to avoid sharing a cache line */
+	struct {
+		uint32_t countdown;
+	} __rte_cache_aligned sampler[MAX_WORKERS];
+};
+
+static inline struct dump_slot *dump_ring_slot(struct dump_ring *r, 
+		uint64_t pos)
+{
+	return (struct dump_slot *)(r->slots + 
+			(size_t)(pos & (r->num_slots - 1)) * r->slot_size);
+}
+
+/* multi-producer safe. NULL if the reader is behind */
+static inline struct dump_slot *
+dump_ring_reserve(struct dump_ring *r, uint64_t *p_pos)
+{
+	uint64_t pos = r->head;
+
+	for (;;) {
+		struct dump_slot *slot = dump_ring_slot(r, pos);
+		int64_t diff = (int64_t)(slot->seq - pos);
+
+		if (diff == 0) {
+			if (__sync_bool_compare_and_swap(&r->head, 
+						pos, pos + 1)) {
+				*p_pos = pos;
+				return slot;
+			}
+		} else if (diff < 0)
+			return NULL;
+
+		pos = r->head;
+	}
+}
+
+static void dump_ring_pkts(struct gate *gate, struct gate_hook *hook,
+		struct pkt_batch *batch)
+{
+	struct tcpdump_ring_hook *t = 
+		container_of(hook, struct tcpdump_ring_hook, hook);
+	struct dump_ring *r = t->ring;
+	uint32_t *countdown = &t->sampler[ctx.wid].countdown;
+	uint64_t overflows = 0;
+	struct timeval tv = {0, 0};
+
+	for (int i = 0; i < batch->cnt; i++) {
+		struct snbuf *pkt = batch->pkts[i];
+		struct rte_mbuf *seg;
+		struct dump_slot *slot;
+		uint64_t pos;
+		uint32_t len;
+		uint32_t caplen;
+		char *dst;
+
+		if (*countdown > 1) {
+			(*countdown)--;
+			continue;
+		}
+		*countdown = r->sample;
+
+		/* only for batches with a sampled packet */
+		if (!tv.tv_sec)
+			gettimeofday(&tv, NULL);
+
+		slot = dump_ring_reserve(r, &pos);
+		if (!slot) {
+			overflows++;
+			continue;
+		}
+
+		len = snb_total_len(pkt);
+		caplen = RTE_MIN(len, r->snaplen);
+
+		slot->rec.ts_sec = tv.tv_sec;
+		slot->rec.ts_usec = tv.tv_usec;
+		slot->rec.incl_len = caplen;
+		slot->rec.orig_len = len;
+
+		dst = slot->data;
+		for (seg = &pkt->mbuf; seg && caplen > 0; seg = seg->next) {
+			uint32_t copy = RTE_MIN(caplen, 
+					(uint32_t)seg->data_len);
+
+			rte_memcpy(dst, rte_pktmbuf_mtod(seg, void *), copy);
+			dst += copy;
+			caplen -= copy;
+		}
+
+		/* publish the record after its content */
+		rte_wmb();
+		slot->seq = pos + 1;
+	}
+
+	if (overflows)
+		__sync_fetch_and_add(&r->overflows, overflows);
+}
+
+static void tcpdump_ring_hook_fini(struct gate *gate, struct gate_hook *hook)
+{
+	struct tcpdump_ring_hook *t = 
+		container_of(hook, struct tcpdump_ring_hook, hook);
+
+	munmap(t->ring, t->ring_len);
+	close(t->fd);
+	rte_free(t);
+}
+
+int enable_tcpdump_ring(const char *path, struct module *m, 
+		gate_idx_t ogate, uint32_t snaplen, uint32_t num_slots, 
+		uint32_t sample)
+{
+	struct tcpdump_ring_hook *t;
+	struct dump_ring *r;
+	uint32_t slot_size;
+	size_t len;
+	int fd;
+	int ret;
+
+	if (!is_active_gate(&m->ogates, ogate))
+		return -EINVAL;
+
+	if (find_gate_hook(m->ogates.arr[ogate], TCPDUMP_HOOK_NAME))
+		return -EEXIST;
+
+	if (snaplen == 0 || snaplen > PCAP_SNAPLEN || sample == 0 ||
+			num_slots < 2 || (num_slots & (num_slots - 1)))
+		return -EINVAL;
+
+	slot_size = (sizeof(struct dump_slot) + snaplen + 63) & ~63;
+	len = sizeof(struct dump_ring) + (size_t)slot_size * num_slots;
+
+	/* the reader (e.g., bessctl) removes the file when it is done */
+	fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0)
+		return -errno;
+
+	if (ftruncate(fd, len) < 0) {
+		ret = -errno;
+		goto fail_file;
+	}
+
+	r = mmap(NULL, len, PROT_READ | PROT_WRITE, 
+			MAP_SHARED | MAP_POPULATE, fd, 0);
+	if (r == MAP_FAILED) {
+		ret = -errno;
+		goto fail_file;
+	}
+
+	r->num_slots = num_slots;
+	r->slot_size = slot_size;
+	r->snaplen = snaplen;
+	r->sample = sample;
+	r->overflows = 0;
+	r->head = 0;
+
+	for (uint32_t i = 0; i < num_slots; i++)
+		dump_ring_slot(r, i)->seq = i;
+
+	r->version = DUMP_RING_VERSION;
+
+	/* the reader waits for this */
+	rte_wmb();
+	r->magic = DUMP_RING_MAGIC;
+
+	t = rte_zmalloc("tcpdump_ring_hook", sizeof(*t), 0);
+	if (!t) {
+		ret = -ENOMEM;
+		goto fail_map;
+	}
+
+	t->hook.name = TCPDUMP_HOOK_NAME;
+	t->hook.f = dump_ring_pkts;
+	t->hook.fini = tcpdump_ring_hook_fini;
+	t->ring = r;
+	t->ring_len = len;
+	t->fd = fd;
+
+	ret = add_gate_hook(m->ogates.arr[ogate], &t->hook);
+	if (ret < 0) {
+		rte_free(t);
+		goto fail_map;
+	}
+
+	return ret;
+
+fail_map:
+	munmap(r, len);
+fail_file:
+	close(fd);
+	unlink(path);
+	return ret;
+}
+
+int disable_tcpdump(struct module *m, gate_idx_t ogate)
+{
+	if (!is_active_gate(&m->ogates, ogate))
+		return -EINVAL;
+
+	if (remove_gate_hook(m->ogates.arr[ogate], TCPDUMP_HOOK_NAME) < 0)
+		return -EINVAL;
+
+	return 0;
+}
 
 #if 0
 static __thread struct module *timer_fired_mods[MAX_MODULES];
@@ -11,6 +11,10 @@
 #include <rte_timer.h>
 #include <rte_cycles.h>
 
+#if __AVX2__
+#include <x86intrin.h>
+#endif
+
 #include "utils/cdlist.h"
 #include "utils/pcap.h"
 
@@ -20,6 +24,7 @@
 #include "snbuf.h"
 #include "worker.h"
 #include "snobj.h"
+#include "metadata.h"
 
 #define MAX_TASKS_PER_MODULE	32
 
@@ -27,23 +32,93 @@ ct_assert(MAX_TASKS_PER_MODULE < INVALID_TASK_ID);
 
 #define MODULE_NAME_LEN		128
 
-#define TRACK_GATES		1
-#define TCPDUMP_GATES		1
+struct gate;
 
-struct gate {
-	/* immutable values */
-	struct module *m;	/* the module this gate belongs to */
-	gate_idx_t gate_idx;	/* input/output gate index of itself */
+/* Gate hooks are run on every batch going through an output gate, 
+ * before the next module is called. Embed this struct in your own hook 
+ * struct (see struct track_hook) to keep per-hook state.
+ *
+ * Hooks can be added and removed at runtime, without pausing workers.
+ * Only the master thread modifies the chain, and removal waits for all 
+ * workers to stop using the hook before fini is called. */
+struct gate_hook {
+	const char *name;	/* only one hook per name, per gate */
+
+	void (*f)(struct gate *gate, struct gate_hook *hook, 
+			struct pkt_batch *batch);
+
+	/* called once the hook is not referenced any more. may be NULL */
+	void (*fini)(struct gate *gate, struct gate_hook *hook);
+
+	struct gate_hook * volatile next;
+};
 
-	/* mutable values below */
-	proc_func_t f;		/* m_next->mclass->process_batch or deadend */
+/* counts batches and packets (installed by "track_gate") */
+struct track_hook {
+	struct gate_hook hook;
+	uint64_t cnt;
+	uint64_t pkts;
+};
+
+/* Per-hop latency (installed by "latency_gate"). Every packet going
+ * through the gate is tagged with the TSC, in its metadata (not payload).
+ * If it was already tagged by another probe upstream, the time since then
+ * is recorded first: e.g., with probes on the gates into a Queue and out of
+ * its QueueInc, the time spent in the queue, including the hop between
+ * workers. Untagged packets (at the first probe on their path) are only
+ * counted. */
+struct histogram;
+
+struct latency_hook {
+	struct gate_hook hook;
+	int precision;		/* sub-bucket bits of the histograms */
+
+	/* updated only by the worker */
+	struct latency_worker {
+		uint64_t untagged;
+		struct histogram *hist;		/* in cycles */
+	} __cacheline_aligned workers[MAX_WORKERS];
+};
+
+#define TRACK_HOOK_NAME		"track"
+#define TCPDUMP_HOOK_NAME	"tcpdump"
+#define LATENCY_HOOK_NAME	"latency"
+
+/* Batch compaction on an output gate (enable_compaction()), e.g., after a
+ * filter that leaves only a few packets in each batch. Batches smaller 
+ * than min_size are merged in a per-worker buffer, which is passed on when
+ * full, or at the end of the task run at the latest (flush_compaction()).
+ * So the packets are not held beyond the round they arrived in, and the
+ * order is preserved. */
+struct compact_buf {
+	struct pkt_batch batch;
+	struct gate *gate;
+	int pending;				/* in ctx.compact_pending? */
+	struct compact_buf *next_pending;
+} __cacheline_aligned;
+
+struct gate_compact {
+	int min_size;
+	struct compact_buf bufs[MAX_WORKERS];
+};
+
+/* The fields used by run_choose_module() come first */
+struct gate {
+	/* mutable values */
+	proc_func_t f;		/* m_next->mclass->process_batch */
 	void *arg;
 
+	/* NULL (the common case) if no hooks are installed */
+	struct gate_hook * volatile hooks;
+
+	/* NULL (the common case) if batches are passed as they are */
+	struct gate_compact * volatile compact;
+
 	union {
 		struct {
-			struct cdlist_item igate_upstream; 
-			struct gate *igate;
 			gate_idx_t igate_idx;
+			struct gate *igate;
+			struct cdlist_item igate_upstream; 
 		} out;
 
 		struct {
@@ -51,15 +126,9 @@ struct gate {
 		} in;
 	};
 
-	/* TODO: generalize with gate hooks */
-#if TRACK_GATES
-	uint64_t cnt;
-	uint64_t pkts;
-#endif
-#if TCPDUMP_GATES
-	uint32_t tcpdump;
-	int fifo_fd;
-#endif
+	/* immutable values */
+	struct module *m;	/* the module this gate belongs to */
+	gate_idx_t gate_idx;	/* input/output gate index of itself */
 };
 
 struct gates {
@@ -72,11 +141,30 @@ struct gates {
 	gate_idx_t curr_size;
 };
 
+/* Output gates below this index are embedded in struct module 
+ * (inline_ogates), so that run_choose_module() finds the next module 
+ * without going through ogates.arr. Most modules have fewer. */
+#define INLINE_OGATES		4
+
 static inline int is_active_gate(struct gates *gates, gate_idx_t idx)
 {
 	return idx < gates->curr_size && gates->arr[idx] != NULL;
 }
 
+/* Sampled cycle accounting (see task_scheduled_sampled()).
+ * Cycles exclude those spent in downstream modules.
+ * drops are not sampled, but counted by count_drops().
+ * Each worker only writes its own entry. */
+struct module_perf {
+	uint64_t samples;	/* sampled invocations */
+	uint64_t pkts;
+	uint64_t cycles;
+
+	uint64_t drops[NUM_DROP_CAUSES];
+
+	uint64_t pmu[NUM_PMU_EVENTS];	/* sampled, if enable_pmu() */
+} __cacheline_aligned;
+
 /* This struct is shared across workers */
 struct module {
 	/* less frequently accessed fields should be here */
@@ -84,10 +172,65 @@ struct module {
 	const struct mclass *mclass;
 	struct task *tasks[MAX_TASKS_PER_MODULE];
 
+	/* given to create_module(), for snapshots. NULL if none */
+	struct snobj *arg;
+
+	/* NULL for the default process_batch/run_task of mclass, 
+	 * otherwise the name of the selected mclass->variants[] */
+	const char *variant;
+
+	/* NUMA node where the module (with its private data) is allocated.
+	 * SOCKET_ID_ANY if not specified */
+	int socket;
+
+	/* the block with the module and its private data (alloc_with_priv()) */
+	void *mem_base;
+	size_t mem_size;
+
+	/* metadata attributes declared by the module */
+	int num_attrs;
+	struct mt_attr attrs[MAX_ATTRS_PER_MODULE];
+	/* scratch for compute_metadata_offsets() */
+	int mt_component;
+	mt_offset_t attr_offsets_new[MAX_ATTRS_PER_MODULE];
+
+	struct module_perf perf[MAX_WORKERS];
+
+	/* those of mclass or the variant in use. 
+	 * Gates and tasks have their own copies */
+	proc_func_t process_batch;
+	task_func_t run_task;
+
 	/* frequently access fields should be below */
 	struct gates igates;
 	struct gates ogates;
 
+	/* ogates.arr points to these, if connected. 
+	 * f is NULL (and set last) when not connected */
+	struct gate inline_ogates[INLINE_OGATES];
+
+	/* Direct link to the next module, for single-output modules whose
+	 * ogate has no hooks (a copy of the ogate fields). Chains of such 
+	 * modules are "fused": run_next_module() calls the next module 
+	 * without going through the gate. f is NULL if not fusable. */
+	struct {
+		proc_func_t volatile f;
+		struct module *arg;
+		gate_idx_t igate_idx;
+	} fused;
+
+	/* If not NULL, the cycles spent in this module, and in downstream
+	 * modules without their own owner, are charged to this TC rather
+	 * than the one running the task (which may be of another tenant).
+	 * Must not be an auto_free TC. See __charged_call_module() */
+	struct tc *owner_tc;
+
+	/* offsets of attrs[] in snb->_metadata_buf */
+	mt_offset_t attr_offsets[MAX_ATTRS_PER_MODULE];
+
+	/* per-worker private data, if mclass->priv_worker_size > 0 */
+	void *priv_worker[MAX_WORKERS];
+
 	/* Some private data for this module instance begins at this marker. 
 	 * (this is poor person's class inheritance in C language)
 	 * The 'struct module' object will be allocated with enough tail room
@@ -96,7 +239,8 @@ struct module {
 	 * to save a few cycles by avoiding indirect memory access.
 	 *
 	 * Note: this is shared across all workers. Ensuring thread safety 
-	 * and/or managing per-worker data is each module's responsibility. */
+	 * is each module's responsibility. For per-worker data, 
+	 * use mclass->priv_worker_size instead. */
 	void *priv[0]; 	
 };
 
@@ -110,6 +254,24 @@ static inline const void *get_priv_const(const struct module *m)
 	return (const void *)(m + 1);
 }
 
+/* Only for worker threads (ctx.wid must be valid) */
+static inline void *get_priv_worker(struct module *m)
+{
+	return m->priv_worker[ctx.wid];
+}
+
+static inline void *get_priv_worker_by_wid(struct module *m, int wid)
+{
+	return m->priv_worker[wid];
+}
+
+/* Iterates over the per-worker data of all workers (running or not), 
+ * e.g., for commands to aggregate statistics. 
+ * Reading while workers are running may give slightly stale values. */
+#define for_each_priv_worker(m, wid, p) \
+	for ((wid) = 0; (wid) < MAX_WORKERS && \
+			((p) = (m)->priv_worker[wid]) != NULL; (wid)++)
+
 task_id_t register_task(struct module *m, void *arg);
 task_id_t task_to_tid(struct task *t);
 int num_module_tasks(struct module *m);
@@ -118,19 +280,39 @@ size_t list_modules(const struct module **p_arr, size_t arr_size, size_t offset)
 
 struct module *find_module(const char *name);
 
+/* socket: NUMA node to allocate the module on, or SOCKET_ID_ANY */
 struct module *create_module(const char *name, 
 		const struct mclass *class, 
 		struct snobj *arg,
+		int socket,
 		struct snobj **perr);
 
 void destroy_module(struct module *m);
 
+/* mclass->deinit_worker() of all modules, for a worker being removed. 
+ * Other workers may be running */
+void deinit_modules_worker(int wid);
+
+/* Switches to mclass->variants[] of the name (NULL for the defaults),
+ * updating the gates and tasks that call the module. Workers must be
+ * paused, unless they are never in the module at the same time (e.g., in
+ * init()). Returns 0 or -ENOENT */
+int select_variant(struct module *m, const char *name);
+
+/* re-evaluate m->fused, after any change to the ogate of m */
+void update_fused_link(struct module *m);
+
 int connect_modules(struct module *m_prev, gate_idx_t ogate_idx, 
 		    struct module *m_next, gate_idx_t igate_idx);
 int disconnect_modules(struct module *m_prev, gate_idx_t ogate_idx);
 		
+/* drops the batch, sent by m to an unconnected gate */
 void deadend(struct module *m, struct pkt_batch *batch);
 
+/* parses the "prefetch" argument (an integer, in packets) of modules that
+ * use snb_prefetch_ahead(). NULL if valid */
+struct snobj *get_prefetch_dist(struct snobj *arg, int *dist);
+
 /* run all per-thread initializers */
 void init_module_worker(void);
 
@@ -141,24 +323,49 @@ void _trace_before_call(struct module *mod, struct module *next,
 void _trace_after_call(void);
 #endif
 
-#if TCPDUMP_GATES
-int enable_tcpdump(const char* fifo, struct module *m, gate_idx_t gate);
+/* returns -EEXIST if the gate already has a hook with the same name */
+int add_gate_hook(struct gate *gate, struct gate_hook *hook);
 
-int disable_tcpdump(struct module *m, gate_idx_t gate);
+struct gate_hook *find_gate_hook(struct gate *gate, const char *name);
 
-void dump_pcap_pkts(struct gate *gate, struct pkt_batch *batch);
+/* returns -ENOENT if not found. The hook is finalized on return */
+int remove_gate_hook(struct gate *gate, const char *name);
 
-#else
-inline int enable_tcpdump(const char *, struct module *, gate_idx_t) {
-	/* Cannot enable tcpdump */
-	return -EINVAL;
-}
+/* remove and finalize all hooks. Only for gates that are being freed */
+void remove_all_gate_hooks(struct gate *gate);
+
+int enable_track(struct module *m, gate_idx_t gate);
+int disable_track(struct module *m, gate_idx_t gate);
+
+/* precision: [HISTO_MIN_SUB_BITS, HISTO_MAX_SUB_BITS]. Returns -EEXIST if
+ * the gate already has a probe */
+int enable_latency(struct module *m, gate_idx_t gate, int precision);
+int disable_latency(struct module *m, gate_idx_t gate);
+
+/* min_size: 2-MAX_PKT_BURST. Updated if already enabled */
+int enable_compaction(struct module *m, gate_idx_t gate, int min_size);
+
+/* returns -ENOENT if not enabled. Buffered packets are passed on first */
+int disable_compaction(struct module *m, gate_idx_t gate);
+
+/* dumps 1 out of every sample packets (counted per worker) */
+int enable_tcpdump(const char* fifo, struct module *m, gate_idx_t gate,
+		uint32_t sample);
+
+/* creates a struct dump_ring at path (must not exist) */
+int enable_tcpdump_ring(const char *path, struct module *m, 
+		gate_idx_t gate, uint32_t snaplen, uint32_t num_slots, 
+		uint32_t sample);
+
+int disable_tcpdump(struct module *m, gate_idx_t gate);
+
+static inline void run_gate_hooks(struct gate *gate, struct pkt_batch *batch)
+{
+	struct gate_hook *hook;
 
-inline int disable_tcpdump(struct module *, int) {
-	/* Cannot disable tcpdump */
-	return -EINVAL;
+	for (hook = gate->hooks; hook; hook = hook->next)
+		hook->f(gate, hook, batch);
 }
-#endif
 
 
 static inline gate_idx_t get_igate()
@@ -166,22 +373,170 @@ static inline gate_idx_t get_igate()
 	return ctx.igate_stack[ctx.stack_depth - 1];
 }
 
+/* How many packets the running task should try to handle in this run.
+ * MAX_PKT_BURST, unless autotuned (global_opts.task_backoff_us).
+ * Tasks may process it as multiple batches of up to MAX_PKT_BURST. */
+static inline uint32_t get_task_burst()
+{
+	return (global_opts.task_backoff_us && ctx.current_task) ? 
+		ctx.current_task->burst : MAX_PKT_BURST;
+}
+
+static inline void account_module_perf(struct module *m, uint64_t pkts,
+		uint64_t cycles)
+{
+	struct module_perf *perf = &m->perf[ctx.wid];
+
+	perf->samples++;
+	perf->pkts += pkts;
+	perf->cycles += cycles;
+}
+
+/* Hardware counters around a sampled call. Like ctx.perf_child_cycles,
+ * ctx.perf_child_pmu keeps the counts of downstream modules out */
+struct pmu_sample {
+	uint64_t start[NUM_PMU_EVENTS];
+	uint64_t saved[NUM_PMU_EVENTS];
+};
+
+static inline void pmu_sample_begin(struct pmu_sample *s)
+{
+	for (int i = 0; i < NUM_PMU_EVENTS; i++) {
+		s->saved[i] = ctx.perf_child_pmu[i];
+		ctx.perf_child_pmu[i] = 0;
+	}
+
+	pmu_read(&ctx.pmu, s->start);
+}
+
+/* adds the counts of the caller itself to self, and all to total */
+static inline void pmu_sample_end(struct pmu_sample *s, uint64_t *self,
+		uint64_t *total)
+{
+	uint64_t now[NUM_PMU_EVENTS];
+
+	pmu_read(&ctx.pmu, now);
+
+	for (int i = 0; i < NUM_PMU_EVENTS; i++) {
+		uint64_t elapsed = now[i] - s->start[i];
+
+		self[i] += elapsed - ctx.perf_child_pmu[i];
+		total[i] += elapsed;
+		ctx.perf_child_pmu[i] = s->saved[i] + elapsed;
+	}
+}
+
+/* Counts cnt packets dropped for the cause, on this worker and by m
+ * (NULL if not dropped by a particular module) */
+static inline void count_drops(struct module *m, enum drop_cause cause,
+		uint64_t cnt)
+{
+	ctx.drops[cause] += cnt;
+
+	if (m)
+		m->perf[ctx.wid].drops[cause] += cnt;
+}
+
+/* f(m, batch), with its cycles charged to owner (m->owner_tc) */
+void __charged_call_module(proc_func_t f, struct module *m, 
+		struct pkt_batch *batch, struct tc *owner);
+
+static inline void __call_module(proc_func_t f, struct module *m, 
+		struct pkt_batch *batch)
+{
+	/* read once: set_module_tc() may clear it meanwhile */
+	struct tc *owner = *(struct tc * volatile *)&m->owner_tc;
+
+	if (unlikely(owner != NULL))
+		__charged_call_module(f, m, batch, owner);
+	else
+		f(m, batch);
+}
+
+/* f(m, batch), timed during a sampled task run */
+void __perf_call_module(proc_func_t f, struct module *m, 
+		struct pkt_batch *batch);
+
+/* f(m, batch), recorded in the trace ring of the worker (trace.h) */
+void __trace_call_module(proc_func_t f, struct module *m, 
+		struct pkt_batch *batch);
+
+static inline void call_module(proc_func_t f, struct module *m,
+		struct pkt_batch *batch)
+{
+	if (unlikely(ctx.trace != NULL))
+		__trace_call_module(f, m, batch);
+	else if (unlikely(ctx.perf_sampling))
+		__perf_call_module(f, m, batch);
+	else
+		__call_module(f, m, batch);
+}
+
+/* batch to a connected ogate, whose f is given */
+static inline void __run_gate(struct gate *ogate, proc_func_t f,
+		struct pkt_batch *batch)
+{
+	if (unlikely(ogate->hooks != NULL))
+		run_gate_hooks(ogate, batch);
+
+	ctx.igate_stack[ctx.stack_depth] = ogate->out.igate_idx;
+	ctx.stack_depth++;
+
+	call_module(f, ogate->arg, batch);
+
+	ctx.stack_depth--;
+}
+
+void compact_batch(struct gate *ogate, struct gate_compact *gc,
+		struct pkt_batch *batch);
+
+void __flush_compaction(void);
+
+/* passes on all partial batches buffered by compact_batch(). 
+ * Called at the end of every task run and timer round */
+static inline void flush_compaction(void)
+{
+	if (unlikely(ctx.compact_pending != NULL))
+		__flush_compaction();
+}
+
 /* Pass packets to the next module.
  * Packet deallocation is callee's responsibility. */
 static inline void run_choose_module(struct module *m, gate_idx_t ogate_idx,
 				     struct pkt_batch *batch)
 {
 	struct gate *ogate;
+	struct gate_compact *gc;
+	proc_func_t f;
+
+	if (likely(ogate_idx < INLINE_OGATES)) {
+		ogate = &m->inline_ogates[ogate_idx];
+	} else {
+		if (unlikely(ogate_idx >= m->ogates.curr_size)) {
+			deadend(m, batch);
+			return;
+		}
+
+		ogate = m->ogates.arr[ogate_idx];
+
+		if (unlikely(!ogate)) {
+			deadend(m, batch);
+			return;
+		}
+	}
 
-	if (unlikely(ogate_idx >= m->ogates.curr_size)) {
-		deadend(NULL, batch);
+	/* read once: inline gates are unpublished by clearing it */
+	f = ogate->f;
+
+	if (unlikely(!f)) {
+		deadend(m, batch);
 		return;
 	}
 
-	ogate = m->ogates.arr[ogate_idx];
+	gc = ogate->compact;
 
-	if (unlikely(!ogate)) {
-		deadend(NULL, batch);
+	if (unlikely(gc != NULL)) {
+		compact_batch(ogate, gc, batch);
 		return;
 	}
 
@@ -189,22 +544,7 @@ static inline void run_choose_module(struct module *m, gate_idx_t ogate_idx,
 	_trace_before_call(m, next, batch);
 #endif
 
-#if TRACK_GATES
-	ogate->cnt += 1;
-	ogate->pkts += batch->cnt;
-#endif
-
-#if TCPDUMP_GATES
-	if (unlikely(ogate->tcpdump))
-		dump_pcap_pkts(ogate, batch);
-#endif
-
-	ctx.igate_stack[ctx.stack_depth] = ogate->out.igate_idx;
-	ctx.stack_depth++;
-
-	ogate->f(ogate->arg, batch);
-
-	ctx.stack_depth--;
+	__run_gate(ogate, f, batch);
 
 #if SN_TRACE_MODULES
 	_trace_after_call();
@@ -214,14 +554,60 @@ static inline void run_choose_module(struct module *m, gate_idx_t ogate_idx,
 /* Wrapper for single-output modules */
 static inline void run_next_module(struct module *m, struct pkt_batch *batch)
 {
+#if !SN_TRACE_MODULES
+	proc_func_t f = m->fused.f;
+
+	if (likely(f != NULL)) {
+		ctx.igate_stack[ctx.stack_depth] = m->fused.igate_idx;
+		ctx.stack_depth++;
+
+		call_module(f, m->fused.arg, batch);
+
+		ctx.stack_depth--;
+		return;
+	}
+#endif
+
 	run_choose_module(m, 0, batch);
 }
 
+/* Do all packets go to the same gate? 
+ * ogates must have room for MAX_PKT_BURST entries */
+static inline int split_is_uniform(const gate_idx_t *ogates, int cnt)
+{
+#if __AVX2__
+	const __m256i first = _mm256_set1_epi16(ogates[0]);
+
+	ct_assert(MAX_PKT_BURST % 16 == 0);
+
+	for (int i = 0; i < cnt; i += 16) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(ogates + i));
+		uint32_t eq = _mm256_movemask_epi8(_mm256_cmpeq_epi16(v, first));
+		uint32_t mask = (cnt - i >= 16) ? 
+				0xffffffff : (1u << ((cnt - i) * 2)) - 1;
+
+		if ((eq & mask) != mask)
+			return 0;
+	}
+
+	return 1;
+#else
+	gate_idx_t first = ogates[0];
+	int diff = 0;
+
+	for (int i = 1; i < cnt; i++)
+		diff |= (ogates[i] != first);
+
+	return !diff;
+#endif
+}
+
 /*
  * Split a batch into several, one for each ogate
  * NOTE:
  *   1. Order is preserved for packets with the same gate.
  *   2. No ordering guarantee for packets with different gates.
+ *   3. ogates must have room for MAX_PKT_BURST entries.
  */
 static void run_split(struct module *m, const gate_idx_t *ogates,
 		struct pkt_batch *mixed_batch)
@@ -234,31 +620,37 @@ static void run_split(struct module *m, const gate_idx_t *ogates,
 	gate_idx_t pending[MAX_PKT_BURST];
 	struct pkt_batch batches[MAX_PKT_BURST];
 
-	struct pkt_batch *splits = ctx.splits;
+	uint8_t *slot = ctx.split_slot;
 
-	/* phase 1: collect unique ogates into pending[] */
-	for (int i = 0; i < cnt; i++) {
-		struct pkt_batch *batch;
-		gate_idx_t ogate;
-		
-		ogate = ogates[i];
-		batch = &splits[ogate];
+	ct_assert(MAX_PKT_BURST < 256);
 
-		batch_add(batch, *(p_pkt++));
+	if (unlikely(cnt == 0))
+		return;
 
-		pending[num_pending] = ogate;
-		num_pending += (batch->cnt == 1);
+	/* fast path: a single gate. the batch can be passed as is */
+	if (split_is_uniform(ogates, cnt)) {
+		run_choose_module(m, ogates[0], mixed_batch);
+		return;
 	}
 
-	/* phase 2: move batches to local stack, since it may be reentrant */
-	for (int i = 0; i < num_pending; i++) {
-		struct pkt_batch *batch;
+	/* phase 1: scatter packets directly into per-gate batches */
+	for (int i = 0; i < cnt; i++) {
+		gate_idx_t ogate = ogates[i];
+		int idx = slot[ogate];
+
+		if (idx == 0) {
+			pending[num_pending] = ogate;
+			batch_clear(&batches[num_pending]);
+			idx = slot[ogate] = ++num_pending;
+		}
 
-		batch = &splits[pending[i]];
-		batch_copy(&batches[i], batch);
-		batch_clear(batch);
+		batch_add(&batches[idx - 1], *(p_pkt++));
 	}
 
+	/* phase 2: reset the map before firing, since it may be reentrant */
+	for (int i = 0; i < num_pending; i++)
+		slot[pending[i]] = 0;
+
 	/* phase 3: fire */
 	for (int i = 0; i < num_pending; i++)
 		run_choose_module(m, pending[i], &batches[i]);
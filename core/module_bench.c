@@ -0,0 +1,230 @@
+#include <errno.h>
+#include <stdlib.h>
+
+#include <rte_byteorder.h>
+#include <rte_ether.h>
+#include <rte_ip.h>
+#include <rte_udp.h>
+
+#include "module.h"
+#include "module_bench.h"
+
+#define BENCH_HDR_LEN	(sizeof(struct ether_hdr) + \
+		sizeof(struct ipv4_hdr) + sizeof(struct udp_hdr))
+
+struct bench_job {
+	struct module *m;
+	struct module *sink;
+	const struct module_bench_cfg *cfg;
+	struct module_bench_result *res;
+
+	char *hdrs;		/* BENCH_HDR_LEN bytes per flow */
+	uint32_t next_flow;
+
+	int wid;
+};
+
+/* 10.<flow> -> 192.168.0.1, with the source port also varying */
+static void build_hdr(char *buf, uint32_t flow, int pkt_size)
+{
+	struct ether_hdr *eth = (struct ether_hdr *)buf;
+	struct ipv4_hdr *ip = (struct ipv4_hdr *)(eth + 1);
+	struct udp_hdr *udp = (struct udp_hdr *)(ip + 1);
+
+	struct ether_addr src = {.addr_bytes = {0x02, 0, 0, 0, 0, 0x01}};
+	struct ether_addr dst = {.addr_bytes = {0x02, 0, 0, 0, 0, 0x02}};
+
+	ether_addr_copy(&src, &eth->s_addr);
+	ether_addr_copy(&dst, &eth->d_addr);
+	eth->ether_type = rte_cpu_to_be_16(ETHER_TYPE_IPv4);
+
+	ip->version_ihl = 0x45;
+	ip->type_of_service = 0;
+	ip->total_length = rte_cpu_to_be_16(pkt_size - sizeof(*eth));
+	ip->packet_id = 0;
+	ip->fragment_offset = 0;
+	ip->time_to_live = 64;
+	ip->next_proto_id = IPPROTO_UDP;
+	ip->hdr_checksum = 0;
+	ip->src_addr = rte_cpu_to_be_32((10 << 24) | (flow & 0xffffff));
+	ip->dst_addr = rte_cpu_to_be_32((192 << 24) | (168 << 16) | 1);
+	ip->hdr_checksum = rte_ipv4_cksum(ip);
+
+	udp->src_port = rte_cpu_to_be_16(1024 + (flow % 60000));
+	udp->dst_port = rte_cpu_to_be_16(5001);
+	udp->dgram_len = rte_cpu_to_be_16(pkt_size - sizeof(*eth) -
+			sizeof(*ip));
+	udp->dgram_cksum = 0;
+}
+
+static int fill_batch(struct bench_job *job, struct pkt_batch *batch)
+{
+	const struct module_bench_cfg *cfg = job->cfg;
+	int n = cfg->batch_size;
+
+	if (snb_alloc_bulk(batch->pkts, n, cfg->pkt_size) != n)
+		return -ENOMEM;
+
+	for (int i = 0; i < n; i++) {
+		rte_memcpy(snb_head_data(batch->pkts[i]),
+				job->hdrs + job->next_flow * BENCH_HDR_LEN,
+				BENCH_HDR_LEN);
+
+		if (++job->next_flow == cfg->num_flows)
+			job->next_flow = 0;
+	}
+
+	batch->cnt = n;
+
+	return 0;
+}
+
+/* cycles of num_batches */
+static int run_batches(struct bench_job *job, struct module *m,
+		uint64_t num_batches, uint64_t *cycles)
+{
+	proc_func_t f = m->process_batch;
+
+	*cycles = 0;
+
+	for (uint64_t i = 0; i < num_batches; i++) {
+		struct pkt_batch batch;
+		uint64_t start;
+		int ret;
+
+		ret = fill_batch(job, &batch);
+		if (ret < 0)
+			return ret;
+
+		start = rdtsc();
+		ctx.current_tsc = start;
+		f(m, &batch);
+		flush_compaction();
+		*cycles += rdtsc() - start;
+	}
+
+	return 0;
+}
+
+static int bench_on_worker(void *arg)
+{
+	struct bench_job *job = arg;
+	const struct module_bench_cfg *cfg = job->cfg;
+	struct module_bench_result *res = job->res;
+
+	uint64_t saved_tsc = ctx.current_tsc;
+	struct task *saved_task = ctx.current_task;
+	uint64_t saved_deadline = ctx.task_deadline_tsc;
+	uint64_t warmup;
+	int ret;
+
+	/* paused meanwhile, so run_on_worker() called this on the master */
+	if (ctx.wid != job->wid)
+		return -EBUSY;
+
+	/* appear to come from igate 0 (see get_igate()) */
+	ctx.igate_stack[ctx.stack_depth] = 0;
+	ctx.stack_depth++;
+
+	/* not a task run, so no TC is charged (module.owner_tc) 
+	 * and there is no cycle budget */
+	ctx.current_task = NULL;
+	ctx.task_deadline_tsc = UINT64_MAX;
+
+	warmup = cfg->num_batches / 10;
+
+	ret = run_batches(job, job->sink, warmup, &res->base_cycles);
+	if (ret < 0)
+		goto out;
+
+	ret = run_batches(job, job->sink, cfg->num_batches, &res->base_cycles);
+	if (ret < 0)
+		goto out;
+
+	ret = run_batches(job, job->m, warmup, &res->cycles);
+	if (ret < 0)
+		goto out;
+
+	ret = run_batches(job, job->m, cfg->num_batches, &res->cycles);
+	if (ret < 0)
+		goto out;
+
+	res->batches = cfg->num_batches;
+	res->packets = cfg->num_batches * cfg->batch_size;
+
+out:
+	ctx.stack_depth--;
+	ctx.current_tsc = saved_tsc;
+	ctx.current_task = saved_task;
+	ctx.task_deadline_tsc = saved_deadline;
+
+	return ret;
+}
+
+int bench_module(struct module *m, int wid, const struct module_bench_cfg *cfg,
+		struct module_bench_result *res)
+{
+	const struct mclass *sink_class;
+	struct bench_job job = {};
+	struct snobj *err;
+	int num_ogates;
+	int ret;
+
+	if (!m->process_batch || m->mclass->num_igates == 0)
+		return -ENOTSUP;
+
+	if (cfg->batch_size < 1 || cfg->batch_size > MAX_PKT_BURST ||
+			cfg->pkt_size < 60 || cfg->pkt_size > SNBUF_DATA ||
+			cfg->num_flows < 1 || cfg->num_flows > BENCH_MAX_FLOWS ||
+			cfg->num_batches < 1 ||
+			cfg->num_batches > BENCH_MAX_BATCHES)
+		return -EINVAL;
+
+	if (!is_worker_active(wid))
+		return -ENOENT;
+
+	/* otherwise run_on_worker() would run it on this (master) thread,
+	 * which has no per-worker state */
+	if (!is_worker_running(wid))
+		return -EBUSY;
+
+	sink_class = find_mclass("Sink");
+	if (!sink_class)
+		return -ENOENT;
+
+	job.hdrs = malloc((size_t)cfg->num_flows * BENCH_HDR_LEN);
+	if (!job.hdrs)
+		return -ENOMEM;
+
+	for (uint32_t i = 0; i < cfg->num_flows; i++)
+		build_hdr(job.hdrs + i * BENCH_HDR_LEN, i, cfg->pkt_size);
+
+	job.sink = create_module(NULL, sink_class, NULL,
+			workers[wid]->socket, &err);
+	if (!job.sink) {
+		snobj_free(err);
+		free(job.hdrs);
+		return -ENOMEM;
+	}
+
+	num_ogates = MIN(m->mclass->num_ogates, BENCH_MAX_OGATES);
+
+	for (int i = 0; i < num_ogates; i++) {
+		ret = connect_modules(m, i, job.sink, 0);
+		if (ret < 0)
+			goto out;
+	}
+
+	job.m = m;
+	job.cfg = cfg;
+	job.res = res;
+	job.wid = wid;
+
+	ret = run_on_worker(wid, bench_on_worker, &job);
+
+out:
+	destroy_module(job.sink);
+	free(job.hdrs);
+
+	return ret;
+}
@@ -0,0 +1,40 @@
+#ifndef _MODULE_BENCH_H_
+#define _MODULE_BENCH_H_
+
+#include <stdint.h>
+
+/* Module microbenchmark. Synthetic UDP/IPv4 batches are fed to the
+ * process_batch() of a module in a tight loop, on the thread of a worker
+ * (which is stalled meanwhile, see run_on_worker()). The worker must be
+ * running, since module code uses the per-worker state of ctx. The output gates go
+ * to a Sink, and the cost of freeing the packets there is measured
+ * separately with the Sink alone (base_cycles), so the difference is the
+ * cost of the module itself. Packet allocation and header writing are not
+ * timed. */
+
+#define BENCH_MAX_FLOWS		(1 << 20)
+#define BENCH_MAX_BATCHES	10000000
+#define BENCH_MAX_OGATES	64	/* beyond these, packets are dropped */
+
+struct module_bench_cfg {
+	int batch_size;		/* 1-MAX_PKT_BURST */
+	int pkt_size;		/* 60-SNBUF_DATA, without the FCS */
+	uint32_t num_flows;	/* distinct UDP flows, round robin */
+	uint64_t num_batches;	/* another 10% before them, for warmup */
+};
+
+struct module_bench_result {
+	uint64_t batches;
+	uint64_t packets;
+	uint64_t cycles;	/* in process_batch(), including the Sink */
+	uint64_t base_cycles;	/* of the same batches, to the Sink alone */
+};
+
+struct module;
+
+/* m must have an input gate and process_batch(), and no connection.
+ * Returns 0 or -errno (-EBUSY if the worker is not running) */
+int bench_module(struct module *m, int wid, const struct module_bench_cfg *cfg,
+		struct module_bench_result *res);
+
+#endif
@@ -0,0 +1,590 @@
+#include <arpa/inet.h>
+
+#include <rte_acl.h>
+
+#include "../module.h"
+#include "../parse.h"
+
+/* Wildcard 5-tuple classifier for IPv4, with rule priorities.
+ *
+ * Rules are compiled into a DPDK rte_acl context (a multi-bit trie
+ * classified with SIMD), and a whole batch is classified with one call.
+ * Each add/clear builds a new context from the full rule set on the
+ * control thread while workers keep using the old one. The new context is
+ * published with a pointer store and the old one is freed after
+ * synchronize_workers(), so commands do not pause the datapath.
+ *
+ * Packets that are not IPv4, or match no rule, go to the default gate.
+ * Non-first fragments have no L4 header, and are classified with ports 0. */
+
+#define ACL_MAX_RULES		(1 << 20)
+
+/* What rte_acl looks at. Network order, grouped into 4-byte inputs. */
+struct acl_key {
+	uint8_t proto;
+	uint8_t pad[3];
+	uint32_t src_addr;
+	uint32_t dst_addr;
+	uint16_t src_port;
+	uint16_t dst_port;
+};
+
+enum {
+	ACL_FIELD_PROTO,
+	ACL_FIELD_SRC,
+	ACL_FIELD_DST,
+	ACL_FIELD_SRC_PORT,
+	ACL_FIELD_DST_PORT,
+	ACL_NUM_FIELDS,
+};
+
+RTE_ACL_RULE_DEF(acl_rule, ACL_NUM_FIELDS);
+
+static const struct rte_acl_field_def acl_field_defs[ACL_NUM_FIELDS] = {
+	{
+		.type = RTE_ACL_FIELD_TYPE_BITMASK,
+		.size = sizeof(uint8_t),
+		.field_index = ACL_FIELD_PROTO,
+		.input_index = 0,
+		.offset = offsetof(struct acl_key, proto),
+	},
+	{
+		.type = RTE_ACL_FIELD_TYPE_MASK,
+		.size = sizeof(uint32_t),
+		.field_index = ACL_FIELD_SRC,
+		.input_index = 1,
+		.offset = offsetof(struct acl_key, src_addr),
+	},
+	{
+		.type = RTE_ACL_FIELD_TYPE_MASK,
+		.size = sizeof(uint32_t),
+		.field_index = ACL_FIELD_DST,
+		.input_index = 2,
+		.offset = offsetof(struct acl_key, dst_addr),
+	},
+	{
+		.type = RTE_ACL_FIELD_TYPE_RANGE,
+		.size = sizeof(uint16_t),
+		.field_index = ACL_FIELD_SRC_PORT,
+		.input_index = 3,
+		.offset = offsetof(struct acl_key, src_port),
+	},
+	{
+		.type = RTE_ACL_FIELD_TYPE_RANGE,
+		.size = sizeof(uint16_t),
+		.field_index = ACL_FIELD_DST_PORT,
+		.input_index = 3,
+		.offset = offsetof(struct acl_key, dst_port),
+	},
+};
+
+struct acl_priv {
+	struct rte_acl_ctx * volatile ctx;	/* NULL if no rules */
+	uint32_t generation;			/* for unique context names */
+
+	/* all rules, to rebuild the context. userdata is gate + 1 */
+	struct acl_rule *rules;
+	uint32_t n_rules;
+	uint32_t max_rules;
+
+	int attr_id;
+	gate_idx_t default_gate;
+};
+
+/* fills key, and returns 0 if the packet is IPv4 */
+static inline int acl_extract_key(struct module *m, int attr_id, int parsed,
+		struct snbuf *snb, struct acl_key *key)
+{
+	struct pkt_parse local;
+	struct pkt_parse *pp;
+	const char *head = snb_head_data(snb);
+	const struct ipv4_hdr *ip;
+
+	if (parsed) {
+		pp = get_parse(m, attr_id, snb);
+	} else {
+		parse_packet(snb, &local);
+		pp = &local;
+	}
+
+	if (!(pp->flags & PARSE_IPV4))
+		return -1;
+
+	ip = (const struct ipv4_hdr *)(head + pp->l3_offset);
+
+	key->proto = ip->next_proto_id;
+	key->src_addr = ip->src_addr;
+	key->dst_addr = ip->dst_addr;
+
+	/* TCP, UDP, SCTP, ... all begin with the ports. Short packets and
+	 * non-first fragments have none. */
+	if (pp->l4_offset && pp->l4_offset + 4 <= snb_head_len(snb)) {
+		const uint16_t *ports = (const uint16_t *)(head + pp->l4_offset);
+
+		key->src_port = ports[0];
+		key->dst_port = ports[1];
+	} else {
+		key->src_port = 0;
+		key->dst_port = 0;
+	}
+
+	return 0;
+}
+
+static void acl_process_batch(struct module *m, struct pkt_batch *batch)
+{
+	struct acl_priv *priv = get_priv(m);
+	const struct rte_acl_ctx *ctx = priv->ctx;
+	gate_idx_t default_gate = priv->default_gate;
+	int attr_id = priv->attr_id;
+	int parsed = parse_available(m, attr_id);
+	int cnt = batch->cnt;
+	int n = 0;
+
+	struct acl_key keys[MAX_PKT_BURST];
+	const uint8_t *data[MAX_PKT_BURST];
+	uint32_t results[MAX_PKT_BURST];
+	uint8_t idx[MAX_PKT_BURST];
+	gate_idx_t ogates[MAX_PKT_BURST];
+
+	if (!ctx) {
+		run_choose_module(m, default_gate, batch);
+		return;
+	}
+
+	for (int i = 0; i < cnt; i++) {
+		ogates[i] = default_gate;
+
+		if (acl_extract_key(m, attr_id, parsed, batch->pkts[i],
+					&keys[n]))
+			continue;
+
+		data[n] = (const uint8_t *)&keys[n];
+		idx[n] = i;
+		n++;
+	}
+
+	if (n) {
+		rte_acl_classify(ctx, data, results, n, 1);
+
+		for (int i = 0; i < n; i++)
+			if (results[i])
+				ogates[idx[i]] = results[i] - 1;
+	}
+
+	run_split(m, ogates, batch);
+}
+
+/* builds and publishes a context for the first n rules */
+static int acl_rebuild(struct module *m, uint32_t n)
+{
+	struct acl_priv *priv = get_priv(m);
+	struct rte_acl_ctx *old = priv->ctx;
+	struct rte_acl_ctx *ctx = NULL;
+	char name[RTE_ACL_NAMESIZE];
+	int ret;
+
+	if (n > 0) {
+		struct rte_acl_param param = {
+			.name = name,
+			.socket_id = m->socket,
+			.rule_size = RTE_ACL_RULE_SZ(ACL_NUM_FIELDS),
+			.max_rule_num = n,
+		};
+		struct rte_acl_config cfg = {
+			.num_categories = 1,
+			.num_fields = ACL_NUM_FIELDS,
+		};
+
+		/* rte_acl_create() returns the existing context of the name */
+		snprintf(name, sizeof(name), "acl_%p_%u", priv,
+				priv->generation++);
+
+		ctx = rte_acl_create(&param);
+		if (!ctx)
+			return -ENOMEM;
+
+		memcpy(cfg.defs, acl_field_defs, sizeof(acl_field_defs));
+
+		ret = rte_acl_add_rules(ctx,
+				(const struct rte_acl_rule *)priv->rules, n);
+		if (!ret)
+			ret = rte_acl_build(ctx, &cfg);
+
+		if (ret) {
+			rte_acl_free(ctx);
+			return ret;
+		}
+	}
+
+	priv->ctx = ctx;
+
+	if (old) {
+		synchronize_workers();
+		rte_acl_free(old);
+	}
+
+	return 0;
+}
+
+static struct snobj *acl_parse_prefix(struct snobj *rule, const char *name,
+		struct rte_acl_field *field)
+{
+	char buf[INET_ADDRSTRLEN + 4];
+	const char *str;
+	char *slash;
+	struct in_addr addr;
+	int len = 32;
+
+	field->value.u32 = 0;
+	field->mask_range.u32 = 0;	/* prefix length. 0: any */
+
+	if (!snobj_eval_exists(rule, name))
+		return NULL;
+
+	str = snobj_eval_str(rule, name);
+	if (!str || strlen(str) >= sizeof(buf))
+		return snobj_err(EINVAL, "'%s' must be an IPv4 address or "
+				"prefix", name);
+
+	strcpy(buf, str);
+	slash = strchr(buf, '/');
+	if (slash) {
+		char *end;
+
+		*slash = '\0';
+		len = strtol(slash + 1, &end, 10);
+		if (*end || end == slash + 1 || len < 0 || len > 32)
+			return snobj_err(EINVAL, "invalid prefix length in "
+					"'%s'", name);
+	}
+
+	if (inet_pton(AF_INET, buf, &addr) != 1)
+		return snobj_err(EINVAL, "invalid IPv4 address in '%s'", name);
+
+	/* rules are in host order, unlike the keys */
+	field->value.u32 = len ?
+		rte_be_to_cpu_32(addr.s_addr) & ~((1ul << (32 - len)) - 1) : 0;
+	field->mask_range.u32 = len;
+
+	return NULL;
+}
+
+/* an integer, or a list of [low, high] */
+static struct snobj *acl_parse_range(struct snobj *rule, const char *name,
+		struct rte_acl_field *field)
+{
+	struct snobj *v = snobj_eval(rule, name);
+	int64_t low = 0;
+	int64_t high = UINT16_MAX;
+
+	if (!v) {
+		/* any */
+	} else if (snobj_type(v) == TYPE_INT) {
+		low = high = snobj_int_get(v);
+	} else if (snobj_type(v) == TYPE_LIST && v->size == 2 &&
+			snobj_type(snobj_list_get(v, 0)) == TYPE_INT &&
+			snobj_type(snobj_list_get(v, 1)) == TYPE_INT) {
+		low = snobj_int_get(snobj_list_get(v, 0));
+		high = snobj_int_get(snobj_list_get(v, 1));
+	} else
+		return snobj_err(EINVAL, "'%s' must be a port or a list of "
+				"[low, high]", name);
+
+	if (low < 0 || high > UINT16_MAX || low > high)
+		return snobj_err(EINVAL, "invalid range for '%s'", name);
+
+	field->value.u16 = low;
+	field->mask_range.u16 = high;
+
+	return NULL;
+}
+
+static struct snobj *acl_parse_rule(struct snobj *rule, struct acl_rule *r)
+{
+	struct rte_acl_field *proto = &r->field[ACL_FIELD_PROTO];
+	struct snobj *err;
+	int64_t priority = 0;
+	gate_idx_t gate;
+
+	if (snobj_type(rule) != TYPE_MAP)
+		return snobj_err(EINVAL, "each rule must be a map");
+
+	memset(r, 0, sizeof(*r));
+
+	if (snobj_eval_exists(rule, "priority"))
+		priority = snobj_eval_int(rule, "priority");
+
+	if (priority < RTE_ACL_MIN_PRIORITY || priority > RTE_ACL_MAX_PRIORITY)
+		return snobj_err(EINVAL, "'priority' must be %d-%d",
+				RTE_ACL_MIN_PRIORITY, RTE_ACL_MAX_PRIORITY);
+
+	if (snobj_eval_int(rule, "drop")) {
+		gate = DROP_GATE;
+	} else {
+		if (!snobj_eval_exists(rule, "gate"))
+			return snobj_err(EINVAL, "either 'gate' or 'drop' "
+					"must be given");
+
+		gate = snobj_eval_uint(rule, "gate");
+		if (!is_valid_gate(gate))
+			return snobj_err(EINVAL, "invalid gate %d", gate);
+	}
+
+	r->data.category_mask = 1;
+	r->data.priority = priority;
+	r->data.userdata = gate + 1;
+
+	if (snobj_eval_exists(rule, "proto")) {
+		struct snobj *v = snobj_eval(rule, "proto");
+		const char *str = snobj_str_get(v);
+
+		if (str && strcmp(str, "tcp") == 0)
+			proto->value.u8 = IPPROTO_TCP;
+		else if (str && strcmp(str, "udp") == 0)
+			proto->value.u8 = IPPROTO_UDP;
+		else if (str && strcmp(str, "icmp") == 0)
+			proto->value.u8 = IPPROTO_ICMP;
+		else if (snobj_type(v) == TYPE_INT &&
+				snobj_uint_get(v) <= UINT8_MAX)
+			proto->value.u8 = snobj_uint_get(v);
+		else
+			return snobj_err(EINVAL, "'proto' must be 'tcp', "
+					"'udp', 'icmp', or a number");
+
+		proto->mask_range.u8 = 0xff;
+	}
+
+	err = acl_parse_prefix(rule, "src_ip", &r->field[ACL_FIELD_SRC]);
+	if (err)
+		return err;
+
+	err = acl_parse_prefix(rule, "dst_ip", &r->field[ACL_FIELD_DST]);
+	if (err)
+		return err;
+
+	err = acl_parse_range(rule, "src_port", &r->field[ACL_FIELD_SRC_PORT]);
+	if (err)
+		return err;
+
+	return acl_parse_range(rule, "dst_port", &r->field[ACL_FIELD_DST_PORT]);
+}
+
+static struct snobj *
+command_add(struct module *m, const char *cmd, struct snobj *arg)
+{
+	struct acl_priv *priv = get_priv(m);
+	uint32_t n;
+	int ret;
+
+	if (snobj_type(arg) != TYPE_LIST)
+		return snobj_err(EINVAL, "argument must be a list of rules");
+
+	n = priv->n_rules + arg->size;
+	if (n > ACL_MAX_RULES)
+		return snobj_err(EINVAL, "max %d rules are allowed",
+				ACL_MAX_RULES);
+
+	if (n > priv->max_rules) {
+		uint32_t max_rules = RTE_MAX(priv->max_rules * 2, n);
+		struct acl_rule *rules;
+
+		rules = realloc(priv->rules, max_rules * sizeof(*rules));
+		if (!rules)
+			return snobj_errno(ENOMEM);
+
+		priv->rules = rules;
+		priv->max_rules = max_rules;
+	}
+
+	/* the new rules take effect only if all of them are valid */
+	for (int i = 0; i < arg->size; i++) {
+		struct snobj *err;
+
+		err = acl_parse_rule(snobj_list_get(arg, i),
+				&priv->rules[priv->n_rules + i]);
+		if (err)
+			return err;
+	}
+
+	ret = acl_rebuild(m, n);
+	if (ret)
+		return snobj_err(-ret, "failed to build the rule set "
+				"(%d rules)", n);
+
+	priv->n_rules = n;
+
+	return NULL;
+}
+
+static struct snobj *
+command_clear(struct module *m, const char *cmd, struct snobj *arg)
+{
+	struct acl_priv *priv = get_priv(m);
+
+	acl_rebuild(m, 0);
+	priv->n_rules = 0;
+
+	return NULL;
+}
+
+static struct snobj *
+command_set_default_gate(struct module *m, const char *cmd, struct snobj *arg)
+{
+	struct acl_priv *priv = get_priv(m);
+	int gate = snobj_int_get(arg);
+
+	if (!is_valid_gate(gate))
+		return snobj_err(EINVAL, "invalid gate %d", gate);
+
+	priv->default_gate = gate;
+
+	return NULL;
+}
+
+static struct snobj *acl_init(struct module *m, struct snobj *arg)
+{
+	struct acl_priv *priv = get_priv(m);
+	struct snobj *rules = NULL;
+
+	priv->attr_id = add_parse_attr(m, MT_READ);
+	if (priv->attr_id < 0)
+		return snobj_errno(-priv->attr_id);
+
+	if (snobj_type(arg) == TYPE_MAP) {
+		if (snobj_eval_exists(arg, "default_gate")) {
+			struct snobj *err = command_set_default_gate(m, NULL,
+					snobj_eval(arg, "default_gate"));
+			if (err)
+				return err;
+		}
+
+		rules = snobj_eval(arg, "rules");
+	} else
+		rules = arg;
+
+	return rules ? command_add(m, NULL, rules) : NULL;
+}
+
+static void acl_deinit(struct module *m)
+{
+	struct acl_priv *priv = get_priv(m);
+
+	/* workers may be running (see destroy_module()) */
+	acl_rebuild(m, 0);
+	free(priv->rules);
+}
+
+static struct snobj *acl_get_desc(const struct module *m)
+{
+	const struct acl_priv *priv = get_priv_const(m);
+
+	return snobj_str_fmt("%u rules", priv->n_rules);
+}
+
+static void acl_prefix_to_snobj(struct snobj *rule, const char *name,
+		const struct rte_acl_field *field)
+{
+	struct in_addr addr = {.s_addr = rte_cpu_to_be_32(field->value.u32)};
+	char buf[INET_ADDRSTRLEN];
+
+	if (!field->mask_range.u32)
+		return;
+
+	inet_ntop(AF_INET, &addr, buf, sizeof(buf));
+	snobj_map_set(rule, name, snobj_str_fmt("%s/%u", buf,
+				field->mask_range.u32));
+}
+
+static void acl_range_to_snobj(struct snobj *rule, const char *name,
+		const struct rte_acl_field *field)
+{
+	struct snobj *range;
+
+	if (field->value.u16 == 0 && field->mask_range.u16 == UINT16_MAX)
+		return;
+
+	range = snobj_list();
+	snobj_list_add(range, snobj_int(field->value.u16));
+	snobj_list_add(range, snobj_int(field->mask_range.u16));
+	snobj_map_set(rule, name, range);
+}
+
+/* the inverse of acl_parse_rule() */
+static struct snobj *acl_rule_to_snobj(const struct acl_rule *r)
+{
+	struct snobj *rule = snobj_map();
+	gate_idx_t gate = r->data.userdata - 1;
+
+	snobj_map_set(rule, "priority", snobj_int(r->data.priority));
+
+	if (gate == DROP_GATE)
+		snobj_map_set(rule, "drop", snobj_int(1));
+	else
+		snobj_map_set(rule, "gate", snobj_uint(gate));
+
+	if (r->field[ACL_FIELD_PROTO].mask_range.u8)
+		snobj_map_set(rule, "proto",
+				snobj_uint(r->field[ACL_FIELD_PROTO].value.u8));
+
+	acl_prefix_to_snobj(rule, "src_ip", &r->field[ACL_FIELD_SRC]);
+	acl_prefix_to_snobj(rule, "dst_ip", &r->field[ACL_FIELD_DST]);
+	acl_range_to_snobj(rule, "src_port", &r->field[ACL_FIELD_SRC_PORT]);
+	acl_range_to_snobj(rule, "dst_port", &r->field[ACL_FIELD_DST_PORT]);
+
+	return rule;
+}
+
+/* The rules given with the init argument are added again by init,
+ * so the snapshot starts with a clear */
+static struct snobj *acl_get_snapshot(const struct module *m)
+{
+	const struct acl_priv *priv = get_priv_const(m);
+
+	struct snobj *cmds = snobj_list();
+	struct snobj *rules = snobj_list();
+	struct snobj *cmd;
+
+	for (uint32_t i = 0; i < priv->n_rules; i++)
+		snobj_list_add(rules, acl_rule_to_snobj(&priv->rules[i]));
+
+	cmd = snobj_map();
+	snobj_map_set(cmd, "cmd", snobj_str("clear"));
+	snobj_list_add(cmds, cmd);
+
+	cmd = snobj_map();
+	snobj_map_set(cmd, "cmd", snobj_str("set_default_gate"));
+	snobj_map_set(cmd, "arg", snobj_int(priv->default_gate));
+	snobj_list_add(cmds, cmd);
+
+	if (priv->n_rules) {
+		cmd = snobj_map();
+		snobj_map_set(cmd, "cmd", snobj_str("add"));
+		snobj_map_set(cmd, "arg", rules);
+		snobj_list_add(cmds, cmd);
+	} else
+		snobj_free(rules);
+
+	return cmds;
+}
+
+static const struct mclass acl = {
+	.name 			= "ACL",
+	.help			= "5-tuple wildcard classifier with priorities",
+	.def_module_name	= "acl",
+	.num_igates		= 1,
+	.num_ogates		= MAX_GATES,
+	.priv_size		= sizeof(struct acl_priv),
+	.init 			= acl_init,
+	.deinit			= acl_deinit,
+	.process_batch 		= acl_process_batch,
+	.get_desc		= acl_get_desc,
+	.get_snapshot		= acl_get_snapshot,
+	.commands		= {
+		{"add",			command_add,		.mt_safe=1},
+		{"clear",		command_clear,		.mt_safe=1},
+		{"set_default_gate",	command_set_default_gate, .mt_safe=1},
+	}
+};
+
+ADD_MCLASS(acl)
@@ -1063,6 +1063,7 @@ bpf_jit_compile(struct bpf_insn *prog, u_int nins, size_t *size)
  * Module code begins from here
  * ------------------------------------------------------------------------- */
 #include "../module.h"
+#include "../ebpf.h"
 
 /* Note: bpf_filter will return SNAPLEN if matched, and 0 if unmatched. */
 /* Note: unmatched packets are sent to gate 0 */
@@ -1070,6 +1071,17 @@ bpf_jit_compile(struct bpf_insn *prog, u_int nins, size_t *size)
 
 #define MAX_FILTERS	128
 
+/* Return values of the merged program (see merge_filters()).
+ * MERGED_RET_MATCH + i means filters[i] matched. An out-of-bounds load
+ * in any filter aborts the whole program with 0, so then we fall back
+ * to the individual filters for that packet. */
+#define MERGED_RET_OOB		0
+#define MERGED_RET_NOMATCH	1
+#define MERGED_RET_MATCH	2
+
+/* conditional jumps have 8-bit offsets */
+#define MAX_JUMP_OFF		255
+
 struct filter {
 	bpf_filter_func_t func;
 	int gate;
@@ -1077,11 +1089,27 @@ struct filter {
 	size_t mmap_size;	/* needed for munmap() */
 	int priority;		/* higher number == higher priority */
 	char *exp;		/* original filter expression string */
+
+	struct bpf_insn *insns;	/* kept for merge_filters() */
+	u_int n_insns;
 };
 
 struct bpf_priv {
 	struct filter filters[MAX_FILTERS + 1];
 	int n_filters;
+	int prefetch_dist;
+
+	/* all filters in a single program. NULL if n_filters < 2 or 
+	 * the filters could not be merged */
+	bpf_filter_func_t merged_func;
+	size_t merged_mmap_size;
+	u_int merged_insns;
+	u_int merged_threaded;	/* jumps redirected by thread_jump() */
+
+	/* if not NULL, the module runs this eBPF program instead of the
+	 * classic filters. Its R0 is the output gate. */
+	struct ebpf_prog *ebpf;
+	uint64_t ebpf_faults;	/* bad memory accesses */
 };
 
 static int compare_filter(const void *filter1, const void *filter2)
@@ -1097,31 +1125,535 @@ static int compare_filter(const void *filter1, const void *filter2)
 		return 0;
 }
 
+/* An instruction of the merged program, with absolute jump targets */
+struct merged_insn {
+	struct bpf_insn insn;
+	u_int jt;		/* also for BPF_JA */
+	u_int jf;
+	int seg;		/* index of the filter it came from */
+};
+
+/* what the accumulator holds: the result of "ld{w,h,b} [k]" */
+struct acc_src {
+	int known;
+	uint16_t code;
+	uint32_t k;
+};
+
+static int is_cond_jump(const struct bpf_insn *ins)
+{
+	return BPF_CLASS(ins->code) == BPF_JMP && BPF_OP(ins->code) != BPF_JA;
+}
+
+static void acc_meet(struct acc_src *dst, int *visited, 
+		const struct acc_src *src)
+{
+	if (!*visited) {
+		*dst = *src;
+		*visited = 1;
+	} else if (dst->known && (!src->known || dst->code != src->code ||
+				dst->k != src->k))
+		dst->known = 0;
+}
+
+/* Computes what A holds when each instruction is entered.
+ * BPF only jumps forward, so a single pass in order suffices. */
+static void compute_acc_src(const struct merged_insn *prog, u_int n,
+		struct acc_src *in)
+{
+	int *visited = calloc(n, sizeof(int));
+
+	if (!visited) {
+		memset(in, 0, n * sizeof(*in));
+		return;
+	}
+
+	for (u_int i = 0; i < n; i++) {
+		const struct bpf_insn *ins = &prog[i].insn;
+		struct acc_src out;
+
+		if (!visited[i])	/* entry point, or unreachable */
+			in[i].known = 0;
+
+		out = in[i];
+
+		switch (BPF_CLASS(ins->code)) {
+		case BPF_LD:
+			out.known = BPF_MODE(ins->code) == BPF_ABS;
+			out.code = ins->code;
+			out.k = ins->k;
+			break;
+
+		case BPF_ALU:
+			out.known = 0;
+			break;
+
+		case BPF_MISC:
+			if (BPF_MISCOP(ins->code) == BPF_TXA)
+				out.known = 0;
+			break;
+		}
+
+		if (BPF_CLASS(ins->code) == BPF_RET)
+			continue;
+
+		if (BPF_CLASS(ins->code) != BPF_JMP) {
+			acc_meet(&in[i + 1], &visited[i + 1], &out);
+			continue;
+		}
+
+		acc_meet(&in[prog[i].jt], &visited[prog[i].jt], &out);
+		if (is_cond_jump(ins))
+			acc_meet(&in[prog[i].jf], &visited[prog[i].jf], &out);
+	}
+
+	free(visited);
+}
+
+/* Given that the test "op1 #k1" on A had the outcome o1, returns the
+ * outcome of "op2 #k2" on the same A (0 or 1), or -1 if unknown */
+static int implied_outcome(uint16_t op1, uint32_t k1, int o1,
+		uint16_t op2, uint32_t k2)
+{
+	if (op1 == op2 && k1 == k2)
+		return o1;
+
+	if (op1 == BPF_JEQ && o1) {
+		switch (op2) {
+		case BPF_JEQ:	return k1 == k2;
+		case BPF_JGT:	return k1 > k2;
+		case BPF_JGE:	return k1 >= k2;
+		case BPF_JSET:	return (k1 & k2) != 0;
+		}
+	}
+
+	if (op1 == BPF_JGT && o1) {
+		if (op2 == BPF_JEQ && k2 <= k1)
+			return 0;
+		if ((op2 == BPF_JGT || op2 == BPF_JGE) && k2 <= k1)
+			return 1;
+	}
+
+	return -1;
+}
+
+/* Follows the branch of the jump at i with outcome o, as far as the
+ * outcome of later instructions is known from the same test: reloading
+ * the same header field and testing it again (typically the ethertype or
+ * the IP protocol at the beginning of each filter) is skipped.
+ * Returns the new branch target. */
+static u_int thread_jump(const struct merged_insn *prog, u_int i, int o,
+		const struct acc_src *src)
+{
+	const struct bpf_insn *jmp = &prog[i].insn;
+	u_int pos = o ? prog[i].jt : prog[i].jf;
+
+	if (!src->known || BPF_SRC(jmp->code) != BPF_K)
+		return pos;
+
+	for (;;) {
+		const struct bpf_insn *ins = &prog[pos].insn;
+		int r;
+
+		if (ins->code == (BPF_JMP | BPF_JA)) {
+			pos = prog[pos].jt;
+			continue;
+		}
+
+		/* A does not change, nor the bounds check result */
+		if (ins->code == src->code && ins->k == src->k) {
+			pos++;
+			continue;
+		}
+
+		if (!is_cond_jump(ins) || BPF_SRC(ins->code) != BPF_K)
+			break;
+
+		r = implied_outcome(BPF_OP(jmp->code), jmp->k, o,
+				BPF_OP(ins->code), ins->k);
+		if (r < 0)
+			break;
+
+		pos = r ? prog[pos].jt : prog[pos].jf;
+	}
+
+	return pos;
+}
+
+/* Concatenates all filters (in priority order) into one program.
+ * "ret #0" of filter i continues with filter i + 1, and "ret #k" returns
+ * MERGED_RET_MATCH + i. Then jumps are threaded across filters with
+ * thread_jump(), so that tests shared by consecutive filters (e.g., "ip"
+ * or "tcp") are done once and a packet skips the filters that cannot
+ * match, making the cost much less dependent on the number of filters.
+ *
+ * Since conditional jumps are limited to MAX_JUMP_OFF, a jump threaded
+ * into another filter goes through a trampoline (a "ja", which has a
+ * 32-bit offset) placed right after its own filter. */
+static void merge_filters(struct bpf_priv *priv)
+{
+	const int n_filters = priv->n_filters;
+
+	struct merged_insn *prog = NULL;
+	struct acc_src *src = NULL;
+	struct bpf_insn *out = NULL;
+
+	u_int seg_base[MAX_FILTERS + 1];
+	u_int tramp_base[MAX_FILTERS + 1];
+	u_int *tramp_target = NULL;	/* per segment, in order */
+	int *tramp_seg = NULL;
+	u_int n_tramps = 0;
+
+	u_int n = 0;
+	u_int threaded = 0;
+
+	if (priv->merged_func) {
+		munmap(priv->merged_func, priv->merged_mmap_size);
+		priv->merged_func = NULL;
+		priv->merged_insns = 0;
+		priv->merged_threaded = 0;
+	}
+
+	if (n_filters < 2)
+		return;
+
+	for (int s = 0; s < n_filters; s++) {
+		seg_base[s] = n;
+		n += priv->filters[s].n_insns;
+	}
+	seg_base[n_filters] = n;
+
+	prog = malloc(n * sizeof(*prog));
+	src = malloc(n * sizeof(*src));
+	/* at most two trampolines per instruction */
+	tramp_target = malloc(n * 2 * sizeof(*tramp_target));
+	tramp_seg = malloc(n * 2 * sizeof(*tramp_seg));
+	if (!prog || !src || !tramp_target || !tramp_seg)
+		goto out;
+
+	for (int s = 0; s < n_filters; s++) {
+		const struct filter *f = &priv->filters[s];
+
+		for (u_int j = 0; j < f->n_insns; j++) {
+			struct merged_insn *mi = &prog[seg_base[s] + j];
+			u_int next = seg_base[s] + j + 1;
+
+			mi->insn = f->insns[j];
+			mi->seg = s;
+			mi->jt = mi->jf = 0;
+
+			switch (BPF_CLASS(mi->insn.code)) {
+			case BPF_RET:
+				if (BPF_RVAL(mi->insn.code) != BPF_K)
+					goto out;	/* "ret a" */
+
+				if (mi->insn.k) {
+					mi->insn.k = MERGED_RET_MATCH + s;
+				} else if (s == n_filters - 1) {
+					mi->insn.k = MERGED_RET_NOMATCH;
+				} else {
+					mi->insn = (struct bpf_insn)
+						BPF_STMT(BPF_JMP | BPF_JA, 0);
+					mi->jt = seg_base[s + 1];
+				}
+				break;
+
+			case BPF_JMP:
+				if (BPF_OP(mi->insn.code) == BPF_JA) {
+					mi->jt = next + mi->insn.k;
+				} else {
+					mi->jt = next + mi->insn.jt;
+					mi->jf = next + mi->insn.jf;
+				}
+				break;
+			}
+		}
+	}
+
+	compute_acc_src(prog, n, src);
+
+	for (int s = 0; s < n_filters; s++) {
+		tramp_base[s] = n_tramps;
+
+		for (u_int i = seg_base[s]; i < seg_base[s + 1]; i++) {
+			u_int *targets[2] = {&prog[i].jf, &prog[i].jt};
+
+			if (!is_cond_jump(&prog[i].insn))
+				continue;
+
+			for (int o = 0; o < 2; o++) {
+				u_int t = thread_jump(prog, i, o, &src[i]);
+				u_int k;
+
+				if (t == *targets[o])
+					continue;
+
+				if (t < seg_base[s + 1]) {
+					if (t - i - 1 > MAX_JUMP_OFF)
+						continue;
+					*targets[o] = t;
+					threaded++;
+					continue;
+				}
+
+				for (k = tramp_base[s]; k < n_tramps; k++)
+					if (tramp_target[k] == t)
+						break;
+
+				/* the trampoline is at seg_base[s + 1] + 
+				 * (k - tramp_base[s]), before relocation */
+				if (seg_base[s + 1] + k - tramp_base[s] - 
+						i - 1 > MAX_JUMP_OFF)
+					continue;
+
+				if (k == n_tramps) {
+					tramp_target[n_tramps] = t;
+					tramp_seg[n_tramps] = s;
+					n_tramps++;
+				}
+
+				/* encoded as n + k, resolved below */
+				*targets[o] = n + k;
+				threaded++;
+			}
+		}
+	}
+	tramp_base[n_filters] = n_tramps;
+
+	out = malloc((n + n_tramps) * sizeof(*out));
+	if (!out)
+		goto out;
+
+/* the final position of an absolute target t. The trampolines of each
+ * segment follow its last instruction */
+#define RELOC(t) ((t) >= n ?						\
+		seg_base[tramp_seg[(t) - n] + 1] + (t) - n :		\
+		(t) + tramp_base[prog[(t)].seg])
+
+	for (u_int i = 0; i < n; i++) {
+		struct bpf_insn *ins = &out[RELOC(i)];
+		u_int next = RELOC(i) + 1;
+
+		*ins = prog[i].insn;
+
+		if (BPF_CLASS(ins->code) != BPF_JMP)
+			continue;
+
+		if (BPF_OP(ins->code) == BPF_JA) {
+			ins->k = RELOC(prog[i].jt) - next;
+		} else {
+			ins->jt = RELOC(prog[i].jt) - next;
+			ins->jf = RELOC(prog[i].jf) - next;
+		}
+	}
+
+	for (u_int k = 0; k < n_tramps; k++) {
+		u_int pos = RELOC(n + k);
+
+		out[pos] = (struct bpf_insn)BPF_STMT(BPF_JMP | BPF_JA, 0);
+		out[pos].k = RELOC(tramp_target[k]) - (pos + 1);
+	}
+
+#undef RELOC
+
+	priv->merged_func = bpf_jit_compile(out, n + n_tramps,
+			&priv->merged_mmap_size);
+	if (priv->merged_func) {
+		priv->merged_insns = n + n_tramps;
+		priv->merged_threaded = threaded;
+	}
+
+out:
+	free(prog);
+	free(src);
+	free(tramp_target);
+	free(tramp_seg);
+	free(out);
+}
+
 static struct snobj *
 command_add(struct module *m, const char *cmd, struct snobj *arg);
 
-static struct snobj *bpf_init(struct module *m, struct snobj *arg)
+static struct snobj *parse_ebpf_attr(struct module *m, 
+		struct ebpf_attr *attr, struct snobj *a)
 {
-	return arg ? command_add(m, NULL, arg) : NULL;
+	enum mt_access_mode mode;
+	const char *name;
+	const char *mode_str;
+	int size;
+	int ret;
+
+	if (snobj_type(a) != TYPE_MAP)
+		return snobj_err(EINVAL, "Each metadata attribute must be a "
+				"map of 'name', 'size', and 'mode'");
+
+	name = snobj_eval_str(a, "name");
+	size = snobj_eval_int(a, "size");
+	mode_str = snobj_eval_str(a, "mode");
+
+	if (!name || !mode_str)
+		return snobj_err(EINVAL, "Missing 'name' or 'mode'");
+
+	if (strcmp(mode_str, "read") == 0)
+		mode = MT_READ;
+	else if (strcmp(mode_str, "write") == 0)
+		mode = MT_WRITE;
+	else if (strcmp(mode_str, "update") == 0)
+		mode = MT_UPDATE;
+	else
+		return snobj_err(EINVAL, "'mode' must be 'read', 'write', "
+				"or 'update'");
+
+	/* the module has no other attributes, so the IDs are the same 
+	 * as the indices for the program */
+	ret = add_metadata_attr(m, name, size, mode);
+	if (ret < 0)
+		return snobj_errno(-ret);
+
+	attr->size = size;
+	attr->writable = (mode != MT_READ);
+
+	return NULL;
 }
 
-static void bpf_deinit(struct module *m)
+/* picks the process_batch for the current filters, 
+ * so that it doesn't have to check them for every batch */
+static void update_variant(struct module *m)
 {
 	struct bpf_priv *priv = get_priv(m);
+	const char *variant = NULL;	/* two or more filters */
+
+	if (priv->ebpf)
+		variant = "ebpf";
+	else if (priv->n_filters == 0)
+		variant = "none";
+	else if (priv->n_filters == 1)
+		variant = "1filter";
+
+	select_variant(m, variant);
+}
+
+/* {"ebpf": <code (blob)>, 
+ *  "maps": [<number of entries>, ...],
+ *  "metadata": [{"name": .., "size": .., "mode": "read"/"write"/"update"}]}
+ * Map i and attribute i are referred to as i by the program (see ebpf.h) */
+static struct snobj *init_ebpf(struct module *m, struct snobj *arg)
+{
+	struct bpf_priv *priv = get_priv(m);
+	struct ebpf_prog *prog;
+
+	struct snobj *code = snobj_eval(arg, "ebpf");
+	struct snobj *maps = snobj_eval(arg, "maps");
+	struct snobj *attrs = snobj_eval(arg, "metadata");
+	struct snobj *err;
+
+	/* to drop the attributes added by parse_ebpf_attr() on failure */
+	const int num_attrs = m->num_attrs;
+
+	if (snobj_type(code) != TYPE_BLOB)
+		return snobj_err(EINVAL, "'ebpf' must be a blob of eBPF "
+				"instructions");
+
+	if (maps && (snobj_type(maps) != TYPE_LIST || 
+				maps->size > EBPF_MAX_MAPS))
+		return snobj_err(EINVAL, "'maps' must be a list of up to %d "
+				"map sizes", EBPF_MAX_MAPS);
+
+	if (attrs && (snobj_type(attrs) != TYPE_LIST ||
+				attrs->size > MAX_ATTRS_PER_MODULE))
+		return snobj_err(EINVAL, "'metadata' must be a list of up to "
+				"%d attributes", MAX_ATTRS_PER_MODULE);
+
+	prog = calloc(1, sizeof(*prog));
+	if (!prog)
+		return snobj_errno(ENOMEM);
+
+	for (int i = 0; maps && i < maps->size; i++) {
+		int64_t n_entries = snobj_int_get(snobj_list_get(maps, i));
+
+		if (n_entries <= 0 || n_entries > EBPF_MAX_MAP_ENTRIES) {
+			free(prog);
+			return snobj_err(EINVAL, "Map size must be between "
+					"1 and %d", EBPF_MAX_MAP_ENTRIES);
+		}
+
+		prog->maps[prog->n_maps++].n_entries = n_entries;
+	}
+
+	for (int i = 0; attrs && i < attrs->size; i++) {
+		err = parse_ebpf_attr(m, &prog->attrs[prog->n_attrs], 
+				snobj_list_get(attrs, i));
+		if (err) {
+			m->num_attrs = num_attrs;
+			free(prog);
+			return err;
+		}
 
+		prog->n_attrs++;
+	}
+
+	err = ebpf_load(prog, snobj_blob_get(code), snobj_size(code));
+	if (err) {
+		m->num_attrs = num_attrs;
+		ebpf_unload(prog);
+		free(prog);
+		return err;
+	}
+
+	priv->ebpf = prog;
+	update_variant(m);
+
+	return NULL;
+}
+
+static struct snobj *bpf_init(struct module *m, struct snobj *arg)
+{
+	struct bpf_priv *priv = get_priv(m);
+
+	/* the argument is the list of filters, or an eBPF program 
+	 * (see init_ebpf()). use "set_prefetch" to tune */
+	priv->prefetch_dist = SNB_PREFETCH_DIST_DEFAULT;
+
+	if (arg && snobj_type(arg) == TYPE_MAP && 
+			snobj_eval_exists(arg, "ebpf"))
+		return init_ebpf(m, arg);
+
+	if (!arg) {
+		update_variant(m);
+		return NULL;
+	}
+
+	return command_add(m, NULL, arg);
+}
+
+static void clear_filters(struct bpf_priv *priv)
+{
 	for (int i = 0; i < priv->n_filters; i++) {
 		munmap(priv->filters[i].func, 
 				priv->filters[i].mmap_size);
 		free(priv->filters[i].exp);
+		free(priv->filters[i].insns);
 	}
 
 	priv->n_filters = 0;
+	merge_filters(priv);
 }
 
-static struct snobj *
-command_add(struct module *m, const char *cmd, struct snobj *arg)
+static void bpf_deinit(struct module *m)
 {
 	struct bpf_priv *priv = get_priv(m);
+
+	clear_filters(priv);
+
+	if (priv->ebpf) {
+		ebpf_unload(priv->ebpf);
+		free(priv->ebpf);
+		priv->ebpf = NULL;
+	}
+}
+
+static struct snobj *add_filters(struct bpf_priv *priv, struct snobj *arg)
+{
 	struct filter *filter;
 
 	if (snobj_type(arg) != TYPE_LIST)
@@ -1175,10 +1707,19 @@ command_add(struct module *m, const char *cmd, struct snobj *arg)
 		filter->func = bpf_jit_compile(il_code.bf_insns, il_code.bf_len,
 				&filter->mmap_size);
 
+		filter->n_insns = il_code.bf_len;
+		filter->insns = malloc(il_code.bf_len * sizeof(struct bpf_insn));
+		if (filter->insns)
+			memcpy(filter->insns, il_code.bf_insns, 
+					il_code.bf_len * sizeof(struct bpf_insn));
+
 		pcap_freecode(&il_code);
 
-		if (!filter->func) {
-			free(exp);
+		if (!filter->func || !filter->insns) {
+			if (filter->func)
+				munmap(filter->func, filter->mmap_size);
+			free(filter->exp);
+			free(filter->insns);
 			return snobj_err(ENOMEM, "BPF JIT compilation error");
 		}
 
@@ -1192,10 +1733,30 @@ command_add(struct module *m, const char *cmd, struct snobj *arg)
 	return NULL;
 }
 
+static struct snobj *
+command_add(struct module *m, const char *cmd, struct snobj *arg)
+{
+	struct bpf_priv *priv = get_priv(m);
+	struct snobj *err;
+
+	if (priv->ebpf)
+		return snobj_err(EINVAL, "Filters cannot be added to an eBPF "
+				"program");
+
+	err = add_filters(priv, arg);
+
+	/* also if only some of them were added */
+	merge_filters(priv);
+	update_variant(m);
+
+	return err;
+}
+
 static struct snobj *
 command_clear(struct module *m, const char *cmd, struct snobj *arg)
 {
-	bpf_deinit(m);
+	clear_filters(get_priv(m));
+	update_variant(m);
 	return NULL;
 }
 
@@ -1203,8 +1764,13 @@ static struct snobj *bpf_get_desc(const struct module *m)
 {
 	const struct bpf_priv *priv = get_priv_const(m);
 
-	if (priv->n_filters == 1)
+	if (priv->ebpf)
+		return snobj_str_fmt("eBPF, %d insns", priv->ebpf->n_insns);
+	else if (priv->n_filters == 1)
 		return snobj_str(priv->filters[0].exp);
+	else if (priv->merged_func)
+		return snobj_str_fmt("%d filters (merged, %u insns)", 
+				priv->n_filters, priv->merged_insns);
 	else
 		return snobj_str_fmt("%d filters", priv->n_filters);
 }
@@ -1222,12 +1788,17 @@ bpf_process_batch_1filter(struct module *m, struct pkt_batch *batch)
 	ptrs[1] = (struct snbuf **)&out_batches[1].pkts;
 
 	int cnt = batch->cnt;
+	int dist = priv->prefetch_dist;
+
+	snb_prefetch_start(batch, dist);
 
 	for (int i = 0; i < cnt; i++) {
 		struct snbuf *pkt = batch->pkts[i];
 		int ret;
 		int idx;
 
+		snb_prefetch_ahead(batch, i, dist);
+
 		ret = filter->func((uint8_t *)snb_head_data(pkt),
 				       snb_total_len(pkt),
 				       snb_head_len(pkt));
@@ -1247,32 +1818,105 @@ bpf_process_batch_1filter(struct module *m, struct pkt_batch *batch)
 		run_choose_module(m, filter->gate, &out_batches[1]);
 }
 
-static void bpf_process_batch(struct module *m, struct pkt_batch *batch)
+/* R0 is the output gate. Packets are dropped if it is out of range,
+ * or if the program made a bad memory access */
+static void bpf_process_batch_ebpf(struct module *m, struct pkt_batch *batch)
 {
 	struct bpf_priv *priv = get_priv(m);
+	const struct ebpf_prog *prog = priv->ebpf;
 
 	gate_idx_t ogates[MAX_PKT_BURST];
-	int n_filters = priv->n_filters;
-	int cnt;
+	struct snbuf *drop[MAX_PKT_BURST];
+	int n_drop = 0;
+	int n_faults = 0;
+	int cnt = batch->cnt;
+	int dist = priv->prefetch_dist;
+	int n = 0;
 
-	if (n_filters == 0) {
-		run_next_module(m, batch);
-		return;
+	snb_prefetch_start(batch, dist);
+
+	for (int i = 0; i < cnt; i++) {
+		struct snbuf *pkt = batch->pkts[i];
+		struct ebpf_ctx ectx;
+		uint64_t ret;
+		int fault = 0;
+
+		snb_prefetch_ahead(batch, i, dist);
+
+		ectx.data = (uintptr_t)snb_head_data(pkt);
+		ectx.data_end = ectx.data + snb_head_len(pkt);
+		ectx.len = snb_total_len(pkt);
+		ectx.head_len = snb_head_len(pkt);
+		ectx.metadata = (uintptr_t)pkt->_metadata_buf;
+
+		ret = ebpf_run(prog, &ectx, m->attr_offsets, &fault);
+
+		if (unlikely(fault || ret >= MAX_GATES)) {
+			n_faults += fault;
+			drop[n_drop++] = pkt;
+			continue;
+		}
+
+		batch->pkts[n] = pkt;
+		ogates[n] = ret;
+		n++;
 	}
 
-	if (n_filters == 1) {
-		bpf_process_batch_1filter(m, batch);
-		return;
+	if (unlikely(n_drop)) {
+		snb_free_bulk(drop, n_drop);
+		count_drops(m, DROP_FILTER, n_drop - n_faults);
+		if (n_faults) {
+			count_drops(m, DROP_INVALID, n_faults);
+			__sync_fetch_and_add(&priv->ebpf_faults, n_faults);
+		}
 	}
 
+	batch->cnt = n;
+	run_split(m, ogates, batch);
+}
+
+static void bpf_process_batch_none(struct module *m, struct pkt_batch *batch)
+{
+	run_next_module(m, batch);
+}
+
+/* two or more filters. See update_variant() for the others */
+static void bpf_process_batch(struct module *m, struct pkt_batch *batch)
+{
+	struct bpf_priv *priv = get_priv(m);
+
+	gate_idx_t ogates[MAX_PKT_BURST];
+	int n_filters = priv->n_filters;
+	int dist = priv->prefetch_dist;
+	int cnt;
+
 	cnt = batch->cnt;
 
-	/* slow version for general cases */
+	snb_prefetch_start(batch, dist);
+
 	for (int i = 0; i < cnt; i++) {
 		struct snbuf *pkt = batch->pkts[i];
 		struct filter *filter = &priv->filters[0];
 		gate_idx_t gate = 0;	/* default gate for unmatched pkts */
 
+		snb_prefetch_ahead(batch, i, dist);
+
+		if (likely(priv->merged_func)) {
+			u_int ret = priv->merged_func(
+					(uint8_t *)snb_head_data(pkt),
+					snb_total_len(pkt),
+					snb_head_len(pkt));
+
+			if (likely(ret != MERGED_RET_OOB)) {
+				if (ret != MERGED_RET_NOMATCH)
+					gate = priv->filters[ret - 
+						MERGED_RET_MATCH].gate;
+				ogates[i] = gate;
+				continue;
+			}
+		}
+
+		/* slow version for general cases */
 		for (int j = 0; j < n_filters; j++, filter++) {
 			if (filter->func((uint8_t *)snb_head_data(pkt),
 				       snb_total_len(pkt),
@@ -1289,6 +1933,153 @@ static void bpf_process_batch(struct module *m, struct pkt_batch *batch)
 	run_split(m, ogates, batch);
 }
 
+static struct snobj *
+command_set_prefetch(struct module *m, const char *cmd, struct snobj *arg)
+{
+	struct bpf_priv *priv = get_priv(m);
+
+	return get_prefetch_dist(arg, &priv->prefetch_dist);
+}
+
+static struct ebpf_map *get_ebpf_map(struct bpf_priv *priv, 
+		struct snobj *arg, struct snobj **err)
+{
+	int64_t map_id;
+
+	*err = NULL;
+
+	if (!priv->ebpf) {
+		*err = snobj_err(EINVAL, "No eBPF program is loaded");
+		return NULL;
+	}
+
+	map_id = snobj_eval_int(arg, "map");
+	if (map_id < 0 || map_id >= priv->ebpf->n_maps) {
+		*err = snobj_err(EINVAL, "Invalid 'map'");
+		return NULL;
+	}
+
+	return &priv->ebpf->maps[map_id];
+}
+
+/* {"map": <index>, "key": <index>} returns the value.
+ * Without "key", returns the list of all values. */
+static struct snobj *
+command_get_map(struct module *m, const char *cmd, struct snobj *arg)
+{
+	struct ebpf_map *map;
+	struct snobj *err;
+	struct snobj *r;
+	int64_t key;
+
+	map = get_ebpf_map(get_priv(m), arg, &err);
+	if (!map)
+		return err;
+
+	if (!snobj_eval_exists(arg, "key")) {
+		r = snobj_list();
+		for (uint32_t i = 0; i < map->n_entries; i++)
+			snobj_list_add(r, snobj_uint(map->values[i]));
+		return r;
+	}
+
+	key = snobj_eval_int(arg, "key");
+	if (key < 0 || key >= map->n_entries)
+		return snobj_err(EINVAL, "Invalid 'key'");
+
+	return snobj_uint(map->values[key]);
+}
+
+/* {"map": <index>, "key": <index>, "value": <uint64>} */
+static struct snobj *
+command_set_map(struct module *m, const char *cmd, struct snobj *arg)
+{
+	struct ebpf_map *map;
+	struct snobj *err;
+	int64_t key;
+
+	map = get_ebpf_map(get_priv(m), arg, &err);
+	if (!map)
+		return err;
+
+	key = snobj_eval_int(arg, "key");
+	if (key < 0 || key >= map->n_entries)
+		return snobj_err(EINVAL, "Invalid 'key'");
+
+	if (!snobj_eval_exists(arg, "value"))
+		return snobj_err(EINVAL, "Missing 'value'");
+
+	map->values[key] = snobj_eval_uint(arg, "value");
+
+	return NULL;
+}
+
+static struct snobj *
+command_get_ebpf_faults(struct module *m, const char *cmd, struct snobj *arg)
+{
+	struct bpf_priv *priv = get_priv(m);
+
+	return snobj_uint(priv->ebpf_faults);
+}
+
+/* The eBPF program comes from the init argument, but not its map values.
+ * Classic filters may have been given with the init argument too, so
+ * they are cleared first */
+static struct snobj *bpf_get_snapshot(const struct module *m)
+{
+	const struct bpf_priv *priv = get_priv_const(m);
+	struct snobj *cmds = snobj_list();
+	struct snobj *cmd;
+
+	if (priv->ebpf) {
+		for (int i = 0; i < priv->ebpf->n_maps; i++) {
+			const struct ebpf_map *map = &priv->ebpf->maps[i];
+
+			for (uint32_t key = 0; key < map->n_entries; key++) {
+				struct snobj *arg;
+
+				if (!map->values[key])
+					continue;
+
+				arg = snobj_map();
+				snobj_map_set(arg, "map", snobj_int(i));
+				snobj_map_set(arg, "key", snobj_uint(key));
+				snobj_map_set(arg, "value",
+						snobj_uint(map->values[key]));
+
+				cmd = snobj_map();
+				snobj_map_set(cmd, "cmd", snobj_str("set_map"));
+				snobj_map_set(cmd, "arg", arg);
+				snobj_list_add(cmds, cmd);
+			}
+		}
+	} else {
+		struct snobj *filters = snobj_list();
+
+		for (int i = 0; i < priv->n_filters; i++) {
+			const struct filter *f = &priv->filters[i];
+			struct snobj *filter = snobj_map();
+
+			snobj_map_set(filter, "priority",
+					snobj_int(f->priority));
+			snobj_map_set(filter, "filter", snobj_str(f->exp));
+			snobj_map_set(filter, "gate", snobj_int(f->gate));
+			snobj_list_add(filters, filter);
+		}
+
+		cmd = snobj_map();
+		snobj_map_set(cmd, "cmd", snobj_str("clear"));
+		snobj_list_add(cmds, cmd);
+
+		cmd = snobj_map();
+		snobj_map_set(cmd, "cmd", snobj_str("add"));
+		snobj_map_set(cmd, "arg", filters);
+		snobj_list_add(cmds, cmd);
+	}
+
+	return cmds;
+}
+
 static const struct mclass bpf = {
 	.name 		= "BPF",
 	.help		= "classifies packets with pcap-filter(7) syntax",
@@ -1298,10 +2089,20 @@ static const struct mclass bpf = {
 	.init 		= bpf_init,
 	.deinit 	= bpf_deinit,
 	.get_desc	= bpf_get_desc,
+	.get_snapshot	= bpf_get_snapshot,
 	.process_batch  = bpf_process_batch,
+	.variants	= {
+		{"none", 	bpf_process_batch_none},
+		{"1filter", 	bpf_process_batch_1filter},
+		{"ebpf", 	bpf_process_batch_ebpf},
+	},
 	.commands	 = {
 		{"add", 	command_add},
 		{"clear", 	command_clear},
+		{"set_prefetch",command_set_prefetch, .mt_safe=1},
+		{"get_map",	command_get_map, .mt_safe=1},
+		{"set_map",	command_set_map, .mt_safe=1},
+		{"get_ebpf_faults", command_get_ebpf_faults, .mt_safe=1},
 	}
 };
 
@@ -1,46 +1,119 @@
 #include "../module.h"
+#include "../time.h"
+#include "../timer.h"
 
-/* TODO: timer-triggered flush */
 struct buffer_priv {
+	int size;		/* flush when this many packets are buffered */
+	uint64_t max_delay_ns;	/* flush partial batches after this (0=never) */
+};
+
+/* packets are buffered per worker, and flushed by the same worker */
+struct buffer_worker {
 	struct pkt_batch buf;
+	struct timer timer;	/* armed while buf is not empty */
 };
 
-static void buffer_deinit(struct module *m)
+static void buffer_timeout(struct timer *t)
+{
+	struct module *m = t->arg;
+	struct buffer_worker *w = get_priv_worker(m);
+	struct pkt_batch *buf = &w->buf;
+
+	if (buf->cnt) {
+		run_next_module(m, buf);
+		batch_clear(buf);
+	}
+}
+
+static struct snobj *buffer_init(struct module *m, struct snobj *arg)
 {
 	struct buffer_priv *priv = get_priv(m);
-	struct pkt_batch *buf = &priv->buf;
+	struct buffer_worker *w;
+	int wid;
+
+	priv->size = MAX_PKT_BURST;
+
+	if (arg && snobj_eval(arg, "size")) {
+		int size = snobj_eval_int(arg, "size");
+
+		if (size < 1 || size > MAX_PKT_BURST)
+			return snobj_err(EINVAL, "'size' must be between "
+					"1 and %d", MAX_PKT_BURST);
+
+		priv->size = size;
+	}
+
+	if (arg && snobj_eval(arg, "max_delay")) {
+		int64_t max_delay = snobj_eval_int(arg, "max_delay");
+
+		if (max_delay < 0)
+			return snobj_err(EINVAL, "'max_delay' (us) must be "
+					"non-negative");
 
-	if (buf->cnt)
+		priv->max_delay_ns = max_delay * 1000;
+	}
+
+	for_each_priv_worker(m, wid, w)
+		timer_init(&w->timer, buffer_timeout, m);
+
+	return NULL;
+}
+
+/* the timer lives in the wheel of the worker */
+static void buffer_deinit_worker(struct module *m, int wid)
+{
+	struct buffer_worker *w = get_priv_worker_by_wid(m, wid);
+	struct pkt_batch *buf = &w->buf;
+
+	timer_cancel(&w->timer);
+
+	if (buf->cnt) {
 		snb_free_bulk(buf->pkts, buf->cnt);
+		batch_clear(buf);
+	}
 }
 
 static void buffer_process_batch(struct module *m, struct pkt_batch *batch)
 {
 	struct buffer_priv *priv = get_priv(m);
-	struct pkt_batch *buf = &priv->buf;
+	struct buffer_worker *w = get_priv_worker(m);
+	struct pkt_batch *buf = &w->buf;
 
-	int free_slots = MAX_PKT_BURST - buf->cnt;
+	const int size = priv->size;
+
+	int free_slots = size - buf->cnt;
 	int left = batch->cnt;
 
 	snb_array_t p_buf = &buf->pkts[buf->cnt];
 	snb_array_t p_batch = &batch->pkts[0];
 
+	/* a smaller size may leave more than one batch worth of packets */
 	if (left >= free_slots) {
-		buf->cnt = MAX_PKT_BURST;
-		rte_memcpy((void *)p_buf, (void *)p_batch, 
-				free_slots * sizeof(struct snbuf *));
+		timer_cancel(&w->timer);
 
-		p_buf = &buf->pkts[0];
-		p_batch += free_slots;
-		left -= free_slots;
+		do {
+			buf->cnt = size;
+			rte_memcpy((void *)p_buf, (void *)p_batch, 
+					free_slots * sizeof(struct snbuf *));
 
-		run_next_module(m, buf);
-		batch_clear(buf);
+			p_buf = &buf->pkts[0];
+			p_batch += free_slots;
+			left -= free_slots;
+
+			run_next_module(m, buf);
+			batch_clear(buf);
+
+			free_slots = size;
+		} while (left >= free_slots);
 	}
 
 	buf->cnt += left;
 	rte_memcpy((void *)p_buf, (void *)p_batch, 
 			left * sizeof(struct snbuf *));
+
+	/* the deadline is set by the oldest packet in the buffer */
+	if (priv->max_delay_ns && buf->cnt && !timer_is_armed(&w->timer))
+		timer_arm_ns(&w->timer, priv->max_delay_ns);
 }
 
 static const struct mclass buffer = {
@@ -49,7 +122,9 @@ static const struct mclass buffer = {
 	.num_igates	= 1,
 	.num_ogates	= 1,
 	.priv_size 	= sizeof(struct buffer_priv),
-	.deinit		= buffer_deinit,
+	.priv_worker_size = sizeof(struct buffer_worker),
+	.init		= buffer_init,
+	.deinit_worker	= buffer_deinit_worker,
 	.process_batch  = buffer_process_batch,
 };
 
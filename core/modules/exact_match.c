@@ -0,0 +1,763 @@
+#include <rte_hash_crc.h>
+#include <rte_prefetch.h>
+
+#include "../module.h"
+
+/* Exact-match classifier on arbitrary header fields (e.g., the 5-tuple).
+ *
+ * The key is the concatenation of configured fields (offset/size/mask),
+ * up to EM_MAX_KEY_SIZE bytes. As with L2Forward, the table is a cuckoo
+ * hash with two candidate buckets of EM_BUCKET_SIZE slots per key. Buckets
+ * hold 32-bit signatures (compared with SIMD) and gates only, so they pack
+ * two per cache line; the keys and values are kept in a separate array and
+ * touched only for signature matches. */
+
+#define EM_MAX_FIELDS		8
+#define EM_MAX_FIELD_SIZE	16
+#define EM_MAX_KEY_SIZE		32
+#define EM_MAX_KEY_WORDS	(EM_MAX_KEY_SIZE / 8)
+
+#define EM_BUCKET_SIZE		4
+#define EM_DEFAULT_SIZE		(1 << 20)	/* entries */
+#define EM_MAX_SIZE		(1 << 26)
+
+/* bounds the search for a cuckoo path (buckets visited) */
+#define EM_BFS_MAX_NODES	256
+
+#define EM_SIG_EMPTY		0
+#define EM_NOT_FOUND		UINT32_MAX
+
+struct em_bucket {
+	uint32_t sig[EM_BUCKET_SIZE];	/* EM_SIG_EMPTY if not occupied */
+	gate_idx_t gate[EM_BUCKET_SIZE];
+	uint16_t pad[EM_BUCKET_SIZE];
+} __attribute__((aligned(32)));
+
+struct em_field {
+	int16_t offset;		/* in the packet */
+	uint8_t size;		/* in bytes */
+	uint8_t pos;		/* in the key */
+};
+
+struct exact_match_priv {
+	int num_fields;
+	struct em_field fields[EM_MAX_FIELDS];
+	int key_size;
+	int key_words;
+	int min_len;		/* shorter packets do not match anything */
+	uint64_t key_mask[EM_MAX_KEY_WORDS];
+
+	struct em_bucket *buckets;
+	uint64_t *records;	/* rec_words per slot */
+	int rec_words;
+	uint32_t bucket_mask;	/* number of buckets - 1 */
+	uint32_t count;
+
+	gate_idx_t default_gate;
+	uint64_t default_value;
+
+	int value_attr;		/* -1 if values are not written */
+	int value_size;
+};
+
+static inline uint32_t em_hash(const struct exact_match_priv *priv,
+		const uint64_t *key)
+{
+	uint32_t hash = 0;
+
+	for (int i = 0; i < priv->key_words; i++)
+		hash = rte_hash_crc_8byte(key[i], hash);
+
+	return hash ? : 1;	/* EM_SIG_EMPTY is reserved */
+}
+
+static inline uint32_t em_primary(const struct exact_match_priv *priv,
+		uint32_t sig)
+{
+	return sig & priv->bucket_mask;
+}
+
+/* Both candidates can be derived from the other and the signature, so
+ * entries can be moved without their keys */
+static inline uint32_t em_alt(const struct exact_match_priv *priv,
+		uint32_t bucket, uint32_t sig)
+{
+	uint32_t tag = ((sig >> 16) | (sig << 16)) * 0x5bd1e995;
+
+	return (bucket ^ tag) & priv->bucket_mask;
+}
+
+static inline uint64_t *em_rec(const struct exact_match_priv *priv,
+		uint32_t slot)
+{
+	return priv->records + (uint64_t)slot * priv->rec_words;
+}
+
+/* bitmap of the slots in the bucket with the signature */
+static inline int em_match_sig(const struct em_bucket *b, uint32_t sig)
+{
+	__m128i sigs = _mm_load_si128((const __m128i *)b->sig);
+	__m128i cmp = _mm_cmpeq_epi32(sigs, _mm_set1_epi32(sig));
+
+	return _mm_movemask_ps(_mm_castsi128_ps(cmp));
+}
+
+static inline int em_key_eq(const struct exact_match_priv *priv,
+		const uint64_t *rec, const uint64_t *key)
+{
+	uint64_t diff = 0;
+
+	for (int i = 0; i < priv->key_words; i++)
+		diff |= rec[i] ^ key[i];
+
+	return !diff;
+}
+
+static inline uint32_t em_find_in_bucket(const struct exact_match_priv *priv,
+		uint32_t bucket, uint32_t sig, const uint64_t *key)
+{
+	int hits = em_match_sig(&priv->buckets[bucket], sig);
+
+	while (hits) {
+		int i = __builtin_ctz(hits);
+		uint32_t slot = bucket * EM_BUCKET_SIZE + i;
+
+		if (em_key_eq(priv, em_rec(priv, slot), key))
+			return slot;
+
+		hits &= hits - 1;
+	}
+
+	return EM_NOT_FOUND;
+}
+
+static uint32_t em_find(const struct exact_match_priv *priv,
+		const uint64_t *key)
+{
+	uint32_t sig = em_hash(priv, key);
+	uint32_t b1 = em_primary(priv, sig);
+	uint32_t slot;
+
+	slot = em_find_in_bucket(priv, b1, sig, key);
+	if (slot != EM_NOT_FOUND)
+		return slot;
+
+	return em_find_in_bucket(priv, em_alt(priv, b1, sig), sig, key);
+}
+
+static int em_free_slot(const struct exact_match_priv *priv, uint32_t bucket)
+{
+	int empty = em_match_sig(&priv->buckets[bucket], EM_SIG_EMPTY);
+
+	return empty ? __builtin_ctz(empty) : -1;
+}
+
+/* The destination is written before the source is cleared, so concurrent
+ * lookups always find the entry in one of the two */
+static void em_move(struct exact_match_priv *priv,
+		uint32_t from_bucket, int from, uint32_t to_bucket, int to)
+{
+	struct em_bucket *src = &priv->buckets[from_bucket];
+	struct em_bucket *dst = &priv->buckets[to_bucket];
+
+	rte_memcpy(em_rec(priv, to_bucket * EM_BUCKET_SIZE + to),
+			em_rec(priv, from_bucket * EM_BUCKET_SIZE + from),
+			priv->rec_words * sizeof(uint64_t));
+	dst->gate[to] = src->gate[from];
+
+	STORE_BARRIER();
+	dst->sig[to] = src->sig[from];
+	STORE_BARRIER();
+	src->sig[from] = EM_SIG_EMPTY;
+}
+
+struct em_bfs_node {
+	uint32_t bucket;
+	int16_t parent;		/* -1 for the two candidates of the new key */
+	int8_t slot;		/* in the parent bucket, moving to this one */
+};
+
+static int em_on_path(const struct em_bfs_node *nodes, int idx,
+		uint32_t bucket)
+{
+	for (; idx >= 0; idx = nodes[idx].parent)
+		if (nodes[idx].bucket == bucket)
+			return 1;
+
+	return 0;
+}
+
+/* Finds a free slot for a new key in b1 or b2, moving other entries along
+ * the shortest cuckoo path if both are full. Returns the slot or -ENOMEM */
+static int64_t em_make_room(struct exact_match_priv *priv,
+		uint32_t b1, uint32_t b2)
+{
+	struct em_bfs_node nodes[EM_BFS_MAX_NODES];
+	int head = 0;
+	int tail = 0;
+	int free_slot;
+
+	if ((free_slot = em_free_slot(priv, b1)) >= 0)
+		return b1 * EM_BUCKET_SIZE + free_slot;
+	if ((free_slot = em_free_slot(priv, b2)) >= 0)
+		return b2 * EM_BUCKET_SIZE + free_slot;
+
+	nodes[tail++] = (struct em_bfs_node){.bucket = b1, .parent = -1};
+	if (b2 != b1)
+		nodes[tail++] = (struct em_bfs_node){.bucket = b2, .parent = -1};
+
+	for (; head < tail; head++) {
+		uint32_t bucket = nodes[head].bucket;
+
+		for (int i = 0; i < EM_BUCKET_SIZE; i++) {
+			uint32_t sig = priv->buckets[bucket].sig[i];
+			uint32_t alt = em_alt(priv, bucket, sig);
+
+			if (alt == bucket || em_on_path(nodes, head, alt))
+				continue;
+
+			free_slot = em_free_slot(priv, alt);
+			if (free_slot >= 0) {
+				/* move entries backward along the path */
+				uint32_t to_bucket = alt;
+				int to = free_slot;
+				int idx = head;
+				int from = i;
+
+				for (;;) {
+					em_move(priv, nodes[idx].bucket, from,
+							to_bucket, to);
+					to_bucket = nodes[idx].bucket;
+					to = from;
+
+					if (nodes[idx].parent < 0)
+						break;
+
+					from = nodes[idx].slot;
+					idx = nodes[idx].parent;
+				}
+
+				return to_bucket * EM_BUCKET_SIZE + to;
+			}
+
+			if (tail < EM_BFS_MAX_NODES)
+				nodes[tail++] = (struct em_bfs_node){
+					.bucket = alt,
+					.parent = head,
+					.slot = i,
+				};
+		}
+	}
+
+	return -ENOMEM;
+}
+
+static int em_add(struct exact_match_priv *priv, const uint64_t *key,
+		gate_idx_t gate, uint64_t value)
+{
+	uint32_t sig = em_hash(priv, key);
+	uint32_t b1 = em_primary(priv, sig);
+	uint32_t b2 = em_alt(priv, b1, sig);
+	int64_t slot;
+	uint64_t *rec;
+
+	if (em_find(priv, key) != EM_NOT_FOUND)
+		return -EEXIST;
+
+	slot = em_make_room(priv, b1, b2);
+	if (slot < 0)
+		return slot;
+
+	rec = em_rec(priv, slot);
+	rte_memcpy(rec, key, priv->key_words * sizeof(uint64_t));
+	rec[priv->key_words] = value;
+	priv->buckets[slot / EM_BUCKET_SIZE].gate[slot % EM_BUCKET_SIZE] = gate;
+
+	STORE_BARRIER();
+	priv->buckets[slot / EM_BUCKET_SIZE].sig[slot % EM_BUCKET_SIZE] = sig;
+
+	priv->count++;
+
+	return 0;
+}
+
+static int em_delete(struct exact_match_priv *priv, const uint64_t *key)
+{
+	uint32_t slot = em_find(priv, key);
+
+	if (slot == EM_NOT_FOUND)
+		return -ENOENT;
+
+	priv->buckets[slot / EM_BUCKET_SIZE].sig[slot % EM_BUCKET_SIZE] =
+		EM_SIG_EMPTY;
+	priv->count--;
+
+	return 0;
+}
+
+static inline void em_extract_key(const struct exact_match_priv *priv,
+		const char *head, uint64_t *key)
+{
+	for (int i = 0; i < EM_MAX_KEY_WORDS; i++)
+		key[i] = 0;
+
+	for (int i = 0; i < priv->num_fields; i++) {
+		const struct em_field *f = &priv->fields[i];
+
+		rte_memcpy((char *)key + f->pos, head + f->offset, f->size);
+	}
+
+	for (int i = 0; i < priv->key_words; i++)
+		key[i] &= priv->key_mask[i];
+}
+
+/* Builds a key from a list of field values (integers, or blobs of the same
+ * size as the field) */
+static struct snobj *em_parse_key(const struct exact_match_priv *priv,
+		struct snobj *values, uint64_t *key)
+{
+	uint8_t buf[EM_MAX_KEY_WORDS * 8] = {0};
+
+	if (!values || snobj_type(values) != TYPE_LIST)
+		return snobj_err(EINVAL, "'fields' must be a list");
+
+	if (values->size != priv->num_fields)
+		return snobj_err(EINVAL, "%d field values are required, "
+				"but %u given", priv->num_fields,
+				values->size);
+
+	for (int i = 0; i < priv->num_fields; i++) {
+		const struct em_field *f = &priv->fields[i];
+		struct snobj *v = snobj_list_get(values, i);
+
+		if (snobj_type(v) == TYPE_INT) {
+			uint64_t val = snobj_uint_get(v);
+
+			if (f->size > 8)
+				return snobj_err(EINVAL, "field %d is too "
+						"large for an integer", i);
+
+			/* big endian, as in the packet */
+			for (int j = f->size - 1; j >= 0; j--) {
+				buf[f->pos + j] = val & 0xff;
+				val >>= 8;
+			}
+
+			if (val)
+				return snobj_err(EINVAL, "value of field %d "
+						"does not fit in %d bytes",
+						i, f->size);
+		} else if (snobj_type(v) == TYPE_BLOB) {
+			if (snobj_size(v) != f->size)
+				return snobj_err(EINVAL, "value of field %d "
+						"must be %d bytes", i, f->size);
+
+			memcpy(buf + f->pos, snobj_blob_get(v), f->size);
+		} else
+			return snobj_err(EINVAL, "value of field %d must be "
+					"an integer or a blob", i);
+	}
+
+	memcpy(key, buf, sizeof(buf));
+
+	for (int i = 0; i < priv->key_words; i++)
+		key[i] &= priv->key_mask[i];
+
+	return NULL;
+}
+
+static struct snobj *em_parse_fields(struct exact_match_priv *priv,
+		struct snobj *fields)
+{
+	uint8_t mask[EM_MAX_KEY_WORDS * 8] = {0};
+	int pos = 0;
+
+	if (!fields || snobj_type(fields) != TYPE_LIST || fields->size == 0)
+		return snobj_err(EINVAL, "'fields' must be a non-empty list "
+				"of maps");
+
+	if (fields->size > EM_MAX_FIELDS)
+		return snobj_err(EINVAL, "max %d fields can be specified",
+				EM_MAX_FIELDS);
+
+	for (int i = 0; i < fields->size; i++) {
+		struct snobj *field = snobj_list_get(fields, i);
+		struct em_field *f = &priv->fields[i];
+		int offset;
+		int size;
+
+		if (snobj_type(field) != TYPE_MAP)
+			return snobj_err(EINVAL,
+					"'fields' must be a list of maps");
+
+		offset = snobj_eval_int(field, "offset");
+		size = snobj_eval_int(field, "size");
+
+		if (size < 1 || size > EM_MAX_FIELD_SIZE)
+			return snobj_err(EINVAL, "'size' must be 1-%d",
+					EM_MAX_FIELD_SIZE);
+
+		if (offset < 0 || offset + size > SNBUF_DATA)
+			return snobj_err(EINVAL, "invalid 'offset'");
+
+		if (pos + size > EM_MAX_KEY_SIZE)
+			return snobj_err(EINVAL, "fields must be at most %d "
+					"bytes in total", EM_MAX_KEY_SIZE);
+
+		f->offset = offset;
+		f->size = size;
+		f->pos = pos;
+
+		if (snobj_eval_exists(field, "mask")) {
+			uint64_t m = snobj_eval_uint(field, "mask");
+
+			if (size > 8)
+				return snobj_err(EINVAL, "'mask' is supported "
+						"only for fields up to 8 bytes");
+
+			for (int j = size - 1; j >= 0; j--) {
+				mask[pos + j] = m & 0xff;
+				m >>= 8;
+			}
+		} else
+			memset(mask + pos, 0xff, size);
+
+		priv->min_len = RTE_MAX(priv->min_len, offset + size);
+		pos += size;
+	}
+
+	priv->num_fields = fields->size;
+	priv->key_size = pos;
+	priv->key_words = (pos + 7) / 8;
+	memcpy(priv->key_mask, mask, sizeof(mask));
+
+	return NULL;
+}
+
+static struct snobj *exact_match_init(struct module *m, struct snobj *arg)
+{
+	struct exact_match_priv *priv = get_priv(m);
+	struct snobj *err;
+	uint64_t size = EM_DEFAULT_SIZE;
+	uint32_t n_buckets;
+
+	priv->default_gate = DROP_GATE;
+	priv->value_attr = -1;
+
+	if (!arg || snobj_type(arg) != TYPE_MAP)
+		return snobj_err(EINVAL, "argument must be a map");
+
+	err = em_parse_fields(priv, snobj_eval(arg, "fields"));
+	if (err)
+		return err;
+
+	if (snobj_eval_exists(arg, "size"))
+		size = snobj_eval_uint(arg, "size");
+
+	if (size == 0 || size > EM_MAX_SIZE)
+		return snobj_err(EINVAL, "'size' must be 1-%d", EM_MAX_SIZE);
+
+	/* metadata attribute to write the value of the matching entry to */
+	if (snobj_eval_exists(arg, "value_attr")) {
+		const char *name = snobj_eval_str(arg, "value_attr");
+		int value_size = 8;
+
+		if (!name)
+			return snobj_err(EINVAL, "'value_attr' must be a string");
+
+		if (snobj_eval_exists(arg, "value_size"))
+			value_size = snobj_eval_int(arg, "value_size");
+
+		if (value_size < 1 || value_size > 8)
+			return snobj_err(EINVAL, "'value_size' must be 1-8");
+
+		priv->value_attr = add_metadata_attr(m, name, value_size,
+				MT_WRITE);
+		if (priv->value_attr < 0)
+			return snobj_errno(-priv->value_attr);
+
+		priv->value_size = value_size;
+		priv->default_value = snobj_eval_uint(arg, "default_value");
+	}
+
+	n_buckets = rte_align32pow2((size + EM_BUCKET_SIZE - 1) /
+			EM_BUCKET_SIZE);
+	priv->bucket_mask = n_buckets - 1;
+	priv->rec_words = priv->key_words + 1;
+
+	priv->buckets = rte_zmalloc_socket("exact_match_buckets",
+			n_buckets * sizeof(struct em_bucket), 0, m->socket);
+	priv->records = rte_zmalloc_socket("exact_match_records",
+			(uint64_t)n_buckets * EM_BUCKET_SIZE *
+			priv->rec_words * sizeof(uint64_t), 0, m->socket);
+
+	if (!priv->buckets || !priv->records) {
+		rte_free(priv->buckets);
+		rte_free(priv->records);
+		return snobj_errno(ENOMEM);
+	}
+
+	return NULL;
+}
+
+static void exact_match_deinit(struct module *m)
+{
+	struct exact_match_priv *priv = get_priv(m);
+
+	rte_free(priv->buckets);
+	rte_free(priv->records);
+}
+
+static struct snobj *exact_match_get_desc(const struct module *m)
+{
+	const struct exact_match_priv *priv = get_priv_const(m);
+
+	return snobj_str_fmt("%d fields, %u/%u entries", priv->num_fields,
+			priv->count, (priv->bucket_mask + 1) * EM_BUCKET_SIZE);
+}
+
+static void exact_match_process_batch(struct module *m,
+		struct pkt_batch *batch)
+{
+	struct exact_match_priv *priv = get_priv(m);
+	int cnt = batch->cnt;
+
+	uint64_t keys[MAX_PKT_BURST][EM_MAX_KEY_WORDS];
+	uint32_t sigs[MAX_PKT_BURST];
+	uint32_t b1[MAX_PKT_BURST];
+	uint32_t slots[MAX_PKT_BURST];
+	gate_idx_t ogates[MAX_PKT_BURST];
+
+	mt_offset_t value_offset = MT_OFFSET_INVALID;
+
+	if (priv->value_attr >= 0)
+		value_offset = get_attr_offset(m, priv->value_attr);
+
+	/* 1. extract and hash all keys, and prefetch both candidate buckets */
+	for (int i = 0; i < cnt; i++) {
+		struct snbuf *snb = batch->pkts[i];
+
+		if (unlikely(snb_head_len(snb) < priv->min_len)) {
+			sigs[i] = EM_SIG_EMPTY;
+			continue;
+		}
+
+		em_extract_key(priv, snb_head_data(snb), keys[i]);
+		sigs[i] = em_hash(priv, keys[i]);
+		b1[i] = em_primary(priv, sigs[i]);
+
+		rte_prefetch0(&priv->buckets[b1[i]]);
+		rte_prefetch0(&priv->buckets[em_alt(priv, b1[i], sigs[i])]);
+	}
+
+	/* 2. find the first signature match, and prefetch its record */
+	for (int i = 0; i < cnt; i++) {
+		uint32_t b2;
+		int hits;
+
+		slots[i] = EM_NOT_FOUND;
+
+		if (sigs[i] == EM_SIG_EMPTY)
+			continue;
+
+		b2 = em_alt(priv, b1[i], sigs[i]);
+
+		if ((hits = em_match_sig(&priv->buckets[b1[i]], sigs[i])))
+			slots[i] = b1[i] * EM_BUCKET_SIZE + __builtin_ctz(hits);
+		else if ((hits = em_match_sig(&priv->buckets[b2], sigs[i])))
+			slots[i] = b2 * EM_BUCKET_SIZE + __builtin_ctz(hits);
+		else
+			continue;
+
+		rte_prefetch0(em_rec(priv, slots[i]));
+	}
+
+	/* 3. verify the keys */
+	for (int i = 0; i < cnt; i++) {
+		uint32_t slot = slots[i];
+		uint64_t value = priv->default_value;
+
+		ogates[i] = priv->default_gate;
+
+		if (slot != EM_NOT_FOUND &&
+				!em_key_eq(priv, em_rec(priv, slot), keys[i]))
+			/* signature collision: do it the slow way */
+			slot = em_find(priv, keys[i]);
+
+		if (slot != EM_NOT_FOUND) {
+			ogates[i] = priv->buckets[slot / EM_BUCKET_SIZE].gate[
+					slot % EM_BUCKET_SIZE];
+			value = em_rec(priv, slot)[priv->key_words];
+		}
+
+		if (is_valid_attr_offset(value_offset))
+			rte_memcpy(batch->pkts[i]->_metadata_buf + value_offset,
+					&value, priv->value_size);
+	}
+
+	run_split(m, ogates, batch);
+}
+
+static struct snobj *
+command_add(struct module *m, const char *cmd, struct snobj *arg)
+{
+	struct exact_match_priv *priv = get_priv(m);
+
+	if (snobj_type(arg) != TYPE_LIST)
+		return snobj_err(EINVAL, "argument must be a list of maps");
+
+	for (int i = 0; i < arg->size; i++) {
+		struct snobj *entry = snobj_list_get(arg, i);
+		uint64_t key[EM_MAX_KEY_WORDS];
+		struct snobj *err;
+		int gate;
+		int ret;
+
+		if (snobj_type(entry) != TYPE_MAP)
+			return snobj_err(EINVAL,
+					"argument must be a list of maps");
+
+		err = em_parse_key(priv, snobj_eval(entry, "fields"), key);
+		if (err)
+			return err;
+
+		gate = snobj_eval_int(entry, "gate");
+		if (!is_valid_gate(gate))
+			return snobj_err(EINVAL, "invalid gate %d", gate);
+
+		ret = em_add(priv, key, gate, snobj_eval_uint(entry, "value"));
+		if (ret == -EEXIST)
+			return snobj_err(EEXIST, "entry %d already exists", i);
+		else if (ret == -ENOMEM)
+			return snobj_err(ENOMEM, "Not enough space");
+		else if (ret)
+			return snobj_errno(-ret);
+	}
+
+	return NULL;
+}
+
+static struct snobj *
+command_delete(struct module *m, const char *cmd, struct snobj *arg)
+{
+	struct exact_match_priv *priv = get_priv(m);
+
+	if (snobj_type(arg) != TYPE_LIST)
+		return snobj_err(EINVAL, "argument must be a list of lists");
+
+	for (int i = 0; i < arg->size; i++) {
+		uint64_t key[EM_MAX_KEY_WORDS];
+		struct snobj *err;
+
+		err = em_parse_key(priv, snobj_list_get(arg, i), key);
+		if (err)
+			return err;
+
+		if (em_delete(priv, key))
+			return snobj_err(ENOENT, "entry %d does not exist", i);
+	}
+
+	return NULL;
+}
+
+static struct snobj *
+command_clear(struct module *m, const char *cmd, struct snobj *arg)
+{
+	struct exact_match_priv *priv = get_priv(m);
+
+	memset(priv->buckets, 0,
+			(priv->bucket_mask + 1) * sizeof(struct em_bucket));
+	priv->count = 0;
+
+	return NULL;
+}
+
+static struct snobj *
+command_set_default_gate(struct module *m, const char *cmd, struct snobj *arg)
+{
+	struct exact_match_priv *priv = get_priv(m);
+	int gate = snobj_int_get(arg);
+
+	if (!is_valid_gate(gate))
+		return snobj_err(EINVAL, "invalid gate %d", gate);
+
+	priv->default_gate = gate;
+
+	return NULL;
+}
+
+/* the field values are given as blobs, as they are in the key */
+static struct snobj *exact_match_get_snapshot(const struct module *m)
+{
+	const struct exact_match_priv *priv = get_priv_const(m);
+	uint64_t slots = (uint64_t)(priv->bucket_mask + 1) * EM_BUCKET_SIZE;
+
+	struct snobj *cmds = snobj_list();
+	struct snobj *entries = snobj_list();
+	struct snobj *cmd;
+
+	for (uint64_t slot = 0; slot < slots; slot++) {
+		const struct em_bucket *b = &priv->buckets[slot /
+			EM_BUCKET_SIZE];
+		const uint64_t *rec;
+		struct snobj *entry;
+		struct snobj *fields;
+
+		if (b->sig[slot % EM_BUCKET_SIZE] == EM_SIG_EMPTY)
+			continue;
+
+		rec = em_rec(priv, slot);
+
+		fields = snobj_list();
+		for (int i = 0; i < priv->num_fields; i++) {
+			const struct em_field *f = &priv->fields[i];
+
+			snobj_list_add(fields, snobj_blob(
+					(const uint8_t *)rec + f->pos,
+					f->size));
+		}
+
+		entry = snobj_map();
+		snobj_map_set(entry, "fields", fields);
+		snobj_map_set(entry, "gate",
+				snobj_int(b->gate[slot % EM_BUCKET_SIZE]));
+		snobj_map_set(entry, "value",
+				snobj_uint(rec[priv->key_words]));
+		snobj_list_add(entries, entry);
+	}
+
+	cmd = snobj_map();
+	snobj_map_set(cmd, "cmd", snobj_str("set_default_gate"));
+	snobj_map_set(cmd, "arg", snobj_int(priv->default_gate));
+	snobj_list_add(cmds, cmd);
+
+	cmd = snobj_map();
+	snobj_map_set(cmd, "cmd", snobj_str("add"));
+	snobj_map_set(cmd, "arg", entries);
+	snobj_list_add(cmds, cmd);
+
+	return cmds;
+}
+
+static const struct mclass exact_match = {
+	.name			= "ExactMatch",
+	.help			=
+		"classifies packets with exact match on header fields",
+	.def_module_name	= "em",
+	.num_igates		= 1,
+	.num_ogates		= MAX_GATES,
+	.priv_size		= sizeof(struct exact_match_priv),
+	.init			= exact_match_init,
+	.deinit			= exact_match_deinit,
+	.get_desc		= exact_match_get_desc,
+	.get_snapshot		= exact_match_get_snapshot,
+	.process_batch		= exact_match_process_batch,
+	.commands		= {
+		{"add",			command_add},
+		{"delete",		command_delete},
+		{"clear",		command_clear},
+		{"set_default_gate",	command_set_default_gate, .mt_safe=1},
+	}
+};
+
+ADD_MCLASS(exact_match)
@@ -0,0 +1,537 @@
+#include "../module.h"
+#include "../utils/random.h"
+
+/* Traffic generator for many flows.
+ *
+ * Only the headers of a few templates (Ethernet, optionally VLAN, IPv4 and
+ * TCP/UDP) are written into each packet; the payload is left as it is, as
+ * with Source. Flows differ in a set of header fields (e.g., addresses and
+ * ports). Flow i takes the values of a mixed-radix counter over the fields:
+ *
+ *   field k = min_k + (i / (range_0 * ... * range_{k-1})) % range_k
+ *
+ * The field values and the IPv4 header checksum (without the length) of
+ * each flow are computed when the module is created, so per packet only
+ * the template copy, a few stores, and a 16-bit add for the length remain.
+ * Flows are emitted round robin, with packet sizes from a fixed or weighted
+ * (e.g., IMIX) distribution. The rate can be limited with the TC of the
+ * task, as with Source. UDP checksums are set to 0 (none); TCP checksums
+ * are left as in the template. */
+
+#define FG_MAX_TEMPLATES	16
+#define FG_MAX_HDR_SIZE		128
+#define FG_MAX_FIELDS		8
+#define FG_MAX_FLOWS		(1 << 24)
+#define FG_MAX_SIZES		16
+#define FG_SIZE_SLOTS		1024	/* for the size distribution */
+
+#define FG_DEFAULT_PKT_SIZE	60
+
+struct fg_template {
+	uint8_t hdr[FG_MAX_HDR_SIZE] __ymm_aligned;
+	uint16_t hdr_len;
+	int16_t ip_offset;	/* -1 if not IPv4 */
+	int16_t udp_offset;	/* -1 if not UDP */
+};
+
+struct fg_field {
+	int16_t offset;
+	uint8_t size;		/* 1, 2, or 4 */
+	uint32_t min;
+	uint64_t range;		/* max - min + 1 */
+};
+
+struct flowgen_priv {
+	int burst;
+
+	int num_templates;
+	struct fg_template templates[FG_MAX_TEMPLATES];
+	uint16_t max_hdr_len;
+
+	int num_fields;
+	struct fg_field fields[FG_MAX_FIELDS];
+
+	uint32_t num_flows;
+	uint32_t next_flow;
+	int next_template;	/* == next_flow % num_templates */
+
+	/* per flow. Field values are in network order */
+	uint32_t *vals;		/* num_flows * num_fields */
+	uint16_t *ip_sums;	/* folded, not complemented, with length 0 */
+
+	uint16_t sizes[FG_SIZE_SLOTS];
+	uint16_t max_size;
+	int next_size;
+};
+
+static inline uint16_t fg_fold(uint32_t sum)
+{
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+
+	return sum;
+}
+
+static inline void fg_write_field(uint8_t *head, const struct fg_field *f,
+		uint32_t val)
+{
+	switch (f->size) {
+	case 1:
+		head[f->offset] = val;
+		break;
+	case 2:
+		*(uint16_t *)(head + f->offset) = val;
+		break;
+	default:
+		*(uint32_t *)(head + f->offset) = val;
+	}
+}
+
+static struct task_result
+flowgen_run_task(struct module *m, void *arg)
+{
+	struct flowgen_priv *priv = get_priv(m);
+
+	struct pkt_batch batch;
+	struct task_result ret;
+
+	const int pkt_overhead = 24;
+	const int num_fields = priv->num_fields;
+
+	uint32_t flow = priv->next_flow;
+	int tmpl = priv->next_template;
+	int size_idx = priv->next_size;
+	uint64_t total_bytes = 0;
+
+	const int cnt = snb_alloc_bulk(batch.pkts, priv->burst, priv->max_size);
+
+	for (int i = 0; i < cnt; i++) {
+		struct snbuf *snb = batch.pkts[i];
+		const struct fg_template *t = &priv->templates[tmpl];
+		const uint32_t *vals = &priv->vals[flow * num_fields];
+		uint16_t size = priv->sizes[size_idx];
+		uint8_t *head = (uint8_t *)snb_head_data(snb);
+
+		snb->mbuf.pkt_len = snb->mbuf.data_len = size;
+		total_bytes += size;
+
+		rte_memcpy(head, t->hdr, t->hdr_len);
+
+		for (int j = 0; j < num_fields; j++)
+			fg_write_field(head, &priv->fields[j], vals[j]);
+
+		if (t->ip_offset >= 0) {
+			struct ipv4_hdr *ip =
+				(struct ipv4_hdr *)(head + t->ip_offset);
+			uint16_t len = rte_cpu_to_be_16(size - t->ip_offset);
+
+			ip->total_length = len;
+			ip->hdr_checksum = ~fg_fold(priv->ip_sums[flow] + len);
+		}
+
+		if (t->udp_offset >= 0) {
+			struct udp_hdr *udp =
+				(struct udp_hdr *)(head + t->udp_offset);
+
+			udp->dgram_len = rte_cpu_to_be_16(size - t->udp_offset);
+		}
+
+		if (++flow == priv->num_flows) {
+			flow = 0;
+			tmpl = 0;
+		} else if (++tmpl == priv->num_templates)
+			tmpl = 0;
+
+		size_idx = (size_idx + 1) % FG_SIZE_SLOTS;
+	}
+
+	priv->next_flow = flow;
+	priv->next_template = tmpl;
+	priv->next_size = size_idx;
+
+	if (cnt > 0) {
+		batch.cnt = cnt;
+		run_next_module(m, &batch);
+	}
+
+	ret = (struct task_result) {
+		.packets = cnt,
+		.bits = (total_bytes + cnt * pkt_overhead) * 8,
+	};
+
+	return ret;
+}
+
+/* Takes the headers of a packet. Returns the header length, or 0 if
+ * invalid. */
+static int fg_parse_template(struct fg_template *t, const uint8_t *pkt,
+		int len)
+{
+	int off = 12;
+	uint16_t type;
+
+	t->ip_offset = -1;
+	t->udp_offset = -1;
+
+	if (len < off + 2)
+		return 0;
+
+	type = (pkt[off] << 8) | pkt[off + 1];
+	off += 2;
+
+	if (type == ETHER_TYPE_VLAN) {
+		if (len < off + 4)
+			return 0;
+
+		type = (pkt[off + 2] << 8) | pkt[off + 3];
+		off += 4;
+	}
+
+	if (type == ETHER_TYPE_IPv4 && len >= off + sizeof(struct ipv4_hdr)) {
+		const struct ipv4_hdr *ip = (const struct ipv4_hdr *)(pkt + off);
+		int ihl = (ip->version_ihl & 0xf) * 4;
+
+		if (ihl < sizeof(struct ipv4_hdr) || len < off + ihl)
+			return 0;
+
+		t->ip_offset = off;
+		off += ihl;
+
+		if (ip->next_proto_id == IPPROTO_UDP) {
+			if (len < off + sizeof(struct udp_hdr))
+				return 0;
+
+			t->udp_offset = off;
+			off += sizeof(struct udp_hdr);
+		} else if (ip->next_proto_id == IPPROTO_TCP) {
+			const struct tcp_hdr *tcp;
+
+			if (len < off + sizeof(struct tcp_hdr))
+				return 0;
+
+			tcp = (const struct tcp_hdr *)(pkt + off);
+			off += (tcp->data_off >> 4) * 4;
+			if (len < off)
+				return 0;
+		} else
+			off = len;
+	} else
+		off = len;
+
+	if (off > FG_MAX_HDR_SIZE)
+		return 0;
+
+	memcpy(t->hdr, pkt, off);
+	t->hdr_len = off;
+
+	if (t->udp_offset >= 0)
+		((struct udp_hdr *)(t->hdr + t->udp_offset))->dgram_cksum = 0;
+
+	return off;
+}
+
+static struct snobj *fg_parse_templates(struct flowgen_priv *priv,
+		struct snobj *templates)
+{
+	if (!templates || snobj_type(templates) != TYPE_LIST ||
+			templates->size == 0)
+		return snobj_err(EINVAL, "'templates' must be a non-empty "
+				"list of packets");
+
+	if (templates->size > FG_MAX_TEMPLATES)
+		return snobj_err(EINVAL, "max %d templates can be specified",
+				FG_MAX_TEMPLATES);
+
+	for (int i = 0; i < templates->size; i++) {
+		struct snobj *pkt = snobj_list_get(templates, i);
+		struct fg_template *t = &priv->templates[i];
+
+		if (snobj_type(pkt) != TYPE_BLOB)
+			return snobj_err(EINVAL, "templates must be blobs");
+
+		if (!fg_parse_template(t, snobj_blob_get(pkt), pkt->size))
+			return snobj_err(EINVAL, "template %d: invalid "
+					"packet or headers too long (max %d "
+					"bytes)", i, FG_MAX_HDR_SIZE);
+
+		priv->max_hdr_len = RTE_MAX(priv->max_hdr_len, t->hdr_len);
+	}
+
+	priv->num_templates = templates->size;
+
+	return NULL;
+}
+
+static struct snobj *fg_parse_fields(struct flowgen_priv *priv,
+		struct snobj *fields)
+{
+	if (snobj_type(fields) != TYPE_LIST)
+		return snobj_err(EINVAL, "'fields' must be a list of maps");
+
+	if (fields->size > FG_MAX_FIELDS)
+		return snobj_err(EINVAL, "max %d fields can be specified",
+				FG_MAX_FIELDS);
+
+	for (int i = 0; i < fields->size; i++) {
+		struct snobj *field = snobj_list_get(fields, i);
+		struct fg_field *f = &priv->fields[i];
+		int offset;
+		int size;
+		uint64_t min;
+		uint64_t max;
+
+		if (snobj_type(field) != TYPE_MAP)
+			return snobj_err(EINVAL,
+					"'fields' must be a list of maps");
+
+		offset = snobj_eval_int(field, "offset");
+		size = snobj_eval_int(field, "size");
+		min = snobj_eval_uint(field, "min");
+		max = snobj_eval_uint(field, "max");
+
+		if (size != 1 && size != 2 && size != 4)
+			return snobj_err(EINVAL, "'size' must be 1, 2, or 4");
+
+		/* only the headers are written */
+		if (offset < 0 || offset + size > priv->max_hdr_len)
+			return snobj_err(EINVAL, "field %d: 'offset' must be "
+					"within the headers", i);
+
+		if (min > max || max >> (size * 8))
+			return snobj_err(EINVAL, "field %d: invalid 'min' or "
+					"'max'", i);
+
+		f->offset = offset;
+		f->size = size;
+		f->min = min;
+		f->range = max - min + 1;
+	}
+
+	priv->num_fields = fields->size;
+
+	return NULL;
+}
+
+static struct snobj *fg_parse_sizes(struct flowgen_priv *priv,
+		struct snobj *arg)
+{
+	uint16_t sizes[FG_MAX_SIZES] = {FG_DEFAULT_PKT_SIZE};
+	uint64_t weights[FG_MAX_SIZES] = {1};
+	uint64_t total_weight = 0;
+	struct snobj *s = snobj_eval(arg, "pkt_sizes");
+	struct snobj *w = snobj_eval(arg, "weights");
+	int n = 1;
+	int pos = 0;
+	uint64_t seed = 1;
+
+	if (snobj_eval_exists(arg, "pkt_size"))
+		sizes[0] = snobj_eval_uint(arg, "pkt_size");
+
+	if (s) {
+		if (snobj_type(s) != TYPE_LIST || s->size == 0 ||
+				s->size > FG_MAX_SIZES)
+			return snobj_err(EINVAL, "'pkt_sizes' must be a list "
+					"of 1-%d sizes", FG_MAX_SIZES);
+
+		if (w && (snobj_type(w) != TYPE_LIST || w->size != s->size))
+			return snobj_err(EINVAL, "'weights' must be a list "
+					"of the same length as 'pkt_sizes'");
+
+		n = s->size;
+		for (int i = 0; i < n; i++) {
+			sizes[i] = snobj_uint_get(snobj_list_get(s, i));
+			weights[i] = w ? snobj_uint_get(snobj_list_get(w, i)) : 1;
+		}
+	}
+
+	for (int i = 0; i < n; i++) {
+		if (sizes[i] < priv->max_hdr_len || sizes[i] > SNBUF_DATA)
+			return snobj_err(EINVAL, "packet size %d is out of "
+					"range (%d-%d)", sizes[i],
+					priv->max_hdr_len, SNBUF_DATA);
+
+		total_weight += weights[i];
+		priv->max_size = RTE_MAX(priv->max_size, sizes[i]);
+	}
+
+	if (total_weight == 0)
+		return snobj_err(EINVAL, "'weights' must not be all zero");
+
+	/* each size takes its share of the slots (rounded down, the rest
+	 * goes to the first ones), then they are shuffled */
+	for (int i = 0; i < n; i++) {
+		int slots = weights[i] * FG_SIZE_SLOTS / total_weight;
+
+		for (int j = 0; j < slots; j++)
+			priv->sizes[pos++] = sizes[i];
+	}
+
+	for (int i = 0; pos < FG_SIZE_SLOTS; i = (i + 1) % n)
+		if (weights[i])
+			priv->sizes[pos++] = sizes[i];
+
+	for (int i = FG_SIZE_SLOTS - 1; i > 0; i--) {
+		int j = rand_fast_range(&seed, i + 1);
+		uint16_t tmp = priv->sizes[i];
+
+		priv->sizes[i] = priv->sizes[j];
+		priv->sizes[j] = tmp;
+	}
+
+	return NULL;
+}
+
+/* the field values and IPv4 header checksums of all flows */
+static int fg_init_flows(struct module *m)
+{
+	struct flowgen_priv *priv = get_priv(m);
+	const int num_fields = priv->num_fields;
+
+	priv->vals = rte_malloc_socket("flowgen_vals", (size_t)priv->num_flows *
+			RTE_MAX(num_fields, 1) * sizeof(uint32_t), 0,
+			m->socket);
+	priv->ip_sums = rte_malloc_socket("flowgen_ip_sums",
+			(size_t)priv->num_flows * sizeof(uint16_t), 0,
+			m->socket);
+	if (!priv->vals || !priv->ip_sums)
+		return -ENOMEM;
+
+	for (uint32_t i = 0; i < priv->num_flows; i++) {
+		const struct fg_template *t =
+			&priv->templates[i % priv->num_templates];
+		uint32_t *vals = &priv->vals[i * num_fields];
+		uint64_t idx = i;
+		uint8_t hdr[FG_MAX_HDR_SIZE];
+
+		memcpy(hdr, t->hdr, t->hdr_len);
+
+		for (int j = 0; j < num_fields; j++) {
+			const struct fg_field *f = &priv->fields[j];
+			uint32_t v = f->min + idx % f->range;
+
+			idx /= f->range;
+
+			if (f->size == 2)
+				v = rte_cpu_to_be_16(v);
+			else if (f->size == 4)
+				v = rte_cpu_to_be_32(v);
+
+			vals[j] = v;
+			fg_write_field(hdr, f, v);
+		}
+
+		priv->ip_sums[i] = 0;
+
+		if (t->ip_offset >= 0) {
+			struct ipv4_hdr *ip =
+				(struct ipv4_hdr *)(hdr + t->ip_offset);
+			const uint16_t *words =
+				(const uint16_t *)(hdr + t->ip_offset);
+			uint32_t sum = 0;
+
+			ip->total_length = 0;
+			ip->hdr_checksum = 0;
+
+			for (int k = 0; k < (ip->version_ihl & 0xf) * 2; k++)
+				sum += words[k];
+
+			priv->ip_sums[i] = fg_fold(sum);
+		}
+	}
+
+	return 0;
+}
+
+static void flowgen_deinit(struct module *m)
+{
+	struct flowgen_priv *priv = get_priv(m);
+
+	rte_free(priv->vals);
+	rte_free(priv->ip_sums);
+}
+
+static struct snobj *flowgen_init(struct module *m, struct snobj *arg)
+{
+	struct flowgen_priv *priv = get_priv(m);
+	struct snobj *err;
+	uint64_t num_flows = 1;
+	task_id_t tid;
+	int ret;
+
+	if (!arg || snobj_type(arg) != TYPE_MAP)
+		return snobj_err(EINVAL, "argument must be a map");
+
+	err = fg_parse_templates(priv, snobj_eval(arg, "templates"));
+	if (err)
+		return err;
+
+	if (snobj_eval_exists(arg, "fields")) {
+		err = fg_parse_fields(priv, snobj_eval(arg, "fields"));
+		if (err)
+			return err;
+	}
+
+	err = fg_parse_sizes(priv, arg);
+	if (err)
+		return err;
+
+	/* by default, all combinations of field values */
+	for (int i = 0; i < priv->num_fields; i++)
+		num_flows = RTE_MIN(num_flows * priv->fields[i].range,
+				(uint64_t)FG_MAX_FLOWS);
+
+	if (snobj_eval_exists(arg, "flows"))
+		num_flows = snobj_eval_uint(arg, "flows");
+
+	if (num_flows == 0 || num_flows > FG_MAX_FLOWS)
+		return snobj_err(EINVAL, "'flows' must be 1-%d",
+				FG_MAX_FLOWS);
+
+	priv->num_flows = num_flows;
+
+	priv->burst = MAX_PKT_BURST;
+	if (snobj_eval_exists(arg, "burst")) {
+		priv->burst = snobj_eval_int(arg, "burst");
+		if (priv->burst < 1 || priv->burst > MAX_PKT_BURST)
+			return snobj_err(EINVAL, "burst size must be [1,%d]",
+					MAX_PKT_BURST);
+	}
+
+	ret = fg_init_flows(m);
+	if (ret) {
+		flowgen_deinit(m);
+		return snobj_errno(-ret);
+	}
+
+	tid = register_task(m, NULL);
+	if (tid == INVALID_TASK_ID) {
+		flowgen_deinit(m);
+		return snobj_err(ENOMEM, "Task creation failed");
+	}
+
+	return NULL;
+}
+
+static struct snobj *flowgen_get_desc(const struct module *m)
+{
+	const struct flowgen_priv *priv = get_priv_const(m);
+
+	return snobj_str_fmt("%u flows, %d templates", priv->num_flows,
+			priv->num_templates);
+}
+
+static const struct mclass flowgen = {
+	.name 			= "FlowGen",
+	.help			=
+		"generates packets of many flows from header templates",
+	.def_module_name	= "flowgen",
+	.num_igates 		= 0,
+	.num_ogates		= 1,
+	.priv_size		= sizeof(struct flowgen_priv),
+	.init 			= flowgen_init,
+	.deinit			= flowgen_deinit,
+	.get_desc		= flowgen_get_desc,
+	.run_task 		= flowgen_run_task,
+};
+
+ADD_MCLASS(flowgen)
@@ -0,0 +1,428 @@
+#include <string.h>
+
+#include <rte_tcp.h>
+
+#include "../module.h"
+#include "../time.h"
+#include "../timer.h"
+
+/* Coalesces in-order TCP segments of the same flow into one large packet
+ * (software GRO), so that a vport and the kernel stack behind it receive
+ * far fewer packets.
+ *
+ * Consecutive data segments of a flow (untagged Ethernet, IPv4 without
+ * options or fragmentation, and TCP with only ACK or PSH set) are chained
+ * together without copying: the headers of every segment but the first are
+ * stripped with snb_adj(). The merged packet has its IP total length
+ * updated, and carries the MSS as a TSO request (snb_tx_offload_tso()),
+ * which the vport passes to the kernel as gso_mss. Since the checksums are
+ * left to the offload, the TCP checksum of every segment is verified in
+ * software before merging, unless 'verify_cksum' is 0.
+ *
+ * A flow is flushed when a segment is out of order, shorter than the MSS,
+ * has PSH set, differs in any other header field (ACK, window, options,
+ * ...), or when it would exceed 64KB. Anything else of the same flow (e.g.,
+ * a FIN or a pure ACK) flushes it first, so the order within a flow is
+ * kept. Pending flows are flushed at the end of every batch by default, or
+ * up to 'max_delay' us later, to coalesce across batches.
+ *
+ * The output needs TSO, so it is meant for vports (or NICs that support
+ * TSO with chained mbufs). IPv6 is not coalesced. */
+
+#define GRO_MAX_FLOWS		16
+#define GRO_MAX_SEGS		64
+#define GRO_MAX_IP_LEN		65535
+
+#define GRO_TCP_FLAG_PSH	0x08
+#define GRO_TCP_FLAG_ACK	0x10
+
+/* offsets of untagged Ethernet + IPv4 without options */
+#define GRO_IP_OFF		sizeof(struct ether_hdr)
+#define GRO_TCP_OFF		(GRO_IP_OFF + sizeof(struct ipv4_hdr))
+
+struct gro_priv {
+	uint64_t max_delay_ns;	/* 0: flushed at the end of each batch */
+	int verify_cksum;
+};
+
+/* a chain of segments being coalesced (head is NULL when empty) */
+struct gro_flow {
+	struct snbuf *head;
+	struct snbuf *tail;
+
+	uint64_t addrs;		/* src/dst IPv4 addresses, as in the packet */
+	uint32_t ports;		/* src/dst TCP ports, as in the packet */
+
+	uint32_t next_seq;	/* host order */
+	uint16_t mss;		/* payload of the first segment */
+	uint16_t nsegs;
+	uint16_t ip_len;	/* IP total length so far */
+	uint8_t tcp_len;
+	uint8_t psh;
+};
+
+/* flows are kept in the order they started, so flows[0] is the oldest */
+struct gro_worker {
+	struct gro_flow flows[GRO_MAX_FLOWS];
+	int num_flows;
+
+	struct pkt_batch out;
+	struct timer timer;	/* armed while num_flows > 0 */
+} __attribute__((aligned(64)));
+
+enum gro_seg_type {
+	GRO_SEG_OTHER,		/* not IPv4/TCP */
+	GRO_SEG_TCP,		/* of a flow, but cannot be coalesced */
+	GRO_SEG_DATA,		/* can be coalesced */
+};
+
+struct gro_seg {
+	struct ipv4_hdr *ip;
+	struct tcp_hdr *tcp;
+
+	uint64_t addrs;
+	uint32_t ports;
+
+	uint32_t seq;		/* host order */
+	uint16_t ip_len;
+	uint16_t payload;
+	uint8_t tcp_len;
+};
+
+static enum gro_seg_type gro_parse(const struct gro_priv *priv,
+		struct snbuf *pkt, struct gro_seg *seg)
+{
+	char *head = snb_head_data(pkt);
+	int len = snb_head_len(pkt);
+	struct ether_hdr *eth = (struct ether_hdr *)head;
+	struct ipv4_hdr *ip;
+	struct tcp_hdr *tcp;
+	int ip_len;
+
+	if (unlikely(len < (int)(GRO_TCP_OFF + sizeof(struct tcp_hdr))))
+		return GRO_SEG_OTHER;
+
+	if (eth->ether_type != rte_cpu_to_be_16(ETHER_TYPE_IPv4))
+		return GRO_SEG_OTHER;
+
+	ip = (struct ipv4_hdr *)(head + GRO_IP_OFF);
+	if (ip->version_ihl != 0x45 || ip->next_proto_id != IPPROTO_TCP)
+		return GRO_SEG_OTHER;
+
+	tcp = (struct tcp_hdr *)(head + GRO_TCP_OFF);
+
+	seg->ip = ip;
+	seg->tcp = tcp;
+	memcpy(&seg->addrs, &ip->src_addr, sizeof(seg->addrs));
+	memcpy(&seg->ports, &tcp->src_port, sizeof(seg->ports));
+
+	/* from here on, the packet belongs to a flow */
+
+	if (!snb_is_linear(pkt) ||
+			(pkt->mbuf.ol_flags & (PKT_RX_IP_CKSUM_BAD |
+					       PKT_RX_L4_CKSUM_BAD |
+					       SNB_TX_OFFLOAD_FLAGS)))
+		return GRO_SEG_TCP;
+
+	/* no fragments (DF is fine) */
+	if (ip->fragment_offset & rte_cpu_to_be_16(0x3fff))
+		return GRO_SEG_TCP;
+
+	if ((tcp->tcp_flags & ~GRO_TCP_FLAG_PSH) != GRO_TCP_FLAG_ACK)
+		return GRO_SEG_TCP;
+
+	ip_len = rte_be_to_cpu_16(ip->total_length);
+	seg->tcp_len = (tcp->data_off >> 4) << 2;
+
+	/* Ethernet padding is allowed (and trimmed later) */
+	if (seg->tcp_len < sizeof(struct tcp_hdr) ||
+			ip_len <= (int)sizeof(struct ipv4_hdr) + seg->tcp_len ||
+			(int)GRO_IP_OFF + ip_len > len)
+		return GRO_SEG_TCP;
+
+	if (priv->verify_cksum && (rte_ipv4_cksum(ip) != 0xffff ||
+				rte_ipv4_udptcp_cksum(ip, tcp) != 0xffff))
+		return GRO_SEG_TCP;
+
+	seg->seq = rte_be_to_cpu_32(tcp->sent_seq);
+	seg->ip_len = ip_len;
+	seg->payload = ip_len - sizeof(struct ipv4_hdr) - seg->tcp_len;
+
+	return GRO_SEG_DATA;
+}
+
+/* Can seg be appended to f? Everything but the sequence number, the IP ID,
+ * the checksums, and PSH must be the same as those of the first segment */
+static int gro_can_merge(const struct gro_flow *f, const struct gro_seg *seg)
+{
+	const char *head = snb_head_data(f->head);
+	const struct ipv4_hdr *ip = (const struct ipv4_hdr *)(head + GRO_IP_OFF);
+	const struct tcp_hdr *tcp = (const struct tcp_hdr *)(head + GRO_TCP_OFF);
+	uint32_t word;
+	uint32_t seg_word;
+
+	if (seg->seq != f->next_seq || seg->tcp_len != f->tcp_len ||
+			seg->payload > f->mss ||
+			f->nsegs >= GRO_MAX_SEGS ||
+			f->ip_len + seg->payload > GRO_MAX_IP_LEN)
+		return 0;
+
+	if (seg->ip->type_of_service != ip->type_of_service ||
+			seg->ip->time_to_live != ip->time_to_live ||
+			seg->ip->fragment_offset != ip->fragment_offset ||
+			seg->tcp->recv_ack != tcp->recv_ack)
+		return 0;
+
+	/* data offset, flags, and window */
+	memcpy(&word, &tcp->data_off, sizeof(word));
+	memcpy(&seg_word, &seg->tcp->data_off, sizeof(seg_word));
+	if ((word ^ seg_word) & ~rte_cpu_to_be_32(GRO_TCP_FLAG_PSH << 16))
+		return 0;
+
+	return memcmp(tcp + 1, seg->tcp + 1,
+			f->tcp_len - sizeof(struct tcp_hdr)) == 0;
+}
+
+static inline void gro_emit(struct module *m, struct gro_worker *w,
+		struct snbuf *pkt)
+{
+	batch_add(&w->out, pkt);
+
+	if (unlikely(batch_full(&w->out))) {
+		run_next_module(m, &w->out);
+		batch_clear(&w->out);
+	}
+}
+
+static void gro_flush(struct module *m, struct gro_worker *w, int idx)
+{
+	struct gro_flow *f = &w->flows[idx];
+	struct snbuf *head = f->head;
+
+	if (f->nsegs > 1) {
+		char *data = snb_head_data(head);
+		struct ipv4_hdr *ip = (struct ipv4_hdr *)(data + GRO_IP_OFF);
+		struct tcp_hdr *tcp = (struct tcp_hdr *)(data + GRO_TCP_OFF);
+
+		ip->total_length = rte_cpu_to_be_16(f->ip_len);
+		if (f->psh)
+			tcp->tcp_flags |= GRO_TCP_FLAG_PSH;
+
+		/* the checksums are computed by snb_tx_offload_tso() */
+		snb_tx_offload_tso(head, GRO_IP_OFF, sizeof(struct ipv4_hdr),
+				f->tcp_len, f->mss);
+	}
+
+	gro_emit(m, w, head);
+
+	w->num_flows--;
+	memmove(f, f + 1, (w->num_flows - idx) * sizeof(*f));
+}
+
+static void gro_flush_all(struct module *m, struct gro_worker *w)
+{
+	while (w->num_flows)
+		gro_flush(m, w, w->num_flows - 1);
+
+	if (w->out.cnt) {
+		run_next_module(m, &w->out);
+		batch_clear(&w->out);
+	}
+}
+
+static inline int gro_find(const struct gro_worker *w, uint64_t addrs,
+		uint32_t ports)
+{
+	for (int i = 0; i < w->num_flows; i++) {
+		const struct gro_flow *f = &w->flows[i];
+
+		if (f->addrs == addrs && f->ports == ports)
+			return i;
+	}
+
+	return -1;
+}
+
+static void gro_append(struct gro_flow *f, struct snbuf *pkt,
+		const struct gro_seg *seg)
+{
+	uint16_t hdr_len = GRO_TCP_OFF + seg->tcp_len;
+
+	/* only the payload, without the headers or padding */
+	snb_adj(pkt, hdr_len);
+	pkt->mbuf.data_len = seg->payload;
+	pkt->mbuf.pkt_len = seg->payload;
+
+	f->tail->mbuf.next = &pkt->mbuf;
+	f->tail = pkt;
+
+	f->head->mbuf.nb_segs++;
+	f->head->mbuf.pkt_len += seg->payload;
+	f->head->simple = 0;
+
+	f->next_seq += seg->payload;
+	f->ip_len += seg->payload;
+	f->nsegs++;
+}
+
+static void gro_start(struct gro_worker *w, struct snbuf *pkt,
+		const struct gro_seg *seg)
+{
+	struct gro_flow *f = &w->flows[w->num_flows++];
+	int len = GRO_IP_OFF + seg->ip_len;
+
+	if (snb_head_len(pkt) > len)
+		snb_trim(pkt, snb_head_len(pkt) - len);
+
+	f->head = pkt;
+	f->tail = pkt;
+	f->addrs = seg->addrs;
+	f->ports = seg->ports;
+	f->next_seq = seg->seq + seg->payload;
+	f->mss = seg->payload;
+	f->nsegs = 1;
+	f->ip_len = seg->ip_len;
+	f->tcp_len = seg->tcp_len;
+	f->psh = 0;
+}
+
+static void gro_timeout(struct timer *t)
+{
+	struct module *m = t->arg;
+
+	gro_flush_all(m, get_priv_worker(m));
+}
+
+static void gro_process_batch(struct module *m, struct pkt_batch *batch)
+{
+	struct gro_priv *priv = get_priv(m);
+	struct gro_worker *w = get_priv_worker(m);
+	int cnt = batch->cnt;
+
+	for (int i = 0; i < cnt; i++) {
+		struct snbuf *pkt = batch->pkts[i];
+		enum gro_seg_type type;
+		struct gro_seg seg;
+		int idx = -1;
+
+		type = gro_parse(priv, pkt, &seg);
+		if (type != GRO_SEG_OTHER)
+			idx = gro_find(w, seg.addrs, seg.ports);
+
+		if (type == GRO_SEG_DATA) {
+			int last = (seg.tcp->tcp_flags & GRO_TCP_FLAG_PSH) != 0;
+
+			if (idx >= 0 && gro_can_merge(&w->flows[idx], &seg)) {
+				struct gro_flow *f = &w->flows[idx];
+
+				gro_append(f, pkt, &seg);
+				f->psh = last;
+
+				if (last || seg.payload < f->mss)
+					gro_flush(m, w, idx);
+				continue;
+			}
+
+			if (idx >= 0)
+				gro_flush(m, w, idx);
+
+			if (!last) {
+				if (w->num_flows == GRO_MAX_FLOWS)
+					gro_flush(m, w, 0);
+
+				gro_start(w, pkt, &seg);
+				continue;
+			}
+		} else if (idx >= 0)
+			gro_flush(m, w, idx);
+
+		gro_emit(m, w, pkt);
+	}
+
+	if (!priv->max_delay_ns || !w->num_flows) {
+		gro_flush_all(m, w);
+		if (timer_is_armed(&w->timer))
+			timer_cancel(&w->timer);
+		return;
+	}
+
+	if (w->out.cnt) {
+		run_next_module(m, &w->out);
+		batch_clear(&w->out);
+	}
+
+	/* the deadline is set by the oldest pending flow */
+	if (!timer_is_armed(&w->timer))
+		timer_arm_ns(&w->timer, priv->max_delay_ns);
+}
+
+static struct snobj *gro_init(struct module *m, struct snobj *arg)
+{
+	struct gro_priv *priv = get_priv(m);
+	struct gro_worker *w;
+	int wid;
+
+	priv->verify_cksum = 1;
+
+	if (arg && snobj_eval(arg, "max_delay")) {
+		int64_t max_delay = snobj_eval_int(arg, "max_delay");
+
+		if (max_delay < 0)
+			return snobj_err(EINVAL, "'max_delay' (us) must be "
+					"non-negative");
+
+		priv->max_delay_ns = max_delay * 1000;
+	}
+
+	if (arg && snobj_eval(arg, "verify_cksum"))
+		priv->verify_cksum = snobj_eval_int(arg, "verify_cksum");
+
+	for_each_priv_worker(m, wid, w)
+		timer_init(&w->timer, gro_timeout, m);
+
+	return NULL;
+}
+
+/* the timer lives in the wheel of the worker */
+static void gro_deinit_worker(struct module *m, int wid)
+{
+	struct gro_worker *w = get_priv_worker_by_wid(m, wid);
+
+	timer_cancel(&w->timer);
+
+	for (int i = 0; i < w->num_flows; i++)
+		snb_free(w->flows[i].head);	/* with the whole chain */
+	w->num_flows = 0;
+
+	if (w->out.cnt) {
+		snb_free_bulk(w->out.pkts, w->out.cnt);
+		batch_clear(&w->out);
+	}
+}
+
+static struct snobj *gro_get_desc(const struct module *m)
+{
+	const struct gro_priv *priv = get_priv_const(m);
+
+	if (priv->max_delay_ns)
+		return snobj_str_fmt("max_delay %luus",
+				priv->max_delay_ns / 1000);
+	else
+		return snobj_str_fmt("per batch");
+}
+
+static const struct mclass gro = {
+	.name 			= "GRO",
+	.help			= "coalesces TCP segments into larger packets",
+	.def_module_name	= "gro",
+	.num_igates		= 1,
+	.num_ogates		= 1,
+	.priv_size		= sizeof(struct gro_priv),
+	.priv_worker_size	= sizeof(struct gro_worker),
+	.init 			= gro_init,
+	.deinit_worker		= gro_deinit_worker,
+	.process_batch 		= gro_process_batch,
+	.get_desc		= gro_get_desc,
+};
+
+ADD_MCLASS(gro)
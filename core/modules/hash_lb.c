@@ -0,0 +1,384 @@
+#include <rte_hash_crc.h>
+#include <rte_prefetch.h>
+
+#include "../module.h"
+
+/* Flow-consistent load balancing over output gates.
+ *
+ * Packets are hashed (CRC32) on a set of header fields, the IPv4 5-tuple
+ * of an untagged frame by default, and the hash selects an entry of a
+ * Maglev lookup table (Eisenbud et al., NSDI '16) that holds the gates.
+ * All packets of a flow take the same gate, and when a gate is added or
+ * removed, only about the share of the changed gate is remapped.
+ *
+ * With "hash": "rss", the hash that came with the packet is used instead,
+ * if any (PKT_RX_RSS_HASH): from the RSS of a NIC, or the skb flow hash for
+ * vports. E.g., HashLB to Queue modules whose tasks run on different 
+ * workers spreads the packets of one port queue over the workers, without
+ * reordering packets of the same flow.
+ *
+ * On set_gates, the table is rebuilt in a spare copy and published with a
+ * single pointer store. The old copy is reused only after all workers are
+ * done with it. */
+
+#define HLB_MAX_FIELDS		8
+#define HLB_MAX_FIELD_SIZE	16
+#define HLB_MAX_KEY_SIZE	64
+#define HLB_MAX_KEY_WORDS	(HLB_MAX_KEY_SIZE / 8)
+
+/* must be a prime, larger than the number of gates (x100 recommended) */
+#define HLB_TABLE_SIZE		65537
+#define HLB_MAX_GATES		(HLB_TABLE_SIZE / 100)
+
+#define HLB_SEED_OFFSET		0x4c4f4144	/* "LOAD" */
+#define HLB_SEED_SKIP		0x42414c41	/* "BALA" */
+
+struct hlb_field {
+	int16_t offset;		/* in the packet */
+	uint8_t size;		/* in bytes */
+	uint8_t pos;		/* in the key */
+};
+
+struct hash_lb_priv {
+	int num_fields;
+	struct hlb_field fields[HLB_MAX_FIELDS];
+	int key_words;
+
+	int num_gates;
+	gate_idx_t gates[HLB_MAX_GATES];
+
+	/* points to one of tables[], or NULL if there are no gates */
+	gate_idx_t * volatile table;
+	gate_idx_t tables[2][HLB_TABLE_SIZE];
+};
+
+static const struct {
+	int offset;
+	int size;
+} hlb_default_fields[] = {
+	{23, 1},	/* IPv4 protocol */
+	{26, 8},	/* IPv4 src/dst addresses */
+	{34, 4},	/* TCP/UDP src/dst ports */
+};
+
+static inline uint32_t hlb_hash(const struct hash_lb_priv *priv,
+		const char *head, int len)
+{
+	uint64_t key[HLB_MAX_KEY_WORDS] = {0};
+	uint32_t hash = 0;
+
+	for (int i = 0; i < priv->num_fields; i++) {
+		const struct hlb_field *f = &priv->fields[i];
+
+		/* missing fields of short packets are hashed as zeros */
+		if (likely(f->offset + f->size <= len))
+			rte_memcpy((char *)key + f->pos, head + f->offset,
+					f->size);
+	}
+
+	for (int i = 0; i < priv->key_words; i++)
+		hash = rte_hash_crc_8byte(key[i], hash);
+
+	return hash;
+}
+
+/* maps a 32-bit hash to [0, HLB_TABLE_SIZE) without a division */
+static inline uint32_t hlb_index(uint32_t hash)
+{
+	return ((uint64_t)hash * HLB_TABLE_SIZE) >> 32;
+}
+
+/* Each gate fills its preferred (not yet taken) entries in turn, following
+ * a permutation of the table defined by the gate number only. The result
+ * for a gate does not depend on the order of the gates. */
+static void hlb_populate(gate_idx_t *table, const gate_idx_t *gates, int n)
+{
+	uint32_t offset[HLB_MAX_GATES];
+	uint32_t skip[HLB_MAX_GATES];
+	uint32_t next[HLB_MAX_GATES];
+	gate_idx_t sorted[HLB_MAX_GATES];
+	uint32_t filled = 0;
+
+	/* insertion sort, n is small */
+	for (int i = 0; i < n; i++) {
+		int j = i;
+
+		while (j > 0 && sorted[j - 1] > gates[i]) {
+			sorted[j] = sorted[j - 1];
+			j--;
+		}
+		sorted[j] = gates[i];
+	}
+
+	for (int i = 0; i < n; i++) {
+		offset[i] = rte_hash_crc_4byte(sorted[i], HLB_SEED_OFFSET) %
+			HLB_TABLE_SIZE;
+		skip[i] = rte_hash_crc_4byte(sorted[i], HLB_SEED_SKIP) %
+			(HLB_TABLE_SIZE - 1) + 1;
+		next[i] = 0;
+	}
+
+	for (int i = 0; i < HLB_TABLE_SIZE; i++)
+		table[i] = DROP_GATE;
+
+	while (filled < HLB_TABLE_SIZE) {
+		for (int i = 0; i < n && filled < HLB_TABLE_SIZE; i++) {
+			uint32_t c;
+
+			do {
+				c = (offset[i] + (uint64_t)next[i] * skip[i]) %
+					HLB_TABLE_SIZE;
+				next[i]++;
+			} while (table[c] != DROP_GATE);
+
+			table[c] = sorted[i];
+			filled++;
+		}
+	}
+}
+
+/* rss is a constant, so that each variant has only its own loop */
+static inline __attribute__((always_inline)) void 
+do_process_batch(struct module *m, struct pkt_batch *batch, const int rss)
+{
+	struct hash_lb_priv *priv = get_priv(m);
+	const gate_idx_t *table = priv->table;
+	gate_idx_t ogates[MAX_PKT_BURST];
+	uint32_t idx[MAX_PKT_BURST];
+	int cnt = batch->cnt;
+
+	if (unlikely(!table)) {
+		run_choose_module(m, DROP_GATE, batch);
+		return;
+	}
+
+	/* hash the whole batch first, so that the table lookups overlap */
+	for (int i = 0; i < cnt; i++) {
+		struct snbuf *snb = batch->pkts[i];
+		uint32_t hash;
+
+		if (rss && (snb->mbuf.ol_flags & PKT_RX_RSS_HASH))
+			hash = snb->mbuf.hash.rss;
+		else
+			hash = hlb_hash(priv, snb_head_data(snb),
+					snb_head_len(snb));
+
+		idx[i] = hlb_index(hash);
+		rte_prefetch0(&table[idx[i]]);
+	}
+
+	for (int i = 0; i < cnt; i++)
+		ogates[i] = table[idx[i]];
+
+	run_split(m, ogates, batch);
+}
+
+static void hash_lb_process_batch(struct module *m, struct pkt_batch *batch)
+{
+	do_process_batch(m, batch, 0);
+}
+
+static void 
+hash_lb_process_batch_rss(struct module *m, struct pkt_batch *batch)
+{
+	do_process_batch(m, batch, 1);
+}
+
+static struct snobj *hlb_set_fields(struct hash_lb_priv *priv,
+		struct snobj *fields)
+{
+	int pos = 0;
+
+	if (snobj_type(fields) != TYPE_LIST || fields->size == 0)
+		return snobj_err(EINVAL, "'fields' must be a non-empty list "
+				"of maps");
+
+	if (fields->size > HLB_MAX_FIELDS)
+		return snobj_err(EINVAL, "max %d fields can be specified",
+				HLB_MAX_FIELDS);
+
+	for (int i = 0; i < fields->size; i++) {
+		struct snobj *field = snobj_list_get(fields, i);
+		struct hlb_field *f = &priv->fields[i];
+		int offset;
+		int size;
+
+		if (snobj_type(field) != TYPE_MAP)
+			return snobj_err(EINVAL,
+					"'fields' must be a list of maps");
+
+		offset = snobj_eval_int(field, "offset");
+		size = snobj_eval_int(field, "size");
+
+		if (size < 1 || size > HLB_MAX_FIELD_SIZE)
+			return snobj_err(EINVAL, "'size' must be 1-%d",
+					HLB_MAX_FIELD_SIZE);
+
+		if (offset < 0 || offset + size > SNBUF_DATA)
+			return snobj_err(EINVAL, "invalid 'offset'");
+
+		if (pos + size > HLB_MAX_KEY_SIZE)
+			return snobj_err(EINVAL, "fields must be at most %d "
+					"bytes in total", HLB_MAX_KEY_SIZE);
+
+		f->offset = offset;
+		f->size = size;
+		f->pos = pos;
+		pos += size;
+	}
+
+	priv->num_fields = fields->size;
+	priv->key_words = (pos + 7) / 8;
+
+	return NULL;
+}
+
+static struct snobj *
+command_set_gates(struct module *m, const char *cmd, struct snobj *arg)
+{
+	struct hash_lb_priv *priv = get_priv(m);
+	gate_idx_t gates[HLB_MAX_GATES];
+	gate_idx_t *table;
+	int n;
+
+	if (snobj_type(arg) == TYPE_INT) {
+		n = snobj_int_get(arg);
+
+		if (n < 0 || n > HLB_MAX_GATES || n > MAX_GATES)
+			return snobj_err(EINVAL, "no more than %d gates",
+					MIN(HLB_MAX_GATES, MAX_GATES));
+
+		for (int i = 0; i < n; i++)
+			gates[i] = i;
+
+	} else if (snobj_type(arg) == TYPE_LIST) {
+		n = arg->size;
+
+		if (n > HLB_MAX_GATES)
+			return snobj_err(EINVAL, "no more than %d gates",
+					HLB_MAX_GATES);
+
+		for (int i = 0; i < n; i++) {
+			struct snobj *elem = snobj_list_get(arg, i);
+
+			if (snobj_type(elem) != TYPE_INT)
+				return snobj_err(EINVAL,
+						"'gate' must be an integer");
+
+			gates[i] = snobj_int_get(elem);
+			if (!is_valid_gate(gates[i]))
+				return snobj_err(EINVAL, "invalid gate %d",
+						gates[i]);
+
+			for (int j = 0; j < i; j++)
+				if (gates[j] == gates[i])
+					return snobj_err(EINVAL,
+							"duplicate gate %d",
+							gates[i]);
+		}
+
+	} else
+		return snobj_err(EINVAL, "argument must specify a gate "
+				"or a list of gates");
+
+	if (n == 0) {
+		table = NULL;
+	} else {
+		/* the copy not in use */
+		table = (priv->table == priv->tables[0]) ?
+			priv->tables[1] : priv->tables[0];
+		hlb_populate(table, gates, n);
+	}
+
+	STORE_BARRIER();
+	priv->table = table;
+	memcpy(priv->gates, gates, n * sizeof(gate_idx_t));
+	priv->num_gates = n;
+
+	/* the other copy may be overwritten by the next call */
+	synchronize_workers();
+
+	return NULL;
+}
+
+static struct snobj *hash_lb_init(struct module *m, struct snobj *arg)
+{
+	struct hash_lb_priv *priv = get_priv(m);
+	struct snobj *gates = NULL;
+	struct snobj *err;
+
+	if (snobj_type(arg) == TYPE_MAP) {
+		struct snobj *fields = snobj_eval(arg, "fields");
+		const char *hash = snobj_eval_str(arg, "hash");
+
+		if (fields) {
+			err = hlb_set_fields(priv, fields);
+			if (err)
+				return err;
+		}
+
+		/* "packet" (the fields) or "rss" (then the fields for 
+		 * packets without one) */
+		if (hash && strcmp(hash, "rss") == 0)
+			select_variant(m, "rss");
+		else if (hash && strcmp(hash, "packet") != 0)
+			return snobj_err(EINVAL, "'hash' must be either "
+					"'packet' or 'rss'");
+
+		gates = snobj_eval(arg, "gates");
+	} else
+		gates = arg;
+
+	if (!priv->num_fields) {
+		int pos = 0;
+
+		priv->num_fields = sizeof(hlb_default_fields) /
+			sizeof(hlb_default_fields[0]);
+		for (int i = 0; i < priv->num_fields; i++) {
+			priv->fields[i].offset = hlb_default_fields[i].offset;
+			priv->fields[i].size = hlb_default_fields[i].size;
+			priv->fields[i].pos = pos;
+			pos += hlb_default_fields[i].size;
+		}
+		priv->key_words = (pos + 7) / 8;
+	}
+
+	if (!gates)
+		return snobj_err(EINVAL, "'gates' must specify a gate "
+				"or a list of gates");
+
+	return command_set_gates(m, NULL, gates);
+}
+
+static struct snobj *hash_lb_get_desc(const struct module *m)
+{
+	const struct hash_lb_priv *priv = get_priv_const(m);
+
+	if (m->variant)
+		return snobj_str_fmt("%s hash, %d gates", m->variant,
+				priv->num_gates);
+
+	return snobj_str_fmt("%d fields, %d gates", priv->num_fields,
+			priv->num_gates);
+}
+
+static const struct mclass hash_lb = {
+	.name 			= "HashLB",
+	.help			=
+		"splits packets over gates by flow (consistent hashing)",
+	.def_module_name	= "hash_lb",
+	.num_igates		= 1,
+	.num_ogates		= MAX_GATES,
+	.priv_size		= sizeof(struct hash_lb_priv),
+	.init 			= hash_lb_init,
+	.process_batch 		= hash_lb_process_batch,
+	.variants		= {
+		{"rss",		hash_lb_process_batch_rss},
+	},
+	.get_desc		= hash_lb_get_desc,
+	.commands		= {
+		{"set_gates",	command_set_gates,	.mt_safe=1},
+	}
+};
+
+ADD_MCLASS(hash_lb)
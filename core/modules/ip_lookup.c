@@ -1,32 +1,573 @@
 #include "../module.h"
+#include "../parse.h"
 
 #include <arpa/inet.h>
 
-#include <rte_errno.h>
-#include <rte_lpm.h>
+#include <rte_malloc.h>
 #include <rte_byteorder.h>
 
-#define VECTOR_OPTIMIZATION	1
+/* DIR-24-8 tables for IPv4 and IPv6.
+ *
+ * tbl24 is indexed by the first 24 bits of the address. An entry is either
+ * the gate of the longest prefix covering it (up to /24), or the index of 
+ * a group of 256 entries in tbl8 for the next 8 bits of the address. For 
+ * IPv6, groups are chained the same way, 8 bits at a time, so a lookup 
+ * takes 1 + (prefix_len - 24) / 8 memory accesses at most. Each entry 
+ * also records the prefix length it came from, so a shorter prefix added 
+ * later does not overwrite a longer one.
+ *
+ * tbl24 takes 64MB. Every /24 (or, for IPv6, every 8-bit step beyond /24)
+ * with routes longer than itself takes a tbl8 group of 1KB; 
+ * "max_tbl8s" (and "max_tbl8s_v6") set how many can be allocated. The 
+ * IPv6 table is allocated on the first IPv6 route. */
+
+#define LPM_VALID		(1u << 31)
+#define LPM_EXT			(1u << 30)	/* points to a tbl8 group */
+#define LPM_DEPTH_SHIFT		22
+#define LPM_VAL_MASK		((1u << LPM_DEPTH_SHIFT) - 1)
+
+#define LPM_TBL24_SIZE		(1 << 24)
+#define LPM_GROUP_SIZE		256
+
+#define DEF_MAX_TBL8S		16384
+#define DEF_MAX_TBL8S_V6	16384
+#define MAX_TBL8S		(1 << 20)
+
+/* a route, kept to find the next shorter one when it is deleted */
+struct lpm_rule {
+	struct lpm_rule *next;
+	uint8_t addr[16];
+	uint8_t depth;
+	gate_idx_t gate;
+};
+
+struct lpm {
+	uint32_t *tbl24;
+	uint32_t *tbl8;
+	uint32_t max_tbl8s;
+	uint32_t n_tbl8s;	/* ever allocated (the rest are never used) */
+
+	/* groups no longer in use. Freed groups are pending until all 
+	 * workers are done with them (see lpm_reclaim()) */
+	uint32_t *free_tbl8s;
+	uint32_t n_free;
+	uint32_t *pending_tbl8s;
+	uint32_t n_pending;
+
+	uint32_t n_routes;
+	uint32_t n_buckets;
+	struct lpm_rule **rules;
+};
 
 struct ip_lookup_priv {
-	struct rte_lpm *lpm;
+	struct lpm v4;
+	struct lpm v6;		/* tbl24 is NULL until the first IPv6 route */
 	gate_idx_t default_gate;
+	gate_idx_t default_gate_v6;
+	int attr_id;		/* cached offsets, if there is a Parse module */
+	int prefetch_dist;
+	int socket;
 };
 
+static inline uint32_t lpm_entry(uint32_t val, int depth)
+{
+	return LPM_VALID | (depth << LPM_DEPTH_SHIFT) | val;
+}
+
+static inline int lpm_depth(uint32_t e)
+{
+	return (e >> LPM_DEPTH_SHIFT) & 0xff;
+}
+
+/* Workers may be reading the entry. Aligned 32-bit stores are atomic, 
+ * so they see either the old or the new one */
+static inline void lpm_set(uint32_t *e, uint32_t val)
+{
+	*(volatile uint32_t *)e = val;
+}
+
+/* Workers may be running (for the IPv6 table). t->tbl24 is set last */
+static int lpm_alloc(struct lpm *t, uint32_t max_tbl8s, int socket)
+{
+	uint32_t *tbl24;
+
+	tbl24 = rte_zmalloc_socket("ip_lookup_tbl24", 
+			LPM_TBL24_SIZE * sizeof(uint32_t), 0, socket);
+	t->tbl8 = rte_zmalloc_socket("ip_lookup_tbl8", 
+			(size_t)max_tbl8s * LPM_GROUP_SIZE * sizeof(uint32_t),
+			0, socket);
+	t->free_tbl8s = malloc(max_tbl8s * sizeof(uint32_t));
+	t->pending_tbl8s = malloc(max_tbl8s * sizeof(uint32_t));
+	t->n_buckets = 1024;
+	t->rules = calloc(t->n_buckets, sizeof(struct lpm_rule *));
+
+	if (!tbl24 || !t->tbl8 || !t->free_tbl8s || !t->pending_tbl8s ||
+			!t->rules)
+	{
+		rte_free(tbl24);
+		rte_free(t->tbl8);
+		free(t->free_tbl8s);
+		free(t->pending_tbl8s);
+		free(t->rules);
+		t->tbl8 = NULL;
+		return -ENOMEM;
+	}
+
+	t->max_tbl8s = max_tbl8s;
+	t->n_tbl8s = 0;
+	t->n_free = 0;
+	t->n_pending = 0;
+	t->n_routes = 0;
+
+	STORE_BARRIER();
+	t->tbl24 = tbl24;
+
+	return 0;
+}
+
+static void lpm_free_rules(struct lpm *t)
+{
+	for (uint32_t i = 0; i < t->n_buckets; i++) {
+		struct lpm_rule *r = t->rules[i];
+
+		while (r) {
+			struct lpm_rule *next = r->next;
+
+			free(r);
+			r = next;
+		}
+
+		t->rules[i] = NULL;
+	}
+
+	t->n_routes = 0;
+}
+
+static void lpm_free(struct lpm *t)
+{
+	if (!t->tbl24)
+		return;
+
+	lpm_free_rules(t);
+	free(t->rules);
+	free(t->free_tbl8s);
+	free(t->pending_tbl8s);
+	rte_free(t->tbl24);
+	rte_free(t->tbl8);
+	t->tbl24 = t->tbl8 = NULL;
+}
+
+/* The tables are emptied in place. Groups are reused only after
+ * synchronize_workers() */
+static void lpm_clear(struct lpm *t)
+{
+	if (!t->tbl24)
+		return;
+
+	for (int i = 0; i < LPM_TBL24_SIZE; i++)
+		lpm_set(&t->tbl24[i], 0);
+
+	lpm_free_rules(t);
+
+	synchronize_workers();
+
+	t->n_tbl8s = 0;
+	t->n_free = 0;
+	t->n_pending = 0;
+}
+
+/* Groups freed so far are not used by workers anymore, after a grace 
+ * period. Called once per batch of updates. */
+static void lpm_reclaim(struct lpm *t)
+{
+	if (!t->n_pending)
+		return;
+
+	synchronize_workers();
+
+	for (uint32_t i = 0; i < t->n_pending; i++)
+		t->free_tbl8s[t->n_free++] = t->pending_tbl8s[i];
+
+	t->n_pending = 0;
+}
+
+static uint32_t lpm_hash(const uint8_t *addr, int depth)
+{
+	uint32_t h = 2166136261u ^ depth;
+
+	for (int i = 0; i < 16; i++)
+		h = (h ^ addr[i]) * 16777619u;
+
+	return h;
+}
+
+static struct lpm_rule **lpm_find_rule(struct lpm *t, const uint8_t *addr,
+		int depth)
+{
+	struct lpm_rule **r;
+
+	r = &t->rules[lpm_hash(addr, depth) & (t->n_buckets - 1)];
+
+	for (; *r; r = &(*r)->next)
+		if ((*r)->depth == depth && memcmp((*r)->addr, addr, 16) == 0)
+			break;
+
+	return r;
+}
+
+/* doubles the hash table, if it is getting full */
+static void lpm_grow_rules(struct lpm *t)
+{
+	uint32_t n_buckets = t->n_buckets * 2;
+	struct lpm_rule **rules;
+
+	if (t->n_routes < t->n_buckets)
+		return;
+
+	rules = calloc(n_buckets, sizeof(struct lpm_rule *));
+	if (!rules)
+		return;		/* just slower */
+
+	for (uint32_t i = 0; i < t->n_buckets; i++) {
+		struct lpm_rule *r = t->rules[i];
+
+		while (r) {
+			struct lpm_rule *next = r->next;
+			uint32_t h = lpm_hash(r->addr, r->depth) & 
+				(n_buckets - 1);
+
+			r->next = rules[h];
+			rules[h] = r;
+			r = next;
+		}
+	}
+
+	free(t->rules);
+	t->rules = rules;
+	t->n_buckets = n_buckets;
+}
+
+/* Sets n entries to e_new (of the given depth), unless they are already
+ * from a longer prefix. Groups are updated recursively. */
+static void lpm_fill(struct lpm *t, uint32_t *e, int n, uint32_t e_new, 
+		int depth)
+{
+	for (int i = 0; i < n; i++) {
+		if (e[i] & LPM_EXT)
+			lpm_fill(t, &t->tbl8[(e[i] & LPM_VAL_MASK) * 
+					LPM_GROUP_SIZE],
+					LPM_GROUP_SIZE, e_new, depth);
+		else if (!(e[i] & LPM_VALID) || lpm_depth(e[i]) <= depth)
+			lpm_set(&e[i], e_new);
+	}
+}
+
+/* Reverts the entries of a deleted route (those of exactly its depth) 
+ * to e_old, the next shorter route or 0 */
+static void lpm_unfill(struct lpm *t, uint32_t *e, int n, uint32_t e_old,
+		int depth)
+{
+	for (int i = 0; i < n; i++) {
+		if (e[i] & LPM_EXT)
+			lpm_unfill(t, &t->tbl8[(e[i] & LPM_VAL_MASK) * 
+					LPM_GROUP_SIZE],
+					LPM_GROUP_SIZE, e_old, depth);
+		else if ((e[i] & LPM_VALID) && lpm_depth(e[i]) == depth)
+			lpm_set(&e[i], e_old);
+	}
+}
+
+/* Returns the group that *e points to, allocating one (with 256 copies of
+ * the current entry) if it is not extended yet. -ENOSPC if none left */
+static int lpm_extend(struct lpm *t, uint32_t *e)
+{
+	uint32_t *group;
+	uint32_t g;
+
+	if (*e & LPM_EXT)
+		return *e & LPM_VAL_MASK;
+
+	if (t->n_free)
+		g = t->free_tbl8s[--t->n_free];
+	else if (t->n_tbl8s < t->max_tbl8s)
+		g = t->n_tbl8s++;
+	else
+		return -ENOSPC;
+
+	group = &t->tbl8[g * LPM_GROUP_SIZE];
+
+	for (int i = 0; i < LPM_GROUP_SIZE; i++)
+		group[i] = *e;
+
+	/* the group must be complete before workers can see it */
+	STORE_BARRIER();
+	lpm_set(e, LPM_VALID | LPM_EXT | g);
+
+	return g;
+}
+
+/* If all entries of the group that *e points to are the same (and not 
+ * extended), replaces *e with the entry and frees the group. 
+ * bits: resolved at the level of *e. Entries of longer routes (e.g., two
+ * /25s with the same gate) must stay in the group, where later adds and 
+ * deletes of those routes expect them */
+static int lpm_collapse(struct lpm *t, uint32_t *e, int bits)
+{
+	uint32_t g = *e & LPM_VAL_MASK;
+	uint32_t *group = &t->tbl8[g * LPM_GROUP_SIZE];
+
+	if ((group[0] & LPM_EXT) || lpm_depth(group[0]) > bits)
+		return 0;
+
+	for (int i = 1; i < LPM_GROUP_SIZE; i++)
+		if (group[i] != group[0])
+			return 0;
+
+	lpm_set(e, group[0]);
+	t->pending_tbl8s[t->n_pending++] = g;
+
+	return 1;
+}
+
+/* Walks down to the level that covers depth, extending entries on the way
+ * if create is set. Returns the first entry of the range and its size, 
+ * and the entries that point to each group on the way in path[] */
+static uint32_t *lpm_walk(struct lpm *t, const uint8_t *addr, int depth,
+		int create, int *n, uint32_t **path, int *path_len)
+{
+	uint32_t idx = (addr[0] << 16) | (addr[1] << 8) | addr[2];
+	uint32_t *e;
+	int bits = 24;		/* resolved by the current level */
+	int b = 3;		/* next byte of addr */
+
+	*path_len = 0;
+
+	if (depth <= 24) {
+		*n = 1 << (24 - depth);
+		return &t->tbl24[idx];
+	}
+
+	e = &t->tbl24[idx];
+
+	for (;;) {
+		uint32_t *group;
+		int g;
+
+		if (create)
+			g = lpm_extend(t, e);
+		else
+			g = (*e & LPM_EXT) ? (int)(*e & LPM_VAL_MASK) : -ENOENT;
+
+		if (g < 0)
+			return NULL;
+
+		path[(*path_len)++] = e;
+		group = &t->tbl8[g * LPM_GROUP_SIZE];
+		bits += 8;
+
+		if (depth <= bits) {
+			*n = 1 << (bits - depth);
+			return &group[addr[b]];
+		}
+
+		e = &group[addr[b++]];
+	}
+}
+
+#define LPM_MAX_LEVELS		14	/* 24 + 13 * 8 = 128 bits */
+
+/* addr is in network order (addr_len bytes, zero-padded to 16), with no
+ * bits set beyond depth. Returns 0 or -errno */
+static int lpm_add(struct lpm *t, const uint8_t *addr, int depth, 
+		gate_idx_t gate)
+{
+	struct lpm_rule **pr = lpm_find_rule(t, addr, depth);
+	uint32_t *path[LPM_MAX_LEVELS];
+	int path_len;
+	uint32_t *e;
+	int n;
+
+	if (!*pr) {
+		struct lpm_rule *r = calloc(1, sizeof(*r));
+
+		if (!r)
+			return -ENOMEM;
+
+		e = lpm_walk(t, addr, depth, 1, &n, path, &path_len);
+		if (!e) {
+			free(r);
+			return -ENOSPC;
+		}
+
+		memcpy(r->addr, addr, 16);
+		r->depth = depth;
+		*pr = r;
+		t->n_routes++;
+	} else
+		e = lpm_walk(t, addr, depth, 1, &n, path, &path_len);
+
+	(*pr)->gate = gate;
+	lpm_fill(t, e, n, lpm_entry(gate, depth), depth);
+	lpm_grow_rules(t);
+
+	return 0;
+}
+
+/* Groups freed here go to pending_tbl8s[]; call lpm_reclaim() after */
+static int lpm_delete(struct lpm *t, const uint8_t *addr, int depth)
+{
+	struct lpm_rule **pr = lpm_find_rule(t, addr, depth);
+	struct lpm_rule *r = *pr;
+	uint32_t *path[LPM_MAX_LEVELS];
+	int path_len;
+	uint32_t e_old = 0;
+	uint32_t *e;
+	int n;
+
+	if (!r)
+		return -ENOENT;
+
+	/* the next shorter route that covers this one, if any */
+	for (int d = depth - 1; d > 0; d--) {
+		uint8_t parent[16];
+		struct lpm_rule *pr;
+
+		memcpy(parent, addr, 16);
+		parent[d / 8] &= (uint8_t)(0xff << (8 - d % 8));
+		memset(parent + (d + 7) / 8, 0, 16 - (d + 7) / 8);
+
+		pr = *lpm_find_rule(t, parent, d);
+		if (pr) {
+			e_old = lpm_entry(pr->gate, d);
+			break;
+		}
+	}
+
+	e = lpm_walk(t, addr, depth, 0, &n, path, &path_len);
+	if (e)
+		lpm_unfill(t, e, n, e_old, depth);
+
+	/* from the deepest group, while they become uniform. 
+	 * path[i] is at the level that resolves 24 + 8 * i bits */
+	for (int i = path_len - 1; i >= 0; i--)
+		if (!lpm_collapse(t, path[i], 24 + 8 * i))
+			break;
+
+	*pr = r->next;
+	free(r);
+	t->n_routes--;
+
+	return 0;
+}
+
+/* addr in cpu order */
+static inline gate_idx_t lpm_lookup4(const struct lpm *t, uint32_t addr,
+		gate_idx_t default_gate)
+{
+	uint32_t e = t->tbl24[addr >> 8];
+
+	if (unlikely(e & LPM_EXT))
+		e = t->tbl8[(e & LPM_VAL_MASK) * LPM_GROUP_SIZE + 
+			(addr & 0xff)];
+
+	return (e & LPM_VALID) ? (e & LPM_VAL_MASK) : default_gate;
+}
+
+static inline gate_idx_t lpm_lookup6(const struct lpm *t, 
+		const uint8_t *addr, gate_idx_t default_gate)
+{
+	uint32_t e = t->tbl24[(addr[0] << 16) | (addr[1] << 8) | addr[2]];
+	int b = 3;
+
+	while (e & LPM_EXT)
+		e = t->tbl8[(e & LPM_VAL_MASK) * LPM_GROUP_SIZE + addr[b++]];
+
+	return (e & LPM_VALID) ? (e & LPM_VAL_MASK) : default_gate;
+}
+
+#if __AVX2__
+/* 8 addresses (in cpu order) at a time, with gathers */
+static inline void lpm_lookup4_x8(const struct lpm *t, const uint32_t *addrs,
+		gate_idx_t *gates, gate_idx_t default_gate)
+{
+	const __m256i ext = _mm256_set1_epi32(LPM_VALID | LPM_EXT);
+	const __m256i val_mask = _mm256_set1_epi32(LPM_VAL_MASK);
+	const __m256i byte_mask = _mm256_set1_epi32(0xff);
+
+	__m256i addr = _mm256_loadu_si256((const __m256i *)addrs);
+	__m256i e;
+	__m256i is_ext;
+	__m256i gate;
+	__m256i packed;
+
+	e = _mm256_i32gather_epi32((const int *)t->tbl24, 
+			_mm256_srli_epi32(addr, 8), 4);
+
+	is_ext = _mm256_cmpeq_epi32(_mm256_and_si256(e, ext), ext);
+
+	if (unlikely(!_mm256_testz_si256(is_ext, is_ext))) {
+		__m256i idx;
+
+		idx = _mm256_or_si256(
+			_mm256_slli_epi32(_mm256_and_si256(e, val_mask), 8),
+			_mm256_and_si256(addr, byte_mask));
+
+		e = _mm256_mask_i32gather_epi32(e, (const int *)t->tbl8, 
+				idx, is_ext, 4);
+	}
+
+	/* the sign bit is LPM_VALID */
+	gate = _mm256_blendv_epi8(_mm256_set1_epi32(default_gate),
+			_mm256_and_si256(e, val_mask), 
+			_mm256_srai_epi32(e, 31));
+
+	/* 32 -> 16 bits. packus works within each 128-bit lane */
+	packed = _mm256_packus_epi32(gate, gate);
+	packed = _mm256_permute4x64_epi64(packed, 0x08);
+	_mm_storeu_si128((__m128i *)gates, _mm256_castsi256_si128(packed));
+}
+#endif
+
 static struct snobj *ip_lookup_init(struct module *m, struct snobj *arg)
 {
 	struct ip_lookup_priv *priv = get_priv(m);
 
+	int64_t max_tbl8s = DEF_MAX_TBL8S;
+	int64_t max_tbl8s_v6 = DEF_MAX_TBL8S_V6;
+
 	priv->default_gate = DROP_GATE;
+	priv->default_gate_v6 = DROP_GATE;
+	priv->prefetch_dist = SNB_PREFETCH_DIST_DEFAULT;
+	priv->socket = m->socket;
+
+	if (arg && snobj_eval_exists(arg, "max_tbl8s"))
+		max_tbl8s = snobj_eval_int(arg, "max_tbl8s");
+
+	if (arg && snobj_eval_exists(arg, "max_tbl8s_v6"))
+		max_tbl8s_v6 = snobj_eval_int(arg, "max_tbl8s_v6");
 
-	priv->lpm = rte_lpm_create(m->name, 
-			/* socket_id = */ 0,
-			/* max_rules = */ 65536,
-			/* flags = */ 0);
+	if (max_tbl8s <= 0 || max_tbl8s > MAX_TBL8S ||
+			max_tbl8s_v6 <= 0 || max_tbl8s_v6 > MAX_TBL8S)
+		return snobj_err(EINVAL, "'max_tbl8s' and 'max_tbl8s_v6' "
+				"must be between 1 and %d", MAX_TBL8S);
 
-	if (!priv->lpm)
-		return snobj_err(rte_errno, "DPDK error: %s", 
-				rte_strerror(rte_errno));
+	priv->v6.max_tbl8s = max_tbl8s_v6;
+
+	if (arg && snobj_eval(arg, "prefetch")) {
+		struct snobj *err;
+
+		err = get_prefetch_dist(snobj_eval(arg, "prefetch"), 
+				&priv->prefetch_dist);
+		if (err)
+			return err;
+	}
+
+	priv->attr_id = add_parse_attr(m, MT_READ);
+	if (priv->attr_id < 0)
+		return snobj_errno(-priv->attr_id);
+
+	if (lpm_alloc(&priv->v4, max_tbl8s, priv->socket))
+		return snobj_errno(ENOMEM);
 	
 	return NULL;
 }
@@ -35,113 +576,142 @@ static void ip_lookup_deinit(struct module *m)
 {
 	struct ip_lookup_priv *priv = get_priv(m);
 
-	rte_lpm_free(priv->lpm);
+	lpm_free(&priv->v4);
+	lpm_free(&priv->v6);
+}
+
+/* Returns the L3 header. Packets that are not IPv6 are taken as IPv4 */
+static inline char *get_ip_hdr(struct module *m, int attr_id, int parsed, 
+		struct snbuf *pkt, int *is_v6)
+{
+	char *head = snb_head_data(pkt);
+
+	if (parsed) {
+		struct pkt_parse *p = get_parse(m, attr_id, pkt);
+
+		*is_v6 = (p->flags & PARSE_IPV6) != 0;
+		return head + p->l3_offset;
+	} else {
+		struct ether_hdr *eth = (struct ether_hdr *)head;
+
+		*is_v6 = (eth->ether_type == 
+				rte_cpu_to_be_16(ETHER_TYPE_IPv6));
+		return head + sizeof(struct ether_hdr);
+	}
 }
 
 static void ip_lookup_process_batch(struct module *m, struct pkt_batch *batch)
 {
 	struct ip_lookup_priv *priv = get_priv(m);
 	gate_idx_t ogates[MAX_PKT_BURST];
-	gate_idx_t default_gate = priv->default_gate;
-
-	int cnt = batch->cnt;
-	int i = 0;
-
-#if VECTOR_OPTIMIZATION
-	const __m128i bswap_mask = _mm_set_epi8(12, 13, 14, 15, 
-						8, 9, 10, 11, 
-						4, 5, 6, 7, 
-						0, 1, 2, 3);
+	int attr_id = priv->attr_id;
+	int parsed = parse_available(m, attr_id);
+	int dist = priv->prefetch_dist;
 
-	/* 4 at a time */
-	for(; i + 3 < cnt; i += 4) {
-		struct ether_hdr *eth; 
-		struct ipv4_hdr *ip;
+	/* IPv4 packets are looked up together, after the loop */
+	uint32_t addrs[MAX_PKT_BURST];
+	gate_idx_t gates[MAX_PKT_BURST];
+	uint8_t idx[MAX_PKT_BURST];
+	int n4 = 0;
+	int j = 0;
 
-		uint32_t a0, a1, a2, a3;
+	int cnt = batch->cnt;
 
-		__m128i ip_addr;
+	snb_prefetch_start(batch, dist);
 
-		eth = (struct ether_hdr *)snb_head_data(batch->pkts[i+0]);
-		ip = (struct ipv4_hdr *)(eth + 1);
-		a0 = ip->dst_addr;
+	for (int i = 0; i < cnt; i++) {
+		char *l3;
+		int is_v6;
 
-		eth = (struct ether_hdr *)snb_head_data(batch->pkts[i+1]);
-		ip = (struct ipv4_hdr *)(eth + 1);
-		a1 = ip->dst_addr;
+		snb_prefetch_ahead(batch, i, dist);
 
-		eth = (struct ether_hdr *)snb_head_data(batch->pkts[i+2]);
-		ip = (struct ipv4_hdr *)(eth + 1);
-		a2 = ip->dst_addr;
+		l3 = get_ip_hdr(m, attr_id, parsed, batch->pkts[i], &is_v6);
 
-		eth = (struct ether_hdr *)snb_head_data(batch->pkts[i+3]);
-		ip = (struct ipv4_hdr *)(eth + 1);
-		a3 = ip->dst_addr;
+		if (likely(!is_v6)) {
+			struct ipv4_hdr *ip = (struct ipv4_hdr *)l3;
 
-		ip_addr = _mm_set_epi32(a3, a2, a1, a0);
-		ip_addr = _mm_shuffle_epi8(ip_addr, bswap_mask);
+			addrs[n4] = rte_be_to_cpu_32(ip->dst_addr);
+			idx[n4++] = i;
+		} else if (priv->v6.tbl24) {
+			struct ipv6_hdr *ip = (struct ipv6_hdr *)l3;
 
-		rte_lpm_lookupx4(priv->lpm, ip_addr, &ogates[i], 
-				default_gate);
+			ogates[i] = lpm_lookup6(&priv->v6, ip->dst_addr, 
+					priv->default_gate_v6);
+		} else
+			ogates[i] = priv->default_gate_v6;
 	}
-#endif
 
-	/* process the rest one by one */
-	for (; i < cnt; i++) {
-		struct ether_hdr *eth; 
-		struct ipv4_hdr *ip;
+#if __AVX2__
+	for (; j + 7 < n4; j += 8)
+		lpm_lookup4_x8(&priv->v4, &addrs[j], &gates[j], 
+				priv->default_gate);
+#endif
 
-		gate_idx_t next_hop;
-		int ret;	
-		
-		eth = (struct ether_hdr *)snb_head_data(batch->pkts[i]);
-		ip = (struct ipv4_hdr *)(eth + 1);
+	for (; j < n4; j++)
+		gates[j] = lpm_lookup4(&priv->v4, addrs[j], 
+				priv->default_gate);
 
-		ret = rte_lpm_lookup(priv->lpm, 
-				rte_be_to_cpu_32(ip->dst_addr), 
-				(uint8_t *)&next_hop);
+	if (likely(n4 == cnt))
+		run_split(m, gates, batch);
+	else {
+		for (j = 0; j < n4; j++)
+			ogates[idx[j]] = gates[j];
 
-		if (ret == 0)
-			ogates[i] = next_hop;
-		else
-			ogates[i] = default_gate;
+		run_split(m, ogates, batch);
 	}
-
-	run_split(m, ogates, batch);
 }
 
-struct snobj *command_add(struct module *m, const char *cmd, struct snobj *arg)
+/* parses {"prefix", "prefix_len"} into addr (zero-padded to 16 bytes) */
+static struct snobj *parse_prefix(struct snobj *arg, uint8_t *addr, 
+		int *prefix_len, int *is_v6)
 {
-	struct ip_lookup_priv *priv = get_priv(m);
-	
 	char *prefix = snobj_eval_str(arg, "prefix");
-	uint32_t prefix_len = snobj_eval_uint(arg, "prefix_len");
-	gate_idx_t gate = snobj_eval_uint(arg, "gate");
-
-	struct in_addr ip_addr_be;
-	uint32_t ip_addr;		/* in cpu order */
-	uint32_t netmask;
+	int len = snobj_eval_int(arg, "prefix_len");
 	int ret;
 
 	if (!prefix || !snobj_eval_exists(arg, "prefix_len"))
 		return snobj_err(EINVAL, 
 				"'prefix' or 'prefix_len' is missing");
 
-	ret = inet_aton(prefix, &ip_addr_be);
-	if (!ret)
+	*is_v6 = (strchr(prefix, ':') != NULL);
+
+	memset(addr, 0, 16);
+	ret = inet_pton(*is_v6 ? AF_INET6 : AF_INET, prefix, addr);
+	if (ret != 1)
 		return snobj_err(EINVAL, "Invalid IP prefix: %s",
 				prefix);
 
-	if (prefix_len > 32)
-		return snobj_err(EINVAL, "Invalid prefix length: %d",
-				prefix_len);
+	if (len < 0 || len > (*is_v6 ? 128 : 32))
+		return snobj_err(EINVAL, "Invalid prefix length: %d", len);
+
+	for (int i = 0; i < 16; i++) {
+		int bits = RTE_MIN(8, RTE_MAX(0, len - i * 8));
+		uint8_t mask = bits ? (uint8_t)(0xff << (8 - bits)) : 0;
 
-	ip_addr = rte_be_to_cpu_32(ip_addr_be.s_addr);
-	netmask = ~0 ^ ((1 << (32 - prefix_len)) - 1);
+		if (addr[i] & ~mask)
+			return snobj_err(EINVAL, "Invalid IP prefix %s/%d",
+					prefix, len);
+	}
+
+	*prefix_len = len;
 
-	if (ip_addr & ~netmask)
-		return snobj_err(EINVAL, "Invalid IP prefix %s/%d %x %x",
-				prefix, prefix_len, ip_addr, netmask);
+	return NULL;
+}
+
+static struct snobj *add_route(struct ip_lookup_priv *priv, 
+		struct snobj *arg)
+{
+	gate_idx_t gate = snobj_eval_uint(arg, "gate");
+
+	struct snobj *err;
+	uint8_t addr[16];
+	int prefix_len;
+	int is_v6;
+	int ret;
+
+	err = parse_prefix(arg, addr, &prefix_len, &is_v6);
+	if (err)
+		return err;
 
 	if (!snobj_eval_exists(arg, "gate"))
 		return snobj_err(EINVAL, 
@@ -150,45 +720,238 @@ struct snobj *command_add(struct module *m, const char *cmd, struct snobj *arg)
 	if (!is_valid_gate(gate))
 		return snobj_err(EINVAL, "Invalid gate: %hu", gate);
 
-	if (prefix_len == 0)
-		priv->default_gate = gate;
-	else {
-		/* only in DPDK 2.2 or older */
-		if (gate >= 256)
-			return snobj_err(EINVAL, 
-					"'gate' should be < 256");
+	if (prefix_len == 0) {
+		if (is_v6)
+			priv->default_gate_v6 = gate;
+		else
+			priv->default_gate = gate;
+		return NULL;
+	}
+
+	if (is_v6) {
+		if (!priv->v6.tbl24 && lpm_alloc(&priv->v6, 
+					priv->v6.max_tbl8s, priv->socket))
+			return snobj_errno(ENOMEM);
+
+		ret = lpm_add(&priv->v6, addr, prefix_len, gate);
+	} else
+		ret = lpm_add(&priv->v4, addr, prefix_len, gate);
+
+	if (ret == -ENOSPC)
+		return snobj_err(ENOSPC, "No tbl8 group left for %s/%d "
+				"(see 'max_tbl8s%s')", 
+				snobj_eval_str(arg, "prefix"), prefix_len,
+				is_v6 ? "_v6" : "");
+	else if (ret)
+		return snobj_errno(-ret);
+
+	return NULL;
+}
 
-		ret = rte_lpm_add(priv->lpm, ip_addr, prefix_len, gate); 
-		if (ret)
-			return snobj_err(-ret, "rpm_lpm_add() failed");
+static struct snobj *delete_route(struct ip_lookup_priv *priv, 
+		struct snobj *arg)
+{
+	struct snobj *err;
+	uint8_t addr[16];
+	int prefix_len;
+	int is_v6;
+	int ret;
+
+	err = parse_prefix(arg, addr, &prefix_len, &is_v6);
+	if (err)
+		return err;
+
+	if (prefix_len == 0) {
+		if (is_v6)
+			priv->default_gate_v6 = DROP_GATE;
+		else
+			priv->default_gate = DROP_GATE;
+		return NULL;
+	}
+
+	if (is_v6)
+		ret = priv->v6.tbl24 ? 
+			lpm_delete(&priv->v6, addr, prefix_len) : -ENOENT;
+	else
+		ret = lpm_delete(&priv->v4, addr, prefix_len);
+
+	if (ret == -ENOENT)
+		return snobj_err(ENOENT, "No such route: %s/%d", 
+				snobj_eval_str(arg, "prefix"), prefix_len);
+
+	return NULL;
+}
+
+/* a route, or a list of them */
+static struct snobj *for_each_route(struct ip_lookup_priv *priv, 
+		struct snobj *arg,
+		struct snobj *(*func)(struct ip_lookup_priv *, struct snobj *))
+{
+	if (!arg)
+		return NULL;
+
+	if (snobj_type(arg) != TYPE_LIST)
+		return func(priv, arg);
+
+	for (int i = 0; i < arg->size; i++) {
+		struct snobj *err = func(priv, snobj_list_get(arg, i));
+
+		if (err)
+			return err;
 	}
 
 	return NULL;
 }
 
-struct snobj *
+/* Route updates do not need workers to be paused. Each entry of the
+ * tables is updated with a single store, so a lookup sees either the old
+ * or the new route. Groups that become unused are given a grace period
+ * (synchronize_workers()) once per command, before they are reused. */
+
+/* a route {"prefix", "prefix_len", "gate"}, or a list of them */
+static struct snobj *
+command_add(struct module *m, const char *cmd, struct snobj *arg)
+{
+	return for_each_route(get_priv(m), arg, add_route);
+}
+
+/* a route {"prefix", "prefix_len"}, or a list of them */
+static struct snobj *
+command_delete(struct module *m, const char *cmd, struct snobj *arg)
+{
+	struct ip_lookup_priv *priv = get_priv(m);
+	struct snobj *err;
+	
+	err = for_each_route(priv, arg, delete_route);
+
+	lpm_reclaim(&priv->v4);
+	lpm_reclaim(&priv->v6);
+
+	return err;
+}
+
+/* {"delete": [routes], "add": [routes]}, in this order. For BGP updates 
+ * (withdrawals and announcements) in bulk */
+static struct snobj *
+command_update(struct module *m, const char *cmd, struct snobj *arg)
+{
+	struct ip_lookup_priv *priv = get_priv(m);
+	struct snobj *err;
+	
+	if (snobj_type(arg) != TYPE_MAP)
+		return snobj_err(EINVAL, "Argument must be a map of 'delete' "
+				"and 'add' lists");
+	
+	err = for_each_route(priv, snobj_eval(arg, "delete"), delete_route);
+	if (!err)
+		err = for_each_route(priv, snobj_eval(arg, "add"), add_route);
+
+	lpm_reclaim(&priv->v4);
+	lpm_reclaim(&priv->v6);
+
+	return err;
+}
+
+static struct snobj *
 command_clear(struct module *m, const char *cmd, struct snobj *arg)
 {
 	struct ip_lookup_priv *priv = get_priv(m);
 	
-	rte_lpm_delete_all(priv->lpm);
+	lpm_clear(&priv->v4);
+	lpm_clear(&priv->v6);
 	priv->default_gate = DROP_GATE;
+	priv->default_gate_v6 = DROP_GATE;
 	return NULL;
 }
 
+static struct snobj *ip_lookup_get_desc(const struct module *m)
+{
+	const struct ip_lookup_priv *priv = get_priv_const(m);
+
+	return snobj_str_fmt("%u/%u IPv4/IPv6 routes", 
+			priv->v4.n_routes, priv->v6.n_routes);
+}
+
+static struct snobj *
+command_set_prefetch(struct module *m, const char *cmd, struct snobj *arg)
+{
+	struct ip_lookup_priv *priv = get_priv(m);
+
+	return get_prefetch_dist(arg, &priv->prefetch_dist);
+}
+
+static struct snobj *route_to_snobj(const uint8_t *addr, int depth,
+		gate_idx_t gate, int is_v6)
+{
+	struct snobj *route = snobj_map();
+	char buf[INET6_ADDRSTRLEN];
+
+	inet_ntop(is_v6 ? AF_INET6 : AF_INET, addr, buf, sizeof(buf));
+
+	snobj_map_set(route, "prefix", snobj_str(buf));
+	snobj_map_set(route, "prefix_len", snobj_int(depth));
+	snobj_map_set(route, "gate", snobj_uint(gate));
+
+	return route;
+}
+
+static void lpm_snapshot(const struct lpm *t, int is_v6, struct snobj *routes)
+{
+	if (!t->tbl24)
+		return;
+
+	for (uint32_t i = 0; i < t->n_buckets; i++)
+		for (struct lpm_rule *r = t->rules[i]; r; r = r->next)
+			snobj_list_add(routes, route_to_snobj(r->addr,
+					r->depth, r->gate, is_v6));
+}
+
+/* all routes (including the default ones) in a single "add" */
+static struct snobj *ip_lookup_get_snapshot(const struct module *m)
+{
+	const struct ip_lookup_priv *priv = get_priv_const(m);
+	static const uint8_t zero[16];
+
+	struct snobj *cmds = snobj_list();
+	struct snobj *routes = snobj_list();
+	struct snobj *cmd;
+
+	if (priv->default_gate != DROP_GATE)
+		snobj_list_add(routes, route_to_snobj(zero, 0,
+				priv->default_gate, 0));
+	if (priv->default_gate_v6 != DROP_GATE)
+		snobj_list_add(routes, route_to_snobj(zero, 0,
+				priv->default_gate_v6, 1));
+
+	lpm_snapshot(&priv->v4, 0, routes);
+	lpm_snapshot(&priv->v6, 1, routes);
+
+	cmd = snobj_map();
+	snobj_map_set(cmd, "cmd", snobj_str("add"));
+	snobj_map_set(cmd, "arg", routes);
+	snobj_list_add(cmds, cmd);
+
+	return cmds;
+}
+
 static const struct mclass ip_lookup = {
 	.name            = "IPLookup",
-	.help		 = "performs Longest Prefix Match on IPv4 packets",
+	.help		 = "performs Longest Prefix Match on IPv4/IPv6 packets",
 	.def_module_name = "ip_lookup",
 	.num_igates	 = 1,
 	.num_ogates	 = MAX_GATES,
 	.priv_size       = sizeof(struct ip_lookup_priv),
 	.init            = ip_lookup_init,
 	.deinit          = ip_lookup_deinit,
+	.get_desc	 = ip_lookup_get_desc,
+	.get_snapshot	 = ip_lookup_get_snapshot,
 	.process_batch   = ip_lookup_process_batch,
 	.commands	 = {
-		{"add", 	command_add},
-		{"clear", 	command_clear},
+		{"add", 	command_add, .mt_safe=1},
+		{"delete", 	command_delete, .mt_safe=1},
+		{"update", 	command_update, .mt_safe=1},
+		{"clear", 	command_clear, .mt_safe=1},
+		{"set_prefetch",command_set_prefetch, .mt_safe=1},
 	}
 };
 
@@ -1,9 +1,12 @@
 #include "../module.h"
 
+#include "../master.h"
+#include "../time.h"
 #include "../utils/simd.h"
 
 #include <rte_hash_crc.h>
 #include <rte_prefetch.h>
+#include <rte_spinlock.h>
 
 #define MAX_TABLE_SIZE (1048576*64)
 #define DEFAULT_TABLE_SIZE (1048576)
@@ -17,6 +20,21 @@
 
 #define USE_RTEMALLOC (1)
 
+/* Timestamps of learned entries are in units of 2^L2_TS_SHIFT cycles
+ * (~0.35ms at 3GHz), so 32 bits wrap around only after a couple of weeks */
+#define L2_TS_SHIFT (20)
+
+/* in seconds, as in most hardware switches */
+#define DEFAULT_AGE (300)
+
+/* slots visited by the aging task per run */
+#define L2_AGING_SWEEP (1024)
+
+/* The table grows (doubles) once half full. With single-step cuckoo moves,
+ * inserts start failing at around 2/3 load. */
+#define L2_GROW_THRESHOLD(slots) ((slots) / 2)
+#define L2_RESIZE_CHECK_NS (100000000ul)
+
 struct l2_entry
 {
 	union {
@@ -36,6 +54,10 @@ struct l2_table
 	uint64_t size_power;
 	uint64_t bucket;
 	uint64_t count;
+
+	/* last time each slot was seen as a source address (only with aging).
+	 * 0 for static entries, which never expire. */
+	uint32_t *ts;
 };
 
 typedef uint64_t mac_addr_t;
@@ -109,8 +131,10 @@ static int l2_deinit(struct l2_table *l2tbl)
 
 #if USE_RTEMALLOC
 	rte_free(l2tbl->table);
+	rte_free(l2tbl->ts);
 #else
 	free(l2tbl->table);
+	free(l2tbl->ts);
 #endif
 
 	memset(l2tbl, 0, sizeof(struct l2_table));
@@ -137,7 +161,7 @@ static uint32_t l2_alt_index(uint32_t hash, uint32_t size_power, uint32_t index)
 {
 	uint64_t tag =  (hash >> size_power) + 1;
 	tag = tag * 0x5bd1e995;
-	return (index ^ tag) & ((0x1lu << (size_power - 1)) - 1);
+	return (index ^ tag) & ((0x1lu << size_power) - 1);
 }
 
 
@@ -180,33 +204,32 @@ static inline int find_index(uint64_t addr, uint64_t *table, const uint64_t coun
 }
 
 
-static inline int l2_find(struct l2_table *l2tbl,
-			  uint64_t addr, gate_idx_t *gate)
+#define L2_NOT_FOUND (UINT32_MAX)
+
+/* searches the buckets of the two candidate indexes */
+static inline int l2_lookup_idx(struct l2_table *l2tbl, uint64_t addr,
+				uint32_t idx1, uint32_t idx2,
+				uint32_t *offset_out)
 {
 	int i;
-	int ret = -ENOENT;
-	uint32_t hash, idx1, offset;
+	uint32_t offset;
 	struct l2_entry *tbl = l2tbl->table;
 
-	hash = l2_hash(addr);
-	idx1 = l2_hash_to_index(hash, l2tbl->size);
-
 	offset = l2_ib_to_offset(l2tbl, idx1, 0);
 
 	if (l2tbl->bucket == 4) {
 		int tmp1 = find_index(addr, &tbl[offset].entry, l2tbl->count);
 		if (tmp1) {
-			*gate  = tbl[offset + tmp1 - 1].gate;
+			*offset_out = offset + tmp1 - 1;
 			return 0;
 		}
 
-		idx1 = l2_alt_index(hash, l2tbl->size_power, idx1);
-		offset = l2_ib_to_offset(l2tbl, idx1, 0);
+		offset = l2_ib_to_offset(l2tbl, idx2, 0);
 
 		int tmp2 = find_index(addr, &tbl[offset].entry, l2tbl->count);
 
 		if (tmp2) {
-			*gate  = tbl[offset + tmp2 - 1].gate;
+			*offset_out = offset + tmp2 - 1;
 			return 0;
 		}
 
@@ -214,19 +237,18 @@ static inline int l2_find(struct l2_table *l2tbl,
 		/* search buckets for first index */
 		for (i = 0; i < l2tbl->bucket; i++) {
 			if (tbl[offset].occupied && addr == tbl[offset].addr) {
-				*gate = tbl[offset].gate;
+				*offset_out = offset;
 				return 0;
 			}
 
 			offset++;
 		}
 
-		idx1 = l2_alt_index(hash, l2tbl->size_power, idx1);
-		offset = l2_ib_to_offset(l2tbl, idx1, 0);
+		offset = l2_ib_to_offset(l2tbl, idx2, 0);
 		/* search buckets for alternate index */
 		for (i = 0; i < l2tbl->bucket; i++) {
 			if (tbl[offset].occupied && addr == tbl[offset].addr) {
-				*gate = tbl[offset].gate;
+				*offset_out = offset;
 				return 0;
 			}
 
@@ -234,7 +256,72 @@ static inline int l2_find(struct l2_table *l2tbl,
 		}
 	}
 
-	return ret;
+	return -ENOENT;
+}
+
+/* the datapath version of l2_find_offset() */
+static inline int l2_lookup(struct l2_table *l2tbl,
+			    uint64_t addr, uint32_t *offset_out)
+{
+	uint32_t hash = l2_hash(addr);
+	uint32_t idx1 = l2_hash_to_index(hash, l2tbl->size);
+	uint32_t idx2 = l2_alt_index(hash, l2tbl->size_power, idx1);
+
+	return l2_lookup_idx(l2tbl, addr, idx1, idx2, offset_out);
+}
+
+/* Looks up cnt (<= MAX_PKT_BURST) addresses at once. All addresses are
+ * hashed and both of their candidate buckets are prefetched first, so that
+ * the cache misses overlap. offsets[i] is L2_NOT_FOUND for misses. */
+static inline void l2_lookup_bulk(struct l2_table *l2tbl,
+		const mac_addr_t *addrs, int cnt, uint32_t *offsets)
+{
+	uint32_t idx1[MAX_PKT_BURST];
+	uint32_t idx2[MAX_PKT_BURST];
+	struct l2_entry *tbl = l2tbl->table;
+
+	for (int i = 0; i < cnt; i++) {
+		uint32_t hash = l2_hash(addrs[i]);
+
+		idx1[i] = l2_hash_to_index(hash, l2tbl->size);
+		idx2[i] = l2_alt_index(hash, l2tbl->size_power, idx1[i]);
+
+		/* a bucket (<= 32 bytes) never spans two cache lines */
+		rte_prefetch0(&tbl[l2_ib_to_offset(l2tbl, idx1[i], 0)]);
+		rte_prefetch0(&tbl[l2_ib_to_offset(l2tbl, idx2[i], 0)]);
+	}
+
+	for (int i = 0; i < cnt; i++) {
+		if (l2_lookup_idx(l2tbl, addrs[i], idx1[i], idx2[i],
+					&offsets[i]))
+			offsets[i] = L2_NOT_FOUND;
+	}
+}
+
+/* The entry may have been deleted (aged out) by another thread since it
+ * was found. Read it once to get a consistent view. */
+static inline int l2_get_gate(struct l2_table *l2tbl, uint32_t offset,
+			      gate_idx_t *gate)
+{
+	struct l2_entry e;
+
+	e.entry = *(volatile uint64_t *)&l2tbl->table[offset].entry;
+	if (!e.occupied)
+		return -ENOENT;
+
+	*gate = e.gate;
+	return 0;
+}
+
+static inline int l2_find(struct l2_table *l2tbl,
+			  uint64_t addr, gate_idx_t *gate)
+{
+	uint32_t offset;
+
+	if (l2_lookup(l2tbl, addr, &offset))
+		return -ENOENT;
+
+	return l2_get_gate(l2tbl, offset, gate);
 }
 
 static int l2_find_offset(struct l2_table *l2tbl,
@@ -275,57 +362,83 @@ static int l2_find_offset(struct l2_table *l2tbl,
 	return -ENOENT;
 }
 
+/* Entries are updated with a single store, since lookups run concurrently
+ * with learning and aging */
+static inline void l2_set_entry(struct l2_table *l2tbl, uint32_t offset,
+				uint64_t entry)
+{
+	*(volatile uint64_t *)&l2tbl->table[offset].entry = entry;
+}
+
+static inline uint64_t l2_make_entry(mac_addr_t addr, gate_idx_t gate)
+{
+	struct l2_entry e = {.addr = addr, .gate = gate, .occupied = 1};
+
+	return e.entry;
+}
+
 static int l2_find_slot(struct l2_table *l2tbl, mac_addr_t addr,
 			uint32_t *idx, uint32_t *bucket)
 {
-	int i, j;
+	int i, j, k;
 	uint32_t hash;
-	uint32_t idx1, idx_v1, idx_v2;
+	uint32_t cand[2];
+	uint32_t idx1, idx_v1, idx_v2, idx_other;
 	uint32_t offset1, offset2;
 	struct l2_entry *tbl = l2tbl->table;
 
 	hash = l2_hash(addr);
-	idx1 = l2_hash_to_index(hash, l2tbl->size);
+	cand[0] = l2_hash_to_index(hash, l2tbl->size);
+	cand[1] = l2_alt_index(hash, l2tbl->size_power, cand[0]);
 
-	/* if there is available slot */
-	for (i = 0; i < l2tbl->bucket; i++) {
-		offset1 = l2_ib_to_offset(l2tbl, idx1, i);
-		if (!tbl[offset1].occupied) {
-			*idx = idx1;
-			*bucket = i;
-			return 0;
+	/* if there is available slot in either index */
+	for (k = 0; k < 2; k++) {
+		for (i = 0; i < l2tbl->bucket; i++) {
+			offset1 = l2_ib_to_offset(l2tbl, cand[k], i);
+			if (!tbl[offset1].occupied) {
+				*idx = cand[k];
+				*bucket = i;
+				return 0;
+			}
 		}
 	}
 
-	offset1 = l2_ib_to_offset(l2tbl, idx1, 0);
+	/* try moving an entry to its other index */
+	for (k = 0; k < 2; k++) {
+		idx1 = cand[k];
 
-	/* try moving */
-	for (i = 0; i < l2tbl->bucket; i++) {
-		offset1 = l2_ib_to_offset(l2tbl, idx1, i);
-		hash = l2_hash(tbl[offset1].addr);
-		idx_v1 = l2_hash_to_index(hash, l2tbl->size);
-		idx_v2 = l2_alt_index(hash, l2tbl->size_power, idx_v1);
-
-		/* if the alternate bucket is same as original skip it */
-		if (idx_v1 == idx_v2 || idx1 == idx_v2)
-			break;
-
-		for (j = 0; j < l2tbl->bucket; j++) {
-			offset2 = l2_ib_to_offset(l2tbl, idx_v2, j);
-			if (!tbl[offset2].occupied) {
-				/* move offset1 to offset2 */
-				tbl[offset2] = tbl[offset1];
+		for (i = 0; i < l2tbl->bucket; i++) {
+			offset1 = l2_ib_to_offset(l2tbl, idx1, i);
+			hash = l2_hash(tbl[offset1].addr);
+			idx_v1 = l2_hash_to_index(hash, l2tbl->size);
+			idx_v2 = l2_alt_index(hash, l2tbl->size_power, idx_v1);
+			idx_other = (idx1 == idx_v1) ? idx_v2 : idx_v1;
+
+			/* if the alternate bucket is same as original skip it */
+			if (idx_other == idx1)
+				continue;
+
+			for (j = 0; j < l2tbl->bucket; j++) {
+				offset2 = l2_ib_to_offset(l2tbl, idx_other, j);
+				if (tbl[offset2].occupied)
+					continue;
+
+				/* move offset1 to offset2. Copy first, so
+				 * that concurrent lookups always find it. */
+				if (l2tbl->ts)
+					l2tbl->ts[offset2] = l2tbl->ts[offset1];
+				l2_set_entry(l2tbl, offset2, tbl[offset1].entry);
 				/* clear offset1 */
-				tbl[offset1].occupied = 0;
+				l2_set_entry(l2tbl, offset1, 0);
 
 				*idx = idx1;
-				*bucket = 0;
+				*bucket = i;
 				return 0;
 			}
 		}
 	}
 
-	/* TODO:if alternate index is also full then start move */
+	/* TODO: deeper cuckoo paths. For now the table is grown instead */
 	return -ENOMEM;
 }
 
@@ -349,9 +462,9 @@ static int l2_add_entry(struct l2_table *l2tbl, mac_addr_t addr, gate_idx_t gate
 	/* insert entry into empty slot */
 	offset = l2_ib_to_offset(l2tbl, index, bucket);
 
-	l2tbl->table[offset].addr = addr;
-	l2tbl->table[offset].gate = gate;
-	l2tbl->table[offset].occupied = 1;
+	if (l2tbl->ts)
+		l2tbl->ts[offset] = 0;
+	l2_set_entry(l2tbl, offset, l2_make_entry(addr, gate));
 	l2tbl->count++;
 	return 0;
 }
@@ -364,9 +477,7 @@ static int l2_del_entry(struct l2_table *l2tbl, uint64_t addr)
 		return -ENOENT;
 	}
 
-	l2tbl->table[offset].addr = 0;
-	l2tbl->table[offset].gate = 0;
-	l2tbl->table[offset].occupied = 0;
+	l2_set_entry(l2tbl, offset, 0);
 	l2tbl->count--;
 	return 0;
 }
@@ -380,6 +491,113 @@ static int l2_flush(struct l2_table *l2tbl)
 
 	memset(l2tbl->table, 0,
 			sizeof(struct l2_entry) * l2tbl->size * l2tbl->bucket);
+	if (l2tbl->ts)
+		memset(l2tbl->ts, 0,
+			sizeof(uint32_t) * l2tbl->size * l2tbl->bucket);
+	l2tbl->count = 0;
+
+	return 0;
+}
+
+/* Allocates the timestamps for aging */
+static int l2_enable_aging(struct l2_table *l2tbl)
+{
+	size_t size = sizeof(uint32_t) * l2tbl->size * l2tbl->bucket;
+
+#if USE_RTEMALLOC
+	l2tbl->ts = rte_zmalloc("l2tbl_ts", size, 0);
+#else
+	l2tbl->ts = calloc(1, size);
+#endif
+
+	return l2tbl->ts ? 0 : -ENOMEM;
+}
+
+/* never 0, which is reserved for static entries */
+static inline uint32_t l2_now(uint64_t tsc)
+{
+	return (tsc >> L2_TS_SHIFT) | 1;
+}
+
+/* Learns (or moves) a source address. Static entries are left untouched.
+ * Returns 1 if an entry was added, 0 if updated (or static) */
+static int l2_learn_entry(struct l2_table *l2tbl, mac_addr_t addr,
+			  gate_idx_t gate, uint32_t now)
+{
+	uint32_t offset;
+	int ret;
+
+	if (l2_find_offset(l2tbl, addr, &offset) == 0) {
+		if (l2tbl->ts && !l2tbl->ts[offset])
+			return 0;
+
+		if (l2tbl->ts)
+			l2tbl->ts[offset] = now;
+		l2_set_entry(l2tbl, offset, l2_make_entry(addr, gate));
+		return 0;
+	}
+
+	ret = l2_add_entry(l2tbl, addr, gate);
+	if (ret)
+		return ret;
+
+	if (l2tbl->ts) {
+		ret = l2_find_offset(l2tbl, addr, &offset);
+		assert(ret == 0);
+		l2tbl->ts[offset] = now;
+	}
+
+	return 1;
+}
+
+/* Removes learned entries not seen for max_age, in slots [start, start+n).
+ * Returns the number of removed entries. */
+static int l2_age(struct l2_table *l2tbl, uint32_t start, uint32_t n,
+		  uint32_t now, uint32_t max_age)
+{
+	struct l2_entry *tbl = l2tbl->table;
+	uint32_t *ts = l2tbl->ts;
+	int aged = 0;
+
+	for (uint32_t offset = start; offset < start + n; offset++) {
+		if (!tbl[offset].occupied || !ts[offset])
+			continue;
+
+		if ((uint32_t)(now - ts[offset]) > max_age) {
+			l2_set_entry(l2tbl, offset, 0);
+			ts[offset] = 0;
+			l2tbl->count--;
+			aged++;
+		}
+	}
+
+	return aged;
+}
+
+/* Inserts all entries of src into dst (e.g., a larger table) */
+static int l2_copy(struct l2_table *dst, struct l2_table *src)
+{
+	struct l2_entry *tbl = src->table;
+	uint32_t slots = src->size * src->bucket;
+
+	for (uint32_t offset = 0; offset < slots; offset++) {
+		uint32_t new_offset;
+		int ret;
+
+		if (!tbl[offset].occupied)
+			continue;
+
+		ret = l2_add_entry(dst, tbl[offset].addr, tbl[offset].gate);
+		if (ret)
+			return ret;
+
+		if (src->ts && dst->ts) {
+			ret = l2_find_offset(dst, tbl[offset].addr, 
+					&new_offset);
+			assert(ret == 0);
+			dst->ts[new_offset] = src->ts[offset];
+		}
+	}
 
 	return 0;
 }
@@ -565,34 +783,226 @@ int test_all()
 /******************************************************************************/
 
 struct l2_forward_priv {
-	struct l2_table l2_table;
+	/* Replaced as a whole when resized. Workers keep using the old
+	 * table until the new one is published. */
+	struct l2_table * volatile l2_table;
 	gate_idx_t default_gate;
+	int prefetch_dist;
+
+	int bucket;
+	uint64_t max_size;	/* for automatic growth */
+	volatile int grow_req;	/* set by workers, served by resize_job */
+	struct master_job resize_job;
+	uint64_t cnt_resized;
+
+	/* Source MAC learning: packets from igate X teach that their source
+	 * address is reachable via ogate X. Inserts are done after the batch
+	 * is passed downstream. Writers (learning, aging) take the lock;
+	 * lookups do not. */
+	int learn;
+	uint32_t max_age;	/* in L2_TS_SHIFT units, 0 for no aging */
+	uint32_t age_pos;	/* next slot for the aging task */
+	rte_spinlock_t lock;
+
+	uint64_t cnt_learned;
+	uint64_t cnt_aged;
+	uint64_t cnt_learn_failed;
 };
 
+static struct l2_table *l2_forward_alloc_table(struct l2_forward_priv *priv,
+		uint64_t size, int *ret)
+{
+	struct l2_table *l2tbl;
+
+	if (size > MAX_TABLE_SIZE) {
+		*ret = -EINVAL;
+		return NULL;
+	}
+
+	l2tbl = rte_zmalloc("l2_forward", sizeof(*l2tbl), 0);
+	if (!l2tbl) {
+		*ret = -ENOMEM;
+		return NULL;
+	}
+
+	*ret = l2_init(l2tbl, size, priv->bucket);
+	if (*ret) {
+		rte_free(l2tbl);
+		return NULL;
+	}
+
+	/* learning needs the timestamps to tell static entries apart */
+	if (priv->learn) {
+		*ret = l2_enable_aging(l2tbl);
+		if (*ret) {
+			l2_deinit(l2tbl);
+			rte_free(l2tbl);
+			return NULL;
+		}
+	}
+
+	return l2tbl;
+}
+
+static void l2_forward_free_table(struct l2_table *l2tbl)
+{
+	l2_deinit(l2tbl);
+	rte_free(l2tbl);
+}
+
+/* Rehashes the table into a new one with new_size hash values. Lookups
+ * continue on the old table while it is copied, and learning and aging
+ * skip their turns (see l2_forward_learn()). Must be called on the master
+ * thread. */
+static int l2_forward_resize(struct l2_forward_priv *priv, uint64_t new_size)
+{
+	struct l2_table *old_tbl = priv->l2_table;
+	struct l2_table *new_tbl;
+	int ret;
+
+	if (new_size == old_tbl->size)
+		return 0;
+
+	new_tbl = l2_forward_alloc_table(priv, new_size, &ret);
+	if (!new_tbl)
+		return ret;
+
+	rte_spinlock_lock(&priv->lock);
+
+	ret = l2_copy(new_tbl, old_tbl);
+	if (ret) {
+		rte_spinlock_unlock(&priv->lock);
+		l2_forward_free_table(new_tbl);
+		return ret;
+	}
+
+	priv->age_pos = 0;
+
+	STORE_BARRIER();
+	priv->l2_table = new_tbl;
+
+	rte_spinlock_unlock(&priv->lock);
+
+	/* no worker can be looking at the old table after this */
+	synchronize_workers();
+	l2_forward_free_table(old_tbl);
+
+	priv->cnt_resized++;
+	return 0;
+}
+
+/* doubles the table, up to max_size */
+static int l2_forward_grow(struct l2_forward_priv *priv)
+{
+	uint64_t size = priv->l2_table->size;
+	int ret = -ENOMEM;
+
+	/* cuckoo insertion may fail even with free slots left */
+	while (ret == -ENOMEM && size < priv->max_size) {
+		size = size * 2;
+		ret = l2_forward_resize(priv, size);
+	}
+
+	return ret;
+}
+
+static void l2_forward_resize_job(void *arg)
+{
+	struct l2_forward_priv *priv = arg;
+
+	if (!priv->grow_req)
+		return;
+
+	if (l2_forward_grow(priv))
+		log_err("L2Forward: could not grow the table beyond %lu\n", 
+				priv->l2_table->size);
+
+	priv->grow_req = 0;
+}
+
+/* adds a static entry, growing the table if needed */
+static int l2_forward_add_entry(struct l2_forward_priv *priv, 
+		mac_addr_t addr, gate_idx_t gate)
+{
+	int ret = l2_add_entry(priv->l2_table, addr, gate);
+
+	if (ret == -ENOMEM && l2_forward_grow(priv) == 0) 
+		ret = l2_add_entry(priv->l2_table, addr, gate);
+
+	return ret;
+}
+
 static struct snobj *l2_forward_init(struct module *m, struct snobj *arg)
 {
 	struct l2_forward_priv *priv = get_priv(m);
 	int ret = 0;
 	int size = snobj_eval_int(arg, "size");
 	int bucket = snobj_eval_int(arg, "bucket");
+	int64_t max_size = snobj_eval_int(arg, "max_size");
 
 	priv->default_gate = DROP_GATE;
+	priv->prefetch_dist = SNB_PREFETCH_DIST_DEFAULT;
+
+	if (snobj_eval(arg, "prefetch")) {
+		struct snobj *err;
+
+		err = get_prefetch_dist(snobj_eval(arg, "prefetch"), 
+				&priv->prefetch_dist);
+		if (err)
+			return err;
+	}
 
 	if (size == 0)
 		size = DEFAULT_TABLE_SIZE;
 	if (bucket == 0)
 		bucket = MAX_BUCKET_SIZE;
 
+	if (max_size == 0)
+		max_size = size;
+	if (max_size < size || max_size > MAX_TABLE_SIZE || 
+			!is_power_of_2(max_size))
+		return snobj_err(EINVAL, "invalid 'max_size' %ld", max_size);
+
+	priv->learn = snobj_eval_int(arg, "learn");
+
+	int age = snobj_eval_exists(arg, "age") ? 
+			snobj_eval_int(arg, "age") : DEFAULT_AGE;
+	if (age < 0)
+		return snobj_err(EINVAL, "'age' must be non-negative");
+
+	priv->bucket = bucket;
+	priv->max_size = max_size;
+	rte_spinlock_init(&priv->lock);
+
 	assert(priv != NULL);
-	ret = l2_init(&priv->l2_table, size, bucket);
+	priv->l2_table = l2_forward_alloc_table(priv, size, &ret);
 
-	if (ret != 0) {
+	if (!priv->l2_table) {
 		return snobj_err(-ret,
 				"initialization failed with argument " \
 				"size: '%d' bucket: '%d'",
 				size, bucket);
 	}
 
+	init_master_job(&priv->resize_job, l2_forward_resize_job, priv,
+			L2_RESIZE_CHECK_NS);
+
+	if (!priv->learn)
+		return NULL;
+
+	if (max_size > size)
+		add_master_job(&priv->resize_job);
+
+	if (age > 0) {
+		priv->max_age = ((uint64_t)age * tsc_hz) >> L2_TS_SHIFT;
+
+		if (register_task(m, NULL) == INVALID_TASK_ID) {
+			remove_master_job(&priv->resize_job);
+			l2_forward_free_table(priv->l2_table);
+			return snobj_err(ENOMEM, "Task creation failed");
+		}
+	}
+
 	return NULL;
 }
 
@@ -600,7 +1010,8 @@ static void l2_forward_deinit(struct module *m)
 {
 	struct l2_forward_priv *priv = get_priv(m);
 
-	l2_deinit(&priv->l2_table);
+	remove_master_job(&priv->resize_job);
+	l2_forward_free_table(priv->l2_table);
 }
 
 static int parse_mac_addr(const char *str, char *addr)
@@ -660,8 +1071,7 @@ command_add(struct module *m, const char *cmd, struct snobj *arg)
 					 "%s is not a proper mac address",
 					 str_addr);
 
-		int r = l2_add_entry(&priv->l2_table,
-				l2_addr_to_u64(addr), gate);
+		int r = l2_forward_add_entry(priv, l2_addr_to_u64(addr), gate);
 
 		if (r == -EEXIST) {
 			return snobj_err(EEXIST,
@@ -702,7 +1112,7 @@ command_delete(struct module *m, const char *cmd, struct snobj *arg)
 					 str_addr);
 		}
 
-		int r = l2_del_entry(&priv->l2_table,
+		int r = l2_del_entry(priv->l2_table,
 				l2_addr_to_u64(addr));
 
 		if (r == -ENOENT) {
@@ -759,7 +1169,7 @@ command_lookup(struct module *m, const char *cmd, struct snobj *arg)
 		}
 
 		gate_idx_t gate;
-		int r = l2_find(&priv->l2_table,
+		int r = l2_find(priv->l2_table,
 				l2_addr_to_u64(addr),
 				&gate);
 
@@ -833,9 +1243,8 @@ command_populate(struct module *m, const char *cmd, struct snobj *arg)
 	base_u64 = base_u64 >> 16;
 
 	for (int i = 0; i < cnt; i++) {
-		l2_add_entry(&priv->l2_table,
-			     rte_cpu_to_be_64(base_u64 << 16),
-			     i % gate_cnt);
+		l2_forward_add_entry(priv, rte_cpu_to_be_64(base_u64 << 16),
+				i % gate_cnt);
 
 		base_u64++;
 	}
@@ -843,43 +1252,266 @@ command_populate(struct module *m, const char *cmd, struct snobj *arg)
 	return NULL;
 }
 
+static void l2_forward_learn(struct l2_forward_priv *priv,
+		mac_addr_t *addrs, int cnt, gate_idx_t gate, uint32_t now)
+{
+	struct l2_table *l2tbl;
+
+	/* Another worker is updating the table, or it is being resized.
+	 * Skip; the addresses will be learned from the next packets. */
+	if (!rte_spinlock_trylock(&priv->lock))
+		return;
+
+	/* may have been replaced since the lookup */
+	l2tbl = priv->l2_table;
+
+	for (int i = 0; i < cnt; i++) {
+		int ret = l2_learn_entry(l2tbl, addrs[i], gate, now);
+
+		if (ret > 0)
+			priv->cnt_learned++;
+		else if (ret < 0)
+			priv->cnt_learn_failed++;
+	}
+
+	if (l2tbl->count > L2_GROW_THRESHOLD(l2tbl->size * l2tbl->bucket) &&
+			l2tbl->size < priv->max_size)
+		priv->grow_req = 1;
+
+	rte_spinlock_unlock(&priv->lock);
+}
+
 static void l2_forward_process_batch(struct module *m, struct pkt_batch *batch)
 {
 	struct l2_forward_priv *priv = get_priv(m);
+	struct l2_table *l2tbl = priv->l2_table;
 
 	gate_idx_t default_gate = priv->default_gate;
 	gate_idx_t ogates[MAX_PKT_BURST];
+	int dist = priv->prefetch_dist;
+	int cnt = batch->cnt;
+
+	mac_addr_t dst[MAX_PKT_BURST];
+	mac_addr_t src[MAX_PKT_BURST];
+	uint32_t offsets[MAX_PKT_BURST];
+
+	gate_idx_t igate = get_igate();
+	mac_addr_t learn[MAX_PKT_BURST];
+	int learn_cnt = 0;
+	uint32_t now = l2_now(ctx.current_tsc);
+
+	snb_prefetch_start(batch, dist);
+
+	for (int i = 0; i < cnt; i++) {
+		char *head = snb_head_data(batch->pkts[i]);
+
+		snb_prefetch_ahead(batch, i, dist);
+
+		dst[i] = l2_addr_to_u64(head);
+		src[i] = l2_addr_to_u64(head + 6);
+	}
 
-	for (int i = 0; i < batch->cnt; i++) {
-		struct snbuf *snb = batch->pkts[i];
+	l2_lookup_bulk(l2tbl, dst, cnt, offsets);
 
+	for (int i = 0; i < cnt; i++) {
 		ogates[i] = default_gate;
 
-		l2_find(&priv->l2_table,
-			    l2_addr_to_u64(snb_head_data(snb)),
-			    &ogates[i]);
+		if (offsets[i] != L2_NOT_FOUND)
+			l2_get_gate(l2tbl, offsets[i], &ogates[i]);
 	}
 
+	if (!priv->learn)
+		goto out;
+
+	l2_lookup_bulk(l2tbl, src, cnt, offsets);
+
+	for (int i = 0; i < cnt; i++) {
+		uint32_t offset = offsets[i];
+
+		/* never learn group addresses */
+		if (src[i] & 0x1)
+			continue;
+
+		if (offset != L2_NOT_FOUND) {
+			uint32_t ts = l2tbl->ts[offset];
+
+			/* static entries (ts == 0) are never overridden */
+			if (!ts)
+				continue;
+
+			if (l2tbl->table[offset].gate == igate) {
+				/* Write only when changed, to keep the cache
+				 * line clean for other workers */
+				if (ts != now)
+					l2tbl->ts[offset] = now;
+				continue;
+			}
+		}
+
+		/* consecutive packets are often from the same host */
+		if (!learn_cnt || learn[learn_cnt - 1] != src[i])
+			learn[learn_cnt++] = src[i];
+	}
+
+out:
 	run_split(m, ogates, batch);
+
+	if (learn_cnt)
+		l2_forward_learn(priv, learn, learn_cnt, igate, now);
+}
+
+/* Incrementally expires learned entries */
+static struct task_result 
+l2_forward_run_task(struct module *m, void *arg)
+{
+	struct l2_forward_priv *priv = get_priv(m);
+	struct l2_table *l2tbl;
+	struct task_result ret = {.packets = 0, .bits = 0};
+	uint32_t slots;
+	uint32_t n;
+
+	if (!rte_spinlock_trylock(&priv->lock))
+		return ret;
+
+	l2tbl = priv->l2_table;
+	slots = l2tbl->size * l2tbl->bucket;
+	n = RTE_MIN((uint32_t)L2_AGING_SWEEP, slots - priv->age_pos);
+
+	priv->cnt_aged += l2_age(l2tbl, priv->age_pos, n, 
+			l2_now(rdtsc()), priv->max_age);
+
+	priv->age_pos += n;
+	if (priv->age_pos >= slots)
+		priv->age_pos = 0;
+
+	rte_spinlock_unlock(&priv->lock);
+
+	return ret;
+}
+
+static struct snobj *l2_forward_get_desc(const struct module *m)
+{
+	const struct l2_forward_priv *priv = get_priv_const(m);
+	const struct l2_table *l2tbl = priv->l2_table;
+	uint64_t slots = l2tbl->size * l2tbl->bucket;
+
+	if (!priv->learn)
+		return snobj_str_fmt("%lu/%lu entries", l2tbl->count, slots);
+
+	return snobj_str_fmt("%lu/%lu entries, %lu learned, %lu aged, "
+			"%lu failed", l2tbl->count, slots, priv->cnt_learned, 
+			priv->cnt_aged, priv->cnt_learn_failed);
+}
+
+/* Static entries only. Learned ones will be learned again */
+static struct snobj *l2_forward_get_snapshot(const struct module *m)
+{
+	const struct l2_forward_priv *priv = get_priv_const(m);
+	const struct l2_table *l2tbl = priv->l2_table;
+	uint64_t slots = l2tbl->size * l2tbl->bucket;
+
+	struct snobj *cmds = snobj_list();
+	struct snobj *entries = snobj_list();
+	struct snobj *cmd;
+
+	for (uint64_t i = 0; i < slots; i++) {
+		const struct l2_entry *e = &l2tbl->table[i];
+		struct snobj *entry;
+		uint64_t addr;
+
+		if (!e->occupied || (l2tbl->ts && l2tbl->ts[i]))
+			continue;
+
+		addr = e->addr;
+
+		entry = snobj_map();
+		snobj_map_set(entry, "addr", snobj_str_fmt(
+				"%02lx:%02lx:%02lx:%02lx:%02lx:%02lx",
+				addr & 0xff, (addr >> 8) & 0xff,
+				(addr >> 16) & 0xff, (addr >> 24) & 0xff,
+				(addr >> 32) & 0xff, (addr >> 40) & 0xff));
+		snobj_map_set(entry, "gate", snobj_int(e->gate));
+		snobj_list_add(entries, entry);
+	}
+
+	/* the table may have grown since init */
+	cmd = snobj_map();
+	snobj_map_set(cmd, "cmd", snobj_str("resize"));
+	snobj_map_set(cmd, "arg", snobj_int(l2tbl->size));
+	snobj_list_add(cmds, cmd);
+
+	cmd = snobj_map();
+	snobj_map_set(cmd, "cmd", snobj_str("set_default_gate"));
+	snobj_map_set(cmd, "arg", snobj_int(priv->default_gate));
+	snobj_list_add(cmds, cmd);
+
+	cmd = snobj_map();
+	snobj_map_set(cmd, "cmd", snobj_str("add"));
+	snobj_map_set(cmd, "arg", entries);
+	snobj_list_add(cmds, cmd);
+
+	return cmds;
+}
+
+/* Grows (or shrinks) the table while workers keep running */
+static struct snobj *
+command_resize(struct module *m, const char *cmd, struct snobj *arg)
+{
+	struct l2_forward_priv *priv = get_priv(m);
+	int64_t size = snobj_int_get(arg);
+	int ret;
+
+	if (snobj_type(arg) != TYPE_INT)
+		return snobj_err(EINVAL, "argument must be an integer");
+
+	if (size <= 0 || size > MAX_TABLE_SIZE || !is_power_of_2(size))
+		return snobj_err(EINVAL, "size must be a power of 2 "
+				"and at most %d", MAX_TABLE_SIZE);
+
+	ret = l2_forward_resize(priv, size);
+	if (ret == -ENOMEM)
+		return snobj_err(ENOMEM, "%lu entries do not fit in size %ld", 
+				priv->l2_table->count, size);
+	else if (ret)
+		return snobj_errno(-ret);
+
+	if (priv->max_size < size)
+		priv->max_size = size;
+
+	return NULL;
+}
+
+static struct snobj *
+command_set_prefetch(struct module *m, const char *cmd, struct snobj *arg)
+{
+	struct l2_forward_priv *priv = get_priv(m);
+
+	return get_prefetch_dist(arg, &priv->prefetch_dist);
 }
 
 static const struct mclass l2_forward = {
 	.name			= "L2Forward",
 	.help			= 
-		"classifies packets with destination MAC address",
+		"classifies packets with destination MAC address, "
+		"optionally learning source MAC addresses",
 	.def_module_name 	= "l2_forward",
-	.num_igates		= 1,
+	.num_igates		= MAX_GATES,
 	.num_ogates		= MAX_GATES,
 	.priv_size		= sizeof(struct l2_forward_priv),
 	.init			= l2_forward_init,
 	.deinit			= l2_forward_deinit,
+	.get_desc		= l2_forward_get_desc,
+	.get_snapshot		= l2_forward_get_snapshot,
 	.process_batch		= l2_forward_process_batch,
+	.run_task		= l2_forward_run_task,
 	.commands		= {
 		{"add",			command_add},
 		{"delete",		command_delete},
 		{"set_default_gate",	command_set_default_gate, .mt_safe=1},
 		{"lookup",		command_lookup,		  .mt_safe=1},
 		{"populate",		command_populate},
+		{"set_prefetch",	command_set_prefetch,	  .mt_safe=1},
+		{"resize",		command_resize,		  .mt_safe=1},
 	}
 };
 
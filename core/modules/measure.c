@@ -2,61 +2,166 @@
 #include <string.h>
 
 #include "../module.h"
+#include "../parse.h"
 #include "../utils/histogram.h"
 #include "../time.h"
 
-/* XXX: currently doesn't support multiple workers */
+/* Latencies are measured in TSC cycles from the timestamps of the
+ * Timestamp module, and converted to ns only when reported. Both modules
+ * must use the same 'metadata' and 'offset' arguments. With the default
+ * offset, both use the end of the TCP header found by a Parse module, 
+ * if any, so the packets should be parsed before both of them. */
+
+#define MEASURE_DEFAULT_OFFSET	(sizeof(struct ether_hdr) + \
+				 sizeof(struct ipv4_hdr) + \
+				 sizeof(struct tcp_hdr))
+
 struct measure_priv {
-	struct histogram hist;
+	uint64_t warmup;	/* in cycles */
+	int precision;		/* sub-bucket bits of the histograms */
+
+	int attr_id;		/* -1 if the timestamp is in payload */
+	int offset;		/* in payload */
+	int parse_attr_id;	/* -1 unless the default offset is used */
+};
 
-	uint64_t start_time;
-	int warmup;		/* second */
+/* updated only by the worker that owns it */
+struct measure_worker {
+	uint64_t start_time;	/* TSC */
 
 	uint64_t pkt_cnt;
 	uint64_t bytes_cnt;
-	uint64_t total_latency;
+	uint64_t total_latency;	/* in cycles */
+
+	struct histogram *hist;	/* of latencies, in cycles */
 };
 
+static void measure_deinit(struct module *m)
+{
+	struct measure_worker *w;
+	int wid;
+
+	for_each_priv_worker(m, wid, w)
+		rte_free(w->hist);
+}
+
 static struct snobj *measure_init(struct module *m, struct snobj *arg)
 {
 	struct measure_priv *priv = get_priv(m);
+	struct measure_worker *w;
+	int wid;
 
+	/* in seconds */
 	if (arg)
-		priv->warmup = snobj_eval_int(arg, "warmup");
+		priv->warmup = snobj_eval_int(arg, "warmup") * tsc_hz;
+
+	priv->precision = HISTO_DEFAULT_SUB_BITS;
+	if (arg && snobj_eval_exists(arg, "precision"))
+		priv->precision = snobj_eval_int(arg, "precision");
+
+	if (priv->precision < HISTO_MIN_SUB_BITS ||
+			priv->precision > HISTO_MAX_SUB_BITS)
+		return snobj_err(EINVAL, "'precision' must be %d-%d (bits)",
+				HISTO_MIN_SUB_BITS, HISTO_MAX_SUB_BITS);
 
-	init_hist(&priv->hist);
+	/* should match that of the Timestamp module */
+	priv->attr_id = -1;
+
+	if (arg && snobj_eval_int(arg, "metadata")) {
+		priv->attr_id = add_metadata_attr(m, "timestamp", 
+				sizeof(uint64_t), MT_READ);
+		if (priv->attr_id < 0)
+			return snobj_errno(-priv->attr_id);
+	}
+
+	priv->offset = MEASURE_DEFAULT_OFFSET;
+	priv->parse_attr_id = -1;
+
+	if (arg && snobj_eval_exists(arg, "offset")) {
+		priv->offset = snobj_eval_int(arg, "offset");
+		if (priv->offset < 0 || priv->offset + 1 + sizeof(uint64_t) >
+				SNBUF_DATA)
+			return snobj_err(EINVAL, "invalid 'offset'");
+	} else if (priv->attr_id < 0) {
+		priv->parse_attr_id = add_parse_attr(m, MT_READ);
+		if (priv->parse_attr_id < 0)
+			return snobj_errno(-priv->parse_attr_id);
+	}
+
+	/* one per worker, so that workers do not share cache lines */
+	for_each_priv_worker(m, wid, w) {
+		w->hist = rte_malloc_socket("measure_hist",
+				histo_size(priv->precision,
+					HISTO_DEFAULT_MAX_BITS),
+				RTE_CACHE_LINE_SIZE, m->socket);
+		if (!w->hist) {
+			measure_deinit(m);
+			return snobj_errno(ENOMEM);
+		}
+
+		histo_init(w->hist, priv->precision, HISTO_DEFAULT_MAX_BITS);
+	}
 
 	return NULL;
 }
 
-static inline int get_measure_packet(struct snbuf* pkt, uint64_t* time)
+static inline int get_measure_packet(struct snbuf* pkt, int offset,
+		uint64_t* time)
+{
+	uint8_t *avail = (uint8_t *)snb_head_data(pkt) + offset;
+
+	if (unlikely(offset + 1 + sizeof(uint64_t) > snb_head_len(pkt)))
+		return 0;
+
+	*time = *(uint64_t *)(avail + 1);
+	return *avail;
+}
+
+static inline int get_measure_attr(struct module *m, int attr_id,
+		struct snbuf *pkt, uint64_t *time)
 {
-	uint8_t *avail = (uint8_t*)((uint8_t*)snb_head_data(pkt) +
-			sizeof(struct ether_hdr) + sizeof(struct ipv4_hdr)) +
-		sizeof(struct tcp_hdr);
-	uint64_t *ts = (uint64_t*)(avail + 1);
-	uint8_t available = *avail;
-	*time = *ts;
-	return available;
+	if (!is_valid_attr_offset(get_attr_offset(m, attr_id)))
+		return 0;
+
+	*time = *get_attr_ptr(m, attr_id, pkt, uint64_t);
+	return 1;
 }
 
 static void measure_process_batch(struct module *m, struct pkt_batch *batch)
 {
 	struct measure_priv *priv = get_priv(m);
+	struct measure_worker *w = get_priv_worker(m);
 
-	uint64_t time = get_time();
+	uint64_t time = rdtsc();
+	int parsed = priv->parse_attr_id >= 0 && 
+			parse_available(m, priv->parse_attr_id);
 
-	if (priv->start_time == 0)
-		priv->start_time = get_time();
+	if (w->start_time == 0)
+		w->start_time = time;
 
-	if (HISTO_TIME_TO_SEC(time - priv->start_time) < priv->warmup)
+	if (time - w->start_time < priv->warmup)
 		goto skip;
 
-	priv->pkt_cnt += batch->cnt;
+	w->pkt_cnt += batch->cnt;
 
 	for (int i = 0; i < batch->cnt; i++) {
 		uint64_t pkt_time;
-		if (get_measure_packet(batch->pkts[i], &pkt_time)) {
+		int available;
+		int offset = priv->offset;
+
+		if (parsed)
+			offset = parse_l4_payload(get_parse(m, 
+					priv->parse_attr_id, batch->pkts[i]),
+					sizeof(struct tcp_hdr), offset);
+
+		if (priv->attr_id >= 0)
+			available = get_measure_attr(m, priv->attr_id, 
+					batch->pkts[i], &pkt_time);
+		else
+			available = get_measure_packet(batch->pkts[i], 
+					offset, &pkt_time);
+
+		if (available) {
 			uint64_t diff;
 			
 			if (time >= pkt_time)
@@ -64,10 +169,10 @@ static void measure_process_batch(struct module *m, struct pkt_batch *batch)
 			else
 				continue;
 
-			priv->bytes_cnt += batch->pkts[i]->mbuf.pkt_len;
-			priv->total_latency += diff;
+			w->bytes_cnt += batch->pkts[i]->mbuf.pkt_len;
+			w->total_latency += diff;
 
-			record_latency(&priv->hist, diff);
+			histo_record(w->hist, diff);
 		}
 	}
 
@@ -75,26 +180,79 @@ skip:
 	run_next_module(m, batch);
 }
 
+/* with the percentiles of the latency since the start (or clear) */
 struct snobj *
 command_get_summary(struct module *m, const char *cmd, struct snobj *arg)
 {
-	struct measure_priv *priv = get_priv(m);
+	const struct measure_priv *priv = get_priv(m);
+	struct measure_worker *w;
+	struct histogram *hist;
+	struct snobj *latency;
+	int wid;
 
-	uint64_t pkt_total = priv->pkt_cnt;
-	uint64_t byte_total = priv->bytes_cnt;
-	uint64_t bits = (byte_total + pkt_total * 24) * 8;
+	uint64_t pkt_total = 0;
+	uint64_t byte_total = 0;
+	uint64_t latency_total = 0;
+	uint64_t bits;
 
 	struct snobj *r = snobj_map();
 
+	hist = malloc(histo_size(priv->precision, HISTO_DEFAULT_MAX_BITS));
+	if (!hist) {
+		snobj_free(r);
+		return snobj_errno(ENOMEM);
+	}
+
+	histo_init(hist, priv->precision, HISTO_DEFAULT_MAX_BITS);
+
+	for_each_priv_worker(m, wid, w) {
+		pkt_total += w->pkt_cnt;
+		byte_total += w->bytes_cnt;
+		latency_total += w->total_latency;
+		histo_merge(hist, w->hist);
+	}
+
+	latency = snobj_map();
+	snobj_map_set(latency, "count", snobj_uint(hist->count));
+	snobj_map_set(latency, "min_ns",
+			snobj_uint(hist->count ? tsc_to_ns(hist->min) : 0));
+	snobj_map_set(latency, "avg_ns",
+			snobj_uint(hist->count ?
+				tsc_to_ns(hist->sum / hist->count) : 0));
+	snobj_map_set(latency, "max_ns", snobj_uint(tsc_to_ns(hist->max)));
+	snobj_map_set(latency, "p50_ns",
+			snobj_uint(tsc_to_ns(histo_percentile(hist, 50))));
+	snobj_map_set(latency, "p99_ns",
+			snobj_uint(tsc_to_ns(histo_percentile(hist, 99))));
+	snobj_map_set(latency, "p999_ns",
+			snobj_uint(tsc_to_ns(histo_percentile(hist, 99.9))));
+
+	free(hist);
+
+	bits = (byte_total + pkt_total * 24) * 8;
+
 	snobj_map_set(r, "timestamp", snobj_double(get_epoch_time()));
 	snobj_map_set(r, "packets", snobj_uint(pkt_total));
 	snobj_map_set(r, "bits", snobj_uint(bits));
 	snobj_map_set(r, "total_latency_ns", 
-			snobj_uint(priv->total_latency * 100));
+			snobj_uint(tsc_to_ns(latency_total)));
+	snobj_map_set(r, "latency", latency);
 
 	return r;
 }
 
+static struct snobj *
+command_clear(struct module *m, const char *cmd, struct snobj *arg)
+{
+	struct measure_worker *w;
+	int wid;
+
+	for_each_priv_worker(m, wid, w)
+		histo_reset(w->hist);
+
+	return NULL;
+}
+
 static const struct mclass measure = {
 	.name 		= "Measure",
 	.help		= 
@@ -102,10 +260,13 @@ static const struct mclass measure = {
 	.num_igates	= 1,
 	.num_ogates	= 1,
 	.priv_size	= sizeof(struct measure_priv),
+	.priv_worker_size = sizeof(struct measure_worker),
 	.init 		= measure_init,
+	.deinit		= measure_deinit,
 	.process_batch 	= measure_process_batch,
 	.commands	 = {
 		{"get_summary", command_get_summary},
+		{"clear", 	command_clear},
 	}
 };
 
@@ -0,0 +1,432 @@
+#include <string.h>
+
+#include <rte_hash_crc.h>
+#include <rte_malloc.h>
+#include <rte_prefetch.h>
+
+#include "../module.h"
+#include "../time.h"
+
+/* Per-flow (or per-subscriber) policing with the single rate (srTCM, RFC
+ * 2697) or the two rate (trTCM, RFC 2698) three color marker, color-blind.
+ * Green, yellow, and red packets go to ogates 0, 1, and 2, respectively.
+ *
+ * Packets are mapped to one of 'size' meters by a 32-bit metadata attribute
+ * ('key_attr', red if out of range), or by a hash of a header field (the
+ * IPv4 source address by default). Each meter has a profile (rates and
+ * burst sizes, the first one by default), and its two buckets and the time
+ * of the last update take 32 bytes, two per cache line. The meters of a
+ * batch are looked up and prefetched all at once before any of them is
+ * updated.
+ *
+ * Tokens are in bytes, with 32 fractional bits so that frequent updates
+ * do not lose the fractions. A meter is updated without synchronization,
+ * so it should be used by one worker at a time (e.g., the key should not
+ * overlap between workers running the module). */
+
+#define METER_DEFAULT_SIZE	1024
+#define METER_MAX_SIZE		(1 << 24)
+#define METER_MAX_PROFILES	64
+
+#define METER_MAX_BURST		((1ul << 30) - 1)	/* in bytes */
+
+#define METER_FRAC_BITS		32
+
+#define METER_GREEN		0
+#define METER_YELLOW		1
+#define METER_RED		2
+
+#define METER_INVALID		UINT32_MAX
+
+enum meter_mode {
+	METER_SRTCM,
+	METER_TRTCM,
+};
+
+struct meter_profile {
+	/* in bytes per cycle, with METER_FRAC_BITS */
+	uint64_t cir;
+	uint64_t pir;		/* trTCM only */
+
+	/* with METER_FRAC_BITS */
+	uint64_t cbs;
+	uint64_t ebs;		/* EBS (srTCM) or PBS (trTCM) */
+
+	/* cycles to fill up the buckets from empty. For srTCM, fill_c is
+	 * not used and fill_e is for both. */
+	uint64_t fill_c;
+	uint64_t fill_e;
+};
+
+struct meter_bucket {
+	uint64_t time;		/* of the last update, in TSC cycles */
+	uint64_t tc;		/* with METER_FRAC_BITS */
+	uint64_t te;		/* Te (srTCM) or Tp (trTCM) */
+	uint32_t profile;
+	uint32_t _pad;
+} __attribute__((aligned(32)));
+
+struct meter_priv {
+	enum meter_mode mode;
+
+	uint32_t size;
+	struct meter_bucket *buckets;
+
+	int key_attr;		/* -1 if the key is hashed from the packet */
+	int key_offset;
+	int key_size;		/* in bytes, 1-8 */
+
+	int num_profiles;
+	struct meter_profile profiles[METER_MAX_PROFILES];
+};
+
+static inline uint32_t meter_index(const struct meter_priv *priv,
+		mt_offset_t key_offset, struct snbuf *pkt)
+{
+	uint64_t key = 0;
+
+	if (priv->key_attr >= 0) {
+		uint32_t idx;
+
+		if (unlikely(!is_valid_attr_offset(key_offset)))
+			return METER_INVALID;
+
+		idx = *(uint32_t *)(pkt->_metadata_buf + key_offset);
+		return likely(idx < priv->size) ? idx : METER_INVALID;
+	}
+
+	/* short packets share the meter of the zero key */
+	if (likely(priv->key_offset + priv->key_size <= snb_head_len(pkt)))
+		memcpy(&key, snb_head_data(pkt) + priv->key_offset,
+				priv->key_size);
+
+	/* maps the hash to [0, size) without a division */
+	return ((uint64_t)rte_hash_crc_8byte(key, 0) * priv->size) >> 32;
+}
+
+static inline int meter_srtcm(const struct meter_profile *pr,
+		struct meter_bucket *b, uint64_t now, uint64_t len)
+{
+	uint64_t elapsed = now - b->time;
+
+	b->time = now;
+
+	if (elapsed >= pr->fill_e) {
+		b->tc = pr->cbs;
+		b->te = pr->ebs;
+	} else {
+		/* does not overflow, since elapsed * cir < cbs + ebs */
+		uint64_t tc = b->tc + elapsed * pr->cir;
+
+		/* tokens beyond CBS go to the excess bucket */
+		if (tc > pr->cbs) {
+			uint64_t te = b->te + (tc - pr->cbs);
+
+			b->te = (te < pr->ebs) ? te : pr->ebs;
+			tc = pr->cbs;
+		}
+
+		b->tc = tc;
+	}
+
+	if (b->tc >= len) {
+		b->tc -= len;
+		return METER_GREEN;
+	}
+
+	if (b->te >= len) {
+		b->te -= len;
+		return METER_YELLOW;
+	}
+
+	return METER_RED;
+}
+
+static inline int meter_trtcm(const struct meter_profile *pr,
+		struct meter_bucket *b, uint64_t now, uint64_t len)
+{
+	uint64_t elapsed = now - b->time;
+
+	b->time = now;
+
+	if (elapsed >= pr->fill_c)
+		b->tc = pr->cbs;
+	else
+		b->tc = RTE_MIN(b->tc + elapsed * pr->cir, pr->cbs);
+
+	if (elapsed >= pr->fill_e)
+		b->te = pr->ebs;
+	else
+		b->te = RTE_MIN(b->te + elapsed * pr->pir, pr->ebs);
+
+	if (b->te < len)
+		return METER_RED;
+
+	b->te -= len;
+
+	if (b->tc < len)
+		return METER_YELLOW;
+
+	b->tc -= len;
+	return METER_GREEN;
+}
+
+static void meter_process_batch(struct module *m, struct pkt_batch *batch)
+{
+	struct meter_priv *priv = get_priv(m);
+	struct meter_bucket *buckets = priv->buckets;
+	gate_idx_t ogates[MAX_PKT_BURST];
+	uint32_t idx[MAX_PKT_BURST];
+	mt_offset_t key_offset = MT_OFFSET_INVALID;
+	uint64_t now = ctx.current_tsc;
+	int cnt = batch->cnt;
+
+	if (priv->key_attr >= 0)
+		key_offset = get_attr_offset(m, priv->key_attr);
+
+	for (int i = 0; i < cnt; i++) {
+		idx[i] = meter_index(priv, key_offset, batch->pkts[i]);
+		if (likely(idx[i] != METER_INVALID))
+			rte_prefetch0(&buckets[idx[i]]);
+	}
+
+	for (int i = 0; i < cnt; i++) {
+		struct meter_bucket *b;
+		const struct meter_profile *pr;
+		uint64_t len;
+
+		if (unlikely(idx[i] == METER_INVALID)) {
+			ogates[i] = METER_RED;
+			continue;
+		}
+
+		b = &buckets[idx[i]];
+		pr = &priv->profiles[b->profile];
+		len = (uint64_t)snb_total_len(batch->pkts[i]) <<
+				METER_FRAC_BITS;
+
+		if (priv->mode == METER_SRTCM)
+			ogates[i] = meter_srtcm(pr, b, now, len);
+		else
+			ogates[i] = meter_trtcm(pr, b, now, len);
+	}
+
+	run_split(m, ogates, batch);
+}
+
+/* bits per second to bytes per cycle, with METER_FRAC_BITS */
+static uint64_t meter_rate(uint64_t bps)
+{
+	return ((unsigned __int128)bps << METER_FRAC_BITS) / 8 / tsc_hz;
+}
+
+static uint64_t meter_fill_cycles(uint64_t tokens, uint64_t rate)
+{
+	return (tokens + rate - 1) / rate;
+}
+
+static struct snobj *meter_parse_profile(struct meter_priv *priv,
+		struct meter_profile *pr, struct snobj *arg)
+{
+	uint64_t cir_bps;
+	uint64_t cbs;
+	uint64_t ebs;
+
+	if (snobj_type(arg) != TYPE_MAP)
+		return snobj_err(EINVAL, "a profile must be a map");
+
+	cir_bps = snobj_eval_uint(arg, "cir");
+	cbs = snobj_eval_uint(arg, "cbs");
+	ebs = snobj_eval_uint(arg, (priv->mode == METER_SRTCM) ?
+			"ebs" : "pbs");
+
+	if (cbs == 0 || cbs > METER_MAX_BURST || ebs > METER_MAX_BURST)
+		return snobj_err(EINVAL, "burst sizes must be 1-%lu bytes",
+				METER_MAX_BURST);
+
+	pr->cir = meter_rate(cir_bps);
+	if (pr->cir == 0)
+		return snobj_err(EINVAL, "'cir' (bps) is too small");
+
+	pr->cbs = cbs << METER_FRAC_BITS;
+	pr->ebs = ebs << METER_FRAC_BITS;
+
+	if (priv->mode == METER_SRTCM) {
+		pr->pir = 0;
+		pr->fill_c = meter_fill_cycles(pr->cbs, pr->cir);
+		pr->fill_e = meter_fill_cycles(pr->cbs + pr->ebs, pr->cir);
+	} else {
+		uint64_t pir_bps = snobj_eval_uint(arg, "pir");
+
+		if (pir_bps < cir_bps)
+			return snobj_err(EINVAL, "'pir' must not be smaller "
+					"than 'cir'");
+
+		if (ebs < cbs)
+			return snobj_err(EINVAL, "'pbs' must not be smaller "
+					"than 'cbs'");
+
+		pr->pir = meter_rate(pir_bps);
+		pr->fill_c = meter_fill_cycles(pr->cbs, pr->cir);
+		pr->fill_e = meter_fill_cycles(pr->ebs, pr->pir);
+	}
+
+	return NULL;
+}
+
+static struct snobj *
+command_set(struct module *m, const char *cmd, struct snobj *arg)
+{
+	struct meter_priv *priv = get_priv(m);
+
+	if (snobj_type(arg) != TYPE_LIST)
+		return snobj_err(EINVAL, "argument must be a list of maps");
+
+	for (int i = 0; i < arg->size; i++) {
+		struct snobj *entry = snobj_list_get(arg, i);
+		int64_t index;
+		int64_t profile;
+
+		if (snobj_type(entry) != TYPE_MAP)
+			return snobj_err(EINVAL,
+					"argument must be a list of maps");
+
+		index = snobj_eval_int(entry, "index");
+		profile = snobj_eval_int(entry, "profile");
+
+		if (index < 0 || index >= priv->size)
+			return snobj_err(EINVAL, "'index' must be 0-%u",
+					priv->size - 1);
+
+		if (profile < 0 || profile >= priv->num_profiles)
+			return snobj_err(EINVAL, "'profile' must be 0-%d",
+					priv->num_profiles - 1);
+
+		/* the tokens are capped to the new burst sizes on refill */
+		priv->buckets[index].profile = profile;
+	}
+
+	return NULL;
+}
+
+static struct snobj *meter_init(struct module *m, struct snobj *arg)
+{
+	struct meter_priv *priv = get_priv(m);
+	const char *mode = "srtcm";
+	struct snobj *profiles;
+	uint64_t size = METER_DEFAULT_SIZE;
+
+	priv->key_attr = -1;
+	priv->key_offset = 26;		/* IPv4 source address */
+	priv->key_size = 4;
+
+	if (snobj_type(arg) != TYPE_MAP)
+		return snobj_err(EINVAL, "argument must be a map");
+
+	if (snobj_eval_exists(arg, "mode"))
+		mode = snobj_eval_str(arg, "mode");
+
+	if (mode && strcmp(mode, "srtcm") == 0)
+		priv->mode = METER_SRTCM;
+	else if (mode && strcmp(mode, "trtcm") == 0)
+		priv->mode = METER_TRTCM;
+	else
+		return snobj_err(EINVAL, "'mode' must be 'srtcm' or 'trtcm'");
+
+	if (snobj_eval_exists(arg, "size"))
+		size = snobj_eval_uint(arg, "size");
+
+	if (size == 0 || size > METER_MAX_SIZE)
+		return snobj_err(EINVAL, "'size' must be 1-%d",
+				METER_MAX_SIZE);
+
+	priv->size = size;
+
+	if (snobj_eval_exists(arg, "key_attr")) {
+		const char *name = snobj_eval_str(arg, "key_attr");
+
+		if (!name)
+			return snobj_err(EINVAL, "'key_attr' must be a string");
+
+		priv->key_attr = add_metadata_attr(m, name, sizeof(uint32_t),
+				MT_READ);
+		if (priv->key_attr < 0)
+			return snobj_errno(-priv->key_attr);
+	} else {
+		if (snobj_eval_exists(arg, "key_offset"))
+			priv->key_offset = snobj_eval_int(arg, "key_offset");
+		if (snobj_eval_exists(arg, "key_size"))
+			priv->key_size = snobj_eval_int(arg, "key_size");
+
+		if (priv->key_size < 1 || priv->key_size > 8)
+			return snobj_err(EINVAL, "'key_size' must be 1-8");
+
+		if (priv->key_offset < 0 ||
+				priv->key_offset + priv->key_size > SNBUF_DATA)
+			return snobj_err(EINVAL, "invalid 'key_offset'");
+	}
+
+	profiles = snobj_eval(arg, "profiles");
+	if (!profiles || snobj_type(profiles) != TYPE_LIST ||
+			profiles->size == 0)
+		return snobj_err(EINVAL, "'profiles' must be a non-empty "
+				"list of maps");
+
+	if (profiles->size > METER_MAX_PROFILES)
+		return snobj_err(EINVAL, "max %d profiles can be specified",
+				METER_MAX_PROFILES);
+
+	for (int i = 0; i < profiles->size; i++) {
+		struct snobj *err;
+
+		err = meter_parse_profile(priv, &priv->profiles[i],
+				snobj_list_get(profiles, i));
+		if (err)
+			return err;
+	}
+
+	priv->num_profiles = profiles->size;
+
+	/* all zeroes: the first profile, and full buckets on first use */
+	priv->buckets = rte_zmalloc_socket("meter_buckets",
+			size * sizeof(struct meter_bucket), 64, m->socket);
+	if (!priv->buckets)
+		return snobj_errno(ENOMEM);
+
+	return NULL;
+}
+
+static void meter_deinit(struct module *m)
+{
+	struct meter_priv *priv = get_priv(m);
+
+	rte_free(priv->buckets);
+}
+
+static struct snobj *meter_get_desc(const struct module *m)
+{
+	const struct meter_priv *priv = get_priv_const(m);
+
+	return snobj_str_fmt("%s, %u meters, %d profiles",
+			priv->mode == METER_SRTCM ? "srTCM" : "trTCM",
+			priv->size, priv->num_profiles);
+}
+
+static const struct mclass meter = {
+	.name 			= "Meter",
+	.help			=
+		"colors packets per flow with srTCM/trTCM (RFC 2697/2698)",
+	.def_module_name	= "meter",
+	.num_igates		= 1,
+	.num_ogates		= 3,
+	.priv_size		= sizeof(struct meter_priv),
+	.init 			= meter_init,
+	.deinit			= meter_deinit,
+	.process_batch 		= meter_process_batch,
+	.get_desc		= meter_get_desc,
+	.commands		= {
+		{"set",		command_set,	.mt_safe=1},
+	}
+};
+
+ADD_MCLASS(meter)
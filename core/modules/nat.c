@@ -0,0 +1,747 @@
+#include <arpa/inet.h>
+
+#include <rte_hash_crc.h>
+#include <rte_prefetch.h>
+#include <rte_tcp.h>
+#include <rte_udp.h>
+
+#include "../module.h"
+#include "../parse.h"
+#include "../time.h"
+#include "../timer.h"
+#include "../utils/checksum.h"
+
+/* Source NAT (NAPT) for TCP/UDP over IPv4, with connection tracking.
+ *
+ * igate/ogate 0: outbound (internal -> external). Unknown flows are
+ *   assigned an external address/port.
+ * igate/ogate 1: inbound (external -> internal). Packets that do not
+ *   belong to a known flow (from the same remote endpoint) are dropped.
+ * Anything else (non-IPv4, fragments, other protocols) is dropped.
+ *
+ * An external (address, port) pair of a protocol is a "slot", and each slot
+ * is used by at most one flow, so the flow of an inbound packet is found
+ * directly from its destination. The slots are split among the workers
+ * that exist when the module is created. Each worker allocates from its own
+ * slots and keeps its own hash table of outbound 5-tuples, so no locking is
+ * needed. Outbound packets of a flow must stay on the same worker, as RSS
+ * does. Inbound packets may arrive at any worker: flows are read without
+ * locks and validated with a per-flow sequence counter.
+ *
+ * Each flow has a timer in the wheel of its worker. When it fires, the flow
+ * is removed if it has been idle for the timeout, or re-armed otherwise,
+ * so packets only need to update the last-seen timestamp. */
+
+#define NAT_MAX_ADDRS		16
+
+#define NAT_TCP			0
+#define NAT_UDP			1
+#define NAT_NUM_PROTOS		2
+
+#define NAT_NONE		UINT32_MAX
+
+#define NAT_DEFAULT_PORT_MIN	1024
+#define NAT_DEFAULT_PORT_MAX	65535
+
+/* in seconds. RFC 4787 (REQ-5) and RFC 5382 (REQ-5) */
+#define NAT_DEFAULT_UDP_TIMEOUT	120
+#define NAT_DEFAULT_TCP_TIMEOUT	7440
+
+struct nat_flow {
+	volatile uint32_t seq;	/* odd while the flow is being updated */
+	uint32_t next;		/* in the hash chain of the owner */
+
+	/* all in network order */
+	uint32_t int_addr;
+	uint32_t rem_addr;
+	uint16_t int_port;
+	uint16_t rem_port;
+
+	uint8_t active;
+	uint8_t proto;		/* NAT_TCP or NAT_UDP */
+
+	volatile uint64_t last_seen;	/* TSC */
+
+	struct timer timer;
+} __attribute__((aligned(64)));
+
+/* a FIFO of free slots. FIFO, so that ports are not reused right away */
+struct nat_free_slots {
+	uint32_t *slots;
+	uint32_t size;
+	uint32_t head;		/* both are [0, size) */
+	uint32_t cnt;
+};
+
+struct nat_worker {
+	int owner;		/* 1 if the worker has its own slots */
+	uint32_t slot_begin;	/* [slot_begin, slot_end) */
+	uint32_t slot_end;
+	uint32_t *heads;	/* flow ids, or NAT_NONE */
+	uint32_t hash_mask;
+	struct nat_free_slots free[NAT_NUM_PROTOS];
+
+	uint64_t flows;		/* currently active */
+	uint64_t created;
+	uint64_t expired;
+	uint64_t no_slot;	/* no free port */
+	uint64_t no_owner;	/* new flows on a worker with no slots */
+	uint64_t inbound_miss;
+	uint64_t unsupported;	/* not TCP/UDP over IPv4, or a fragment */
+};
+
+struct nat_priv {
+	struct module *m;
+	int attr_id;
+
+	int n_addrs;
+	uint32_t ext_addrs[NAT_MAX_ADDRS];	/* network order */
+	uint16_t port_min;
+	uint32_t n_ports;
+	uint32_t n_slots;			/* n_addrs * n_ports */
+
+	uint64_t timeout[NAT_NUM_PROTOS];	/* in cycles */
+
+	/* NAT_NUM_PROTOS * n_slots, indexed by flow id */
+	struct nat_flow *flows;
+};
+
+struct nat_pkt {
+	struct ipv4_hdr *ip;
+	struct udp_hdr *l4;	/* ports are at the same offsets for TCP */
+	uint16_t *l4_cksum;
+	int l4_cksum_on;	/* 0 for UDP without a checksum */
+	int proto;		/* NAT_TCP, NAT_UDP, or -1 */
+	uint32_t hash;
+};
+
+static inline uint32_t nat_flow_id(const struct nat_priv *priv, int proto,
+		uint32_t slot)
+{
+	return proto * priv->n_slots + slot;
+}
+
+static inline uint32_t nat_hash(uint8_t proto, uint32_t int_addr,
+		uint16_t int_port, uint32_t rem_addr, uint16_t rem_port)
+{
+	uint32_t hash;
+
+	hash = rte_hash_crc_8byte(((uint64_t)int_addr << 32) | rem_addr, 0);
+	hash = rte_hash_crc_4byte(((uint32_t)int_port << 16) | rem_port, hash);
+
+	return rte_hash_crc_4byte(proto, hash);
+}
+
+static void nat_flow_expire(struct timer *t);
+
+static inline int nat_pop_slot(struct nat_free_slots *f, uint32_t *slot)
+{
+	if (!f->cnt)
+		return -ENOSPC;
+
+	*slot = f->slots[f->head];
+	f->head = (f->head + 1 == f->size) ? 0 : f->head + 1;
+	f->cnt--;
+
+	return 0;
+}
+
+static inline void nat_push_slot(struct nat_free_slots *f, uint32_t slot)
+{
+	uint32_t tail = f->head + f->cnt;
+
+	if (tail >= f->size)
+		tail -= f->size;
+
+	f->slots[tail] = slot;
+	f->cnt++;
+}
+
+/* the outbound flow of the 5-tuple of pkt, or NAT_NONE */
+static inline uint32_t nat_find(const struct nat_priv *priv,
+		const struct nat_worker *w, const struct nat_pkt *p)
+{
+	uint32_t id;
+
+	/* heads are only allocated for owners (e.g., not for workers
+	 * launched after init). nat_create() counts these as no_owner */
+	if (unlikely(!w->owner))
+		return NAT_NONE;
+
+	id = w->heads[p->hash & w->hash_mask];
+
+	while (id != NAT_NONE) {
+		const struct nat_flow *f = &priv->flows[id];
+
+		if (f->proto == p->proto &&
+				f->int_addr == p->ip->src_addr &&
+				f->rem_addr == p->ip->dst_addr &&
+				f->int_port == p->l4->src_port &&
+				f->rem_port == p->l4->dst_port)
+			return id;
+
+		id = f->next;
+	}
+
+	return NAT_NONE;
+}
+
+static uint32_t nat_create(struct nat_priv *priv, struct nat_worker *w,
+		const struct nat_pkt *p)
+{
+	struct nat_flow *f;
+	uint32_t *head;
+	uint32_t slot;
+	uint32_t id;
+
+	if (unlikely(!w->owner)) {
+		w->no_owner++;
+		return NAT_NONE;
+	}
+
+	if (nat_pop_slot(&w->free[p->proto], &slot)) {
+		w->no_slot++;
+		return NAT_NONE;
+	}
+
+	id = nat_flow_id(priv, p->proto, slot);
+	f = &priv->flows[id];
+
+	f->seq++;
+	STORE_BARRIER();
+
+	f->int_addr = p->ip->src_addr;
+	f->rem_addr = p->ip->dst_addr;
+	f->int_port = p->l4->src_port;
+	f->rem_port = p->l4->dst_port;
+	f->last_seen = ctx.current_tsc;
+	f->active = 1;
+
+	head = &w->heads[p->hash & w->hash_mask];
+	f->next = *head;
+	*head = id;
+
+	STORE_BARRIER();
+	f->seq++;
+
+	timer_arm(&f->timer, ctx.current_tsc + priv->timeout[p->proto]);
+
+	w->flows++;
+	w->created++;
+
+	return id;
+}
+
+/* called on the owner worker */
+static void nat_flow_expire(struct timer *t)
+{
+	struct nat_flow *f = container_of(t, struct nat_flow, timer);
+	struct nat_priv *priv = t->arg;
+	struct nat_worker *w = get_priv_worker(priv->m);
+	uint64_t expire = f->last_seen + priv->timeout[f->proto];
+	uint32_t id = f - priv->flows;
+	uint32_t *prev;
+
+	if (rdtsc() < expire) {
+		timer_arm(t, expire);
+		return;
+	}
+
+	prev = &w->heads[nat_hash(f->proto, f->int_addr, f->int_port,
+			f->rem_addr, f->rem_port) & w->hash_mask];
+	while (*prev != id)
+		prev = &priv->flows[*prev].next;
+	*prev = f->next;
+
+	f->seq++;
+	STORE_BARRIER();
+	f->active = 0;
+	STORE_BARRIER();
+	f->seq++;
+
+	nat_push_slot(&w->free[f->proto], id % priv->n_slots);
+
+	w->flows--;
+	w->expired++;
+}
+
+/* updates the checksums for an address/port change, before the fields
+ * are written. The L4 checksum covers the address in the pseudo header. */
+static inline void nat_update_cksums(struct nat_pkt *p,
+		uint32_t old_addr, uint32_t new_addr,
+		uint16_t old_port, uint16_t new_port)
+{
+	uint16_t cksum;
+
+	p->ip->hdr_checksum = cksum_update32(p->ip->hdr_checksum,
+			old_addr, new_addr);
+
+	if (!p->l4_cksum_on)
+		return;
+
+	cksum = cksum_update32(*p->l4_cksum, old_addr, new_addr);
+	cksum = cksum_update16(cksum, old_port, new_port);
+
+	/* for UDP, 0 means "no checksum". 0xffff is the same value in
+	 * one's complement */
+	if (p->proto == NAT_UDP && cksum == 0)
+		cksum = 0xffff;
+
+	*p->l4_cksum = cksum;
+}
+
+static gate_idx_t nat_outbound(struct nat_priv *priv, struct nat_worker *w,
+		struct nat_pkt *p)
+{
+	uint32_t id = nat_find(priv, w, p);
+	uint32_t slot;
+	uint32_t ext_addr;
+	uint16_t ext_port;
+
+	if (id == NAT_NONE) {
+		id = nat_create(priv, w, p);
+		if (id == NAT_NONE)
+			return DROP_GATE;
+	}
+
+	priv->flows[id].last_seen = ctx.current_tsc;
+
+	slot = id % priv->n_slots;
+	ext_addr = priv->ext_addrs[slot / priv->n_ports];
+	ext_port = rte_cpu_to_be_16(priv->port_min + slot % priv->n_ports);
+
+	nat_update_cksums(p, p->ip->src_addr, ext_addr,
+			p->l4->src_port, ext_port);
+	p->ip->src_addr = ext_addr;
+	p->l4->src_port = ext_port;
+
+	return 0;
+}
+
+/* the flow id of the destination of an inbound packet, or NAT_NONE */
+static inline uint32_t nat_inbound_id(const struct nat_priv *priv,
+		const struct nat_pkt *p)
+{
+	uint32_t port = rte_be_to_cpu_16(p->l4->dst_port) - priv->port_min;
+
+	if (port >= priv->n_ports)
+		return NAT_NONE;
+
+	for (int i = 0; i < priv->n_addrs; i++)
+		if (priv->ext_addrs[i] == p->ip->dst_addr)
+			return nat_flow_id(priv, p->proto,
+					i * priv->n_ports + port);
+
+	return NAT_NONE;
+}
+
+static gate_idx_t nat_inbound(struct nat_priv *priv, struct nat_worker *w,
+		struct nat_pkt *p, uint32_t id)
+{
+	struct nat_flow *f;
+	uint32_t seq;
+	uint32_t int_addr;
+	uint16_t int_port;
+	int match;
+
+	if (id == NAT_NONE)
+		goto miss;
+
+	/* may be owned by another worker */
+	f = &priv->flows[id];
+	seq = f->seq;
+	LOAD_BARRIER();
+
+	match = !(seq & 1) && f->active &&
+		f->rem_addr == p->ip->src_addr &&
+		f->rem_port == p->l4->src_port;
+	int_addr = f->int_addr;
+	int_port = f->int_port;
+
+	LOAD_BARRIER();
+	if (!match || f->seq != seq)
+		goto miss;
+
+	f->last_seen = ctx.current_tsc;
+
+	nat_update_cksums(p, p->ip->dst_addr, int_addr,
+			p->l4->dst_port, int_port);
+	p->ip->dst_addr = int_addr;
+	p->l4->dst_port = int_port;
+
+	return 1;
+
+miss:
+	w->inbound_miss++;
+	return DROP_GATE;
+}
+
+/* fills p, and returns 0 if the packet can be translated */
+static inline int nat_parse(struct module *m, int attr_id, int parsed,
+		struct snbuf *snb, struct nat_pkt *p)
+{
+	struct pkt_parse local;
+	struct pkt_parse *pp;
+	char *head = snb_head_data(snb);
+
+	if (parsed) {
+		pp = get_parse(m, attr_id, snb);
+	} else {
+		parse_packet(snb, &local);
+		pp = &local;
+	}
+
+	if (!(pp->flags & PARSE_IPV4) || (pp->flags & PARSE_FRAG) ||
+			!pp->l4_offset)
+		return -1;
+
+	p->ip = (struct ipv4_hdr *)(head + pp->l3_offset);
+	p->l4 = (struct udp_hdr *)(head + pp->l4_offset);
+
+	if (pp->l4_proto == IPPROTO_TCP) {
+		if (pp->l4_offset + sizeof(struct tcp_hdr) > snb_head_len(snb))
+			return -1;
+
+		p->proto = NAT_TCP;
+		p->l4_cksum = (uint16_t *)((char *)p->l4 +
+				offsetof(struct tcp_hdr, cksum));
+		p->l4_cksum_on = 1;
+	} else if (pp->l4_proto == IPPROTO_UDP) {
+		if (pp->l4_offset + sizeof(struct udp_hdr) > snb_head_len(snb))
+			return -1;
+
+		p->proto = NAT_UDP;
+		p->l4_cksum = (uint16_t *)((char *)p->l4 +
+				offsetof(struct udp_hdr, dgram_cksum));
+		p->l4_cksum_on = (p->l4->dgram_cksum != 0);
+	} else
+		return -1;
+
+	return 0;
+}
+
+static void nat_process_batch(struct module *m, struct pkt_batch *batch)
+{
+	struct nat_priv *priv = get_priv(m);
+	struct nat_worker *w = get_priv_worker(m);
+	int attr_id = priv->attr_id;
+	int parsed = parse_available(m, attr_id);
+	int inbound = (get_igate() == 1);
+	int cnt = batch->cnt;
+
+	struct nat_pkt pkts[MAX_PKT_BURST];
+	uint32_t ids[MAX_PKT_BURST];
+	gate_idx_t ogates[MAX_PKT_BURST];
+
+	/* parse all packets and prefetch their hash chain heads (outbound)
+	 * or flows (inbound) first */
+	for (int i = 0; i < cnt; i++) {
+		struct nat_pkt *p = &pkts[i];
+
+		if (nat_parse(m, attr_id, parsed, batch->pkts[i], p)) {
+			p->proto = -1;
+			continue;
+		}
+
+		if (inbound) {
+			ids[i] = nat_inbound_id(priv, p);
+			if (ids[i] != NAT_NONE)
+				rte_prefetch0(&priv->flows[ids[i]]);
+		} else {
+			p->hash = nat_hash(p->proto, p->ip->src_addr,
+					p->l4->src_port, p->ip->dst_addr,
+					p->l4->dst_port);
+			if (likely(w->owner))
+				rte_prefetch0(&w->heads[p->hash &
+						w->hash_mask]);
+		}
+	}
+
+	for (int i = 0; i < cnt; i++) {
+		struct nat_pkt *p = &pkts[i];
+
+		if (p->proto < 0) {
+			w->unsupported++;
+			ogates[i] = DROP_GATE;
+		} else if (inbound)
+			ogates[i] = nat_inbound(priv, w, p, ids[i]);
+		else
+			ogates[i] = nat_outbound(priv, w, p);
+	}
+
+	run_split(m, ogates, batch);
+}
+
+static struct snobj *nat_parse_addrs(struct nat_priv *priv, struct snobj *arg)
+{
+	struct snobj *addrs = snobj_eval(arg, "ext_addrs");
+
+	if (!addrs || snobj_type(addrs) != TYPE_LIST || addrs->size == 0)
+		return snobj_err(EINVAL, "'ext_addrs' must be a non-empty "
+				"list of IPv4 addresses");
+
+	if (addrs->size > NAT_MAX_ADDRS)
+		return snobj_err(EINVAL, "max %d external addresses can be "
+				"specified", NAT_MAX_ADDRS);
+
+	for (int i = 0; i < addrs->size; i++) {
+		struct snobj *addr = snobj_list_get(addrs, i);
+
+		if (snobj_type(addr) != TYPE_STR ||
+				inet_pton(AF_INET, snobj_str_get(addr),
+					&priv->ext_addrs[i]) != 1)
+			return snobj_err(EINVAL, "invalid IPv4 address in "
+					"'ext_addrs'");
+	}
+
+	priv->n_addrs = addrs->size;
+
+	return NULL;
+}
+
+/* splits the slots among the workers that exist now */
+static int nat_init_workers(struct module *m)
+{
+	struct nat_priv *priv = get_priv(m);
+	struct nat_worker *w;
+	int n_owners = 0;
+	int owner = 0;
+	int wid;
+
+	for (wid = 0; wid < MAX_WORKERS; wid++)
+		n_owners += is_worker_active(wid);
+
+	for_each_priv_worker(m, wid, w) {
+		uint32_t begin;
+		uint32_t end;
+		uint32_t n;
+
+		/* with no workers yet, worker 0 takes everything */
+		if (n_owners ? !is_worker_active(wid) : wid != 0)
+			continue;
+
+		begin = (uint64_t)priv->n_slots * owner / RTE_MAX(n_owners, 1);
+		end = (uint64_t)priv->n_slots * (owner + 1) /
+			RTE_MAX(n_owners, 1);
+		n = end - begin;
+		owner++;
+
+		if (n == 0)
+			continue;
+
+		w->hash_mask = rte_align32pow2(n * NAT_NUM_PROTOS) - 1;
+		w->heads = rte_malloc_socket("nat_heads",
+				(w->hash_mask + 1) * sizeof(uint32_t), 0,
+				m->socket);
+		if (!w->heads)
+			return -ENOMEM;
+
+		memset(w->heads, 0xff, (w->hash_mask + 1) * sizeof(uint32_t));
+
+		for (int proto = 0; proto < NAT_NUM_PROTOS; proto++) {
+			struct nat_free_slots *f = &w->free[proto];
+
+			f->slots = rte_malloc_socket("nat_free_slots",
+					n * sizeof(uint32_t), 0, m->socket);
+			if (!f->slots)
+				return -ENOMEM;
+
+			f->size = n;
+			f->cnt = 0;
+			f->head = 0;
+
+			for (uint32_t slot = begin; slot < end; slot++)
+				nat_push_slot(f, slot);
+		}
+
+		w->slot_begin = begin;
+		w->slot_end = end;
+		w->owner = 1;
+	}
+
+	return 0;
+}
+
+/* Flows of its own slots are only armed by the worker. They stay in the
+ * table, but they will not expire any more if the worker is removed */
+static void nat_deinit_worker(struct module *m, int wid)
+{
+	struct nat_priv *priv = get_priv(m);
+	struct nat_worker *w = get_priv_worker_by_wid(m, wid);
+
+	if (!w->owner || !priv->flows)
+		return;
+
+	for (int proto = 0; proto < NAT_NUM_PROTOS; proto++)
+		for (uint32_t slot = w->slot_begin; slot < w->slot_end; slot++)
+			timer_cancel(&priv->flows[nat_flow_id(priv, proto,
+						slot)].timer);
+}
+
+static void nat_deinit(struct module *m)
+{
+	struct nat_priv *priv = get_priv(m);
+	struct nat_worker *w;
+	int wid;
+
+	for_each_priv_worker(m, wid, w) {
+		rte_free(w->heads);
+		for (int proto = 0; proto < NAT_NUM_PROTOS; proto++)
+			rte_free(w->free[proto].slots);
+	}
+
+	rte_free(priv->flows);
+}
+
+static struct snobj *nat_init(struct module *m, struct snobj *arg)
+{
+	struct nat_priv *priv = get_priv(m);
+	struct snobj *err;
+	int64_t port_min = NAT_DEFAULT_PORT_MIN;
+	int64_t port_max = NAT_DEFAULT_PORT_MAX;
+	int64_t udp_timeout = NAT_DEFAULT_UDP_TIMEOUT;
+	int64_t tcp_timeout = NAT_DEFAULT_TCP_TIMEOUT;
+	int ret;
+
+	priv->m = m;
+
+	if (!arg || snobj_type(arg) != TYPE_MAP)
+		return snobj_err(EINVAL, "argument must be a map");
+
+	err = nat_parse_addrs(priv, arg);
+	if (err)
+		return err;
+
+	if (snobj_eval_exists(arg, "port_min"))
+		port_min = snobj_eval_int(arg, "port_min");
+	if (snobj_eval_exists(arg, "port_max"))
+		port_max = snobj_eval_int(arg, "port_max");
+
+	if (port_min < 1 || port_max > 65535 || port_min > port_max)
+		return snobj_err(EINVAL, "invalid port range %ld-%ld",
+				port_min, port_max);
+
+	if (snobj_eval_exists(arg, "udp_timeout"))
+		udp_timeout = snobj_eval_int(arg, "udp_timeout");
+	if (snobj_eval_exists(arg, "tcp_timeout"))
+		tcp_timeout = snobj_eval_int(arg, "tcp_timeout");
+
+	if (udp_timeout <= 0 || tcp_timeout <= 0)
+		return snobj_err(EINVAL, "timeouts (in seconds) must be "
+				"positive");
+
+	priv->port_min = port_min;
+	priv->n_ports = port_max - port_min + 1;
+	priv->n_slots = priv->n_addrs * priv->n_ports;
+	priv->timeout[NAT_TCP] = tcp_timeout * tsc_hz;
+	priv->timeout[NAT_UDP] = udp_timeout * tsc_hz;
+
+	priv->attr_id = add_parse_attr(m, MT_READ);
+	if (priv->attr_id < 0)
+		return snobj_errno(-priv->attr_id);
+
+	priv->flows = rte_zmalloc_socket("nat_flows",
+			NAT_NUM_PROTOS * priv->n_slots *
+			sizeof(struct nat_flow), 0, m->socket);
+	if (!priv->flows)
+		return snobj_errno(ENOMEM);
+
+	for (uint32_t id = 0; id < NAT_NUM_PROTOS * priv->n_slots; id++) {
+		priv->flows[id].proto = id / priv->n_slots;
+		timer_init(&priv->flows[id].timer, nat_flow_expire, priv);
+	}
+
+	ret = nat_init_workers(m);
+	if (ret) {
+		nat_deinit(m);
+		return snobj_errno(-ret);
+	}
+
+	return NULL;
+}
+
+static struct snobj *nat_get_desc(const struct module *m)
+{
+	const struct nat_worker *w;
+	uint64_t flows = 0;
+	int wid;
+
+	for_each_priv_worker(m, wid, w)
+		flows += w->flows;
+
+	return snobj_str_fmt("%lu flows", flows);
+}
+
+static struct snobj *
+command_get_stats(struct module *m, const char *cmd, struct snobj *arg)
+{
+	struct nat_priv *priv = get_priv(m);
+	struct snobj *workers = snobj_list();
+	struct snobj *r = snobj_map();
+	struct nat_worker total = {};
+	struct nat_worker *w;
+	int wid;
+
+	for_each_priv_worker(m, wid, w) {
+		struct snobj *stats;
+
+		total.flows += w->flows;
+		total.created += w->created;
+		total.expired += w->expired;
+		total.no_slot += w->no_slot;
+		total.no_owner += w->no_owner;
+		total.inbound_miss += w->inbound_miss;
+		total.unsupported += w->unsupported;
+
+		if (!w->owner && !w->no_owner && !w->inbound_miss &&
+				!w->unsupported)
+			continue;
+
+		stats = snobj_map();
+		snobj_map_set(stats, "wid", snobj_int(wid));
+		snobj_map_set(stats, "flows", snobj_uint(w->flows));
+		snobj_map_set(stats, "free_tcp_ports",
+				snobj_uint(w->free[NAT_TCP].cnt));
+		snobj_map_set(stats, "free_udp_ports",
+				snobj_uint(w->free[NAT_UDP].cnt));
+		snobj_map_set(stats, "created", snobj_uint(w->created));
+		snobj_map_set(stats, "expired", snobj_uint(w->expired));
+		snobj_map_set(stats, "insert_failed",
+				snobj_uint(w->no_slot + w->no_owner));
+		snobj_list_add(workers, stats);
+	}
+
+	snobj_map_set(r, "flows", snobj_uint(total.flows));
+	snobj_map_set(r, "capacity",
+			snobj_uint(NAT_NUM_PROTOS * priv->n_slots));
+	snobj_map_set(r, "created", snobj_uint(total.created));
+	snobj_map_set(r, "expired", snobj_uint(total.expired));
+	snobj_map_set(r, "insert_failed_no_port", snobj_uint(total.no_slot));
+	snobj_map_set(r, "insert_failed_no_owner", snobj_uint(total.no_owner));
+	snobj_map_set(r, "inbound_miss", snobj_uint(total.inbound_miss));
+	snobj_map_set(r, "unsupported", snobj_uint(total.unsupported));
+	snobj_map_set(r, "workers", workers);
+
+	return r;
+}
+
+static const struct mclass nat = {
+	.name			= "NAT",
+	.help			=
+		"source NAT for TCP/UDP over IPv4 (0: outbound, 1: inbound)",
+	.def_module_name	= "nat",
+	.num_igates		= 2,
+	.num_ogates		= 2,
+	.priv_size		= sizeof(struct nat_priv),
+	.priv_worker_size	= sizeof(struct nat_worker),
+	.init			= nat_init,
+	.deinit			= nat_deinit,
+	.deinit_worker		= nat_deinit_worker,
+	.get_desc		= nat_get_desc,
+	.process_batch		= nat_process_batch,
+	.commands		= {
+		{"get_stats",	command_get_stats,	.mt_safe=1},
+	}
+};
+
+ADD_MCLASS(nat)
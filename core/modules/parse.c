@@ -0,0 +1,54 @@
+#include "../module.h"
+#include "../parse.h"
+
+struct parse_priv {
+	int attr_id;
+};
+
+static struct snobj *parse_init(struct module *m, struct snobj *arg)
+{
+	struct parse_priv *priv = get_priv(m);
+
+	priv->attr_id = add_parse_attr(m, MT_WRITE);
+	if (priv->attr_id < 0)
+		return snobj_errno(-priv->attr_id);
+
+	return NULL;
+}
+
+static void parse_process_batch(struct module *m, struct pkt_batch *batch)
+{
+	struct parse_priv *priv = get_priv(m);
+	int attr_id = priv->attr_id;
+	int cnt = batch->cnt;
+
+	/* no space left, or nobody downstream */
+	if (!parse_available(m, attr_id))
+		goto out;
+
+	for (int i = 0; i < cnt; i++) {
+		struct snbuf *pkt = batch->pkts[i];
+
+		if (i + 1 < cnt)
+			rte_prefetch0(snb_head_data(batch->pkts[i + 1]));
+
+		parse_packet(pkt, get_parse(m, attr_id, pkt));
+	}
+
+out:
+	run_next_module(m, batch);
+}
+
+static const struct mclass parse = {
+	.name 			= "Parse",
+	.help			= 
+		"caches L2/L3/L4 header offsets in the packet metadata",
+	.def_module_name	= "parse",
+	.num_igates		= 1,
+	.num_ogates		= 1,
+	.priv_size		= sizeof(struct parse_priv),
+	.init			= parse_init,
+	.process_batch		= parse_process_batch,
+};
+
+ADD_MCLASS(parse)
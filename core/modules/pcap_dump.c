@@ -0,0 +1,414 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include <rte_malloc.h>
+
+#include "../module.h"
+#include "../utils/mcslock.h"
+#include "../kmod/llring.h"
+
+/* Captures packets to a pcap file, without doing any I/O on workers.
+ *
+ * Workers copy the pcap records into a stream of large chunks. Full chunks
+ * are handed to a writer thread through an llring, written with a single
+ * write() each, and returned through another llring. Records may straddle
+ * chunks, so that every chunk but the last one is completely filled
+ * (a requirement of O_DIRECT, with "direct").
+ *
+ * If no chunk is available (the disk is not fast enough), the packets are
+ * not captured and counted as dropped. Packets are always passed through
+ * to the output gate. */
+
+#define DEF_CHUNK_KB		1024
+#define DEF_NUM_CHUNKS		64
+#define MAX_NUM_CHUNKS		65536
+
+/* for O_DIRECT */
+#define DIRECT_ALIGN		4096
+
+#define WRITER_IDLE_US		100
+
+struct dump_chunk {
+	char *data;
+	uint32_t used;
+};
+
+struct pcap_dump_priv {
+	int fd;
+	int direct;
+	uint32_t snaplen;
+	uint32_t chunk_size;
+	uint32_t num_chunks;
+
+	struct dump_chunk *chunks;
+	struct llring *free_q;		/* writer -> workers */
+	struct llring *full_q;		/* workers -> writer */
+
+	pthread_t writer;
+	int writer_started;
+	volatile int stop;
+
+	/* serializes workers, for everything below */
+	mcslock_t lock;
+
+	struct dump_chunk *cur;		/* NULL if ran out of chunks */
+
+	uint64_t pkts;
+	uint64_t bytes;			/* including the pcap headers */
+	uint64_t truncated;		/* longer than snaplen */
+	uint64_t dropped;		/* no chunk available */
+
+	/* updated by the writer thread */
+	volatile uint64_t chunks_written;
+	volatile uint64_t bytes_written;
+	volatile uint64_t write_errors;
+	volatile int last_errno;
+};
+
+static void write_chunk(struct pcap_dump_priv *priv, struct dump_chunk *c)
+{
+	uint32_t off = 0;
+
+	while (off < c->used) {
+		ssize_t ret = write(priv->fd, c->data + off, c->used - off);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+
+			/* the rest of the chunk is lost */
+			priv->last_errno = errno;
+			priv->write_errors++;
+			break;
+		}
+
+		off += ret;
+	}
+
+	priv->bytes_written += off;
+	priv->chunks_written++;
+}
+
+static void *writer_main(void *arg)
+{
+	struct pcap_dump_priv *priv = arg;
+
+	for (;;) {
+		void *c;
+
+		if (llring_sc_dequeue(priv->full_q, &c) == 0) {
+			write_chunk(priv, c);
+			((struct dump_chunk *)c)->used = 0;
+			llring_sp_enqueue(priv->free_q, c);
+			continue;
+		}
+
+		/* all full chunks have been written */
+		if (priv->stop)
+			break;
+
+		usleep(WRITER_IDLE_US);
+	}
+
+	return NULL;
+}
+
+/* how many bytes can be appended without running out of chunks.
+ * Only a lower bound, since the writer may return more chunks */
+static inline uint64_t room_left(struct pcap_dump_priv *priv)
+{
+	uint64_t room = (uint64_t)priv->chunk_size *
+		llring_count(priv->free_q);
+
+	if (priv->cur)
+		room += priv->chunk_size - priv->cur->used;
+
+	return room;
+}
+
+/* room_left() must have been checked */
+static void append(struct pcap_dump_priv *priv, const void *src, uint32_t len)
+{
+	while (len > 0) {
+		struct dump_chunk *c = priv->cur;
+		uint32_t copy;
+
+		if (!c || c->used == priv->chunk_size) {
+			void *next;
+
+			if (c)
+				llring_sp_enqueue(priv->full_q, c);
+
+			/* cannot fail, as long as room_left() was checked */
+			llring_sc_dequeue(priv->free_q, &next);
+			priv->cur = c = next;
+		}
+
+		copy = RTE_MIN(len, priv->chunk_size - c->used);
+		rte_memcpy(c->data + c->used, src, copy);
+
+		c->used += copy;
+		src = (const char *)src + copy;
+		len -= copy;
+	}
+}
+
+static void dump_pkt(struct pcap_dump_priv *priv, struct snbuf *pkt,
+		const struct timeval *tv)
+{
+	struct rte_mbuf *seg = &pkt->mbuf;
+	struct pcap_rec_hdr hdr;
+	uint32_t len = snb_total_len(pkt);
+	uint32_t caplen = RTE_MIN(len, priv->snaplen);
+
+	if (unlikely(room_left(priv) < sizeof(hdr) + caplen)) {
+		priv->dropped++;
+		return;
+	}
+
+	hdr.ts_sec = tv->tv_sec;
+	hdr.ts_usec = tv->tv_usec;
+	hdr.incl_len = caplen;
+	hdr.orig_len = len;
+
+	append(priv, &hdr, sizeof(hdr));
+
+	priv->pkts++;
+	priv->bytes += sizeof(hdr) + caplen;
+	priv->truncated += (caplen < len);
+
+	for (; seg && caplen > 0; seg = seg->next) {
+		uint32_t copy = RTE_MIN(caplen, (uint32_t)seg->data_len);
+
+		append(priv, rte_pktmbuf_mtod(seg, void *), copy);
+		caplen -= copy;
+	}
+}
+
+static void pcap_dump_process_batch(struct module *m, struct pkt_batch *batch)
+{
+	struct pcap_dump_priv *priv = get_priv(m);
+	mcslock_node_t mynode;
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	mcs_lock(&priv->lock, &mynode);
+
+	for (int i = 0; i < batch->cnt; i++)
+		dump_pkt(priv, batch->pkts[i], &tv);
+
+	mcs_unlock(&priv->lock, &mynode);
+
+	run_next_module(m, batch);
+}
+
+static struct llring *alloc_ring(uint32_t num_chunks)
+{
+	/* one slot of a llring is always left empty */
+	uint32_t slots = rte_align32pow2(num_chunks + 1);
+	struct llring *r;
+
+	r = rte_zmalloc("pcap_dump_ring", llring_bytes_with_slots(slots), 0);
+	if (!r)
+		return NULL;
+
+	if (llring_init(r, slots, 1, 1)) {
+		rte_free(r);
+		return NULL;
+	}
+
+	return r;
+}
+
+static void pcap_dump_deinit(struct module *m)
+{
+	struct pcap_dump_priv *priv = get_priv(m);
+
+	if (priv->writer_started) {
+		priv->stop = 1;
+		pthread_join(priv->writer, NULL);
+		priv->writer_started = 0;
+	}
+
+	/* write the last (partial) chunk */
+	if (priv->fd >= 0 && priv->cur && priv->cur->used > 0) {
+		if (priv->direct)
+			fcntl(priv->fd, F_SETFL,
+					fcntl(priv->fd, F_GETFL) & ~O_DIRECT);
+
+		write_chunk(priv, priv->cur);
+		priv->cur->used = 0;
+	}
+
+	if (priv->fd >= 0) {
+		close(priv->fd);
+		priv->fd = -1;
+	}
+
+	if (priv->chunks) {
+		for (uint32_t i = 0; i < priv->num_chunks; i++)
+			rte_free(priv->chunks[i].data);
+
+		rte_free(priv->chunks);
+		priv->chunks = NULL;
+	}
+
+	rte_free(priv->free_q);
+	rte_free(priv->full_q);
+	priv->free_q = priv->full_q = NULL;
+}
+
+static struct snobj *pcap_dump_init(struct module *m, struct snobj *arg)
+{
+	struct pcap_dump_priv *priv = get_priv(m);
+
+	struct pcap_hdr file_hdr = {
+		.magic_number = PCAP_MAGIC_NUMBER,
+		.version_major = PCAP_VERSION_MAJOR,
+		.version_minor = PCAP_VERSION_MINOR,
+		.thiszone = PCAP_THISZONE,
+		.sigfigs = PCAP_SIGFIGS,
+		.snaplen = PCAP_SNAPLEN,
+		.network = PCAP_NETWORK,
+	};
+
+	const char *file;
+	int64_t chunk_kb = DEF_CHUNK_KB;
+	int64_t num_chunks = DEF_NUM_CHUNKS;
+	int64_t snaplen = PCAP_SNAPLEN;
+	int flags;
+	int ret;
+
+	priv->fd = -1;
+	mcs_lock_init(&priv->lock);
+
+	if (!arg || !(file = snobj_eval_str(arg, "file")))
+		return snobj_err(EINVAL, "'file' must be given as a string");
+
+	if (snobj_eval_exists(arg, "snaplen"))
+		snaplen = snobj_eval_int(arg, "snaplen");
+
+	if (snobj_eval_exists(arg, "chunk_kb"))
+		chunk_kb = snobj_eval_int(arg, "chunk_kb");
+
+	if (snobj_eval_exists(arg, "num_chunks"))
+		num_chunks = snobj_eval_int(arg, "num_chunks");
+
+	priv->direct = snobj_eval_int(arg, "direct");
+
+	if (snaplen < 1 || snaplen > PCAP_SNAPLEN)
+		return snobj_err(EINVAL, "'snaplen' must be 1-%d",
+				PCAP_SNAPLEN);
+
+	if (chunk_kb < 4 || chunk_kb > 65536 ||
+			(priv->direct && (chunk_kb * 1024) % DIRECT_ALIGN))
+		return snobj_err(EINVAL, "'chunk_kb' must be 4-65536, and "
+				"a multiple of %d with 'direct'",
+				DIRECT_ALIGN / 1024);
+
+	if (num_chunks < 2 || num_chunks > MAX_NUM_CHUNKS)
+		return snobj_err(EINVAL, "'num_chunks' must be 2-%d",
+				MAX_NUM_CHUNKS);
+
+	priv->snaplen = snaplen;
+	priv->chunk_size = chunk_kb * 1024;
+	priv->num_chunks = num_chunks;
+
+	flags = O_WRONLY | O_CREAT | O_TRUNC;
+	if (priv->direct)
+		flags |= O_DIRECT;
+
+	priv->fd = open(file, flags, 0644);
+	if (priv->fd < 0)
+		return snobj_err(errno, "Cannot open '%s': %s", file,
+				strerror(errno));
+
+	priv->free_q = alloc_ring(priv->num_chunks);
+	priv->full_q = alloc_ring(priv->num_chunks);
+	priv->chunks = rte_zmalloc("pcap_dump_chunks",
+			sizeof(struct dump_chunk) * priv->num_chunks, 0);
+	if (!priv->free_q || !priv->full_q || !priv->chunks)
+		goto oom;
+
+	for (uint32_t i = 0; i < priv->num_chunks; i++) {
+		struct dump_chunk *c = &priv->chunks[i];
+
+		c->data = rte_malloc("pcap_dump_chunk", priv->chunk_size,
+				DIRECT_ALIGN);
+		if (!c->data)
+			goto oom;
+
+		llring_sp_enqueue(priv->free_q, c);
+	}
+
+	/* the file header goes through the chunks as well, so that all
+	 * writes stay aligned for O_DIRECT */
+	file_hdr.snaplen = priv->snaplen;
+	append(priv, &file_hdr, sizeof(file_hdr));
+
+	ret = pthread_create(&priv->writer, NULL, writer_main, priv);
+	if (ret) {
+		pcap_dump_deinit(m);
+		return snobj_err(ret, "pthread_create() failed");
+	}
+
+	priv->writer_started = 1;
+
+	return NULL;
+
+oom:
+	pcap_dump_deinit(m);
+	return snobj_err(ENOMEM, "Out of memory");
+}
+
+static struct snobj *pcap_dump_get_desc(const struct module *m)
+{
+	const struct pcap_dump_priv *priv = get_priv_const(m);
+
+	return snobj_str_fmt("%lu/%lu dropped", priv->dropped,
+			priv->pkts + priv->dropped);
+}
+
+static struct snobj *
+command_get_stats(struct module *m, const char *cmd, struct snobj *arg)
+{
+	struct pcap_dump_priv *priv = get_priv(m);
+	struct snobj *r = snobj_map();
+
+	snobj_map_set(r, "packets", snobj_uint(priv->pkts));
+	snobj_map_set(r, "bytes", snobj_uint(priv->bytes));
+	snobj_map_set(r, "truncated", snobj_uint(priv->truncated));
+	snobj_map_set(r, "dropped", snobj_uint(priv->dropped));
+	snobj_map_set(r, "chunks_written", snobj_uint(priv->chunks_written));
+	snobj_map_set(r, "bytes_written", snobj_uint(priv->bytes_written));
+	snobj_map_set(r, "write_errors", snobj_uint(priv->write_errors));
+	snobj_map_set(r, "chunks_pending",
+			snobj_uint(llring_count(priv->full_q)));
+
+	if (priv->write_errors)
+		snobj_map_set(r, "last_error",
+				snobj_str(strerror(priv->last_errno)));
+
+	return r;
+}
+
+static const struct mclass pcap_dump = {
+	.name 		= "PcapDump",
+	.help		= "captures packets to a pcap file, "
+			  "with asynchronous writes",
+	.num_igates	= 1,
+	.num_ogates	= 1,
+	.priv_size	= sizeof(struct pcap_dump_priv),
+	.init 		= pcap_dump_init,
+	.deinit		= pcap_dump_deinit,
+	.get_desc	= pcap_dump_get_desc,
+	.process_batch 	= pcap_dump_process_batch,
+	.commands	 = {
+		{"get_stats",	command_get_stats,	.mt_safe=1},
+	}
+};
+
+ADD_MCLASS(pcap_dump)
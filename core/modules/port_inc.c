@@ -4,7 +4,7 @@
 struct port_inc_priv {
 	struct port *port;
 	pkt_io_func_t recv_pkts;
-	int prefetch;
+	int burst;
 };
 
 static struct snobj *port_inc_init(struct module *m, struct snobj *arg)
@@ -36,7 +36,18 @@ static struct snobj *port_inc_init(struct module *m, struct snobj *arg)
 	}
 
 	if (snobj_eval_int(arg, "prefetch"))
-		priv->prefetch = 1;
+		select_variant(m, "prefetch");
+
+	priv->burst = MAX_PKT_BURST;
+	if (snobj_eval(arg, "burst")) {
+		int burst = snobj_eval_int(arg, "burst");
+
+		if (burst < 1 || burst > MAX_PKT_BURST)
+			return snobj_err(EINVAL, "'burst' must be between "
+					"1 and %d", MAX_PKT_BURST);
+
+		priv->burst = burst;
+	}
 
 	ret = acquire_queues(priv->port, m, PACKET_DIR_INC, NULL, 0);
 	if (ret < 0)
@@ -61,8 +72,9 @@ static struct snobj *port_inc_get_desc(const struct module *m)
 	return snobj_str_fmt("%s/%s", priv->port->name, priv->port->driver->name);
 }
 
-static struct task_result
-port_inc_run_task(struct module *m, void *arg)
+/* prefetch is a constant, so that each variant has only its own loop */
+static inline __attribute__((always_inline)) struct task_result
+do_run_task(struct module *m, void *arg, const int prefetch)
 {
 	struct port_inc_priv *priv = get_priv(m);
 	struct port *p = priv->port;
@@ -70,45 +82,62 @@ port_inc_run_task(struct module *m, void *arg)
 	const queue_t qid = (queue_t)(uint64_t)arg;
 
 	struct pkt_batch batch;
-	struct task_result ret;
-
-	uint64_t received_bytes = 0;
+	struct task_result ret = {.packets = 0, .bits = 0};
 
-	const int pkt_burst = MAX_PKT_BURST;
+	const uint32_t task_burst = get_task_burst();
+	const int pkt_burst = priv->burst;
 	const int pkt_overhead = 24;
 
 	int cnt;
 
-	cnt = batch.cnt = priv->recv_pkts(p, qid, batch.pkts, pkt_burst);
+	/* task_burst may be larger than a batch, if autotuned.
+	 * Keep receiving as long as the queue gives full batches. */
+	do {
+		uint64_t received_bytes = 0;
+
+		cnt = batch.cnt = priv->recv_pkts(p, qid, batch.pkts, 
+				pkt_burst);
+		if (cnt == 0)
+			break;
+
+		/* NOTE: we cannot skip this step since it might be used by 
+		 * scheduler */
+		if (prefetch) {
+			for (int i = 0; i < cnt; i++) {
+				received_bytes += snb_total_len(batch.pkts[i]);
+				rte_prefetch0(snb_head_data(batch.pkts[i]));
+			}
+		} else {
+			for (int i = 0; i < cnt; i++)
+				received_bytes += snb_total_len(batch.pkts[i]);
+		}
 
-	if (cnt == 0) {
-		ret.packets = 0;
-		ret.bits = 0;
-		return ret;
-	}
+		ret.packets += cnt;
+		ret.bits += (received_bytes + pkt_overhead * cnt) * 8;
 
-	/* NOTE: we cannot skip this step since it might be used by scheduler */
-	if (priv->prefetch) {
-		for (int i = 0; i < cnt; i++) {
-			received_bytes += snb_total_len(batch.pkts[i]);
-			rte_prefetch0(snb_head_data(batch.pkts[i]));
+		if (!(p->driver->flags & DRIVER_FLAG_SELF_INC_STATS)) {
+			p->queue_stats[PACKET_DIR_INC][qid].packets += cnt;
+			p->queue_stats[PACKET_DIR_INC][qid].bytes += 
+				received_bytes;
 		}
-	} else {
-		for (int i = 0; i < cnt; i++)
-			received_bytes += snb_total_len(batch.pkts[i]);
-	}
 
-	ret.packets = cnt;
-	ret.bits = (received_bytes + pkt_overhead * cnt) * 8;
+		run_next_module(m, &batch);
+	} while (cnt == pkt_burst && ret.packets < task_burst &&
+			!task_over_budget());
 
-	if (!(p->driver->flags & DRIVER_FLAG_SELF_INC_STATS)) {
-		p->queue_stats[PACKET_DIR_INC][qid].packets += cnt;
-		p->queue_stats[PACKET_DIR_INC][qid].bytes += received_bytes;
-	}
+	return ret;
+}
 
-	run_next_module(m, &batch);
+static struct task_result
+port_inc_run_task(struct module *m, void *arg)
+{
+	return do_run_task(m, arg, 0);
+}
 
-	return ret;
+static struct task_result
+port_inc_run_task_prefetch(struct module *m, void *arg)
+{
+	return do_run_task(m, arg, 1);
 }
 
 static const struct mclass port_inc = {
@@ -121,6 +150,9 @@ static const struct mclass port_inc = {
 	.deinit		= port_inc_deinit,
 	.get_desc	= port_inc_get_desc,
 	.run_task 	= port_inc_run_task,
+	.variants	= {
+		{"prefetch", 	.run_task = port_inc_run_task_prefetch},
+	},
 };
 
 ADD_MCLASS(port_inc)
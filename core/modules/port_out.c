@@ -1,9 +1,15 @@
 #include "../module.h"
 #include "../port.h"
+#include "../txstage.h"
 
 struct port_out_priv {
 	struct port *port;
 	pkt_io_func_t send_pkts;
+
+	/* requested offloads that the port cannot do by itself */
+	uint64_t sw_offloads;
+
+	struct tx_stage_conf stage;
 };
 
 static struct snobj *port_out_init(struct module *m, struct snobj *arg)
@@ -12,6 +18,7 @@ static struct snobj *port_out_init(struct module *m, struct snobj *arg)
 
 	const char *port_name;
 
+	struct snobj *err;
 	int ret;
 
 	if (!arg || !(port_name = snobj_eval_str(arg, "port")))
@@ -30,6 +37,18 @@ static struct snobj *port_out_init(struct module *m, struct snobj *arg)
 		return snobj_errno(-ret);
 
 	priv->send_pkts = priv->port->driver->send_pkts;
+	priv->sw_offloads = snb_tx_offload_sw_mask(
+			priv->port->tx_offload_capa);
+
+	priv->stage.port = priv->port;
+	priv->stage.qid = 0;
+	priv->stage.send_pkts = priv->send_pkts;
+
+	err = tx_stage_init(m, &priv->stage, arg);
+	if (err) {
+		release_queues(priv->port, m, PACKET_DIR_OUT, NULL, 0);
+		return err;
+	}
 
 	return NULL;
 }
@@ -61,6 +80,34 @@ static void port_out_process_batch(struct module *m,
 	uint64_t sent_bytes = 0;
 	int sent_pkts;
 
+	if (priv->sw_offloads) {
+		int cnt = 0;
+
+		/* drop packets whose offloads cannot be done */
+		for (int i = 0; i < batch->cnt; i++) {
+			struct snbuf *pkt = batch->pkts[i];
+
+			if (unlikely(pkt->mbuf.ol_flags & priv->sw_offloads) &&
+					snb_tx_offload_sw(pkt, 
+						p->tx_offload_capa) < 0) 
+			{
+				snb_free(pkt);
+				p->queue_stats[PACKET_DIR_OUT][qid].dropped++;
+				count_drops(m, DROP_INVALID, 1);
+				continue;
+			}
+
+			batch->pkts[cnt++] = pkt;
+		}
+
+		batch->cnt = cnt;
+	}
+
+	if (priv->stage.max_pkts) {
+		tx_stage_send(get_priv_worker(m), batch);
+		return;
+	}
+
 	sent_pkts = priv->send_pkts(p, qid, batch->pkts, batch->cnt);
 
 	if (!(p->driver->flags & DRIVER_FLAG_SELF_OUT_STATS)) {
@@ -74,8 +121,16 @@ static void port_out_process_batch(struct module *m,
 		p->queue_stats[dir][qid].bytes += sent_bytes;
 	}
 
-	if (sent_pkts < batch->cnt)
+	if (sent_pkts < batch->cnt) {
 		snb_free_bulk(batch->pkts + sent_pkts, batch->cnt - sent_pkts);
+		count_drops(m, DROP_TX_FULL, batch->cnt - sent_pkts);
+	}
+}
+
+static struct snobj *
+command_get_tx_stats(struct module *m, const char *cmd, struct snobj *arg)
+{
+	return tx_stage_get_stats(m);
 }
 
 static const struct mclass port_out = {
@@ -84,10 +139,15 @@ static const struct mclass port_out = {
 	.num_igates	= 1,
 	.num_ogates	= 0,
 	.priv_size	= sizeof(struct port_out_priv),
+	.priv_worker_size = sizeof(struct tx_stage),
 	.init		= port_out_init,
 	.deinit		= port_out_deinit,
+	.deinit_worker = tx_stage_deinit_worker,
 	.get_desc	= port_out_get_desc,
 	.process_batch	= port_out_process_batch,
+	.commands	= {
+		{"get_tx_stats",	command_get_tx_stats,	.mt_safe=1},
+	}
 };
 
 ADD_MCLASS(port_out)
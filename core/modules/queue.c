@@ -0,0 +1,212 @@
+#include <rte_malloc.h>
+
+#include "../module.h"
+#include "../kmod/llring.h"
+
+/* Hands packets over to another worker through a lock-free ring.
+ *
+ * Batches coming into the input gate are enqueued (by any number of
+ * workers, or by one with "single_producer"), and the task of the module
+ * dequeues them to the output gate, on the worker its traffic class is
+ * attached to. This way a pipeline can be split across cores, e.g.,
+ * PortInc -> Parse -> Queue on one worker and Queue -> DPI -> PortOut on
+ * another. The ring is an llring of snbuf pointers, with bulk operations
+ * and the producer/consumer indices in separate cache lines.
+ *
+ * Packets that do not fit in the ring are dropped and counted. */
+
+#define QUEUE_DEFAULT_SIZE	1024
+#define QUEUE_MAX_SIZE		(1 << 20)
+
+struct queue_priv {
+	struct llring *ring;
+	uint32_t size;		/* packets, the ring has one more slot */
+	int burst;
+};
+
+/* counted per worker, so that producers do not share a cache line */
+struct queue_worker {
+	uint64_t enqueued;
+	uint64_t dequeued;
+	uint64_t dropped;
+} __attribute__((aligned(64)));
+
+static void queue_process_batch(struct module *m, struct pkt_batch *batch)
+{
+	struct queue_priv *priv = get_priv(m);
+	struct queue_worker *w = get_priv_worker(m);
+	int cnt = batch->cnt;
+	int queued;
+
+	queued = llring_enqueue_burst(priv->ring, (void **)batch->pkts, cnt);
+	w->enqueued += queued;
+
+	if (unlikely(queued < cnt)) {
+		snb_free_bulk(batch->pkts + queued, cnt - queued);
+		w->dropped += cnt - queued;
+		count_drops(m, DROP_QUEUE_FULL, cnt - queued);
+	}
+}
+
+static struct task_result queue_run_task(struct module *m, void *arg)
+{
+	struct queue_priv *priv = get_priv(m);
+	struct queue_worker *w = get_priv_worker(m);
+
+	struct pkt_batch batch;
+	struct task_result ret = {.packets = 0, .bits = 0};
+
+	const uint32_t task_burst = get_task_burst();
+	const int pkt_burst = priv->burst;
+	const int pkt_overhead = 24;
+
+	int cnt;
+
+	do {
+		uint64_t total_bytes = 0;
+
+		cnt = llring_sc_dequeue_burst(priv->ring, (void **)batch.pkts,
+				pkt_burst);
+		if (cnt <= 0)
+			break;
+
+		batch.cnt = cnt;
+
+		for (int i = 0; i < cnt; i++)
+			total_bytes += snb_total_len(batch.pkts[i]);
+
+		ret.packets += cnt;
+		ret.bits += (total_bytes + pkt_overhead * cnt) * 8;
+		w->dequeued += cnt;
+
+		run_next_module(m, &batch);
+	} while (cnt == pkt_burst && ret.packets < task_burst &&
+			!task_over_budget());
+
+	return ret;
+}
+
+static struct snobj *queue_init(struct module *m, struct snobj *arg)
+{
+	struct queue_priv *priv = get_priv(m);
+	uint64_t size = QUEUE_DEFAULT_SIZE;
+	uint32_t slots;
+	task_id_t tid;
+	int sp = 0;
+
+	priv->burst = MAX_PKT_BURST;
+
+	if (arg && snobj_eval(arg, "size")) {
+		size = snobj_eval_uint(arg, "size");
+
+		if (size < 1 || size > QUEUE_MAX_SIZE)
+			return snobj_err(EINVAL, "'size' must be 1-%d",
+					QUEUE_MAX_SIZE);
+	}
+
+	if (arg && snobj_eval(arg, "burst")) {
+		int burst = snobj_eval_int(arg, "burst");
+
+		if (burst < 1 || burst > MAX_PKT_BURST)
+			return snobj_err(EINVAL, "'burst' must be between "
+					"1 and %d", MAX_PKT_BURST);
+
+		priv->burst = burst;
+	}
+
+	if (arg && snobj_eval_int(arg, "single_producer"))
+		sp = 1;
+
+	/* one slot of a llring is always left empty */
+	slots = rte_align32pow2(size + 1);
+	priv->size = slots - 1;
+
+	priv->ring = rte_zmalloc_socket("queue_ring",
+			llring_bytes_with_slots(slots), 64, m->socket);
+	if (!priv->ring)
+		return snobj_errno(ENOMEM);
+
+	if (llring_init(priv->ring, slots, sp, 1)) {
+		rte_free(priv->ring);
+		priv->ring = NULL;
+		return snobj_err(EINVAL, "llring_init() failed");
+	}
+
+	tid = register_task(m, NULL);
+	if (tid == INVALID_TASK_ID) {
+		rte_free(priv->ring);
+		priv->ring = NULL;
+		return snobj_err(ENOMEM, "Task creation failed");
+	}
+
+	return NULL;
+}
+
+static void queue_deinit(struct module *m)
+{
+	struct queue_priv *priv = get_priv(m);
+	struct snbuf *pkt;
+
+	if (!priv->ring)
+		return;
+
+	/* not from a worker, so not through the per-worker caches */
+	while (llring_sc_dequeue(priv->ring, (void **)&pkt) == 0)
+		snb_free(pkt);
+
+	rte_free(priv->ring);
+}
+
+static struct snobj *
+command_get_status(struct module *m, const char *cmd, struct snobj *arg)
+{
+	struct queue_priv *priv = get_priv(m);
+	struct snobj *r = snobj_map();
+	struct queue_worker *w;
+	uint64_t enqueued = 0;
+	uint64_t dequeued = 0;
+	uint64_t dropped = 0;
+	int wid;
+
+	for_each_priv_worker(m, wid, w) {
+		enqueued += w->enqueued;
+		dequeued += w->dequeued;
+		dropped += w->dropped;
+	}
+
+	snobj_map_set(r, "count", snobj_uint(llring_count(priv->ring)));
+	snobj_map_set(r, "size", snobj_uint(priv->size));
+	snobj_map_set(r, "enqueued", snobj_uint(enqueued));
+	snobj_map_set(r, "dequeued", snobj_uint(dequeued));
+	snobj_map_set(r, "dropped", snobj_uint(dropped));
+
+	return r;
+}
+
+static struct snobj *queue_get_desc(const struct module *m)
+{
+	const struct queue_priv *priv = get_priv_const(m);
+
+	return snobj_str_fmt("%u/%u", llring_count(priv->ring), priv->size);
+}
+
+static const struct mclass queue = {
+	.name 			= "Queue",
+	.help			=
+		"passes packets to another worker through a lock-free ring",
+	.def_module_name	= "queue",
+	.num_igates		= 1,
+	.num_ogates		= 1,
+	.priv_size		= sizeof(struct queue_priv),
+	.priv_worker_size	= sizeof(struct queue_worker),
+	.init 			= queue_init,
+	.deinit			= queue_deinit,
+	.process_batch 		= queue_process_batch,
+	.run_task		= queue_run_task,
+	.get_desc		= queue_get_desc,
+	.commands		= {
+		{"get_status",	command_get_status,	.mt_safe=1},
+	}
+};
+
+ADD_MCLASS(queue)
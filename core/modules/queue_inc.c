@@ -4,6 +4,7 @@
 struct queue_inc_priv {
 	struct port *port;
 	pkt_io_func_t recv_pkts;
+	int burst;
 	queue_t qid;
 	int prefetch;
 };
@@ -38,6 +39,17 @@ static struct snobj *queue_inc_init(struct module *m, struct snobj *arg)
 	if (snobj_eval_int(arg, "prefetch"))
 		priv->prefetch = 1;
 
+	priv->burst = MAX_PKT_BURST;
+	if (snobj_eval(arg, "burst")) {
+		int burst = snobj_eval_int(arg, "burst");
+
+		if (burst < 1 || burst > MAX_PKT_BURST)
+			return snobj_err(EINVAL, "'burst' must be between "
+					"1 and %d", MAX_PKT_BURST);
+
+		priv->burst = burst;
+	}
+
 	tid = register_task(m, (void *)(uint64_t)priv->qid);
 	if (tid == INVALID_TASK_ID)
 		return snobj_err(ENOMEM, "Task creation failed");
@@ -77,43 +89,48 @@ queue_inc_run_task(struct module *m, void *arg)
 	const queue_t qid = (queue_t)(uint64_t)arg;
 
 	struct pkt_batch batch;
-	struct task_result ret;
-
-	uint64_t received_bytes = 0;
+	struct task_result ret = {.packets = 0, .bits = 0};
 
-	const int pkt_burst = MAX_PKT_BURST;
+	const uint32_t task_burst = get_task_burst();
+	const int pkt_burst = priv->burst;
 	const int pkt_overhead = 24;
 	
 	int cnt;
 
-	cnt = batch.cnt = priv->recv_pkts(p, qid, batch.pkts, pkt_burst);
-
-	if (cnt == 0) {
-		ret.packets = 0;
-		ret.bits = 0;
-		return ret;
-	}
-
-	/* NOTE: we cannot skip this step since it might be used by scheduler */
-	if (priv->prefetch) {
-		for (int i = 0; i < cnt; i++) {
-			received_bytes += snb_total_len(batch.pkts[i]);
-			rte_prefetch0(snb_head_data(batch.pkts[i]));
+	/* task_burst may be larger than a batch, if autotuned.
+	 * Keep receiving as long as the queue gives full batches. */
+	do {
+		uint64_t received_bytes = 0;
+
+		cnt = batch.cnt = priv->recv_pkts(p, qid, batch.pkts, 
+				pkt_burst);
+		if (cnt == 0)
+			break;
+
+		/* NOTE: we cannot skip this step since it might be used by 
+		 * scheduler */
+		if (priv->prefetch) {
+			for (int i = 0; i < cnt; i++) {
+				received_bytes += snb_total_len(batch.pkts[i]);
+				rte_prefetch0(snb_head_data(batch.pkts[i]));
+			}
+		} else {
+			for (int i = 0; i < cnt; i++)
+				received_bytes += snb_total_len(batch.pkts[i]);
 		}
-	} else {
-		for (int i = 0; i < cnt; i++)
-			received_bytes += snb_total_len(batch.pkts[i]);
-	}
 
-	ret.packets = cnt;
-	ret.bits = (received_bytes + pkt_overhead * cnt) * 8;
+		ret.packets += cnt;
+		ret.bits += (received_bytes + pkt_overhead * cnt) * 8;
 
-	if (!(p->driver->flags & DRIVER_FLAG_SELF_INC_STATS)) {
-		p->queue_stats[PACKET_DIR_INC][qid].packets += cnt;
-		p->queue_stats[PACKET_DIR_INC][qid].bytes += received_bytes;
-	}
+		if (!(p->driver->flags & DRIVER_FLAG_SELF_INC_STATS)) {
+			p->queue_stats[PACKET_DIR_INC][qid].packets += cnt;
+			p->queue_stats[PACKET_DIR_INC][qid].bytes += 
+				received_bytes;
+		}
 
-	run_next_module(m, &batch);
+		run_next_module(m, &batch);
+	} while (cnt == pkt_burst && ret.packets < task_burst &&
+			!task_over_budget());
 
 	return ret;
 }
@@ -1,10 +1,13 @@
 #include "../module.h"
 #include "../port.h"
+#include "../txstage.h"
 
 struct queue_out_priv {
 	struct port *port;
 	pkt_io_func_t send_pkts;
 	queue_t qid;
+
+	struct tx_stage_conf stage;
 };
 
 static struct snobj *queue_out_init(struct module *m, struct snobj *arg)
@@ -15,6 +18,7 @@ static struct snobj *queue_out_init(struct module *m, struct snobj *arg)
 
 	const char *port_name;
 
+	struct snobj *err;
 	int ret;
 
 	if (!arg || snobj_type(arg) != TYPE_MAP)
@@ -39,6 +43,16 @@ static struct snobj *queue_out_init(struct module *m, struct snobj *arg)
 
 	priv->send_pkts = priv->port->driver->send_pkts;
 
+	priv->stage.port = priv->port;
+	priv->stage.qid = priv->qid;
+	priv->stage.send_pkts = priv->send_pkts;
+
+	err = tx_stage_init(m, &priv->stage, arg);
+	if (err) {
+		release_queues(priv->port, m, PACKET_DIR_OUT, &priv->qid, 1);
+		return err;
+	}
+
 	return NULL;
 }
 
@@ -68,6 +82,11 @@ static void queue_out_process_batch(struct module *m,
 	uint64_t sent_bytes = 0;
 	int sent_pkts;
 
+	if (priv->stage.max_pkts) {
+		tx_stage_send(get_priv_worker(m), batch);
+		return;
+	}
+
 	sent_pkts = priv->send_pkts(p, qid, batch->pkts, batch->cnt);
 
 	if (!(p->driver->flags & DRIVER_FLAG_SELF_OUT_STATS)) {
@@ -81,8 +100,16 @@ static void queue_out_process_batch(struct module *m,
 		p->queue_stats[dir][qid].bytes += sent_bytes;
 	}
 
-	if (sent_pkts < batch->cnt)
+	if (sent_pkts < batch->cnt) {
 		snb_free_bulk(batch->pkts + sent_pkts, batch->cnt - sent_pkts);
+		count_drops(m, DROP_TX_FULL, batch->cnt - sent_pkts);
+	}
+}
+
+static struct snobj *
+command_get_tx_stats(struct module *m, const char *cmd, struct snobj *arg)
+{
+	return tx_stage_get_stats(m);
 }
 
 static const struct mclass queue_out = {
@@ -91,10 +118,15 @@ static const struct mclass queue_out = {
 	.num_igates	= 1,
 	.num_ogates	= 0,
 	.priv_size	= sizeof(struct queue_out_priv),
+	.priv_worker_size = sizeof(struct tx_stage),
 	.init		= queue_out_init,
 	.deinit		= queue_out_deinit,
+	.deinit_worker = tx_stage_deinit_worker,
 	.get_desc	= queue_out_get_desc,
 	.process_batch	= queue_out_process_batch,
+	.commands	= {
+		{"get_tx_stats",	command_get_tx_stats,	.mt_safe=1},
+	}
 };
 
 ADD_MCLASS(queue_out)
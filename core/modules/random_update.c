@@ -3,16 +3,25 @@
 
 #define MAX_VARS		16
 
+/* Values for a whole batch are generated at once, RAND_VEC_VALS at a time
+ * with AVX2, and then written to the packets. In "sequential" mode, a
+ * field takes min, min + step, ... (wrapping around after max) over
+ * packets instead, for reproducible sweeps. */
+
 struct rupdate_priv {
 	int num_vars;
 	struct var {
 		uint32_t mask;
 		uint32_t min;
-		uint32_t range;		/* == max - min + 1 */
+		uint64_t range;		/* == max - min + 1 */
 		int16_t offset;
+
+		int sequential;
+		uint32_t step;		/* < range */
+		uint32_t cur;		/* the next value - min */
 	} vars[MAX_VARS];
 
-	uint64_t seed;
+	struct rand_vec rng;
 };
 
 static struct snobj *
@@ -37,6 +46,8 @@ command_add(struct module *m, const char *cmd, struct snobj *arg)
 		uint32_t mask;
 		uint32_t min;
 		uint32_t max;
+		uint64_t step = 1;
+		int sequential = 0;
 
 		if (var->type != TYPE_MAP)
 			return snobj_err(EINVAL, 
@@ -82,12 +93,28 @@ command_add(struct module *m, const char *cmd, struct snobj *arg)
 			return snobj_err(EINVAL, "'min' should not be " \
 					"greater than 'max'");
 
+		if (snobj_eval_exists(var, "mode")) {
+			const char *mode = snobj_eval_str(var, "mode");
+
+			if (mode && strcmp(mode, "sequential") == 0)
+				sequential = 1;
+			else if (!mode || strcmp(mode, "random") != 0)
+				return snobj_err(EINVAL, "'mode' must be "
+						"either 'random' or "
+						"'sequential'");
+		}
+
+		if (snobj_eval_exists(var, "step"))
+			step = snobj_eval_uint(var, "step");
+
 		priv->vars[curr + i].offset = offset;
 		priv->vars[curr + i].mask = mask;
 		priv->vars[curr + i].min = min;
 
-		/* avoid modulo 0 */
-		priv->vars[curr + i].range = (max - min + 1) ? : 0xffffffff;
+		priv->vars[curr + i].range = (uint64_t)max - min + 1;
+		priv->vars[curr + i].sequential = sequential;
+		priv->vars[curr + i].step = step % priv->vars[curr + i].range;
+		priv->vars[curr + i].cur = 0;
 	}
 
 	priv->num_vars = curr + arg->size;
@@ -109,7 +136,7 @@ static struct snobj *rupdate_init(struct module *m, struct snobj *arg)
 {
 	struct rupdate_priv *priv = get_priv(m);
 
-	priv->seed = 1;
+	rand_vec_init(&priv->rng, 1);
 
 	if (arg)
 		return command_add(m, NULL, arg);
@@ -121,33 +148,47 @@ static void rupdate_process_batch(struct module *m, struct pkt_batch *batch)
 {
 	struct rupdate_priv *priv = get_priv(m);
 
-	uint64_t seed = priv->seed;
 	int cnt = batch->cnt;
 
+	/* rand_vec_range() rounds up to RAND_VEC_VALS */
+	uint32_t vals[MAX_PKT_BURST + RAND_VEC_VALS];
+
 	for (int i = 0; i < priv->num_vars; i++) {
-		const struct var *var = &priv->vars[i];
+		struct var *var = &priv->vars[i];
 
 		uint32_t mask = var->mask;
-		uint32_t min = var->min;
-		uint32_t range = var->range;
 		int16_t offset = var->offset;
+
+		if (var->sequential) {
+			uint64_t cur = var->cur;
+
+			for (int j = 0; j < cnt; j++) {
+				vals[j] = var->min + cur;
+				cur += var->step;
+				if (cur >= var->range)
+					cur -= var->range;
+			}
+
+			var->cur = cur;
+		} else
+			rand_vec_range(&priv->rng, vals, cnt, var->min,
+					var->range);
 			
 		for (int j = 0; j < cnt; j++) {
 			struct snbuf *snb = batch->pkts[j];
 			char *head = snb_head_data(snb);
 
 			uint32_t * restrict p;
-			uint32_t rand_val;
+
+			/* may be a small snbuf */
+			if (unlikely(offset + 4 > snb_capacity(snb)))
+				continue;
 
 			p = (uint32_t *)(head + offset);
-			rand_val = min + rand_fast_range(&seed, range);
-			
-			*p = (*p & mask) | rte_cpu_to_be_32(rand_val);
+			*p = (*p & mask) | rte_cpu_to_be_32(vals[j]);
 		}
 	}
 
-	priv->seed = seed;
-
 	run_next_module(m, batch);
 }
 
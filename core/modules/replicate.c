@@ -0,0 +1,184 @@
+#include "../module.h"
+
+/* Sends every packet to each of a set of output gates (e.g., for port
+ * mirroring or multicast) without copying the payload.
+ *
+ * By default all the gates get the same snbufs, with the reference count
+ * bumped once per extra gate, so modules downstream must not modify the
+ * packets (see snb_ref()). With 'clone_headers', every gate but the first
+ * gets its own copy of that many bytes of headers, chained to an indirect
+ * mbuf for the rest of the packet (snb_clone_hdr()), so that the headers
+ * can be rewritten (or pushed or popped) per copy. The payload is still
+ * shared, and clones that cannot be allocated are not sent. */
+
+#define REPLICATE_MAX_GATES	16
+
+struct replicate_priv {
+	int num_gates;
+	gate_idx_t gates[REPLICATE_MAX_GATES];
+
+	uint16_t clone_headers;		/* 0 for sharing */
+};
+
+static void replicate_share(struct module *m, struct pkt_batch *batch)
+{
+	struct replicate_priv *priv = get_priv(m);
+	int n = priv->num_gates;
+
+	for (int i = 0; i < batch->cnt; i++)
+		snb_ref(batch->pkts[i], n - 1);
+
+	/* downstream modules may modify the batch itself */
+	for (int g = 0; g < n - 1; g++) {
+		struct pkt_batch copy;
+
+		batch_copy(&copy, batch);
+		run_choose_module(m, priv->gates[g], &copy);
+	}
+
+	run_choose_module(m, priv->gates[n - 1], batch);
+}
+
+static void replicate_clone(struct module *m, struct pkt_batch *batch)
+{
+	struct replicate_priv *priv = get_priv(m);
+	struct pkt_batch clones[REPLICATE_MAX_GATES - 1];
+	int n = priv->num_gates;
+
+	/* all before the originals go anywhere */
+	for (int g = 0; g < n - 1; g++) {
+		struct pkt_batch *c = &clones[g];
+
+		batch_clear(c);
+
+		for (int i = 0; i < batch->cnt; i++) {
+			struct snbuf *pkt;
+
+			pkt = snb_clone_hdr(batch->pkts[i],
+					priv->clone_headers);
+			if (likely(pkt))
+				batch_add(c, pkt);
+		}
+	}
+
+	run_choose_module(m, priv->gates[0], batch);
+
+	for (int g = 0; g < n - 1; g++)
+		if (clones[g].cnt)
+			run_choose_module(m, priv->gates[g + 1], &clones[g]);
+}
+
+static void replicate_process_batch(struct module *m, struct pkt_batch *batch)
+{
+	struct replicate_priv *priv = get_priv(m);
+
+	if (unlikely(priv->num_gates <= 1)) {
+		run_choose_module(m, priv->num_gates ? priv->gates[0] :
+				DROP_GATE, batch);
+		return;
+	}
+
+	if (priv->clone_headers)
+		replicate_clone(m, batch);
+	else
+		replicate_share(m, batch);
+}
+
+static struct snobj *
+command_set_gates(struct module *m, const char *cmd, struct snobj *arg)
+{
+	struct replicate_priv *priv = get_priv(m);
+	gate_idx_t gates[REPLICATE_MAX_GATES];
+	int n;
+
+	if (snobj_type(arg) == TYPE_INT) {
+		n = snobj_int_get(arg);
+
+		if (n < 0 || n > REPLICATE_MAX_GATES)
+			return snobj_err(EINVAL, "no more than %d gates",
+					REPLICATE_MAX_GATES);
+
+		for (int i = 0; i < n; i++)
+			gates[i] = i;
+
+	} else if (snobj_type(arg) == TYPE_LIST) {
+		n = arg->size;
+
+		if (n > REPLICATE_MAX_GATES)
+			return snobj_err(EINVAL, "no more than %d gates",
+					REPLICATE_MAX_GATES);
+
+		for (int i = 0; i < n; i++) {
+			struct snobj *elem = snobj_list_get(arg, i);
+
+			if (snobj_type(elem) != TYPE_INT)
+				return snobj_err(EINVAL,
+						"'gate' must be an integer");
+
+			gates[i] = snobj_int_get(elem);
+			if (!is_valid_gate(gates[i]))
+				return snobj_err(EINVAL, "invalid gate %d",
+						gates[i]);
+		}
+
+	} else
+		return snobj_err(EINVAL, "argument must specify a gate "
+				"or a list of gates");
+
+	memcpy(priv->gates, gates, n * sizeof(gate_idx_t));
+	priv->num_gates = n;
+
+	return NULL;
+}
+
+static struct snobj *replicate_init(struct module *m, struct snobj *arg)
+{
+	struct replicate_priv *priv = get_priv(m);
+	struct snobj *gates = arg;
+
+	if (snobj_type(arg) == TYPE_MAP) {
+		int clone_headers = snobj_eval_int(arg, "clone_headers");
+
+		if (clone_headers < 0 || clone_headers > SNBUF_DATA)
+			return snobj_err(EINVAL, "'clone_headers' must be "
+					"0-%d", SNBUF_DATA);
+
+		priv->clone_headers = clone_headers;
+		gates = snobj_eval(arg, "gates");
+	}
+
+	if (!gates)
+		return snobj_err(EINVAL, "'gates' must specify a gate "
+				"or a list of gates");
+
+	return command_set_gates(m, NULL, gates);
+}
+
+static struct snobj *replicate_get_desc(const struct module *m)
+{
+	const struct replicate_priv *priv = get_priv_const(m);
+
+	if (priv->clone_headers)
+		return snobj_str_fmt("%d gates, %hu-byte headers cloned",
+				priv->num_gates, priv->clone_headers);
+	else
+		return snobj_str_fmt("%d gates", priv->num_gates);
+}
+
+static const struct mclass replicate = {
+	.name 			= "Replicate",
+	.help			=
+		"sends packets to multiple gates without copying the payload",
+	.def_module_name	= "replicate",
+	.num_igates		= 1,
+	.num_ogates		= MAX_GATES,
+	.priv_size		= sizeof(struct replicate_priv),
+	.init 			= replicate_init,
+	.process_batch 		= replicate_process_batch,
+	.get_desc		= replicate_get_desc,
+	.commands		= {
+		{"set_gates",	command_set_gates},
+	}
+};
+
+ADD_MCLASS(replicate)
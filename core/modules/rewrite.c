@@ -3,6 +3,29 @@
 #define SLOTS			(MAX_PKT_BURST * 2 - 1)
 #define MAX_TEMPLATE_SIZE	1536
 
+/* Incremental mode: templates usually differ only in a few header fields.
+ * The byte ranges where any two templates differ (the "diff" ranges) are
+ * precomputed, and a packet that already holds one of the templates of
+ * this module gets only those ranges rewritten, instead of the whole
+ * template.
+ *
+ * Whether a packet holds a template is tracked with a tag at the start of
+ * its headroom, written on every full copy, and SNB_REWRITE_TAGGED in
+ * ol_flags. The flag is reset whenever the buffer is allocated or received,
+ * so only packets that come back to this module without being freed
+ * (e.g., sent in a loop) are patched; fresh buffers always get a full copy.
+ * In particular, this mode does not help the usual generator pipeline
+ * (Source -> Rewrite -> port), where every packet is a freshly allocated
+ * buffer: it costs a tag write per packet there and saves nothing.
+ * The tag cannot tell if another module modified the template bytes in
+ * the meantime, so modules in such a loop must leave them alone. */
+#define MAX_DIFFS		8
+
+struct rewrite_tag {
+	uint64_t cookie;	/* of the module and the template set */
+	uint16_t data_off;
+};
+
 struct rewrite_priv {
 	/* For fair round robin we remember the next index for later.
 	 * [0, num_templates - 1] */
@@ -11,6 +34,15 @@ struct rewrite_priv {
 	int num_templates;
 	uint16_t template_size[SLOTS];
 	unsigned char templates[SLOTS][MAX_TEMPLATE_SIZE] __ymm_aligned;
+
+	int incremental;
+	uint32_t generation;	/* bumped whenever templates change */
+	uint64_t cookie;
+	int num_diffs;		/* -1 if too scattered for incremental */
+	struct {
+		uint16_t start;
+		uint16_t end;
+	} diffs[MAX_DIFFS];
 };
 
 static struct snobj *
@@ -18,12 +50,37 @@ command_add(struct module *m, const char *cmd, struct snobj *arg);
 
 static struct snobj *rewrite_init(struct module *m, struct snobj *arg)
 {
+	struct rewrite_priv *priv = get_priv(m);
+
+	if (snobj_type(arg) == TYPE_MAP) {
+		priv->incremental = snobj_eval_int(arg, "incremental");
+		arg = snobj_eval(arg, "templates");
+	}
+
 	if (arg)
 		return command_add(m, NULL, arg);
 	
 	return NULL;
 }
 
+static inline struct rewrite_tag *rewrite_get_tag(struct snbuf *snb)
+{
+	return (struct rewrite_tag *)snb->_headroom;
+}
+
+/* the template bytes that are not the same in all templates */
+static inline void rewrite_patch(const struct rewrite_priv *priv, char *ptr,
+		const unsigned char *template, uint16_t size)
+{
+	for (int i = 0; i < priv->num_diffs; i++) {
+		uint16_t start = priv->diffs[i].start;
+		uint16_t end = RTE_MIN(priv->diffs[i].end, size);
+
+		if (start < end)
+			rte_memcpy(ptr + start, template + start, end - start);
+	}
+}
+
 static void rewrite_process_batch(struct module *m, struct pkt_batch *batch)
 {
 	struct rewrite_priv *priv = get_priv(m);
@@ -31,14 +88,50 @@ static void rewrite_process_batch(struct module *m, struct pkt_batch *batch)
 	if (priv->num_templates) {
 		int start = priv->next_turn;
 		const int cnt = batch->cnt;
+		const int incremental = priv->incremental &&
+			priv->num_diffs >= 0;
+		const uint64_t cookie = priv->cookie;
 
 		for (int i = 0; i < cnt; i++) {
 			struct snbuf *snb = batch->pkts[i];
-			char *ptr = snb_head_data(snb);
 			uint16_t size = priv->template_size[start + i];
+			struct rewrite_tag *tag;
+			char *ptr;
 
+			/* a small snbuf cannot hold the template */
+			if (unlikely(size > snb_capacity(snb))) {
+				struct snbuf *full = __snb_alloc();
+
+				if (!full)
+					continue;
+
+				snb_free(snb);
+				batch->pkts[i] = snb = full;
+			}
+
+			ptr = snb_head_data(snb);
 			snb->mbuf.pkt_len = snb->mbuf.data_len = size;
-			rte_memcpy(ptr, priv->templates[start + i], size);
+
+			if (!incremental) {
+				rte_memcpy(ptr, priv->templates[start + i], 
+						size);
+				continue;
+			}
+
+			tag = rewrite_get_tag(snb);
+
+			if ((snb->mbuf.ol_flags & SNB_REWRITE_TAGGED) &&
+					tag->cookie == cookie &&
+					tag->data_off == snb->mbuf.data_off) {
+				rewrite_patch(priv, ptr,
+						priv->templates[start + i], size);
+			} else {
+				rte_memcpy(ptr, priv->templates[start + i],
+						size);
+				tag->cookie = cookie;
+				tag->data_off = snb->mbuf.data_off;
+				snb->mbuf.ol_flags |= SNB_REWRITE_TAGGED;
+			}
 		}
 
 		priv->next_turn = (start + cnt) % priv->num_templates;
@@ -47,6 +140,67 @@ static void rewrite_process_batch(struct module *m, struct pkt_batch *batch)
 	run_next_module(m, batch);
 }
 
+/* Finds the byte ranges where templates differ from each other, merging
+ * ranges with small gaps, since a short copy costs about the same as a
+ * longer one. */
+static void rewrite_update_diffs(struct rewrite_priv *priv)
+{
+	const int max_gap = 16;
+	int max_size = 0;
+	int n = 0;
+	int start = -1;
+	int last = -1;
+
+	priv->generation++;
+	priv->cookie = ((uint64_t)priv->generation << 48) ^ (uintptr_t)priv;
+
+	for (int i = 0; i < priv->num_templates; i++)
+		max_size = RTE_MAX(max_size, priv->template_size[i]);
+
+	for (int pos = 0; pos < max_size; pos++) {
+		int differs = 0;
+
+		/* beyond the end of a template is a difference too, so
+		 * that a longer template can be patched over a shorter one */
+		for (int i = 0; i < priv->num_templates && !differs; i++)
+			differs = pos >= priv->template_size[i] ||
+				priv->templates[i][pos] !=
+				priv->templates[0][pos];
+
+		if (!differs)
+			continue;
+
+		if (start >= 0 && pos - last <= max_gap) {
+			last = pos;
+			continue;
+		}
+
+		if (start >= 0) {
+			if (n == MAX_DIFFS) {
+				priv->num_diffs = -1;
+				return;
+			}
+			priv->diffs[n].start = start;
+			priv->diffs[n].end = last + 1;
+			n++;
+		}
+
+		start = last = pos;
+	}
+
+	if (start >= 0) {
+		if (n == MAX_DIFFS) {
+			priv->num_diffs = -1;
+			return;
+		}
+		priv->diffs[n].start = start;
+		priv->diffs[n].end = last + 1;
+		n++;
+	}
+
+	priv->num_diffs = n;
+}
+
 static struct snobj *
 command_add(struct module *m, const char *cmd, struct snobj *arg)
 {
@@ -87,6 +241,8 @@ command_add(struct module *m, const char *cmd, struct snobj *arg)
 		priv->template_size[i] = priv->template_size[j];
 	}
 
+	rewrite_update_diffs(priv);
+
 	return NULL;
 }
 
@@ -97,6 +253,8 @@ command_clear(struct module *m, const char *cmd, struct snobj *arg)
 
 	priv->next_turn = 0;
 	priv->num_templates = 0;
+	priv->generation++;
+	priv->cookie = ((uint64_t)priv->generation << 48) ^ (uintptr_t)priv;
 
 	return NULL;
 }
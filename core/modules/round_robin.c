@@ -7,20 +7,18 @@ struct roundrobin_priv {
 	gate_idx_t gates[MAX_RR_GATES];
 	int ngates;
 	int current_gate;
-	int per_packet;
 };
 
 static struct snobj *
 command_set_mode(struct module *m, const char *cmd, struct snobj *arg)
 {
-	struct roundrobin_priv *priv = get_priv(m);
-
 	const char *mode = snobj_str_get(arg);
 	
+	/* the default process_batch is per batch */
 	if (mode && strcmp(mode, "packet") == 0)
-		priv->per_packet = 1;
+		select_variant(m, "packet");
 	else if (mode && strcmp(mode, "batch") == 0)
-		priv->per_packet = 0;
+		select_variant(m, NULL);
 	else
 		return snobj_err(EINVAL, 
 				"argument must be either 'packet' or 'batch'");
@@ -84,22 +82,26 @@ static struct snobj *roundrobin_init(struct module *m, struct snobj *arg)
 
 static void
 roundrobin_process_batch(struct module *m, struct pkt_batch *batch)
+{
+	struct roundrobin_priv* priv = get_priv(m);
+
+	gate_idx_t gate = priv->gates[priv->current_gate];
+	priv->current_gate = (priv->current_gate + 1) % priv->ngates;
+	run_choose_module(m, gate, batch);
+}
+
+static void
+roundrobin_process_batch_packet(struct module *m, struct pkt_batch *batch)
 {
 	struct roundrobin_priv* priv = get_priv(m);
 	gate_idx_t ogates[MAX_PKT_BURST];
 
-	if (priv->per_packet) {
-		for (int i = 0; i < batch->cnt; i++) {
-			ogates[i] = priv->gates[priv->current_gate];
-			priv->current_gate = (priv->current_gate + 1) % 
-						priv->ngates;
-		}
-		run_split(m, ogates, batch);
-	} else {
-		gate_idx_t gate = priv->gates[priv->current_gate];
-		priv->current_gate = (priv->current_gate + 1) % priv->ngates;
-		run_choose_module(m, gate, batch);
+	for (int i = 0; i < batch->cnt; i++) {
+		ogates[i] = priv->gates[priv->current_gate];
+		priv->current_gate = (priv->current_gate + 1) % 
+					priv->ngates;
 	}
+	run_split(m, ogates, batch);
 }
 
 static const struct mclass roundrobin = {
@@ -110,6 +112,9 @@ static const struct mclass roundrobin = {
 	.priv_size	= sizeof(struct roundrobin_priv),
 	.init 		= roundrobin_init,
 	.process_batch 	= roundrobin_process_batch,
+	.variants	= {
+		{"packet", 	roundrobin_process_batch_packet},
+	},
 	.commands	 = {
 		{"set_mode",	command_set_mode},
 		{"set_gates",	command_set_gates},
@@ -0,0 +1,198 @@
+#include <string.h>
+
+#include "../module.h"
+#include "../utils/random.h"
+
+/* Forwards every packet to ogate 0, and a copy of one out of every 'rate'
+ * packets to ogate 1 (e.g., to a capture port or a slow-path analyzer).
+ *
+ * In the default "deterministic" mode, every rate-th packet (counted per
+ * worker) is sampled. In "random" mode, each packet is sampled with a
+ * probability of 1/rate, with the random values for a whole batch
+ * generated at once (rand_vec_range()). With 'snaplen', the copies are
+ * truncated to that many bytes, which also keeps them in a single snbuf.
+ *
+ * The copies are allocated only for the sampled packets, so batches
+ * without any sample cost little more than a countdown or a vector RNG
+ * step. Copies that cannot be allocated are not sent. */
+
+#define SAMPLE_GATE_ALL		0
+#define SAMPLE_GATE_COPY	1
+
+struct sample_priv {
+	uint32_t rate;
+	uint16_t snaplen;	/* 0 for whole packets */
+	int random;
+};
+
+struct sample_worker {
+	struct rand_vec rng;
+	uint32_t countdown;	/* packets until the next sample */
+} __attribute__((aligned(64)));
+
+static struct snbuf *sample_copy(const struct sample_priv *priv,
+		struct snbuf *pkt)
+{
+	struct snbuf *copy;
+	const void *src;
+	uint32_t len;
+	char *dst;
+
+	len = snb_total_len(pkt);
+	if (priv->snaplen && len > priv->snaplen)
+		len = priv->snaplen;
+
+	/* e.g., jumbo frames, copied segment by segment */
+	if (unlikely(len > SNBUF_DATA))
+		return snb_copy(pkt);
+
+	copy = __snb_alloc_pool(ctx.pframe_pools[snb_class_fit(len)]);
+	if (!copy)
+		return NULL;
+
+	dst = snb_append(copy, len);
+
+	/* chained packets are gathered directly into the copy */
+	src = snb_read(pkt, 0, len, dst);
+	if (src != dst)
+		rte_memcpy(dst, src, len);
+
+	return copy;
+}
+
+static void sample_process_batch(struct module *m, struct pkt_batch *batch)
+{
+	struct sample_priv *priv = get_priv(m);
+	struct sample_worker *w = get_priv_worker(m);
+	struct pkt_batch copies;
+	int cnt = batch->cnt;
+
+	batch_clear(&copies);
+
+	if (priv->random) {
+		/* rand_vec_range() rounds up to RAND_VEC_VALS */
+		uint32_t vals[MAX_PKT_BURST + RAND_VEC_VALS];
+
+		rand_vec_range(&w->rng, vals, cnt, 0, priv->rate);
+
+		for (int i = 0; i < cnt; i++) {
+			struct snbuf *copy;
+
+			if (likely(vals[i] != 0))
+				continue;
+
+			copy = sample_copy(priv, batch->pkts[i]);
+			if (likely(copy))
+				batch_add(&copies, copy);
+		}
+	} else {
+		uint32_t countdown = w->countdown;
+		int last = 0;
+
+		/* skip the whole batch at once, if possible */
+		if (likely(countdown > (uint32_t)cnt)) {
+			w->countdown = countdown - cnt;
+			run_choose_module(m, SAMPLE_GATE_ALL, batch);
+			return;
+		}
+
+		for (int i = countdown - 1; i < cnt; i += priv->rate) {
+			struct snbuf *copy;
+
+			copy = sample_copy(priv, batch->pkts[i]);
+			if (likely(copy))
+				batch_add(&copies, copy);
+
+			last = i;
+		}
+
+		w->countdown = priv->rate - (cnt - 1 - last);
+	}
+
+	/* the copies are made before the originals go anywhere */
+	run_choose_module(m, SAMPLE_GATE_ALL, batch);
+
+	if (copies.cnt)
+		run_choose_module(m, SAMPLE_GATE_COPY, &copies);
+}
+
+static struct snobj *sample_init(struct module *m, struct snobj *arg)
+{
+	struct sample_priv *priv = get_priv(m);
+	struct sample_worker *w;
+	const char *mode = "deterministic";
+	uint64_t seed = 1;
+	int64_t rate;
+	int wid;
+
+	if (!arg || snobj_type(arg) != TYPE_MAP)
+		return snobj_err(EINVAL, "argument must be a map");
+
+	rate = snobj_eval_int(arg, "rate");
+	if (rate < 1 || rate > UINT32_MAX)
+		return snobj_err(EINVAL, "'rate' must be 1-%u", UINT32_MAX);
+
+	priv->rate = rate;
+
+	if (snobj_eval_exists(arg, "mode"))
+		mode = snobj_eval_str(arg, "mode");
+
+	if (mode && strcmp(mode, "deterministic") == 0)
+		priv->random = 0;
+	else if (mode && strcmp(mode, "random") == 0)
+		priv->random = 1;
+	else
+		return snobj_err(EINVAL, "'mode' must be 'deterministic' "
+				"or 'random'");
+
+	if (snobj_eval_exists(arg, "snaplen")) {
+		int snaplen = snobj_eval_int(arg, "snaplen");
+
+		if (snaplen < 0 || snaplen > SNBUF_DATA)
+			return snobj_err(EINVAL, "'snaplen' must be 0-%d",
+					SNBUF_DATA);
+
+		priv->snaplen = snaplen;
+	}
+
+	if (snobj_eval_exists(arg, "seed"))
+		seed = snobj_eval_uint(arg, "seed");
+
+	/* independent sequences on each worker */
+	for_each_priv_worker(m, wid, w) {
+		rand_vec_init(&w->rng, seed + wid);
+		w->countdown = priv->rate;
+	}
+
+	return NULL;
+}
+
+static struct snobj *sample_get_desc(const struct module *m)
+{
+	const struct sample_priv *priv = get_priv_const(m);
+
+	if (priv->snaplen)
+		return snobj_str_fmt("%s 1/%u, %hu bytes",
+				priv->random ? "random" : "every",
+				priv->rate, priv->snaplen);
+	else
+		return snobj_str_fmt("%s 1/%u",
+				priv->random ? "random" : "every",
+				priv->rate);
+}
+
+static const struct mclass sample = {
+	.name 			= "Sample",
+	.help			=
+		"forwards all packets and copies 1 out of N to ogate 1",
+	.def_module_name	= "sample",
+	.num_igates		= 1,
+	.num_ogates		= 2,
+	.priv_size		= sizeof(struct sample_priv),
+	.priv_worker_size	= sizeof(struct sample_worker),
+	.init 			= sample_init,
+	.process_batch 		= sample_process_batch,
+	.get_desc		= sample_get_desc,
+};
+
+ADD_MCLASS(sample)
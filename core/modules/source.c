@@ -2,11 +2,15 @@
 
 struct source_priv {
 	int pkt_size;
+	int burst;
 };
 
 static struct snobj *
 command_set_pkt_size(struct module *m, const char *cmd, struct snobj *arg);
 
+static struct snobj *
+command_set_burst(struct module *m, const char *cmd, struct snobj *arg);
+
 static struct snobj *source_init(struct module *m, struct snobj *arg)
 {
 	struct source_priv *priv = get_priv(m);
@@ -16,6 +20,16 @@ static struct snobj *source_init(struct module *m, struct snobj *arg)
 	if (tid == INVALID_TASK_ID)
 		return snobj_err(ENOMEM, "Task creation failed");
 
+	priv->burst = MAX_PKT_BURST;
+
+	if (arg && snobj_eval(arg, "burst")) {
+		struct snobj *err;
+
+		err = command_set_burst(m, NULL, snobj_eval(arg, "burst"));
+		if (err)
+			return err;
+	}
+
 	if (!arg || (arg = snobj_eval(arg, "pkt_size"))) {
 		priv->pkt_size = 60;	/* default: min-sized Ethernet frames */
 		return NULL;
@@ -42,6 +56,26 @@ command_set_pkt_size(struct module *m, const char *cmd, struct snobj *arg)
 	return NULL;
 }
 
+static struct snobj *
+command_set_burst(struct module *m, const char *cmd, struct snobj *arg)
+{
+	struct source_priv *priv = get_priv(m);
+	uint64_t val;
+	
+	if (snobj_type(arg) != TYPE_INT)
+		return snobj_err(EINVAL, "argument must be an integer");
+
+	val = snobj_uint_get(arg);
+
+	if (val == 0 || val > MAX_PKT_BURST)
+		return snobj_err(EINVAL, "burst size must be [1,%d]",
+				MAX_PKT_BURST);
+
+	priv->burst = val;
+
+	return NULL;
+}
+
 static struct task_result
 source_run_task(struct module *m, void *arg)
 {
@@ -52,10 +86,12 @@ source_run_task(struct module *m, void *arg)
 
 	const int pkt_overhead = 24;
 
-	uint64_t total_bytes = priv->pkt_size * MAX_PKT_BURST;
+	const int burst = priv->burst;
+	const int pkt_size = priv->pkt_size;
+
+	uint64_t total_bytes = pkt_size * burst;
 
-	const int cnt = snb_alloc_bulk(batch.pkts, MAX_PKT_BURST, 
-			priv->pkt_size);
+	const int cnt = snb_alloc_bulk(batch.pkts, burst, pkt_size);
 
 	if (cnt > 0) {
 		batch.cnt = cnt;
@@ -81,6 +117,7 @@ static const struct mclass source = {
 	.run_task 	= source_run_task,
 	.commands	= {
 		{"set_pkt_size", command_set_pkt_size, .mt_safe=1},
+		{"set_burst", command_set_burst, .mt_safe=1},
 	}
 };
 
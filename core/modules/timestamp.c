@@ -1,26 +1,99 @@
 #include <rte_tcp.h>
 
 #include "../module.h"
-#include "../utils/histogram.h"
+#include "../parse.h"
+#include "../time.h"
+
+/* Marks packets with the current TSC, for the Measure module to compute
+ * latencies in cycles. Conversion to time is left to Measure, when stats
+ * are read.
+ *
+ * If 'metadata' is set, the timestamp is carried in the packet metadata
+ * (only within this BESS instance). Otherwise it is written into the
+ * payload at 'offset' (by default, right after the Ethernet/IPv4/TCP
+ * headers) as a flag byte and the 64-bit TSC, so that packets can go
+ * through external devices and come back. With the default offset, the
+ * actual end of the TCP header is used if a Parse module upstream has 
+ * found it (e.g., with VLAN tags or IPv4 options). */
+
+#define TIMESTAMP_DEFAULT_OFFSET	(sizeof(struct ether_hdr) + \
+					 sizeof(struct ipv4_hdr) + \
+					 sizeof(struct tcp_hdr))
+
+struct timestamp_priv {
+	int attr_id;		/* -1 if in payload */
+	int offset;		/* in payload */
+	int parse_attr_id;	/* -1 unless the default offset is used */
+};
+
+static struct snobj *timestamp_init(struct module *m, struct snobj *arg)
+{
+	struct timestamp_priv *priv = get_priv(m);
+
+	priv->attr_id = -1;
+	priv->offset = TIMESTAMP_DEFAULT_OFFSET;
+
+	if (arg && snobj_eval_int(arg, "metadata")) {
+		priv->attr_id = add_metadata_attr(m, "timestamp", 
+				sizeof(uint64_t), MT_WRITE);
+		if (priv->attr_id < 0)
+			return snobj_errno(-priv->attr_id);
+	}
+
+	priv->parse_attr_id = -1;
+
+	if (arg && snobj_eval_exists(arg, "offset")) {
+		priv->offset = snobj_eval_int(arg, "offset");
+		if (priv->offset < 0 || priv->offset + 1 + sizeof(uint64_t) >
+				SNBUF_DATA)
+			return snobj_err(EINVAL, "invalid 'offset'");
+	} else if (priv->attr_id < 0) {
+		priv->parse_attr_id = add_parse_attr(m, MT_READ);
+		if (priv->parse_attr_id < 0)
+			return snobj_errno(-priv->parse_attr_id);
+	}
+
+	return NULL;
+}
 
 static inline void
-timestamp_packet(struct snbuf* pkt, uint64_t time)
+timestamp_packet(struct snbuf* pkt, int offset, uint64_t time)
 {
-	uint8_t *avail = (uint8_t*)((uint8_t*)snb_head_data(pkt) +
-			sizeof(struct ether_hdr) + sizeof(struct ipv4_hdr)) +
-		sizeof(struct tcp_hdr);
+	uint8_t *avail = (uint8_t *)snb_head_data(pkt) + offset;
+
+	if (unlikely(offset + 1 + sizeof(uint64_t) > snb_head_len(pkt)))
+		return;
+
 	*avail = 1;
-	uint64_t *ts = (uint64_t*)(avail + 1);
-	*ts = time;
+	*(uint64_t *)(avail + 1) = time;
 }
 
 static void
 timestamp_process_batch(struct module *m, struct pkt_batch *batch)
 {
-	uint64_t time = get_time();
+	struct timestamp_priv *priv = get_priv(m);
+	uint64_t time = rdtsc();
+
+	if (priv->attr_id >= 0) {
+		if (is_valid_attr_offset(get_attr_offset(m, priv->attr_id)))
+			for (int i = 0; i < batch->cnt; i++)
+				*get_attr_ptr(m, priv->attr_id, batch->pkts[i], 
+						uint64_t) = time;
+	} else if (priv->parse_attr_id >= 0 && 
+			parse_available(m, priv->parse_attr_id)) {
+		for (int i = 0; i < batch->cnt; i++) {
+			struct snbuf *pkt = batch->pkts[i];
+			struct pkt_parse *p = get_parse(m, priv->parse_attr_id,
+					pkt);
 
-	for (int i = 0; i < batch->cnt; i++)
-		timestamp_packet(batch->pkts[i], time);
+			timestamp_packet(pkt, parse_l4_payload(p, 
+					sizeof(struct tcp_hdr), priv->offset), 
+					time);
+		}
+	} else {
+		for (int i = 0; i < batch->cnt; i++)
+			timestamp_packet(batch->pkts[i], priv->offset, time);
+	}
 
 	run_next_module(m, batch);
 }
@@ -31,6 +104,8 @@ static const struct mclass timestamp = {
 		"marks current time to packets (paired with Measure module)",
 	.num_igates 	= 1,
 	.num_ogates	= 1,
+	.priv_size	= sizeof(struct timestamp_priv),
+	.init		= timestamp_init,
 	.process_batch 	= timestamp_process_batch,
 };
 
@@ -0,0 +1,213 @@
+#include <string.h>
+
+#include "../module.h"
+#include "../parse.h"
+
+/* Removes the outer Ethernet/IPv4/UDP and VXLAN or GENEVE headers (see
+ * TunnelEncap) by moving the head of the packet. The inner frame is not
+ * copied.
+ *
+ * Packets of the tunnel (by UDP destination port) are decapsulated to
+ * ogate 0, and the VNI is written to a 32-bit metadata attribute if
+ * 'vni_attr' is given. Anything else goes to ogate 1 as is. The outer
+ * checksums are not verified. */
+
+#define VXLAN_PORT		4789
+#define GENEVE_PORT		6081
+
+#define VXLAN_HDR_LEN		8
+#define VXLAN_FLAG_VNI		0x08
+
+#define GENEVE_HDR_LEN		8	/* without options */
+#define GENEVE_PROTO_ETHER	0x6558	/* Transparent Ethernet Bridging */
+
+#define TUN_GATE_DECAP		0
+#define TUN_GATE_OTHER		1
+
+enum tun_type {
+	TUN_VXLAN,
+	TUN_GENEVE,
+};
+
+struct tunnel_decap_priv {
+	enum tun_type type;
+	uint16_t dst_port;	/* network order */
+
+	int vni_attr;		/* -1 if the VNI is not written */
+	int parse_attr;		/* cached offsets are updated, if any */
+};
+
+/* Returns the length of the outer headers (and sets *vni), or 0 if the
+ * packet does not belong to the tunnel */
+static inline int tun_outer_len(const struct tunnel_decap_priv *priv,
+		const char *head, int len, uint32_t *vni)
+{
+	const struct ether_hdr *eth = (const struct ether_hdr *)head;
+	const struct ipv4_hdr *ip;
+	const struct udp_hdr *udp;
+	const uint8_t *tun;
+	int ihl;
+	int tun_len;
+
+	if (unlikely(len < (int)(sizeof(struct ether_hdr) +
+				sizeof(struct ipv4_hdr) +
+				sizeof(struct udp_hdr) + VXLAN_HDR_LEN)))
+		return 0;
+
+	if (eth->ether_type != rte_cpu_to_be_16(ETHER_TYPE_IPv4))
+		return 0;
+
+	ip = (const struct ipv4_hdr *)(head + sizeof(struct ether_hdr));
+	ihl = (ip->version_ihl & 0x0f) << 2;
+
+	/* fragments are not reassembled */
+	if (ip->next_proto_id != IPPROTO_UDP || ihl < 20 ||
+			(ip->fragment_offset & rte_cpu_to_be_16(0x3fff)))
+		return 0;
+
+	udp = (const struct udp_hdr *)((const char *)ip + ihl);
+	tun = (const uint8_t *)(udp + 1);
+
+	if ((const char *)tun + VXLAN_HDR_LEN > head + len ||
+			udp->dst_port != priv->dst_port)
+		return 0;
+
+	if (priv->type == TUN_VXLAN) {
+		if (!(tun[0] & VXLAN_FLAG_VNI))
+			return 0;
+
+		tun_len = VXLAN_HDR_LEN;
+	} else {
+		/* version 0, with Ethernet payload */
+		if ((tun[0] >> 6) != 0 || tun[2] != (GENEVE_PROTO_ETHER >> 8) ||
+				tun[3] != (GENEVE_PROTO_ETHER & 0xff))
+			return 0;
+
+		/* options are skipped */
+		tun_len = GENEVE_HDR_LEN + ((tun[0] & 0x3f) << 2);
+	}
+
+	*vni = (tun[4] << 16) | (tun[5] << 8) | tun[6];
+
+	tun_len += (const char *)tun - head;
+	if (tun_len + (int)sizeof(struct ether_hdr) > len)
+		return 0;
+
+	return tun_len;
+}
+
+static void tunnel_decap_process_batch(struct module *m,
+		struct pkt_batch *batch)
+{
+	struct tunnel_decap_priv *priv = get_priv(m);
+	gate_idx_t ogates[MAX_PKT_BURST];
+	mt_offset_t vni_offset = MT_OFFSET_INVALID;
+	int cnt = batch->cnt;
+	int decapped = 0;
+	int parsed;
+
+	if (priv->vni_attr >= 0)
+		vni_offset = get_attr_offset(m, priv->vni_attr);
+
+	parsed = parse_available(m, priv->parse_attr);
+
+	for (int i = 0; i < cnt; i++) {
+		struct snbuf *pkt = batch->pkts[i];
+		uint32_t vni;
+		int len;
+
+		len = tun_outer_len(priv, snb_head_data(pkt),
+				snb_head_len(pkt), &vni);
+		if (!len) {
+			ogates[i] = TUN_GATE_OTHER;
+			continue;
+		}
+
+		snb_adj(pkt, len);
+		ogates[i] = TUN_GATE_DECAP;
+		decapped++;
+
+		if (is_valid_attr_offset(vni_offset))
+			*(uint32_t *)(pkt->_metadata_buf + vni_offset) = vni;
+
+		/* the cached offsets were those of the outer headers */
+		if (parsed)
+			parse_packet(pkt, get_parse(m, priv->parse_attr, pkt));
+	}
+
+	if (likely(decapped == cnt))
+		run_choose_module(m, TUN_GATE_DECAP, batch);
+	else
+		run_split(m, ogates, batch);
+}
+
+static struct snobj *tunnel_decap_init(struct module *m, struct snobj *arg)
+{
+	struct tunnel_decap_priv *priv = get_priv(m);
+	const char *type = "vxlan";
+	int dst_port;
+
+	priv->vni_attr = -1;
+
+	if (arg && snobj_type(arg) != TYPE_MAP && snobj_type(arg) != TYPE_NIL)
+		return snobj_err(EINVAL, "argument must be a map");
+
+	if (snobj_eval_exists(arg, "type"))
+		type = snobj_eval_str(arg, "type");
+
+	if (type && strcmp(type, "vxlan") == 0)
+		priv->type = TUN_VXLAN;
+	else if (type && strcmp(type, "geneve") == 0)
+		priv->type = TUN_GENEVE;
+	else
+		return snobj_err(EINVAL, "'type' must be 'vxlan' or 'geneve'");
+
+	dst_port = (priv->type == TUN_VXLAN) ? VXLAN_PORT : GENEVE_PORT;
+	if (snobj_eval_exists(arg, "dst_port"))
+		dst_port = snobj_eval_int(arg, "dst_port");
+	if (dst_port <= 0 || dst_port > 65535)
+		return snobj_err(EINVAL, "'dst_port' must be 1-65535");
+
+	priv->dst_port = rte_cpu_to_be_16(dst_port);
+
+	if (snobj_eval_exists(arg, "vni_attr")) {
+		const char *name = snobj_eval_str(arg, "vni_attr");
+
+		if (!name)
+			return snobj_err(EINVAL, "'vni_attr' must be a string");
+
+		priv->vni_attr = add_metadata_attr(m, name, sizeof(uint32_t),
+				MT_WRITE);
+		if (priv->vni_attr < 0)
+			return snobj_errno(-priv->vni_attr);
+	}
+
+	priv->parse_attr = add_parse_attr(m, MT_UPDATE);
+	if (priv->parse_attr < 0)
+		return snobj_errno(-priv->parse_attr);
+
+	return NULL;
+}
+
+static struct snobj *tunnel_decap_get_desc(const struct module *m)
+{
+	const struct tunnel_decap_priv *priv = get_priv_const(m);
+
+	return snobj_str_fmt("%s, port %u",
+			priv->type == TUN_VXLAN ? "VXLAN" : "GENEVE",
+			rte_be_to_cpu_16(priv->dst_port));
+}
+
+static const struct mclass tunnel_decap = {
+	.name 			= "TunnelDecap",
+	.help			= "decapsulates VXLAN/GENEVE packets",
+	.def_module_name 	= "tunnel_decap",
+	.num_igates 		= 1,
+	.num_ogates		= 2,
+	.priv_size		= sizeof(struct tunnel_decap_priv),
+	.init 			= tunnel_decap_init,
+	.get_desc		= tunnel_decap_get_desc,
+	.process_batch  	= tunnel_decap_process_batch,
+};
+
+ADD_MCLASS(tunnel_decap)
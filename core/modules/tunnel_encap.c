@@ -0,0 +1,420 @@
+#include <string.h>
+#include <stdio.h>
+
+#include <arpa/inet.h>
+
+#include <rte_hash_crc.h>
+
+#include "../module.h"
+#include "../parse.h"
+#include "../utils/simd.h"
+
+/* VXLAN (RFC 7348) or GENEVE (RFC 8926, without options) encapsulation
+ * over IPv4/UDP.
+ *
+ * Each destination (a remote tunnel endpoint and a VNI) has a template of
+ * the 50 bytes of outer headers, prepended into the headroom of the packet
+ * with two overlapping 32-byte stores. The payload is not copied. Then only
+ * the lengths, the outer IPv4 checksum (from a precomputed partial sum, or
+ * by the NIC with 'offload'), and the UDP source port need to be set. The
+ * source port is taken from a hash of the inner flow, so that the outer
+ * packets of a flow stay on the same path (ECMP) or RSS queue.
+ *
+ * The destination is given by a 16-bit metadata attribute ('dst_attr'),
+ * e.g., written by ExactMatch, or is always the first one. Packets for an
+ * unknown destination, or without enough headroom, are dropped. */
+
+#define TUN_MAX_DSTS		1024
+
+#define TUN_HDR_LEN		50	/* Ethernet + IPv4 + UDP + VXLAN/GENEVE */
+#define TUN_IP_OFF		14
+#define TUN_UDP_OFF		34
+#define TUN_L4_HDR_LEN		16	/* UDP + VXLAN/GENEVE */
+
+#define VXLAN_PORT		4789
+#define GENEVE_PORT		6081
+
+#define VXLAN_FLAG_VNI		0x08
+#define GENEVE_PROTO_ETHER	0x6558	/* Transparent Ethernet Bridging */
+
+enum tun_type {
+	TUN_VXLAN,
+	TUN_GENEVE,
+};
+
+struct tun_dst {
+	/* with zero IP length, IP checksum, UDP length, and UDP source port */
+	char hdr[TUN_HDR_LEN];
+	uint16_t _pad;
+
+	/* of the IPv4 header in the template, not folded */
+	uint32_t ip_sum;
+} __attribute__((aligned(64)));
+
+struct tunnel_encap_priv {
+	enum tun_type type;
+	int offload;		/* outer IPv4 checksum by the NIC */
+
+	int dst_attr;		/* -1 if always the first destination */
+	int parse_attr;		/* cached offsets are updated, if any */
+
+	volatile int num_dsts;
+	struct tun_dst dsts[TUN_MAX_DSTS];
+};
+
+static int tun_parse_mac(const char *str, char *addr)
+{
+	if (!str || sscanf(str, "%2hhx:%2hhx:%2hhx:%2hhx:%2hhx:%2hhx",
+				addr, addr + 1, addr + 2,
+				addr + 3, addr + 4, addr + 5) != 6)
+		return -EINVAL;
+
+	return 0;
+}
+
+static int tun_parse_ip(const char *str, uint32_t *addr)
+{
+	if (!str || inet_pton(AF_INET, str, addr) != 1)
+		return -EINVAL;
+
+	return 0;
+}
+
+static inline void tun_copy_hdr(char *head, const struct tun_dst *d)
+{
+	/* covers [0, 32) and [18, 50) */
+#if __AVX2__
+	__m256i a = _mm256_loadu_si256((__m256i *)d->hdr);
+	__m256i b = _mm256_loadu_si256((__m256i *)(d->hdr + 18));
+
+	_mm256_storeu_si256((__m256i *)head, a);
+	_mm256_storeu_si256((__m256i *)(head + 18), b);
+#else
+	__m128i a = _mm_loadu_si128((__m128i *)d->hdr);
+	__m128i b = _mm_loadu_si128((__m128i *)(d->hdr + 16));
+	__m128i c = _mm_loadu_si128((__m128i *)(d->hdr + 32));
+	__m128i e = _mm_loadu_si128((__m128i *)(d->hdr + 34));
+
+	_mm_storeu_si128((__m128i *)head, a);
+	_mm_storeu_si128((__m128i *)(head + 16), b);
+	_mm_storeu_si128((__m128i *)(head + 32), c);
+	_mm_storeu_si128((__m128i *)(head + 34), e);
+#endif
+}
+
+/* The IPv4 5-tuple (of an untagged frame), or the Ethernet header.
+ * The frame is at least as long as the Ethernet header. */
+static inline uint32_t tun_inner_hash(const char *inner, int len)
+{
+	const struct ether_hdr *eth = (const struct ether_hdr *)inner;
+	uint32_t hash;
+
+	if (len >= (int)(sizeof(struct ether_hdr) + sizeof(struct ipv4_hdr)) &&
+			eth->ether_type == rte_cpu_to_be_16(ETHER_TYPE_IPv4)) {
+		const struct ipv4_hdr *ip = (const struct ipv4_hdr *)
+				(inner + sizeof(struct ether_hdr));
+		int l4_off = sizeof(struct ether_hdr) +
+				((ip->version_ihl & 0x0f) << 2);
+
+		hash = rte_hash_crc_8byte(*(const uint64_t *)&ip->src_addr,
+				ip->next_proto_id);
+
+		/* ports, unless a fragment */
+		if ((ip->next_proto_id == IPPROTO_TCP ||
+				ip->next_proto_id == IPPROTO_UDP) &&
+				!(ip->fragment_offset &
+					rte_cpu_to_be_16(0x3fff)) &&
+				len >= l4_off + 4)
+			hash = rte_hash_crc_4byte(
+					*(const uint32_t *)(inner + l4_off),
+					hash);
+	} else {
+		hash = rte_hash_crc_8byte(*(const uint64_t *)inner, 0);
+		hash = rte_hash_crc_4byte(*(const uint32_t *)(inner + 8), hash);
+		hash = rte_hash_crc_4byte(eth->ether_type, hash);
+	}
+
+	return hash;
+}
+
+static inline int tun_encap(struct tunnel_encap_priv *priv,
+		struct snbuf *pkt, const struct tun_dst *d)
+{
+	int inner_len = snb_total_len(pkt);
+	uint32_t hash;
+	uint32_t sum;
+	char *head;
+
+	/* pending offloads for the inner headers as they are now */
+	if (unlikely(pkt->mbuf.ol_flags & (PKT_TX_VLAN_PKT |
+				PKT_TX_OUTER_IPV4 | PKT_TX_OUTER_IPV6)) &&
+			snb_tx_offload_sw(pkt, 0) < 0)
+		return -1;
+
+	/* not an Ethernet frame */
+	if (unlikely(snb_head_len(pkt) < (int)sizeof(struct ether_hdr)))
+		return -1;
+
+	hash = tun_inner_hash(snb_head_data(pkt), snb_head_len(pkt));
+
+	head = snb_prepend(pkt, TUN_HDR_LEN);
+	if (unlikely(!head))
+		return -1;
+
+	tun_copy_hdr(head, d);
+
+	/* the dynamic/private port range (49152-65535), as RFC 7348 says */
+	*(uint16_t *)(head + TUN_UDP_OFF) = rte_cpu_to_be_16(
+			0xc000 | (hash >> 18));
+	*(uint16_t *)(head + TUN_UDP_OFF + 4) = rte_cpu_to_be_16(
+			inner_len + TUN_L4_HDR_LEN);
+	*(uint16_t *)(head + TUN_IP_OFF + 2) = rte_cpu_to_be_16(
+			inner_len + TUN_HDR_LEN - TUN_IP_OFF);
+
+	if (priv->offload) {
+		snb_tx_offload_encap(pkt, TUN_IP_OFF, TUN_UDP_OFF - TUN_IP_OFF,
+				TUN_L4_HDR_LEN, 1);
+	} else {
+		/* the one's complement sum does not depend on the byte order */
+		sum = d->ip_sum + *(uint16_t *)(head + TUN_IP_OFF + 2);
+		sum = (sum & 0xffff) + (sum >> 16);
+		sum = (sum & 0xffff) + (sum >> 16);
+		*(uint16_t *)(head + TUN_IP_OFF + 10) = ~sum;
+
+		snb_tx_offload_encap(pkt, TUN_IP_OFF, TUN_UDP_OFF - TUN_IP_OFF,
+				TUN_L4_HDR_LEN, 0);
+	}
+
+	return 0;
+}
+
+static void tunnel_encap_process_batch(struct module *m,
+		struct pkt_batch *batch)
+{
+	struct tunnel_encap_priv *priv = get_priv(m);
+	gate_idx_t ogates[MAX_PKT_BURST];
+	int num_dsts = priv->num_dsts;
+	int cnt = batch->cnt;
+	int dropped = 0;
+	mt_offset_t dst_offset = MT_OFFSET_INVALID;
+	int parsed;
+
+	if (priv->dst_attr >= 0)
+		dst_offset = get_attr_offset(m, priv->dst_attr);
+
+	/* the cached offsets are now those of the outer headers */
+	parsed = parse_available(m, priv->parse_attr);
+
+	for (int i = 0; i < cnt; i++) {
+		struct snbuf *pkt = batch->pkts[i];
+		int idx = 0;
+
+		if (is_valid_attr_offset(dst_offset))
+			idx = *(uint16_t *)(pkt->_metadata_buf + dst_offset);
+
+		if (unlikely(idx >= num_dsts) ||
+				tun_encap(priv, pkt, &priv->dsts[idx]) < 0) {
+			ogates[i] = DROP_GATE;
+			dropped++;
+			continue;
+		}
+
+		ogates[i] = 0;
+
+		if (parsed) {
+			struct pkt_parse *p = get_parse(m, priv->parse_attr,
+					pkt);
+
+			p->l3_type = rte_cpu_to_be_16(ETHER_TYPE_IPv4);
+			p->l3_offset = TUN_IP_OFF;
+			p->l4_offset = TUN_UDP_OFF;
+			p->l4_proto = IPPROTO_UDP;
+			p->flags = PARSE_IPV4;
+		}
+	}
+
+	if (likely(!dropped))
+		run_next_module(m, batch);
+	else
+		run_split(m, ogates, batch);
+}
+
+static struct snobj *tun_build_dst(struct tunnel_encap_priv *priv,
+		struct tun_dst *d, struct snobj *dst)
+{
+	struct ether_hdr *eth = (struct ether_hdr *)d->hdr;
+	struct ipv4_hdr *ip = (struct ipv4_hdr *)(d->hdr + TUN_IP_OFF);
+	struct udp_hdr *udp = (struct udp_hdr *)(d->hdr + TUN_UDP_OFF);
+	uint8_t *tun = (uint8_t *)(d->hdr + TUN_UDP_OFF + 8);
+	uint32_t src_ip;
+	uint32_t dst_ip;
+	uint32_t vni;
+	int dst_port;
+	int ttl = 64;
+
+	const uint16_t *w = (const uint16_t *)(d->hdr + TUN_IP_OFF);
+	uint32_t sum = 0;
+
+	if (snobj_type(dst) != TYPE_MAP)
+		return snobj_err(EINVAL, "a destination must be a map");
+
+	memset(d, 0, sizeof(*d));
+
+	if (tun_parse_mac(snobj_eval_str(dst, "src_mac"),
+				(char *)&eth->s_addr) ||
+			tun_parse_mac(snobj_eval_str(dst, "dst_mac"),
+				(char *)&eth->d_addr))
+		return snobj_err(EINVAL, "'src_mac' and 'dst_mac' must be "
+				"MAC addresses (xx:xx:xx:xx:xx:xx)");
+
+	if (tun_parse_ip(snobj_eval_str(dst, "src_ip"), &src_ip) ||
+			tun_parse_ip(snobj_eval_str(dst, "dst_ip"), &dst_ip))
+		return snobj_err(EINVAL, "'src_ip' and 'dst_ip' must be "
+				"IPv4 addresses");
+
+	vni = snobj_eval_uint(dst, "vni");
+	if (vni >= (1 << 24))
+		return snobj_err(EINVAL, "'vni' must be 24 bits");
+
+	dst_port = (priv->type == TUN_VXLAN) ? VXLAN_PORT : GENEVE_PORT;
+	if (snobj_eval_exists(dst, "dst_port"))
+		dst_port = snobj_eval_int(dst, "dst_port");
+	if (dst_port <= 0 || dst_port > 65535)
+		return snobj_err(EINVAL, "'dst_port' must be 1-65535");
+
+	if (snobj_eval_exists(dst, "ttl"))
+		ttl = snobj_eval_int(dst, "ttl");
+	if (ttl <= 0 || ttl > 255)
+		return snobj_err(EINVAL, "'ttl' must be 1-255");
+
+	eth->ether_type = rte_cpu_to_be_16(ETHER_TYPE_IPv4);
+
+	/* atomic datagrams, with zero ID (RFC 6864) */
+	ip->version_ihl = 0x45;
+	ip->fragment_offset = rte_cpu_to_be_16(0x4000);	/* DF */
+	ip->time_to_live = ttl;
+	ip->next_proto_id = IPPROTO_UDP;
+	ip->src_addr = src_ip;
+	ip->dst_addr = dst_ip;
+
+	/* zero UDP checksum, allowed for both over IPv4 */
+	udp->dst_port = rte_cpu_to_be_16(dst_port);
+
+	if (priv->type == TUN_VXLAN) {
+		tun[0] = VXLAN_FLAG_VNI;
+	} else {
+		tun[2] = GENEVE_PROTO_ETHER >> 8;
+		tun[3] = GENEVE_PROTO_ETHER & 0xff;
+	}
+
+	tun[4] = vni >> 16;
+	tun[5] = vni >> 8;
+	tun[6] = vni;
+
+	for (int i = 0; i < (int)sizeof(struct ipv4_hdr) / 2; i++)
+		sum += w[i];
+	d->ip_sum = sum;
+
+	return NULL;
+}
+
+static struct snobj *
+command_add(struct module *m, const char *cmd, struct snobj *arg)
+{
+	struct tunnel_encap_priv *priv = get_priv(m);
+	int n = priv->num_dsts;
+
+	if (snobj_type(arg) != TYPE_LIST)
+		return snobj_err(EINVAL, "argument must be a list of maps");
+
+	if (n + arg->size > TUN_MAX_DSTS)
+		return snobj_err(EINVAL, "max %d destinations can be added",
+				TUN_MAX_DSTS);
+
+	for (int i = 0; i < arg->size; i++) {
+		struct snobj *err;
+
+		err = tun_build_dst(priv, &priv->dsts[n + i],
+				snobj_list_get(arg, i));
+		if (err)
+			return err;
+	}
+
+	/* the new entries are not visible to workers until here */
+	STORE_BARRIER();
+	priv->num_dsts = n + arg->size;
+
+	return NULL;
+}
+
+static struct snobj *tunnel_encap_init(struct module *m, struct snobj *arg)
+{
+	struct tunnel_encap_priv *priv = get_priv(m);
+	const char *type = "vxlan";
+	struct snobj *dsts;
+
+	priv->dst_attr = -1;
+
+	if (snobj_type(arg) != TYPE_MAP)
+		return snobj_err(EINVAL, "argument must be a map");
+
+	if (snobj_eval_exists(arg, "type"))
+		type = snobj_eval_str(arg, "type");
+
+	if (type && strcmp(type, "vxlan") == 0)
+		priv->type = TUN_VXLAN;
+	else if (type && strcmp(type, "geneve") == 0)
+		priv->type = TUN_GENEVE;
+	else
+		return snobj_err(EINVAL, "'type' must be 'vxlan' or 'geneve'");
+
+	priv->offload = snobj_eval_int(arg, "offload");
+
+	if (snobj_eval_exists(arg, "dst_attr")) {
+		const char *name = snobj_eval_str(arg, "dst_attr");
+
+		if (!name)
+			return snobj_err(EINVAL, "'dst_attr' must be a string");
+
+		priv->dst_attr = add_metadata_attr(m, name, sizeof(uint16_t),
+				MT_READ);
+		if (priv->dst_attr < 0)
+			return snobj_errno(-priv->dst_attr);
+	}
+
+	priv->parse_attr = add_parse_attr(m, MT_UPDATE);
+	if (priv->parse_attr < 0)
+		return snobj_errno(-priv->parse_attr);
+
+	dsts = snobj_eval(arg, "dsts");
+	if (!dsts)
+		return snobj_err(EINVAL, "'dsts' must be a list of maps");
+
+	return command_add(m, NULL, dsts);
+}
+
+static struct snobj *tunnel_encap_get_desc(const struct module *m)
+{
+	const struct tunnel_encap_priv *priv = get_priv_const(m);
+
+	return snobj_str_fmt("%s, %d destinations",
+			priv->type == TUN_VXLAN ? "VXLAN" : "GENEVE",
+			priv->num_dsts);
+}
+
+static const struct mclass tunnel_encap = {
+	.name 			= "TunnelEncap",
+	.help			= "encapsulates packets in VXLAN/GENEVE",
+	.def_module_name 	= "tunnel_encap",
+	.num_igates 		= 1,
+	.num_ogates		= 1,
+	.priv_size		= sizeof(struct tunnel_encap_priv),
+	.init 			= tunnel_encap_init,
+	.get_desc		= tunnel_encap_get_desc,
+	.process_batch  	= tunnel_encap_process_batch,
+	.commands		= {
+		{"add", 	command_add,	.mt_safe=1},
+	}
+};
+
+ADD_MCLASS(tunnel_encap)
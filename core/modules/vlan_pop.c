@@ -1,9 +1,27 @@
 #include <string.h>
 
 #include "../module.h"
+#include "../parse.h"
+
+struct vlan_pop_priv {
+	int attr_id;		/* cached offsets are adjusted, if any */
+};
+
+static struct snobj *vpop_init(struct module *m, struct snobj *arg)
+{
+	struct vlan_pop_priv *priv = get_priv(m);
+
+	priv->attr_id = add_parse_attr(m, MT_UPDATE);
+	if (priv->attr_id < 0)
+		return snobj_errno(-priv->attr_id);
+
+	return NULL;
+}
 
 static void vpop_process_batch(struct module *m, struct pkt_batch *batch)
 {
+	struct vlan_pop_priv *priv = get_priv(m);
+	int parsed = parse_available(m, priv->attr_id);
 	int cnt = batch->cnt;
 
 	for (int i = 0; i < cnt; i++) {
@@ -22,6 +40,10 @@ static void vpop_process_batch(struct module *m, struct pkt_batch *batch)
 		if (tagged && snb_adj(pkt, 4)) {
 			ethh = _mm_slli_si128(ethh, 4);
 			_mm_storeu_si128((__m128i *)old_head, ethh);
+
+			if (parsed)
+				parse_shift_l2(get_parse(m, priv->attr_id, 
+							pkt), -4);
 		}
 	}
 		
@@ -34,6 +56,8 @@ static const struct mclass vlan_pop = {
 	.def_module_name 	= "vlan_pop",
 	.num_igates 		= 1,
 	.num_ogates		= 1,
+	.priv_size		= sizeof(struct vlan_pop_priv),
+	.init			= vpop_init,
 	.process_batch  	= vpop_process_batch,
 };
 
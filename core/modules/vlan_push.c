@@ -3,12 +3,15 @@
 #include <arpa/inet.h>
 
 #include "../module.h"
+#include "../parse.h"
 #include "../utils/simd.h"
 
 struct vlan_push_priv {
 	/* network order */
 	uint32_t vlan_tag;	
 	uint32_t qinq_tag;
+
+	int attr_id;		/* cached offsets are adjusted, if any */
 };
 
 static struct snobj *
@@ -33,6 +36,12 @@ command_set_tci(struct module *m, const char *cmd, struct snobj *arg)
 
 static struct snobj *vpush_init(struct module *m, struct snobj *arg)
 {
+	struct vlan_push_priv *priv = get_priv(m);
+
+	priv->attr_id = add_parse_attr(m, MT_UPDATE);
+	if (priv->attr_id < 0)
+		return snobj_errno(-priv->attr_id);
+
 	return command_set_tci(m, NULL, arg);
 }
 
@@ -55,6 +64,7 @@ static void vpush_process_batch(struct module *m, struct pkt_batch *batch)
 
 	uint32_t vlan_tag = priv->vlan_tag;
 	uint32_t qinq_tag = priv->qinq_tag;
+	int parsed = parse_available(m, priv->attr_id);
 
 	for (int i = 0; i < cnt; i++) {
 		struct snbuf *pkt = batch->pkts[i];
@@ -83,6 +93,9 @@ static void vpush_process_batch(struct module *m, struct pkt_batch *batch)
 					(tpid == rte_cpu_to_be_16(0x8100)) ?
 						qinq_tag : vlan_tag;
 #endif
+			if (parsed)
+				parse_shift_l2(get_parse(m, priv->attr_id, 
+							pkt), 4);
 		}
 	}
 		
@@ -1,9 +1,27 @@
 #include <string.h>
 
 #include "../module.h"
+#include "../parse.h"
+
+struct vlan_split_priv {
+	int attr_id;		/* cached offsets are adjusted, if any */
+};
+
+static struct snobj *vsplit_init(struct module *m, struct snobj *arg)
+{
+	struct vlan_split_priv *priv = get_priv(m);
+
+	priv->attr_id = add_parse_attr(m, MT_UPDATE);
+	if (priv->attr_id < 0)
+		return snobj_errno(-priv->attr_id);
+
+	return NULL;
+}
 
 static void vsplit_process_batch(struct module *m, struct pkt_batch *batch)
 {
+	struct vlan_split_priv *priv = get_priv(m);
+	int parsed = parse_available(m, priv->attr_id);
 	gate_idx_t vid[MAX_PKT_BURST];
 	int cnt = batch->cnt;
 
@@ -26,6 +44,10 @@ static void vsplit_process_batch(struct module *m, struct pkt_batch *batch)
 			ethh = _mm_slli_si128(ethh, 4);
 			_mm_storeu_si128((__m128i *)old_head, ethh);
 			vid[i] = rte_be_to_cpu_16(tci) & 0x0fff;
+
+			if (parsed)
+				parse_shift_l2(get_parse(m, priv->attr_id, 
+							pkt), -4);
 		} else
 			vid[i] = 0;	/* untagged packets go to gate 0 */
 	}
@@ -39,6 +61,8 @@ static const struct mclass vlan_split = {
 	.def_module_name 	= "vlan_split",
 	.num_igates		= 1,
 	.num_ogates		= 4096,
+	.priv_size		= sizeof(struct vlan_split_priv),
+	.init			= vsplit_init,
 	.process_batch  	= vsplit_process_batch,
 };
 
@@ -319,14 +319,16 @@ void ns_init_iterator(struct ns_iter *iter, ns_type_t type)
 	assert(type >= 0);
 	assert(type < NS_TYPE_MAX);
 		
-	ht.iterator_cnt[type]++;
+	/* atomic, as read-only control requests may iterate concurrently */
+	__sync_fetch_and_add(&ht.iterator_cnt[type], 1);
+
+	iter->type = type;
 
 	if (ht.item_count == 0) {
 		iter->next = NULL;
 		return;
 	}
 	
-	iter->type = type;
 	iter->ns_elem_iter = &ht.ns_elem_type_iter[type];
 	ihead = iter->ns_elem_iter;
 
@@ -343,7 +345,7 @@ void ns_init_iterator(struct ns_iter *iter, ns_type_t type)
 
 void ns_release_iterator(struct ns_iter* iter) 
 {
-	ht.iterator_cnt[iter->type]--;
+	__sync_fetch_and_sub(&ht.iterator_cnt[iter->type], 1);
 }
 
 void *ns_next(struct ns_iter *iter) 
@@ -2,7 +2,6 @@
 #include <assert.h>
 #include <string.h>
 #include <unistd.h>
-#include <sys/epoll.h>
 #include <sched.h>
 
 #include <rte_config.h>
@@ -104,7 +103,7 @@ static int run_fastforward(void)
 
 static int interrupt_cnt = 0;
 
-static int run_fastforward_event(int efd)
+static int run_fastforward_event(struct sn_poll_set *set)
 {
 	int ret = 0;
 
@@ -115,18 +114,16 @@ static int run_fastforward_event(int efd)
 	int i;
 	int rxq;
 
-
-	struct epoll_event evs[1024];
+	int ready[SN_POLL_MAX_QUEUES];
 	int k;
-	int n = epoll_wait(efd, evs, 1024, -1);
+	int n = sn_poll_wait(set, ready, SN_POLL_MAX_QUEUES, -1);
 
 	int total_batch = 0;
+
+	interrupt_cnt++;
 	
 	for (k = 0; k < n; k++) {
-		char buf[100];
-
-		rxq = evs[k].data.fd;
-		interrupt_cnt += read(in_port->fd[rxq], buf, 1);
+		rxq = set->qs[ready[k]].rxq;
 		int cnt = 0;
 		do {
 			received = sn_receive_pkts(in_port, rxq, pkts, batch_size);
@@ -175,8 +172,6 @@ static int run_fastforward_event(int efd)
 			ret += received;
 			ret += sent;
 		} while (received > 0 && total_batch < 32);
-		/* FIXME */
-		/*sn_enable_interrupt(&in_port->rx_queues[rxq]);		*/
 	}
 	
 
@@ -242,7 +237,7 @@ int main(int argc, char **argv)
 
 	char *endptr;
 
-	int efd;
+	struct sn_poll_set *set = NULL;
 	int idle;
 
 	memset(in_ifname, 0, sizeof(in_ifname));
@@ -321,16 +316,14 @@ int main(int argc, char **argv)
 	last_tsc = rte_rdtsc();
 
 	if (!polling) {
-		struct epoll_event ev;
 		int rxq;
-		efd = epoll_create(1024);
+
+		set = sn_poll_create();
+		assert(set);
 		
-		for (rxq = 0; rxq < in_port->num_txq; rxq++) {
-			ev.events = EPOLLIN;
-			ev.data.fd = rxq;
-			epoll_ctl(efd, EPOLL_CTL_ADD,  in_port->fd[rxq], &ev);
-			/* FIXME */
-			/*sn_enable_interrupt(&in_port->rx_queues[rxq]);*/
+		for (rxq = 0; rxq < sn_num_rxq(in_port); rxq++) {
+			int ret = sn_poll_add(set, in_port, rxq);
+			assert(ret >= 0);
 		}
 	}
 
@@ -341,7 +334,7 @@ int main(int argc, char **argv)
 			if (run_fastforward() > 0)
 				idle = 0;
 		} else {
-			run_fastforward_event(efd);
+			run_fastforward_event(set);
 		}
 #if 0
 		if ((loop_count & 0xff) || rte_rdtsc() - last_tsc < hz)
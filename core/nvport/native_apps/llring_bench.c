@@ -0,0 +1,261 @@
+/* Measures the cost of moving objects between two cores through llrings.
+ *
+ * stream mode (default): one thread enqueues, the other dequeues.
+ *   Reports the throughput in ns per object.
+ * ping-pong mode (-l): the producer sends a burst and waits for it to be
+ *   echoed back through a second ring. Reports the round-trip time.
+ *
+ * Pick the two cores on the same or on different sockets to see the cost
+ * of cache line transfers. -m uses the multi-producer/consumer code paths,
+ * which read the index of the other side on every call. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include "../../kmod/llring.h"
+
+#define MAX_BURST	256
+
+static int producer_core = 0;
+static int consumer_core = 1;
+static int burst = 32;
+static int slots = 256;
+static int multi = 0;
+static int pingpong = 0;
+static uint64_t total_objs = 100000000;
+
+static struct llring *ring_fwd;
+static struct llring *ring_bwd;
+
+static volatile int ready;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static void pin_to_core(int core)
+{
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(core, &set);
+
+	if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) {
+		fprintf(stderr, "cannot pin to core %d\n", core);
+		exit(1);
+	}
+}
+
+static struct llring *alloc_ring(void)
+{
+	struct llring *r;
+	int ret;
+
+	if (posix_memalign((void **)&r, LLRING_CACHELINE_SIZE,
+				llring_bytes_with_slots(slots))) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+
+	ret = llring_init(r, slots, !multi, !multi);
+	if (ret) {
+		fprintf(stderr, "llring_init() failed: %d\n", ret);
+		exit(1);
+	}
+
+	return r;
+}
+
+/* enqueue all of objs[0..n), spinning while the ring is full */
+static void enqueue_all(struct llring *r, void **objs, int n)
+{
+	int sent = 0;
+
+	while (sent < n) {
+		int ret = llring_enqueue_burst(r, objs + sent, n - sent);
+
+		sent += ret & RING_SZ_MASK;
+		if (sent < n)
+			llring_pause();
+	}
+}
+
+static void dequeue_all(struct llring *r, void **objs, int n)
+{
+	int received = 0;
+
+	while (received < n) {
+		int ret = llring_dequeue_burst(r, objs + received,
+				n - received);
+
+		received += ret;
+		if (received < n)
+			llring_pause();
+	}
+}
+
+static void *consumer_main(void *arg)
+{
+	void *objs[MAX_BURST];
+	uint64_t received = 0;
+	uint64_t expected = 1;
+
+	pin_to_core(consumer_core);
+	ready = 1;
+
+	while (received < total_objs) {
+		int cnt;
+		int i;
+
+		if (pingpong) {
+			cnt = burst;
+			dequeue_all(ring_fwd, objs, cnt);
+			enqueue_all(ring_bwd, objs, cnt);
+		} else {
+			cnt = llring_dequeue_burst(ring_fwd, objs, burst);
+			if (cnt == 0) {
+				llring_pause();
+				continue;
+			}
+		}
+
+		/* objects must arrive in order, once */
+		for (i = 0; i < cnt; i++) {
+			if ((uintptr_t)objs[i] != expected) {
+				fprintf(stderr, "expected %lu, got %lu\n",
+						expected, (uintptr_t)objs[i]);
+				exit(1);
+			}
+			expected++;
+		}
+
+		received += cnt;
+	}
+
+	return NULL;
+}
+
+static void run_producer(void)
+{
+	void *objs[MAX_BURST];
+	uint64_t seq = 1;
+	uint64_t sent = 0;
+	uint64_t start;
+	uint64_t elapsed;
+
+	pin_to_core(producer_core);
+
+	while (!ready)
+		llring_pause();
+
+	start = now_ns();
+
+	while (sent < total_objs) {
+		int i;
+
+		for (i = 0; i < burst; i++)
+			objs[i] = (void *)(uintptr_t)seq++;
+
+		enqueue_all(ring_fwd, objs, burst);
+
+		if (pingpong)
+			dequeue_all(ring_bwd, objs, burst);
+
+		sent += burst;
+	}
+
+	elapsed = now_ns() - start;
+
+	if (pingpong)
+		printf("%s: %lu round trips of %d objects, "
+				"%.1f ns/round trip, %.2f ns/object\n",
+				multi ? "mp/mc" : "sp/sc",
+				sent / burst, burst,
+				(double)elapsed * burst / sent,
+				(double)elapsed / sent);
+	else
+		printf("%s: %lu objects in bursts of %d, "
+				"%.2f ns/object, %.1f Mobjs/s\n",
+				multi ? "mp/mc" : "sp/sc",
+				sent, burst,
+				(double)elapsed / sent,
+				(double)sent * 1000 / elapsed);
+}
+
+void show_usage(char *prog_name)
+{
+	fprintf(stderr, "Usage: %s [-p <producer core>] [-c <consumer core>] "
+		"[-b <burst size>] [-s <ring slots>] [-n <objects>] "
+		"[-l (ping-pong)] [-m (mp/mc)]\n",
+		prog_name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	pthread_t consumer;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "p:c:b:s:n:lm")) != -1) {
+		switch (opt) {
+		case 'p':
+			producer_core = atoi(optarg);
+			break;
+		case 'c':
+			consumer_core = atoi(optarg);
+			break;
+		case 'b':
+			burst = atoi(optarg);
+			break;
+		case 's':
+			slots = atoi(optarg);
+			break;
+		case 'n':
+			total_objs = strtoull(optarg, NULL, 10);
+			break;
+		case 'l':
+			pingpong = 1;
+			break;
+		case 'm':
+			multi = 1;
+			break;
+		default:
+			show_usage(argv[0]);
+		}
+	}
+
+	if (burst < 1 || burst > MAX_BURST || burst >= slots)
+		show_usage(argv[0]);
+
+	/* whole bursts only */
+	total_objs -= total_objs % burst;
+	if (total_objs == 0)
+		show_usage(argv[0]);
+
+	ring_fwd = alloc_ring();
+	ring_bwd = alloc_ring();
+
+	if (pthread_create(&consumer, NULL, consumer_main, NULL)) {
+		fprintf(stderr, "pthread_create() failed\n");
+		return 1;
+	}
+
+	run_producer();
+
+	pthread_join(consumer, NULL);
+
+	free(ring_fwd);
+	free(ring_bwd);
+
+	return 0;
+}
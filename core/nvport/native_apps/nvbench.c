@@ -0,0 +1,666 @@
+/* Benchmark suite for the nvport library.
+ *
+ * Runs the scenarios below over a matrix of packet sizes and queue counts,
+ * and prints one JSON object per result line to stdout (progress goes to
+ * stderr), so that runs with different builds or kernels can be diffed or
+ * loaded into a script as is.
+ *
+ *   alloc       snbuf alloc/free, single and bulk (no port needed)
+ *   throughput  one-way: send on the TX queues of -i as fast as possible,
+ *               and receive from the RX queues of -o
+ *   latency     ping-pong: one timestamped packet in flight at a time
+ *   isolation   ping-pong on queue 0, while the other queues are blasted
+ *
+ * All but alloc expect BESS to forward the packets from -i back to -o
+ * as they are, queue by queue, e.g.,
+ *   QueueInc(port=a, qid=N) -> QueueOut(port=b, qid=N)  for each N
+ * (-o defaults to -i, then the same port loops back) */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/utsname.h>
+
+#include <rte_config.h>
+#include <rte_cycles.h>
+#include <rte_mbuf.h>
+#include <rte_ether.h>
+#include <rte_ip.h>
+#include <rte_udp.h>
+#include <rte_byteorder.h>
+
+#include "sn.h"
+
+#define MAX_LIST	16
+
+#define MAX_SAMPLES	(1 << 20)
+
+/* a probe is lost if not back within this */
+#define PROBE_TIMEOUT_US	10000
+
+#define BENCH_MAGIC	0x6e766263	/* "nvbc" */
+
+#define HDR_LEN		(sizeof(struct ether_hdr) + \
+			 sizeof(struct ipv4_hdr) + sizeof(struct udp_hdr))
+
+/* in the UDP payload */
+struct bench_hdr {
+	uint32_t magic;
+	uint32_t seq;
+	uint64_t tsc;
+} __attribute__((packed));
+
+#define MIN_PKT_SIZE	60	/* without FCS */
+#define MAX_PKT_SIZE	1514
+
+enum {
+	TEST_ALLOC		= 1 << 0,
+	TEST_THROUGHPUT		= 1 << 1,
+	TEST_LATENCY		= 1 << 2,
+	TEST_ISOLATION		= 1 << 3,
+};
+
+static const struct {
+	const char *name;
+	int flag;
+} tests[] = {
+	{"alloc",	TEST_ALLOC},
+	{"throughput",	TEST_THROUGHPUT},
+	{"latency",	TEST_LATENCY},
+	{"isolation",	TEST_ISOLATION},
+	{NULL,		0},
+};
+
+static struct sn_port *in_port;
+static struct sn_port *out_port;
+
+static int batch_size = 32;
+static double duration = 1.0;		/* seconds per result */
+
+static int pkt_sizes[MAX_LIST] = {64, 128, 256, 512, 1024, 1514};
+static int num_pkt_sizes = 6;
+
+static int queue_cnts[MAX_LIST] = {1, 2, 4, 8};
+static int num_queue_cnts = 4;
+
+static uint64_t hz;
+
+static uint64_t samples[MAX_SAMPLES];
+static int num_samples;
+
+static char pkt_tmp[HDR_LEN];
+
+char unique_name[APPNAMESIZ];
+
+static void show_usage(char *prog_name)
+{
+	fprintf(stderr, "Usage: %s -i <iface> [-o <iface>] [-c <core id>] "
+		"[-n <name>]\n"
+		"\t[-t <tests, e.g., alloc,throughput,latency,isolation>]\n"
+		"\t[-s <packet sizes, e.g., 64,1514>] "
+		"[-q <queue counts, e.g., 1,2,4>]\n"
+		"\t[-b <batch size>] [-d <seconds per result>]\n",
+		prog_name);
+	exit(1);
+}
+
+static int parse_list(const char *str, int *vals)
+{
+	char buf[256];
+	char *tok;
+	char *saveptr;
+	int cnt = 0;
+
+	snprintf(buf, sizeof(buf), "%s", str);
+
+	for (tok = strtok_r(buf, ",", &saveptr); tok;
+			tok = strtok_r(NULL, ",", &saveptr)) {
+		if (cnt >= MAX_LIST) {
+			fprintf(stderr, "Too many values in '%s'\n", str);
+			exit(1);
+		}
+		vals[cnt++] = atoi(tok);
+	}
+
+	return cnt;
+}
+
+static int parse_tests(const char *str)
+{
+	char buf[256];
+	char *tok;
+	char *saveptr;
+	int mask = 0;
+
+	snprintf(buf, sizeof(buf), "%s", str);
+
+	for (tok = strtok_r(buf, ",", &saveptr); tok;
+			tok = strtok_r(NULL, ",", &saveptr)) {
+		int i;
+
+		for (i = 0; tests[i].name; i++) {
+			if (strcmp(tok, tests[i].name) == 0)
+				break;
+		}
+
+		if (!tests[i].name) {
+			fprintf(stderr, "Unknown test '%s'\n", tok);
+			exit(1);
+		}
+
+		mask |= tests[i].flag;
+	}
+
+	return mask;
+}
+
+static inline double cycles_to_ns(uint64_t cycles)
+{
+	return (double)cycles * 1000000000.0 / hz;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* ---------------------------------------------------------------- */
+
+static void build_template(int size)
+{
+	struct ether_hdr *eth = (struct ether_hdr *)pkt_tmp;
+	struct ipv4_hdr *ip = (struct ipv4_hdr *)(eth + 1);
+	struct udp_hdr *udp = (struct udp_hdr *)(ip + 1);
+
+	memset(pkt_tmp, 0, sizeof(pkt_tmp));
+
+	eth->d_addr.addr_bytes[5] = 2;
+	eth->s_addr.addr_bytes[5] = 1;
+	eth->ether_type = rte_cpu_to_be_16(ETHER_TYPE_IPv4);
+
+	ip->version_ihl = (4 << 4) | sizeof(struct ipv4_hdr) >> 2;
+	ip->total_length = rte_cpu_to_be_16(size - sizeof(*eth));
+	ip->time_to_live = 64;
+	ip->next_proto_id = IPPROTO_UDP;
+	ip->src_addr = rte_cpu_to_be_32(IPv4(192, 168, 0, 1));
+	ip->dst_addr = rte_cpu_to_be_32(IPv4(192, 168, 0, 2));
+
+	/* the checksum is not checked on the way */
+
+	udp->src_port = rte_cpu_to_be_16(1234);
+	udp->dst_port = rte_cpu_to_be_16(5678);
+	udp->dgram_len = rte_cpu_to_be_16(size - sizeof(*eth) - sizeof(*ip));
+}
+
+static void build_batch(struct snbuf **pkts, int cnt, int size)
+{
+	int i;
+
+	sn_snb_alloc_bulk(pkts, cnt);
+
+	for (i = 0; i < cnt; i++) {
+		char *buf = snb_append(pkts[i], size);
+
+		assert(buf);
+		memcpy(buf, pkt_tmp, HDR_LEN);
+	}
+}
+
+static struct snbuf *build_probe(int size, uint32_t seq)
+{
+	struct snbuf *pkt;
+	struct bench_hdr *hdr;
+	char *buf;
+
+	pkt = sn_snb_alloc();
+	assert(pkt);
+
+	buf = snb_append(pkt, size);
+	assert(buf);
+	memcpy(buf, pkt_tmp, HDR_LEN);
+
+	hdr = (struct bench_hdr *)(buf + HDR_LEN);
+	hdr->magic = BENCH_MAGIC;
+	hdr->seq = seq;
+	hdr->tsc = rte_rdtsc();
+
+	return pkt;
+}
+
+/* returns the number of packets sent. The rest are freed */
+static int send_batch(int txq, struct snbuf **pkts, int cnt)
+{
+	int sent = sn_send_pkts(in_port, txq, pkts, cnt);
+
+	if (sent < cnt)
+		sn_snb_free_bulk_range(pkts, sent, cnt - sent);
+
+	return sent;
+}
+
+/* receives and frees packets. Returns the number of packets */
+static int drain_queue(int rxq, uint64_t *bytes)
+{
+	struct snbuf *pkts[batch_size];
+	int received;
+	int i;
+
+	received = sn_receive_pkts(out_port, rxq, pkts, batch_size);
+	if (received == 0)
+		return 0;
+
+	if (bytes) {
+		for (i = 0; i < received; i++)
+			*bytes += snb_total_len(pkts[i]);
+	}
+
+	sn_snb_free_bulk(pkts, received);
+
+	return received;
+}
+
+/* Looks for the probe seq in the queue. Other packets are dropped.
+ * Returns the round-trip time in cycles, or 0 if not found (yet) */
+static uint64_t poll_probe(int rxq, uint32_t seq)
+{
+	struct snbuf *pkts[batch_size];
+	uint64_t rtt = 0;
+	int received;
+	int i;
+
+	received = sn_receive_pkts(out_port, rxq, pkts, batch_size);
+	if (received == 0)
+		return 0;
+
+	for (i = 0; i < received; i++) {
+		struct bench_hdr *hdr;
+
+		if (snb_head_len(pkts[i]) < HDR_LEN + sizeof(*hdr))
+			continue;
+
+		hdr = (struct bench_hdr *)(snb_head_data(pkts[i]) + HDR_LEN);
+		if (hdr->magic == BENCH_MAGIC && hdr->seq == seq)
+			rtt = rte_rdtsc() - hdr->tsc;
+	}
+
+	sn_snb_free_bulk(pkts, received);
+
+	return rtt;
+}
+
+/* for isolation, on top of the latency probes */
+struct bulk_stats {
+	uint64_t tx_pkts;
+	uint64_t rx_pkts;
+	uint64_t rx_bytes;
+	uint64_t rx_pkts_q[MAX_QUEUES_PER_PORT_DIR];
+};
+
+static void run_bulk(int first_q, int num_qs, int size, struct bulk_stats *s)
+{
+	struct snbuf *pkts[batch_size];
+	int q;
+
+	for (q = first_q; q < num_qs; q++) {
+		uint64_t rx;
+
+		build_batch(pkts, batch_size, size);
+		s->tx_pkts += send_batch(q, pkts, batch_size);
+
+		rx = drain_queue(q, &s->rx_bytes);
+		s->rx_pkts += rx;
+		s->rx_pkts_q[q] += rx;
+	}
+}
+
+/* packets still in flight at the end are counted as received */
+static void settle(int num_qs, struct bulk_stats *s)
+{
+	uint64_t until = rte_rdtsc() + hz / 1000;	/* 1ms */
+
+	while (rte_rdtsc() < until) {
+		int q;
+
+		for (q = 0; q < num_qs; q++) {
+			uint64_t rx = drain_queue(q, &s->rx_bytes);
+
+			s->rx_pkts += rx;
+			s->rx_pkts_q[q] += rx;
+		}
+	}
+}
+
+static void print_latency(void)
+{
+	double sum = 0;
+	int i;
+
+	if (num_samples == 0) {
+		printf(", \"samples\": 0");
+		return;
+	}
+
+	qsort(samples, num_samples, sizeof(samples[0]), cmp_u64);
+
+	for (i = 0; i < num_samples; i++)
+		sum += samples[i];
+
+	printf(", \"samples\": %d, \"rtt_ns\": {\"min\": %.0f, "
+			"\"avg\": %.0f, \"p50\": %.0f, \"p99\": %.0f, "
+			"\"p999\": %.0f, \"max\": %.0f}",
+			num_samples,
+			cycles_to_ns(samples[0]),
+			cycles_to_ns(sum / num_samples),
+			cycles_to_ns(samples[num_samples / 2]),
+			cycles_to_ns(samples[(int)(num_samples * 0.99)]),
+			cycles_to_ns(samples[(int)(num_samples * 0.999)]),
+			cycles_to_ns(samples[num_samples - 1]));
+}
+
+/* ping-pong on queue 0. With num_qs > 1, the other queues carry bulk
+ * traffic in the meantime */
+static void run_pingpong(int size, int num_qs, struct bulk_stats *bulk,
+		uint64_t *lost)
+{
+	const uint64_t timeout = hz * PROBE_TIMEOUT_US / 1000000;
+	uint64_t start = rte_rdtsc();
+	uint64_t end = start + duration * hz;
+	uint32_t seq = 0;
+
+	num_samples = 0;
+	*lost = 0;
+
+	while (rte_rdtsc() < end && num_samples < MAX_SAMPLES) {
+		struct snbuf *probe = build_probe(size, ++seq);
+		uint64_t sent_tsc = rte_rdtsc();
+		uint64_t rtt = 0;
+
+		if (send_batch(0, &probe, 1) == 0) {
+			(*lost)++;
+			continue;
+		}
+
+		while (rtt == 0 && rte_rdtsc() - sent_tsc < timeout) {
+			rtt = poll_probe(0, seq);
+
+			if (num_qs > 1)
+				run_bulk(1, num_qs, size, bulk);
+		}
+
+		if (rtt)
+			samples[num_samples++] = rtt;
+		else
+			(*lost)++;
+	}
+}
+
+/* ---------------------------------------------------------------- */
+
+static void print_meta(void)
+{
+	struct utsname u;
+
+	uname(&u);
+
+	printf("{\"test\": \"meta\", \"kernel\": \"%s\", \"machine\": \"%s\", "
+			"\"tsc_hz\": %lu, \"batch\": %d, \"duration\": %.3f",
+			u.release, u.machine, hz, batch_size, duration);
+
+	if (in_port)
+		printf(", \"in_txq\": %d, \"out_rxq\": %d",
+				sn_num_txq(in_port), sn_num_rxq(out_port));
+
+	printf("}\n");
+	fflush(stdout);
+}
+
+static void test_alloc(void)
+{
+	const int batches[] = {1, batch_size};
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		struct snbuf *pkts[batch_size];
+		int batch = batches[i];
+
+		uint64_t start = rte_rdtsc();
+		uint64_t end = start + duration * hz;
+		uint64_t now;
+		uint64_t ops = 0;
+
+		fprintf(stderr, "alloc: batch %d\n", batch);
+
+		do {
+			int j;
+
+			for (j = 0; j < 64; j++) {
+				if (batch == 1) {
+					pkts[0] = sn_snb_alloc();
+					sn_snb_free(pkts[0]);
+				} else {
+					sn_snb_alloc_bulk(pkts, batch);
+					sn_snb_free_bulk(pkts, batch);
+				}
+			}
+
+			ops += 64 * batch;
+			now = rte_rdtsc();
+		} while (now < end);
+
+		printf("{\"test\": \"alloc\", \"batch\": %d, \"pkts\": %lu, "
+				"\"mpps\": %.3f, \"cycles_per_pkt\": %.1f}\n",
+				batch, ops,
+				ops / ((double)(now - start) / hz) / 1000000,
+				(double)(now - start) / ops);
+		fflush(stdout);
+	}
+}
+
+static void test_throughput(int size, int num_qs)
+{
+	struct bulk_stats s;
+	uint64_t start;
+	uint64_t end;
+	double secs;
+
+	memset(&s, 0, sizeof(s));
+
+	start = rte_rdtsc();
+	end = start + duration * hz;
+
+	while (rte_rdtsc() < end)
+		run_bulk(0, num_qs, size, &s);
+
+	secs = (double)(rte_rdtsc() - start) / hz;
+	settle(num_qs, &s);
+
+	printf("{\"test\": \"throughput\", \"pkt_size\": %d, \"queues\": %d, "
+			"\"tx_mpps\": %.3f, \"rx_mpps\": %.3f, "
+			"\"rx_gbps\": %.3f, \"loss\": %.6f, \"rx_mpps_q\": [",
+			size, num_qs,
+			s.tx_pkts / secs / 1000000,
+			s.rx_pkts / secs / 1000000,
+			(s.rx_bytes + s.rx_pkts * 24) * 8 / secs / 1e9,
+			s.tx_pkts ? 1.0 - (double)s.rx_pkts / s.tx_pkts : 0);
+
+	for (int q = 0; q < num_qs; q++)
+		printf("%s%.3f", q ? ", " : "", s.rx_pkts_q[q] / secs / 1000000);
+
+	printf("]}\n");
+	fflush(stdout);
+}
+
+static void test_latency(int size)
+{
+	struct bulk_stats s;
+	uint64_t lost;
+
+	memset(&s, 0, sizeof(s));
+	run_pingpong(size, 1, &s, &lost);
+	settle(1, &s);
+
+	printf("{\"test\": \"latency\", \"pkt_size\": %d, \"lost\": %lu",
+			size, lost);
+	print_latency();
+	printf("}\n");
+	fflush(stdout);
+}
+
+static void test_isolation(int size, int num_qs)
+{
+	struct bulk_stats s;
+	uint64_t lost;
+	double secs;
+
+	memset(&s, 0, sizeof(s));
+
+	uint64_t start = rte_rdtsc();
+	run_pingpong(size, num_qs, &s, &lost);
+	secs = (double)(rte_rdtsc() - start) / hz;
+	settle(num_qs, &s);
+
+	printf("{\"test\": \"isolation\", \"pkt_size\": %d, \"queues\": %d, "
+			"\"lost\": %lu, \"bulk_tx_mpps\": %.3f, "
+			"\"bulk_rx_mpps\": %.3f",
+			size, num_qs, lost,
+			s.tx_pkts / secs / 1000000,
+			s.rx_pkts / secs / 1000000);
+	print_latency();
+	printf("}\n");
+	fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+	char in_ifname[IFNAMSIZ];
+	char out_ifname[IFNAMSIZ];
+
+	uint64_t core = 7;
+	int test_mask = TEST_ALLOC | TEST_THROUGHPUT | TEST_LATENCY |
+			TEST_ISOLATION;
+	int max_qs;
+	int opt;
+	int i;
+	int j;
+
+	memset(in_ifname, 0, sizeof(in_ifname));
+	memset(out_ifname, 0, sizeof(out_ifname));
+
+	while ((opt = getopt(argc, argv, "c:i:o:n:t:s:q:b:d:")) != -1) {
+		switch (opt) {
+		case 'c':
+			core = atoi(optarg);
+			break;
+		case 'i':
+			strncpy(in_ifname, optarg, IFNAMSIZ - 1);
+			break;
+		case 'o':
+			strncpy(out_ifname, optarg, IFNAMSIZ - 1);
+			break;
+		case 'n':
+			strncpy(unique_name, optarg, APPNAMESIZ - 1);
+			break;
+		case 't':
+			test_mask = parse_tests(optarg);
+			break;
+		case 's':
+			num_pkt_sizes = parse_list(optarg, pkt_sizes);
+			break;
+		case 'q':
+			num_queue_cnts = parse_list(optarg, queue_cnts);
+			break;
+		case 'b':
+			batch_size = atoi(optarg);
+			break;
+		case 'd':
+			duration = atof(optarg);
+			break;
+		default:
+			show_usage(argv[0]);
+		}
+	}
+
+	if (batch_size < 1 || batch_size > MAX_PKT_BURST || duration <= 0)
+		show_usage(argv[0]);
+
+	for (i = 0; i < num_pkt_sizes; i++) {
+		if (pkt_sizes[i] < MIN_PKT_SIZE || pkt_sizes[i] > MAX_PKT_SIZE) {
+			fprintf(stderr, "Packet sizes must be between %d "
+					"and %d\n", MIN_PKT_SIZE, MAX_PKT_SIZE);
+			exit(1);
+		}
+	}
+
+	if ((test_mask & ~TEST_ALLOC) && !in_ifname[0])
+		show_usage(argv[0]);
+
+	if (!unique_name[0])
+		snprintf(unique_name, sizeof(unique_name), "nvbench%d",
+				getpid());
+
+	init_bess(core, unique_name);
+	hz = rte_get_tsc_hz();
+
+	if (in_ifname[0]) {
+		in_port = init_port(in_ifname);
+		assert(in_port);
+
+		if (!out_ifname[0] || strcmp(in_ifname, out_ifname) == 0)
+			out_port = in_port;
+		else {
+			out_port = init_port(out_ifname);
+			assert(out_port);
+		}
+	}
+
+	print_meta();
+
+	if (test_mask & TEST_ALLOC)
+		test_alloc();
+
+	if (!in_port)
+		return 0;
+
+	max_qs = RTE_MIN(sn_num_txq(in_port), sn_num_rxq(out_port));
+
+	for (i = 0; i < num_pkt_sizes; i++) {
+		int size = pkt_sizes[i];
+
+		build_template(size);
+
+		if (test_mask & TEST_LATENCY) {
+			fprintf(stderr, "latency: %dB\n", size);
+			test_latency(size);
+		}
+
+		for (j = 0; j < num_queue_cnts; j++) {
+			int num_qs = queue_cnts[j];
+
+			if (num_qs < 1 || num_qs > max_qs) {
+				fprintf(stderr, "skipping %d queues "
+						"(the ports have %d)\n",
+						num_qs, max_qs);
+				continue;
+			}
+
+			if (test_mask & TEST_THROUGHPUT) {
+				fprintf(stderr, "throughput: %dB, %d queues\n",
+						size, num_qs);
+				test_throughput(size, num_qs);
+			}
+
+			if ((test_mask & TEST_ISOLATION) && num_qs > 1) {
+				fprintf(stderr, "isolation: %dB, %d queues\n",
+						size, num_qs);
+				test_isolation(size, num_qs);
+			}
+		}
+	}
+
+	return 0;
+}
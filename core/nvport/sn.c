@@ -5,6 +5,8 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
 
 #include <rte_cycles.h>
 #include <rte_config.h>
@@ -214,6 +216,128 @@ void close_port(struct sn_port *port)
 	free(port);
 }
 
+struct sn_poll_set *sn_poll_create(void)
+{
+	struct sn_poll_set *set;
+
+	set = malloc(sizeof(struct sn_poll_set));
+	if (!set)
+		return NULL;
+
+	set->num_qs = 0;
+
+	set->efd = epoll_create(SN_POLL_MAX_QUEUES);
+	if (set->efd < 0) {
+		free(set);
+		return NULL;
+	}
+
+	return set;
+}
+
+void sn_poll_destroy(struct sn_poll_set *set)
+{
+	close(set->efd);
+	free(set);
+}
+
+int sn_poll_add(struct sn_poll_set *set, struct sn_port *port, int rxq)
+{
+	struct epoll_event ev;
+	int idx = set->num_qs;
+
+	if (idx >= SN_POLL_MAX_QUEUES || rxq < 0 || rxq >= port->num_rxq)
+		return -1;
+
+	ev.events = EPOLLIN;
+	ev.data.u32 = idx;
+
+	if (epoll_ctl(set->efd, EPOLL_CTL_ADD, port->fd[rxq], &ev) < 0)
+		return -1;
+
+	set->qs[idx].port = port;
+	set->qs[idx].rxq = rxq;
+	set->num_qs++;
+
+	return idx;
+}
+
+int sn_poll_ready(struct sn_poll_set *set, int *ready, int max)
+{
+	int cnt = 0;
+
+	for (int i = 0; i < set->num_qs && cnt < max; i++) {
+		struct sn_poll_queue *q = &set->qs[i];
+
+		if (llring_count(q->port->rx_qs[q->rxq]) > 0)
+			ready[cnt++] = i;
+	}
+
+	return cnt;
+}
+
+static void set_interrupts(struct sn_poll_set *set, int enable)
+{
+	for (int i = 0; i < set->num_qs; i++) {
+		struct sn_poll_queue *q = &set->qs[i];
+
+		if (enable)
+			__sn_enable_interrupt(q->port->rx_regs[q->rxq]);
+		else
+			__sn_disable_interrupt(q->port->rx_regs[q->rxq]);
+	}
+}
+
+int sn_poll_wait(struct sn_poll_set *set, int *ready, int max, 
+		int timeout_ms)
+{
+	struct epoll_event evs[SN_POLL_MAX_QUEUES];
+	int cnt;
+
+	cnt = sn_poll_ready(set, ready, max);
+	if (cnt > 0)
+		return cnt;
+
+	set_interrupts(set, 1);
+
+	for (;;) {
+		int n;
+
+		/* packets may have arrived before the interrupts were on */
+		cnt = sn_poll_ready(set, ready, max);
+		if (cnt > 0)
+			break;
+
+		n = epoll_wait(set->efd, evs, SN_POLL_MAX_QUEUES, timeout_ms);
+		if (n < 0 && errno == EINTR)
+			continue;
+
+		if (n <= 0) {
+			cnt = n;
+			break;
+		}
+
+		/* BESS writes one byte per interrupt it sends. A byte may be 
+		 * stale (the queue was drained without sleeping), 
+		 * so check the rings again rather than trust the events */
+		for (int k = 0; k < n; k++) {
+			struct sn_poll_queue *q = &set->qs[evs[k].data.u32];
+			char buf[64];
+			int ret;
+
+			ret = read(q->port->fd[q->rxq], buf, sizeof(buf));
+			(void)ret;
+
+			/* BESS clears it when sending the interrupt */
+			__sn_enable_interrupt(q->port->rx_regs[q->rxq]);
+		}
+	}
+
+	set_interrupts(set, 0);
+
+	return cnt;
+}
+
 int sn_receive_pkts(struct sn_port *port,
 		 int rxq, struct snbuf **pkts, int cnt)
 {
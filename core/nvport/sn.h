@@ -73,6 +73,21 @@ struct sn_port {
 
 /* End ideally share this part */
 
+/* A set of (port, RX queue) pairs to wait on. See sn_poll_wait() */
+#define SN_POLL_MAX_QUEUES	(MAX_QUEUES_PER_PORT_DIR * 8)
+
+struct sn_poll_queue {
+	struct sn_port *port;
+	int rxq;
+};
+
+struct sn_poll_set {
+	int efd;	/* epoll over the IRQ FIFOs of the queues */
+
+	int num_qs;
+	struct sn_poll_queue qs[SN_POLL_MAX_QUEUES];
+};
+
 //// Maximum size of a metadata attribute or value
 //extern const int ATTRSZ;
 
@@ -101,6 +116,23 @@ void sn_snb_copy_batch(snb_array_t src, snb_array_t dest, int cnt);
 void sn_enable_interrupt(struct vport_out_regs *);
 void sn_disable_interrupt(struct vport_out_regs *);
 
+/* Returns NULL on error */
+struct sn_poll_set *sn_poll_create(void);
+void sn_poll_destroy(struct sn_poll_set *set);
+
+/* Returns the index of the queue in the set, or -1 on error */
+int sn_poll_add(struct sn_poll_set *set, struct sn_port *port, int rxq);
+
+/* Fills ready[] with the indexes of the queues that have packets, and
+ * returns how many (up to max). Does not block */
+int sn_poll_ready(struct sn_poll_set *set, int *ready, int max);
+
+/* Same as sn_poll_ready(), but if no queue has packets, enables the
+ * interrupts of all queues and sleeps until one gets packets or timeout_ms
+ * passes (-1 to wait forever). Returns 0 on timeout, -1 on error */
+int sn_poll_wait(struct sn_poll_set *set, int *ready, int max, 
+		int timeout_ms);
+
 uint16_t sn_num_txq(struct sn_port* vport);
 
 uint16_t sn_num_rxq(struct sn_port* vport);
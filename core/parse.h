@@ -0,0 +1,154 @@
+#ifndef _PARSE_H_
+#define _PARSE_H_
+
+#include <stdint.h>
+
+#include <rte_byteorder.h>
+#include <rte_ether.h>
+#include <rte_ip.h>
+
+#include "snbuf.h"
+#include "metadata.h"
+
+/* Cached header offsets, carried in the "parse" metadata attribute.
+ *
+ * The Parse module fills it once per packet, so that modules further down
+ * the pipeline do not need to walk the L2/L3 headers again. A module that
+ * wants to use it declares the attribute with add_parse_attr(m, MT_READ) and
+ * checks parse_available() once per batch. If no module in the connected
+ * component writes the attribute, its offset is invalid and the module
+ * should parse the headers by itself, as before.
+ *
+ * Offsets are relative to snb_head_data(). Modules that move the headers
+ * (e.g., VLANPush) use MT_UPDATE and adjust the offsets accordingly. */
+
+#define PARSE_ATTR_NAME		"parse"
+
+/* pkt_parse.flags */
+#define PARSE_VLAN		0x01	/* one or more VLAN tags */
+#define PARSE_IPV4		0x02
+#define PARSE_IPV6		0x04
+#define PARSE_FRAG		0x08	/* IPv4 fragment */
+
+#define PARSE_MAX_VLANS		2
+
+struct pkt_parse {
+	uint16_t l3_type;	/* EtherType after VLAN tags, network order */
+	uint8_t l3_offset;
+	uint8_t l4_offset;	/* 0 if unknown (e.g., non-first fragment) */
+	uint8_t l4_proto;	/* IP protocol number, if IPv4/IPv6 */
+	uint8_t flags;
+	uint16_t _reserved;
+};
+
+static inline int add_parse_attr(struct module *m, enum mt_access_mode mode)
+{
+	return add_metadata_attr(m, PARSE_ATTR_NAME, sizeof(struct pkt_parse), 
+			mode);
+}
+
+static inline int parse_available(struct module *m, int attr_id)
+{
+	return is_valid_attr_offset(get_attr_offset(m, attr_id));
+}
+
+#define get_parse(m, attr_id, snb) \
+	get_attr_ptr(m, attr_id, snb, struct pkt_parse)
+
+/* only the first segment is examined */
+static inline void parse_packet(struct snbuf *snb, struct pkt_parse *p)
+{
+	const char *head = snb_head_data(snb);
+	int len = snb_head_len(snb);
+	uint16_t type;
+	int off;
+
+	p->flags = 0;
+	p->l4_offset = 0;
+	p->l4_proto = 0;
+
+	if (unlikely(len < (int)sizeof(struct ether_hdr))) {
+		p->l3_type = 0;
+		p->l3_offset = 0;
+		return;
+	}
+
+	type = ((const struct ether_hdr *)head)->ether_type;
+	off = sizeof(struct ether_hdr);
+
+	for (int i = 0; i < PARSE_MAX_VLANS; i++) {
+		if (type != rte_cpu_to_be_16(ETHER_TYPE_VLAN) && 
+				type != rte_cpu_to_be_16(0x88a8))
+			break;
+
+		if (off + 4 > len)
+			break;
+
+		p->flags |= PARSE_VLAN;
+		type = *(const uint16_t *)(head + off + 2);
+		off += 4;
+	}
+
+	p->l3_type = type;
+	p->l3_offset = off;
+
+	if (type == rte_cpu_to_be_16(ETHER_TYPE_IPv4)) {
+		const struct ipv4_hdr *ip = (const struct ipv4_hdr *)(head + off);
+		int ihl;
+
+		if (off + (int)sizeof(struct ipv4_hdr) > len)
+			return;
+
+		p->flags |= PARSE_IPV4;
+		p->l4_proto = ip->next_proto_id;
+
+		ihl = (ip->version_ihl & IPV4_HDR_IHL_MASK) * 4;
+
+		if (ip->fragment_offset & rte_cpu_to_be_16(
+					IPV4_HDR_OFFSET_MASK | IPV4_HDR_MF_FLAG))
+			p->flags |= PARSE_FRAG;
+
+		if (!(ip->fragment_offset & 
+				rte_cpu_to_be_16(IPV4_HDR_OFFSET_MASK)) &&
+				ihl >= (int)sizeof(struct ipv4_hdr) &&
+				off + ihl <= len)
+			p->l4_offset = off + ihl;
+	} else if (type == rte_cpu_to_be_16(ETHER_TYPE_IPv6)) {
+		const struct ipv6_hdr *ip = (const struct ipv6_hdr *)(head + off);
+
+		if (off + (int)sizeof(struct ipv6_hdr) > len)
+			return;
+
+		/* extension headers are not followed */
+		p->flags |= PARSE_IPV6;
+		p->l4_proto = ip->proto;
+		p->l4_offset = off + sizeof(struct ipv6_hdr);
+	}
+}
+
+/* the offset of the L4 payload, after an L4 header of hdr_len bytes, 
+ * or def if the L4 header was not found */
+static inline int parse_l4_payload(const struct pkt_parse *p, int hdr_len,
+		int def)
+{
+	return p->l4_offset ? p->l4_offset + hdr_len : def;
+}
+
+/* after a VLAN tag is pushed (delta = 4) or popped (delta = -4) */
+static inline void parse_shift_l2(struct pkt_parse *p, int delta)
+{
+	/* too short to parse at all */
+	if (!p->l3_offset)
+		return;
+
+	p->l3_offset += delta;
+	if (p->l4_offset)
+		p->l4_offset += delta;
+
+	if (p->l3_offset > sizeof(struct ether_hdr))
+		p->flags |= PARSE_VLAN;
+	else
+		p->flags &= ~PARSE_VLAN;
+}
+
+#endif
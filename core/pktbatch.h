@@ -5,7 +5,17 @@
 
 #include <rte_memcpy.h>
 
+/* The capacity of a batch. Can be overridden at build time
+ * (e.g., "make MAX_PKT_BURST=128" for 100G NICs with cheap pipelines).
+ * Must be a multiple of 16, and smaller than 256.
+ * Modules should use this macro (or a smaller configured value), 
+ * rather than assuming 32. */
+#ifndef MAX_PKT_BURST
 #define MAX_PKT_BURST			32
+#endif
+
+_Static_assert(MAX_PKT_BURST % 16 == 0 && MAX_PKT_BURST < 256,
+		"Invalid MAX_PKT_BURST");
 
 struct snbuf;
 
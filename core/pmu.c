@@ -0,0 +1,189 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "pmu.h"
+#include "worker.h"
+#include "log.h"
+
+const char *pmu_event_names[NUM_PMU_EVENTS] = {
+	[PMU_CYCLES]		= "cycles",
+	[PMU_INSTRUCTIONS]	= "instructions",
+	[PMU_LLC_MISSES]	= "llc_misses",
+	[PMU_BRANCH_MISSES]	= "branch_misses",
+};
+
+static const uint64_t pmu_event_configs[NUM_PMU_EVENTS] = {
+	[PMU_CYCLES]		= PERF_COUNT_HW_CPU_CYCLES,
+	[PMU_INSTRUCTIONS]	= PERF_COUNT_HW_INSTRUCTIONS,
+	[PMU_LLC_MISSES]	= PERF_COUNT_HW_CACHE_MISSES,
+	[PMU_BRANCH_MISSES]	= PERF_COUNT_HW_BRANCH_MISSES,
+};
+
+/* set by the master, read by workers when they are launched or resumed.
+ * pmu_gen is bumped whenever pmu_on is set */
+static volatile int pmu_on;
+static volatile uint32_t pmu_gen;
+
+uint64_t __pmu_read_slow(const struct pmu_counter *c)
+{
+	uint64_t val;
+
+	if (read(c->fd, &val, sizeof(val)) != sizeof(val))
+		return 0;
+
+	return val;
+}
+
+/* the first n counters */
+static void close_counters(struct pmu *p, int n)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+
+	for (int i = 0; i < n; i++) {
+		munmap(p->counters[i].page, page_size);
+		close(p->counters[i].fd);
+	}
+}
+
+int pmu_open(struct pmu *p)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+	int ret;
+	int i;
+
+	if (p->enabled)
+		return 0;
+
+	p->rdpmc = 1;
+
+	for (i = 0; i < NUM_PMU_EVENTS; i++) {
+		struct pmu_counter *c = &p->counters[i];
+		struct perf_event_attr attr;
+
+		memset(&attr, 0, sizeof(attr));
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.size = sizeof(attr);
+		attr.config = pmu_event_configs[i];
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+
+		/* this thread, on any CPU */
+		c->fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+		if (c->fd < 0) {
+			ret = -errno;
+			goto fail;
+		}
+
+		c->page = mmap(NULL, page_size, PROT_READ, MAP_SHARED,
+				c->fd, 0);
+		if (c->page == MAP_FAILED) {
+			ret = -errno;
+			close(c->fd);
+			goto fail;
+		}
+
+		if (!c->page->cap_user_rdpmc)
+			p->rdpmc = 0;
+	}
+
+	p->enabled = 1;
+
+	return 0;
+
+fail:
+	close_counters(p, i);
+	return ret;
+}
+
+void pmu_close(struct pmu *p)
+{
+	if (!p->enabled)
+		return;
+
+	p->enabled = 0;
+	close_counters(p, NUM_PMU_EVENTS);
+}
+
+void pmu_read_total(const struct pmu *p, uint64_t *vals)
+{
+	for (int i = 0; i < NUM_PMU_EVENTS; i++)
+		vals[i] = p->enabled ? __pmu_read_slow(&p->counters[i]) : 0;
+}
+
+int pmu_sync(struct pmu *p)
+{
+	uint32_t gen = pmu_gen;
+	int ret = 0;
+
+	if (p->gen == gen)
+		return 0;
+
+	p->gen = gen;
+
+	if (pmu_on) {
+		ret = pmu_open(p);
+		if (ret < 0)
+			log_err("W%d: perf_event_open() failed: %s\n", 
+					ctx.wid, strerror(-ret));
+	} else
+		pmu_close(p);
+
+	return ret;
+}
+
+static int sync_on_worker(void *arg)
+{
+	struct worker_context *w = arg;
+
+	if (w == &ctx)
+		return pmu_sync(&w->pmu);
+
+	/* paused, so on the master. The worker opens its counters when 
+	 * resumed, but they can be closed from any thread */
+	if (!pmu_on) {
+		pmu_close(&w->pmu);
+		w->pmu.gen = pmu_gen;
+	}
+
+	return 0;
+}
+
+int enable_pmu(void)
+{
+	pmu_on = 1;
+	pmu_gen++;
+
+	for (int wid = 0; wid < MAX_WORKERS; wid++) {
+		int ret;
+
+		if (!is_worker_active(wid))
+			continue;
+
+		ret = run_on_worker(wid, sync_on_worker, workers[wid]);
+		if (ret < 0) {
+			disable_pmu();
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+void disable_pmu(void)
+{
+	pmu_on = 0;
+	pmu_gen++;
+
+	for (int wid = 0; wid < MAX_WORKERS; wid++)
+		if (is_worker_active(wid))
+			run_on_worker(wid, sync_on_worker, workers[wid]);
+}
+
+int is_pmu_enabled(void)
+{
+	return pmu_on;
+}
@@ -0,0 +1,108 @@
+#ifndef _PMU_H_
+#define _PMU_H_
+
+#include <stdint.h>
+
+#include <linux/perf_event.h>
+
+/* Hardware performance counters of a worker thread (perf_event_open()),
+ * user-space only. They are read with rdpmc through the mmap'ed page of
+ * each event, without a system call, if the kernel allows it
+ * (/sys/bus/event_source/devices/cpu/rdpmc), or with read() otherwise.
+ *
+ * Like cycles, the counters are attributed to modules and TCs only in
+ * sampled task runs (see task_scheduled_sampled()), so only ratios such
+ * as IPC or LLC misses per packet are meaningful. Once enabled with
+ * enable_pmu(), workers launched later open the counters too.
+ *
+ * The counters are for the thread that opens them, so a worker always opens
+ * its own, with pmu_sync(). Paused workers do it when resumed. */
+
+enum pmu_event {
+	PMU_CYCLES = 0,
+	PMU_INSTRUCTIONS,
+	PMU_LLC_MISSES,
+	PMU_BRANCH_MISSES,
+	NUM_PMU_EVENTS,
+};
+
+extern const char *pmu_event_names[NUM_PMU_EVENTS];
+
+struct pmu_counter {
+	int fd;
+	struct perf_event_mmap_page *page;
+};
+
+/* in the worker context */
+struct pmu {
+	int enabled;
+	int rdpmc;		/* all events can be read with rdpmc */
+	uint32_t gen;		/* of enable_pmu()/disable_pmu(), last synced */
+	struct pmu_counter counters[NUM_PMU_EVENTS];
+};
+
+static inline uint64_t rdpmc(uint32_t idx)
+{
+	uint32_t hi, lo;
+	__asm__ __volatile__ ("rdpmc" : "=a"(lo), "=d"(hi) : "c"(idx));
+	return (uint64_t)lo | ((uint64_t)hi << 32);
+}
+
+/* See the comment on struct perf_event_mmap_page (the seqlock is 'lock') */
+static inline uint64_t pmu_rdpmc(const struct perf_event_mmap_page *pc)
+{
+	uint64_t count;
+	uint32_t seq;
+
+	do {
+		uint32_t idx;
+
+		seq = pc->lock;
+		__asm__ __volatile__ ("" ::: "memory");
+
+		idx = pc->index;
+		count = pc->offset;
+
+		/* idx is 0 while the event is not scheduled on the PMU */
+		if (idx) {
+			int shift = 64 - pc->pmc_width;
+			int64_t pmc = rdpmc(idx - 1);
+
+			count += (uint64_t)((pmc << shift) >> shift);
+		}
+
+		__asm__ __volatile__ ("" ::: "memory");
+	} while (pc->lock != seq);
+
+	return count;
+}
+
+uint64_t __pmu_read_slow(const struct pmu_counter *c);
+
+/* on the thread of p */
+static inline void pmu_read(const struct pmu *p, uint64_t *vals)
+{
+	for (int i = 0; i < NUM_PMU_EVENTS; i++) {
+		const struct pmu_counter *c = &p->counters[i];
+
+		vals[i] = p->rdpmc ? pmu_rdpmc(c->page) : __pmu_read_slow(c);
+	}
+}
+
+/* for the calling thread. Returns 0 or -errno */
+int pmu_open(struct pmu *p);
+void pmu_close(struct pmu *p);
+
+/* for the calling thread: opens or closes the counters, if enable_pmu() or
+ * disable_pmu() has been called since the last time. Returns 0 or -errno */
+int pmu_sync(struct pmu *p);
+
+/* totals of a worker, from any thread (with read()) */
+void pmu_read_total(const struct pmu *p, uint64_t *vals);
+
+/* on all workers, running or not, and those launched later */
+int enable_pmu(void);
+void disable_pmu(void);
+int is_pmu_enabled(void);
+
+#endif
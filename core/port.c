@@ -1,10 +1,12 @@
 #include <errno.h>
+#include <pthread.h>
 
 #include <rte_malloc.h>
 
 #include "port.h"
 #include "driver.h"
 #include "namespace.h"
+#include "mem.h"
 
 size_t list_ports(const struct port **p_arr, size_t arr_size, size_t offset)
 {
@@ -100,6 +102,8 @@ struct port *create_port(const char *name,
 		struct snobj **perr)
 {
 	struct port *p = NULL;
+	void *mem_base;
+	size_t mem_size;
 	int ret;
 
 	queue_t num_inc_q = 1;
@@ -172,12 +176,17 @@ struct port *create_port(const char *name,
 		goto fail;
 	}
 
-	p = rte_zmalloc("port", sizeof(struct port) + driver->priv_size , 0);
+	/* the device socket is not known yet (set by init_port()) */
+	p = alloc_with_priv("port", sizeof(struct port), driver->priv_size,
+			driver->priv_align, SOCKET_ID_ANY, &mem_base, &mem_size);
 	if (!p) {
 		*perr = snobj_errno(ENOMEM);
 		goto fail;
 	}
 
+	p->mem_base = mem_base;
+	p->mem_size = mem_size;
+
 	p->name = rte_zmalloc("name", PORT_NAME_LEN, 0);
 	if (!p->name) {
 		*perr = snobj_errno(ENOMEM);
@@ -185,6 +194,11 @@ struct port *create_port(const char *name,
 	}
 
 	p->driver = driver;
+	p->socket = SOCKET_ID_ANY;
+
+	for (packet_dir_t dir = 0; dir < PACKET_DIRS; dir++)
+		for (queue_t qid = 0; qid < MAX_QUEUES_PER_DIR; qid++)
+			p->queue_owner[dir][qid] = -1;
 
 	memcpy(p->mac_addr, mac_addr, ETH_ALEN);
 	p->num_queues[PACKET_DIR_INC] = num_inc_q;
@@ -208,13 +222,18 @@ struct port *create_port(const char *name,
 		goto fail;
 	}
 
+	if (arg) {
+		snobj_acquire(arg);
+		p->arg = arg;
+	}
+
 	return p;
 
 fail:
-	if (p)
+	if (p) {
 		rte_free(p->name);
-
-	rte_free(p);
+		rte_free(p->mem_base);
+	}
 
 	return NULL;
 }
@@ -237,19 +256,30 @@ int destroy_port(struct port *p)
 	if (p->driver->deinit_port)
 		p->driver->deinit_port(p);
 
+	if (p->arg)
+		snobj_free(p->arg);
+
 	rte_free(p->name);
-	rte_free(p);
+	rte_free(p->mem_base);
 
 	return 0;
 }
 
 void get_port_stats(struct port *p, port_stats_t *stats)
 {
+	/* collect_stats() updates p->port_stats, and read-only control 
+	 * requests may come from multiple threads at the same time */
+	static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+	pthread_mutex_lock(&stats_lock);
+
 	if (p->driver->collect_stats)
 		p->driver->collect_stats(p, 0);
 
 	memcpy(stats, &p->port_stats, sizeof(port_stats_t));
 
+	pthread_mutex_unlock(&stats_lock);
+
 	for (packet_dir_t dir = 0; dir < PACKET_DIRS; dir++) {
 		for (queue_t qid = 0; qid < p->num_queues[dir]; qid++) {
 			const struct packet_stats *queue_stats;
@@ -263,6 +293,77 @@ void get_port_stats(struct port *p, port_stats_t *stats)
 	}
 }
 
+struct snobj *parse_single_queues(struct port *p, packet_dir_t dir,
+		struct snobj *arg)
+{
+	if (!arg)
+		return NULL;
+
+	if (snobj_type(arg) == TYPE_INT) {
+		for (queue_t qid = 0; qid < p->num_queues[dir]; qid++)
+			p->queue_single[dir][qid] = !!snobj_int_get(arg);
+
+		return NULL;
+	}
+
+	if (snobj_type(arg) != TYPE_LIST)
+		return snobj_err(EINVAL, "Must be an int or a list of queues");
+
+	for (int i = 0; i < arg->size; i++) {
+		struct snobj *q = snobj_list_get(arg, i);
+		int qid;
+
+		if (snobj_type(q) != TYPE_INT)
+			return snobj_err(EINVAL, "Queue ID must be an int");
+
+		qid = snobj_int_get(q);
+		if (qid < 0 || qid >= p->num_queues[dir])
+			return snobj_err(EINVAL, "Invalid queue %d", qid);
+
+		p->queue_single[dir][qid] = 1;
+	}
+
+	return NULL;
+}
+
+void reset_queue_owners(void)
+{
+	struct ns_iter iter;
+	struct port *p;
+
+	ns_init_iterator(&iter, NS_TYPE_PORT);
+
+	while ((p = (struct port *)ns_next(&iter)) != NULL) {
+		for (packet_dir_t dir = 0; dir < PACKET_DIRS; dir++)
+			for (queue_t qid = 0; qid < MAX_QUEUES_PER_DIR; qid++)
+				p->queue_owner[dir][qid] = -1;
+	}
+
+	ns_release_iterator(&iter);
+}
+
+void release_queue_owners(int wid)
+{
+	struct ns_iter iter;
+	struct port *p;
+
+	ns_init_iterator(&iter, NS_TYPE_PORT);
+
+	while ((p = (struct port *)ns_next(&iter)) != NULL) {
+		for (packet_dir_t dir = 0; dir < PACKET_DIRS; dir++)
+			for (queue_t qid = 0; qid < MAX_QUEUES_PER_DIR; qid++) {
+				int *owner = &p->queue_owner[dir][qid];
+				int cur = *owner;
+
+				if (queue_owner_wid(cur) == wid)
+					__sync_bool_compare_and_swap(owner,
+							cur, -1);
+			}
+	}
+
+	ns_release_iterator(&iter);
+}
+
 /* XXX: Do we need this? Currently not being used anywhere */
 void get_queue_stats(struct port *p, packet_dir_t dir, queue_t qid, 
 		struct packet_stats *stats)
@@ -292,8 +393,10 @@ int acquire_queues(struct port *p, const struct module *m, packet_dir_t dir,
 				return -EBUSY;
 		}
 
-		for (qid = 0; qid < p->num_queues[dir]; qid++)
+		for (qid = 0; qid < p->num_queues[dir]; qid++) {
 			p->users[dir][qid] = m;
+			p->queue_owner[dir][qid] = -1;
+		}
 
 		return 0;
 	}
@@ -316,6 +419,7 @@ int acquire_queues(struct port *p, const struct module *m, packet_dir_t dir,
 	for (i = 0; i < num_queues; i++) {
 		qid = queues[i];
 		p->users[dir][qid] = m;
+		p->queue_owner[dir][qid] = -1;
 	}
 
 	return 0;
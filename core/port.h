@@ -7,6 +7,7 @@
 #include "log.h"
 #include "snobj.h"
 #include "driver.h"
+#include "worker.h"
 
 #define PORT_NAME_LEN		128
 
@@ -28,6 +29,9 @@ struct port {
 
 	const struct driver *driver;
 
+	/* given to create_port(), for snapshots. NULL if none */
+	struct snobj *arg;
+
 	/* which modules are using this port?
 	 * TODO: more robust gate keeping */
 	const struct module *users[PACKET_DIRS][MAX_QUEUES_PER_DIR];
@@ -37,7 +41,28 @@ struct port {
 	queue_t num_queues[PACKET_DIRS];
 	int queue_size[PACKET_DIRS];
 
+	/* NUMA node of the device, set by the driver. 
+	 * SOCKET_ID_ANY if not applicable (e.g., virtual ports) */
+	int socket;
+
+	/* the block with the port and its private data (alloc_with_priv()) */
+	void *mem_base;
+	size_t mem_size;
+
+	/* TX offloads done by the device (DEV_TX_OFFLOAD_*), set by the
+	 * driver. PortOut does the others in software. */
+	uint32_t tx_offload_capa;
+
 	struct packet_stats queue_stats[PACKET_DIRS][MAX_QUEUES_PER_DIR];
+
+	/* Set by the driver, for queues that are not safe to be used by 
+	 * multiple workers at the same time (e.g., llrings in single
+	 * producer/consumer mode). See check_queue_owner() */
+	uint8_t queue_single[PACKET_DIRS][MAX_QUEUES_PER_DIR];
+
+	/* wid of the worker using the queue, -1 if none yet */
+	int queue_owner[PACKET_DIRS][MAX_QUEUES_PER_DIR];
+	uint64_t queue_violations[PACKET_DIRS][MAX_QUEUES_PER_DIR];
 	
 	/* for stats that do NOT belong to any queues */
 	port_stats_t port_stats;	
@@ -65,6 +90,62 @@ void get_port_stats(struct port *p, port_stats_t *stats);
 void get_queue_stats(struct port *p, packet_dir_t dir, queue_t qid, 
 		struct packet_stats *stats);
 
+/* queue_owner[][] values: -1 if none, otherwise the wid of the owner 
+ * (low 8 bits) and its queue_epoch at the time it took the queue */
+static inline int queue_owner_id(int wid, uint32_t epoch)
+{
+	return (int)(((epoch << 8) | wid) & INT32_MAX);
+}
+
+static inline int queue_owner_wid(int owner)
+{
+	return owner < 0 ? -1 : owner & 0xff;
+}
+
+/* the owner has given up its queues since (or is gone) */
+static inline int is_queue_owner_stale(int owner)
+{
+	const struct worker_context *w = workers[queue_owner_wid(owner)];
+
+	return !w || queue_owner_id(w->wid, w->queue_epoch) != owner;
+}
+
+/* For queue_single queues. The first worker that uses the queue after
+ * acquire_queues() (or after workers are paused, or after its owner
+ * gave up its queues with give_up_queues()) owns it. Returns 0 if
+ * the calling worker is not the owner, then the driver must not touch
+ * the queue. */
+static inline int check_queue_owner(struct port *p, packet_dir_t dir, 
+		queue_t qid)
+{
+	int *owner = &p->queue_owner[dir][qid];
+	int me = queue_owner_id(ctx.wid, ctx.queue_epoch);
+	int cur = *owner;
+
+	if (likely(cur == me))
+		return 1;
+
+	if ((cur < 0 || is_queue_owner_stale(cur)) && 
+			__sync_bool_compare_and_swap(owner, cur, me))
+		return 1;
+
+	p->queue_violations[dir][qid]++;
+	return 0;
+}
+
+/* Sets queue_single[dir] from a driver option: 1 for all queues, 0 for none,
+ * or a list of queue IDs. Call in init_port(), before using the flags */
+struct snobj *parse_single_queues(struct port *p, packet_dir_t dir,
+		struct snobj *arg);
+
+/* all workers must be paused. Tasks may have moved to other workers */
+void reset_queue_owners(void);
+
+/* Only the queues last used by the worker, e.g., after its tasks have
+ * moved to others (it claims again those it still uses). 
+ * Other workers may be running */
+void release_queue_owners(int wid);
+
 /* quques == NULL if _all_ queues are being acquired/released */
 int acquire_queues(struct port *p, const struct module *m, packet_dir_t dir, 
 		const queue_t *queues, int num_queues);
@@ -1,4 +1,9 @@
 #include <assert.h>
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+
+#include <pthread.h>
 
 #include <rte_errno.h>
 
@@ -9,13 +14,17 @@
 #include "time.h"
 #include "dpdk.h"
 #include "snbuf.h"
+#include "task.h"
+#include "tc.h"
 
 
 #define NUM_MEMPOOL_CACHE	512
 
-struct rte_mbuf pframe_template;
+struct rte_mbuf pframe_template[SNB_NUM_CLASSES];
+
+static struct rte_mempool *pframe_pool[SNB_NUM_CLASSES][RTE_MAX_NUMA_NODES];
 
-static struct rte_mempool *pframe_pool[RTE_MAX_NUMA_NODES];
+static struct snb_pool_stats pool_stats[SNB_NUM_CLASSES][RTE_MAX_NUMA_NODES];
 
 /* per-packet initializer for mempool */
 static void snbuf_pkt_init(struct rte_mempool *mp, void *opaque_arg,
@@ -24,84 +33,189 @@ static void snbuf_pkt_init(struct rte_mempool *mp, void *opaque_arg,
 	struct snbuf *snb;
 	struct snbuf_immutable *immutable;
 
+	const uint16_t mbuf_size = SNBUF_MBUF + SNBUF_RESERVE;
+	phys_addr_t paddr = rte_mempool_virt2phy(mp, _m);
+
 	snb = _m;
 	immutable = (struct snbuf_immutable *)&snb->immutable;
 
-	rte_pktmbuf_init(mp, NULL, _m, i);
-
-	memset(snb->_reserve, 0, SNBUF_RESERVE);
+	/* Same as rte_pktmbuf_init(), except that it does not zero the whole
+	 * object: the headroom and data area are never touched here, 
+	 * which cuts the memory traffic of pool population by ~5x */
+	memset(snb, 0, mbuf_size);
+
+	snb->mbuf.priv_size = SNBUF_RESERVE;
+	snb->mbuf.buf_addr = (char *)snb + mbuf_size;
+	snb->mbuf.buf_physaddr = paddr + mbuf_size;
+	snb->mbuf.buf_len = mp->elt_size - mbuf_size;
+	snb->mbuf.data_off = RTE_MIN(RTE_PKTMBUF_HEADROOM, snb->mbuf.buf_len);
+	snb->mbuf.pool = mp;
+	snb->mbuf.nb_segs = 1;
+	snb->mbuf.port = 0xff;
+	rte_mbuf_refcnt_set(&snb->mbuf, 1);
 
 	immutable->vaddr = snb;
-	immutable->paddr = rte_mempool_virt2phy(mp, snb);
+	immutable->paddr = paddr;
 	immutable->sid = (uint32_t)(uint64_t)opaque_arg;
 	immutable->index = i;
 
 	snb->simple = 1;
 }
 
-static void init_mempool_socket(int sid)
+struct pkt_init_arg {
+	struct rte_mempool *mp;
+	int sid;
+};
+
+static void snbuf_pkt_init_iter(void *_arg, void *obj_start,
+		void *obj_end, uint32_t i)
+{
+	struct pkt_init_arg *arg = _arg;
+
+	snbuf_pkt_init(arg->mp, (void *)(int64_t)arg->sid,
+			(char *)obj_start + arg->mp->header_size, i);
+}
+
+/* rte_mempool_create() holds RTE_EAL_MEMPOOL_RWLOCK, across obj_init for
+ * every object too. The pool is created without obj_init, and the objects
+ * are initialized afterwards, with the same walk as its mempool_populate(),
+ * so that the pools of different sockets are populated in parallel. */
+static void populate_mempool(struct rte_mempool *mp, int sid)
+{
+	struct pkt_init_arg arg = {.mp = mp, .sid = sid};
+
+	rte_mempool_obj_iter((void *)mp->elt_va_start, mp->size,
+			mp->header_size + mp->elt_size + mp->trailer_size, 1,
+			mp->elt_pa, mp->pg_num, mp->pg_shift,
+			snbuf_pkt_init_iter, &arg);
+}
+
+/* the number of packets tried first, and the minimum */
+static const int pool_size[SNB_NUM_CLASSES][2] = {
+	[SNB_CLASS_SMALL] = {131072, 16384},
+	[SNB_CLASS_FULL] = {524288, 16384},
+};
+
+/* The time spent in rte_mempool_create() is added to create_cycles */
+static void init_mempool_socket(int sid, int cls, uint64_t *create_cycles)
 {
 	struct rte_pktmbuf_pool_private pool_priv;
 	char name[256];
 
-	const int initial_try = 524288;
-	const int minimum_try = 16384;
+	const int initial_try = pool_size[cls][0];
+	const int minimum_try = pool_size[cls][1];
 	int current_try = initial_try;
+	uint64_t start;
+
+	/* small snbufs are truncated at the end of _data */
+	const int obj_size = sizeof(struct snbuf) - SNBUF_DATA + 
+			snb_class_size(cls);
 
-	pool_priv.mbuf_data_room_size = SNBUF_HEADROOM + SNBUF_DATA;
+	pool_priv.mbuf_data_room_size = SNBUF_HEADROOM + snb_class_size(cls);
 	pool_priv.mbuf_priv_size = SNBUF_RESERVE;
 
 again:
-	sprintf(name, "pframe%d_%dk", sid, (current_try + 1) / 1024);
+	if (cls == SNB_CLASS_FULL)
+		sprintf(name, "pframe%d_%dk", sid, (current_try + 1) / 1024);
+	else
+		sprintf(name, "pframe%d_%dk_%d", sid, (current_try + 1) / 1024,
+				snb_class_size(cls));
+
+	start = rdtsc();
 
 	/* 2^n - 1 is optimal according to the DPDK manual */
-	pframe_pool[sid] = rte_mempool_create(name, 
+	pframe_pool[cls][sid] = rte_mempool_create(name, 
 			current_try - 1, 
-			sizeof(struct snbuf),
+			obj_size,
 			NUM_MEMPOOL_CACHE, 
 			sizeof(struct rte_pktmbuf_pool_private),
 			rte_pktmbuf_pool_init, &pool_priv,
-			snbuf_pkt_init, (void *)(int64_t)sid, 
+			NULL, NULL,
 			sid, 0);
 
-	if (!pframe_pool[sid]) {
-		log_warn("pframe allocation (%d pkts) failure on node %d: %s\n",
-				current_try - 1, sid, rte_strerror(rte_errno));
+	*create_cycles += rdtsc() - start;
+
+	if (!pframe_pool[cls][sid]) {
+		log_warn("pframe allocation (%d pkts, %d bytes) failure "
+				"on node %d: %s\n", current_try - 1, 
+				snb_class_size(cls), sid, 
+				rte_strerror(rte_errno));
 		if (current_try > minimum_try) {
 			current_try /= 2;
 			goto again;
 		}
 
+		/* the full-sized class is mandatory */
+		if (cls != SNB_CLASS_FULL) {
+			log_warn("No %d-byte packet buffers on socket %d\n",
+					snb_class_size(cls), sid);
+			return;
+		}
+
 		log_crit("Packet buffer allocation failed on socket %d\n", sid);
 		exit(EXIT_FAILURE);
 	}
 
-	log_info("%d packet buffers allocated on socket %d\n", 
-			current_try - 1, sid);
+	populate_mempool(pframe_pool[cls][sid], sid);
+
+	log_info("%d packet buffers (%d bytes) allocated on socket %d\n", 
+			current_try - 1, snb_class_size(cls), sid);
 
 	if (global_opts.debug_mode)
-		rte_mempool_dump(stdout, pframe_pool[sid]);
+		rte_mempool_dump(stdout, pframe_pool[cls][sid]);
 }
 
 static void init_templates(void)
 {
 	int i;
 
-	for (i = 0; i < RTE_MAX_NUMA_NODES; i++) {
-		struct rte_mbuf *mbuf;
+	for (int cls = 0; cls < SNB_NUM_CLASSES; cls++) {
+		for (i = 0; i < RTE_MAX_NUMA_NODES; i++) {
+			struct rte_mbuf *mbuf;
 
-		if (!pframe_pool[i])
-			continue;
+			if (!pframe_pool[cls][i])
+				continue;
 
-		mbuf = rte_pktmbuf_alloc(pframe_pool[i]);
-		pframe_template = *mbuf;
-		rte_pktmbuf_free(mbuf);
+			mbuf = rte_pktmbuf_alloc(pframe_pool[cls][i]);
+			pframe_template[cls] = *mbuf;
+			rte_pktmbuf_free(mbuf);
+		}
 	}
 }
 
+struct mempool_init_arg {
+	pthread_t thread;
+	int sid;
+	uint64_t cycles;
+	uint64_t create_cycles;		/* serialized by DPDK */
+};
+
+static void *init_mempool_thread(void *_arg)
+{
+	struct mempool_init_arg *arg = _arg;
+	uint64_t start = rdtsc();
+
+	arg->create_cycles = 0;
+
+	/* the full-sized class first, for its memory */
+	for (int cls = SNB_CLASS_FULL; cls >= 0; cls--)
+		init_mempool_socket(arg->sid, cls, &arg->create_cycles);
+
+	arg->cycles = rdtsc() - start;
+
+	return NULL;
+}
+
+/* Most of the time goes to snbuf_pkt_init() for every object, 
+ * so the pools of different sockets are populated in parallel
+ * (see populate_mempool()). The per-socket log shows how much of it
+ * was spent in rte_mempool_create(), which does not run in parallel. */
 void init_mempool(void)
 {
 	int initialized[RTE_MAX_NUMA_NODES];
+	struct mempool_init_arg args[RTE_MAX_NUMA_NODES];
+	int num_sockets = 0;
+	uint64_t start = rdtsc();
 
 	int i;
 
@@ -119,12 +233,38 @@ void init_mempool(void)
 		int sid = rte_lcore_to_socket_id(i);
 
 		if (!initialized[sid]) {
-			init_mempool_socket(sid);
+			args[num_sockets++].sid = sid;
 			initialized[sid] = 1;
 		}
 	}
 
+	if (num_sockets == 1) {
+		init_mempool_thread(&args[0]);
+	} else {
+		for (i = 0; i < num_sockets; i++) {
+			int ret = pthread_create(&args[i].thread, NULL, 
+					init_mempool_thread, &args[i]);
+			if (ret) {
+				errno = ret;
+				log_perr("pthread_create(mempool)");
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		for (i = 0; i < num_sockets; i++)
+			pthread_join(args[i].thread, NULL);
+	}
+
+	for (i = 0; i < num_sockets; i++)
+		log_info("Packet buffers on socket %d: %.1f ms "
+				"(%.1f ms in rte_mempool_create)\n",
+				args[i].sid, tsc_to_us(args[i].cycles) / 1000,
+				tsc_to_us(args[i].create_cycles) / 1000);
+
 	init_templates();
+
+	log_info("Packet buffer initialization: %.1f ms\n", 
+			tsc_to_us(rdtsc() - start) / 1000);
 }
 
 void close_mempool(void)
@@ -134,26 +274,504 @@ void close_mempool(void)
 
 struct rte_mempool *get_pframe_pool()
 {
-	return pframe_pool[ctx.socket];
+	return pframe_pool[SNB_CLASS_FULL][ctx.socket];
 }
 
 struct rte_mempool *get_pframe_pool_socket(int socket)
 {
-	return pframe_pool[socket];
+	return pframe_pool[SNB_CLASS_FULL][socket];
+}
+
+struct rte_mempool *get_pframe_pool_class(int socket, int cls)
+{
+	return pframe_pool[cls][socket];
+}
+
+struct rte_mempool *get_pframe_pool_fit(int socket, uint16_t len)
+{
+	for (int cls = 0; cls < SNB_CLASS_FULL; cls++)
+		if (len <= snb_class_size(cls) && pframe_pool[cls][socket])
+			return pframe_pool[cls][socket];
+
+	return pframe_pool[SNB_CLASS_FULL][socket];
+}
+
+#define SNB_CACHE_UNIT		(SNB_CACHE_SIZE / 2)
+
+const struct snb_pool_stats *get_pframe_pool_stats(int socket, int cls)
+{
+	if (!pframe_pool[cls][socket])
+		return NULL;
+
+	return &pool_stats[cls][socket];
+}
+
+/* written by the master, read by workers in the slow path */
+static struct snb_admission admission;
+
+int set_snb_admission(const struct snb_admission *adm)
+{
+	if (adm->reserve_pct < 0 || adm->reserve_pct > 100 ||
+			adm->watermark_pct < 0 || adm->watermark_pct > 100)
+		return -EINVAL;
+
+	admission = *adm;
+
+	return 0;
+}
+
+const struct snb_admission *get_snb_admission(void)
+{
+	return &admission;
+}
+
+enum admission_verdict {
+	ADMIT = 0,
+	ADMIT_SHORT,	/* take no more than asked */
+	DENY,
+};
+
+/* cnt snbufs from the pool, by the running task */
+static enum admission_verdict admit(struct rte_mempool *pool, int cnt)
+{
+	const struct task *t = ctx.current_task;
+	uint32_t avail;
+
+	if (!admission.reserve_pct && !admission.watermark_pct)
+		return ADMIT;
+
+	/* the master, timers, and high-priority TCs */
+	if (!t || !t->c || t->c->settings.priority >= admission.min_priority)
+		return ADMIT;
+
+	avail = rte_mempool_count(pool);
+
+	if (avail < cnt + (uint64_t)pool->size * admission.reserve_pct / 100)
+		return DENY;
+
+	if ((uint64_t)(pool->size - avail) * 100 > 
+			(uint64_t)pool->size * admission.watermark_pct)
+		return ADMIT_SHORT;
+
+	return ADMIT;
+}
+
+/* it only runs once per SNB_CACHE_UNIT allocations, so the cost of
+ * rte_mempool_free_count() (which walks the per-lcore caches) is amortized.
+ * failed is the number of snbufs that could not be allocated */
+static void update_pool_stats(int cls, struct rte_mempool *pool, int failed)
+{
+	struct snb_pool_stats *st = &pool_stats[cls][pool->socket_id];
+	uint32_t in_use = rte_mempool_free_count(pool);
+
+	if (in_use > st->max_in_use)
+		st->max_in_use = in_use;
+
+	if (failed) {
+		ctx.snb_cache[cls].cnt_fail++;
+		ctx.drops[DROP_NO_MBUF] += failed;
+		st->alloc_fails++;
+	}
+}
+
+int __snb_cache_get_slow(int cls, snb_array_t snbs, int cnt)
+{
+	struct snb_cache *c = &ctx.snb_cache[cls];
+	struct rte_mempool *pool = ctx.pframe_pools[cls];
+	struct snb_pool_stats *st = &pool_stats[cls][pool->socket_id];
+	enum admission_verdict verdict;
+
+	c->cnt_refill++;
+
+	verdict = admit(pool, cnt);
+
+	if (unlikely(verdict == DENY)) {
+		st->alloc_denied++;
+		ctx.current_task->c->stats.cnt_alloc_denied++;
+		update_pool_stats(cls, pool, cnt);
+		return -ENOENT;
+	}
+
+	if (unlikely(verdict == ADMIT_SHORT))
+		st->alloc_short++;
+
+	/* too big for the cache */
+	if (cnt > SNB_CACHE_UNIT) {
+		int ret = rte_mempool_get_bulk(pool, (void **)snbs, cnt);
+
+		update_pool_stats(cls, pool, ret ? cnt : 0);
+		return ret;
+	}
+
+	/* c->cnt < cnt <= SNB_CACHE_UNIT, so there is room for a unit */
+	if (verdict != ADMIT_SHORT && rte_mempool_get_bulk(pool, 
+				(void **)&c->bufs[c->cnt], SNB_CACHE_UNIT) == 0)
+		c->cnt += SNB_CACHE_UNIT;
+	else if (rte_mempool_get_bulk(pool,
+				(void **)&c->bufs[c->cnt], cnt - c->cnt) == 0)
+		c->cnt = cnt;	/* the pool is running low */
+	else {
+		update_pool_stats(cls, pool, cnt);
+		return -ENOENT;
+	}
+
+	update_pool_stats(cls, pool, 0);
+
+	c->cnt -= cnt;
+	rte_memcpy((void *)snbs, (void *)&c->bufs[c->cnt], 
+			cnt * sizeof(struct snbuf *));
+
+	return 0;
+}
+
+void __snb_cache_put_slow(int cls, snb_array_t snbs, int cnt)
+{
+	struct snb_cache *c = &ctx.snb_cache[cls];
+	struct rte_mempool *pool = ctx.pframe_pools[cls];
+
+	c->cnt_spill++;
+
+	if (cnt > SNB_CACHE_UNIT) {
+		rte_mempool_put_bulk(pool, (void **)snbs, cnt);
+		return;
+	}
+
+	/* spill the bottom (coldest) unit, and keep the hot ones on top */
+	c->cnt -= SNB_CACHE_UNIT;
+	rte_mempool_put_bulk(pool, (void **)c->bufs, 
+			SNB_CACHE_UNIT);
+	memmove(c->bufs, &c->bufs[SNB_CACHE_UNIT], 
+			c->cnt * sizeof(struct snbuf *));
+
+	rte_memcpy((void *)&c->bufs[c->cnt], (void *)snbs, 
+			cnt * sizeof(struct snbuf *));
+	c->cnt += cnt;
+}
+
+void snb_cache_flush(void)
+{
+	for (int cls = 0; cls < SNB_NUM_CLASSES; cls++) {
+		struct snb_cache *c = &ctx.snb_cache[cls];
+
+		if (c->cnt)
+			rte_mempool_put_bulk(ctx.pframe_pools[cls], 
+					(void **)c->bufs, c->cnt);
+
+		c->cnt = 0;
+	}
+}
+
+const void *__snb_read_chain(struct snbuf *snb, uint32_t off, uint32_t len,
+		void *buf)
+{
+	const struct rte_mbuf *seg = &snb->mbuf;
+	char *dst = buf;
+
+	if (off + len > snb_total_len(snb))
+		return NULL;
+
+	while (off >= seg->data_len) {
+		off -= seg->data_len;
+		seg = seg->next;
+	}
+
+	/* contiguous in a later segment */
+	if (off + len <= seg->data_len)
+		return rte_pktmbuf_mtod(seg, char *) + off;
+
+	while (len > 0) {
+		uint32_t n = RTE_MIN(len, (uint32_t)seg->data_len - off);
+
+		rte_memcpy(dst, rte_pktmbuf_mtod(seg, char *) + off, n);
+		dst += n;
+		len -= n;
+		off = 0;
+		seg = seg->next;
+	}
+
+	return buf;
+}
+
+struct snbuf *__snb_copy_chain(struct snbuf *src)
+{
+	struct rte_mbuf *head = NULL;
+	struct rte_mbuf *tail = NULL;
+
+	for (struct rte_mbuf *seg = &src->mbuf; seg; seg = seg->next) {
+		struct rte_mbuf *copy;
+
+		copy = rte_pktmbuf_alloc(seg->pool);
+		if (!copy) {
+			if (head)
+				rte_pktmbuf_free(head);
+			return NULL;
+		}
+
+		copy->data_len = seg->data_len;
+		rte_memcpy(rte_pktmbuf_mtod(copy, void *),
+				rte_pktmbuf_mtod(seg, void *), seg->data_len);
+
+		if (!head) {
+			head = copy;
+			head->pkt_len = src->mbuf.pkt_len;
+			head->nb_segs = 1;
+		} else {
+			tail->next = copy;
+			head->nb_segs++;
+		}
+
+		tail = copy;
+	}
+
+	return (struct snbuf *)head;
+}
+
+/* indirect snbufs do not use their own data area, so the small class is
+ * good enough */
+static struct rte_mempool *indirect_pool(void)
+{
+	return ctx.pframe_pools[snb_class_fit(1)];
+}
+
+static void copy_pkt_info(struct snbuf *dst, const struct snbuf *src)
+{
+	dst->mbuf.ol_flags = src->mbuf.ol_flags;
+	dst->mbuf.packet_type = src->mbuf.packet_type;
+	dst->mbuf.vlan_tci = src->mbuf.vlan_tci;
+	dst->mbuf.vlan_tci_outer = src->mbuf.vlan_tci_outer;
+	dst->mbuf.hash = src->mbuf.hash;
+	dst->mbuf.tx_offload = src->mbuf.tx_offload;
+	dst->mbuf.port = src->mbuf.port;
+
+	rte_memcpy(dst->_metadata, src->_metadata, SNBUF_METADATA);
+}
+
+struct snbuf *snb_clone(struct snbuf *src)
+{
+	struct snbuf *dst;
+
+	/* the offload fields are copied by DPDK */
+	dst = (struct snbuf *)rte_pktmbuf_clone(&src->mbuf, indirect_pool());
+	if (!dst)
+		return NULL;
+
+	rte_memcpy(dst->_metadata, src->_metadata, SNBUF_METADATA);
+	dst->simple = 0;
+	src->simple = 0;
+
+	return dst;
+}
+
+struct snbuf *snb_clone_hdr(struct snbuf *src, uint16_t hdr_len)
+{
+	struct rte_mbuf *rest = NULL;
+	struct snbuf *hdr;
+
+	if (hdr_len > snb_head_len(src))
+		hdr_len = snb_head_len(src);
+
+	hdr = __snb_alloc_pool(ctx.pframe_pools[snb_class_fit(hdr_len)]);
+	if (!hdr)
+		return NULL;
+
+	/* the rest of the packet, if any */
+	if (hdr_len < snb_head_len(src)) {
+		rest = rte_pktmbuf_clone(&src->mbuf, indirect_pool());
+		if (rest) {
+			rest->data_off += hdr_len;
+			rest->data_len -= hdr_len;
+		}
+	} else if (src->mbuf.next) {
+		rest = rte_pktmbuf_clone(src->mbuf.next, indirect_pool());
+	} else {
+		/* a full copy */
+		rest = NULL;
+		goto copy_hdr;
+	}
+
+	if (!rest) {
+		snb_free(hdr);
+		return NULL;
+	}
+
+	rest->pkt_len = snb_total_len(src) - hdr_len;
+
+copy_hdr:
+	copy_pkt_info(hdr, src);
+
+	rte_memcpy(snb_head_data(hdr), snb_head_data(src), hdr_len);
+	hdr->mbuf.data_len = hdr_len;
+	hdr->mbuf.pkt_len = snb_total_len(src);
+
+	if (rest) {
+		hdr->mbuf.next = rest;
+		hdr->mbuf.nb_segs = 1 + rest->nb_segs;
+		hdr->simple = 0;
+		src->simple = 0;
+	} else
+		hdr->simple = 1;
+
+	return hdr;
+}
+
+uint64_t snb_tx_offload_sw_mask(uint32_t capa)
+{
+	const uint32_t l4_capa = DEV_TX_OFFLOAD_TCP_CKSUM | 
+			DEV_TX_OFFLOAD_UDP_CKSUM;
+
+	uint64_t mask = 0;
+
+	if (!(capa & DEV_TX_OFFLOAD_VLAN_INSERT))
+		mask |= PKT_TX_VLAN_PKT;
+
+	if (!(capa & DEV_TX_OFFLOAD_IPV4_CKSUM))
+		mask |= PKT_TX_IP_CKSUM;
+
+	if ((capa & l4_capa) != l4_capa)
+		mask |= PKT_TX_L4_MASK;
+
+	if (!(capa & DEV_TX_OFFLOAD_TCP_TSO))
+		mask |= PKT_TX_TCP_SEG;
+
+	/* without tunnel support, any offload of a tunneled packet */
+	if (!(capa & DEV_TX_OFFLOAD_OUTER_IPV4_CKSUM))
+		mask |= PKT_TX_OUTER_IP_CKSUM | PKT_TX_OUTER_IPV4 | 
+				PKT_TX_OUTER_IPV6;
+
+	return mask;
+}
+
+static uint16_t l4_sw_cksum(const char *l3, const char *l4, uint64_t flags)
+{
+	if (flags & PKT_TX_IPV4)
+		return rte_ipv4_udptcp_cksum((const struct ipv4_hdr *)l3, l4);
+	else
+		return rte_ipv6_udptcp_cksum((const struct ipv6_hdr *)l3, l4);
+}
+
+int snb_tx_offload_sw(struct snbuf *snb, uint32_t capa)
+{
+	struct rte_mbuf *mbuf = &snb->mbuf;
+
+	uint64_t flags = mbuf->ol_flags;
+
+	int tunneled = !!(flags & (PKT_TX_OUTER_IPV4 | PKT_TX_OUTER_IPV6));
+	int outer_len = tunneled ? mbuf->outer_l2_len + mbuf->outer_l3_len : 0;
+
+	char *l3 = snb_head_data(snb) + outer_len + mbuf->l2_len;
+	char *l4 = l3 + mbuf->l3_len;
+
+	uint16_t *l4_cksum = NULL;
+	int l4_hw = 0;
+
+	/* NICs that do not know the outer headers would look for the inner
+	 * headers at l2_len. Everything but VLAN insertion is done here. */
+	if (tunneled && !(capa & DEV_TX_OFFLOAD_OUTER_IPV4_CKSUM))
+		capa &= DEV_TX_OFFLOAD_VLAN_INSERT;
+
+	if ((flags & PKT_TX_L4_MASK) == PKT_TX_TCP_CKSUM) {
+		l4_cksum = (uint16_t *)(l4 + offsetof(struct tcp_hdr, cksum));
+		l4_hw = !!(capa & DEV_TX_OFFLOAD_TCP_CKSUM);
+	} else if ((flags & PKT_TX_L4_MASK) == PKT_TX_UDP_CKSUM) {
+		l4_cksum = (uint16_t *)(l4 + 
+				offsetof(struct udp_hdr, dgram_cksum));
+		l4_hw = !!(capa & DEV_TX_OFFLOAD_UDP_CKSUM);
+	}
+
+	if (flags & PKT_TX_TCP_SEG) {
+		if (capa & DEV_TX_OFFLOAD_TCP_TSO) {
+			/* TCP checksums are done per segment */
+			l4_hw = 1;
+		} else {
+			uint32_t hdr_len = outer_len + mbuf->l2_len + 
+					mbuf->l3_len + mbuf->l4_len;
+
+			/* no software segmentation. 
+			 * Only good if the payload fits in a single segment */
+			if (snb_total_len(snb) > hdr_len + mbuf->tso_segsz)
+				return -EMSGSIZE;
+
+			flags &= ~PKT_TX_TCP_SEG;
+
+			/* now the length must be included */
+			if (l4_hw)
+				*l4_cksum = __snb_phdr_cksum(l3, flags);
+		}
+	}
+
+	if (l4_cksum && !l4_hw) {
+		/* the payload must be contiguous */
+		if (!snb_is_linear(snb))
+			return -ENOTSUP;
+
+		*l4_cksum = 0;
+		*l4_cksum = l4_sw_cksum(l3, l4, flags);
+		flags &= ~PKT_TX_L4_MASK;
+	}
+
+	if ((flags & PKT_TX_IP_CKSUM) && !(capa & DEV_TX_OFFLOAD_IPV4_CKSUM)) {
+		struct ipv4_hdr *ip = (struct ipv4_hdr *)l3;
+
+		ip->hdr_checksum = 0;
+		ip->hdr_checksum = rte_ipv4_cksum(ip);
+		flags &= ~PKT_TX_IP_CKSUM;
+	}
+
+	if ((flags & PKT_TX_OUTER_IP_CKSUM) && 
+			!(capa & DEV_TX_OFFLOAD_OUTER_IPV4_CKSUM)) {
+		struct ipv4_hdr *ip = (struct ipv4_hdr *)
+				(snb_head_data(snb) + mbuf->outer_l2_len);
+
+		ip->hdr_checksum = 0;
+		ip->hdr_checksum = rte_ipv4_cksum(ip);
+		flags &= ~PKT_TX_OUTER_IP_CKSUM;
+	}
+
+	/* done last, since it moves the L3 header */
+	if ((flags & PKT_TX_VLAN_PKT) && !(capa & DEV_TX_OFFLOAD_VLAN_INSERT)) {
+		char *p = snb_prepend(snb, 4);
+		uint16_t *tag;
+
+		if (!p)
+			return -ENOSPC;
+
+		memmove(p, p + 4, 2 * ETHER_ADDR_LEN);
+
+		tag = (uint16_t *)(p + 2 * ETHER_ADDR_LEN);
+		tag[0] = rte_cpu_to_be_16(0x8100);
+		tag[1] = rte_cpu_to_be_16(mbuf->vlan_tci);
+
+		if (tunneled)
+			mbuf->outer_l2_len += 4;
+		else
+			mbuf->l2_len += 4;
+		flags &= ~PKT_TX_VLAN_PKT;
+	}
+
+	if (!(flags & SNB_TX_OFFLOAD_INNER))
+		flags &= ~(PKT_TX_IPV4 | PKT_TX_IPV6);
+
+	if (!(flags & (SNB_TX_OFFLOAD_INNER | PKT_TX_OUTER_IP_CKSUM)))
+		flags &= ~(PKT_TX_OUTER_IPV4 | PKT_TX_OUTER_IPV6);
+
+	mbuf->ol_flags = flags;
+
+	return 0;
 }
 
 struct snbuf *paddr_to_snb(phys_addr_t paddr)
 {
 	struct snbuf *ret = NULL;
 
-	for (int i = 0; i < RTE_MAX_NUMA_NODES; i++) {
+	for (int i = 0; i < SNB_NUM_CLASSES * RTE_MAX_NUMA_NODES; i++) {
 		struct rte_mempool *pool;
 
 		phys_addr_t pg_start;
 		phys_addr_t pg_end;
 		uintptr_t size;
 
-		pool = pframe_pool[i];
+		/* all classes of all sockets */
+		pool = ((struct rte_mempool **)pframe_pool)[i];
 		if (!pool)
 			continue;
 
@@ -198,8 +816,10 @@ void snb_dump(FILE *file, struct snbuf *pkt)
 		fprintf(file, "%p(", mbuf->pool);
 
 		for (i = 0; i < RTE_MAX_NUMA_NODES; i++) {
-			if (pframe_pool[i] == mbuf->pool)
-				fprintf(file, "P%d", i);
+			for (int cls = 0; cls < SNB_NUM_CLASSES; cls++)
+				if (pframe_pool[cls][i] == mbuf->pool)
+					fprintf(file, "P%d/%d", i, 
+						snb_class_size(cls));
 		}
 		fprintf(file, ") ");
 	}
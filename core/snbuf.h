@@ -5,8 +5,11 @@
 
 #include <rte_config.h>
 #include <rte_mbuf.h>
+#include <rte_prefetch.h>
 #include <rte_ether.h>
 #include <rte_ip.h>
+#include <rte_tcp.h>
+#include <rte_udp.h>
 
 #include <sn.h>
 
@@ -39,6 +42,14 @@ ct_assert(SNBUF_HEADROOM == RTE_PKTMBUF_HEADROOM);
  *  * When packets are newly allocated, the data should be filled from _data.
  *  * The packet data may reside in the _headroom + _data area, 
  *    but its size must not exceed 1536 (SNBUF_DATA) when passed to a port.
+ *    Larger (e.g., jumbo) frames are chains of snbufs, one segment each.
+ *
+ * Size classes:
+ *  Besides the full-sized snbufs above (SNB_CLASS_FULL), there is a pool of
+ *  small snbufs (SNB_CLASS_SMALL) with only SNBUF_SMALL_DATA bytes of _data,
+ *  so that more small packets fit in the LLC. The layout is the same, 
+ *  except that the object ends early: never access _data beyond 
+ *  snb_capacity() bytes from the head data.
  */
 struct snbuf {
 	union {
@@ -77,9 +88,20 @@ struct snbuf {
 					 * following conditions are met:
 					 *  1. refcnt == 1
 					 *  2. direct mbuf
-					 *  3. linear (non-chained) */
+					 *  3. linear (non-chained)
+					 * Cleared by snb_ref() and snb_clone*(),
+					 * and set again by snb_free() of the
+					 * last reference. Never set for a
+					 * shared snbuf, but it may be stale
+					 * (0) for buffers freed by DPDK.
+					 * snb_is_simple() is exact. */
 					uint8_t simple;
 
+					/* TSC at the last latency probe
+					 * (struct latency_hook). Valid only
+					 * if SNB_LATENCY_TAGGED is set */
+					uint64_t latency_tsc;
+
 					/* user-defined dynamic fields */
 					char _metadata_buf[0]	__ymm_aligned;
 				};
@@ -96,6 +118,18 @@ struct snbuf {
 
 typedef struct snbuf * restrict * restrict snb_array_t;
 
+/* In ol_flags, set by latency probes. The bit is not used by DPDK (RX flags
+ * are in the low bits, TX flags in the high bits), and ol_flags is reset
+ * whenever a buffer is allocated or received, so stale tags do not outlive
+ * the packet. */
+#define SNB_LATENCY_TAGGED	(1ULL << 32)
+
+/* In ol_flags too, set by Rewrite (incremental mode) along with the tag in
+ * the headroom, which alone would survive the reuse of the buffer. Being
+ * reset on allocation, it only marks packets that have not been freed
+ * since, never recycled ones. */
+#define SNB_REWRITE_TAGGED	(1ULL << 33)
+
 static inline char *snb_head_data(struct snbuf *snb)
 {
 	return rte_pktmbuf_mtod(&snb->mbuf, char *);
@@ -123,7 +157,69 @@ static inline int snb_is_simple(struct snbuf *snb)
 	return snb_is_linear(snb) && RTE_MBUF_DIRECT(&snb->mbuf);
 }
 
-extern struct rte_mbuf pframe_template;
+/* Chained snbufs (e.g., jumbo frames) are passed through the pipeline as is.
+ * snb_head_data() and snb_head_len() refer to the first segment only,
+ * so modules that only look at headers should check snb_head_has() or
+ * use snb_read(), rather than linearizing the packet. */
+static inline int snb_num_segs(struct snbuf *snb)
+{
+	return snb->mbuf.nb_segs;
+}
+
+/* are the first len bytes all in the first segment? */
+static inline int snb_head_has(struct snbuf *snb, uint32_t len)
+{
+	return snb_head_len(snb) >= len;
+}
+
+/* slow path of snb_read() */
+const void *__snb_read_chain(struct snbuf *snb, uint32_t off, uint32_t len,
+		void *buf);
+
+/* Returns a pointer to len bytes at offset off of the packet data.
+ * If they span multiple segments, they are copied to buf (len bytes),
+ * which is returned instead. NULL if the packet is too short. */
+static inline const void *snb_read(struct snbuf *snb, uint32_t off,
+		uint32_t len, void *buf)
+{
+	if (likely(off + len <= snb_head_len(snb)))
+		return snb_head_data(snb) + off;
+
+	return __snb_read_chain(snb, off, len, buf);
+}
+
+enum {
+	SNB_CLASS_SMALL = 0,
+	SNB_CLASS_FULL = SNB_NUM_CLASSES - 1,
+};
+
+#define SNBUF_SMALL_DATA	512
+
+ct_assert(SNBUF_SMALL_DATA <= SNBUF_DATA);
+
+/* the data size of each class */
+static inline uint16_t snb_class_size(int cls)
+{
+	return (cls == SNB_CLASS_SMALL) ? SNBUF_SMALL_DATA : SNBUF_DATA;
+}
+
+/* The smallest available class that can hold len bytes of data.
+ * len 0 means a blank buffer to be filled (e.g., by RX), of the full size */
+static inline int snb_class_fit(uint16_t len)
+{
+	if (len && len <= SNBUF_SMALL_DATA && ctx.pframe_pools[SNB_CLASS_SMALL])
+		return SNB_CLASS_SMALL;
+
+	return SNB_CLASS_FULL;
+}
+
+/* how many bytes can be written from the head data */
+static inline int snb_capacity(struct snbuf *snb)
+{
+	return snb->mbuf.buf_len - snb->mbuf.data_off;
+}
+
+extern struct rte_mbuf pframe_template[SNB_NUM_CLASSES];
 
 static inline struct snbuf *__snb_alloc()
 {
@@ -148,18 +244,136 @@ static inline struct snbuf *snb_alloc()
 
 static inline void snb_free(struct snbuf *snb)
 {
-	rte_pktmbuf_free((struct rte_mbuf *)snb);
+	struct rte_mbuf *mbuf = &snb->mbuf;
+
+	/* the last reference: the buffer(s) will be simple when reused */
+	if (unlikely(!snb->simple) && rte_mbuf_refcnt_read(mbuf) == 1) {
+		snb->simple = 1;
+
+		if (!RTE_MBUF_DIRECT(mbuf)) {
+			struct snbuf *direct;
+
+			direct = (struct snbuf *)rte_mbuf_from_indirect(mbuf);
+			if (rte_mbuf_refcnt_read(&direct->mbuf) == 1)
+				direct->simple = 1;
+		}
+	}
+
+	rte_pktmbuf_free(mbuf);
+}
+
+/* Usage of a mempool, by all threads on the socket. Updated without
+ * synchronization in the slow path, so it is approximate */
+struct snb_pool_stats {
+	uint32_t max_in_use;	/* high watermark, sampled at cache refills */
+	uint64_t alloc_fails;	/* including the denied ones below */
+	uint64_t alloc_denied;	/* by admission control */
+	uint64_t alloc_short;	/* refills cut short by admission control */
+};
+
+/* Admission control of the pools, so that low-priority traffic cannot 
+ * take the buffers that high-priority traffic needs under overload.
+ * It applies to software allocations (snb_alloc_bulk(), e.g., vport RX),
+ * made by tasks of TCs with a priority below min_priority. PMD RX refills
+ * its rings directly from the mempool, so it is never denied: it is what
+ * the reserve is for. Once more than watermark_pct of a pool is in use,
+ * low-priority refills of the per-thread cache take only what is asked 
+ * (short), and they are denied altogether if that would leave less than
+ * reserve_pct of the pool available. Denials count as DROP_NO_MBUF and in 
+ * the stats of the TC. Only checked in __snb_cache_get_slow(), so it adds 
+ * nothing to the fast path. All zeroes (the default) disable it. */
+struct snb_admission {
+	int reserve_pct;
+	int watermark_pct;
+	int32_t min_priority;
+};
+
+/* returns 0 or -EINVAL */
+int set_snb_admission(const struct snb_admission *adm);
+const struct snb_admission *get_snb_admission(void);
+
+/* NULL if the class is not available on the socket */
+const struct snb_pool_stats *get_pframe_pool_stats(int socket, int cls);
+
+/* slow paths of snb_cache_get() and snb_cache_put() */
+int __snb_cache_get_slow(int cls, snb_array_t snbs, int cnt);
+void __snb_cache_put_slow(int cls, snb_array_t snbs, int cnt);
+
+/* return all cached snbufs of this thread to the mempools */
+void snb_cache_flush(void);
+
+/* get cnt snbufs from ctx.pframe_pools[cls], through the per-thread cache.
+ * Returns 0 on success, or -ENOENT (no snbuf is taken) */
+static inline int snb_cache_get(int cls, snb_array_t snbs, int cnt)
+{
+	struct snb_cache *c = &ctx.snb_cache[cls];
+
+	c->cnt_alloc++;
+
+	if (unlikely(c->cnt < cnt))
+		return __snb_cache_get_slow(cls, snbs, cnt);
+
+	c->cnt -= cnt;
+	rte_memcpy((void *)snbs, (void *)&c->bufs[c->cnt], 
+			cnt * sizeof(struct snbuf *));
+
+	return 0;
+}
+
+/* snbufs must be simple, and from ctx.pframe_pools[cls] */
+static inline void snb_cache_put(int cls, snb_array_t snbs, int cnt)
+{
+	struct snb_cache *c = &ctx.snb_cache[cls];
+
+	c->cnt_free++;
+
+	if (unlikely(c->cnt + cnt > SNB_CACHE_SIZE)) {
+		__snb_cache_put_slow(cls, snbs, cnt);
+		return;
+	}
+
+	rte_memcpy((void *)&c->bufs[c->cnt], (void *)snbs, 
+			cnt * sizeof(struct snbuf *));
+	c->cnt += cnt;
+}
+
+/* which class (of this thread) does the pool belong to? -1 if none */
+static inline int snb_pool_class(const struct rte_mempool *pool)
+{
+	if (likely(pool == ctx.pframe_pool))
+		return SNB_CLASS_FULL;
+
+	for (int cls = 0; cls < SNB_CLASS_FULL; cls++)
+		if (pool == ctx.pframe_pools[cls])
+			return cls;
+
+	return -1;
+}
+
+/* snbufs must be simple, and from the same pool */
+static inline void __snb_free_bulk_simple(struct rte_mempool *pool,
+		snb_array_t snbs, int cnt)
+{
+	int cls = snb_pool_class(pool);
+
+	/* NOTE: it seems that zeroing the refcnt of mbufs is not necessary.
+	 *   (allocators will reset them) */
+	if (likely(cls >= 0))
+		snb_cache_put(cls, snbs, cnt);
+	else
+		rte_mempool_put_bulk(pool, (void **)snbs, cnt);
 }
 
 #if __AVX__
 #  include "snbuf_avx.h"
 #else
+/* the size class is chosen with snb_class_fit(len) */
 static inline int snb_alloc_bulk(snb_array_t snbs, int cnt, uint16_t len)
 {
 	int ret;
 	int i;
 
-	ret = rte_mempool_get_bulk(ctx.pframe_pool, (void **)snbs, cnt);
+	ret = snb_cache_get(snb_class_fit(len), snbs, cnt);
 	if (ret != 0)
 		return 0;
 
@@ -192,9 +406,7 @@ static inline void snb_free_bulk(snb_array_t snbs, int cnt)
 		}
 	}
 
-	/* NOTE: it seems that zeroing the refcnt of mbufs is not necessary.
-	 *   (allocators will reset them) */
-	rte_mempool_put_bulk(pool, (void **)snbs, cnt);
+	__snb_free_bulk_simple(pool, snbs, cnt);
 	return;
 
 slow_path:
@@ -244,11 +456,16 @@ static inline void snb_trim(struct snbuf *snb, uint16_t to_remove)
 	assert(ret == 0);
 }
 
+/* slow path of snb_copy() */
+struct snbuf *__snb_copy_chain(struct snbuf *src);
+
+/* deep copy. Chained snbufs are copied segment by segment */
 static inline struct snbuf *snb_copy(struct snbuf *src)
 {
 	struct snbuf *dst;
 
-	assert(snb_is_linear(src));
+	if (unlikely(!snb_is_linear(src)))
+		return __snb_copy_chain(src);
 
 	dst = __snb_alloc_pool(src->mbuf.pool);
 
@@ -259,6 +476,29 @@ static inline struct snbuf *snb_copy(struct snbuf *src)
 	return dst;
 }
 
+/* Zero-copy sharing.
+ *
+ * snb_ref() gives n more references to the same snbuf (e.g., one per output
+ * gate), to be freed separately. Since all of the users see the same mbuf,
+ * data, and metadata, none of them may modify the packet, including its
+ * length and offsets (e.g., VLANPush). Users that need to modify headers
+ * should take a snb_clone_hdr(), whose first bytes are private. */
+static inline void snb_ref(struct snbuf *snb, int n)
+{
+	snb->simple = 0;
+	rte_pktmbuf_refcnt_update(&snb->mbuf, n);
+}
+
+/* A new (indirect) snbuf chain that refers to the data of src, with a copy
+ * of the mbuf offload fields and the metadata of src. NULL if out of
+ * buffers. Only for workers. */
+struct snbuf *snb_clone(struct snbuf *src);
+
+/* Same as snb_clone(), but the first hdr_len bytes (up to the first segment)
+ * are copied into a new direct snbuf at the head of the chain, so that the
+ * headers can be modified, pushed, or popped independently of src. */
+struct snbuf *snb_clone_hdr(struct snbuf *src, uint16_t hdr_len);
+
 static inline phys_addr_t snb_seg_dma_addr(struct rte_mbuf *mbuf)
 {
 	return mbuf->buf_physaddr + mbuf->data_off;
@@ -269,9 +509,194 @@ static inline phys_addr_t snb_dma_addr(struct snbuf *snb)
 	return snb_seg_dma_addr(&snb->mbuf);
 }
 
+/* TX offloads (checksums, TSO, and VLAN insertion).
+ *
+ * Modules request them with the helpers below, which fill the offload
+ * fields of the mbuf (ol_flags, l2_len, l3_len, l4_len, tso_segsz, 
+ * and vlan_tci) as DPDK expects them. In particular, the IPv4 checksum is 
+ * zeroed and the TCP/UDP checksum field holds the pseudo-header checksum.
+ *
+ * Each port advertises what it can offload in p->tx_offload_capa 
+ * (DEV_TX_OFFLOAD_*), and PortOut does the rest in software with 
+ * snb_tx_offload_sw() before handing packets to the driver.
+ *
+ * The header lengths are taken at the time of the request, so headers
+ * must not be pushed or popped afterwards (e.g., by VLANPush), except for
+ * tunnel headers with snb_tx_offload_encap(). All headers must be in the
+ * first segment. */
+#define SNB_TX_OFFLOAD_FLAGS	(PKT_TX_VLAN_PKT | PKT_TX_IP_CKSUM | \
+		PKT_TX_L4_MASK | PKT_TX_TCP_SEG | PKT_TX_IPV4 | PKT_TX_IPV6 | \
+		PKT_TX_OUTER_IP_CKSUM | PKT_TX_OUTER_IPV4 | PKT_TX_OUTER_IPV6)
+
+/* offloads that refer to the (inner) L3/L4 headers */
+#define SNB_TX_OFFLOAD_INNER	(PKT_TX_IP_CKSUM | PKT_TX_L4_MASK | \
+		PKT_TX_TCP_SEG)
+
+/* tci is in host order */
+static inline void snb_tx_offload_vlan(struct snbuf *snb, uint16_t tci)
+{
+	snb->mbuf.vlan_tci = tci;
+	snb->mbuf.ol_flags |= PKT_TX_VLAN_PKT;
+}
+
+static inline uint16_t __snb_phdr_cksum(const char *l3, uint64_t ol_flags)
+{
+	if (ol_flags & PKT_TX_IPV4)
+		return rte_ipv4_phdr_cksum((const struct ipv4_hdr *)l3, 
+				ol_flags);
+	else
+		return rte_ipv6_phdr_cksum((const struct ipv6_hdr *)l3, 
+				ol_flags);
+}
+
+/* IPv4 header checksum (none for IPv6), and L4 checksum if l4_proto is
+ * IPPROTO_TCP or IPPROTO_UDP (0 for none) */
+static inline void snb_tx_offload_csum(struct snbuf *snb, 
+		int l2_len, int l3_len, int l4_proto)
+{
+	struct rte_mbuf *mbuf = &snb->mbuf;
+	char *l3 = snb_head_data(snb) + l2_len;
+	char *l4 = l3 + l3_len;
+
+	uint64_t flags = mbuf->ol_flags & ~(PKT_TX_IP_CKSUM | PKT_TX_L4_MASK |
+			PKT_TX_IPV4 | PKT_TX_IPV6);
+
+	mbuf->l2_len = l2_len;
+	mbuf->l3_len = l3_len;
+
+	if ((*(uint8_t *)l3 >> 4) == 4) {
+		((struct ipv4_hdr *)l3)->hdr_checksum = 0;
+		flags |= PKT_TX_IPV4 | PKT_TX_IP_CKSUM;
+	} else
+		flags |= PKT_TX_IPV6;
+
+	if (l4_proto == IPPROTO_TCP) {
+		flags |= PKT_TX_TCP_CKSUM;
+		((struct tcp_hdr *)l4)->cksum = __snb_phdr_cksum(l3, flags);
+	} else if (l4_proto == IPPROTO_UDP) {
+		flags |= PKT_TX_UDP_CKSUM;
+		((struct udp_hdr *)l4)->dgram_cksum = 
+				__snb_phdr_cksum(l3, flags);
+	}
+
+	mbuf->ol_flags = flags;
+}
+
+/* TCP segmentation into segments of mss payload bytes (implies checksums).
+ * l4_len is the length of the TCP header including options. */
+static inline void snb_tx_offload_tso(struct snbuf *snb, 
+		int l2_len, int l3_len, int l4_len, uint16_t mss)
+{
+	snb->mbuf.l4_len = l4_len;
+	snb->mbuf.tso_segsz = mss;
+
+	/* the pseudo-header checksum must not include the length */
+	snb->mbuf.ol_flags |= PKT_TX_TCP_SEG;
+	snb_tx_offload_csum(snb, l2_len, l3_len, IPPROTO_TCP);
+}
+
+/* For outer Ethernet/IPv4 and tunnel (e.g., UDP and VXLAN) headers that
+ * have just been prepended. Offloads already requested for the packet are
+ * kept for the inner headers, and the outer IPv4 checksum is offloaded
+ * if ip_cksum is set (otherwise it must be already valid).
+ *
+ * The packet must not be tunneled already, or have a VLAN tag insertion
+ * pending, since those refer to the headers now inside the tunnel. */
+static inline void snb_tx_offload_encap(struct snbuf *snb, 
+		int outer_l2_len, int outer_l3_len, int tun_len, int ip_cksum)
+{
+	struct rte_mbuf *mbuf = &snb->mbuf;
+	uint64_t flags = mbuf->ol_flags;
+
+	/* l2_len spans the outer L4 and tunnel headers, as DPDK expects */
+	if (flags & SNB_TX_OFFLOAD_INNER)
+		mbuf->l2_len += tun_len;
+	else if (!ip_cksum)
+		return;
+
+	mbuf->outer_l2_len = outer_l2_len;
+	mbuf->outer_l3_len = outer_l3_len;
+	flags |= PKT_TX_OUTER_IPV4;
+
+	if (ip_cksum) {
+		struct ipv4_hdr *ip = (struct ipv4_hdr *)
+				(snb_head_data(snb) + outer_l2_len);
+
+		ip->hdr_checksum = 0;
+		flags |= PKT_TX_OUTER_IP_CKSUM;
+	}
+
+	mbuf->ol_flags = flags;
+}
+
+/* requested offloads in ol_flags that need software fallback for the given
+ * capabilities (DEV_TX_OFFLOAD_*), being conservative for L4 checksums.
+ * Computed once per port, to filter packets quickly. */
+uint64_t snb_tx_offload_sw_mask(uint32_t capa);
+
+/* Does the offloads of snb that are not in capa, and clears them from
+ * ol_flags. Returns 0, or -errno if the packet cannot be sent as requested
+ * (e.g., TSO without hardware support) and should be dropped. */
+int snb_tx_offload_sw(struct snbuf *snb, uint32_t capa);
+
+/* of the full-sized class */
 struct rte_mempool *get_pframe_pool();
 struct rte_mempool *get_pframe_pool_socket(int socket);
 
+/* NULL if the class is not available */
+struct rte_mempool *get_pframe_pool_class(int socket, int cls);
+
+/* the pool of the smallest class that can hold a frame of len bytes 
+ * (e.g., for RX queues, with the max frame size) */
+struct rte_mempool *get_pframe_pool_fit(int socket, uint16_t len);
+
+/* Software prefetch over a batch.
+ *
+ * With distance d, while packet i is processed, the mbuf of packet i + 2d
+ * (needed to locate the data) and the head data and metadata of packet
+ * i + d are prefetched:
+ *
+ *	snb_prefetch_start(batch, d);
+ *	for (int i = 0; i < batch->cnt; i++) {
+ *		snb_prefetch_ahead(batch, i, d);
+ *		... process batch->pkts[i] ...
+ *	}
+ *
+ * d = 0 disables prefetch. */
+#define SNB_PREFETCH_DIST_DEFAULT	4
+
+static inline void __snb_prefetch_data(struct snbuf *snb)
+{
+	rte_prefetch0(snb_head_data(snb));
+	rte_prefetch0(snb->_metadata);
+}
+
+static inline void snb_prefetch_start(struct pkt_batch *batch, int dist)
+{
+	int cnt = batch->cnt;
+
+	for (int i = 0; i < RTE_MIN(cnt, dist * 2); i++)
+		rte_prefetch0(batch->pkts[i]);
+
+	for (int i = 0; i < RTE_MIN(cnt, dist); i++)
+		__snb_prefetch_data(batch->pkts[i]);
+}
+
+static inline void snb_prefetch_ahead(struct pkt_batch *batch, int i, 
+		int dist)
+{
+	int cnt = batch->cnt;
+
+	if (!dist)
+		return;
+
+	if (i + dist * 2 < cnt)
+		rte_prefetch0(batch->pkts[i + dist * 2]);
+
+	if (i + dist < cnt)
+		__snb_prefetch_data(batch->pkts[i + dist]);
+}
+
 static inline phys_addr_t snb_to_paddr(struct snbuf *snb)
 {
 	return snb->immutable.paddr;
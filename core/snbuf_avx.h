@@ -5,9 +5,12 @@
 	#error "Do not directly include this file. Include snbuf.h instead."
 #endif
 
+/* the size class is chosen with snb_class_fit(len) */
 static inline int
 snb_alloc_bulk(snb_array_t snbs, int cnt, uint16_t len)
 {
+	const int cls = snb_class_fit(len);
+
 	int ret;
 	int i;
 
@@ -33,11 +36,11 @@ snb_alloc_bulk(snb_array_t snbs, int cnt, uint16_t len)
 	rxdesc_fields = _mm_setr_epi32(len << 16, len, 0, 0);
 #endif
 
-	ret = rte_mempool_get_bulk(ctx.pframe_pool, (void **)snbs, cnt);
+	ret = snb_cache_get(cls, snbs, cnt);
 	if (ret != 0)
 		return 0;
 
-	mbuf_template = *((__m128i *)&pframe_template.buf_len);
+	mbuf_template = *((__m128i *)&pframe_template[cls].buf_len);
 	
 	/* 4 at a time didn't help */
 	for (i = 0; i < (cnt & (~0x1)); i+=2) {
@@ -132,9 +135,7 @@ static inline void snb_free_bulk(snb_array_t snbs, int cnt)
 		}
 	}
 
-	/* NOTE: it seems that zeroing the refcnt of mbufs is not necessary.
-	 *   (allocators will reset them) */
-	rte_mempool_put_bulk(_pool, (void **)snbs, cnt);
+	__snb_free_bulk_simple(_pool, snbs, cnt);
 	return;
 
 slow_path:
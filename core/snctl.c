@@ -5,9 +5,12 @@
 #include <unistd.h>
 #include <assert.h>
 #include <errno.h>
+#include <stdarg.h>
 #include <stdlib.h>
 
 #include <pthread.h>
+#include <fcntl.h>
+#include <limits.h>
 
 #include <sys/time.h>
 #include <sys/types.h>
@@ -18,11 +21,22 @@
 #include "module.h"
 #include "port.h"
 #include "time.h"
+#include "telemetry.h"
+#include "trace.h"
+#include "module_bench.h"
+#include "topology.h"
+
+#include "utils/histogram.h"
 
 struct handler_map {
 	const char *cmd;
 	int pause_needed;	/* should all workers have been paused? */
 	struct snobj *(*func)(struct snobj *);
+
+	/* if non-zero, the handler changes nothing (not even counters), so
+	 * it can run concurrently with other read-only handlers (see 
+	 * is_read_only_request()) */
+	int read_only;
 };
 
 static const char *resource_names[NUM_RESOURCES] = 
@@ -89,6 +103,42 @@ static struct snobj *handle_reset_workers(struct snobj *q)
 	return NULL;
 }
 
+/* Hardware counters (enum pmu_event) with the IPC, and if pkts is not 0,
+ * the counts per packet */
+static struct snobj *pmu_to_snobj(const uint64_t *vals, uint64_t pkts)
+{
+	struct snobj *r = snobj_map();
+	uint64_t cycles = vals[PMU_CYCLES];
+
+	for (int i = 0; i < NUM_PMU_EVENTS; i++) {
+		char key[64];
+
+		snobj_map_set(r, pmu_event_names[i], snobj_uint(vals[i]));
+
+		if (!pkts)
+			continue;
+
+		snprintf(key, sizeof(key), "%s_per_packet", pmu_event_names[i]);
+		snobj_map_set(r, key, snobj_double((double)vals[i] / pkts));
+	}
+
+	snobj_map_set(r, "ipc", snobj_double(cycles ?
+			(double)vals[PMU_INSTRUCTIONS] / cycles : 0.0));
+
+	return r;
+}
+
+/* packets by cause (enum drop_cause) */
+static struct snobj *drops_to_snobj(const uint64_t *drops)
+{
+	struct snobj *r = snobj_map();
+
+	for (int i = 0; i < NUM_DROP_CAUSES; i++)
+		snobj_map_set(r, drop_cause_names[i], snobj_uint(drops[i]));
+
+	return r;
+}
+
 static struct snobj *handle_list_workers(struct snobj *q)
 {
 	struct snobj *r;
@@ -107,10 +157,79 @@ static struct snobj *handle_list_workers(struct snobj *q)
 				snobj_int(is_worker_running(wid)));
 		snobj_map_set(worker, "core",
 				snobj_int(workers[wid]->core));
+
+		if (CPU_COUNT(&workers[wid]->cpuset) > 1) {
+			struct snobj *cores = snobj_list();
+
+			for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+				if (CPU_ISSET(cpu, &workers[wid]->cpuset))
+					snobj_list_add(cores, snobj_int(cpu));
+
+			snobj_map_set(worker, "cores", cores);
+		}
 		snobj_map_set(worker, "num_tcs",
 				snobj_int(workers[wid]->s->num_classes));
 		snobj_map_set(worker, "silent_drops",
-				snobj_int(workers[wid]->silent_drops));
+				snobj_int(workers[wid]->drops[DROP_DEADEND]));
+		snobj_map_set(worker, "drops",
+				drops_to_snobj(workers[wid]->drops));
+
+		if (workers[wid]->pmu.enabled) {
+			uint64_t vals[NUM_PMU_EVENTS];
+
+			/* all, not only sampled, so no packet count */
+			pmu_read_total(&workers[wid]->pmu, vals);
+			snobj_map_set(worker, "pmu", pmu_to_snobj(vals, 0));
+		}
+
+		{
+			struct snobj *cache = snobj_map();
+			struct snb_cache sum = {};
+
+			/* all size classes */
+			for (int i = 0; i < SNB_NUM_CLASSES; i++) {
+				const struct snb_cache *c = 
+					&workers[wid]->snb_cache[i];
+
+				sum.cnt += c->cnt;
+				sum.cnt_alloc += c->cnt_alloc;
+				sum.cnt_refill += c->cnt_refill;
+				sum.cnt_free += c->cnt_free;
+				sum.cnt_spill += c->cnt_spill;
+				sum.cnt_fail += c->cnt_fail;
+			}
+
+			snobj_map_set(cache, "cached", snobj_int(sum.cnt));
+			snobj_map_set(cache, "allocs", 
+					snobj_uint(sum.cnt_alloc));
+			snobj_map_set(cache, "refills", 
+					snobj_uint(sum.cnt_refill));
+			snobj_map_set(cache, "frees", 
+					snobj_uint(sum.cnt_free));
+			snobj_map_set(cache, "spills", 
+					snobj_uint(sum.cnt_spill));
+			snobj_map_set(cache, "fails", 
+					snobj_uint(sum.cnt_fail));
+			snobj_map_set(worker, "snb_cache", cache);
+		}
+
+		if (global_opts.idle_sleep_us) {
+			const struct sched_stats *st = &workers[wid]->s->stats;
+
+			snobj_map_set(worker, "idle_cycles",
+					snobj_uint(st->cycles_idle));
+			snobj_map_set(worker, "sleep_cycles",
+					snobj_uint(st->cycles_sleep));
+			snobj_map_set(worker, "sleep_count",
+					snobj_uint(st->cnt_sleep));
+			snobj_map_set(worker, "wakeup_latency_avg_us",
+					snobj_double(st->cnt_sleep ? 
+					tsc_to_us(st->wakeup_latency / 
+						st->cnt_sleep) : 0.0));
+			snobj_map_set(worker, "wakeup_latency_max_us",
+					snobj_double(tsc_to_us(
+						st->wakeup_latency_max)));
+		}
 
 		snobj_list_add(r, worker);
 	}
@@ -118,10 +237,216 @@ static struct snobj *handle_list_workers(struct snobj *q)
 	return r;
 }
 
+/* all workers, and modules that have dropped any packets */
+static struct snobj *handle_get_drop_stats(struct snobj *q)
+{
+	uint64_t total[NUM_DROP_CAUSES] = {};
+	struct snobj *r = snobj_map();
+	struct snobj *modules = snobj_map();
+
+	int cnt = 1;
+	int offset;
+
+	for (int wid = 0; wid < MAX_WORKERS; wid++) {
+		if (!is_worker_active(wid))
+			continue;
+
+		for (int i = 0; i < NUM_DROP_CAUSES; i++)
+			total[i] += workers[wid]->drops[i];
+	}
+
+	for (offset = 0; cnt != 0; offset += cnt) {
+		const int arr_size = 16;
+		const struct module *arr[arr_size];
+
+		cnt = list_modules(arr, arr_size, offset);
+
+		for (int i = 0; i < cnt; i++) {
+			uint64_t drops[NUM_DROP_CAUSES] = {};
+			uint64_t sum = 0;
+
+			for (int wid = 0; wid < MAX_WORKERS; wid++)
+				for (int j = 0; j < NUM_DROP_CAUSES; j++)
+					drops[j] += arr[i]->perf[wid].drops[j];
+
+			for (int j = 0; j < NUM_DROP_CAUSES; j++)
+				sum += drops[j];
+
+			if (sum)
+				snobj_map_set(modules, arr[i]->name,
+						drops_to_snobj(drops));
+		}
+	}
+
+	snobj_map_set(r, "timestamp", snobj_double(get_epoch_time()));
+	snobj_map_set(r, "total", drops_to_snobj(total));
+	snobj_map_set(r, "modules", modules);
+
+	return r;
+}
+
+/* cheap enough to be polled every second: 
+ * rte_mempool_count() walks the per-lcore caches of each pool */
+static struct snobj *handle_get_mempool_stats(struct snobj *q)
+{
+	struct snobj *r = snobj_map();
+	struct snobj *pools = snobj_list();
+	struct snobj *worker_list = snobj_list();
+
+	for (int sid = 0; sid < RTE_MAX_NUMA_NODES; sid++) {
+		for (int cls = 0; cls < SNB_NUM_CLASSES; cls++) {
+			struct rte_mempool *pool;
+			const struct snb_pool_stats *st;
+			struct snobj *pool_obj;
+			uint32_t avail;
+			uint32_t in_use;
+			uint32_t cached = 0;
+
+			pool = get_pframe_pool_class(sid, cls);
+			st = get_pframe_pool_stats(sid, cls);
+			if (!pool || !st)
+				continue;
+
+			/* held in the snbuf caches of workers */
+			for (int wid = 0; wid < MAX_WORKERS; wid++)
+				if (is_worker_active(wid) && 
+				    workers[wid]->pframe_pools[cls] == pool)
+					cached += workers[wid]->snb_cache[cls].cnt;
+
+			avail = rte_mempool_count(pool);
+			in_use = pool->size - avail;
+
+			pool_obj = snobj_map();
+			snobj_map_set(pool_obj, "name", snobj_str(pool->name));
+			snobj_map_set(pool_obj, "socket", snobj_int(sid));
+			snobj_map_set(pool_obj, "buf_size", 
+					snobj_int(snb_class_size(cls)));
+			snobj_map_set(pool_obj, "size", snobj_uint(pool->size));
+			snobj_map_set(pool_obj, "available", snobj_uint(avail));
+			snobj_map_set(pool_obj, "in_use", snobj_uint(in_use));
+			snobj_map_set(pool_obj, "worker_cached", 
+					snobj_uint(cached));
+
+			/* in the pipeline, port queues, vport rings, etc. */
+			snobj_map_set(pool_obj, "in_flight", 
+					snobj_uint(in_use > cached ? 
+						in_use - cached : 0));
+			snobj_map_set(pool_obj, "max_in_use", 
+					snobj_uint(st->max_in_use));
+			snobj_map_set(pool_obj, "alloc_fails", 
+					snobj_uint(st->alloc_fails));
+			snobj_map_set(pool_obj, "alloc_denied", 
+					snobj_uint(st->alloc_denied));
+			snobj_map_set(pool_obj, "alloc_short", 
+					snobj_uint(st->alloc_short));
+
+			snobj_list_add(pools, pool_obj);
+		}
+	}
+
+	for (int wid = 0; wid < MAX_WORKERS; wid++) {
+		struct snobj *worker;
+		struct snobj *classes;
+
+		if (!is_worker_active(wid))
+			continue;
+
+		worker = snobj_map();
+		classes = snobj_list();
+
+		for (int cls = 0; cls < SNB_NUM_CLASSES; cls++) {
+			const struct snb_cache *c = &workers[wid]->snb_cache[cls];
+			struct snobj *cache;
+
+			if (!workers[wid]->pframe_pools[cls])
+				continue;
+
+			cache = snobj_map();
+			snobj_map_set(cache, "buf_size", 
+					snobj_int(snb_class_size(cls)));
+			snobj_map_set(cache, "cached", snobj_int(c->cnt));
+			snobj_map_set(cache, "capacity", 
+					snobj_int(SNB_CACHE_SIZE));
+			snobj_map_set(cache, "allocs", snobj_uint(c->cnt_alloc));
+			snobj_map_set(cache, "refills", 
+					snobj_uint(c->cnt_refill));
+			snobj_map_set(cache, "frees", snobj_uint(c->cnt_free));
+			snobj_map_set(cache, "spills", snobj_uint(c->cnt_spill));
+			snobj_map_set(cache, "alloc_fails", 
+					snobj_uint(c->cnt_fail));
+
+			snobj_list_add(classes, cache);
+		}
+
+		snobj_map_set(worker, "wid", snobj_int(wid));
+		snobj_map_set(worker, "socket", 
+				snobj_int(workers[wid]->socket));
+		snobj_map_set(worker, "snb_cache", classes);
+
+		snobj_list_add(worker_list, worker);
+	}
+
+	snobj_map_set(r, "pools", pools);
+	snobj_map_set(r, "workers", worker_list);
+
+	{
+		const struct snb_admission *adm = get_snb_admission();
+		struct snobj *obj = snobj_map();
+
+		snobj_map_set(obj, "reserve_pct", snobj_int(adm->reserve_pct));
+		snobj_map_set(obj, "watermark_pct", 
+				snobj_int(adm->watermark_pct));
+		snobj_map_set(obj, "min_priority", 
+				snobj_int(adm->min_priority));
+
+		snobj_map_set(r, "admission", obj);
+	}
+
+	return r;
+}
+
+/* all fields are optional, and unchanged if not given */
+static struct snobj *handle_set_mempool_admission(struct snobj *q)
+{
+	struct snb_admission adm = *get_snb_admission();
+
+	if (snobj_eval_exists(q, "reserve_pct"))
+		adm.reserve_pct = snobj_eval_int(q, "reserve_pct");
+
+	if (snobj_eval_exists(q, "watermark_pct"))
+		adm.watermark_pct = snobj_eval_int(q, "watermark_pct");
+
+	if (snobj_eval_exists(q, "min_priority"))
+		adm.min_priority = snobj_eval_int(q, "min_priority");
+
+	if (set_snb_admission(&adm) < 0)
+		return snobj_err(EINVAL, "'reserve_pct' and 'watermark_pct' "
+				"must be between 0 and 100");
+
+	return NULL;
+}
+
+static const char *throttle_mode_names[NUM_THROTTLE_MODES] =
+		{"heap", "wheel"};
+
+static int name_to_throttle_mode(const char *name)
+{
+	for (int i = 0; i < NUM_THROTTLE_MODES; i++)
+		if (strcmp(throttle_mode_names[i], name) == 0)
+			return i;
+
+	/* not found */
+	return -1;
+}
+
 static struct snobj *handle_add_worker(struct snobj *q)
 {
 	unsigned int wid;
 	unsigned int core;
+	cpu_set_t cpuset;
+	int throttle_mode = THROTTLE_HEAP;
+
+	const char *throttle;
 
 	struct snobj *t;
 
@@ -138,18 +463,102 @@ static struct snobj *handle_add_worker(struct snobj *q)
 	if (!t)
 		return snobj_err(EINVAL, "Missing 'core' field");
 
-	core = snobj_uint_get(t);
-	if (!is_cpu_present(core))
-		return snobj_err(EINVAL, "Invalid core %d", core);
+	/* either a single core or a list of them */
+	CPU_ZERO(&cpuset);
+
+	for (int i = 0; i < (t->type == TYPE_LIST ? t->size : 1); i++) {
+		struct snobj *c = (t->type == TYPE_LIST) ? 
+				snobj_list_get(t, i) : t;
+
+		if (c->type != TYPE_INT)
+			return snobj_err(EINVAL, "'core' must be an integer " 
+					"or a list of integers");
+
+		core = snobj_uint_get(c);
+		if (!is_cpu_present(core) || core >= CPU_SETSIZE)
+			return snobj_err(EINVAL, "Invalid core %d", core);
+
+		/* also run on the hyperthreads of the same physical core */
+		if (snobj_eval_int(q, "smt")) {
+			int ret = add_smt_siblings(&cpuset, core);
+			if (ret < 0)
+				return snobj_err(-ret, "Cannot find the SMT "
+						"siblings of core %d", core);
+		} else
+			CPU_SET(core, &cpuset);
+	}
+
+	if (CPU_COUNT(&cpuset) == 0)
+		return snobj_err(EINVAL, "'core' must not be empty");
+
+	throttle = snobj_eval_str(q, "throttle");
+	if (throttle) {
+		throttle_mode = name_to_throttle_mode(throttle);
+		if (throttle_mode < 0)
+			return snobj_err(EINVAL, "Invalid throttle mode '%s'",
+					throttle);
+	}
 
 	if (is_worker_active(wid))
 		return snobj_err(EEXIST, "worker:%d is already active", wid);
 
-	launch_worker(wid, core);
+	launch_worker_cpuset(wid, &cpuset);
+
+	/* the new worker is paused and has no TCs yet, so this cannot fail */
+	sched_set_throttle_mode(workers[wid]->s, throttle_mode);
+
+	/* to grow a running pipeline, without resume_all (thus, without 
+	 * spreading orphan tasks) */
+	if (snobj_eval_int(q, "resume"))
+		resume_worker(wid);
+
+	return NULL;
+}
+
+/* Workers keep running. The TCs of the worker are moved to others */
+static struct snobj *handle_remove_worker(struct snobj *q)
+{
+	struct snobj *t;
+	unsigned int wid;
+	int ret;
+
+	t = snobj_eval(q, "wid");
+	if (!t)
+		return snobj_err(EINVAL, "Missing 'wid' field");
+
+	wid = snobj_uint_get(t);
+	if (wid >= MAX_WORKERS)
+		return snobj_err(EINVAL, "'wid' must be between 0 and %d",
+				MAX_WORKERS - 1);
+
+	if (!is_worker_active(wid))
+		return snobj_err(ENOENT, "worker:%d does not exist", wid);
+
+	ret = remove_worker(wid);
+	if (ret == -EBUSY)
+		return snobj_err(EBUSY, "worker:%d has TCs, but there is no "
+				"other worker to take them", wid);
+	else if (ret < 0)
+		return snobj_errno(-ret);
 
 	return NULL;
 }
 
+/* modules owned by c are not charged to anyone any more */
+static void clear_module_owners(struct tc *c)
+{
+	struct ns_iter iter;
+	struct module *m;
+
+	ns_init_iterator(&iter, NS_TYPE_MODULE);
+
+	while ((m = (struct module *)ns_next(&iter)) != NULL)
+		if (m->owner_tc == c)
+			m->owner_tc = NULL;
+
+	ns_release_iterator(&iter);
+}
+
 static struct snobj *handle_reset_tcs(struct snobj *q)
 {
 	struct ns_iter iter;
@@ -187,6 +596,7 @@ static struct snobj *handle_reset_tcs(struct snobj *q)
 		if (c->settings.auto_free)
 			continue;
 
+		clear_module_owners(c);
 		tc_leave(c);
 		tc_dec_refcnt(c);
 	}
@@ -244,6 +654,10 @@ static struct snobj *handle_list_tcs(struct snobj *q)
 		snobj_map_set(elem, "tasks", snobj_int(c->num_tasks));
 		snobj_map_set(elem, "parent", snobj_str(c->parent->settings.name));
 		snobj_map_set(elem, "priority", snobj_int(c->settings.priority));
+		snobj_map_set(elem, "max_delay_us", 
+				snobj_uint(c->settings.max_delay_us));
+		snobj_map_set(elem, "max_run_us", 
+				snobj_uint(c->settings.max_run_us));
 
 		if (wid < MAX_WORKERS)
 			snobj_map_set(elem, "wid", snobj_uint(wid));
@@ -276,13 +690,186 @@ static struct snobj *handle_list_tcs(struct snobj *q)
 	return r;
 }
 
+/* The worker that owns the scheduler s. MAX_WORKERS if none */
+static int sched_to_wid(struct sched *s)
+{
+	for (int wid = 0; wid < MAX_WORKERS; wid++)
+		if (is_worker_active(wid) && workers[wid]->s == s)
+			return wid;
+
+	return MAX_WORKERS;
+}
+
+/* Run func on the owner of the scheduler. TCs can migrate with work
+ * stealing, so func should return -EAGAIN if s turns out to be stale. */
+static int run_on_sched_owner(struct sched *s, int (*func)(void *), void *arg)
+{
+	int wid = sched_to_wid(s);
+
+	if (wid == MAX_WORKERS)
+		return func(arg);
+
+	return run_on_worker(wid, func, arg);
+}
+
+struct tc_update_arg {
+	struct sched *s;
+	const struct tc_params *params;
+	struct tc *c;
+	struct task *t;
+};
+
+static int do_add_tc(void *p)
+{
+	struct tc_update_arg *arg = p;
+
+	arg->c = tc_init(arg->s, arg->params);
+	if (is_err(arg->c))
+		return ptr_to_err(arg->c);
+
+	tc_join(arg->c);
+
+	return 0;
+}
+
+static int do_task_detach(void *p)
+{
+	struct tc_update_arg *arg = p;
+
+	if (arg->t->c != arg->c)
+		return -EAGAIN;
+	
+	if (arg->c && arg->c->s != arg->s)
+		return -EAGAIN;
+
+	task_detach(arg->t);
+
+	/* the task is leaving the worker, with the queues it uses */
+	if (sched_to_wid(arg->s) < MAX_WORKERS)
+		give_up_queues(sched_to_wid(arg->s));
+
+	return 0;
+}
+
+static int do_task_attach(void *p)
+{
+	struct tc_update_arg *arg = p;
+
+	if (arg->c->s != arg->s)
+		return -EAGAIN;
+
+	task_attach(arg->t, arg->c);
+
+	return 0;
+}
+
+static int do_assign_default_tc(void *p)
+{
+	struct tc_update_arg *arg = p;
+
+	assign_default_tc(sched_to_wid(arg->s), arg->t);
+
+	return 0;
+}
+
+/* Move the task t to the TC c, possibly across workers, 
+ * without pausing any worker other than the two involved */
+static void move_task(struct task *t, struct tc *c)
+{
+	struct tc_update_arg arg = {.t = t};
+
+	while (t->c && t->c != c) {
+		arg.c = t->c;
+		arg.s = arg.c->s;
+
+		/* the old TC is on another worker? detach there first */
+		if (arg.s == c->s)
+			break;
+
+		if (run_on_sched_owner(arg.s, do_task_detach, &arg) == 0)
+			break;
+	}
+
+	do {
+		arg.c = c;
+		arg.s = c->s;
+	} while (run_on_sched_owner(arg.s, do_task_attach, &arg) == -EAGAIN);
+}
+
+/* The module memory (including its port's queues and RX buffers, 
+ * for port-bound modules) should be local to the worker running its task */
+static void check_task_placement(const struct task *t, int wid)
+{
+	const struct module *m = t->m;
+
+	if (wid == MAX_WORKERS || !is_worker_active(wid))
+		return;
+
+	if (m->socket == SOCKET_ID_ANY || m->socket == workers[wid]->socket)
+		return;
+
+	log_warn("Module '%s' is on socket %d, but its task is "
+			"running on worker %d (socket %d)\n",
+			m->name, m->socket, wid, workers[wid]->socket);
+}
+
+/* Attach the unattached tasks of m to default TCs, spread across running
+ * workers, without waiting for resume_all_workers() */
+static void attach_tasks_live(struct module *m)
+{
+	static int rr_next;
+
+	for (int i = 0; i < MAX_TASKS_PER_MODULE; i++) {
+		struct task *t = m->tasks[i];
+		struct tc_update_arg arg = {.t = t};
+		int wid;
+		int j;
+
+		if (!t || task_is_attached(t))
+			continue;
+
+		for (j = 0; j < MAX_WORKERS; j++) {
+			wid = (rr_next + j) % MAX_WORKERS;
+			if (is_worker_running(wid))
+				break;
+		}
+
+		if (j == MAX_WORKERS)
+			return;		/* left for process_orphan_tasks() */
+
+		rr_next = wid + 1;
+
+		arg.s = workers[wid]->s;
+		run_on_worker(wid, do_assign_default_tc, &arg);
+		check_task_placement(t, wid);
+	}
+}
+
+/* Detach all tasks of m, each on the worker that owns its TC */
+static void detach_tasks_live(struct module *m)
+{
+	for (int i = 0; i < MAX_TASKS_PER_MODULE; i++) {
+		struct task *t = m->tasks[i];
+		struct tc_update_arg arg = {.t = t};
+
+		if (!t)
+			continue;
+
+		/* retry if the TC has been stolen by another worker */
+		while (task_is_attached(t)) {
+			arg.c = t->c;
+			arg.s = arg.c->s;
+			run_on_sched_owner(arg.s, do_task_detach, &arg);
+		}
+	}
+}
+
 static struct snobj *handle_add_tc(struct snobj *q)
 {
 	const char *tc_name;
 	int wid;
 
 	struct tc_params params;
-	struct tc *c;
 
 	tc_name = snobj_eval_str(q, "name");
 	if (!tc_name)
@@ -321,6 +908,18 @@ static struct snobj *handle_add_tc(struct snobj *q)
 	params.share = 1;
 	params.share_resource = RESOURCE_CNT;
 
+	params.pinned = snobj_eval_int(q, "pinned");
+
+	/* for EDF within the pgroup. 0 if no deadline */
+	params.max_delay_us = snobj_eval_uint(q, "max_delay_us");
+
+	/* for tasks that check task_over_budget(). 0 if unlimited */
+	params.max_run_us = snobj_eval_uint(q, "max_run_us");
+
+	/* saves memory for many TCs per worker (e.g., one per tenant) */
+	if (snobj_eval_exists(q, "wait_stats"))
+		params.no_wait_hist = !snobj_eval_int(q, "wait_stats");
+
 	struct snobj *limit = snobj_eval(q, "limit");
 	if (limit) {
 		if (snobj_type(limit) != TYPE_MAP)
@@ -356,11 +955,13 @@ static struct snobj *handle_add_tc(struct snobj *q)
 		}
 	}
 
-	c = tc_init(workers[wid]->s, &params);
-	if (is_err(c))
-		return snobj_err(-ptr_to_err(c), "tc_init() failed");
+	struct tc_update_arg arg = {.s = workers[wid]->s, .params = &params};
+	int ret;
 
-	tc_join(c);
+	/* only this worker stalls, while tc_init() is done on its own thread */
+	ret = run_on_worker(wid, do_add_tc, &arg);
+	if (ret < 0)
+		return snobj_err(-ret, "tc_init() failed");
 
 	return NULL;
 }
@@ -393,6 +994,39 @@ static struct snobj *handle_get_tc_stats(struct snobj *q)
 	snobj_map_set(r, "bits", 
 			snobj_uint(c->stats.usage[RESOURCE_BIT]));
 
+	/* scheduling delay since creation, if recorded */
+	if (c->wait_hist) {
+		struct snobj *wait = snobj_map();
+
+		snobj_map_set(wait, "p50", snobj_double(tsc_to_us(
+				histo_percentile(c->wait_hist, 50.0))));
+		snobj_map_set(wait, "p99", snobj_double(tsc_to_us(
+				histo_percentile(c->wait_hist, 99.0))));
+		snobj_map_set(wait, "p999", snobj_double(tsc_to_us(
+				histo_percentile(c->wait_hist, 99.9))));
+
+		snobj_map_set(r, "wait_us", wait);
+	}
+
+	if (c->stats.pmu[PMU_CYCLES])
+		snobj_map_set(r, "pmu", pmu_to_snobj(c->stats.pmu,
+					c->stats.pmu_pkts));
+
+	if (c->stats.cnt_alloc_denied)
+		snobj_map_set(r, "alloc_denied", 
+				snobj_uint(c->stats.cnt_alloc_denied));
+
+	if (c->settings.max_delay_us) {
+		snobj_map_set(r, "edf_picks", 
+				snobj_uint(c->stats.cnt_edf));
+		snobj_map_set(r, "deadline_misses", 
+				snobj_uint(c->stats.cnt_deadline_miss));
+	}
+
+	if (c->settings.max_run_us)
+		snobj_map_set(r, "overruns", 
+				snobj_uint(c->stats.cnt_overrun));
+
 	return r;
 }
 
@@ -495,6 +1129,45 @@ static struct snobj *handle_create_port(struct snobj *q)
 	return r;
 }
 
+/* Creates a list of ports in one request, as {"driver", "name", "arg"}
+ * maps (same as create_port). Workers keep running, as with create_port:
+ * they do not see a port until a module uses it. A failure does not stop
+ * the rest; each result is either {"name"} or {"err"} */
+static struct snobj *handle_create_ports(struct snobj *q)
+{
+	struct snobj *results;
+	struct snobj *r;
+
+	uint64_t start = rdtsc();
+	int created = 0;
+
+	if (snobj_type(q) != TYPE_LIST)
+		return snobj_err(EINVAL, "Argument must be a list of maps");
+
+	results = snobj_list();
+
+	for (int i = 0; i < q->size; i++) {
+		struct snobj *port_arg = snobj_list_get(q, i);
+		struct snobj *result;
+
+		result = handle_create_port(port_arg);
+		if (result && snobj_eval_exists(result, "name"))
+			created++;
+		else if (!result)
+			result = snobj_err(EINVAL, "No result");
+
+		snobj_list_add(results, result);
+	}
+
+	r = snobj_map();
+	snobj_map_set(r, "ports", results);
+	snobj_map_set(r, "created", snobj_int(created));
+	snobj_map_set(r, "elapsed_us",
+			snobj_double(tsc_to_us(rdtsc() - start)));
+
+	return r;
+}
+
 static struct snobj *handle_destroy_port(struct snobj *q)
 {
 	const char *port_name;
@@ -518,13 +1191,37 @@ static struct snobj *handle_destroy_port(struct snobj *q)
 	return NULL;
 }
 
-static struct snobj *handle_get_port_stats(struct snobj *q)
+/* queues in single producer/consumer mode, with their current owners */
+static struct snobj *collect_single_queues(struct port *p, packet_dir_t dir)
 {
-	const char *port_name;
+	struct snobj *r = snobj_list();
 
-	struct port *port;
+	for (queue_t qid = 0; qid < p->num_queues[dir]; qid++) {
+		struct snobj *queue;
 
-	port_stats_t stats;
+		if (!p->queue_single[dir][qid])
+			continue;
+
+		queue = snobj_map();
+		snobj_map_set(queue, "queue", snobj_int(qid));
+		snobj_map_set(queue, "owner", 
+				snobj_int(queue_owner_wid(
+						p->queue_owner[dir][qid])));
+		snobj_map_set(queue, "violations", 
+				snobj_uint(p->queue_violations[dir][qid]));
+		snobj_list_add(r, queue);
+	}
+
+	return r;
+}
+
+static struct snobj *handle_get_port_stats(struct snobj *q)
+{
+	const char *port_name;
+
+	struct port *port;
+
+	port_stats_t stats;
 
 	struct snobj *r;
 	struct snobj *inc;
@@ -550,9 +1247,18 @@ static struct snobj *handle_get_port_stats(struct snobj *q)
 	snobj_map_set(out, "dropped", snobj_uint(stats[PACKET_DIR_OUT].dropped));
 	snobj_map_set(out, "bytes",   snobj_uint(stats[PACKET_DIR_OUT].bytes));
 
+	snobj_map_set(inc, "spsc_queues", 
+			collect_single_queues(port, PACKET_DIR_INC));
+	snobj_map_set(out, "spsc_queues", 
+			collect_single_queues(port, PACKET_DIR_OUT));
+
 	r = snobj_map();
 	snobj_map_set(r, "inc", inc);
 	snobj_map_set(r, "out", out);
+
+	if (port->driver->driver_stats)
+		snobj_map_set(r, "driver", port->driver->driver_stats(port));
+
 	snobj_map_set(r, "timestamp", snobj_double(get_epoch_time()));
 
 	return r;
@@ -658,11 +1364,28 @@ static struct snobj *handle_list_modules(struct snobj *q)
 	return r;
 }
 
+/* Modules bound to a port (with a 'port' argument) are placed on the same
+ * node as the device, unless specified otherwise */
+static int guess_module_socket(struct snobj *arg)
+{
+	const char *port_name;
+	struct port *p;
+
+	if (!arg || !(port_name = snobj_eval_str(arg, "port")))
+		return SOCKET_ID_ANY;
+
+	if ((p = find_port(port_name)) == NULL)
+		return SOCKET_ID_ANY;
+
+	return p->socket;
+}
+
 static struct snobj *handle_create_module(struct snobj *q)
 {
 	const char *mclass_name;
 	const struct mclass *mclass;
 	struct module *module;
+	int socket;
 
 	struct snobj *r;
 
@@ -674,11 +1397,22 @@ static struct snobj *handle_create_module(struct snobj *q)
 	if (!mclass)
 		return snobj_err(ENOENT, "No mclass '%s' found", mclass_name);
 
+	if (snobj_eval(q, "socket")) {
+		socket = snobj_eval_int(q, "socket");
+		if (socket < 0 || socket >= RTE_MAX_NUMA_NODES)
+			return snobj_err(EINVAL, "'socket' must be between "
+					"0 and %d", RTE_MAX_NUMA_NODES - 1);
+	} else
+		socket = guess_module_socket(snobj_eval(q, "arg"));
+
 	module = create_module(snobj_eval_str(q, "name"), mclass, 
-			snobj_eval(q, "arg"), &r);
+			snobj_eval(q, "arg"), socket, &r);
 	if (!module)
 		return r;
 
+	if (is_any_worker_running())
+		attach_tasks_live(module);
+
 	r = snobj_map();
 	snobj_map_set(r, "name", snobj_str(module->name));
 
@@ -698,11 +1432,123 @@ static struct snobj *handle_destroy_module(struct snobj *q)
 	if ((m = find_module(m_name)) == NULL)
 		return snobj_err(ENOENT, "No module '%s' found", m_name);
 
+	/* workers may be running */
+	detach_tasks_live(m);
 	destroy_module(m);
 
 	return NULL;
 }
 
+/* the module that feeds m through a fused link, if it is the only one */
+static struct module *fused_prev(struct module *m)
+{
+	struct gate *igate = NULL;
+	struct gate *ogate;
+
+	for (int i = 0; i < m->igates.curr_size; i++) {
+		if (!is_active_gate(&m->igates, i))
+			continue;
+
+		if (igate)
+			return NULL;	/* multiple igates */
+
+		igate = m->igates.arr[i];
+	}
+
+	if (!igate || !cdlist_is_single(&igate->in.ogates_upstream))
+		return NULL;
+
+	ogate = container_of(igate->in.ogates_upstream.next, 
+			struct gate, out.igate_upstream);
+
+	return ogate->m->fused.f ? ogate->m : NULL;
+}
+
+/* The straight-line segment m belongs to, from upstream to downstream.
+ * NULL if m is not fused with any other module. */
+static struct snobj *get_fused_segment(struct module *m)
+{
+	struct module *head = m;
+	struct module *prev;
+	struct snobj *r;
+
+	while ((prev = fused_prev(head)) != NULL && prev != m)
+		head = prev;
+
+	/* the segment ends at the first module with another upstream */
+	if (!head->fused.f || fused_prev(head->fused.arg) != head)
+		return NULL;
+
+	r = snobj_list();
+	snobj_list_add(r, snobj_str(head->name));
+
+	for (m = head; m->fused.f && fused_prev(m->fused.arg) == m; ) {
+		m = m->fused.arg;
+		snobj_list_add(r, snobj_str(m->name));
+
+		if (m == head)	/* loop */
+			break;
+	}
+
+	return r;
+}
+
+/* cycles are sampled, so only the ratios are meaningful */
+static struct snobj *get_module_perf(const struct module *m)
+{
+	struct snobj *r = snobj_map();
+	uint64_t samples = 0;
+	uint64_t pkts = 0;
+	uint64_t cycles = 0;
+	uint64_t pmu[NUM_PMU_EVENTS] = {};
+
+	for (int wid = 0; wid < MAX_WORKERS; wid++) {
+		samples += m->perf[wid].samples;
+		pkts += m->perf[wid].pkts;
+		cycles += m->perf[wid].cycles;
+
+		for (int i = 0; i < NUM_PMU_EVENTS; i++)
+			pmu[i] += m->perf[wid].pmu[i];
+	}
+
+	snobj_map_set(r, "samples", snobj_uint(samples));
+	snobj_map_set(r, "packets", snobj_uint(pkts));
+	snobj_map_set(r, "cycles", snobj_uint(cycles));
+	snobj_map_set(r, "cycles_per_packet", 
+			snobj_double(pkts ? (double)cycles / pkts : 0.0));
+	snobj_map_set(r, "cycles_per_call", 
+			snobj_double(samples ? (double)cycles / samples : 0.0));
+
+	/* sampled along with the cycles, if enabled */
+	if (pmu[PMU_CYCLES])
+		snobj_map_set(r, "pmu", pmu_to_snobj(pmu, pkts));
+
+	return r;
+}
+
+/* in bytes, from the DPDK heap. Tables that modules allocate by themselves
+ * are not included */
+static struct snobj *get_module_mem(const struct module *m)
+{
+	struct snobj *r = snobj_map();
+	uint64_t priv_worker = 0;
+
+	for (int wid = 0; wid < MAX_WORKERS; wid++)
+		if (m->priv_worker[wid])
+			priv_worker += m->mclass->priv_worker_size;
+
+	snobj_map_set(r, "total", snobj_uint(m->mem_size + priv_worker +
+			sizeof(struct gate *) * 
+			(m->igates.curr_size + m->ogates.curr_size)));
+	snobj_map_set(r, "module", snobj_uint(sizeof(struct module)));
+	snobj_map_set(r, "priv", snobj_uint(m->mclass->priv_size));
+	snobj_map_set(r, "priv_worker", snobj_uint(priv_worker));
+	snobj_map_set(r, "priv_align", 
+			snobj_uint(m->mclass->priv_align ? : 64));
+
+	return r;
+}
+
 static struct snobj *handle_get_module_info(struct snobj *q)
 {
 	const char *m_name;
@@ -711,6 +1557,7 @@ static struct snobj *handle_get_module_info(struct snobj *q)
 	struct snobj *r;
 	struct snobj *igates;
 	struct snobj *ogates;
+	struct snobj *fused;
 
 	m_name = snobj_str_get(q);
 
@@ -725,6 +1572,55 @@ static struct snobj *handle_get_module_info(struct snobj *q)
 	snobj_map_set(r, "name", snobj_str(m->name));
 	snobj_map_set(r, "mclass", snobj_str(m->mclass->name));
 
+	if (m->socket != SOCKET_ID_ANY)
+		snobj_map_set(r, "socket", snobj_int(m->socket));
+
+	if ((fused = get_fused_segment(m)) != NULL)
+		snobj_map_set(r, "fused", fused);
+
+	if (m->variant)
+		snobj_map_set(r, "variant", snobj_str(m->variant));
+
+	snobj_map_set(r, "mem", get_module_mem(m));
+
+	if (m->owner_tc)
+		snobj_map_set(r, "owner_tc", 
+				snobj_str(m->owner_tc->settings.name));
+
+	if (m->num_attrs) {
+		static const char *mode_names[] = {"read", "write", "update"};
+		struct snobj *attrs = snobj_list();
+
+		for (int i = 0; i < m->num_attrs; i++) {
+			struct snobj *attr = snobj_map();
+
+			snobj_map_set(attr, "name", 
+					snobj_str(m->attrs[i].name));
+			snobj_map_set(attr, "size", 
+					snobj_int(m->attrs[i].size));
+			snobj_map_set(attr, "mode", 
+					snobj_str(mode_names[m->attrs[i].mode]));
+			snobj_map_set(attr, "offset", 
+					snobj_int(m->attr_offsets[i]));
+
+			snobj_list_add(attrs, attr);
+		}
+
+		snobj_map_set(r, "metadata", attrs);
+	}
+
+	snobj_map_set(r, "perf", get_module_perf(m));
+
+	{
+		uint64_t drops[NUM_DROP_CAUSES] = {};
+
+		for (int wid = 0; wid < MAX_WORKERS; wid++)
+			for (int i = 0; i < NUM_DROP_CAUSES; i++)
+				drops[i] += m->perf[wid].drops[i];
+
+		snobj_map_set(r, "drops", drops_to_snobj(drops));
+	}
+
 	if (m->mclass->get_desc)
 		snobj_map_set(r, "desc", m->mclass->get_desc(m));
 
@@ -772,13 +1668,30 @@ static struct snobj *handle_get_module_info(struct snobj *q)
 		struct snobj *ogate = snobj_map();
 		struct gate *g = m->ogates.arr[i];
 
+		struct gate_hook *hook;
+		struct track_hook *track = NULL;
+		struct snobj *hooks = snobj_list();
+
+		for (hook = g->hooks; hook; hook = hook->next)
+			snobj_list_add(hooks, snobj_str(hook->name));
+
+		hook = find_gate_hook(g, TRACK_HOOK_NAME);
+		if (hook)
+			track = container_of(hook, struct track_hook, hook);
+
 		snobj_map_set(ogate, "ogate", snobj_uint(i));
-#if TRACK_GATES
-		snobj_map_set(ogate, "cnt", snobj_uint(g->cnt));
-		snobj_map_set(ogate, "pkts", snobj_uint(g->pkts));
+
+		/* zero if not tracked */
+		snobj_map_set(ogate, "cnt", 
+				snobj_uint(track ? track->cnt : 0));
+		snobj_map_set(ogate, "pkts", 
+				snobj_uint(track ? track->pkts : 0));
 		snobj_map_set(ogate, "timestamp", 
 				snobj_double(get_epoch_time()));
-#endif
+		snobj_map_set(ogate, "hooks", hooks);
+		if (g->compact)
+			snobj_map_set(ogate, "compact", 
+					snobj_int(g->compact->min_size));
 		snobj_map_set(ogate, "name", 
 				snobj_str(g->out.igate->m->name));
 		snobj_map_set(ogate, "igate",
@@ -823,6 +1736,12 @@ static struct snobj *handle_connect_modules(struct snobj *q)
 		return snobj_err(-ret, "Connection %s:%d->%d:%s failed", 
 			m1_name, ogate, igate, m2_name);
 
+	if (m1->socket != SOCKET_ID_ANY && m2->socket != SOCKET_ID_ANY &&
+			m1->socket != m2->socket)
+		log_warn("Connection %s:%d->%d:%s spans sockets %d and %d\n",
+				m1_name, ogate, igate, m2_name, 
+				m1->socket, m2->socket);
+
 	return NULL;
 }
 
@@ -852,6 +1771,41 @@ static struct snobj *handle_disconnect_modules(struct snobj *q)
 	return NULL;
 }
 
+/* The TC stays valid while any module points to it, since named TCs are 
+ * only freed by reset_tcs (with all workers paused, clearing the pointers).
+ * Workers may see the old owner for a while, which is harmless. */
+static struct snobj *handle_set_module_tc(struct snobj *q)
+{
+	const char *m_name;
+	const char *tc_name;
+
+	struct module *m;
+	struct tc *c = NULL;
+
+	m_name = snobj_eval_str(q, "name");
+	if (!m_name)
+		return snobj_err(EINVAL, "Missing 'name' field");
+
+	if ((m = find_module(m_name)) == NULL)
+		return snobj_err(ENOENT, "No module '%s' found", m_name);
+
+	tc_name = snobj_eval_str(q, "tc");
+	if (tc_name) {
+		c = ns_lookup(NS_TYPE_TC, tc_name);
+		if (!c)
+			return snobj_err(ENOENT, "No TC '%s' found", tc_name);
+
+		if (c->settings.auto_free)
+			return snobj_err(EINVAL, "TC '%s' is a default TC, "
+					"which may go away with its task", 
+					tc_name);
+	}
+
+	m->owner_tc = c;
+
+	return NULL;
+}
+
 static struct snobj *handle_attach_task(struct snobj *q)
 {
 	const char *m_name;
@@ -879,6 +1833,9 @@ static struct snobj *handle_attach_task(struct snobj *q)
 		return snobj_err(ENOENT, "Task %s:%hu does not exist", 
 				m_name, tid);
 
+	if (snobj_eval(q, "pinned"))
+		t->pinned = snobj_eval_int(q, "pinned");
+
 	tc_name = snobj_eval_str(q, "tc");
 
 	if (tc_name) {
@@ -888,7 +1845,8 @@ static struct snobj *handle_attach_task(struct snobj *q)
 		if (!c)
 			return snobj_err(ENOENT, "No TC '%s' found", tc_name);
 
-		task_attach(t, c);
+		move_task(t, c);
+		check_task_placement(t, sched_to_wid(c->s));
 	} else {
 		int wid;		/* TODO: worker_id_t */
 
@@ -904,9 +1862,291 @@ static struct snobj *handle_attach_task(struct snobj *q)
 		if (!is_worker_active(wid))
 			return snobj_err(EINVAL, "Worker %d does not exist", wid);
 
-		assign_default_tc(wid, t);
+		struct tc_update_arg arg = {.s = workers[wid]->s, .t = t};
+
+		run_on_worker(wid, do_assign_default_tc, &arg);
+		check_task_placement(t, wid);
+	}
+
+	return NULL;
+}
+
+static void track_module_gates(struct module *m, int ogate, int enable)
+{
+	for (int i = 0; i < m->ogates.curr_size; i++) {
+		if (ogate >= 0 && i != ogate)
+			continue;
+
+		if (!is_active_gate(&m->ogates, i))
+			continue;
+
+		/* already in the desired state is not an error */
+		if (enable)
+			enable_track(m, i);
+		else
+			disable_track(m, i);
+	}
+}
+
+/* Enable or disable gate counters. If 'name' is not given, all modules.
+ * If 'ogate' is not given, all output gates of the module(s). */
+static struct snobj *handle_track_gate(struct snobj *q)
+{
+	const char *m_name;
+	int enable;
+	int ogate = -1;
+
+	struct module *m;
+
+	enable = snobj_eval_int(q, "enable");
+	m_name = snobj_eval_str(q, "name");
+
+	if (snobj_eval(q, "ogate"))
+		ogate = snobj_eval_uint(q, "ogate");
+
+	if (m_name) {
+		if ((m = find_module(m_name)) == NULL)
+			return snobj_err(ENOENT, "No module '%s' found", 
+					m_name);
+
+		if (ogate >= 0 && !is_active_gate(&m->ogates, ogate))
+			return snobj_err(EINVAL, "Output gate '%d' does not "
+					"exist", ogate);
+
+		track_module_gates(m, ogate, enable);
+	} else {
+		int cnt = 1;
+		int offset;
+
+		for (offset = 0; cnt != 0; offset += cnt) {
+			const int arr_size = 16;
+			const struct module *modules[arr_size];
+
+			cnt = list_modules(modules, arr_size, offset);
+
+			for (int i = 0; i < cnt; i++)
+				track_module_gates((struct module *)modules[i],
+						ogate, enable);
+		}
+	}
+
+	return NULL;
+}
+
+static void latency_module_gates(struct module *m, int ogate, int enable,
+		int precision)
+{
+	for (int i = 0; i < m->ogates.curr_size; i++) {
+		if (ogate >= 0 && i != ogate)
+			continue;
+
+		if (!is_active_gate(&m->ogates, i))
+			continue;
+
+		/* already in the desired state is not an error */
+		if (enable)
+			enable_latency(m, i, precision);
+		else
+			disable_latency(m, i);
+	}
+}
+
+/* Enable or disable latency probes, as with track_gate. Probes should be
+ * placed on consecutive gates of a path, so that each measures a hop */
+static struct snobj *handle_latency_gate(struct snobj *q)
+{
+	const char *m_name;
+	int enable;
+	int ogate = -1;
+	int precision = HISTO_DEFAULT_SUB_BITS;
+
+	struct module *m;
+
+	enable = snobj_eval_int(q, "enable");
+	m_name = snobj_eval_str(q, "name");
+
+	if (snobj_eval(q, "ogate"))
+		ogate = snobj_eval_uint(q, "ogate");
+
+	if (snobj_eval(q, "precision"))
+		precision = snobj_eval_int(q, "precision");
+
+	if (precision < HISTO_MIN_SUB_BITS || precision > HISTO_MAX_SUB_BITS)
+		return snobj_err(EINVAL, "'precision' must be %d-%d (bits)",
+				HISTO_MIN_SUB_BITS, HISTO_MAX_SUB_BITS);
+
+	if (m_name) {
+		if ((m = find_module(m_name)) == NULL)
+			return snobj_err(ENOENT, "No module '%s' found", 
+					m_name);
+
+		if (ogate >= 0 && !is_active_gate(&m->ogates, ogate))
+			return snobj_err(EINVAL, "Output gate '%d' does not "
+					"exist", ogate);
+
+		latency_module_gates(m, ogate, enable, precision);
+	} else {
+		int cnt = 1;
+		int offset;
+
+		for (offset = 0; cnt != 0; offset += cnt) {
+			const int arr_size = 16;
+			const struct module *modules[arr_size];
+
+			cnt = list_modules(modules, arr_size, offset);
+
+			for (int i = 0; i < cnt; i++)
+				latency_module_gates(
+						(struct module *)modules[i],
+						ogate, enable, precision);
+		}
+	}
+
+	return NULL;
+}
+
+/* the histograms of all workers, merged */
+static struct snobj *latency_to_snobj(struct latency_hook *l, int reset)
+{
+	struct snobj *r;
+	struct histogram *hist;
+	uint64_t untagged = 0;
+
+	hist = malloc(histo_size(l->precision, HISTO_DEFAULT_MAX_BITS));
+	if (!hist)
+		return NULL;
+
+	histo_init(hist, l->precision, HISTO_DEFAULT_MAX_BITS);
+
+	for (int wid = 0; wid < MAX_WORKERS; wid++) {
+		struct latency_worker *w = &l->workers[wid];
+
+		untagged += w->untagged;
+		histo_merge(hist, w->hist);
+
+		/* racy with the worker, as Measure's clear */
+		if (reset) {
+			w->untagged = 0;
+			histo_reset(w->hist);
+		}
+	}
+
+	r = snobj_map();
+	snobj_map_set(r, "count", snobj_uint(hist->count));
+	snobj_map_set(r, "untagged", snobj_uint(untagged));
+	snobj_map_set(r, "min_ns",
+			snobj_uint(hist->count ? tsc_to_ns(hist->min) : 0));
+	snobj_map_set(r, "avg_ns",
+			snobj_uint(hist->count ?
+				tsc_to_ns(hist->sum / hist->count) : 0));
+	snobj_map_set(r, "max_ns", snobj_uint(tsc_to_ns(hist->max)));
+	snobj_map_set(r, "p50_ns",
+			snobj_uint(tsc_to_ns(histo_percentile(hist, 50))));
+	snobj_map_set(r, "p99_ns",
+			snobj_uint(tsc_to_ns(histo_percentile(hist, 99))));
+	snobj_map_set(r, "p999_ns",
+			snobj_uint(tsc_to_ns(histo_percentile(hist, 99.9))));
+
+	free(hist);
+
+	return r;
+}
+
+/* All latency probes, each with the time since the previous probe on the
+ * path of the packets. With "reset", the histograms are cleared after */
+static struct snobj *handle_get_latency(struct snobj *q)
+{
+	struct snobj *r = snobj_list();
+	int reset = snobj_eval_int(q, "reset");
+
+	int cnt = 1;
+	int offset;
+
+	for (offset = 0; cnt != 0; offset += cnt) {
+		const int arr_size = 16;
+		const struct module *modules[arr_size];
+
+		cnt = list_modules(modules, arr_size, offset);
+
+		for (int i = 0; i < cnt; i++) {
+			const struct module *m = modules[i];
+
+			for (int j = 0; j < m->ogates.curr_size; j++) {
+				struct gate *g = m->ogates.arr[j];
+				struct gate_hook *hook;
+				struct snobj *probe;
+				struct snobj *stats;
+
+				if (!g)
+					continue;
+
+				hook = find_gate_hook(g, LATENCY_HOOK_NAME);
+				if (!hook)
+					continue;
+
+				stats = latency_to_snobj(container_of(hook,
+						struct latency_hook, hook),
+						reset);
+				if (!stats) {
+					snobj_free(r);
+					return snobj_errno(ENOMEM);
+				}
+
+				probe = snobj_map();
+				snobj_map_set(probe, "name", 
+						snobj_str(m->name));
+				snobj_map_set(probe, "ogate", snobj_uint(j));
+				snobj_map_set(probe, "next", 
+						snobj_str(g->out.igate->m->name));
+				snobj_map_set(probe, "latency", stats);
+				snobj_list_add(r, probe);
+			}
+		}
+	}
+
+	return r;
+}
+
+/* min_size 0 disables it */
+static struct snobj *handle_compact_gate(struct snobj *q)
+{
+	const char *m_name;
+	int ogate = 0;
+	int min_size;
+	int ret;
+
+	struct module *m;
+
+	m_name = snobj_eval_str(q, "name");
+	if (!m_name)
+		return snobj_err(EINVAL, "Missing 'name' field");
+
+	if ((m = find_module(m_name)) == NULL)
+		return snobj_err(ENOENT, "No module '%s' found", m_name);
+
+	if (snobj_eval(q, "ogate"))
+		ogate = snobj_eval_uint(q, "ogate");
+
+	if (!is_active_gate(&m->ogates, ogate))
+		return snobj_err(EINVAL, "Output gate '%d' does not exist", 
+				ogate);
+
+	min_size = snobj_eval_int(q, "min_size");
+
+	if (min_size == 0) {
+		ret = disable_compaction(m, ogate);
+		if (ret == -ENOENT)
+			return NULL;
+	} else {
+		ret = enable_compaction(m, ogate, min_size);
+		if (ret == -EINVAL)
+			return snobj_err(EINVAL, "'min_size' must be between "
+					"2 and %d", MAX_PKT_BURST);
 	}
 
+	if (ret < 0)
+		return snobj_errno(-ret);
+
 	return NULL;
 }
 
@@ -914,7 +2154,9 @@ static struct snobj *handle_enable_tcpdump(struct snobj *q)
 {
 	const char *m_name;
 	const char *fifo;
+	const char *ring;
 	gate_idx_t ogate;
+	uint32_t sample = 1;
 
 	struct module *m;
 
@@ -923,6 +2165,7 @@ static struct snobj *handle_enable_tcpdump(struct snobj *q)
 	m_name = snobj_eval_str(q, "name");
 	ogate = snobj_eval_uint(q, "ogate");
 	fifo = snobj_eval_str(q, "fifo");
+	ring = snobj_eval_str(q, "ring");
 
 	if (!m_name)
 		return snobj_err(EINVAL, "Missing 'name' field");
@@ -934,7 +2177,26 @@ static struct snobj *handle_enable_tcpdump(struct snobj *q)
 		return snobj_err(EINVAL, "Output gate '%hu' does not exist", 
 				ogate);
 
-	ret = enable_tcpdump(fifo, m, ogate);
+	if (snobj_eval_exists(q, "sample"))
+		sample = snobj_eval_uint(q, "sample");
+
+	if (ring) {
+		/* about 8MB by default */
+		uint32_t snaplen = 2048;
+		uint32_t slots = 4096;
+
+		if (snobj_eval_exists(q, "snaplen"))
+			snaplen = snobj_eval_uint(q, "snaplen");
+		if (snobj_eval_exists(q, "slots"))
+			slots = snobj_eval_uint(q, "slots");
+
+		ret = enable_tcpdump_ring(ring, m, ogate, snaplen, slots, 
+				sample);
+	} else if (fifo)
+		ret = enable_tcpdump(fifo, m, ogate, sample);
+	else
+		return snobj_err(EINVAL, "Either 'fifo' or 'ring' must be "
+				"given");
 
 	if (ret < 0) {
 		return snobj_err(-ret, "Enabling tcpdump %s:%d failed",
@@ -975,13 +2237,1125 @@ static struct snobj *handle_disable_tcpdump(struct snobj *q)
 	return NULL;
 }
 
-/* Adding this mostly to provide a reasonable way to exit when daemonized */
-static struct snobj *handle_kill_bess(struct snobj *q)
+static struct snobj *handle_enable_pmu(struct snobj *q)
 {
-	log_notice("Halt requested by a client\n");
-	exit(EXIT_SUCCESS);
+	int ret = enable_pmu();
 
-	/* Never called */
+	if (ret < 0)
+		return snobj_err(-ret, "Opening hardware counters failed "
+				"(see perf_event_open(2))");
+
+	return NULL;
+}
+
+static struct snobj *handle_disable_pmu(struct snobj *q)
+{
+	disable_pmu();
+
+	return NULL;
+}
+
+/* Pipeline snapshots. A snapshot is a batch request (see
+ * handle_snobj_batch()) that rebuilds the pipeline on an empty daemon:
+ * workers, ports and modules with their init arguments, module state
+ * (mclass->get_snapshot), connections, TCs, and task attachments. It is
+ * stored snobj-encoded after a snapshot_hdr, and restored in-process, in a
+ * single pass with the workers paused, without any RPC round trip.
+ * Modules with an "add" command (e.g., tables) but no get_snapshot come
+ * back as created by their init argument only. They are reported as
+ * 'incomplete' when the snapshot is saved. */
+
+#define SNAPSHOT_MAGIC		0x50414e5353534542ul	/* "BESSSNAP" */
+#define SNAPSHOT_VERSION	1
+
+struct snapshot_hdr {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t size;		/* of the encoded batch request */
+};
+
+static struct snobj *dispatch_request(struct snobj *q, int nested);
+static struct snobj *bess_request(const char *cmd, struct snobj *arg);
+
+static void snapshot_add(struct snobj *requests, const char *cmd,
+		struct snobj *arg)
+{
+	snobj_list_add(requests, bess_request(cmd, arg));
+}
+
+/* arg may be NULL */
+static void snapshot_set_arg(struct snobj *q, struct snobj *arg)
+{
+	if (!arg)
+		return;
+
+	snobj_acquire(arg);
+	snobj_map_set(q, "arg", arg);
+}
+
+static void snapshot_workers(struct snobj *requests)
+{
+	for (int wid = 0; wid < MAX_WORKERS; wid++) {
+		struct snobj *arg;
+		struct snobj *cores;
+
+		if (!is_worker_active(wid))
+			continue;
+
+		cores = snobj_list();
+		for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+			if (CPU_ISSET(cpu, &workers[wid]->cpuset))
+				snobj_list_add(cores, snobj_int(cpu));
+
+		arg = snobj_map();
+		snobj_map_set(arg, "wid", snobj_int(wid));
+		snobj_map_set(arg, "core", cores);
+		snobj_map_set(arg, "throttle", snobj_str(
+			throttle_mode_names[workers[wid]->s->throttle_mode]));
+
+		snapshot_add(requests, "add_worker", arg);
+	}
+}
+
+static void snapshot_ports(struct snobj *requests)
+{
+	struct ns_iter iter;
+	struct port *p;
+
+	ns_init_iterator(&iter, NS_TYPE_PORT);
+
+	while ((p = (struct port *)ns_next(&iter)) != NULL) {
+		struct snobj *arg = snobj_map();
+
+		snobj_map_set(arg, "driver", snobj_str(p->driver->name));
+		snobj_map_set(arg, "name", snobj_str(p->name));
+		snapshot_set_arg(arg, p->arg);
+
+		snapshot_add(requests, "create_port", arg);
+	}
+
+	ns_release_iterator(&iter);
+}
+
+/* has state set by commands that get_snapshot would have to capture */
+static int is_snapshot_incomplete(const struct module *m)
+{
+	const struct mclass *mclass = m->mclass;
+
+	if (mclass->get_snapshot)
+		return 0;
+
+	for (int i = 0; i < MAX_COMMANDS && mclass->commands[i].cmd; i++)
+		if (strcmp(mclass->commands[i].cmd, "add") == 0)
+			return 1;
+
+	return 0;
+}
+
+static int snapshot_module(struct snobj *requests, struct module *m)
+{
+	struct snobj *arg = snobj_map();
+
+	snobj_map_set(arg, "mclass", snobj_str(m->mclass->name));
+	snobj_map_set(arg, "name", snobj_str(m->name));
+	if (m->socket != SOCKET_ID_ANY)
+		snobj_map_set(arg, "socket", snobj_int(m->socket));
+	snapshot_set_arg(arg, m->arg);
+
+	snapshot_add(requests, "create_module", arg);
+
+	if (m->mclass->get_snapshot) {
+		struct snobj *cmds = m->mclass->get_snapshot(m);
+
+		if (snobj_type(cmds) != TYPE_LIST) {
+			snobj_free(cmds);
+			return -EINVAL;
+		}
+
+		for (int i = 0; i < cmds->size; i++) {
+			struct snobj *c = snobj_list_get(cmds, i);
+			struct snobj *q = snobj_map();
+
+			snobj_map_set(q, "to", snobj_str("module"));
+			snobj_map_set(q, "name", snobj_str(m->name));
+			snobj_map_set(q, "cmd", 
+					snobj_str(snobj_eval_str(c, "cmd")));
+			snapshot_set_arg(q, snobj_eval(c, "arg"));
+
+			snobj_list_add(requests, q);
+		}
+
+		snobj_free(cmds);
+	}
+
+	return 0;
+}
+
+static void snapshot_connections(struct snobj *requests, struct module *m)
+{
+	for (int i = 0; i < m->ogates.curr_size; i++) {
+		struct gate *g;
+		struct snobj *arg;
+
+		if (!is_active_gate(&m->ogates, i))
+			continue;
+
+		g = m->ogates.arr[i];
+
+		arg = snobj_map();
+		snobj_map_set(arg, "m1", snobj_str(m->name));
+		snobj_map_set(arg, "m2", snobj_str(g->out.igate->m->name));
+		snobj_map_set(arg, "ogate", snobj_uint(i));
+		snobj_map_set(arg, "igate", 
+				snobj_uint(g->out.igate->gate_idx));
+
+		snapshot_add(requests, "connect_modules", arg);
+
+		if (g->compact) {
+			arg = snobj_map();
+			snobj_map_set(arg, "name", snobj_str(m->name));
+			snobj_map_set(arg, "ogate", snobj_uint(i));
+			snobj_map_set(arg, "min_size", 
+					snobj_int(g->compact->min_size));
+
+			snapshot_add(requests, "compact_gate", arg);
+		}
+	}
+}
+
+static struct snobj *snapshot_resources(const uint64_t *vals)
+{
+	struct snobj *r = snobj_map();
+
+	for (int i = 0; i < NUM_RESOURCES; i++)
+		if (vals[i])
+			snobj_map_set(r, resource_names[i], snobj_uint(vals[i]));
+
+	return r;
+}
+
+/* auto-generated (default) TCs are created again by attach_task */
+static void snapshot_tcs(struct snobj *requests)
+{
+	struct ns_iter iter;
+	struct tc *c;
+
+	ns_init_iterator(&iter, NS_TYPE_TC);
+
+	while ((c = (struct tc *)ns_next(&iter)) != NULL) {
+		struct snobj *arg;
+		int wid = sched_to_wid(c->s);
+
+		if (c->settings.auto_free || wid >= MAX_WORKERS)
+			continue;
+
+		arg = snobj_map();
+		snobj_map_set(arg, "name", snobj_str(c->settings.name));
+		snobj_map_set(arg, "wid", snobj_int(wid));
+		snobj_map_set(arg, "priority", 
+				snobj_int(c->settings.priority));
+		snobj_map_set(arg, "pinned", snobj_int(c->settings.pinned));
+		snobj_map_set(arg, "max_delay_us", 
+				snobj_uint(c->settings.max_delay_us));
+		snobj_map_set(arg, "max_run_us", 
+				snobj_uint(c->settings.max_run_us));
+		snobj_map_set(arg, "wait_stats", 
+				snobj_int(!c->settings.no_wait_hist));
+		snobj_map_set(arg, "limit", 
+				snapshot_resources(c->settings.limit));
+		snobj_map_set(arg, "max_burst", 
+				snapshot_resources(c->settings.max_burst));
+
+		snapshot_add(requests, "add_tc", arg);
+	}
+
+	ns_release_iterator(&iter);
+}
+
+static void snapshot_tasks(struct snobj *requests, struct module *m)
+{
+	for (task_id_t id = 0; id < MAX_TASKS_PER_MODULE; id++) {
+		struct task *t = m->tasks[id];
+		struct snobj *arg;
+		int wid;
+
+		if (!t || !task_is_attached(t))
+			continue;
+
+		wid = sched_to_wid(t->c->s);
+		if (wid >= MAX_WORKERS)
+			continue;
+
+		arg = snobj_map();
+		snobj_map_set(arg, "name", snobj_str(m->name));
+		snobj_map_set(arg, "taskid", snobj_uint(id));
+		snobj_map_set(arg, "pinned", snobj_int(t->pinned));
+
+		if (t->c->settings.auto_free)
+			snobj_map_set(arg, "wid", snobj_int(wid));
+		else
+			snobj_map_set(arg, "tc", 
+					snobj_str(t->c->settings.name));
+
+		snapshot_add(requests, "attach_task", arg);
+	}
+}
+
+static void snapshot_owner(struct snobj *requests, struct module *m)
+{
+	struct snobj *arg;
+
+	if (!m->owner_tc)
+		return;
+
+	arg = snobj_map();
+	snobj_map_set(arg, "name", snobj_str(m->name));
+	snobj_map_set(arg, "tc", snobj_str(m->owner_tc->settings.name));
+
+	snapshot_add(requests, "set_module_tc", arg);
+}
+
+/* Modules are iterated in creation order, so that any module is created
+ * after those it may depend on (as in the original script).
+ * The names of the modules not fully captured are added to incomplete */
+static struct snobj *take_snapshot(struct snobj *incomplete)
+{
+	struct snobj *requests = snobj_list();
+	struct snobj *q;
+
+	struct ns_iter iter;
+	struct module *m;
+	int ret = 0;
+
+	snapshot_workers(requests);
+	snapshot_ports(requests);
+
+	ns_init_iterator(&iter, NS_TYPE_MODULE);
+	while (ret == 0 && (m = (struct module *)ns_next(&iter)) != NULL) {
+		ret = snapshot_module(requests, m);
+
+		if (is_snapshot_incomplete(m)) {
+			log_warn("snapshot: the state of module '%s' (%s) "
+					"is not captured\n",
+					m->name, m->mclass->name);
+			snobj_list_add(incomplete, snobj_str(m->name));
+		}
+	}
+	ns_release_iterator(&iter);
+
+	if (ret < 0) {
+		snobj_free(requests);
+		return snobj_err(-ret, "Module '%s' cannot be snapshotted", 
+				m->name);
+	}
+
+	ns_init_iterator(&iter, NS_TYPE_MODULE);
+	while ((m = (struct module *)ns_next(&iter)) != NULL)
+		snapshot_connections(requests, m);
+	ns_release_iterator(&iter);
+
+	snapshot_tcs(requests);
+
+	ns_init_iterator(&iter, NS_TYPE_MODULE);
+	while ((m = (struct module *)ns_next(&iter)) != NULL) {
+		snapshot_tasks(requests, m);
+		snapshot_owner(requests, m);
+	}
+	ns_release_iterator(&iter);
+
+	q = snobj_map();
+	snobj_map_set(q, "to", snobj_str("batch"));
+	snobj_map_set(q, "requests", requests);
+
+	return q;
+}
+
+static struct snobj *handle_save_snapshot(struct snobj *q)
+{
+	struct snapshot_hdr hdr;
+	const char *path;
+	char tmp_path[PATH_MAX];
+
+	struct snobj *snapshot;
+	struct snobj *incomplete;
+	struct snobj *r;
+	char *buf;
+	size_t size;
+	int num_requests;
+	int fd;
+
+	path = snobj_eval_str(q, "path");
+	if (!path)
+		return snobj_err(EINVAL, "Missing 'path' field");
+
+	if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= 
+			(int)sizeof(tmp_path))
+		return snobj_err(ENAMETOOLONG, "'path' is too long");
+
+	incomplete = snobj_list();
+
+	snapshot = take_snapshot(incomplete);
+	if (snobj_eval_exists(snapshot, "err")) {
+		snobj_free(incomplete);
+		return snapshot;
+	}
+
+	num_requests = snobj_eval(snapshot, "requests")->size;
+
+	size = snobj_encode(snapshot, &buf, 1048576);
+	snobj_free(snapshot);
+	if (size == 0) {
+		snobj_free(incomplete);
+		return snobj_err(ENOMEM, "Encoding the snapshot failed");
+	}
+
+	if (size > UINT32_MAX) {
+		free(buf);
+		snobj_free(incomplete);
+		return snobj_err(EFBIG, "The snapshot is too large");
+	}
+
+	hdr.magic = SNAPSHOT_MAGIC;
+	hdr.version = SNAPSHOT_VERSION;
+	hdr.size = size;
+
+	/* written aside first, so that a crash leaves the old one intact */
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		int err = errno;
+
+		free(buf);
+		snobj_free(incomplete);
+		return snobj_err(err, "open(%s) failed: %s", tmp_path,
+				strerror(err));
+	}
+
+	errno = 0;
+	if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+			write(fd, buf, size) != size || fsync(fd) < 0) {
+		int err = errno ? : EIO;
+
+		free(buf);
+		close(fd);
+		unlink(tmp_path);
+		snobj_free(incomplete);
+		return snobj_err(err, "Writing %s failed: %s", tmp_path,
+				strerror(err));
+	}
+
+	free(buf);
+	close(fd);
+
+	if (rename(tmp_path, path) < 0) {
+		int err = errno;
+
+		unlink(tmp_path);
+		snobj_free(incomplete);
+		return snobj_err(err, "rename(%s) failed: %s", path,
+				strerror(err));
+	}
+
+	r = snobj_map();
+	snobj_map_set(r, "requests", snobj_int(num_requests));
+	snobj_map_set(r, "bytes", snobj_uint(sizeof(hdr) + size));
+	snobj_map_set(r, "incomplete", incomplete);
+
+	return r;
+}
+
+static struct snobj *load_snapshot(const char *path)
+{
+	struct snapshot_hdr hdr;
+	struct snobj *q;
+	char *buf;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return snobj_err(errno, "open(%s) failed: %s", path,
+				strerror(errno));
+
+	if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+			hdr.magic != SNAPSHOT_MAGIC) {
+		close(fd);
+		return snobj_err(EINVAL, "%s is not a snapshot", path);
+	}
+
+	if (hdr.version != SNAPSHOT_VERSION) {
+		close(fd);
+		return snobj_err(EINVAL, "%s has version %u, not %d", path,
+				hdr.version, SNAPSHOT_VERSION);
+	}
+
+	buf = malloc(hdr.size);
+	if (!buf) {
+		close(fd);
+		return snobj_errno(ENOMEM);
+	}
+
+	if (read(fd, buf, hdr.size) != hdr.size) {
+		free(buf);
+		close(fd);
+		return snobj_err(EINVAL, "%s is truncated", path);
+	}
+
+	close(fd);
+
+	q = snobj_decode(buf, hdr.size);
+	free(buf);
+
+	if (!q || snobj_type(q) != TYPE_MAP) {
+		if (q)
+			snobj_free(q);
+		return snobj_err(EINVAL, "%s is corrupted", path);
+	}
+
+	return q;
+}
+
+/* Only on an empty daemon. Workers are launched paused and resumed once
+ * the whole pipeline is in place */
+struct snobj *restore_snapshot(const char *path)
+{
+	const struct module *m;
+	const struct port *p;
+
+	struct snobj *q;
+	struct snobj *r;
+
+	uint64_t start = rdtsc();
+	int num_requests;
+
+	if (num_workers > 0 || list_modules(&m, 1, 0) > 0 || 
+			list_ports(&p, 1, 0) > 0)
+		return snobj_err(EBUSY, "The pipeline is not empty");
+
+	q = load_snapshot(path);
+	if (snobj_eval_exists(q, "err"))
+		return q;
+
+	num_requests = snobj_eval(q, "requests") ? 
+			snobj_eval(q, "requests")->size : 0;
+
+	r = dispatch_request(q, 0);
+	snobj_free(q);
+
+	if (snobj_eval_exists(r, "err"))
+		return r;
+
+	snobj_free(r);
+
+	if (num_workers > 0)
+		resume_all_workers();
+
+	r = snobj_map();
+	snobj_map_set(r, "requests", snobj_int(num_requests));
+	snobj_map_set(r, "elapsed_us", 
+			snobj_double(tsc_to_us(rdtsc() - start)));
+
+	log_info("Restored %d requests from %s in %.1f ms\n", num_requests,
+			path, tsc_to_us(rdtsc() - start) / 1000.0);
+
+	return r;
+}
+
+static struct snobj *handle_restore_snapshot(struct snobj *q)
+{
+	const char *path;
+
+	path = snobj_eval_str(q, "path");
+	if (!path)
+		return snobj_err(EINVAL, "Missing 'path' field");
+
+	return restore_snapshot(path);
+}
+
+/* creates a module of the mclass only for the benchmark (module_bench.h) */
+static struct snobj *handle_bench_module(struct snobj *q)
+{
+	const char *mclass_name;
+	const struct mclass *mclass;
+	struct module *m;
+
+	struct module_bench_cfg cfg = {
+		.batch_size = MAX_PKT_BURST,
+		.pkt_size = 60,
+		.num_flows = 1,
+		.num_batches = 100000,
+	};
+	struct module_bench_result res = {};
+
+	struct snobj *r;
+	int wid = -1;
+	int ret;
+
+	mclass_name = snobj_eval_str(q, "mclass");
+	if (!mclass_name)
+		return snobj_err(EINVAL, "Missing 'mclass' field");
+
+	mclass = find_mclass(mclass_name);
+	if (!mclass)
+		return snobj_err(ENOENT, "No mclass '%s' found", mclass_name);
+
+	if (!mclass->process_batch || mclass->num_igates == 0)
+		return snobj_err(ENOTSUP, "mclass '%s' does not take packets",
+				mclass_name);
+
+	if (snobj_eval_exists(q, "batch_size"))
+		cfg.batch_size = snobj_eval_int(q, "batch_size");
+	if (snobj_eval_exists(q, "pkt_size"))
+		cfg.pkt_size = snobj_eval_int(q, "pkt_size");
+	if (snobj_eval_exists(q, "flows"))
+		cfg.num_flows = snobj_eval_uint(q, "flows");
+	if (snobj_eval_exists(q, "batches"))
+		cfg.num_batches = snobj_eval_uint(q, "batches");
+
+	if (cfg.batch_size < 1 || cfg.batch_size > MAX_PKT_BURST)
+		return snobj_err(EINVAL, "'batch_size' must be 1-%d",
+				MAX_PKT_BURST);
+	if (cfg.pkt_size < 60 || cfg.pkt_size > SNBUF_DATA)
+		return snobj_err(EINVAL, "'pkt_size' must be 60-%d",
+				SNBUF_DATA);
+	if (cfg.num_flows < 1 || cfg.num_flows > BENCH_MAX_FLOWS)
+		return snobj_err(EINVAL, "'flows' must be 1-%d",
+				BENCH_MAX_FLOWS);
+	if (cfg.num_batches < 1 || cfg.num_batches > BENCH_MAX_BATCHES)
+		return snobj_err(EINVAL, "'batches' must be 1-%d",
+				BENCH_MAX_BATCHES);
+
+	if (snobj_eval_exists(q, "wid")) {
+		wid = snobj_eval_int(q, "wid");
+		if (wid < 0 || wid >= MAX_WORKERS || !is_worker_active(wid))
+			return snobj_err(EINVAL, "worker:%d does not exist",
+					wid);
+
+		if (!is_worker_running(wid))
+			return snobj_err(EBUSY, "worker:%d is not running", 
+					wid);
+	} else {
+		for (int i = 0; i < MAX_WORKERS; i++)
+			if (is_worker_running(i)) {
+				wid = i;
+				break;
+			}
+
+		if (wid < 0)
+			return snobj_err(EBUSY, "There is no running worker");
+	}
+
+	m = create_module(NULL, mclass, snobj_eval(q, "arg"),
+			workers[wid]->socket, &r);
+	if (!m)
+		return r;
+
+	ret = bench_module(m, wid, &cfg, &res);
+
+	/* its tasks, if any, have never been attached */
+	destroy_module(m);
+
+	if (ret < 0)
+		return snobj_err(-ret, "Benchmark of '%s' failed", mclass_name);
+
+	r = snobj_map();
+	snobj_map_set(r, "mclass", snobj_str(mclass_name));
+	snobj_map_set(r, "wid", snobj_int(wid));
+	snobj_map_set(r, "batches", snobj_uint(res.batches));
+	snobj_map_set(r, "packets", snobj_uint(res.packets));
+	snobj_map_set(r, "cycles", snobj_uint(res.cycles));
+	snobj_map_set(r, "base_cycles", snobj_uint(res.base_cycles));
+
+	{
+		/* the module alone, without the Sink */
+		double cycles = res.cycles > res.base_cycles ?
+			res.cycles - res.base_cycles : 0;
+
+		snobj_map_set(r, "cycles_per_batch",
+				snobj_double(cycles / res.batches));
+		snobj_map_set(r, "cycles_per_packet",
+				snobj_double(cycles / res.packets));
+		snobj_map_set(r, "ns_per_packet",
+				snobj_double(tsc_to_us(cycles) * 1000.0 /
+					res.packets));
+	}
+
+	return r;
+}
+
+static struct snobj *handle_start_trace(struct snobj *q)
+{
+	uint64_t duration_us = 1000;
+	uint64_t events = 65536;
+
+	int ret;
+
+	if (snobj_eval_exists(q, "duration_us"))
+		duration_us = snobj_eval_uint(q, "duration_us");
+	if (snobj_eval_exists(q, "events"))
+		events = snobj_eval_uint(q, "events");
+
+	if (duration_us == 0 || duration_us > 10000000)
+		return snobj_err(EINVAL, "'duration_us' must be 1-10000000");
+
+	if (events > (1 << 24))
+		return snobj_err(EINVAL, "'events' must be up to %d", 1 << 24);
+
+	ret = start_trace(duration_us * 1000, events);
+	if (ret == -EINVAL)
+		return snobj_err(EINVAL, "'events' must be a power of 2");
+	if (ret == -EBUSY)
+		return snobj_err(EBUSY, "A trace exists already. "
+				"Use get_trace to take and clear it");
+	if (ret < 0)
+		return snobj_errno(-ret);
+
+	return NULL;
+}
+
+/* index in the module list, or -1 if destroyed since its events */
+static int trace_module_idx(const struct module **arr, int n, 
+		const struct module *m, int *hint)
+{
+	if (*hint < n && arr[*hint] == m)
+		return *hint;
+
+	for (int i = 0; i < n; i++)
+		if (arr[i] == m) {
+			*hint = i;
+			return i;
+		}
+
+	return -1;
+}
+
+/* Each event field is a list (packed on the wire), oldest first, with
+ * tsc relative to start_tsc. The rings are freed afterwards */
+static struct snobj *handle_get_trace(struct snobj *q)
+{
+	const struct module **arr;
+	size_t arr_slots = 1024;
+	struct snobj *r;
+	struct snobj *modules;
+	struct snobj *wlist;
+	int num_modules = 0;
+	int cnt = 1;
+
+	stop_trace();
+
+	arr = malloc(arr_slots * sizeof(*arr));
+	modules = snobj_list();
+
+	while (cnt != 0) {
+		const int arr_size = 16;
+
+		if (num_modules + arr_size > arr_slots) {
+			arr_slots *= 2;
+			arr = realloc(arr, arr_slots * sizeof(*arr));
+		}
+
+		cnt = list_modules(arr + num_modules, arr_size, num_modules);
+
+		for (int i = 0; i < cnt; i++)
+			snobj_list_add(modules, 
+					snobj_str(arr[num_modules + i]->name));
+
+		num_modules += cnt;
+	}
+
+	wlist = snobj_list();
+
+	for (int wid = 0; wid < MAX_WORKERS; wid++) {
+		const struct trace_ring *t = get_trace(wid);
+		struct snobj *w;
+		struct snobj *fields[6];
+		uint64_t first;
+		int hint = 0;
+
+		if (!t)
+			continue;
+
+		first = t->head > t->mask ? t->head - t->mask - 1 : 0;
+
+		for (int i = 0; i < 6; i++)
+			fields[i] = snobj_list();
+
+		for (uint64_t i = first; i < t->head; i++) {
+			const struct trace_event *e = &t->events[i & t->mask];
+
+			snobj_list_add(fields[0], 
+					snobj_uint(e->tsc - t->start_tsc));
+			snobj_list_add(fields[1], snobj_int(e->type));
+			snobj_list_add(fields[2], snobj_int(trace_module_idx(
+						arr, num_modules, e->m, &hint)));
+			snobj_list_add(fields[3], snobj_int(e->gate));
+			snobj_list_add(fields[4], snobj_int(e->cnt));
+			snobj_list_add(fields[5], snobj_int(e->depth));
+		}
+
+		w = snobj_map();
+		snobj_map_set(w, "wid", snobj_int(wid));
+		snobj_map_set(w, "start_tsc", snobj_uint(t->start_tsc));
+		snobj_map_set(w, "recorded", snobj_uint(t->head));
+		snobj_map_set(w, "lost", snobj_uint(first));
+		snobj_map_set(w, "tsc", fields[0]);
+		snobj_map_set(w, "type", fields[1]);
+		snobj_map_set(w, "module", fields[2]);
+		snobj_map_set(w, "gate", fields[3]);
+		snobj_map_set(w, "cnt", fields[4]);
+		snobj_map_set(w, "depth", fields[5]);
+
+		snobj_list_add(wlist, w);
+	}
+
+	free(arr);
+	free_trace();
+
+	r = snobj_map();
+	snobj_map_set(r, "tsc_hz", snobj_uint(tsc_hz));
+	snobj_map_set(r, "modules", modules);
+	snobj_map_set(r, "workers", wlist);
+
+	return r;
+}
+
+static struct snobj *handle_enable_telemetry(struct snobj *q)
+{
+	const char *path;
+	uint64_t interval_ms = 1000;
+
+	int ret;
+
+	path = snobj_eval_str(q, "path");
+	if (!path)
+		return snobj_err(EINVAL, "Missing 'path' field");
+
+	if (snobj_eval_exists(q, "interval_ms"))
+		interval_ms = snobj_eval_uint(q, "interval_ms");
+
+	if (interval_ms < MASTER_TICK_MS)
+		return snobj_err(EINVAL, "'interval_ms' must be at least %d",
+				MASTER_TICK_MS);
+
+	ret = enable_telemetry(path, interval_ms * 1000000);
+	if (ret < 0)
+		return snobj_err(-ret, "Enabling telemetry on '%s' failed",
+				path);
+
+	return NULL;
+}
+
+static struct snobj *handle_disable_telemetry(struct snobj *q)
+{
+	disable_telemetry();
+
+	return NULL;
+}
+
+static struct snobj *topo_socket_to_snobj(int sid)
+{
+	const struct topo_socket *s = &topo.sockets[sid];
+	struct snobj *socket = snobj_map();
+	struct snobj *cores = snobj_list();
+	struct snobj *workers_on = snobj_list();
+	struct snobj *nics = snobj_list();
+	struct snobj *ports_on = snobj_list();
+	struct snobj *hp;
+
+	int cnt = 1;
+	int offset;
+
+	snobj_map_set(socket, "socket", snobj_int(sid));
+
+	/* as lists of SMT siblings */
+	for (int cpu = 0; cpu < TOPO_MAX_CPUS; cpu++) {
+		struct snobj *core;
+
+		if (!topo.cpus[cpu].present || topo.cpus[cpu].socket != sid ||
+				topo.cpus[cpu].first_sibling != cpu)
+			continue;
+
+		core = snobj_list();
+		for (int i = cpu; i < TOPO_MAX_CPUS; i++)
+			if (topo.cpus[i].present &&
+					topo.cpus[i].first_sibling == cpu)
+				snobj_list_add(core, snobj_int(i));
+
+		snobj_list_add(cores, core);
+	}
+	snobj_map_set(socket, "cores", cores);
+
+	hp = snobj_map();
+	snobj_map_set(hp, "2m_total", snobj_uint(s->hp_2m.total));
+	snobj_map_set(hp, "2m_free", snobj_uint(s->hp_2m.free));
+	snobj_map_set(hp, "1g_total", snobj_uint(s->hp_1g.total));
+	snobj_map_set(hp, "1g_free", snobj_uint(s->hp_1g.free));
+	snobj_map_set(socket, "hugepages", hp);
+
+	snobj_map_set(socket, "mempool",
+			snobj_int(get_pframe_pool_socket(sid) != NULL));
+
+	for (int wid = 0; wid < MAX_WORKERS; wid++)
+		if (is_worker_active(wid) && workers[wid]->socket == sid)
+			snobj_list_add(workers_on, snobj_int(wid));
+	snobj_map_set(socket, "workers", workers_on);
+
+	for (int i = 0; i < topo.num_nics; i++) {
+		struct snobj *nic;
+
+		if (topo.nics[i].socket != sid)
+			continue;
+
+		nic = snobj_map();
+		snobj_map_set(nic, "port_id", snobj_int(i));
+		if (topo.nics[i].pci[0])
+			snobj_map_set(nic, "pci", snobj_str(topo.nics[i].pci));
+		snobj_list_add(nics, nic);
+	}
+	snobj_map_set(socket, "nics", nics);
+
+	for (offset = 0; cnt != 0; offset += cnt) {
+		const int arr_size = 16;
+		const struct port *ports[arr_size];
+
+		cnt = list_ports(ports, arr_size, offset);
+
+		for (int i = 0; i < cnt; i++)
+			if (ports[i]->socket == sid)
+				snobj_list_add(ports_on,
+						snobj_str(ports[i]->name));
+	}
+	snobj_map_set(socket, "ports", ports_on);
+
+	return socket;
+}
+
+static struct snobj *handle_get_topology(struct snobj *q)
+{
+	struct snobj *r = snobj_map();
+	struct snobj *sockets = snobj_list();
+
+	for (int sid = 0; sid < topo.num_sockets; sid++)
+		snobj_list_add(sockets, topo_socket_to_snobj(sid));
+
+	snobj_map_set(r, "num_cpus", snobj_int(topo.num_cpus));
+	snobj_map_set(r, "sockets", sockets);
+
+	return r;
+}
+
+static void placement_warn(struct snobj *warnings, const char *fmt, ...)
+{
+	char buf[256];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+
+	log_warn("auto_place: %s\n", buf);
+	snobj_list_add(warnings, snobj_str(buf));
+}
+
+/* Place the tasks of socket-bound modules (mostly port-bound ones, see
+ * guess_module_socket()) on workers of the same socket. Up to
+ * "workers_per_socket" workers are launched on idle physical cores of
+ * sockets that need them. Packet buffers come from the pool of the socket
+ * of the worker, so mempools follow. Tasks already attached are not moved,
+ * but reported if remote. New workers are paused, as with add_worker,
+ * unless "resume" is given. With "dry_run", nothing is changed. */
+static struct snobj *handle_auto_place(struct snobj *q)
+{
+	int per_socket = 1;
+	int dry_run = snobj_eval_int(q, "dry_run");
+	int resume = snobj_eval_int(q, "resume");
+
+	int demand[RTE_MAX_NUMA_NODES] = {};
+	int num_workers[RTE_MAX_NUMA_NODES] = {};
+	int socket_wids[RTE_MAX_NUMA_NODES][MAX_WORKERS];
+	int rr_next[RTE_MAX_NUMA_NODES] = {};
+	cpu_set_t used;
+
+	struct snobj *r;
+	struct snobj *new_workers = snobj_list();
+	struct snobj *placed = snobj_list();
+	struct snobj *warnings = snobj_list();
+
+	int cnt = 1;
+	int offset;
+
+	if (snobj_eval(q, "workers_per_socket")) {
+		per_socket = snobj_eval_int(q, "workers_per_socket");
+		if (per_socket < 0 || per_socket > MAX_WORKERS)
+			return snobj_err(EINVAL, "'workers_per_socket' must "
+					"be between 0 and %d", MAX_WORKERS);
+	}
+
+	CPU_ZERO(&used);
+	CPU_SET(0, &used);	/* the master and the kernel, usually */
+
+	for (int wid = 0; wid < MAX_WORKERS; wid++) {
+		int sid;
+
+		if (!is_worker_active(wid))
+			continue;
+
+		CPU_OR(&used, &used, &workers[wid]->cpuset);
+
+		sid = workers[wid]->socket;
+		if (sid >= 0 && sid < RTE_MAX_NUMA_NODES)
+			socket_wids[sid][num_workers[sid]++] = wid;
+	}
+
+	for (offset = 0; cnt != 0; offset += cnt) {
+		const int arr_size = 16;
+		const struct module *modules[arr_size];
+
+		cnt = list_modules(modules, arr_size, offset);
+
+		for (int i = 0; i < cnt; i++) {
+			const struct module *m = modules[i];
+
+			if (m->socket < 0 || m->socket >= topo.num_sockets)
+				continue;
+
+			for (int j = 0; j < MAX_TASKS_PER_MODULE; j++)
+				if (m->tasks[j] && !task_is_attached(m->tasks[j]))
+					demand[m->socket]++;
+		}
+	}
+
+	for (int sid = 0; sid < topo.num_sockets; sid++) {
+		int want = MIN(per_socket, demand[sid]);
+
+		if (demand[sid] && !get_pframe_pool_socket(sid))
+			placement_warn(warnings, "socket %d has no packet "
+					"mempool (no hugepages?)", sid);
+
+		while (num_workers[sid] < want) {
+			int wid;
+			int cpu;
+			cpu_set_t cpuset;
+
+			for (wid = 0; wid < MAX_WORKERS; wid++)
+				if (!is_worker_active(wid))
+					break;
+
+			if (wid == MAX_WORKERS) {
+				placement_warn(warnings, "no more workers "
+						"can be added");
+				break;
+			}
+
+			cpu = topo_pick_cpu(sid, &used);
+			if (cpu < 0) {
+				placement_warn(warnings, "no idle core left "
+						"on socket %d", sid);
+				break;
+			}
+
+			CPU_ZERO(&cpuset);
+			add_smt_siblings(&cpuset, cpu);
+			CPU_SET(cpu, &cpuset);
+			CPU_OR(&used, &used, &cpuset);
+
+			if (dry_run) {
+				/* pretend, so that tasks can be planned */
+				wid = MAX_WORKERS + num_workers[sid];
+			} else {
+				launch_worker_cpuset(wid, &cpuset);
+				if (resume)
+					resume_worker(wid);
+			}
+
+			{
+				struct snobj *worker = snobj_map();
+
+				snobj_map_set(worker, "wid", snobj_int(
+						dry_run ? -1 : wid));
+				snobj_map_set(worker, "core", snobj_int(cpu));
+				snobj_map_set(worker, "socket", snobj_int(sid));
+				snobj_list_add(new_workers, worker);
+			}
+
+			socket_wids[sid][num_workers[sid]++] = wid;
+		}
+	}
+
+	for (offset = 0, cnt = 1; cnt != 0; offset += cnt) {
+		const int arr_size = 16;
+		const struct module *modules[arr_size];
+
+		cnt = list_modules(modules, arr_size, offset);
+
+		for (int i = 0; i < cnt; i++) {
+			const struct module *m = modules[i];
+			int sid = m->socket;
+
+			if (sid < 0 || sid >= topo.num_sockets)
+				continue;
+
+			for (int j = 0; j < MAX_TASKS_PER_MODULE; j++) {
+				struct task *t = m->tasks[j];
+				struct tc_update_arg arg = {.t = t};
+				struct snobj *task;
+				int wid;
+
+				if (!t)
+					continue;
+
+				if (task_is_attached(t)) {
+					wid = sched_to_wid(t->c->s);
+					if (wid != MAX_WORKERS && 
+						workers[wid]->socket != sid)
+						placement_warn(warnings, 
+							"task %s:%d is on "
+							"worker %d, not on "
+							"socket %d", m->name,
+							j, wid, sid);
+					continue;
+				}
+
+				if (num_workers[sid] == 0) {
+					placement_warn(warnings, "no worker "
+							"for task %s:%d on "
+							"socket %d", m->name,
+							j, sid);
+					continue;
+				}
+
+				wid = socket_wids[sid][rr_next[sid]++ %
+						num_workers[sid]];
+
+				task = snobj_map();
+				snobj_map_set(task, "name", snobj_str(m->name));
+				snobj_map_set(task, "taskid", snobj_int(j));
+				snobj_map_set(task, "wid", snobj_int(
+						wid < MAX_WORKERS ? wid : -1));
+				snobj_list_add(placed, task);
+
+				if (dry_run)
+					continue;
+
+				arg.s = workers[wid]->s;
+				run_on_worker(wid, do_assign_default_tc, &arg);
+			}
+		}
+	}
+
+	r = snobj_map();
+	snobj_map_set(r, "workers", new_workers);
+	snobj_map_set(r, "tasks", placed);
+	snobj_map_set(r, "warnings", warnings);
+
+	return r;
+}
+
+/* Adding this mostly to provide a reasonable way to exit when daemonized */
+static struct snobj *handle_kill_bess(struct snobj *q)
+{
+	log_notice("Halt requested by a client\n");
+	exit(EXIT_SUCCESS);
+
+	/* Never called */
 	return NULL;
 }
 
@@ -999,40 +3373,67 @@ static struct handler_map sn_handlers[] = {
 	{ "resume_all", 	0, handle_resume_all },
 
 	{ "reset_workers",	1, handle_reset_workers },
-	{ "list_workers",	0, handle_list_workers },
+	{ "list_workers",	0, handle_list_workers, .read_only = 1 },
 	{ "add_worker",		0, handle_add_worker },
+	{ "remove_worker",	0, handle_remove_worker },
 	{ "delete_worker",	1, handle_not_implemented },
+	{ "get_mempool_stats",	0, handle_get_mempool_stats, .read_only = 1 },
+	{ "set_mempool_admission", 0, handle_set_mempool_admission },
+	{ "get_drop_stats",	0, handle_get_drop_stats, .read_only = 1 },
 
 	{ "reset_tcs",		1, handle_reset_tcs },
-	{ "list_tcs",		0, handle_list_tcs },
-	{ "add_tc",		1, handle_add_tc },
-	{ "get_tc_stats",	0, handle_get_tc_stats },
+	{ "list_tcs",		0, handle_list_tcs, .read_only = 1 },
+	{ "add_tc",		0, handle_add_tc },
+	{ "get_tc_stats",	0, handle_get_tc_stats, .read_only = 1 },
 
-	{ "list_drivers",	0, handle_list_drivers },
+	{ "list_drivers",	0, handle_list_drivers, .read_only = 1 },
 	{ "import_driver",	0, handle_not_implemented },	/* TODO */
 
 	{ "reset_ports",	1, handle_reset_ports },
-	{ "list_ports",		0, handle_list_ports },
+	{ "list_ports",		0, handle_list_ports, .read_only = 1 },
 	{ "create_port", 	0, handle_create_port },
+	{ "create_ports", 	0, handle_create_ports },
 	{ "destroy_port",	0, handle_destroy_port },
-	{ "get_port_stats",	0, handle_get_port_stats },
+	{ "get_port_stats",	0, handle_get_port_stats, .read_only = 1 },
 
-	{ "list_mclasses", 	0, handle_list_mclasses },
-	{ "get_mclass_info",	0, handle_get_mclass_info },
+	{ "list_mclasses", 	0, handle_list_mclasses, .read_only = 1 },
+	{ "get_mclass_info",	0, handle_get_mclass_info, .read_only = 1 },
 	{ "import_mclass",	0, handle_not_implemented },	/* TODO */
 
 	{ "reset_modules",	1, handle_reset_modules },
-	{ "list_modules",	0, handle_list_modules },
-	{ "create_module", 	1, handle_create_module },
-	{ "destroy_module", 	1, handle_destroy_module },
-	{ "get_module_info",	0, handle_get_module_info },
-	{ "connect_modules", 	1, handle_connect_modules },
-	{ "disconnect_modules",	1, handle_disconnect_modules },
+	{ "list_modules",	0, handle_list_modules, .read_only = 1 },
+	{ "create_module", 	0, handle_create_module },
+	{ "destroy_module", 	0, handle_destroy_module },
+	{ "get_module_info",	0, handle_get_module_info, .read_only = 1 },
+	{ "connect_modules", 	0, handle_connect_modules },
+	{ "disconnect_modules",	0, handle_disconnect_modules },
 
-	{ "attach_task",	1, handle_attach_task },
+	{ "attach_task",	0, handle_attach_task },
+	{ "set_module_tc",	0, handle_set_module_tc },
 
-	{ "enable_tcpdump",	1, handle_enable_tcpdump },
-	{ "disable_tcpdump",	1, handle_disable_tcpdump },
+	{ "track_gate",		0, handle_track_gate },
+	{ "latency_gate",	0, handle_latency_gate },
+	{ "get_latency",	0, handle_get_latency },
+	{ "compact_gate",	0, handle_compact_gate },
+	{ "enable_tcpdump",	0, handle_enable_tcpdump },
+	{ "disable_tcpdump",	0, handle_disable_tcpdump },
+
+	{ "enable_pmu",		0, handle_enable_pmu },
+	{ "disable_pmu",	0, handle_disable_pmu },
+
+	{ "bench_module",	0, handle_bench_module },
+
+	{ "save_snapshot",	0, handle_save_snapshot },
+	{ "restore_snapshot",	0, handle_restore_snapshot },
+
+	{ "start_trace",	0, handle_start_trace },
+	{ "get_trace",		0, handle_get_trace },
+
+	{ "enable_telemetry",	0, handle_enable_telemetry },
+	{ "disable_telemetry",	0, handle_disable_telemetry },
+
+	{ "get_topology",	0, handle_get_topology, .read_only = 1 },
+	{ "auto_place",		0, handle_auto_place },
 
 	{ "kill_bess",		1, handle_kill_bess },
 
@@ -1122,35 +3523,548 @@ static struct snobj *handle_snobj_module(struct snobj *q)
 		return run_module_command(m, cmd, arg);
 }
 
-struct snobj *handle_request(struct client *c, struct snobj *q)
+static struct snobj *handle_snobj_port(struct snobj *q)
+{
+	const char *p_name;
+	struct port *p;
+	struct snobj *arg;
+
+	p_name = snobj_eval_str(q, "name");
+	if (!p_name)
+		return snobj_err(EINVAL, "Missing port name field 'name'");
+
+	if ((p = find_port(p_name)) == NULL)
+		return snobj_err(ENOENT, "No port '%s' found", p_name);
+
+	if (!p->driver->query)
+		return snobj_err(ENOTSUP, "Driver '%s' does not support "
+				"queries", p->driver->name);
+
+	arg = snobj_eval(q, "arg");
+	if (!arg)
+		return snobj_err(EINVAL, "Missing query field 'arg'");
+
+	return p->driver->query(p, arg);
+}
+
+static struct snobj *handle_snobj_batch(struct snobj *q);
+
+/* NULL normally means "success" */
+static struct snobj *dispatch_request(struct snobj *q, int nested)
 {
-	struct snobj *r = NULL;
 	const char *s;
 
-	if (global_opts.debug_mode) {
-		log_debug("Request:\n");
-		snobj_dump(q);
+	if (q->type != TYPE_MAP)
+		return snobj_err(EINVAL, "The message must be a map");
+
+	s = snobj_eval_str(q, "to");
+	if (!s)
+		return snobj_err(EINVAL, "There is no 'to' field");
+
+	if (strcmp(s, "bess") == 0)
+		return handle_snobj_bess(q);
+	else if (strcmp(s, "module") == 0)
+		return handle_snobj_module(q);
+	else if (strcmp(s, "port") == 0)
+		return handle_snobj_port(q);
+	else if (strcmp(s, "batch") == 0 && !nested)
+		return handle_snobj_batch(q);
+	else
+		return snobj_err(EINVAL, "Unknown destination in 'to': %s", s);
+}
+
+/* Only snobj_err() maps. Successful responses may be lists or scalars too
+ * (e.g., queries of BPF), so these are not errors */
+static int is_error(const struct snobj *r)
+{
+	return r && snobj_type(r) == TYPE_MAP && snobj_eval_exists(r, "err");
+}
+
+static struct snobj *bess_request(const char *cmd, struct snobj *arg)
+{
+	struct snobj *q = snobj_map();
+
+	snobj_map_set(q, "to", snobj_str("bess"));
+	snobj_map_set(q, "cmd", snobj_str(cmd));
+	snobj_map_set(q, "arg", arg);
+
+	return q;
+}
+
+/* The request that reverts q (with the response r), if any. 
+ * *undoable is 0 if q may have changed something that cannot be undone. */
+static struct snobj *
+undo_request(struct snobj *q, struct snobj *r, int *undoable)
+{
+	const char *to = snobj_eval_str(q, "to");
+	const char *cmd = snobj_eval_str(q, "cmd");
+
+	*undoable = 1;
+
+	if (!to || !cmd || strcmp(to, "bess") != 0) {
+		*undoable = 0;
+		return NULL;
+	}
+
+	if (strcmp(cmd, "create_module") == 0 ||
+			strcmp(cmd, "create_port") == 0) {
+		const char *name = snobj_eval_str(r, "name");
+
+		if (!name) {
+			*undoable = 0;
+			return NULL;
+		}
+
+		return bess_request(strcmp(cmd, "create_module") == 0 ?
+				"destroy_module" : "destroy_port", 
+				snobj_str(name));
 	}
 
-	if (q->type != TYPE_MAP) {
-		r = snobj_err(EINVAL, "The message must be a map");
-		goto reply;
+	if (strcmp(cmd, "connect_modules") == 0) {
+		struct snobj *arg = snobj_map();
+
+		snobj_map_set(arg, "name", 
+				snobj_str(snobj_eval_str(q, "arg.m1")));
+		snobj_map_set(arg, "ogate", 
+				snobj_uint(snobj_eval_uint(q, "arg.ogate")));
+		return bess_request("disconnect_modules", arg);
 	}
 
-	s = snobj_eval_str(q, "to");
-	if (!s) {
-		r = snobj_str("There is no 'to' field");
-		goto reply;
+	/* queries do not change anything */
+	if (strncmp(cmd, "list_", 5) == 0 || strncmp(cmd, "get_", 4) == 0)
+		return NULL;
+
+	*undoable = 0;
+	return NULL;
+}
+
+/* Runs a list of requests ('requests', each as it would be sent alone) in
+ * order, pausing the workers once for all of them. With 'pause' set to 0,
+ * workers keep running, so only the commands that support running workers
+ * (e.g., create_module and connect_modules) can be used.
+ *
+ * The first failure stops the batch, and the create_module, create_port,
+ * and connect_modules requests before it are undone in reverse order. 
+ * Other changes (e.g., module commands) cannot be undone, and are listed
+ * as 'not_undone' in the error details, along with 'failed' (the index)
+ * and 'results' so far. On success, 'results' has a response (nil for
+ * none) for each request. */
+static struct snobj *handle_snobj_batch(struct snobj *q)
+{
+	struct snobj *requests = snobj_eval(q, "requests");
+	struct snobj *results;
+	struct snobj *undos;
+	struct snobj *not_undone;
+	struct snobj *r = NULL;
+
+	uint64_t start = rdtsc();
+	int pause = 1;
+	int paused = 0;
+	int i;
+
+	if (!requests || snobj_type(requests) != TYPE_LIST)
+		return snobj_err(EINVAL, "'requests' must be a list of maps");
+
+	if (snobj_eval_exists(q, "pause"))
+		pause = snobj_eval_int(q, "pause");
+
+	if (pause && is_any_worker_running()) {
+		pause_all_workers();
+		paused = 1;
 	}
 
-	if (strcmp(s, "bess") == 0) {
-		r = handle_snobj_bess(q);
-	} else if (strcmp(s, "module") == 0) {
-		r = handle_snobj_module(q);
+	results = snobj_list();
+	undos = snobj_list();
+	not_undone = snobj_list();
+
+	for (i = 0; i < requests->size; i++) {
+		struct snobj *req = snobj_list_get(requests, i);
+		struct snobj *undo;
+		int undoable;
+
+		r = dispatch_request(req, 1);
+		if (is_error(r))
+			break;
+
+		if (!r)
+			r = snobj_nil();
+
+		undo = undo_request(req, r, &undoable);
+		if (undo)
+			snobj_list_add(undos, undo);
+		else if (!undoable)
+			snobj_list_add(not_undone, snobj_int(i));
+
+		snobj_list_add(results, r);
+		r = NULL;
+	}
+
+	if (r) {
+		struct snobj *details = snobj_map();
+		int undone = 0;
+		int err = snobj_eval_int(r, "err");
+		struct snobj *ret;
+
+		for (int j = undos->size - 1; j >= 0; j--) {
+			struct snobj *u;
+
+			u = dispatch_request(snobj_list_get(undos, j), 1);
+			if (is_error(u))
+				log_err("batch: undoing request failed: %s\n",
+						snobj_eval_str(u, "errmsg"));
+			else
+				undone++;
+
+			snobj_free(u);
+		}
+
+		ret = snobj_err_details(err, details, 
+				"Request %d of %d failed: %s", 
+				i, requests->size, snobj_eval_str(r, "errmsg"));
+
+		snobj_list_add(results, r);
+		snobj_map_set(details, "failed", snobj_int(i));
+		snobj_map_set(details, "results", results);
+		snobj_map_set(details, "undone", snobj_int(undone));
+		snobj_map_set(details, "not_undone", not_undone);
+		r = ret;
+	} else {
+		r = snobj_map();
+		snobj_map_set(r, "results", results);
+		snobj_free(not_undone);
+	}
+
+	snobj_map_set(r, "elapsed_us",
+			snobj_double(tsc_to_us(rdtsc() - start)));
+	snobj_free(undos);
+
+	if (paused)
+		resume_all_workers();
+
+	return r;
+}
+
+/* A client that subscribes to stats gets them pushed periodically, as
+ * messages on the same connection after the response, until it
+ * disconnects. The connection should be dedicated to the subscription
+ * (a response would be indistinguishable from pushed messages).
+ *
+ * Every message is {"seq", "full", "stats", "skipped"}, where stats is
+ * {"ports": {name: <get_port_stats>}, "tcs": {name: <get_tc_stats>},
+ * "modules": {name: <get_module_info>}}. A message with full=0 only has the
+ * values that changed since the previous message: integers (counters) as
+ * differences, other values as they are, unchanged map entries omitted,
+ * and unchanged list elements as nil. A full snapshot is sent first,
+ * every 'full_every' messages, and whenever the shape of the stats
+ * changes (e.g., a port is gone or a gate is added). Messages are not
+ * queued: if the client has not received the previous one yet when the
+ * next one is due, that one is skipped (and counted). */
+struct stats_sub {
+	struct client *c;
+	struct master_job job;
+
+	struct snobj *requests;	/* {"ports", "tcs", "modules"}: [names] */
+	struct snobj *last;	/* the last stats sent */
+
+	uint64_t seq;
+	uint64_t skipped;
+	uint32_t full_every;
+};
+
+static const struct {
+	const char *key;
+	struct snobj *(*func)(struct snobj *);
+} stats_sources[] = {
+	{ "ports",	handle_get_port_stats },
+	{ "tcs",	handle_get_tc_stats },
+	{ "modules",	handle_get_module_info },
+};
+
+#define NUM_STATS_SOURCES	(sizeof(stats_sources) / sizeof(stats_sources[0]))
+
+static struct snobj *collect_stats(struct snobj *requests)
+{
+	struct snobj *stats = snobj_map();
+
+	for (int i = 0; i < NUM_STATS_SOURCES; i++) {
+		struct snobj *names = snobj_map_get(requests, 
+				stats_sources[i].key);
+		struct snobj *r = snobj_map();
+
+		for (int j = 0; names && j < names->size; j++) {
+			struct snobj *name = snobj_list_get(names, j);
+			struct snobj *val = stats_sources[i].func(name);
+
+			snobj_map_set(r, snobj_str_get(name), 
+					val ? : snobj_nil());
+		}
+
+		snobj_map_set(stats, stats_sources[i].key, r);
+	}
+
+	return stats;
+}
+
+/* NULL if unchanged. Sets *mismatch if the shapes of the two differ */
+static struct snobj *stats_delta(const struct snobj *old, 
+		const struct snobj *new, int *mismatch)
+{
+	struct snobj *d = NULL;
+
+	if (old->type != new->type || old->size != new->size) {
+		*mismatch = 1;
+		return NULL;
+	}
+
+	switch (new->type) {
+	case TYPE_INT:
+		if (new->int_value != old->int_value)
+			d = snobj_int(new->int_value - old->int_value);
+		break;
+
+	case TYPE_DOUBLE:
+		if (new->double_value != old->double_value)
+			d = snobj_double(new->double_value);
+		break;
+
+	case TYPE_STR:
+		if (memcmp(new->data, old->data, new->size))
+			d = snobj_str(new->data);
+		break;
+
+	case TYPE_BLOB:
+		if (memcmp(new->data, old->data, new->size))
+			d = snobj_blob(new->data, new->size);
+		break;
+
+	case TYPE_LIST:
+		for (int i = 0; i < new->size && !*mismatch; i++) {
+			struct snobj *c = stats_delta(old->list.arr[i], 
+					new->list.arr[i], mismatch);
+
+			if (!c)
+				continue;
+
+			if (!d) {
+				d = snobj_list();
+				for (int j = 0; j < i; j++)
+					snobj_list_add(d, snobj_nil());
+			}
+
+			snobj_list_add(d, c);
+		}
+
+		/* unchanged elements at the tail */
+		while (d && d->size < new->size)
+			snobj_list_add(d, snobj_nil());
+		break;
+
+	case TYPE_MAP:
+		for (int i = 0; i < new->size && !*mismatch; i++) {
+			struct snobj *c;
+
+			if (strcmp(old->map.arr_k[i], new->map.arr_k[i])) {
+				*mismatch = 1;
+				break;
+			}
+
+			c = stats_delta(old->map.arr_v[i], new->map.arr_v[i],
+					mismatch);
+			if (!c)
+				continue;
+
+			if (!d)
+				d = snobj_map();
+
+			snobj_map_set(d, new->map.arr_k[i], c);
+		}
+		break;
+
+	default:
+		; /* nil */
+	}
+
+	if (*mismatch) {
+		snobj_free(d);
+		return NULL;
+	}
+
+	return d;
+}
+
+static void run_stats_sub(void *arg)
+{
+	struct stats_sub *sub = arg;
+	struct snobj *stats;
+	struct snobj *msg;
+	int full = 0;
+	int ret;
+
+	/* still sending the previous one (or receiving a request)? */
+	if (sub->c->msg_len || sub->c->msg_len_off || sub->c->buf_off) {
+		sub->skipped++;
+		return;
+	}
+
+	stats = collect_stats(sub->requests);
+
+	msg = snobj_map();
+	snobj_map_set(msg, "seq", snobj_uint(sub->seq));
+	snobj_map_set(msg, "skipped", snobj_uint(sub->skipped));
+
+	if (sub->last && (sub->seq % sub->full_every) != 0) {
+		struct snobj *d = stats_delta(sub->last, stats, &full);
+
+		if (!full)
+			snobj_map_set(msg, "stats", d ? : snobj_map());
 	} else
-		r = snobj_err(EINVAL, "Unknown destination in 'to': %s", s);
+		full = 1;
+
+	if (full) {
+		snobj_acquire(stats);
+		snobj_map_set(msg, "stats", stats);
+	}
+
+	snobj_map_set(msg, "full", snobj_int(full));
+
+	ret = send_to_client(sub->c, msg);
+	snobj_free(msg);
+
+	if (ret == -EIO) {
+		/* the client (and sub) is gone */
+		snobj_free(stats);
+		return;
+	}
+
+	/* EBUSY cannot happen, since we checked above */
+	snobj_free(sub->last);
+	sub->last = stats;
+	sub->seq++;
+}
+
+static void free_stats_sub(struct stats_sub *sub)
+{
+	remove_master_job(&sub->job);
+	snobj_free(sub->requests);
+	snobj_free(sub->last);
+	sub->c->sub = NULL;
+	free(sub);
+}
+
+void unsubscribe_stats(struct client *c)
+{
+	if (c->sub)
+		free_stats_sub(c->sub);
+}
+
+/* {"interval_ms" (default 1000, at least MASTER_TICK_MS), "full_every"
+ * (default 100), "ports", "tcs", "modules" (lists of names)} */
+static struct snobj *handle_subscribe_stats(struct client *c, 
+		struct snobj *q)
+{
+	struct stats_sub *sub;
+	uint64_t interval_ms = 1000;
+	uint32_t full_every = 100;
+
+	if (!q || snobj_type(q) != TYPE_MAP)
+		return snobj_err(EINVAL, "Argument must be a map");
+
+	if (c->sub)
+		return snobj_err(EEXIST, "Already subscribed");
+
+	if (snobj_eval_exists(q, "interval_ms"))
+		interval_ms = snobj_eval_uint(q, "interval_ms");
+	if (interval_ms < MASTER_TICK_MS)
+		return snobj_err(EINVAL, "'interval_ms' must be %d or larger",
+				MASTER_TICK_MS);
+
+	if (snobj_eval_exists(q, "full_every"))
+		full_every = snobj_eval_uint(q, "full_every");
+	if (full_every < 1)
+		return snobj_err(EINVAL, "'full_every' must be positive");
+
+	for (int i = 0; i < NUM_STATS_SOURCES; i++) {
+		struct snobj *names = snobj_map_get(q, stats_sources[i].key);
+
+		if (!names)
+			continue;
+
+		if (snobj_type(names) != TYPE_LIST)
+			return snobj_err(EINVAL, "'%s' must be a list of names",
+					stats_sources[i].key);
+
+		for (int j = 0; j < names->size; j++)
+			if (!snobj_str_get(snobj_list_get(names, j)))
+				return snobj_err(EINVAL, "'%s' must be a list "
+						"of names", 
+						stats_sources[i].key);
+	}
+
+	sub = malloc(sizeof(*sub));
+	if (!sub)
+		return snobj_errno(ENOMEM);
+
+	memset(sub, 0, sizeof(*sub));
+	sub->c = c;
+	sub->full_every = full_every;
+
+	/* the request goes away, so keep the names */
+	sub->requests = snobj_map();
+	for (int i = 0; i < NUM_STATS_SOURCES; i++) {
+		struct snobj *names = snobj_map_get(q, stats_sources[i].key);
+
+		if (names) {
+			snobj_acquire(names);
+			snobj_map_set(sub->requests, stats_sources[i].key, 
+					names);
+		}
+	}
+
+	init_master_job(&sub->job, run_stats_sub, sub, 
+			interval_ms * 1000000);
+	add_master_job(&sub->job);
+	c->sub = sub;
+
+	return NULL;
+}
+
+int is_read_only_request(const struct snobj *q)
+{
+	const char *cmd;
+
+	if (q->type != TYPE_MAP || 
+			strcmp(snobj_eval_str(q, "to") ? : "", "bess") != 0)
+		return 0;
+
+	cmd = snobj_eval_str(q, "cmd");
+	if (!cmd)
+		return 0;
+
+	for (int i = 0; sn_handlers[i].cmd != NULL; i++)
+		if (strcmp(cmd, sn_handlers[i].cmd) == 0)
+			return sn_handlers[i].read_only;
+
+	return 0;
+}
+
+struct snobj *handle_request(struct client *c, struct snobj *q)
+{
+	struct snobj *r = NULL;
+
+	if (global_opts.debug_mode) {
+		log_debug("Request:\n");
+		snobj_dump(q);
+	}
+
+	/* the only one that needs the connection */
+	if (q->type == TYPE_MAP && 
+			strcmp(snobj_eval_str(q, "to") ? : "", "bess") == 0 &&
+			strcmp(snobj_eval_str(q, "cmd") ? : "", 
+				"subscribe_stats") == 0)
+		r = handle_subscribe_stats(c, snobj_eval(q, "arg"));
+	else
+		r = dispatch_request(q, 0);
 
-reply:
 	/* No response was made? (normally means "success") */
 	if (!r)
 		r = snobj_nil();
@@ -6,4 +6,15 @@ struct snobj;
 
 struct snobj *handle_request(struct client *c, struct snobj *q);
 
+/* for requests to handlers that only read the state, which may run 
+ * concurrently on multiple threads (but not with any other requests) */
+int is_read_only_request(const struct snobj *q);
+
+/* On an empty daemon, from a file written by the "save_snapshot" command.
+ * Returns {"requests", "elapsed_us"} or an error */
+struct snobj *restore_snapshot(const char *path);
+
+/* called when c goes away */
+void unsubscribe_stats(struct client *c);
+
 #endif
@@ -10,6 +10,119 @@
 #define DEF_LIST_SLOTS	4
 #define DEF_MAP_SLOTS	4
 
+/* struct snobj nodes are carved out of chunks of this many, and recycled
+ * through a per-thread free list, instead of a malloc()/free() each.
+ * Decoding a large request thus costs a few allocations per 256 nodes.
+ * Chunks are never returned to the system. */
+#define NODES_PER_CHUNK	256
+
+static __thread struct snobj *free_nodes;	/* linked through ->data */
+
+static struct snobj *node_alloc(void)
+{
+	struct snobj *m = free_nodes;
+
+	if (!m) {
+		struct snobj *chunk;
+		int i;
+
+		chunk = _ALLOC(sizeof(struct snobj) * NODES_PER_CHUNK);
+
+		for (i = 1; i < NODES_PER_CHUNK - 1; i++)
+			chunk[i].data = &chunk[i + 1];
+
+		chunk[NODES_PER_CHUNK - 1].data = NULL;
+		m = &chunk[0];
+		m->data = &chunk[1];
+	}
+
+	free_nodes = m->data;
+	memset(m, 0, sizeof(*m));
+
+	return m;
+}
+
+static void node_free(struct snobj *m)
+{
+#if CHECK_DOUBLE_FREE
+	assert(m->type != (snobj_type_t)-1);
+	m->type = (snobj_type_t)-1;
+#endif
+	m->data = free_nodes;
+	free_nodes = m;
+}
+
+/* FNV-1a */
+static inline uint32_t hash_key(const char *key)
+{
+	uint32_t h = 2166136261u;
+
+	while (*key) {
+		h ^= (uint8_t)*key++;
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+/* 0 for maps without a hash index. At most half full otherwise */
+static inline uint32_t map_index_slots(uint32_t max_size)
+{
+	uint32_t slots = SNOBJ_MAP_HASH_MIN;
+
+	if (max_size < SNOBJ_MAP_HASH_MIN)
+		return 0;
+
+	while (slots < max_size * 2)
+		slots *= 2;
+
+	return slots;
+}
+
+static inline uint32_t *map_index(const struct snobj *m)
+{
+	return (uint32_t *)(m->map.arr_v + m->max_size);
+}
+
+/* returns the index entry for key: either the one with it, or the empty
+ * one where it would be inserted */
+static uint32_t *map_index_find(const struct snobj *m, const char *key)
+{
+	uint32_t mask = map_index_slots(m->max_size) - 1;
+	uint32_t *index = map_index(m);
+	uint32_t pos = hash_key(key) & mask;
+
+	for (;;) {
+		uint32_t e = index[pos];
+
+		if (!e || strcmp(key, m->map.arr_k[e - 1]) == 0)
+			return &index[pos];
+
+		pos = (pos + 1) & mask;
+	}
+}
+
+/* (re)allocates the arrays for max_size elements, with the index rebuilt */
+static void map_resize(struct snobj *m, uint32_t max_size)
+{
+	uint32_t slots = map_index_slots(max_size);
+	uint32_t i;
+
+	m->map.arr_k = _REALLOC(m->map.arr_k, max_size * sizeof(char *));
+	m->map.arr_v = _REALLOC(m->map.arr_v,
+			max_size * sizeof(struct snobj *) +
+			slots * sizeof(uint32_t));
+	m->max_size = max_size;
+
+	if (!slots)
+		return;
+
+	memset(map_index(m), 0, slots * sizeof(uint32_t));
+
+	for (i = 0; i < m->size; i++)
+		*map_index_find(m, m->map.arr_k[i]) = i + 1;
+}
+
 static void snobj_do_free(struct snobj *m)
 {
 	int i;
@@ -41,7 +154,7 @@ static void snobj_do_free(struct snobj *m)
 		; /* do nothing */
 	} 
 
-	_FREE(m);
+	node_free(m);
 }
 
 void snobj_free(struct snobj *m)
@@ -62,7 +175,7 @@ struct snobj *snobj_nil()
 {
 	struct snobj *m;
 	
-	m = _ALLOC(sizeof(struct snobj));
+	m = node_alloc();
 	m->refcnt = 1;
 	
 	return m;
@@ -172,32 +285,47 @@ struct snobj *snobj_str_fmt(const char *fmt, ...)
 	return m;
 }
 
-struct snobj *snobj_list()
+/* with room for the given number of elements (e.g., when decoding) */
+static struct snobj *snobj_list_sized(uint32_t slots)
 {
 	struct snobj *m = snobj_nil();
 
+	if (slots < DEF_LIST_SLOTS)
+		slots = DEF_LIST_SLOTS;
+
 	m->type = TYPE_LIST;
 	m->size = 0;
-	m->max_size = DEF_LIST_SLOTS;
-	m->list.arr = _ALLOC(sizeof(struct snobj *) * DEF_LIST_SLOTS);
+	m->max_size = slots;
+	m->list.arr = _ALLOC(sizeof(struct snobj *) * slots);
 
 	return m;
 }
 
-/* returns the slot idx of the new item. -1 for error for whatever reason */
-struct snobj *snobj_map()
+struct snobj *snobj_list()
+{
+	return snobj_list_sized(DEF_LIST_SLOTS);
+}
+
+static struct snobj *snobj_map_sized(uint32_t slots)
 {
 	struct snobj *m = snobj_nil();
 
+	if (slots < DEF_MAP_SLOTS)
+		slots = DEF_MAP_SLOTS;
+
 	m->type = TYPE_MAP;
 	m->size = 0;
-	m->map.arr_k = _ALLOC(sizeof(char *) * DEF_MAP_SLOTS);
-	m->map.arr_v = _ALLOC(sizeof(struct snobj *) * DEF_MAP_SLOTS);
-	m->max_size = DEF_LIST_SLOTS;
+	map_resize(m, slots);
 
 	return m;
 }
 
+/* returns the slot idx of the new item. -1 for error for whatever reason */
+struct snobj *snobj_map()
+{
+	return snobj_map_sized(DEF_MAP_SLOTS);
+}
+
 int snobj_list_add(struct snobj *m, struct snobj *child)
 {
 	int idx;
@@ -246,6 +374,12 @@ static int snobj_map_index(const struct snobj *m, const char *key)
 	if (m->type != TYPE_MAP)
 		return -1;
 
+	if (m->max_size >= SNOBJ_MAP_HASH_MIN) {
+		uint32_t e = *map_index_find(m, key);
+
+		return e ? (int)e - 1 : -2;
+	}
+
 	for (i = 0; i < m->size; i++) {
 		if (strcmp(key, m->map.arr_k[i]) == 0)
 			return i;
@@ -284,18 +418,16 @@ int snobj_map_set(struct snobj *m, const char *key, struct snobj *val)
 		char *key_copied = _STRDUP(key);
 
 		/* expand? */
-		if (m->size == m->max_size) {
-			m->max_size *= 2;
-			m->map.arr_k = _REALLOC(m->map.arr_k,
-					m->max_size * sizeof(char *));
-			m->map.arr_v = _REALLOC(m->map.arr_v,
-					m->max_size * sizeof(struct snobj *));
-		}
+		if (m->size == m->max_size)
+			map_resize(m, m->max_size * 2);
 		
 		i = m->size;
 		m->map.arr_k[i] = key_copied;
 		m->map.arr_v[i] = val;
 		m->size = i + 1;
+
+		if (m->max_size >= SNOBJ_MAP_HASH_MIN)
+			*map_index_find(m, key) = i + 1;
 	} else {
 		snobj_free(m->map.arr_v[i]);
 		m->map.arr_v[i] = val;
@@ -484,6 +616,37 @@ static void reserve_more(struct encode_state *s, size_t bytes)
 	s->buf_size = new_buf_size;
 }
 
+static int list_all_int(const struct snobj *m)
+{
+	int i;
+
+	for (i = 0; i < m->size; i++)
+		if (m->list.arr[i]->type != TYPE_INT)
+			return 0;
+
+	return 1;
+}
+
+static int snobj_encode_packed(const struct snobj *m, struct encode_state *s)
+{
+	int64_t *p;
+	int i;
+
+	reserve_more(s, 8 + m->size * 8);
+
+	*(uint32_t *)(s->buf + s->offset) = TYPE_LIST | SNOBJ_PACKED_INT;
+	*(uint32_t *)(s->buf + s->offset + 4) = (uint32_t) m->size;
+	s->offset += 8;
+
+	p = (int64_t *)(s->buf + s->offset);
+	for (i = 0; i < m->size; i++)
+		p[i] = m->list.arr[i]->int_value;
+
+	s->offset += m->size * 8;
+
+	return 0;
+}
+
 /* return non-zero if fails */
 static int snobj_encode_recur(const struct snobj *m, struct encode_state *s)
 {
@@ -496,6 +659,10 @@ static int snobj_encode_recur(const struct snobj *m, struct encode_state *s)
 	
 	NEED(8);
 
+	if (m->type == TYPE_LIST && m->size >= SNOBJ_PACKED_MIN &&
+			list_all_int(m))
+		return snobj_encode_packed(m, s);
+
 	*(uint32_t *)(s->buf + s->offset) = (uint32_t) m->type;
 	*(uint32_t *)(s->buf + s->offset + 4) = (uint32_t) m->size;
 	s->offset += 8;
@@ -623,7 +790,6 @@ struct snobj *snobj_decode_recur(struct decode_state *s)
 		break;
 
 	case TYPE_INT:
-	case TYPE_DOUBLE:
 		if (size != 8 || s->offset + 8 > s->buf_size)
 			goto err;
 
@@ -631,19 +797,52 @@ struct snobj *snobj_decode_recur(struct decode_state *s)
 		s->offset += 8;
 		break;
 
+	case TYPE_DOUBLE:
+		if (size != 8 || s->offset + 8 > s->buf_size)
+			goto err;
+
+		m = snobj_double(*(double *)(s->buf + s->offset));
+		s->offset += 8;
+		break;
+
 	case TYPE_STR:
 	case TYPE_BLOB:
-		m = (type == TYPE_STR) ?
-			snobj_str(s->buf + s->offset) :
-			snobj_blob(s->buf + s->offset, size);
+		if (size == 0 || s->offset + size > s->buf_size)
+			goto err;
+
+		if (type == TYPE_STR) {
+			if (s->buf[s->offset + size - 1] != '\0')
+				goto err;
+
+			m = snobj_str(s->buf + s->offset);
+		} else
+			m = snobj_blob(s->buf + s->offset, size);
 
 		s->offset += size;
 		while (s->offset % 8)
 			s->offset++;
 		break;
 
+	case TYPE_LIST | SNOBJ_PACKED_INT:
+		if (size > (s->buf_size - s->offset) / 8)
+			goto err;
+
+		m = snobj_list_sized(size);
+
+		for (i = 0; i < size; i++)
+			m->list.arr[i] = snobj_int(
+					((int64_t *)(s->buf + s->offset))[i]);
+
+		m->size = size;
+		s->offset += size * 8;
+		break;
+
 	case TYPE_LIST:
-		m = snobj_list();
+		/* each element takes at least 8 bytes */
+		if (size > (s->buf_size - s->offset) / 8)
+			goto err;
+
+		m = snobj_list_sized(size);
 
 		for (i = 0; i < size; i++) {
 			struct snobj *child;
@@ -659,15 +858,24 @@ struct snobj *snobj_decode_recur(struct decode_state *s)
 		break;
 
 	case TYPE_MAP:
-		m = snobj_map();
+		/* each key and value take at least 16 bytes */
+		if (size > (s->buf_size - s->offset) / 16)
+			goto err;
+
+		m = snobj_map_sized(size);
 
 		for (i = 0; i < size; i++) {
 			const char *key;
 			struct snobj *child;
+			size_t key_len;
 			int ret;
 
 			key = s->buf + s->offset;
-			s->offset += strlen(key) + 1;
+			key_len = strnlen(key, s->buf_size - s->offset);
+			if (key_len == s->buf_size - s->offset)
+				goto err;
+
+			s->offset += key_len + 1;
 
 			while (s->offset % 8)
 				s->offset++;
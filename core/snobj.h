@@ -16,6 +16,8 @@
 
 #define CHECK_DOUBLE_FREE	0
 
+#define SNOBJ_MAP_HASH_MIN	16	/* max_size to have a hash index */
+
 enum snobj_type {
 	TYPE_NIL = 0,	/* must be zero. useful for boolean flags */
 	TYPE_INT,	/* signed or unsigned 64-bit integer */
@@ -53,9 +55,12 @@ struct snobj {
 			struct snobj **arr;
 		} list;
 
-		/* currently implemented with arrays and
-		 * linear search :( 
-		 * is hash table really necessary? */
+		/* Keys and values are kept in insertion order in
+		 * arr_k/arr_v. Small maps use linear search. Maps
+		 * with max_size >= SNOBJ_MAP_HASH_MIN also have an
+		 * open-addressing hash index (slot + 1, or 0 for
+		 * empty), allocated right after arr_v[max_size] so
+		 * that struct snobj stays 32B. */
 		struct {
 			char **arr_k;
 			struct snobj **arr_v;
@@ -257,11 +262,17 @@ void snobj_dump(const struct snobj *m);
 
 /* recursive encoding of TYPE(4B), SIZE(4B), DATA(variable)
  * DATA is 8-byte aligned by tail padding with zeroes.
+ * Lists of SNOBJ_PACKED_MIN or more integers are encoded as
+ * TYPE_LIST | SNOBJ_PACKED_INT, with SIZE 8-byte values and no
+ * per-element headers. They are decoded as ordinary lists.
  * returns the size of the newly created buffer (always a multiple of 8)
  * returns 0 if failed.
  * hint is used as initial buffer size, but doesn't need to be accurate */
 size_t snobj_encode(const struct snobj *m, char **pbuf, size_t hint);
 
+#define SNOBJ_PACKED_INT	0x100	/* only on the wire */
+#define SNOBJ_PACKED_MIN	8
+
 struct snobj *snobj_decode(char *buf, size_t buf_size);
 
 /* helper function for the common error message format */
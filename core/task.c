@@ -5,6 +5,7 @@
 #include "log.h"
 #include "module.h"
 #include "task.h"
+#include "trace.h"
 
 struct cdlist_head all_tasks = CDLIST_HEAD_INIT(all_tasks);
 
@@ -20,9 +21,11 @@ struct task *task_create(struct module *m, void *arg)
 	cdlist_add_tail(&all_tasks, &t->all_tasks);
 	
 	t->m = m;
-	t->f = m->mclass->run_task;
+	t->f = m->run_task;
 	t->arg = arg;
 
+	t->burst = MAX_PKT_BURST;
+
 	return t;
 }
 
@@ -143,3 +146,50 @@ void process_orphan_tasks()
 		assign_default_tc(wid, t);
 	}
 }
+
+struct task_result task_scheduled_sampled(struct task *t)
+{
+	struct task_result ret;
+	uint64_t start;
+	uint64_t elapsed;
+
+	const int pmu = ctx.pmu.enabled;
+	struct pmu_sample sample;
+
+	ctx.perf_sampling = 1;
+	ctx.perf_child_cycles = 0;
+
+	if (pmu)
+		pmu_sample_begin(&sample);
+
+	start = rdtsc();
+	ret = task_scheduled(t);
+	elapsed = rdtsc() - start;
+
+	ctx.perf_sampling = 0;
+
+	/* the TC gets all, including the downstream modules */
+	if (pmu) {
+		pmu_sample_end(&sample, t->m->perf[ctx.wid].pmu,
+				t->c->stats.pmu);
+		t->c->stats.pmu_pkts += ret.packets;
+	}
+
+	account_module_perf(t->m, ret.packets, 
+			elapsed - ctx.perf_child_cycles);
+
+	return ret;
+}
+
+struct task_result task_scheduled_traced(struct task *t, int sampled)
+{
+	struct task_result ret;
+
+	trace_record(TRACE_TASK, t->m, 0, 0);
+
+	ret = sampled ? task_scheduled_sampled(t) : task_scheduled(t);
+
+	trace_record(TRACE_TASK_END, t->m, 0, ret.packets);
+
+	return ret;
+}
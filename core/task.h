@@ -5,6 +5,8 @@
 
 #include "utils/cdlist.h"
 
+#include "pktbatch.h"
+#include "time.h"
 #include "tc.h"
 
 extern struct cdlist_head all_tasks;
@@ -29,6 +31,19 @@ struct task {
 	task_func_t f;
 	void *arg;
 
+	/* if 1, its TC is not migrated by work stealing */
+	int pinned;
+
+	/* Adaptive polling (global_opts.task_backoff_us).
+	 * burst: how many packets the task should try to handle in a run.
+	 * backoff: how long to skip the task when unproductive (in cycles) */
+	uint32_t burst;
+	uint32_t backoff;
+	uint64_t next_run_tsc;
+
+	/* set by task_defer() during a run, 0 if none */
+	uint64_t defer_tsc;
+
 	struct cdlist_item tc;
 	struct cdlist_item all_tasks;
 };
@@ -49,6 +64,84 @@ static inline struct task_result task_scheduled(struct task *t)
 	return t->f(t->m, t->arg);
 }
 
+/* One out of MODULE_PERF_SAMPLE_INTERVAL task runs (per worker) is timed,
+ * with a rdtsc pair around every module invoked in the run */
+#ifndef MODULE_PERF_SAMPLE_INTERVAL
+#define MODULE_PERF_SAMPLE_INTERVAL	64
+#endif
+
+/* same as task_scheduled(), but with per-module cycle accounting */
+struct task_result task_scheduled_sampled(struct task *t);
+
+/* recorded in the trace ring of the worker (trace.h), and sampled if so */
+struct task_result task_scheduled_traced(struct task *t, int sampled);
+
+/* batch sizes are grown/shrunk within [MAX_PKT_BURST, TASK_MAX_BURST] */
+#define TASK_MAX_BURST		(MAX_PKT_BURST * 8)
+
+/* returning fewer packets than this counts as a poor yield */
+#define TASK_LOW_YIELD		4
+
+/* the first backoff for a task that returned nothing */
+#define TASK_MIN_BACKOFF_NS	500
+
+/* should be skipped for now, because it has been unproductive? */
+static inline int task_is_backed_off(const struct task *t, uint64_t tsc)
+{
+	return t->next_run_tsc > tsc;
+}
+
+/* Adjust the burst and backoff of t, based on the yield of the last run.
+ * The backoff doubles for every empty run, up to max_backoff (cycles),
+ * which bounds the latency added to the task. */
+static inline void task_autotune(struct task *t, uint64_t packets, 
+		uint64_t tsc, uint64_t max_backoff)
+{
+	if (packets >= t->burst) {
+		/* the queue had more. ask for more next time */
+		if (t->burst < TASK_MAX_BURST)
+			t->burst *= 2;
+		t->backoff = 0;
+		return;
+	}
+
+	if (packets < t->burst / 4 && t->burst > MAX_PKT_BURST)
+		t->burst /= 2;
+
+	if (packets == 0) {
+		if (t->backoff == 0)
+			t->backoff = TASK_MIN_BACKOFF_NS * tsc_hz / 1000000000;
+		else if (t->backoff < max_backoff)
+			t->backoff *= 2;
+
+		if (t->backoff > max_backoff)
+			t->backoff = max_backoff;
+	} else if (packets < TASK_LOW_YIELD)
+		t->backoff /= 2;	/* down-weight, but less than empty ones */
+	else 
+		t->backoff = 0;
+
+	t->next_run_tsc = tsc + t->backoff;
+}
+
+/* Backpressure from downstream (e.g., a full TX queue). The task will not
+ * be run again until the given TSC, regardless of task_backoff_us */
+static inline void task_defer(struct task *t, uint64_t until_tsc)
+{
+	if (t->defer_tsc < until_tsc)
+		t->defer_tsc = until_tsc;
+}
+
+/* called after each run, to apply task_defer() */
+static inline void task_apply_defer(struct task *t)
+{
+	if (unlikely(t->defer_tsc)) {
+		if (t->next_run_tsc < t->defer_tsc)
+			t->next_run_tsc = t->defer_tsc;
+		t->defer_tsc = 0;
+	}
+}
+
 void assign_default_tc(int wid, struct task *t);
 void process_orphan_tasks();
 
@@ -1,8 +1,15 @@
 #include <assert.h>
+#include <errno.h>
 #include <stdio.h>
 
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
 
+#include <linux/perf_event.h>
+
 #include <rte_common.h>
 #include <rte_malloc.h>
 #include <rte_cycles.h>
@@ -12,10 +19,12 @@
 #include "time.h"
 #include "task.h"
 #include "worker.h"
+#include "module.h"
 #include "log.h"
 #include "utils/random.h"
 
 #include "tc.h"
+#include "timer.h"
 
 /* this library is not thread safe */
 
@@ -37,13 +46,14 @@ static void tc_add_to_parent_pgroup(struct tc *c, int share_resource)
 	next = (struct cdlist_item *)&parent->pgroups;
 
 pgroup_init:
-	g = rte_zmalloc("pgroup", sizeof(*g), 0);
+	g = rte_zmalloc_socket("pgroup", sizeof(*g), 0, c->s->socket);
 	if (!g)
 		oom_crash();
 
 	cdlist_add_before(next, &g->tc);
 
 	heap_init(&g->pq);
+	heap_init(&g->edf_pq);
 
 	g->resource = share_resource;
 	g->priority = c->settings.priority;
@@ -55,6 +65,9 @@ pgroup_add:
 	assert(g->resource == share_resource);
 
 	g->num_children++;
+	if (c->settings.max_delay_us)
+		g->num_deadline++;
+
 	c->ss.my_pgroup = g;
 }
 
@@ -74,12 +87,25 @@ struct tc *tc_init(struct sched *s, const struct tc_params *params)
 	assert(params->share > 0);
 	assert(params->share <= MAX_SHARE);
 
-	c = rte_zmalloc("tc", sizeof(*c), 0);
+	c = rte_zmalloc_socket("tc", sizeof(*c), 0, s->socket);
 	if (!c)
 		oom_crash();
 
+	if (!params->no_wait_hist) {
+		c->wait_hist = rte_zmalloc_socket("tc_wait_hist", 
+				histo_size(TC_WAIT_HIST_SUB_BITS, 
+					TC_WAIT_HIST_MAX_BITS), 
+				0, s->socket);
+		if (!c->wait_hist)
+			oom_crash();
+
+		histo_init(c->wait_hist, TC_WAIT_HIST_SUB_BITS, 
+				TC_WAIT_HIST_MAX_BITS);
+	}
+
 	ret = ns_insert(NS_TYPE_TC, params->name, c);
 	if (ret < 0) {
+		rte_free(c->wait_hist);
 		rte_free(c);
 		return err_to_ptr(ret);
 	}
@@ -115,6 +141,9 @@ struct tc *tc_init(struct sched *s, const struct tc_params *params)
 	c->ss.stride = STRIDE1 / params->share;
 	c->ss.pass = 0;			/* will be set when joined */
 
+	c->edf.max_delay = params->max_delay_us * tsc_hz / 1000000;
+	c->run_budget = params->max_run_us * tsc_hz / 1000000;
+
 	cdlist_head_init(&c->tasks);
 	cdlist_head_init(&c->pgroups);
 
@@ -140,9 +169,13 @@ void _tc_do_free(struct tc *c)
 
 	if (g) {
 		g->num_children--;
+		if (c->settings.max_delay_us)
+			g->num_deadline--;
+
 		if (g->num_children == 0) {
 			cdlist_del(&g->tc);
 			heap_close(&g->pq);
+			heap_close(&g->edf_pq);
 			rte_free(g);
 		}
 
@@ -152,6 +185,8 @@ void _tc_do_free(struct tc *c)
 
 	ns_remove(c->settings.name);
 
+	rte_free(c->wait_hist);
+
 	memset(c, 0, sizeof(*c));	/* zero out to detect potential bugs */
 	rte_free(c);			/* Note: c is struct sched, if root */
 	
@@ -164,6 +199,63 @@ static inline int tc_is_root(struct tc *c)
 	return c->parent == NULL;
 }
 
+/* (re)set the deadline of c, which must be in g->pq */
+static inline void edf_update(struct pgroup *g, struct tc *c, 
+		uint64_t deadline)
+{
+	if (!c->edf.max_delay)
+		return;
+
+	if (c->edf.queued) {
+		if (heap_peek(&g->edf_pq) == c)
+			heap_pop(&g->edf_pq);
+		else
+			heap_remove(&g->edf_pq, c);
+	}
+
+	c->edf.queued = 1;
+	c->edf.deadline = deadline;
+	heap_push(&g->edf_pq, deadline, c);
+}
+
+/* must be called whenever c leaves g->pq */
+static inline void edf_remove(struct pgroup *g, struct tc *c)
+{
+	if (!c->edf.queued)
+		return;
+
+	c->edf.queued = 0;
+	if (heap_peek(&g->edf_pq) == c)
+		heap_pop(&g->edf_pq);
+	else
+		heap_remove(&g->edf_pq, c);
+}
+
+/* The child with the earliest deadline, if less than half of its max delay
+ * is left. NULL otherwise (the stride order is fine). */
+static inline struct tc *edf_at_risk(struct pgroup *g, uint64_t tsc)
+{
+	while (g->edf_pq.num_nodes > 0) {
+		struct tc *c;
+		int64_t deadline;
+
+		heap_peek_valdata(&g->edf_pq, &deadline, (void **)&c);
+
+		/* left, but still lazily queued in g->pq. skip. */
+		if (!c->state.runnable) {
+			edf_remove(g, c);
+			continue;
+		}
+
+		if (tsc + c->edf.max_delay / 2 >= deadline)
+			return c;
+
+		break;
+	}
+
+	return NULL;
+}
+
 void tc_join(struct tc *c)
 {
 	struct pgroup *g = c->ss.my_pgroup;
@@ -180,6 +272,8 @@ void tc_join(struct tc *c)
 		c->ss.pass = (next ? next->ss.pass : 0) + c->ss.remain;
 		heap_push(pq, c->ss.pass, c);
 		tc_inc_refcnt(c);
+
+		edf_update(g, c, rdtsc() + c->edf.max_delay);
 	}
 }
 
@@ -205,17 +299,42 @@ struct sched *sched_init()
 	if (!s)
 		oom_crash();
 
+	/* the node of the worker thread (SOCKET_ID_ANY on others) */
+	s->socket = rte_socket_id();
+
 	s->root.refcnt = 1;
 	cdlist_head_init(&s->root.tasks);	/* this will be always empty */
 	cdlist_head_init(&s->root.pgroups);
 
+	s->throttle_mode = THROTTLE_HEAP;
 	heap_init(&s->pq);
 
+	twheel_init(&s->timers, rdtsc(), TW_DEFAULT_TICK_SHIFT);
+
 	cdlist_head_init(&s->tcs_all);
 
 	return s;
 }
 
+int sched_set_throttle_mode(struct sched *s, int mode)
+{
+	if (mode < 0 || mode >= NUM_THROTTLE_MODES)
+		return -EINVAL;
+
+	if (mode == s->throttle_mode)
+		return 0;
+
+	if (s->pq.num_nodes > 0 || !twheel_is_empty(&s->tw))
+		return -EBUSY;
+
+	if (mode == THROTTLE_WHEEL && !s->tw.slots)
+		twheel_init(&s->tw, rdtsc(), TW_DEFAULT_TICK_SHIFT);
+
+	s->throttle_mode = mode;
+
+	return 0;
+}
+
 /* Deallocate the scheduler. The owner is still responsible to release
  * its references to all traffic classes */
 void sched_free(struct sched *s)
@@ -236,14 +355,202 @@ void sched_free(struct sched *s)
 	}
 
 	heap_close(&s->pq);
+	if (s->tw.slots)
+		twheel_close(&s->tw);
+
+	/* e.g., of a removed worker. Their owners may cancel them later */
+	cancel_all_timers(s);
+	twheel_close(&s->timers);
 
 	/* the actual memory block of s will be freed by the root TC
 	 * since it shares the address with this scheduler */
 	tc_dec_refcnt(&s->root);
 }
 
+static inline void throttle_tc(struct sched *s, struct tc *c,
+		uint64_t event_tsc)
+{
+	if (s->throttle_mode == THROTTLE_WHEEL)
+		twheel_add(&s->tw, &c->throttle, event_tsc);
+	else
+		heap_push(&s->pq, event_tsc, c);
+}
+
+static inline void resume_tc(struct tc *c, uint64_t event_tsc)
+{
+	c->state.throttled = 0;
+	
+	if (c->state.runnable) {
+		/* No refcnt is adjusted, since we transfer 
+		 * s->pq's (or s->tw's) reference to my_pgroup->pq */ 
+		c->state.queued = 1;
+		c->last_tsc = event_tsc;
+		heap_push(&c->ss.my_pgroup->pq, 0, c);
+		edf_update(c->ss.my_pgroup, c, event_tsc + c->edf.max_delay);
+	} else
+		tc_dec_refcnt(c);
+}
+
+static int tc_is_stealable(struct tc *c)
+{
+	struct task *t;
+
+	/* only runnable leaf classes directly under the root */
+	if (c->parent != &c->s->root || !cdlist_is_empty(&c->pgroups))
+		return 0;
+
+	if (c->settings.pinned || !c->state.runnable || c->state.throttled)
+		return 0;
+
+	if (c->num_tasks == 0)
+		return 0;
+
+	cdlist_for_each_entry(t, &c->tasks, tc) {
+		if (t->pinned)
+			return 0;
+	}
+
+	return 1;
+}
+
+/* Unlink c from s. Throttled TCs start over (unthrottled) with the next
+ * scheduler. The caller gets a reference, held until sched_graft_tc() */
+static struct tc *detach_tc(struct sched *s, struct tc *c)
+{
+	struct pgroup *g = c->ss.my_pgroup;
+
+	tc_inc_refcnt(c);		/* held by the caller, in transit */
+
+	if (c->state.throttled) {
+		if (s->throttle_mode == THROTTLE_WHEEL)
+			twheel_del(&s->tw, &c->throttle);
+		else
+			heap_remove(&s->pq, c);
+
+		c->state.throttled = 0;
+		tc_dec_refcnt(c);
+	}
+
+	if (c->state.queued) {
+		struct tc *next;
+
+		c->state.queued = 0;
+		heap_remove(&g->pq, c);
+		edf_remove(g, c);
+		tc_dec_refcnt(c);
+
+		next = heap_peek(&g->pq);
+		c->ss.remain = next ? c->ss.pass - next->ss.pass : 0;
+	}
+
+	g->num_children--;
+	if (c->settings.max_delay_us)
+		g->num_deadline--;
+
+	if (g->num_children == 0) {
+		cdlist_del(&g->tc);
+		heap_close(&g->pq);
+		heap_close(&g->edf_pq);
+		rte_free(g);
+	}
+
+	cdlist_del(&c->sched_all);
+	s->num_classes--;
+
+	tc_dec_refcnt(c->parent);
+
+	c->parent = NULL;
+	c->ss.my_pgroup = NULL;
+	c->s = NULL;
+
+	return c;
+}
+
+/* Unlink a runnable leaf TC from s, so that another scheduler can take it.
+ * Returns NULL if there is nothing worth giving away: 
+ * a scheduler with a single runnable TC would only swap its load with
+ * the thief (and then steal it back when idle). */
+struct tc *sched_detach_stealable(struct sched *s)
+{
+	struct tc *c;
+	struct tc *victim = NULL;
+
+	int num_runnable = 0;
+
+	assert(!s->current);
+
+	cdlist_for_each_entry(c, &s->tcs_all, sched_all) {
+		if (!c->state.runnable)
+			continue;
+
+		num_runnable++;
+
+		if (!victim && tc_is_stealable(c))
+			victim = c;
+	}
+
+	if (!victim || num_runnable < 2)
+		return NULL;
+
+	return detach_tc(s, victim);
+}
+
+/* The first leaf TC under the root, in any state. NULL if there is none */
+struct tc *sched_detach_any(struct sched *s)
+{
+	struct tc *c;
+
+	assert(!s->current);
+
+	cdlist_for_each_entry(c, &s->tcs_all, sched_all) {
+		if (c->parent == &s->root && cdlist_is_empty(&c->pgroups))
+			return detach_tc(s, c);
+	}
+
+	return NULL;
+}
+
+/* c must have been detached with sched_detach_stealable() or 
+ * sched_detach_any(). The caller's reference is released. */
+void sched_graft_tc(struct sched *s, struct tc *c)
+{
+	int runnable = c->state.runnable;
+
+	assert(!c->s);
+	assert(!c->state.queued && !c->state.throttled);
+
+	c->s = s;
+	s->num_classes++;
+
+	c->parent = &s->root;
+	tc_inc_refcnt(c->parent);
+
+	/* the TSC of another core may be slightly off. start over. */
+	c->last_tsc = rdtsc();
+
+	tc_add_to_parent_pgroup(c, c->settings.share_resource);
+
+	cdlist_add_tail(&s->tcs_all, &c->sched_all);
+
+	if (runnable) {
+		c->state.runnable = 0;
+		tc_join(c);
+	}
+
+	tc_dec_refcnt(c);
+}
+
 static void resume_throttled(struct sched *s, uint64_t tsc)
 {
+	if (s->throttle_mode == THROTTLE_WHEEL) {
+		struct twheel_entry *e;
+
+		while ((e = twheel_pop(&s->tw, tsc)) != NULL)
+			resume_tc(container_of(e, struct tc, throttle), 
+					e->expire);
+		return;
+	}
+
 	while (s->pq.num_nodes > 0) {
 		struct tc *c;
 		int64_t event_tsc;
@@ -255,21 +562,12 @@ static void resume_throttled(struct sched *s, uint64_t tsc)
 
 		heap_pop(&s->pq);
 
-		c->state.throttled = 0;
-		
-		if (c->state.runnable) {
-			/* No refcnt is adjusted, since we transfer 
-			 * s->pq's reference to my_pgroup->pq */ 
-			c->state.queued = 1;
-			c->last_tsc = event_tsc;
-			heap_push(&c->ss.my_pgroup->pq, 0, c);
-		} else
-			tc_dec_refcnt(c);
+		resume_tc(c, event_tsc);
 	}
 }
 
 /* FIXME: this non-recursive version is buggy. Use a stack */
-static struct tc *pick(struct tc *c)
+static struct tc *pick(struct tc *c, uint64_t tsc)
 {
 	struct pgroup *g;
 
@@ -290,6 +588,15 @@ again:
 
 		if (!child->state.runnable)
 			return child;
+
+		if (g->num_deadline) {
+			struct tc *urgent = edf_at_risk(g, tsc);
+
+			if (urgent && urgent != child) {
+				urgent->stats.cnt_edf++;
+				child = urgent;
+			}
+		}
 	
 		c = child;
 		goto again;
@@ -307,7 +614,7 @@ static struct tc *sched_next(struct sched *s, uint64_t tsc)
 	resume_throttled(s, tsc);
 
 again:
-	c = pick(&s->root);
+	c = pick(&s->root, tsc);
 
 	/* empty tree? */
 	if (c == &s->root)
@@ -317,6 +624,7 @@ again:
 		if (!c->state.runnable) {
 			c->state.queued = 0;
 			heap_pop(&c->ss.my_pgroup->pq);
+			edf_remove(c->ss.my_pgroup, c);
 			tc_dec_refcnt(c);
 
 			goto again;
@@ -403,7 +711,7 @@ static int tc_account(struct sched *s, struct tc *c,
 		c->state.throttled = 1;
 		c->stats.cnt_throttled++;
 
-		heap_push(&s->pq, tsc + max_wait_tsc, c);
+		throttle_tc(s, c, tsc + max_wait_tsc);
 		tc_inc_refcnt(c);
 
 		return 1;
@@ -416,8 +724,23 @@ static int tc_account(struct sched *s, struct tc *c,
 static void sched_done(struct sched *s, struct tc *c, 
 		resource_arr_t usage, int reschedule, uint64_t tsc)
 {
+	/* when c started running */
+	const uint64_t start = tsc - usage[RESOURCE_CYCLE];
+
 	accumulate(s->stats.usage, usage);
 
+	/* held the worker longer than allowed? */
+	if (c->run_budget && usage[RESOURCE_CYCLE] > c->run_budget)
+		c->stats.cnt_overrun++;
+
+	/* cycles in modules owned by other TCs are theirs (see 
+	 * __charged_call_module()). The worker totals above are not */
+	if (unlikely(ctx.cycles_transferred)) {
+		usage[RESOURCE_CYCLE] -= RTE_MIN(usage[RESOURCE_CYCLE], 
+				ctx.cycles_transferred);
+		ctx.cycles_transferred = 0;
+	}
+
 	assert(s->current);
 	s->current = NULL;
 
@@ -429,24 +752,50 @@ static void sched_done(struct sched *s, struct tc *c,
 		struct pgroup *g = c->ss.my_pgroup;
 		struct heap *pq = &g->pq;
 
-		uint64_t consumed = usage[g->resource];
+		uint64_t consumed;
 
 		int throttled;
 
+		/* also charged to all its ancestors from here */
+		if (unlikely(c->cycle_debt))
+			usage[RESOURCE_CYCLE] += 
+				__sync_lock_test_and_set(&c->cycle_debt, 0);
+
+		consumed = usage[g->resource];
+
 		assert(c->state.queued);
 		c->ss.pass += c->ss.stride * consumed / QUANTUM;
 
+		/* started running after the deadline? */
+		if (c->edf.queued && start > c->edf.deadline)
+			c->stats.cnt_deadline_miss++;
+
+		if (c->wait_hist && likely(start > c->last_tsc))
+			histo_record(c->wait_hist, start - c->last_tsc);
+
 		throttled = tc_account(s, c, usage, tsc);
 		if (throttled) 
 			reschedule = 0;
 
+		/* c may not be at the top of pq, if picked by EDF */
 		if (reschedule) {
-			heap_replace(pq, c->ss.pass, c);
+			if (heap_peek(pq) == c)
+				heap_replace(pq, c->ss.pass, c);
+			else {
+				heap_remove(pq, c);
+				heap_push(pq, c->ss.pass, c);
+			}
+
+			edf_update(g, c, tsc + c->edf.max_delay);
 		} else {
 			struct tc *next;
 
 			c->state.queued = 0;
-			heap_pop(pq);
+			if (heap_peek(pq) == c)
+				heap_pop(pq);
+			else
+				heap_remove(pq, c);
+			edf_remove(g, c);
 			tc_dec_refcnt(c);
 
 			next = heap_peek(pq);
@@ -468,6 +817,8 @@ static char *print_tc_stats_detail(struct sched *s, char *p, int max_cnt)
 		"packets",
 		"bits",
 		"throttled",
+		"edf",
+		"dl_miss",
 	};
 
 	const int num_fields = sizeof(fields) / sizeof(sizeof(const char *));
@@ -524,6 +875,35 @@ static char *print_tc_stats_detail(struct sched *s, char *p, int max_cnt)
 		p += sprintf(p, "\n");
 	}
 
+	/* scheduling delay (cumulative, not per interval) */
+	for (int i = 0; i < 3; i++) {
+		const char *names[] = {"wait_p50", "wait_p99", "wait_p999"};
+		const double percents[] = {50.0, 99.0, 99.9};
+
+		p += sprintf(p, "%-10s ", names[i]);
+		num_printed = 0;
+
+		cdlist_for_each_entry(c, &s->tcs_all, sched_all) {
+			uint64_t cycles;
+
+			if (num_printed >= max_cnt) {
+				p += sprintf(p, " ...");
+				break;
+			}
+
+			if (!c->wait_hist) {
+				p += sprintf(p, "%12s", "-");
+				num_printed++;
+				continue;
+			}
+
+			cycles = histo_percentile(c->wait_hist, percents[i]);
+			p += sprintf(p, "%10.1fus", tsc_to_us(cycles));
+			num_printed++;
+		}
+		p += sprintf(p, "\n");
+	}
+
 	p += sprintf(p, "\n");
 
 	return p;
@@ -614,6 +994,23 @@ static void print_stats(struct sched *s, struct sched_stats *last_stats)
 			pkts / 1000000.0,
 			bits / 1000000.0);
 
+	if (global_opts.idle_sleep_us) {
+		uint64_t cnt_sleep;
+		uint64_t cycles_sleep;
+		uint64_t latency;
+
+		cnt_sleep = s->stats.cnt_sleep - last_stats->cnt_sleep;
+		cycles_sleep = s->stats.cycles_sleep - 
+				last_stats->cycles_sleep;
+		latency = s->stats.wakeup_latency - 
+				last_stats->wakeup_latency;
+
+		p += sprintf(p, "sleep %.1f%%(%luK) wakeup %.2fus(avg) ",
+				cycles_sleep * 100.0 / tsc_hz,
+				cnt_sleep / 1000,
+				cnt_sleep ? tsc_to_us(latency / cnt_sleep) : 0.0);
+	}
+
 #if 0
 	p = print_tc_stats_simple(s, p, 5);
 #else
@@ -623,17 +1020,50 @@ static void print_stats(struct sched *s, struct sched_stats *last_stats)
 	log_info("%s", buf);
 }
 
-static inline struct task_result tc_scheduled(struct tc *c)
+static inline struct task_result run_task(struct task *t)
+{
+	int sampled = 0;
+
+	if (unlikely(ctx.perf_countdown-- == 0)) {
+		ctx.perf_countdown = MODULE_PERF_SAMPLE_INTERVAL - 1;
+		sampled = 1;
+	}
+
+	if (unlikely(ctx.trace != NULL))
+		return task_scheduled_traced(t, sampled);
+
+	return sampled ? task_scheduled_sampled(t) : task_scheduled(t);
+}
+
+static inline struct task_result tc_scheduled(struct tc *c, 
+		uint64_t max_backoff)
 {
 	struct task_result ret;
 	struct task *t;
 
 	int num_tasks = c->num_tasks;
 
+	ctx.task_deadline_tsc = c->run_budget ? 
+		ctx.current_tsc + c->run_budget : UINT64_MAX;
+
 	while (num_tasks--) {
 		t = container_of(cdlist_rotate_left(&c->tasks), struct task, tc);
 
-		ret = task_scheduled(t);
+		/* next_run_tsc stays 0 without autotuning or task_defer() */
+		if (task_is_backed_off(t, ctx.current_tsc))
+			continue;
+
+		ctx.current_task = t;
+		ret = run_task(t);
+
+		flush_compaction();
+
+		if (max_backoff)
+			task_autotune(t, ret.packets, ctx.current_tsc, 
+					max_backoff);
+
+		task_apply_defer(t);
+
 		if (ret.packets)
 			return ret;
 	}
@@ -641,6 +1071,108 @@ static inline struct task_result tc_scheduled(struct tc *c)
 	return (struct task_result){.packets = 0, .bits = 0};
 }
 
+/* rounds of plain busy polling, before backing off */
+#define IDLE_SPIN_ROUNDS	64
+/* up to 2^n pause instructions between rounds */
+#define IDLE_MAX_PAUSE_POW	8
+/* each sleep doubles from the min to the max */
+#define IDLE_MIN_SLEEP_US	8
+#define IDLE_MAX_SLEEP_US	128
+
+/* the earliest TSC at which a throttled TC may become runnable, 
+ * or a module timer may fire */
+static uint64_t next_resume_tsc(struct sched *s)
+{
+	uint64_t ret = twheel_next_expiry(&s->timers);
+
+	if (s->throttle_mode == THROTTLE_WHEEL)
+		return RTE_MIN(ret, twheel_next_expiry(&s->tw));
+
+	if (s->pq.num_nodes > 0)
+		return RTE_MIN(ret, s->pq.arr_v[1]);
+
+	return ret;
+}
+
+/* Called after each idle round, once past IDLE_SPIN_ROUNDS.
+ * Exponential backoff with pause (or tpause), then sleep.
+ * Returns the current TSC. */
+static uint64_t sched_idle(struct sched *s, uint64_t idle_rounds, 
+		uint64_t idle_cycles, uint64_t sleep_threshold, 
+		uint64_t *num_sleeps, uint64_t now)
+{
+	uint64_t timeout_us;
+	uint64_t deadline;
+	uint64_t resume_tsc;
+	int woken;
+
+	/* this is a quiescent point as well. do not wait for the next one */
+	if (unlikely(ctx.calls)) {
+		process_worker_calls();
+		*num_sleeps = 0;
+		return rdtsc();
+	}
+
+	if (idle_cycles < sleep_threshold) {
+		uint64_t pow = (idle_rounds - IDLE_SPIN_ROUNDS) / 
+				IDLE_SPIN_ROUNDS;
+
+		if (pow > IDLE_MAX_PAUSE_POW)
+			pow = IDLE_MAX_PAUSE_POW;
+#if __WAITPKG__
+		/* ~ 10 cycles per pause */
+		_tpause(0, now + (10UL << pow));
+#else
+		for (int i = 0; i < (1 << pow); i++)
+			_mm_pause();
+#endif
+		now = rdtsc();
+		*num_sleeps = 0;
+		return now;
+	}
+
+	timeout_us = IDLE_MIN_SLEEP_US << RTE_MIN(*num_sleeps, 4UL);
+	if (timeout_us > IDLE_MAX_SLEEP_US)
+		timeout_us = IDLE_MAX_SLEEP_US;
+
+	deadline = now + timeout_us * tsc_hz / 1000000;
+
+	/* do not oversleep throttled TCs */
+	resume_tsc = next_resume_tsc(s);
+	if (resume_tsc < deadline) {
+		if (resume_tsc <= now)
+			return now;
+		deadline = resume_tsc;
+	}
+
+	woken = idle_sleep((deadline - now) * 1000000000 / tsc_hz);
+	
+	(*num_sleeps)++;
+	s->stats.cnt_sleep++;
+
+	{
+		uint64_t slept = rdtsc();
+		uint64_t wakeup_tsc = ctx.wakeup_tsc;
+		uint64_t latency = 0;
+
+		/* explicit wakeup: since the waker's TSC. timeout: oversleep */
+		if (woken) {
+			if (wakeup_tsc && wakeup_tsc < slept)
+				latency = slept - wakeup_tsc;
+		} else if (slept > deadline)
+			latency = slept - deadline;
+
+		s->stats.cycles_sleep += slept - now;
+		s->stats.wakeup_latency += latency;
+		if (latency > s->stats.wakeup_latency_max)
+			s->stats.wakeup_latency_max = latency;
+
+		ctx.wakeup_tsc = 0;
+
+		return slept;
+	}
+}
+
 void sched_loop(struct sched *s)
 {
 	struct sched_stats last_stats = s->stats;
@@ -648,6 +1180,15 @@ void sched_loop(struct sched *s)
 	uint64_t checkpoint;
 	uint64_t now;
 
+	uint64_t idle_rounds = 0;
+	uint64_t idle_start = 0;
+	uint64_t num_sleeps = 0;
+	uint64_t sleep_threshold;
+	uint64_t max_backoff;
+
+	sleep_threshold = global_opts.idle_sleep_us * tsc_hz / 1000000;
+	max_backoff = global_opts.task_backoff_us * tsc_hz / 1000000;
+
 	last_print_tsc = checkpoint = now = rdtsc();
 
 	/* the main scheduling - running - accounting loop */
@@ -670,6 +1211,18 @@ void sched_loop(struct sched *s)
 				last_stats = s->stats;
 				last_print_tsc = checkpoint = now = rdtsc();
 			}
+
+			if (unlikely(ctx.calls))
+				process_worker_calls();
+
+			if (global_opts.steal_idle_rounds)
+				poll_work_stealing(idle_rounds);
+		}
+
+		/* not charged to any TC */
+		if (unlikely(!twheel_is_empty(&s->timers))) {
+			run_expired_timers(s, now);
+			checkpoint = now = rdtsc();
 		}
 
 		/* Schedule (S) */
@@ -678,7 +1231,7 @@ void sched_loop(struct sched *s)
 		if (c) {
 			/* Running (R) */
 			ctx.current_tsc = now;	/* tasks see updated tsc */
-			ret = tc_scheduled(c);
+			ret = tc_scheduled(c, max_backoff);
 
 			now = rdtsc();
 
@@ -689,12 +1242,28 @@ void sched_loop(struct sched *s)
 			usage[RESOURCE_BIT] = ret.bits;
 
 			sched_done(s, c, usage, 1, now);
+
+			if (ret.packets)
+				idle_rounds = 0;
+			else if (idle_rounds++ == 0)
+				idle_start = now;
 		} else {
 			now = rdtsc();
+			if (idle_rounds++ == 0)
+				idle_start = now;
 
 			s->stats.cnt_idle++;
 			s->stats.cycles_idle += (now - checkpoint);
 		}
+
+		if (unlikely(idle_rounds > IDLE_SPIN_ROUNDS) && 
+				global_opts.idle_sleep_us) {
+			uint64_t idle_begin = now;
+
+			now = sched_idle(s, idle_rounds, now - idle_start,
+					sleep_threshold, &num_sleeps, now);
+			s->stats.cycles_idle += (now - idle_begin);
+		}
 	
 		checkpoint = now;
 	}
@@ -802,3 +1371,261 @@ void sched_test_perf()
 
 	sched_loop(s);
 }
+
+/* Scheduler microbenchmark. Sweeps the shape of the TC tree and reports
+ * the cost of a sched_next() + sched_done() pair. No task is run. */
+
+struct sched_bench_cfg {
+	int depth;		/* number of levels below the root */
+	int fanout;		/* children per TC */
+	int limited_pct;	/* % of leaves that are rate limited */
+	int resource;		/* of the rate limit */
+	int throttle_mode;
+	int no_wait_hist;
+};
+
+/* -1 if the counter is not available (e.g., in a VM) */
+static int open_cache_miss_counter(void)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof(attr);
+	attr.config = PERF_COUNT_HW_CACHE_MISSES;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static struct tc *bench_add_tc(struct sched *s, struct tc *parent, 
+		const struct sched_bench_cfg *cfg, int limited)
+{
+	static int id;
+
+	struct tc_params params = {
+		.parent = parent,
+		.priority = 0,
+		.share = 1,
+		.share_resource = RESOURCE_CNT,
+		.no_wait_hist = cfg->no_wait_hist,
+	};
+
+	struct tc *c;
+
+	sprintf(params.name, "_bench_%d", id++);
+
+	if (limited) {
+		/* low enough to be throttled every now and then */
+		if (cfg->resource == RESOURCE_BIT)
+			params.limit[RESOURCE_BIT] = 1e9;
+		else
+			params.limit[cfg->resource] = 1e6;
+	}
+
+	c = tc_init(s, &params);
+	assert(!is_err_or_null(c));
+
+	tc_join(c);
+
+	return c;
+}
+
+static void sched_bench_run(const struct sched_bench_cfg *cfg)
+{
+	const int num_rounds = 1000000;
+
+	struct sched *s;
+	struct tc **classes;
+
+	int num_classes = 0;
+	int max_classes = 0;
+	int num_leaves = 1;
+	int level_begin = 0;
+	int level_end = 0;
+	int fd;
+
+	uint64_t num_pairs = 0;
+	uint64_t num_idle = 0;
+	uint64_t misses = 0;
+	uint64_t start;
+	uint64_t cycles;
+
+	uint64_t seed = rdtsc();
+
+	for (int i = 0; i < cfg->depth; i++) {
+		num_leaves *= cfg->fanout;
+		max_classes += num_leaves;
+	}
+
+	classes = malloc(sizeof(struct tc *) * max_classes);
+	if (!classes)
+		oom_crash();
+
+	s = sched_init();
+	sched_set_throttle_mode(s, cfg->throttle_mode);
+
+	/* build the tree, breadth first */
+	for (int level = 0; level < cfg->depth; level++) {
+		int is_leaf = (level == cfg->depth - 1);
+		int num_parents = (level == 0) ? 1 : level_end - level_begin;
+
+		for (int p = 0; p < num_parents; p++) {
+			struct tc *parent = level ? classes[level_begin + p] : NULL;
+
+			for (int i = 0; i < cfg->fanout; i++) {
+				int limited = is_leaf && 
+					rand_fast_range(&seed, 100) < 
+					cfg->limited_pct;
+
+				classes[num_classes++] = bench_add_tc(s, 
+						parent, cfg, limited);
+			}
+		}
+
+		level_begin = level_end;
+		level_end = num_classes;
+	}
+
+	fd = open_cache_miss_counter();
+	if (fd >= 0) {
+		ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+
+	start = rdtsc();
+
+	for (int i = 0; i < num_rounds; i++) {
+		uint64_t now = rdtsc();
+		struct tc *c;
+
+		c = sched_next(s, now);
+		if (c) {
+			resource_arr_t usage;
+
+			usage[RESOURCE_CNT] = 1;
+			usage[RESOURCE_CYCLE] = 100;
+			usage[RESOURCE_PACKET] = 32;
+			usage[RESOURCE_BIT] = 32 * 1500 * 8;
+
+			sched_done(s, c, usage, 1, now);
+			num_pairs++;
+		} else
+			num_idle++;
+	}
+
+	cycles = rdtsc() - start;
+
+	if (fd >= 0) {
+		int ret;
+
+		ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+		ret = read(fd, &misses, sizeof(misses));
+		if (ret != sizeof(misses))
+			misses = 0;
+		close(fd);
+	}
+
+	if (fd >= 0)
+		log_info("%5d %6d %7d %8d%% %8s %6s %5s %9.1f %9.2f %7.1f%%\n",
+				cfg->depth, cfg->fanout, num_classes,
+				cfg->limited_pct, 
+				cfg->resource == RESOURCE_BIT ? "bits" : "packets",
+				cfg->throttle_mode == THROTTLE_WHEEL ? 
+					"wheel" : "heap",
+				cfg->no_wait_hist ? "no" : "yes",
+				tsc_to_us(cycles) * 1000.0 / num_rounds,
+				(double)misses / num_rounds,
+				num_idle * 100.0 / num_rounds);
+	else
+		log_info("%5d %6d %7d %8d%% %8s %6s %5s %9.1f %9s %7.1f%%\n",
+				cfg->depth, cfg->fanout, num_classes,
+				cfg->limited_pct, 
+				cfg->resource == RESOURCE_BIT ? "bits" : "packets",
+				cfg->throttle_mode == THROTTLE_WHEEL ? 
+					"wheel" : "heap",
+				cfg->no_wait_hist ? "no" : "yes",
+				tsc_to_us(cycles) * 1000.0 / num_rounds,
+				"n/a",
+				num_idle * 100.0 / num_rounds);
+
+	sched_free(s);
+
+	for (int i = num_classes - 1; i >= 0; i--)
+		tc_dec_refcnt(classes[i]);
+
+	free(classes);
+}
+
+void sched_bench()
+{
+	const int depths[] = {1, 2, 3};
+	const int fanouts[] = {4, 16, 64, 1024, 16384};
+	const int limited_pcts[] = {0, 50, 100};
+	const int resources[] = {RESOURCE_PACKET, RESOURCE_BIT};
+
+	/* more than this is not a realistic per-worker configuration */
+	const int max_leaves = 65536;
+
+	log_info("Scheduler microbenchmark: "
+			"ns and cache misses per sched_next/sched_done pair\n");
+	log_info("struct tc: %zu bytes (%zu used by the scheduler), "
+			"and %zu for the wait histogram, if any\n",
+			sizeof(struct tc), (size_t)TC_HOT_SIZE, 
+			histo_size(TC_WAIT_HIST_SUB_BITS, 
+				TC_WAIT_HIST_MAX_BITS));
+	log_info("%5s %6s %7s %9s %8s %6s %5s %9s %9s %8s\n",
+			"depth", "fanout", "classes", "limited", "resource",
+			"queue", "hist", "ns/pair", "miss/pair", "idle");
+
+	for (int d = 0; d < sizeof(depths) / sizeof(int); d++) {
+		for (int f = 0; f < sizeof(fanouts) / sizeof(int); f++) {
+			/* fanout^depth may not even fit in an int */
+			uint64_t num_leaves = 1;
+
+			for (int i = 0; i < depths[d] && 
+					num_leaves <= max_leaves; i++)
+				num_leaves *= fanouts[f];
+
+			if (num_leaves > max_leaves)
+				continue;
+
+			for (int l = 0; l < sizeof(limited_pcts) / sizeof(int); l++) {
+				for (int r = 0; r < sizeof(resources) / sizeof(int); r++) {
+					/* limits do not matter if none */
+					if (limited_pcts[l] == 0 && r > 0)
+						continue;
+
+					for (int m = 0; m < NUM_THROTTLE_MODES; 
+							m++) {
+						struct sched_bench_cfg cfg = {
+							.depth = depths[d],
+							.fanout = fanouts[f],
+							.limited_pct = 
+								limited_pcts[l],
+							.resource = 
+								resources[r],
+							.throttle_mode = m,
+						};
+
+						/* queue does not matter */
+						if (limited_pcts[l] == 0 && 
+								m > 0)
+							continue;
+
+						sched_bench_run(&cfg);
+
+						/* the footprint matters
+						 * with many classes */
+						if (num_leaves >= 1024) {
+							cfg.no_wait_hist = 1;
+							sched_bench_run(&cfg);
+						}
+					}
+				}
+			}
+		}
+	}
+}
@@ -5,8 +5,11 @@
 
 #include "common.h"
 #include "namespace.h"
+#include "pmu.h"
 
 #include "utils/minheap.h"
+#include "utils/twheel.h"
+#include "utils/histogram.h"
 #include "utils/cdlist.h"
 #include "utils/simd.h"
 
@@ -25,6 +28,13 @@ enum {
 	NUM_RESOURCES,		/* Sentinel. Do not use. */
 };
 
+/* how throttled TCs are kept until their token buckets refill */
+enum {
+	THROTTLE_HEAP = 0,	/* binary heap. O(log n), exact order */
+	THROTTLE_WHEEL,		/* hierarchical timing wheel. O(1) */
+	NUM_THROTTLE_MODES,	/* Sentinel. Do not use. */
+};
+
 /* share is defined relatively, so 1024 should be large enough */
 #define MAX_SHARE	(1 << 10)
 #define STRIDE1		(1 << 20)
@@ -38,6 +48,11 @@ typedef uint64_t resource_arr_t[NUM_RESOURCES] __ymm_aligned;
 struct pgroup {
 	struct heap pq;
 
+	/* Children with a deadline (tc_params.max_delay_us), by deadline.
+	 * The earliest one preempts the stride order once it is at risk */
+	struct heap edf_pq;
+	int num_deadline;
+
 	int32_t priority;
 
 	int resource;		/* [0, NUM_RESOURCES - 1] */
@@ -55,6 +70,12 @@ struct tc_params {
 	 * (if its last task is detached, free the tc as well) */
 	int auto_free;		
 
+	/* If 1, never migrated to another worker by work stealing */
+	int pinned;
+
+	/* If 1, no histogram of scheduling delays (2KB per TC) is kept */
+	int no_wait_hist;
+
 	int32_t priority;
 
 	int32_t share;
@@ -63,22 +84,49 @@ struct tc_params {
 	/* in bits/pkts/cycles per sec. 0 if unlimited */
 	uint64_t limit[NUM_RESOURCES];	
 	uint64_t max_burst[NUM_RESOURCES];
+
+	/* maximum scheduling delay, in microseconds. 0 if no deadline */
+	uint32_t max_delay_us;
+
+	/* cycle budget of each run, in microseconds. 0 if unlimited.
+	 * Enforced by tasks that check task_over_budget() */
+	uint32_t max_run_us;
 };
 
 struct tc_stats {
 	resource_arr_t usage;
 	uint64_t cnt_throttled;
+	uint64_t cnt_edf;		/* picked over stride for its deadline */
+	uint64_t cnt_deadline_miss;	/* scheduled after its deadline */
+	uint64_t cnt_alloc_denied;	/* snbuf admission (snbuf.h) */
+	uint64_t cnt_overrun;		/* runs beyond settings.max_run_us */
+
+	/* hardware counters and packets, in sampled task runs only */
+	uint64_t pmu[NUM_PMU_EVENTS];
+	uint64_t pmu_pkts;
 };
 
 /***************************************************************************
  * Any change to the layout of this struct may affect performance.
  * Please group fields in a way that maximizes spatial cache locality.
+ *
+ * A worker may have thousands of classes (e.g., one per tenant), so the
+ * fields used by sched_next() and sched_done() come first, packed in the
+ * fewest cache lines (TC_HOT_SIZE). The rest is only touched by the master
+ * and for stats. The wait-time histogram, which is large, is allocated
+ * separately and is optional (tc_params.no_wait_hist); only the pointer
+ * to it is in the hot part.
  ***************************************************************************/
+
+/* coarse (12.5%) to keep it small, since there is one per TC */
+#define TC_WAIT_HIST_SUB_BITS	3
+#define TC_WAIT_HIST_MAX_BITS	36	/* ~27 sec in cycles at 2.5GHz */
+
 struct tc {
 	/* NOTE: This counter is not atomic. 
 	 * 1 by owner (the creator, or the scheduler if it is root), 
 	 * 1 by ss.my_group->pq (when queued == 1), 
-	 * 1 by s->pq (when throttled == 1), 
+	 * 1 by s->pq or s->tw (when throttled == 1), 
 	 * m by its tasks, and n by children */
 	uint32_t refcnt;
 
@@ -91,23 +139,25 @@ struct tc {
 	struct {
 		int8_t runnable;	/* got work to do? */
 		int8_t queued;		/* in the ss.my_pgroup->pq? */
-		int8_t throttled;	/* being throttled (residing in s->pq) */
+		int8_t throttled;	/* being throttled (in s->pq or s->tw) */
 	} state;
 
-	/* list of child pgroups (empty for leaf classes) */
-	struct cdlist_head pgroups;	
-
-	/* a TC performs round robin scheduling across its tasks */
-	struct cdlist_head tasks;
+	int has_limit;
 
-	/****************************************************************
-	 * Used for accounting only
-	 ****************************************************************/
 	struct tc *parent;		/* NULL for the root */
 
 	uint64_t last_tsc; 		/* when was it last scheduled? */
 
-	int has_limit;
+	/* how long it waited to be picked, since last_tsc (in cycles).
+	 * NULL if not recorded. Checked by every sched_done() */
+	struct histogram *wait_hist;
+
+	/* cycles spent in the modules it owns (module.owner_tc) while 
+	 * other TCs were running, possibly on other workers, not yet 
+	 * charged. Added atomically, see tc_charge_cycles() */
+	volatile uint64_t cycle_debt;
+
+	uint64_t run_budget;		/* in cycles. 0 if unlimited */
 
 	/* stride scheduling within the pgroup */
 	struct {
@@ -117,7 +167,18 @@ struct tc {
 		int64_t remain;
 	} ss;
 
-	struct tc_stats stats;
+	/* earliest deadline first within the pgroup */
+	struct {
+		uint64_t max_delay;	/* in cycles. 0 if no deadline */
+		uint64_t deadline;	/* in TSC */
+		int queued;		/* in ss.my_pgroup->edf_pq? */
+	} edf;
+
+	/* list of child pgroups (empty for leaf classes) */
+	struct cdlist_head pgroups;	
+
+	/* a TC performs round robin scheduling across its tasks */
+	struct cdlist_head tasks;
 
 	/* For per-resource token buckets: 
 	 * 1 work unit = 2 ^ USAGE_AMPLIFIER_POW resource usage.
@@ -133,6 +194,11 @@ struct tc {
 		uint64_t tokens;	/* in work units */
 	} tb[NUM_RESOURCES];
 
+	/* for s->tw, when throttled in THROTTLE_WHEEL mode */
+	struct twheel_entry throttle;
+
+	struct tc_stats stats;
+
 	/****************************************************************
 	 * Not used in the "datapath" (sched_next or sched_done)
 	 ****************************************************************/
@@ -147,21 +213,41 @@ struct tc {
 	struct tc_stats last_stats;
 };
 
+/* bytes of struct tc used by the scheduler, in the common case 
+ * (stats.pmu is only updated for sampled task runs) */
+#define TC_HOT_SIZE	offsetof(struct tc, stats.cnt_edf)
+
 struct sched_stats {
 	resource_arr_t usage;
 	uint64_t cnt_idle;
 	uint64_t cycles_idle;
+
+	/* adaptive idle policy (global_opts.idle_sleep_us). 
+	 * cycles_sleep is also included in cycles_idle */
+	uint64_t cnt_sleep;
+	uint64_t cycles_sleep;		/* idle residency in sleep */
+	uint64_t wakeup_latency;	/* sum, in cycles */
+	uint64_t wakeup_latency_max;	/* in cycles */
 };
 
 struct sched {
 	struct tc root;			/* Must be the first field */
 	struct tc *current;		/* currently running */
 
-	/* priority queue of inactive (throttled) token buckets */
+	/* priority queue of inactive (throttled) token buckets.
+	 * Either pq or tw is used, depending on throttle_mode */
+	int throttle_mode;
 	struct heap pq;
+	struct twheel tw;
+
+	/* module timers (timer.h), run by sched_loop() */
+	struct twheel timers;
 
 	struct sched_stats stats;
 
+	/* NUMA node to allocate TCs on */
+	int socket;
+
 	/* all traffic classes, except the root TC */
 	int num_classes;
 	struct cdlist_head tcs_all;
@@ -185,9 +271,29 @@ static inline void tc_dec_refcnt(struct tc *c)
 		_tc_do_free(c);
 }
 
+/* from any worker. c will pay for them in its next sched_done() */
+static inline void tc_charge_cycles(struct tc *c, uint64_t cycles)
+{
+	__sync_fetch_and_add(&c->cycle_debt, cycles);
+}
+
 struct sched *sched_init();
 void sched_free(struct sched *s);
 
+/* THROTTLE_*. Fails with -EBUSY if any TC is currently throttled */
+int sched_set_throttle_mode(struct sched *s, int mode);
+
+/* For work stealing. A detached TC belongs to no scheduler until grafted,
+ * and the caller holds one reference for it in the meantime.
+ * Both must be called by the thread that owns the scheduler
+ * (or by the master while the worker is paused). */
+struct tc *sched_detach_stealable(struct sched *s);
+void sched_graft_tc(struct sched *s, struct tc *c);
+
+/* For draining a worker: any leaf TC under the root, even if pinned, 
+ * throttled, or not runnable. NULL if none is left */
+struct tc *sched_detach_any(struct sched *s);
+
 //struct tc *sched_next(struct sched *s);
 //void sched_done(struct sched *s, const uint32_t *usage, int reschedule);
 
@@ -196,4 +302,7 @@ void sched_loop(struct sched *s);
 void sched_test_alloc();
 void sched_test_perf();
 
+/* parameter sweep of sched_next()/sched_done() costs (main.c -b) */
+void sched_bench();
+
 #endif
@@ -0,0 +1,361 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#include <rte_atomic.h>
+
+#include "telemetry.h"
+#include "master.h"
+#include "module.h"
+#include "namespace.h"
+#include "port.h"
+#include "tc.h"
+#include "time.h"
+#include "worker.h"
+
+/* capacities of the tables (entities beyond these are not published) */
+#define TELEMETRY_MAX_PORTS	128
+#define TELEMETRY_MAX_TCS	1024
+#define TELEMETRY_MAX_MODULES	1024
+#define TELEMETRY_MAX_GATES	4096
+
+static struct {
+	struct telemetry_hdr *hdr;
+	size_t len;
+	int fd;
+	char *path;
+	struct master_job job;
+} tele = {.fd = -1};
+
+static size_t align64(size_t len)
+{
+	return (len + 63) & ~(size_t)63;
+}
+
+static void *table(uint32_t off)
+{
+	return (char *)tele.hdr + off;
+}
+
+static void copy_name(char *dst, const char *src)
+{
+	strncpy(dst, src ? src : "", TELEMETRY_NAME_LEN - 1);
+	dst[TELEMETRY_NAME_LEN - 1] = '\0';
+}
+
+static void publish_workers(struct telemetry_hdr *h)
+{
+	struct telemetry_worker *recs = table(h->off_workers);
+	uint32_t n = 0;
+
+	for (int wid = 0; wid < MAX_WORKERS; wid++) {
+		struct telemetry_worker *rec;
+		const struct sched_stats *stats;
+
+		if (!is_worker_active(wid))
+			continue;
+
+		rec = &recs[n++];
+		stats = &workers[wid]->s->stats;
+
+		rec->wid = wid;
+		rec->running = is_worker_running(wid);
+		rec->silent_drops = workers[wid]->drops[DROP_DEADEND];
+		for (int i = 0; i < NUM_RESOURCES; i++)
+			rec->usage[i] = stats->usage[i];
+		rec->cnt_idle = stats->cnt_idle;
+		rec->cycles_idle = stats->cycles_idle;
+	}
+
+	h->num_workers = n;
+}
+
+static void publish_ports(struct telemetry_hdr *h)
+{
+	struct telemetry_port *recs = table(h->off_ports);
+	uint32_t n = 0;
+
+	int cnt = 1;
+	int offset;
+
+	for (offset = 0; cnt != 0; offset += cnt) {
+		const int arr_size = 16;
+		const struct port *ports[arr_size];
+
+		cnt = list_ports(ports, arr_size, offset);
+
+		for (int i = 0; i < cnt; i++) {
+			struct telemetry_port *rec;
+			port_stats_t stats;
+
+			if (n == h->cap_ports) {
+				h->truncated = 1;
+				break;
+			}
+
+			rec = &recs[n++];
+
+			get_port_stats((struct port *)ports[i], &stats);
+
+			copy_name(rec->name, ports[i]->name);
+			rec->inc_packets = stats[PACKET_DIR_INC].packets;
+			rec->inc_dropped = stats[PACKET_DIR_INC].dropped;
+			rec->inc_bytes = stats[PACKET_DIR_INC].bytes;
+			rec->out_packets = stats[PACKET_DIR_OUT].packets;
+			rec->out_dropped = stats[PACKET_DIR_OUT].dropped;
+			rec->out_bytes = stats[PACKET_DIR_OUT].bytes;
+		}
+	}
+
+	h->num_ports = n;
+}
+
+static void publish_tcs(struct telemetry_hdr *h)
+{
+	struct telemetry_tc *recs = table(h->off_tcs);
+	uint32_t n = 0;
+
+	struct ns_iter iter;
+	struct tc *c;
+
+	ns_init_iterator(&iter, NS_TYPE_TC);
+
+	while ((c = (struct tc *)ns_next(&iter)) != NULL) {
+		struct telemetry_tc *rec;
+
+		if (n == h->cap_tcs) {
+			h->truncated = 1;
+			break;
+		}
+
+		rec = &recs[n++];
+
+		copy_name(rec->name, c->settings.name);
+
+		rec->wid = -1;
+		for (int wid = 0; wid < MAX_WORKERS; wid++)
+			if (is_worker_active(wid) && workers[wid]->s == c->s) {
+				rec->wid = wid;
+				break;
+			}
+
+		for (int i = 0; i < NUM_RESOURCES; i++)
+			rec->usage[i] = c->stats.usage[i];
+		rec->cnt_throttled = c->stats.cnt_throttled;
+	}
+
+	ns_release_iterator(&iter);
+
+	h->num_tcs = n;
+}
+
+static void publish_gates(struct telemetry_hdr *h, const struct module *m,
+		uint32_t idx)
+{
+	struct telemetry_gate *recs = table(h->off_gates);
+
+	for (gate_idx_t i = 0; i < m->ogates.curr_size; i++) {
+		struct telemetry_gate *rec;
+		struct track_hook *track;
+		struct gate_hook *hook;
+
+		if (!m->ogates.arr[i])
+			continue;
+
+		hook = find_gate_hook(m->ogates.arr[i], TRACK_HOOK_NAME);
+		if (!hook)
+			continue;
+
+		if (h->num_gates == h->cap_gates) {
+			h->truncated = 1;
+			return;
+		}
+
+		track = container_of(hook, struct track_hook, hook);
+		rec = &recs[h->num_gates++];
+
+		rec->module = idx;
+		rec->ogate = i;
+		rec->cnt = track->cnt;
+		rec->pkts = track->pkts;
+	}
+}
+
+static void publish_modules(struct telemetry_hdr *h)
+{
+	struct telemetry_module *recs = table(h->off_modules);
+	uint32_t n = 0;
+
+	int cnt = 1;
+	int offset;
+
+	h->num_gates = 0;
+
+	for (offset = 0; cnt != 0; offset += cnt) {
+		const int arr_size = 16;
+		const struct module *modules[arr_size];
+
+		cnt = list_modules(modules, arr_size, offset);
+
+		for (int i = 0; i < cnt; i++) {
+			const struct module *m = modules[i];
+			struct telemetry_module *rec;
+
+			if (n == h->cap_modules) {
+				h->truncated = 1;
+				break;
+			}
+
+			rec = &recs[n];
+
+			copy_name(rec->name, m->name);
+			rec->samples = 0;
+			rec->pkts = 0;
+			rec->cycles = 0;
+
+			for (int wid = 0; wid < MAX_WORKERS; wid++) {
+				rec->samples += m->perf[wid].samples;
+				rec->pkts += m->perf[wid].pkts;
+				rec->cycles += m->perf[wid].cycles;
+			}
+
+			publish_gates(h, m, n);
+			n++;
+		}
+	}
+
+	h->num_modules = n;
+}
+
+static void publish_telemetry(void *arg)
+{
+	struct telemetry_hdr *h = tele.hdr;
+
+	/* readers retry while seq is odd */
+	h->seq++;
+	rte_wmb();
+
+	h->timestamp_ns = get_epoch_time() * 1e9;
+	h->truncated = 0;
+
+	publish_workers(h);
+	publish_ports(h);
+	publish_tcs(h);
+	publish_modules(h);
+
+	rte_wmb();
+	h->seq++;
+}
+
+int enable_telemetry(const char *path, uint64_t interval_ns)
+{
+	struct telemetry_hdr *h;
+	size_t off;
+	size_t len;
+	int ret;
+
+	if (tele.hdr)
+		return -EEXIST;
+
+	if (interval_ns < MASTER_TICK_MS * 1000000ull)
+		return -EINVAL;
+
+	off = align64(sizeof(struct telemetry_hdr));
+
+	/* the offsets are computed once more below */
+	len = off + align64(MAX_WORKERS * sizeof(struct telemetry_worker)) +
+		align64(TELEMETRY_MAX_PORTS * sizeof(struct telemetry_port)) +
+		align64(TELEMETRY_MAX_TCS * sizeof(struct telemetry_tc)) +
+		align64(TELEMETRY_MAX_MODULES * sizeof(struct telemetry_module)) +
+		align64(TELEMETRY_MAX_GATES * sizeof(struct telemetry_gate));
+
+	/* removed by disable_telemetry() */
+	tele.fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (tele.fd < 0)
+		return -errno;
+
+	if (ftruncate(tele.fd, len) < 0) {
+		ret = -errno;
+		goto fail_file;
+	}
+
+	h = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, tele.fd, 0);
+	if (h == MAP_FAILED) {
+		ret = -errno;
+		goto fail_file;
+	}
+
+	tele.path = strdup(path);
+	if (!tele.path) {
+		ret = -ENOMEM;
+		munmap(h, len);
+		goto fail_file;
+	}
+
+	h->version = TELEMETRY_VERSION;
+	h->tsc_hz = tsc_hz;
+	h->interval_ns = interval_ns;
+
+	h->cap_workers = MAX_WORKERS;
+	h->off_workers = off;
+	off += align64(MAX_WORKERS * sizeof(struct telemetry_worker));
+
+	h->cap_ports = TELEMETRY_MAX_PORTS;
+	h->off_ports = off;
+	off += align64(TELEMETRY_MAX_PORTS * sizeof(struct telemetry_port));
+
+	h->cap_tcs = TELEMETRY_MAX_TCS;
+	h->off_tcs = off;
+	off += align64(TELEMETRY_MAX_TCS * sizeof(struct telemetry_tc));
+
+	h->cap_modules = TELEMETRY_MAX_MODULES;
+	h->off_modules = off;
+	off += align64(TELEMETRY_MAX_MODULES * sizeof(struct telemetry_module));
+
+	h->cap_gates = TELEMETRY_MAX_GATES;
+	h->off_gates = off;
+
+	tele.hdr = h;
+	tele.len = len;
+
+	publish_telemetry(NULL);
+
+	/* the reader waits for this */
+	rte_wmb();
+	h->magic = TELEMETRY_MAGIC;
+
+	init_master_job(&tele.job, publish_telemetry, NULL, interval_ns);
+	add_master_job(&tele.job);
+
+	return 0;
+
+fail_file:
+	close(tele.fd);
+	tele.fd = -1;
+	unlink(path);
+	return ret;
+}
+
+void disable_telemetry(void)
+{
+	if (!tele.hdr)
+		return;
+
+	remove_master_job(&tele.job);
+
+	/* for readers that still have it mapped */
+	tele.hdr->magic = 0;
+
+	munmap(tele.hdr, tele.len);
+	close(tele.fd);
+	unlink(tele.path);
+	free(tele.path);
+
+	tele.hdr = NULL;
+	tele.fd = -1;
+	tele.path = NULL;
+}
@@ -0,0 +1,91 @@
+#ifndef _TELEMETRY_H_
+#define _TELEMETRY_H_
+
+#include <stdint.h>
+
+/* Counters published in a shared-memory file (e.g., in /dev/shm), which
+ * external monitors map read-only, without any control request.
+ *
+ * The master thread rewrites the whole region every interval, as a
+ * seqlock: seq is odd while an update is in progress. A reader copies
+ * what it needs between two reads of seq, and retries if seq was odd or
+ * has changed. Counters are cumulative, as read from the workers without
+ * synchronization, so only differences between updates are meaningful.
+ *
+ * The file is a struct telemetry_hdr, followed by tables of fixed-size
+ * records at the given offsets (from the beginning of the file), each with
+ * room for cap_* and num_* in use. Entities beyond the capacity are not
+ * published (and truncated is set). Names are truncated and always
+ * null-terminated. The layout is fixed (offsets in bytes), since non-C
+ * readers map it; any incompatible change bumps the version. */
+#define TELEMETRY_MAGIC		0x454c4554	/* "TELE" */
+#define TELEMETRY_VERSION	1
+
+#define TELEMETRY_NAME_LEN	64
+
+struct telemetry_hdr {
+	uint32_t magic;			/* 0 */
+	uint32_t version;		/* 4 */
+	volatile uint64_t seq;		/* 8 */
+	uint64_t timestamp_ns;		/* 16, epoch time of the update */
+	uint64_t tsc_hz;		/* 24 */
+	uint64_t interval_ns;		/* 32 */
+	uint32_t truncated;		/* 40 */
+	uint32_t pad;			/* 44 */
+
+	/* 48 */
+	uint32_t num_workers, cap_workers, off_workers, pad_w;
+	uint32_t num_ports, cap_ports, off_ports, pad_p;		/* 64 */
+	uint32_t num_tcs, cap_tcs, off_tcs, pad_t;			/* 80 */
+	uint32_t num_modules, cap_modules, off_modules, pad_m;		/* 96 */
+	uint32_t num_gates, cap_gates, off_gates, pad_g;		/* 112 */
+};
+
+struct telemetry_worker {
+	uint32_t wid;			/* 0 */
+	uint32_t running;		/* 4 */
+	uint64_t silent_drops;		/* 8 */
+	uint64_t usage[4];		/* 16, schedules/cycles/packets/bits */
+	uint64_t cnt_idle;		/* 48 */
+	uint64_t cycles_idle;		/* 56 */
+};
+
+struct telemetry_port {
+	char name[TELEMETRY_NAME_LEN];	/* 0 */
+	uint64_t inc_packets;		/* 64 */
+	uint64_t inc_dropped;		/* 72 */
+	uint64_t inc_bytes;		/* 80 */
+	uint64_t out_packets;		/* 88 */
+	uint64_t out_dropped;		/* 96 */
+	uint64_t out_bytes;		/* 104 */
+};
+
+struct telemetry_tc {
+	char name[TELEMETRY_NAME_LEN];	/* 0 */
+	int32_t wid;			/* 64, -1 if not attached */
+	uint32_t pad;			/* 68 */
+	uint64_t usage[4];		/* 72, schedules/cycles/packets/bits */
+	uint64_t cnt_throttled;		/* 104 */
+};
+
+/* cycles are sampled, as in get_module_info */
+struct telemetry_module {
+	char name[TELEMETRY_NAME_LEN];	/* 0 */
+	uint64_t samples;		/* 64 */
+	uint64_t pkts;			/* 72 */
+	uint64_t cycles;		/* 80 */
+};
+
+/* ogates with a "track" hook (track_gate) */
+struct telemetry_gate {
+	uint32_t module;		/* 0, index in the module table */
+	uint32_t ogate;			/* 4 */
+	uint64_t cnt;			/* 8 */
+	uint64_t pkts;			/* 16 */
+};
+
+/* where to publish, and how often (these are done by a master job) */
+int enable_telemetry(const char *path, uint64_t interval_ns);
+void disable_telemetry(void);
+
+#endif
@@ -20,6 +20,12 @@ static inline double tsc_to_us(uint64_t cycles)
 	return cycles * 1000000.0 / tsc_hz;
 }
 
+/* without overflow for any 64-bit cycles */
+static inline uint64_t tsc_to_ns(uint64_t cycles)
+{
+	return (unsigned __int128)cycles * 1000000000 / tsc_hz;
+}
+
 /* Return current time in seconds since the Epoch. 
  * This is consistent with Python's time.time() */
 static inline double get_epoch_time()
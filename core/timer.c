@@ -0,0 +1,72 @@
+#include <assert.h>
+
+#include "common.h"
+#include "time.h"
+#include "tc.h"
+#include "worker.h"
+#include "module.h"
+#include "timer.h"
+
+void timer_arm(struct timer *t, uint64_t expire_tsc)
+{
+	struct twheel *tw;
+
+	assert(is_worker_active(ctx.wid) && workers[ctx.wid] == &ctx);
+
+	tw = &ctx.s->timers;
+
+	if (timer_is_armed(t))
+		timer_cancel(t);
+
+	/* the wheel does not advance while empty */
+	if (twheel_is_empty(tw))
+		tw->now = rdtsc() >> tw->tick_shift;
+
+	t->tw = tw;
+	twheel_add(tw, &t->entry, expire_tsc);
+}
+
+void timer_arm_ns(struct timer *t, uint64_t delay_ns)
+{
+	timer_arm(t, rdtsc() + delay_ns * tsc_hz / 1000000000);
+}
+
+void timer_cancel(struct timer *t)
+{
+	if (!timer_is_armed(t))
+		return;
+
+	twheel_del(t->tw, &t->entry);
+	t->tw = NULL;
+}
+
+static void disarm_timer(struct twheel_entry *e)
+{
+	container_of(e, struct timer, entry)->tw = NULL;
+}
+
+void cancel_all_timers(struct sched *s)
+{
+	twheel_drain(&s->timers, disarm_timer);
+}
+
+void run_expired_timers(struct sched *s, uint64_t tsc)
+{
+	struct twheel *tw = &s->timers;
+
+	/* timers re-armed by callbacks for the past fire in the next round */
+	uint32_t budget = tw->num_entries;
+	struct twheel_entry *e;
+
+	ctx.current_task = NULL;
+	ctx.task_deadline_tsc = UINT64_MAX;
+
+	while (budget-- && (e = twheel_pop(tw, tsc)) != NULL) {
+		struct timer *t = container_of(e, struct timer, entry);
+
+		t->tw = NULL;
+		t->f(t);
+	}
+
+	flush_compaction();
+}
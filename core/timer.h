@@ -0,0 +1,64 @@
+#ifndef _TIMER_H_
+#define _TIMER_H_
+
+#include <stdint.h>
+
+#include "utils/twheel.h"
+
+/* Per-worker timers for modules, e.g., for deferred flushes or aging.
+ *
+ * Each worker has a timing wheel in its scheduler (struct sched), and 
+ * sched_loop() runs the callbacks of expired timers between scheduling 
+ * rounds. A timer fires on the worker that armed it, so the callback can 
+ * safely touch the same per-worker state as the datapath.
+ *
+ * timer_arm() and timer_cancel() are O(1). A timer must only be armed by
+ * a worker thread. It can be cancelled by the same worker, or by any 
+ * thread while the worker is paused. mclass->deinit() may run with workers
+ * running, so use run_on_worker() there. 
+ * Embed struct timer in module private data, and cancel it before the
+ * memory goes away. */
+
+struct timer;
+struct sched;
+
+typedef void (*timer_func_t)(struct timer *t);
+
+struct timer {
+	struct twheel_entry entry;
+	timer_func_t f;
+	void *arg;
+
+	struct twheel *tw;	/* NULL if not armed */
+};
+
+static inline void timer_init(struct timer *t, timer_func_t f, void *arg)
+{
+	t->f = f;
+	t->arg = arg;
+	t->tw = NULL;
+}
+
+static inline int timer_is_armed(const struct timer *t)
+{
+	return t->tw != NULL;
+}
+
+/* (re)arm the timer on the current worker, to fire at (or shortly after) 
+ * the given TSC */
+void timer_arm(struct timer *t, uint64_t expire_tsc);
+
+/* same as above, relative to now */
+void timer_arm_ns(struct timer *t, uint64_t delay_ns);
+
+/* no-op if not armed */
+void timer_cancel(struct timer *t);
+
+/* called by sched_loop() */
+void run_expired_timers(struct sched *s, uint64_t tsc);
+
+/* disarms all timers of the scheduler, without running them, so that none
+ * points to its wheel once it is freed (sched_free()) */
+void cancel_all_timers(struct sched *s);
+
+#endif
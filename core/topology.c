@@ -0,0 +1,248 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <rte_ethdev.h>
+
+#include "log.h"
+#include "worker.h"
+#include "topology.h"
+
+#define SYS_NODE_DIR	"/sys/devices/system/node/node%d"
+#define SYS_HP_DIR	"/sys/kernel/mm"	/* if not NUMA */
+
+struct topology topo;
+
+/* the list is in the form of "0-3,8,10-11". Returns 0 or -errno */
+static int read_cpu_list(const char *path, cpu_set_t *set)
+{
+	char buf[1024];
+	char *p;
+	FILE *fp;
+
+	CPU_ZERO(set);
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return -errno;
+
+	if (!fgets(buf, sizeof(buf), fp)) {
+		fclose(fp);
+		return -EIO;
+	}
+
+	fclose(fp);
+
+	for (p = strtok(buf, ",\n"); p; p = strtok(NULL, ",\n")) {
+		unsigned int first;
+		unsigned int last;
+
+		switch (sscanf(p, "%u-%u", &first, &last)) {
+		case 1:
+			last = first;
+			break;
+		case 2:
+			break;
+		default:
+			return -EINVAL;
+		}
+
+		for (unsigned int cpu = first; cpu <= last && cpu < CPU_SETSIZE;
+				cpu++)
+			CPU_SET(cpu, set);
+	}
+
+	return 0;
+}
+
+/* 0 if not available */
+static uint32_t read_uint(const char *path)
+{
+	unsigned int val;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return 0;
+
+	if (fscanf(fp, "%u", &val) != 1)
+		val = 0;
+
+	fclose(fp);
+
+	return val;
+}
+
+/* dir is that of the node, or SYS_HP_DIR */
+static void read_hugepages(const char *dir, int size_kb,
+		struct topo_hugepages *hp)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/hugepages/hugepages-%dkB/nr_hugepages",
+			dir, size_kb);
+	hp->total = read_uint(path);
+
+	snprintf(path, sizeof(path),
+			"%s/hugepages/hugepages-%dkB/free_hugepages",
+			dir, size_kb);
+	hp->free = read_uint(path);
+}
+
+static void init_sockets(void)
+{
+	char dir[PATH_MAX];
+	char path[PATH_MAX];
+
+	for (int cpu = 0; cpu < TOPO_MAX_CPUS; cpu++)
+		topo.cpus[cpu].socket = -1;
+
+	for (int sid = 0; sid < RTE_MAX_NUMA_NODES; sid++) {
+		struct topo_socket *s = &topo.sockets[sid];
+		cpu_set_t set;
+
+		snprintf(dir, sizeof(dir), SYS_NODE_DIR, sid);
+		snprintf(path, sizeof(path), "%s/cpulist", dir);
+
+		if (read_cpu_list(path, &set) < 0)
+			continue;
+
+		topo.num_sockets = sid + 1;
+
+		for (int cpu = 0; cpu < TOPO_MAX_CPUS; cpu++)
+			if (CPU_ISSET(cpu, &set))
+				topo.cpus[cpu].socket = sid;
+
+		read_hugepages(dir, 2048, &s->hp_2m);
+		read_hugepages(dir, 1048576, &s->hp_1g);
+	}
+
+	/* not a NUMA system (or no sysfs): everything is on socket 0 */
+	if (topo.num_sockets == 0) {
+		topo.num_sockets = 1;
+		read_hugepages(SYS_HP_DIR, 2048, &topo.sockets[0].hp_2m);
+		read_hugepages(SYS_HP_DIR, 1048576, &topo.sockets[0].hp_1g);
+	}
+}
+
+static void init_cpus(void)
+{
+	for (int cpu = 0; cpu < TOPO_MAX_CPUS; cpu++) {
+		struct topo_cpu *c = &topo.cpus[cpu];
+		cpu_set_t siblings;
+
+		if (!is_cpu_present(cpu)) {
+			c->socket = -1;
+			continue;
+		}
+
+		c->present = 1;
+		if (c->socket < 0)
+			c->socket = 0;
+
+		c->first_sibling = cpu;
+
+		CPU_ZERO(&siblings);
+
+		if (add_smt_siblings(&siblings, cpu) > 0) {
+			for (int i = 0; i < cpu; i++) {
+				if (CPU_ISSET(i, &siblings)) {
+					c->first_sibling = i;
+					break;
+				}
+			}
+		}
+
+		topo.num_cpus++;
+		topo.sockets[c->socket].num_cpus++;
+		if (c->first_sibling == cpu)
+			topo.sockets[c->socket].num_cores++;
+	}
+}
+
+static void init_nics(void)
+{
+	topo.num_nics = RTE_MIN((int)rte_eth_dev_count(), TOPO_MAX_NICS);
+
+	for (int i = 0; i < topo.num_nics; i++) {
+		struct topo_nic *nic = &topo.nics[i];
+		struct rte_eth_dev_info dev_info;
+
+		memset(&dev_info, 0, sizeof(dev_info));
+		rte_eth_dev_info_get(i, &dev_info);
+
+		if (dev_info.pci_dev)
+			snprintf(nic->pci, sizeof(nic->pci),
+				"%04hx:%02hhx:%02hhx.%hhx",
+				dev_info.pci_dev->addr.domain,
+				dev_info.pci_dev->addr.bus,
+				dev_info.pci_dev->addr.devid,
+				dev_info.pci_dev->addr.function);
+
+		nic->socket = rte_eth_dev_socket_id(i);
+		if (nic->socket >= topo.num_sockets)
+			nic->socket = -1;
+	}
+}
+
+void init_topology(void)
+{
+	init_sockets();
+	init_cpus();
+	init_nics();
+}
+
+void log_topology(void)
+{
+	log_info("Topology: %d socket(s), %d CPU(s), %d DPDK port(s)\n",
+			topo.num_sockets, topo.num_cpus, topo.num_nics);
+
+	for (int sid = 0; sid < topo.num_sockets; sid++) {
+		const struct topo_socket *s = &topo.sockets[sid];
+		int num_nics = 0;
+
+		for (int i = 0; i < topo.num_nics; i++)
+			if (topo.nics[i].socket == sid)
+				num_nics++;
+
+		log_info("  socket %d: %d cores (%d CPUs), "
+				"2MB hugepages %u (%u free), "
+				"1GB hugepages %u (%u free), %d NIC(s)\n",
+				sid, s->num_cores, s->num_cpus,
+				s->hp_2m.total, s->hp_2m.free,
+				s->hp_1g.total, s->hp_1g.free, num_nics);
+
+		if (num_nics && !s->hp_2m.total && !s->hp_1g.total)
+			log_warn("  socket %d has NICs but no hugepages, so "
+					"their packets will be remote\n", sid);
+	}
+
+	for (int i = 0; i < topo.num_nics; i++)
+		log_info("  DPDK port_id %d: %s, socket %d\n", i,
+				topo.nics[i].pci[0] ? topo.nics[i].pci : "-",
+				topo.nics[i].socket);
+}
+
+int topo_pick_cpu(int socket, const cpu_set_t *used)
+{
+	for (int cpu = 0; cpu < TOPO_MAX_CPUS; cpu++) {
+		const struct topo_cpu *c = &topo.cpus[cpu];
+		int busy = 0;
+
+		if (!c->present || c->socket != socket ||
+				c->first_sibling != cpu)
+			continue;
+
+		for (int i = cpu; i < TOPO_MAX_CPUS; i++)
+			if (topo.cpus[i].present &&
+					topo.cpus[i].first_sibling == cpu &&
+					CPU_ISSET(i, used))
+				busy = 1;
+
+		if (!busy)
+			return cpu;
+	}
+
+	return -1;
+}
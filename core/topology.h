@@ -0,0 +1,60 @@
+#ifndef _TOPOLOGY_H_
+#define _TOPOLOGY_H_
+
+#include <sched.h>
+#include <stdint.h>
+
+#include <rte_config.h>
+
+/* CPU and memory layout of the machine, read once at startup from sysfs
+ * and DPDK (init_topology(), after rte_eal_init()). Used for the startup
+ * report, and by the "get_topology" and "auto_place" commands. */
+
+#define TOPO_MAX_CPUS	RTE_MAX_LCORE
+#define TOPO_MAX_NICS	RTE_MAX_ETHPORTS
+
+struct topo_cpu {
+	int present;
+	int socket;		/* NUMA node */
+	int first_sibling;	/* the lowest CPU of the same physical core */
+};
+
+struct topo_hugepages {
+	uint32_t total;
+	uint32_t free;		/* at startup, so after DPDK took its share */
+};
+
+struct topo_socket {
+	int num_cpus;
+	int num_cores;		/* physical */
+	struct topo_hugepages hp_2m;
+	struct topo_hugepages hp_1g;
+};
+
+/* DPDK ports */
+struct topo_nic {
+	char pci[16];		/* "dddd:bb:dd.f", empty if not a PCI device */
+	int socket;		/* -1 if unknown */
+};
+
+struct topology {
+	int num_sockets;
+	int num_cpus;
+	int num_nics;
+
+	struct topo_cpu cpus[TOPO_MAX_CPUS];
+	struct topo_socket sockets[RTE_MAX_NUMA_NODES];
+	struct topo_nic nics[TOPO_MAX_NICS];
+};
+
+extern struct topology topo;
+
+void init_topology(void);
+
+void log_topology(void);
+
+/* The first CPU on the socket whose physical core has no CPU in used,
+ * or -1 if there is none */
+int topo_pick_cpu(int socket, const cpu_set_t *used);
+
+#endif
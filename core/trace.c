@@ -0,0 +1,90 @@
+#include <errno.h>
+
+#include <rte_malloc.h>
+
+#include "trace.h"
+#include "worker.h"
+
+/* owned by the master. Workers only see them through ctx.trace */
+static struct trace_ring *traces[MAX_WORKERS];
+
+int start_trace(uint64_t duration_ns, uint32_t num_events)
+{
+	uint64_t now;
+
+	if (num_events < 2 || (num_events & (num_events - 1)))
+		return -EINVAL;
+
+	for (int wid = 0; wid < MAX_WORKERS; wid++)
+		if (traces[wid])
+			return -EBUSY;
+
+	for (int wid = 0; wid < MAX_WORKERS; wid++) {
+		struct trace_ring *t;
+
+		if (!is_worker_active(wid))
+			continue;
+
+		t = rte_zmalloc_socket("trace_ring", sizeof(*t) +
+				num_events * sizeof(struct trace_event), 64,
+				workers[wid]->socket);
+		if (!t) {
+			free_trace();
+			return -ENOMEM;
+		}
+
+		t->mask = num_events - 1;
+		traces[wid] = t;
+	}
+
+	now = rdtsc();
+
+	for (int wid = 0; wid < MAX_WORKERS; wid++) {
+		struct trace_ring *t = traces[wid];
+
+		if (!t)
+			continue;
+
+		t->start_tsc = now;
+		t->stop_tsc = now + duration_ns * tsc_hz / 1000000000;
+
+		STORE_BARRIER();
+		workers[wid]->trace = t;
+	}
+
+	return 0;
+}
+
+void stop_trace(void)
+{
+	int stopped = 0;
+
+	for (int wid = 0; wid < MAX_WORKERS; wid++) {
+		if (!traces[wid] || !is_worker_active(wid))
+			continue;
+
+		if (workers[wid]->trace) {
+			workers[wid]->trace = NULL;
+			stopped = 1;
+		}
+	}
+
+	/* workers may be in the middle of recording an event */
+	if (stopped)
+		synchronize_workers();
+}
+
+const struct trace_ring *get_trace(int wid)
+{
+	return traces[wid];
+}
+
+void free_trace(void)
+{
+	stop_trace();
+
+	for (int wid = 0; wid < MAX_WORKERS; wid++) {
+		rte_free(traces[wid]);
+		traces[wid] = NULL;
+	}
+}
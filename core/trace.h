@@ -0,0 +1,88 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+
+#include <rte_branch_prediction.h>
+
+#include "common.h"
+#include "time.h"
+#include "worker.h"
+
+/* Runtime packet path tracing, for a short window (unlike the debug-only
+ * SN_TRACE_MODULES, which prints every call).
+ *
+ * start_trace() gives every worker a ring of binary events: task runs and
+ * module calls, with the TSC, the module, the input gate, and the number of
+ * packets. Workers record into it until the window closes, overwriting the
+ * oldest events if the ring is full, then stop by themselves. Only the
+ * "ctx.trace != NULL" checks in call_module() and run_task() are left in
+ * the datapath while tracing is off. */
+
+enum trace_type {
+	TRACE_TASK = 0,		/* m: module of the task */
+	TRACE_TASK_END,		/* cnt: packets */
+	TRACE_CALL,		/* m: callee, gate: its igate, cnt: batch size */
+	TRACE_RETURN,
+};
+
+struct module;
+
+struct trace_event {
+	uint64_t tsc;
+	const struct module *m;	/* may not be valid any more */
+	uint16_t gate;
+	uint16_t cnt;
+	uint8_t type;		/* enum trace_type */
+	uint8_t depth;		/* of the module call stack */
+	uint16_t pad;
+};
+
+struct trace_ring {
+	uint64_t start_tsc;
+	uint64_t stop_tsc;	/* the worker stops recording after this */
+	uint64_t head;		/* events recorded, including overwritten */
+	uint32_t mask;		/* the ring has mask + 1 events */
+	struct trace_event events[];
+};
+
+/* on workers. ctx.trace may have been cleared since it was checked */
+static inline void trace_record(enum trace_type type,
+		const struct module *m, gate_idx_t gate, uint32_t cnt)
+{
+	struct trace_ring *t = ctx.trace;
+	struct trace_event *e;
+	uint64_t tsc = rdtsc();
+
+	if (unlikely(!t))
+		return;
+
+	if (unlikely(tsc >= t->stop_tsc)) {
+		ctx.trace = NULL;
+		return;
+	}
+
+	e = &t->events[t->head++ & t->mask];
+
+	e->tsc = tsc;
+	e->m = m;
+	e->gate = gate;
+	e->cnt = cnt < UINT16_MAX ? cnt : UINT16_MAX;
+	e->type = type;
+	e->depth = ctx.stack_depth;
+}
+
+/* num_events (a power of 2) per active worker. Returns 0 or -errno */
+int start_trace(uint64_t duration_ns, uint32_t num_events);
+
+/* Stops recording on all workers (if still in the window), so that the
+ * rings can be read. Waits for each worker to pass a quiescent point */
+void stop_trace(void);
+
+/* NULL if the worker has no ring */
+const struct trace_ring *get_trace(int wid);
+
+/* stops first, if necessary */
+void free_trace(void);
+
+#endif
@@ -0,0 +1,231 @@
+#include <string.h>
+
+#include <rte_memcpy.h>
+
+#include "module.h"
+#include "task.h"
+#include "time.h"
+#include "txstage.h"
+
+/* sends what the driver takes, and updates the queue stats for them */
+static int do_send(const struct tx_stage_conf *conf, snb_array_t pkts,
+		int cnt)
+{
+	struct port *p = conf->port;
+	int sent;
+
+	sent = conf->send_pkts(p, conf->qid, pkts, cnt);
+
+	if (!(p->driver->flags & DRIVER_FLAG_SELF_OUT_STATS)) {
+		struct packet_stats *stats;
+		uint64_t sent_bytes = 0;
+
+		stats = &p->queue_stats[PACKET_DIR_OUT][conf->qid];
+
+		for (int i = 0; i < sent; i++)
+			sent_bytes += snb_total_len(pkts[i]);
+
+		stats->packets += sent;
+		stats->bytes += sent_bytes;
+	}
+
+	return sent;
+}
+
+static void count_dropped(const struct tx_stage_conf *conf, int cnt)
+{
+	struct port *p = conf->port;
+
+	count_drops(conf->m, DROP_TX_FULL, cnt);
+
+	if (!(p->driver->flags & DRIVER_FLAG_SELF_OUT_STATS))
+		p->queue_stats[PACKET_DIR_OUT][conf->qid].dropped += cnt;
+}
+
+/* retries the staged packets, then drops the remaining ones that are
+ * too old. Since the FIFO is in order, those are at the front */
+static void flush(struct tx_stage *s, uint64_t now)
+{
+	const struct tx_stage_conf *conf = s->conf;
+
+	int sent;
+	int aged = 0;
+	int done;
+
+	sent = do_send(conf, s->pkts, s->cnt);
+	s->retried += sent;
+
+	while (sent + aged < s->cnt &&
+			now - s->tsc[sent + aged] > conf->max_age)
+		aged++;
+
+	if (aged) {
+		snb_free_bulk(s->pkts + sent, aged);
+		s->dropped_aged += aged;
+		count_dropped(conf, aged);
+	}
+
+	done = sent + aged;
+	if (done == 0)
+		return;
+
+	s->cnt -= done;
+	memmove(s->pkts, s->pkts + done, s->cnt * sizeof(s->pkts[0]));
+	memmove(s->tsc, s->tsc + done, s->cnt * sizeof(s->tsc[0]));
+}
+
+/* tail drop, if it does not fit */
+static void stage(struct tx_stage *s, snb_array_t pkts, int cnt,
+		uint64_t now)
+{
+	const struct tx_stage_conf *conf = s->conf;
+
+	int room = conf->max_pkts - s->cnt;
+	int n = RTE_MIN(cnt, room);
+
+	rte_memcpy((void *)&s->pkts[s->cnt], (void *)pkts,
+			n * sizeof(struct snbuf *));
+
+	for (int i = 0; i < n; i++)
+		s->tsc[s->cnt + i] = now;
+
+	s->cnt += n;
+
+	if (n < cnt) {
+		snb_free_bulk(pkts + n, cnt - n);
+		s->dropped_full += cnt - n;
+		count_dropped(conf, cnt - n);
+	}
+}
+
+static void retry_timeout(struct timer *t)
+{
+	struct tx_stage *s = t->arg;
+
+	if (s->cnt)
+		flush(s, rdtsc());
+
+	if (s->cnt)
+		timer_arm_ns(&s->timer, TX_STAGE_RETRY_NS);
+}
+
+void tx_stage_send(struct tx_stage *s, struct pkt_batch *batch)
+{
+	const struct tx_stage_conf *conf = s->conf;
+	const uint64_t now = ctx.current_tsc;
+
+	if (s->cnt)
+		flush(s, now);
+
+	/* packets must not overtake staged ones */
+	if (s->cnt == 0) {
+		int sent = do_send(conf, batch->pkts, batch->cnt);
+
+		if (likely(sent == batch->cnt))
+			return;
+
+		stage(s, batch->pkts + sent, batch->cnt - sent, now);
+	} else
+		stage(s, batch->pkts, batch->cnt, now);
+
+	if (!timer_is_armed(&s->timer))
+		timer_arm_ns(&s->timer, TX_STAGE_RETRY_NS);
+
+	if (conf->backpressure && s->cnt > conf->max_pkts / 2 &&
+			ctx.current_task)
+	{
+		task_defer(ctx.current_task, now + conf->retry);
+		s->deferred++;
+	}
+}
+
+struct snobj *tx_stage_init(struct module *m, struct tx_stage_conf *conf,
+		struct snobj *arg)
+{
+	struct tx_stage *s;
+	int wid;
+
+	int64_t age_us = TX_STAGE_DEF_AGE_US;
+
+	conf->m = m;
+	conf->max_pkts = 0;
+	conf->backpressure = 0;
+
+	if (arg && snobj_eval_exists(arg, "tx_buffer")) {
+		int64_t max_pkts = snobj_eval_int(arg, "tx_buffer");
+
+		if (max_pkts < 0 || max_pkts > TX_STAGE_MAX_PKTS)
+			return snobj_err(EINVAL, "'tx_buffer' must be between "
+					"0 and %d", TX_STAGE_MAX_PKTS);
+
+		conf->max_pkts = max_pkts;
+	}
+
+	if (arg && snobj_eval_exists(arg, "tx_buffer_age")) {
+		age_us = snobj_eval_int(arg, "tx_buffer_age");
+
+		if (age_us <= 0)
+			return snobj_err(EINVAL, "'tx_buffer_age' (us) must "
+					"be positive");
+	}
+
+	if (arg && snobj_eval_exists(arg, "backpressure"))
+		conf->backpressure = snobj_eval_int(arg, "backpressure");
+
+	if (conf->backpressure && !conf->max_pkts)
+		return snobj_err(EINVAL, "'backpressure' requires "
+				"'tx_buffer'");
+
+	conf->max_age = age_us * tsc_hz / 1000000;
+	conf->retry = TX_STAGE_RETRY_NS * tsc_hz / 1000000000;
+
+	for_each_priv_worker(m, wid, s) {
+		s->conf = conf;
+		timer_init(&s->timer, retry_timeout, s);
+	}
+
+	return NULL;
+}
+
+/* the timer lives in the wheel of the worker */
+void tx_stage_deinit_worker(struct module *m, int wid)
+{
+	struct tx_stage *s = get_priv_worker_by_wid(m, wid);
+
+	timer_cancel(&s->timer);
+
+	if (s->cnt) {
+		snb_free_bulk(s->pkts, s->cnt);
+		s->cnt = 0;
+	}
+}
+
+struct snobj *tx_stage_get_stats(struct module *m)
+{
+	struct snobj *r = snobj_map();
+
+	uint64_t staged = 0;
+	uint64_t retried = 0;
+	uint64_t dropped_full = 0;
+	uint64_t dropped_aged = 0;
+	uint64_t deferred = 0;
+
+	struct tx_stage *s;
+	int wid;
+
+	for_each_priv_worker(m, wid, s) {
+		staged += s->cnt;
+		retried += s->retried;
+		dropped_full += s->dropped_full;
+		dropped_aged += s->dropped_aged;
+		deferred += s->deferred;
+	}
+
+	snobj_map_set(r, "staged", snobj_uint(staged));
+	snobj_map_set(r, "retried", snobj_uint(retried));
+	snobj_map_set(r, "dropped_full", snobj_uint(dropped_full));
+	snobj_map_set(r, "dropped_aged", snobj_uint(dropped_aged));
+	snobj_map_set(r, "deferred", snobj_uint(deferred));
+
+	return r;
+}
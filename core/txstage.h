@@ -0,0 +1,79 @@
+#ifndef _TXSTAGE_H_
+#define _TXSTAGE_H_
+
+#include <stdint.h>
+
+#include "common.h"
+#include "snobj.h"
+#include "snbuf.h"
+#include "pktbatch.h"
+#include "timer.h"
+#include "port.h"
+
+/* Optional TX staging for PortOut/QueueOut.
+ *
+ * Without it, packets not accepted by the driver (e.g., the NIC TX ring is
+ * full for a moment) are dropped right away. With it, they are kept in a
+ * per-worker FIFO of up to max_pkts packets, and retried before the next
+ * batch, or by a timer if no batch follows. Packets staged for longer than
+ * max_age are dropped, so the added latency is bounded.
+ *
+ * With backpressure, the task that pushed the batch (and thus its TC) is
+ * deferred while the FIFO is more than half full, rather than pulling in
+ * more packets only to drop them here. */
+
+#define TX_STAGE_MAX_PKTS	(MAX_PKT_BURST * 16)
+
+/* default max_age */
+#define TX_STAGE_DEF_AGE_US	100
+
+/* how soon the timer retries, and how long the upstream task is deferred */
+#define TX_STAGE_RETRY_NS	5000
+
+struct module;
+
+/* in the module private data */
+struct tx_stage_conf {
+	struct module *m;	/* set by tx_stage_init() */
+	struct port *port;
+	queue_t qid;
+	pkt_io_func_t send_pkts;
+
+	int max_pkts;		/* 0 if staging is disabled */
+	uint64_t max_age;	/* in cycles */
+	uint64_t retry;		/* TX_STAGE_RETRY_NS, in cycles */
+	int backpressure;
+};
+
+/* use as (or embed at the beginning of) per-worker private data */
+struct tx_stage {
+	const struct tx_stage_conf *conf;
+	struct timer timer;	/* armed while cnt > 0 */
+
+	int cnt;
+
+	uint64_t retried;	/* sent after being staged */
+	uint64_t dropped_full;	/* did not fit in the FIFO */
+	uint64_t dropped_aged;	/* staged for more than max_age */
+	uint64_t deferred;	/* times the upstream task was deferred */
+
+	uint64_t tsc[TX_STAGE_MAX_PKTS];	/* when each packet was staged */
+	struct snbuf *pkts[TX_STAGE_MAX_PKTS];
+};
+
+/* Parses the "tx_buffer" (packets, 0 to disable), "tx_buffer_age" (us)
+ * and "backpressure" (0/1) options. port, qid, and send_pkts of conf must
+ * be set already. m->priv_worker[] must be struct tx_stage */
+struct snobj *tx_stage_init(struct module *m, struct tx_stage_conf *conf,
+		struct snobj *arg);
+
+/* frees the packets staged by the worker. As mclass->deinit_worker() */
+void tx_stage_deinit_worker(struct module *m, int wid);
+
+/* sends the batch, after any staged packets. Takes all packets */
+void tx_stage_send(struct tx_stage *s, struct pkt_batch *batch);
+
+/* counters aggregated over all workers */
+struct snobj *tx_stage_get_stats(struct module *m);
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef _CHECKSUM_H_
+#define _CHECKSUM_H_
+
+#include <stdint.h>
+
+/* Incremental update of the Internet checksum (RFC 1624, eqn. 3), for
+ * header fields rewritten in place: HC' = ~(~HC + ~m + m').
+ *
+ * All values are taken as they are in the packet (network order). The
+ * one's complement sum does not depend on the byte order, so no swapping
+ * is needed. */
+
+static inline uint16_t __cksum_fold(uint32_t sum)
+{
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+
+	return sum;
+}
+
+static inline uint16_t cksum_update16(uint16_t cksum, uint16_t old_val,
+		uint16_t new_val)
+{
+	uint32_t sum = (uint16_t)~cksum + (uint16_t)~old_val + new_val;
+
+	return ~__cksum_fold(sum);
+}
+
+static inline uint16_t cksum_update32(uint16_t cksum, uint32_t old_val,
+		uint32_t new_val)
+{
+	uint32_t sum = (uint16_t)~cksum;
+
+	sum += (uint16_t)~old_val + (uint16_t)~(old_val >> 16);
+	sum += (new_val & 0xffff) + (new_val >> 16);
+
+	return ~__cksum_fold(sum);
+}
+
+#endif
@@ -1,163 +1,171 @@
-#include <signal.h>
 #ifndef __HISTOGRAM_H__
 #define __HISTOGRAM_H__
-#define HISTO_TIMEUNIT_MULT (1000lu*1000*1000) // Nano seconds
-#define HISTO_TIME (100lu) // We measure in 100 ns units
-#define HISTO_BUCKETS (1000000) // Buckets
-#define HISTO_HARD_TIMEOUT (HISTO_BUCKETS)
 
-#define HISTO_TIME_TO_SEC(t) ((t) / (HISTO_TIMEUNIT_MULT/HISTO_TIME))
-#define PRINT_THRES (1)
-#define HISTO_BUCKET_VAL(ptr) ((*(ptr)))
-#define HISTO_BUCKET_INC(ptr) ((*(ptr))++)
+#include <stdint.h>
+#include <string.h>
+
+/* Log-linear (HDR-style) histogram of 64-bit values.
+ *
+ * Values below 2^sub_bits have a bucket each. Above that, every power of
+ * two range [2^k, 2^(k+1)) is split into 2^sub_bits equal buckets, so the
+ * relative error of a bucket is at most 2^-sub_bits (e.g., ~3% for 5 bits)
+ * at any magnitude. Values of 2^max_bits or larger are only counted in
+ * above_threshold (and max).
+ *
+ * With 5 sub bits and 40 bits of range, the counters take 9KB, so a
+ * histogram fits in L2 and each module/worker can keep its own, merged
+ * only when read. */
+
+#define HISTO_MIN_SUB_BITS	1
+#define HISTO_MAX_SUB_BITS	10
+#define HISTO_DEFAULT_SUB_BITS	5
+
+#define HISTO_DEFAULT_MAX_BITS	40
 
 typedef uint64_t histo_count_t;
+
 struct histogram {
-	histo_count_t *global_histogram;
+	int sub_bits;
+	int max_bits;
+	uint32_t num_buckets;
+
+	uint64_t count;		/* including above_threshold */
+	uint64_t sum;
+	uint64_t min;		/* UINT64_MAX if empty */
+	uint64_t max;
 	histo_count_t above_threshold;
+
+	histo_count_t buckets[];
 };
 
+static inline uint32_t histo_num_buckets(int sub_bits, int max_bits)
+{
+	return (max_bits - sub_bits + 1) << sub_bits;
+}
 
-static inline uint64_t get_time() {
-	double t = rte_get_tsc_cycles();
-	return (uint64_t)(t * (HISTO_TIMEUNIT_MULT / HISTO_TIME) 
-				/ rte_get_tsc_hz());
+/* in bytes, to allocate a histogram with */
+static inline size_t histo_size(int sub_bits, int max_bits)
+{
+	return sizeof(struct histogram) +
+		histo_num_buckets(sub_bits, max_bits) * sizeof(histo_count_t);
 }
 
-static inline const char* choose_unit_str(int TIMEUNIT)
+static inline void histo_reset(struct histogram *h)
 {
-	if(TIMEUNIT <= 1)
-		return "sec";
-	if(TIMEUNIT <= 1000)
-		return "msec";
-	if(TIMEUNIT <= 1000*1000)
-		return "usec";
-	//if(TIMEUNIT <= 1000*1000*1000)
-	return "nsec";
+	h->count = 0;
+	h->sum = 0;
+	h->min = UINT64_MAX;
+	h->max = 0;
+	h->above_threshold = 0;
+	memset(h->buckets, 0, h->num_buckets * sizeof(histo_count_t));
 }
 
-static inline int choose_unit_mult(int TIMEUNIT)
+/* sub_bits: [HISTO_MIN_SUB_BITS, HISTO_MAX_SUB_BITS], max_bits: up to 64 */
+static inline void histo_init(struct histogram *h, int sub_bits, int max_bits)
 {
-	if(TIMEUNIT <= 1)
-		return 1;
-	if(TIMEUNIT <= 1000)
-		return TIMEUNIT/1000;
-	if(TIMEUNIT <= 1000*1000)
-		return TIMEUNIT/(1000*1000);
-	//if(TIMEUNIT <= 1000*1000*1000)
-	return TIMEUNIT/(1000*1000*1000);
+	h->sub_bits = sub_bits;
+	h->max_bits = max_bits;
+	h->num_buckets = histo_num_buckets(sub_bits, max_bits);
+	histo_reset(h);
 }
 
-static void print_hist(struct histogram* hist) {
-	const int timeunit_mult = choose_unit_mult(HISTO_TIMEUNIT_MULT);
-	const char* timeunit_name = choose_unit_str(HISTO_TIMEUNIT_MULT);
-	printf("Unit: %lu %s\n", HISTO_TIME * timeunit_mult, timeunit_name);
-	histo_count_t *global_histogram = hist->global_histogram;
-	for(int i=0; i<HISTO_BUCKETS; i++) {
-		size_t current_size = HISTO_BUCKET_VAL(global_histogram+i);
-		if (current_size > 0)
-			printf(" <  %9lu %s: %16lu pkts  \n",
-				(i+1)*HISTO_TIME*timeunit_mult, 
-				timeunit_name, current_size);
-	}
-	printf("above threshold %09lu pkts \n", hist->above_threshold);
+static inline uint32_t histo_bucket_idx(const struct histogram *h,
+		uint64_t v)
+{
+	int msb = 63 - __builtin_clzl(v | 1);
+	int shift;
+
+	if (msb < h->sub_bits)
+		return v;
 
+	shift = msb - h->sub_bits;
 
+	return ((shift + 1) << h->sub_bits) +
+		((v >> shift) & ((1ul << h->sub_bits) - 1));
 }
 
-// Add histogram b's observations into a, so that a contains all.
-static struct histogram* combine_histograms(struct histogram* a, 
-					struct histogram* b) {
-	for (int i=0; i<HISTO_BUCKETS; i++) {
-		*(a->global_histogram + i) += (*(b->global_histogram + i));
-	}
-	a->above_threshold += b->above_threshold;
-	return a;
+/* the lowest value of the bucket */
+static inline uint64_t histo_bucket_value(const struct histogram *h,
+		uint32_t idx)
+{
+	uint32_t sub = idx & ((1u << h->sub_bits) - 1);
+	int shift = (idx >> h->sub_bits) - 1;
+
+	if (shift < 0)
+		return idx;
+
+	return (uint64_t)((1u << h->sub_bits) + sub) << shift;
 }
 
-static void print_summary(struct histogram* hist) {
-	// NOTE: This is destructive.
-	uint64_t total = 0;
-	uint64_t count = 0;
-	uint64_t min = 0;
-	uint64_t max = 0;
-	int max_bucket=0;
-	int found_min = 0;
-	const int timeunit_mult = choose_unit_mult(HISTO_TIMEUNIT_MULT);
-	const char* timeunit_name = choose_unit_str(HISTO_TIMEUNIT_MULT);
-	printf("   Unit: %lu %s\n", HISTO_TIME * timeunit_mult, timeunit_name);
-	printf("\n\nSummary Statistics\n");
-	printf("-----------------------------------------------------------\n");
-	histo_count_t *global_histogram = hist->global_histogram;
-	for(int i=0; i<HISTO_BUCKETS; i++) {
-		size_t current_size = HISTO_BUCKET_VAL(global_histogram+i);
-		uint64_t latency = (i+1)*HISTO_TIME*timeunit_mult;
-		if (!found_min && current_size > 0) {
-			min = latency;
-			found_min = 1;
-		}
-		if (current_size > 0) {
-			max = latency;
-			max_bucket=i;
-		}
-		histo_count_t* bucket = global_histogram + i;
-		uint64_t samples = HISTO_BUCKET_VAL(bucket);
-		count += samples;
-		*bucket = count;
-		total += (samples * latency);
-	}
+/* the highest value of the bucket */
+static inline uint64_t histo_bucket_value_high(const struct histogram *h,
+		uint32_t idx)
+{
+	int shift = (idx >> h->sub_bits) - 1;
 
-	if (count == 0) {
-		printf("No data recorded\n");
-		return;
-	}
+	if (shift <= 0)
+		return histo_bucket_value(h, idx);
 
-	uint64_t counts[]  =	{count / 100, 
-				 count / 2, 
-				(count * 99) / 100,
-				(count * 999) / 1000,
-				(uint64_t)((double)count * (0.9999)),
-				(uint64_t)((double)count * (0.99999)),
-				(uint64_t)((double)count * (0.999999))};
-	
-	uint64_t latencies[] = {0,0,0,0,0,0,0};
-
-	for (int i=0; i<max_bucket; i++) {
-		uint64_t latency = (i+1)*HISTO_TIME*timeunit_mult;
-		for (int j=0; j<sizeof(counts)/sizeof(uint64_t); j++) {
-			if(HISTO_BUCKET_VAL(global_histogram + i) < counts[j]) {
-				latencies[j] = latency;
-			} 
-		}
-	}
+	return histo_bucket_value(h, idx) + (1ul << shift) - 1;
+}
 
-	printf("##   Min: %lu %s\n", min, timeunit_name);
-	printf("##   Avg: %lu %s\n", (total/count), timeunit_name);
-	printf("##   Max: %lu %s\n", max, timeunit_name);
-	printf("##   1%%ile: %lu %s\n", latencies[0], timeunit_name);
-	printf("##   50%%ile: %lu %s\n", latencies[1], timeunit_name);
-	printf("##   99%%ile: %lu %s\n", latencies[2], timeunit_name);
-	printf("##   99.9%%ile: %lu %s\n", latencies[3], timeunit_name);
-	printf("##   99.99%%ile: %lu %s\n", latencies[4], timeunit_name);
-	printf("##   99.999%%ile: %lu %s\n", latencies[5], timeunit_name);
-	printf("##   99.9999%%ile: %lu %s\n", latencies[6], timeunit_name);
-	printf("##   Total: %lu\n", count);
+static inline void histo_record(struct histogram *h, uint64_t v)
+{
+	h->count++;
+	h->sum += v;
+	if (v < h->min)
+		h->min = v;
+	if (v > h->max)
+		h->max = v;
+
+	if (h->max_bits < 64 && v >> h->max_bits)
+		h->above_threshold++;
+	else
+		h->buckets[histo_bucket_idx(h, v)]++;
 }
 
-static inline void record_latency(struct histogram* hist, uint64_t latency) {
-	if (latency >= HISTO_HARD_TIMEOUT) {
-		hist->above_threshold ++;
-	} else {
-		histo_count_t* bucket = hist->global_histogram + latency;
-		HISTO_BUCKET_INC(bucket);
-	}
+/* Adds the observations of src into dst. Both must have the same layout
+ * (sub_bits and max_bits). */
+static inline void histo_merge(struct histogram *dst,
+		const struct histogram *src)
+{
+	for (uint32_t i = 0; i < dst->num_buckets; i++)
+		dst->buckets[i] += src->buckets[i];
+
+	dst->count += src->count;
+	dst->sum += src->sum;
+	if (src->min < dst->min)
+		dst->min = src->min;
+	if (src->max > dst->max)
+		dst->max = src->max;
+	dst->above_threshold += src->above_threshold;
 }
 
-static inline void init_hist(struct histogram* hist) {
-	// This is somewhere within DPDK, which is why you are not seeing it here.
-	hist->global_histogram = rte_zmalloc("timestamp:global_histo",
-		HISTO_BUCKETS * sizeof(histo_count_t), RTE_CACHE_LINE_SIZE);
-	printf("TSC HZ: %lu\n", rte_get_tsc_hz());
+/* The value at the given percentile (0-100), as the highest value of its
+ * bucket (but not above max). Returns 0 if empty. */
+static inline uint64_t histo_percentile(const struct histogram *h,
+		double percentile)
+{
+	uint64_t target;
+	uint64_t seen = 0;
+
+	if (h->count == 0)
+		return 0;
+
+	target = (uint64_t)(h->count * percentile / 100.0 + 0.5);
+	if (target < 1)
+		target = 1;
+
+	for (uint32_t i = 0; i < h->num_buckets; i++) {
+		seen += h->buckets[i];
+		if (seen >= target) {
+			uint64_t v = histo_bucket_value_high(h, i);
+			return v < h->max ? v : h->max;
+		}
+	}
+
+	/* above the threshold */
+	return h->max;
 }
 
 #endif
@@ -149,4 +149,57 @@ static void heap_pop(struct heap *h)
 	heap_replace(h, val, data);
 }
 
+/* O(n). Removes the node with the given data, if any. Returns 0 on success */
+static int heap_remove(struct heap *h, void *data)
+{
+	int64_t *arr_v = h->arr_v;
+	void **arr_d = h->arr_d;
+
+	int64_t val;
+	void *last;
+
+	uint32_t i;
+	uint32_t c;
+
+	for (i = 1; i <= h->num_nodes; i++)
+		if (arr_d[i] == data)
+			goto found;
+
+	return -1;
+
+found:
+	val = arr_v[h->num_nodes];
+	last = arr_d[h->num_nodes];
+	arr_v[h->num_nodes] = INT64_MAX;
+	arr_d[h->num_nodes] = NULL;
+	h->num_nodes--;
+
+	if (i > h->num_nodes)	/* was the last node */
+		return 0;
+
+	/* sift up... */
+	while (val < arr_v[i / 2]) {
+		arr_v[i] = arr_v[i / 2];
+		arr_d[i] = arr_d[i / 2];
+		i = i / 2;
+	}
+
+	/* ...or down */
+	for (c = i * 2; ; c = i * 2) {
+		c += (arr_v[c] > arr_v[c + 1]);
+
+		if (val <= arr_v[c])
+			break;
+
+		arr_v[i] = arr_v[c];
+		arr_d[i] = arr_d[c];
+		i = c;
+	}
+
+	arr_v[i] = val;
+	arr_d[i] = last;
+
+	return 0;
+}
+
 #endif
@@ -25,4 +25,41 @@ struct pcap_rec_hdr {
 	uint32_t orig_len;       /* actual length of packet */
 };
 
+/* Shared-memory ring of pcap records, filled by the tcpdump gate hook and
+ * drained by an external reader (e.g., bessctl), so that workers never
+ * block on a slow reader.
+ *
+ * The file is a struct dump_ring, followed by num_slots slots of slot_size
+ * bytes. Each slot is a struct dump_slot. Slot i is free for the record
+ * at position pos (pos % num_slots == i) if seq == pos, and holds
+ * the record if seq == pos + 1. The reader consumes records in order, and
+ * frees a slot by setting seq to pos + num_slots.
+ *
+ * Workers drop records and increase overflows if the next slot is not free.
+ * The layout is fixed (offsets in bytes), since non-C readers map it. */
+#define DUMP_RING_MAGIC		0x504d5544	/* "DUMP" */
+#define DUMP_RING_VERSION	1
+
+struct dump_ring {
+	uint32_t magic;		/* 0 */
+	uint32_t version;	/* 4 */
+	uint32_t num_slots;	/* 8, power of 2 */
+	uint32_t slot_size;	/* 12, multiple of 64 */
+	uint32_t snaplen;	/* 16 */
+	uint32_t sample;	/* 20, 1 out of this many packets */
+
+	volatile uint64_t overflows __attribute__((aligned(64)));	/* 64 */
+
+	/* next position for workers */
+	volatile uint64_t head __attribute__((aligned(64)));	/* 128 */
+
+	char slots[0] __attribute__((aligned(64)));		/* 192 */
+};
+
+struct dump_slot {
+	volatile uint64_t seq;		/* 0 */
+	struct pcap_rec_hdr rec;	/* 8 */
+	char data[0];			/* 24, up to snaplen bytes */
+};
+
 #endif
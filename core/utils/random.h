@@ -1,6 +1,12 @@
 #ifndef __RANDOM_H__
 #define __RANDOM_H__
 
+#include <stdint.h>
+
+#if __AVX2__
+#include <x86intrin.h>
+#endif
+
 static inline uint32_t rand_fast(uint64_t *seed)
 {
 	uint64_t next_seed;
@@ -36,4 +42,101 @@ static inline uint32_t rand_fast_range(uint64_t *seed, uint32_t range)
 	return (tmp.d - 1.0) * range;
 }
 
+/* xorshift128+ in RAND_VEC_LANES independent 64-bit lanes, each step
+ * giving 2 * RAND_VEC_LANES 32-bit values. With AVX2, a step is a handful
+ * of instructions for all lanes. The scalar version gives the same
+ * sequence. */
+
+#define RAND_VEC_LANES		4
+#define RAND_VEC_VALS		(RAND_VEC_LANES * 2)	/* per step */
+
+struct rand_vec {
+	uint64_t s0[RAND_VEC_LANES];
+	uint64_t s1[RAND_VEC_LANES];
+} __attribute__((aligned(32)));
+
+/* splitmix64, to derive non-zero lane states from one seed */
+static inline uint64_t __rand_splitmix64(uint64_t *x)
+{
+	uint64_t z = (*x += 0x9e3779b97f4a7c15ul);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ul;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebul;
+	return z ^ (z >> 31);
+}
+
+static inline void rand_vec_init(struct rand_vec *r, uint64_t seed)
+{
+	for (int i = 0; i < RAND_VEC_LANES; i++) {
+		r->s0[i] = __rand_splitmix64(&seed) | 1;
+		r->s1[i] = __rand_splitmix64(&seed);
+	}
+}
+
+/* Fills out[] with n (rounded up to a multiple of RAND_VEC_VALS) values of
+ * [min, min + range), range in [1, 2^32]. The range reduction is a
+ * multiply and a shift (Lemire), not a modulo. */
+static inline void rand_vec_range(struct rand_vec *r, uint32_t *out, int n,
+		uint32_t min, uint64_t range)
+{
+#if __AVX2__
+	__m256i s0 = _mm256_load_si256((__m256i *)r->s0);
+	__m256i s1 = _mm256_load_si256((__m256i *)r->s1);
+	__m256i v_min = _mm256_set1_epi32(min);
+	__m256i v_range = _mm256_set1_epi64x(range);
+
+	for (int i = 0; i < n; i += RAND_VEC_VALS) {
+		__m256i x = s0;
+		__m256i y = s1;
+		__m256i v;
+
+		s0 = y;
+		x = _mm256_xor_si256(x, _mm256_slli_epi64(x, 23));
+		s1 = _mm256_xor_si256(_mm256_xor_si256(x, y),
+				_mm256_xor_si256(_mm256_srli_epi64(x, 17),
+					_mm256_srli_epi64(y, 26)));
+		v = _mm256_add_epi64(s1, y);
+
+		if (range <= UINT32_MAX) {
+			/* the high 32 bits of each 32x32 product */
+			__m256i lo = _mm256_srli_epi64(
+					_mm256_mul_epu32(v, v_range), 32);
+			__m256i hi = _mm256_mul_epu32(
+					_mm256_srli_epi64(v, 32), v_range);
+
+			v = _mm256_blend_epi32(lo, hi, 0xaa);
+		}
+
+		_mm256_storeu_si256((__m256i *)&out[i],
+				_mm256_add_epi32(v, v_min));
+	}
+
+	_mm256_store_si256((__m256i *)r->s0, s0);
+	_mm256_store_si256((__m256i *)r->s1, s1);
+#else
+	for (int i = 0; i < n; i += RAND_VEC_VALS) {
+		for (int j = 0; j < RAND_VEC_LANES; j++) {
+			uint64_t x = r->s0[j];
+			uint64_t y = r->s1[j];
+			uint64_t v;
+
+			r->s0[j] = y;
+			x ^= x << 23;
+			r->s1[j] = x ^ y ^ (x >> 17) ^ (y >> 26);
+			v = r->s1[j] + y;
+
+			if (range <= UINT32_MAX) {
+				out[i + j * 2] = min +
+					(((v & 0xffffffff) * range) >> 32);
+				out[i + j * 2 + 1] = min +
+					(((v >> 32) * range) >> 32);
+			} else {
+				out[i + j * 2] = min + (uint32_t)v;
+				out[i + j * 2 + 1] = min + (uint32_t)(v >> 32);
+			}
+		}
+	}
+#endif
+}
+
 #endif
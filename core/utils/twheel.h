@@ -0,0 +1,356 @@
+#ifndef _TWHEEL_H_
+#define _TWHEEL_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#include <rte_branch_prediction.h>
+#include <rte_common.h>
+#include <rte_malloc.h>
+
+#include "../debug.h"
+
+#include "cdlist.h"
+
+/* Hierarchical timing wheel keyed on TSC.
+ *
+ * Time is quantized into ticks of (1 << tick_shift) cycles. Each level has
+ * TW_SLOTS slots, and a slot at level l covers (TW_SLOTS ^ l) ticks.
+ * Entries are intrusive (embed struct twheel_entry in your struct), so that
+ * add is O(1) and expiry touches only the slot head and the entries in it.
+ *
+ * Slot heads are struct cdlist_item sentinels (rather than cdlist_head),
+ * so that all list accesses are done through a single type and are safe
+ * from strict aliasing (the Makefile builds with -Ofast).
+ *
+ * Entries never fire early; they may fire up to one tick late.
+ * twheel_del() removes an entry in O(1). Its slot may stay marked as
+ * occupied until the wheel passes it, which only costs a little skipping. */
+
+#define TW_LEVELS		4
+#define TW_SLOT_BITS		8
+#define TW_SLOTS		(1 << TW_SLOT_BITS)
+#define TW_SLOT_MASK		(TW_SLOTS - 1)
+
+#define TW_DEFAULT_TICK_SHIFT	10	/* 1024 cycles, ~0.4us at 2.5GHz */
+
+struct twheel_entry {
+	struct cdlist_item slot;
+	uint64_t expire;		/* in TSC */
+};
+
+struct twheel {
+	uint64_t now;			/* in ticks */
+	int tick_shift;
+
+	uint32_t num_entries;		/* including the ready ones */
+
+	/* bitmap of non-empty slots, to skip idle ticks quickly */
+	uint64_t occupied[TW_LEVELS][TW_SLOTS / 64];
+
+	/* expired, but not yet popped */
+	struct cdlist_item ready;
+
+	struct cdlist_item (*slots)[TW_SLOTS];
+};
+
+static void twheel_init(struct twheel *tw, uint64_t tsc, int tick_shift)
+{
+	int i;
+	int j;
+
+	tw->tick_shift = tick_shift;
+	tw->now = tsc >> tick_shift;
+	tw->num_entries = 0;
+
+	memset(tw->occupied, 0, sizeof(tw->occupied));
+
+	cdlist_item_init(&tw->ready);
+
+	tw->slots = rte_malloc("twheel",
+			sizeof(struct cdlist_item) * TW_LEVELS * TW_SLOTS, 64);
+	if (!tw->slots)
+		oom_crash();
+
+	for (i = 0; i < TW_LEVELS; i++)
+		for (j = 0; j < TW_SLOTS; j++)
+			cdlist_item_init(&tw->slots[i][j]);
+}
+
+static void twheel_close(struct twheel *tw)
+{
+	rte_free(tw->slots);
+	tw->slots = NULL;
+}
+
+static inline int twheel_is_empty(const struct twheel *tw)
+{
+	return tw->num_entries == 0;
+}
+
+static inline int __twheel_level_occupied(const struct twheel *tw, int level)
+{
+	const uint64_t *map = tw->occupied[level];
+
+	return (map[0] | map[1] | map[2] | map[3]) != 0;
+}
+
+static inline int __twheel_list_empty(const struct cdlist_item *sentinel)
+{
+	return !cdlist_is_hooked(sentinel);
+}
+
+static inline struct cdlist_item *__twheel_slot(struct twheel *tw,
+		int level, uint64_t tick)
+{
+	return &tw->slots[level][(tick >> (TW_SLOT_BITS * level)) & 
+		TW_SLOT_MASK];
+}
+
+static inline void __twheel_mark(struct twheel *tw, int level, uint64_t tick)
+{
+	int idx = (tick >> (TW_SLOT_BITS * level)) & TW_SLOT_MASK;
+
+	tw->occupied[level][idx / 64] |= (1UL << (idx % 64));
+}
+
+static inline void __twheel_unmark(struct twheel *tw, int level, uint64_t tick)
+{
+	int idx = (tick >> (TW_SLOT_BITS * level)) & TW_SLOT_MASK;
+
+	tw->occupied[level][idx / 64] &= ~(1UL << (idx % 64));
+}
+
+/* place e according to its expiry, relative to tw->now */
+static inline void __twheel_place(struct twheel *tw, struct twheel_entry *e)
+{
+	uint64_t tick;
+	uint64_t delta;
+	int level;
+
+	/* round up, so that entries never expire early */
+	tick = (e->expire + (1UL << tw->tick_shift) - 1) >> tw->tick_shift;
+
+	if (tick <= tw->now) {
+		cdlist_add_before(&tw->ready, &e->slot);
+		return;
+	}
+
+	delta = tick - tw->now;
+
+	for (level = 0; level < TW_LEVELS - 1; level++)
+		if (delta < (1UL << (TW_SLOT_BITS * (level + 1))))
+			break;
+
+	/* too far in the future. park it in the farthest slot;
+	 * it will be re-placed when the slot is cascaded */
+	if (delta >= (1UL << (TW_SLOT_BITS * TW_LEVELS)))
+		tick = tw->now + (1UL << (TW_SLOT_BITS * TW_LEVELS)) - 1;
+
+	__twheel_mark(tw, level, tick);
+	cdlist_add_before(__twheel_slot(tw, level, tick), &e->slot);
+}
+
+static inline void twheel_add(struct twheel *tw, struct twheel_entry *e,
+		uint64_t expire_tsc)
+{
+	e->expire = expire_tsc;
+	tw->num_entries++;
+	__twheel_place(tw, e);
+}
+
+/* move all entries in the given slot to the ready list */
+static inline void __twheel_splice_ready(struct twheel *tw,
+		struct cdlist_item *slot)
+{
+	struct cdlist_item *first = slot->next;
+	struct cdlist_item *last = slot->prev;
+
+	first->prev = tw->ready.prev;
+	tw->ready.prev->next = first;
+
+	last->next = &tw->ready;
+	tw->ready.prev = last;
+
+	cdlist_item_init(slot);
+}
+
+static inline void __twheel_cascade(struct twheel *tw, int level)
+{
+	struct cdlist_item *slot;
+	struct cdlist_item *item;
+	struct cdlist_item *next;
+
+	slot = __twheel_slot(tw, level, tw->now);
+
+	/* may have been emptied by twheel_del() */
+	__twheel_unmark(tw, level, tw->now);
+
+	if (__twheel_list_empty(slot))
+		return;
+
+	for (item = slot->next; item != slot; item = next) {
+		next = item->next;
+		__twheel_place(tw, container_of(item, struct twheel_entry,
+					slot));
+	}
+
+	cdlist_item_init(slot);
+}
+
+static void __twheel_advance(struct twheel *tw, uint64_t target)
+{
+	while (tw->now < target) {
+		struct cdlist_item *slot;
+		uint64_t jump_to;
+		int level;
+		int top;
+
+		/* skip over the ticks for which nothing can happen:
+		 * if levels [0, l) are all empty, only the next boundary of
+		 * level l matters */
+		for (level = 0; level < TW_LEVELS; level++)
+			if (__twheel_level_occupied(tw, level))
+				break;
+
+		if (level == TW_LEVELS) {
+			/* all remaining entries are in the ready list */
+			tw->now = target;
+			return;
+		}
+
+		if (level > 0) {
+			uint64_t bits = TW_SLOT_BITS * level;
+
+			jump_to = ((tw->now >> bits) + 1) << bits;
+			if (jump_to > target) {
+				tw->now = target;
+				return;
+			}
+			tw->now = jump_to;
+		} else
+			tw->now++;
+
+		/* cascade from the highest level whose boundary is hit */
+		for (top = 1; top < TW_LEVELS; top++)
+			if (tw->now & ((1UL << (TW_SLOT_BITS * top)) - 1))
+				break;
+
+		for (level = top - 1; level >= 1; level--)
+			__twheel_cascade(tw, level);
+
+		slot = __twheel_slot(tw, 0, tw->now);
+		__twheel_unmark(tw, 0, tw->now);
+		if (!__twheel_list_empty(slot))
+			__twheel_splice_ready(tw, slot);
+	}
+}
+
+/* A lower bound of the TSC when the next entry expires, without advancing
+ * the wheel. UINT64_MAX if empty. */
+static uint64_t twheel_next_expiry(const struct twheel *tw)
+{
+	uint64_t ret = UINT64_MAX;
+	int level;
+
+	if (tw->num_entries == 0)
+		return UINT64_MAX;
+
+	if (!__twheel_list_empty(&tw->ready))
+		return tw->now << tw->tick_shift;
+
+	/* an upper level slot may expire earlier than a lower level one,
+	 * since entries were placed at different times */
+	for (level = 0; level < TW_LEVELS; level++) {
+		uint64_t bits = TW_SLOT_BITS * level;
+		uint64_t base = tw->now >> bits;
+		int i;
+
+		if (!__twheel_level_occupied(tw, level))
+			continue;
+
+		/* the nearest occupied slot, after the current one */
+		for (i = 1; i < TW_SLOTS; i++) {
+			int idx = (base + i) & TW_SLOT_MASK;
+
+			if (tw->occupied[level][idx / 64] & (1UL << (idx % 64)))
+				break;
+		}
+
+		/* entries in a slot at level > 0 may expire at its start */
+		ret = RTE_MIN(ret, ((base + i) << bits) << tw->tick_shift);
+	}
+
+	return ret;
+}
+
+/* returns the entry with expire <= tsc (not necessarily the smallest one),
+ * or NULL if there are none. The entry is not removed. */
+static inline struct twheel_entry *twheel_peek(struct twheel *tw, uint64_t tsc)
+{
+	if (__twheel_list_empty(&tw->ready)) {
+		if (likely(tw->num_entries == 0)) {
+			tw->now = tsc >> tw->tick_shift;
+			return NULL;
+		}
+
+		__twheel_advance(tw, tsc >> tw->tick_shift);
+
+		if (__twheel_list_empty(&tw->ready))
+			return NULL;
+	}
+
+	return container_of(tw->ready.next, struct twheel_entry, slot);
+}
+
+static void __twheel_drain_list(struct cdlist_item *head,
+		void (*f)(struct twheel_entry *e))
+{
+	struct cdlist_item *item;
+	struct cdlist_item *next;
+
+	for (item = head->next; item != head; item = next) {
+		next = item->next;
+		f(container_of(item, struct twheel_entry, slot));
+	}
+
+	cdlist_item_init(head);
+}
+
+/* removes all entries, calling f on each of them (f must not use tw) */
+static void twheel_drain(struct twheel *tw, void (*f)(struct twheel_entry *e))
+{
+	__twheel_drain_list(&tw->ready, f);
+
+	for (int i = 0; i < TW_LEVELS; i++)
+		for (int j = 0; j < TW_SLOTS; j++)
+			__twheel_drain_list(&tw->slots[i][j], f);
+
+	tw->num_entries = 0;
+	memset(tw->occupied, 0, sizeof(tw->occupied));
+}
+
+/* e must have been added to tw, and not popped yet */
+static inline void twheel_del(struct twheel *tw, struct twheel_entry *e)
+{
+	cdlist_del(&e->slot);
+
+	/* no stale marks, when the wheel jumps ahead in twheel_peek() */
+	if (--tw->num_entries == 0)
+		memset(tw->occupied, 0, sizeof(tw->occupied));
+}
+
+static inline struct twheel_entry *twheel_pop(struct twheel *tw, uint64_t tsc)
+{
+	struct twheel_entry *e;
+
+	e = twheel_peek(tw, tsc);
+	if (e) {
+		cdlist_del(&e->slot);
+		tw->num_entries--;
+	}
+
+	return e;
+}
+
+#endif
@@ -1,6 +1,10 @@
 #include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <limits.h>
+#include <poll.h>
 #include <sys/eventfd.h>
 
 #include <rte_config.h>
@@ -11,13 +15,25 @@
 #include "worker.h"
 #include "time.h"
 #include "module.h"
+#include "port.h"
+#include "log.h"
 
 int num_workers;
 struct worker_context * volatile workers[MAX_WORKERS];
 __thread struct worker_context ctx;
 
+const char *drop_cause_names[NUM_DROP_CAUSES] = {
+	[DROP_DEADEND]		= "deadend",
+	[DROP_NO_MBUF]		= "no_mbuf",
+	[DROP_TX_FULL]		= "tx_full",
+	[DROP_QUEUE_FULL]	= "queue_full",
+	[DROP_FILTER]		= "filter",
+	[DROP_INVALID]		= "invalid",
+};
+
 #define SYS_CPU_DIR "/sys/devices/system/cpu/cpu%u"
 #define CORE_ID_FILE "topology/core_id"
+#define SIBLINGS_FILE "topology/thread_siblings_list"
 
 /* Check if a cpu is present by the presence of the cpu information for it */
 int is_cpu_present(unsigned int core_id)
@@ -33,6 +49,53 @@ int is_cpu_present(unsigned int core_id)
        return 1;
 }
 
+int add_smt_siblings(cpu_set_t *set, unsigned int core_id)
+{
+	char path[PATH_MAX];
+	char buf[256];
+	char *p;
+	FILE *fp;
+	int cnt = 0;
+
+	snprintf(path, sizeof(path), SYS_CPU_DIR "/" SIBLINGS_FILE, core_id);
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return -errno;
+
+	if (!fgets(buf, sizeof(buf), fp)) {
+		fclose(fp);
+		return -EIO;
+	}
+
+	fclose(fp);
+
+	/* the list is in the form of "0,28" or "0-1" */
+	for (p = strtok(buf, ",\n"); p; p = strtok(NULL, ",\n")) {
+		unsigned int first;
+		unsigned int last;
+
+		switch (sscanf(p, "%u-%u", &first, &last)) {
+		case 1:
+			last = first;
+			break;
+		case 2:
+			break;
+		default:
+			return -EINVAL;
+		}
+
+		for (unsigned int cpu = first; cpu <= last && 
+				cpu < CPU_SETSIZE; cpu++) {
+			if (!CPU_ISSET(cpu, set))
+				cnt++;
+			CPU_SET(cpu, set);
+		}
+	}
+
+	return cnt;
+}
+
 void set_non_worker()
 {
 	int socket;
@@ -44,12 +107,21 @@ void set_non_worker()
 	ctx.core = INT_MIN;
 	ctx.socket = INT_MIN;
 	ctx.fd_event = INT_MIN;
+	ctx.fd_wakeup = INT_MIN;
+
+	/* e.g., for drivers called by the master */
+	ctx.task_deadline_tsc = UINT64_MAX;
 
 	/* Packet pools should be available to non-worker threads */
 	for (socket = 0; socket < RTE_MAX_NUMA_NODES; socket++) {
 		struct rte_mempool *pool = get_pframe_pool_socket(socket);
-		if (pool)
-			ctx.pframe_pool = pool;
+		if (!pool)
+			continue;
+
+		ctx.pframe_pool = pool;
+		for (int cls = 0; cls < SNB_NUM_CLASSES; cls++)
+			ctx.pframe_pools[cls] = 
+				get_pframe_pool_class(socket, cls);
 	}
 }
 
@@ -58,13 +130,93 @@ int is_worker_core(int cpu)
 	int wid;
 
 	for (wid = 0; wid < MAX_WORKERS; wid++) {
-		if (is_worker_active(wid) && workers[wid]->core == cpu)
+		if (is_worker_active(wid) && 
+				CPU_ISSET(cpu, &workers[wid]->cpuset))
 			return 1;
 	}
 
 	return 0;
 }
 
+void wakeup_worker(int wid)
+{
+	struct worker_context *w = workers[wid];
+
+	FULL_BARRIER();
+
+	if (w && w->sleeping) {
+		int ret;
+
+		w->wakeup_tsc = rdtsc();
+		ret = write(w->fd_wakeup, &(uint64_t){1}, sizeof(uint64_t));
+		assert(ret == sizeof(uint64_t));
+	}
+}
+
+int run_on_worker(int wid, int (*func)(void *), void *arg)
+{
+	struct worker_context *w = workers[wid];
+	struct worker_call call = {.func = func, .arg = arg};
+
+	if (!w || w->status != WORKER_RUNNING)
+		return func(arg);
+
+	do {
+		call.next = w->calls;
+	} while (!__sync_bool_compare_and_swap(&w->calls, call.next, &call));
+
+	wakeup_worker(wid);
+
+	while (!call.done)
+		__builtin_ia32_pause();
+
+	INST_BARRIER();
+
+	return call.ret;
+}
+
+static int quiescent_nop(void *arg)
+{
+	return 0;
+}
+
+void synchronize_workers(void)
+{
+	FULL_BARRIER();
+
+	for (int wid = 0; wid < MAX_WORKERS; wid++)
+		if (is_worker_running(wid))
+			run_on_worker(wid, quiescent_nop, NULL);
+}
+
+void process_worker_calls(void)
+{
+	struct worker_call *list;
+	struct worker_call *prev = NULL;
+
+	list = __sync_lock_test_and_set(&ctx.calls, NULL);
+
+	/* LIFO -> FIFO */
+	while (list) {
+		struct worker_call *next = list->next;
+
+		list->next = prev;
+		prev = list;
+		list = next;
+	}
+
+	while (prev) {
+		/* the caller may go away as soon as done is set */
+		struct worker_call *next = prev->next;
+
+		prev->ret = prev->func(prev->arg);
+		STORE_BARRIER();
+		prev->done = 1;
+
+		prev = next;
+	}
+}
+
 static void pause_worker(int wid)
 {
 	if (workers[wid] && workers[wid]->status == WORKER_RUNNING) {
@@ -72,21 +224,46 @@ static void pause_worker(int wid)
 
 		FULL_BARRIER();
 
+		wakeup_worker(wid);
+
 		while (workers[wid]->status == WORKER_PAUSING)
 			; 	/* spin */
 	}
 }
 
+/* With all workers paused, finish any work stealing in progress. */
+static void drain_steal_mailboxes()
+{
+	for (int wid = 0; wid < MAX_WORKERS; wid++) {
+		struct worker_context *w = workers[wid];
+		struct tc *c;
+
+		if (!w)
+			continue;
+
+		c = w->steal_mailbox;
+		if (c) {
+			w->steal_mailbox = NULL;
+			sched_graft_tc(w->s, c);
+		}
+
+		w->steal_req = -1;
+		w->steal_pending = 0;
+	}
+}
+
 void pause_all_workers() 
 {
 	for (int wid = 0; wid < MAX_WORKERS; wid++)
 		pause_worker(wid);
+
+	drain_steal_mailboxes();
 }
 
 #define SIGNAL_UNBLOCK	1
 #define SIGNAL_QUIT	2
 
-static void resume_worker(int wid)
+void resume_worker(int wid)
 {
 	if (workers[wid] && workers[wid]->status == WORKER_PAUSED) {
 		int ret;
@@ -104,6 +281,9 @@ void resume_all_workers()
 {
 	process_orphan_tasks();
 
+	/* tasks (thus queues) may have been attached to other workers */
+	reset_queue_owners();
+
 	for (int wid = 0; wid < MAX_WORKERS; wid++)
 		resume_worker(wid);
 }
@@ -134,6 +314,135 @@ void destroy_all_workers()
 		destroy_worker(wid);
 }
 
+/* on the draining worker. Returns 1 if its steal request is still being
+ * answered by the victim, which will put a TC in the mailbox */
+static int cancel_steal(void *arg)
+{
+	struct tc *c;
+
+	if (ctx.steal_pending) {
+		for (int wid = 0; wid < MAX_WORKERS; wid++) {
+			struct worker_context *w = workers[wid];
+
+			if (w && __sync_bool_compare_and_swap(&w->steal_req,
+						ctx.wid, -1))
+				ctx.steal_pending = 0;
+		}
+
+		if (ctx.steal_pending)
+			return 1;
+	}
+
+	/* it will be moved on along with the others */
+	c = ctx.steal_mailbox;
+	if (c) {
+		ctx.steal_mailbox = NULL;
+		sched_graft_tc(ctx.s, c);
+	}
+
+	return 0;
+}
+
+struct tc_handoff {
+	struct sched *s;
+	struct tc *c;
+};
+
+static int handoff_detach(void *arg)
+{
+	struct tc_handoff *h = arg;
+
+	h->c = sched_detach_any(h->s);
+
+	return 0;
+}
+
+static int handoff_graft(void *arg)
+{
+	struct tc_handoff *h = arg;
+
+	sched_graft_tc(h->s, h->c);
+
+	return 0;
+}
+
+/* the active worker with the fewest TCs, preferably on the socket */
+static int pick_handoff_target(int from, int socket)
+{
+	int best = -1;
+	int best_score = INT_MAX;
+
+	for (int wid = 0; wid < MAX_WORKERS; wid++) {
+		struct worker_context *w = workers[wid];
+		int score;
+
+		if (wid == from || !w || w->draining)
+			continue;
+
+		score = w->s->num_classes;
+		if (w->socket != socket)
+			score += MAX_WORKERS * 1024;
+
+		if (score < best_score) {
+			best = wid;
+			best_score = score;
+		}
+	}
+
+	return best;
+}
+
+int remove_worker(int wid)
+{
+	struct worker_context *w = workers[wid];
+	struct tc_handoff h;
+	int moved = 0;
+
+	if (!w)
+		return -ENOENT;
+
+	if (w->s->num_classes > 0 && pick_handoff_target(wid, w->socket) < 0)
+		return -EBUSY;
+
+	/* no more steal requests from it. Thieves may still take its TCs */
+	w->draining = 1;
+	FULL_BARRIER();
+
+	while (run_on_worker(wid, cancel_steal, NULL))
+		__builtin_ia32_pause();
+
+	for (;;) {
+		int target;
+
+		h.s = w->s;
+		run_on_worker(wid, handoff_detach, &h);
+		if (!h.c)
+			break;
+
+		/* cannot fail: draining workers do not count */
+		target = pick_handoff_target(wid, w->socket);
+		assert(target >= 0);
+
+		h.s = workers[target]->s;
+		run_on_worker(target, handoff_graft, &h);
+
+		/* its queues are about to be polled by the new worker */
+		release_queue_owners(wid);
+		moved++;
+	}
+
+	log_info("Worker %d: %d TCs moved to other workers\n", wid, moved);
+
+	/* packets held and timers armed by the worker for its old tasks.
+	 * Remaining timers (e.g., of drivers) are disarmed in sched_free() */
+	deinit_modules_worker(wid);
+
+	destroy_worker(wid);
+	release_queue_owners(wid);
+
+	return 0;
+}
+
 int is_any_worker_running()
 {
 	int wid;
@@ -146,6 +455,104 @@ int is_any_worker_running()
 	return 0;
 }
 
+static int find_steal_victim()
+{
+	for (int i = 1; i < MAX_WORKERS; i++) {
+		int wid = (ctx.wid + i) % MAX_WORKERS;
+		struct worker_context *w = workers[wid];
+
+		if (w && w->status == WORKER_RUNNING && w->idle_rounds == 0)
+			return wid;
+	}
+
+	return -1;
+}
+
+void poll_work_stealing(uint64_t idle_rounds)
+{
+	struct tc *c;
+	int thief;
+
+	ctx.idle_rounds = idle_rounds;
+
+	/* got a TC from someone? */
+	c = ctx.steal_mailbox;
+	if (c) {
+		ctx.steal_mailbox = NULL;
+		sched_graft_tc(ctx.s, c);
+		log_debug("W%d: took TC %s\n", ctx.wid, c->settings.name);
+	}
+
+	/* does someone want my work? */
+	thief = ctx.steal_req;
+	if (thief >= 0) {
+		struct worker_context *w = workers[thief];
+
+		c = sched_detach_stealable(ctx.s);
+		if (c) {
+			/* before the thief can run c and claim its queues */
+			give_up_queues(ctx.wid);
+
+			/* w->steal_mailbox must be empty while pending */
+			w->steal_mailbox = c;
+			STORE_BARRIER();
+		}
+
+		w->steal_pending = 0;
+		ctx.steal_req = -1;
+	}
+
+	if (global_opts.steal_idle_rounds && !ctx.steal_pending &&
+			!ctx.draining &&
+			idle_rounds >= global_opts.steal_idle_rounds) {
+		int victim = find_steal_victim();
+
+		if (victim >= 0) {
+			ctx.steal_pending = 1;
+			STORE_BARRIER();
+
+			if (!__sync_bool_compare_and_swap(
+					&workers[victim]->steal_req, 
+					-1, ctx.wid))
+				ctx.steal_pending = 0;
+		}
+	}
+}
+
+int idle_sleep(uint64_t timeout_ns)
+{
+	struct pollfd pfd = {.fd = ctx.fd_wakeup, .events = POLLIN};
+	struct timespec ts = {
+		.tv_sec = timeout_ns / 1000000000,
+		.tv_nsec = timeout_ns % 1000000000,
+	};
+
+	int ret;
+
+	ctx.sleeping = 1;
+	FULL_BARRIER();
+
+	/* the waker sets its flag first, then checks ctx.sleeping */
+	if (is_pause_requested() || ctx.calls) {
+		ctx.sleeping = 0;
+		return 1;
+	}
+
+	ret = ppoll(&pfd, 1, &ts, NULL);
+
+	ctx.sleeping = 0;
+
+	if (ret > 0) {
+		uint64_t t;
+
+		/* nonblocking. may race with another waker, which is fine */
+		ret = read(ctx.fd_wakeup, &t, sizeof(t));
+		return 1;
+	}
+
+	return 0;
+}
+
 int block_worker()
 {
 	uint64_t t;
@@ -156,9 +563,12 @@ int block_worker()
 	ret = read(ctx.fd_event, &t, sizeof(t));
 	assert(ret == sizeof(t));
 
-	if (t == SIGNAL_UNBLOCK)
+	if (t == SIGNAL_UNBLOCK) {
 		ctx.status = WORKER_RUNNING;
-	else if (t == SIGNAL_QUIT)
+
+		/* enable_pmu() or disable_pmu() while paused? */
+		pmu_sync(&ctx.pmu);
+	} else if (t == SIGNAL_QUIT)
 		return 1;
 	else
 		assert(0);
@@ -166,16 +576,19 @@ int block_worker()
 	return 0;
 }
 
-/* arg is the core ID it should run on */
+/* arg is the set of CPUs it should run on. 
+ * Valid until the worker becomes active */
 static int run_worker(void *arg)
 {
-	cpu_set_t set;
+	cpu_set_t set = *(cpu_set_t *)arg;
 	int core;
 
-	core = (int)(int64_t)arg;
+	for (core = 0; core < CPU_SETSIZE; core++)
+		if (CPU_ISSET(core, &set))
+			break;
+
+	assert(core < CPU_SETSIZE);
 
-	CPU_ZERO(&set);
-	CPU_SET(core, &set);
 	rte_thread_set_affinity(&set);
 
 	/* just in case */
@@ -184,18 +597,30 @@ static int run_worker(void *arg)
 	/* for workers, wid == rte_lcore_id() */
 	ctx.wid = rte_lcore_id();
 	ctx.core = core;
+	ctx.cpuset = set;
 	ctx.socket = rte_socket_id();
 	assert(ctx.socket >= 0);	/* shouldn't be SOCKET_ID_ANY (-1) */
 	ctx.fd_event = eventfd(0, 0);
 	assert(ctx.fd_event >= 0);
+	ctx.fd_wakeup = eventfd(0, EFD_NONBLOCK);
+	assert(ctx.fd_wakeup >= 0);
 
 	ctx.s = sched_init();
 
+	/* not fatal: the worker just goes without the counters */
+	pmu_sync(&ctx.pmu);
+
+	ctx.steal_req = -1;
+
 	ctx.current_tsc = rdtsc();
+	ctx.task_deadline_tsc = UINT64_MAX;
 
 	ctx.pframe_pool = get_pframe_pool();
 	assert(ctx.pframe_pool);
 
+	for (int cls = 0; cls < SNB_NUM_CLASSES; cls++)
+		ctx.pframe_pools[cls] = get_pframe_pool_class(ctx.socket, cls);
+
 	ctx.status = WORKER_PAUSING;
 
 #if 0
@@ -215,7 +640,9 @@ static int run_worker(void *arg)
 	log_info("Worker %d(%p) is quitting... (core %d, socket %d)\n", 
 			ctx.wid, &ctx, ctx.core, ctx.socket);
 
+	pmu_close(&ctx.pmu);
 	sched_free(ctx.s);
+	snb_cache_flush();
 
 	STORE_BARRIER();
 	workers[ctx.wid] = NULL;
@@ -224,10 +651,20 @@ static int run_worker(void *arg)
 }
 
 void launch_worker(int wid, int core)
+{
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(core, &set);
+
+	launch_worker_cpuset(wid, &set);
+}
+
+void launch_worker_cpuset(int wid, const cpu_set_t *cpuset)
 {
 	int ret;
 
-	ret = rte_eal_remote_launch(run_worker, (void *)(int64_t)core, wid);
+	ret = rte_eal_remote_launch(run_worker, (void *)cpuset, wid);
 	assert(ret == 0);
 
 	INST_BARRIER();
@@ -2,10 +2,15 @@
 #define _WORKER_H_
 
 #include <stdint.h>
+#include <sched.h>
 
 #include "common.h"
 #include "mclass.h"
 #include "pktbatch.h"
+#include "pmu.h"
+#include "time.h"
+
+struct trace_ring;
 
 #define MAX_MODULES_PER_PATH	256
 
@@ -22,6 +27,49 @@
  *	master		RTE_MAX_LCORE-1		all other cores
  */
 
+/* A function to be run by a worker, at a quiescent point of sched_loop() 
+ * (i.e., between scheduling rounds, with no TC running) */
+struct worker_call {
+	int (*func)(void *arg);
+	void *arg;
+	int ret;
+	volatile int done;
+	struct worker_call *next;
+};
+
+/* snbuf size classes (see snbuf.h) */
+#define SNB_NUM_CLASSES		2
+
+/* Per-thread magazine of free snbufs of a size class, all from 
+ * ctx.pframe_pools[class] (snbuf.h).
+ * Refilled from and spilled to the mempool in units of SNB_CACHE_SIZE / 2 */
+#define SNB_CACHE_SIZE		(MAX_PKT_BURST * 8)
+
+struct snb_cache {
+	int cnt;
+	struct snbuf *bufs[SNB_CACHE_SIZE];
+
+	uint64_t cnt_alloc;	/* snb_alloc_bulk() calls */
+	uint64_t cnt_refill;	/* ... that had to go to the mempool */
+	uint64_t cnt_free;	/* snb_free_bulk() calls, fast path only */
+	uint64_t cnt_spill;	/* ... that had to go to the mempool */
+	uint64_t cnt_fail;	/* snb_alloc_bulk() calls that failed */
+};
+
+/* Why packets were dropped (or, for DROP_NO_MBUF, never received or
+ * created), counted per worker and per module (see count_drops()) */
+enum drop_cause {
+	DROP_DEADEND = 0,	/* sent to an unconnected gate */
+	DROP_NO_MBUF,		/* snb_alloc_bulk() failed (packets asked for) */
+	DROP_TX_FULL,		/* not taken by a port (TX or vport ring full) */
+	DROP_QUEUE_FULL,	/* did not fit in a Queue module */
+	DROP_FILTER,		/* discarded on purpose (e.g., by BPF) */
+	DROP_INVALID,		/* malformed (e.g., offloads cannot be done) */
+	NUM_DROP_CAUSES,
+};
+
+extern const char *drop_cause_names[NUM_DROP_CAUSES];
+
 typedef volatile enum {
 	WORKER_PAUSING = 0,	/* transient state for blocking or quitting */
 	WORKER_PAUSED,
@@ -32,26 +80,88 @@ struct worker_context {
 	worker_status_t status;
 
 	int wid;		/* always [0, MAX_WORKERS - 1] */
-	int core;		/* TODO: should be cpuset_t */
+	int core;		/* the first CPU in cpuset */
+	cpu_set_t cpuset;	/* the thread can float among these CPUs */
 	int socket;
 	int fd_event;
 
+	/* For idle sleep. Any thread may wake up the worker with
+	 * wakeup_worker(), which records wakeup_tsc for latency stats */
+	int fd_wakeup;
+	volatile int sleeping;
+	volatile uint64_t wakeup_tsc;
+
+	/* pframe_pool is the full-sized class (== pframe_pools[SNB_CLASS_FULL]).
+	 * pframe_pools[] may be NULL if the class is not available */
 	struct rte_mempool *pframe_pool;
+	struct rte_mempool *pframe_pools[SNB_NUM_CLASSES];
+	struct snb_cache snb_cache[SNB_NUM_CLASSES];
 
 	struct sched *s;
 
-	uint64_t silent_drops;	/* packets that have been sent to a deadend */
+	uint64_t drops[NUM_DROP_CAUSES];	/* packets, by enum drop_cause */
+
+	/* Work stealing. These are accessed by other workers as well.
+	 * steal_req: wid of the worker asking me for a TC (-1 if none)
+	 * steal_mailbox: a TC given to me, not yet grafted to my scheduler
+	 * steal_pending: have I asked someone, with no answer yet?
+	 * idle_rounds: consecutive idle rounds, updated periodically
+	 * draining: being removed (remove_worker()), so it takes no TCs
+	 * queue_epoch: bumped when a TC leaves me, see give_up_queues() */
+	volatile int steal_req;
+	struct tc * volatile steal_mailbox;
+	volatile int steal_pending;
+	volatile uint64_t idle_rounds;
+	volatile int draining;
+	volatile uint32_t queue_epoch;
+
+	/* pushed by the master, taken all at once by the worker */
+	struct worker_call * volatile calls;
 
 	uint64_t current_tsc;
 	uint64_t current_us;
 
+	/* the task being run */
+	struct task *current_task;
+
+	/* when the current TC run should end (tc_params.max_run_us). 
+	 * UINT64_MAX if there is no budget. See task_over_budget() */
+	uint64_t task_deadline_tsc;
+
+	/* Sampled cycle accounting (see MODULE_PERF_SAMPLE_INTERVAL).
+	 * perf_sampling: is the current task run being timed?
+	 * perf_child_cycles: cycles of downstream modules, to be excluded */
+	int perf_sampling;
+	uint32_t perf_countdown;
+	uint64_t perf_child_cycles;
+
+	/* Cycle attribution to the owners of modules (module.owner_tc).
+	 * charged_child_cycles: of downstream modules with their own owner
+	 * cycles_transferred: charged to the owners in this task run, 
+	 * 	to be taken off the running TC */
+	uint64_t charged_child_cycles;
+	uint64_t cycles_transferred;
+
+	/* hardware counters (enable_pmu()), and like perf_child_cycles, 
+	 * the counts of downstream modules */
+	struct pmu pmu;
+	uint64_t perf_child_pmu[NUM_PMU_EVENTS];
+
+	/* partial batches of compacting gates, to be flushed at the end of
+	 * the task run (see struct gate_compact in module.h) */
+	struct compact_buf *compact_pending;
+
+	/* set by start_trace(), cleared when the window closes (trace.h) */
+	struct trace_ring * volatile trace;
+
 	/* The current input gate index is not given as a function parameter.
 	 * Modules should use get_igate() for access */
 	gate_idx_t igate_stack[MAX_MODULES_PER_PATH];
 	int stack_depth;
 	
-	/* better be the last field. it's huge */
-	struct pkt_batch splits[MAX_GATES + 1];
+	/* For run_split(): ogate -> (index of its batch + 1), 0 if none.
+	 * Always all zeroes, except in the middle of run_split() */
+	uint8_t split_slot[MAX_GATES + 1];
 };
 
 extern int num_workers;
@@ -69,13 +179,46 @@ void pause_all_workers();
 void resume_all_workers();
 void destroy_all_workers();
 
+/* Resume a single (e.g., newly launched) worker, leaving the others as is.
+ * Unlike resume_all_workers(), orphan tasks are not assigned */
+void resume_worker(int wid);
+
+/* Move all TCs of the worker to the other workers, one at a time (each
+ * move stalls only the two workers involved), then destroy it while the
+ * rest keep running. Pinned TCs are moved as well. Fails with -EBUSY if 
+ * the worker has TCs but no other worker can take them. */
+int remove_worker(int wid);
+
 int is_any_worker_running();
 
+/* Can be called by any thread. No-op unless the worker is sleeping */
+void wakeup_worker(int wid);
+
+/* Run func(arg) on the worker's own thread at its next quiescent point, 
+ * and wait for it. Only the target worker stalls (for the duration of func),
+ * so the scheduler of a running worker can be modified without 
+ * pause_all_workers(). If the worker is not running, func is called
+ * directly. Returns the return value of func. */
+int run_on_worker(int wid, int (*func)(void *), void *arg);
+
+/* Wait until every running worker passes a quiescent point (outside of
+ * packet processing). Memory unlinked from the datapath before the call
+ * can be freed after it returns. */
+void synchronize_workers(void);
+
 int is_cpu_present(unsigned int core_id);
 
 /* arg (int) is the core id the worker should run on */
 void launch_worker(int wid, int core);	
 
+/* same as above, but the worker thread is pinned to a set of CPUs
+ * (e.g., a pair of hyperthreads of the same physical core) */
+void launch_worker_cpuset(int wid, const cpu_set_t *cpuset);
+
+/* add the SMT siblings of the core (including itself) to the set.
+ * Returns the number of CPUs added, or -errno. */
+int add_smt_siblings(cpu_set_t *set, unsigned int core_id);
+
 static inline int is_worker_active(int wid)
 {
 	return (workers[wid] != NULL);
@@ -93,7 +236,39 @@ static inline int is_pause_requested() {
 	return (ctx.status == WORKER_PAUSING);
 }
 
+/* Has the running task used up the cycle budget of its TC?
+ * Tasks (and modules or drivers looping over work of unbounded size) should
+ * check it between batches, and return early with partial work if so,
+ * leaving the rest for the next run. Always 0 without a budget. */
+static inline int task_over_budget(void)
+{
+	/* no rdtsc() at all if there is no budget, the common case */
+	if (likely(ctx.task_deadline_tsc == UINT64_MAX))
+		return 0;
+
+	return unlikely(rdtsc() > ctx.task_deadline_tsc);
+}
+
 /* Block myself. Return nonzero if the worker needs to die */
 int block_worker(void);	
 
+/* Sleep until the timeout (in ns) or wakeup_worker().
+ * Returns 1 if woken up explicitly, 0 on timeout */
+int idle_sleep(uint64_t timeout_ns);
+
+/* Run the functions requested with run_on_worker() */
+void process_worker_calls(void);
+
+/* Hand over/take in TCs to/from other workers. Called periodically */
+void poll_work_stealing(uint64_t idle_rounds);
+
+/* The worker gives up the queue_single queues it owns (check_queue_owner()),
+ * since a TC is leaving it and the queues may be used by its new worker.
+ * Those it still uses are claimed again. Call on the worker itself
+ * (between task runs), or while it is paused */
+static inline void give_up_queues(int wid)
+{
+	workers[wid]->queue_epoch++;
+}
+
 #endif
@@ -90,7 +90,10 @@ class BESS(object):
 
         self.s.sendall(struct.pack('<L', len(q)) + q)
 
-        total, = struct.unpack('<L', self.s.recv(4))
+        return self._recv()
+
+    def _recv(self):
+        total, = struct.unpack('<L', self._recv_all(4))
         buf = []
         received = 0
         while received < total:
@@ -112,18 +115,79 @@ class BESS(object):
 
         return obj
 
-    def _request_bess(self, cmd, arg=None):
+    @staticmethod
+    def bess_request(cmd, arg=None):
         if arg is not None:
-            return self._request({'to': 'bess', 'cmd': cmd, 'arg': arg})
+            return {'to': 'bess', 'cmd': cmd, 'arg': arg}
         else:
-            return self._request({'to': 'bess', 'cmd': cmd})
+            return {'to': 'bess', 'cmd': cmd}
 
-    def _request_module(self, name, cmd, arg=None):
+    @staticmethod
+    def module_request(name, cmd, arg=None):
         if arg is not None:
-            return self._request({'to': 'module', 'name': name, 'cmd': cmd, 
-                    'arg': arg}) 
+            return {'to': 'module', 'name': name, 'cmd': cmd, 'arg': arg}
         else:
-            return self._request({'to': 'module', 'name': name, 'cmd': cmd})
+            return {'to': 'module', 'name': name, 'cmd': cmd}
+
+    def _recv_all(self, size):
+        buf = ''
+        while len(buf) < size:
+            frag = self.s.recv(size - len(buf))
+            if not frag:
+                raise socket.error('Connection closed by BESS daemon')
+            buf += frag
+        return buf
+
+    def _request_bess(self, cmd, arg=None):
+        return self._request(self.bess_request(cmd, arg))
+
+    def _request_module(self, name, cmd, arg=None):
+        return self._request(self.module_request(name, cmd, arg))
+
+    # Stats are pushed every interval_ms after this, on this connection, 
+    # which cannot be used for other requests anymore (use another BESS
+    # object for those). Get them with next_stats().
+    def subscribe_stats(self, ports=[], tcs=[], modules=[], 
+            interval_ms=1000, full_every=None):
+        args = {'ports': ports, 'tcs': tcs, 'modules': modules,
+                'interval_ms': interval_ms}
+        if full_every is not None:
+            args['full_every'] = full_every
+        self._stats = None
+        return self._request_bess('subscribe_stats', args)
+
+    # Blocks until the next message, and returns the current stats
+    # (full snapshot or not), as a dict of 'ports', 'tcs', and 'modules'
+    def next_stats(self):
+        msg = self._recv()
+        if msg['full'] or self._stats is None:
+            self._stats = msg['stats']
+        else:
+            self._stats = self._apply_delta(self._stats, msg['stats'])
+        return self._stats
+
+    @classmethod
+    def _apply_delta(cls, old, delta):
+        if delta is None:
+            return old
+        if isinstance(delta, (int, long)) and isinstance(old, (int, long)):
+            return old + delta
+        if isinstance(delta, list):
+            return [cls._apply_delta(o, d) for o, d in zip(old, delta)]
+        if isinstance(delta, message.SNObjDict):
+            for key in delta:
+                old[key] = cls._apply_delta(old[key], delta[key])
+            return old
+        return delta
+
+    # Runs the requests (made with bess_request() or module_request()) in
+    # order with the workers paused once, unless pause is False.
+    # If one fails, the module/port creations and connections before it
+    # are undone, and Error is raised (see handle_snobj_batch()).
+    # Returns the list of responses.
+    def batch(self, requests, pause=True):
+        return self._request({'to': 'batch', 'requests': requests,
+                'pause': int(pause)})['results']
 
     def kill(self):
         try:
@@ -157,12 +221,21 @@ class BESS(object):
 
         return self._request_bess('create_port', kv)
 
+    # ports: a list of dicts with 'driver' and optional 'name' and 'arg'.
+    # Returns a dict with a result ('name' or 'err') for each port.
+    def create_ports(self, ports):
+        return self._request_bess('create_ports', ports)
+
     def destroy_port(self, name):
         return self._request_bess('destroy_port', name)
 
     def get_port_stats(self, port):
         return self._request_bess('get_port_stats', port)
 
+    # driver-specific, e.g., {'cmd': 'set_reta', 'reta': [0, 1]} for PMD
+    def query_port(self, port, arg):
+        return self._request({'to': 'port', 'name': port, 'arg': arg})
+
     def list_mclasses(self):
         return self._request_bess('list_mclasses')
 
@@ -175,11 +248,12 @@ class BESS(object):
     def reset_modules(self):
         return self._request_bess('reset_modules')
 
-    def create_module(self, mclass, name=None, arg=None):
+    def create_module(self, mclass, name=None, arg=None, socket=None):
         kv = {'mclass': mclass}
 
         if name is not None:    kv['name'] = name
         if arg is not None:     kv['arg'] = arg
+        if socket is not None:  kv['socket'] = socket
 
         return self._request_bess('create_module', kv)
 
@@ -200,22 +274,167 @@ class BESS(object):
     def run_module_command(self, name, cmd, arg):
         return self._request_module(name, cmd, arg)
 
-    def enable_tcpdump(self, fifo, m, ogate=0):
+    # m=None: all modules. ogate=None: all output gates
+    def track_gate(self, enable, m=None, ogate=None):
+        args = {'enable': int(enable)}
+        if m is not None:
+            args['name'] = m
+        if ogate is not None:
+            args['ogate'] = ogate
+        return self._request_bess('track_gate', args)
+
+    # latency probes: the time since the previous probe, per packet
+    def latency_gate(self, enable, m=None, ogate=None, precision=None):
+        args = {'enable': int(enable)}
+        if m is not None:
+            args['name'] = m
+        if ogate is not None:
+            args['ogate'] = ogate
+        if precision is not None:
+            args['precision'] = precision
+        return self._request_bess('latency_gate', args)
+
+    def get_latency(self, reset=False):
+        return self._request_bess('get_latency', {'reset': int(reset)})
+
+    # min_size: batches smaller than this are merged (0 disables it)
+    def compact_gate(self, m, ogate=0, min_size=16):
+        args = {'name': m, 'ogate': ogate, 'min_size': min_size}
+        return self._request_bess('compact_gate', args)
+
+    # sample: dumps 1 out of every sample packets
+    def enable_tcpdump(self, fifo, m, ogate=0, sample=None):
         args = {'name': m, 'ogate': ogate, 'fifo': fifo}
+        if sample is not None:
+            args['sample'] = sample
+        return self._request_bess('enable_tcpdump', args)
+
+    # ring: path of a new shared-memory file (see struct dump_ring)
+    def enable_tcpdump_ring(self, ring, m, ogate=0, snaplen=None,
+            slots=None, sample=None):
+        args = {'name': m, 'ogate': ogate, 'ring': ring}
+        if snaplen is not None:
+            args['snaplen'] = snaplen
+        if slots is not None:
+            args['slots'] = slots
+        if sample is not None:
+            args['sample'] = sample
         return self._request_bess('enable_tcpdump', args)
 
     def disable_tcpdump(self, m, ogate=0):
         args = {'name': m, 'ogate': ogate}
         return self._request_bess('disable_tcpdump', args)
 
+    # records task runs and module calls on all workers, for duration_us
+    def start_trace(self, duration_us=None, events=None):
+        args = {}
+        if duration_us is not None:
+            args['duration_us'] = duration_us
+        if events is not None:
+            args['events'] = events
+        return self._request_bess('start_trace', args)
+
+    # takes (and clears) the trace. Stops it if still in progress
+    def get_trace(self):
+        return self._request_bess('get_trace')
+
+    # path is on the host of the daemon
+    def save_snapshot(self, path):
+        return self._request_bess('save_snapshot', {'path': path})
+
+    # only on an empty daemon (also possible at startup with "bessd -r")
+    def restore_snapshot(self, path):
+        return self._request_bess('restore_snapshot', {'path': path})
+
+    # creates a module of the mclass, only for the benchmark on a worker
+    def bench_module(self, mclass, arg=None, batch_size=None, pkt_size=None,
+            flows=None, batches=None, wid=None):
+        args = {'mclass': mclass, 'arg': arg}
+        for k, v in [('batch_size', batch_size), ('pkt_size', pkt_size),
+                     ('flows', flows), ('batches', batches), ('wid', wid)]:
+            if v is not None:
+                args[k] = v
+        return self._request_bess('bench_module', args)
+
+    # hardware counters, reported in list_workers, get_tc_stats, and
+    # get_module_info (perf), as 'pmu'
+    def enable_pmu(self):
+        return self._request_bess('enable_pmu')
+
+    def disable_pmu(self):
+        return self._request_bess('disable_pmu')
+
+    # path: a new shared-memory file (see core/telemetry.h and telemetry.py)
+    def enable_telemetry(self, path, interval_ms=None):
+        args = {'path': path}
+        if interval_ms is not None:
+            args['interval_ms'] = interval_ms
+        return self._request_bess('enable_telemetry', args)
+
+    def disable_telemetry(self):
+        return self._request_bess('disable_telemetry')
+
     def list_workers(self):
         return self._request_bess('list_workers')
 
-    def add_worker(self, wid, core):
+    def get_mempool_stats(self):
+        return self._request_bess('get_mempool_stats')
+
+    def set_mempool_admission(self, reserve_pct=None, watermark_pct=None,
+                              min_priority=None):
+        args = {}
+        if reserve_pct is not None:
+            args['reserve_pct'] = reserve_pct
+        if watermark_pct is not None:
+            args['watermark_pct'] = watermark_pct
+        if min_priority is not None:
+            args['min_priority'] = min_priority
+
+        return self._request_bess('set_mempool_admission', args)
+
+    def get_drop_stats(self):
+        return self._request_bess('get_drop_stats')
+
+    # core can be a list of cores. If smt is true, the worker runs on all
+    # hyperthreads of the given core(s)
+    # resume=True: start the new worker right away, for a running pipeline
+    def add_worker(self, wid, core, throttle=None, smt=None, resume=None):
         args = {'wid': wid, 'core': core}
+        if throttle is not None:
+            args['throttle'] = throttle
+        if smt is not None:
+            args['smt'] = int(smt)
+        if resume is not None:
+            args['resume'] = int(resume)
         return self._request_bess('add_worker', args)
 
-    def attach_task(self, m, tid=0, tc=None, wid=None):
+    # its TCs are moved to other workers, which keep running
+    def remove_worker(self, wid):
+        return self._request_bess('remove_worker', {'wid': wid})
+
+    # sockets, with their cores, hugepages, workers, NICs, and ports
+    def get_topology(self):
+        return self._request_bess('get_topology')
+
+    # launches workers and attaches tasks on the sockets of their modules
+    def auto_place(self, workers_per_socket=None, dry_run=None, resume=None):
+        args = {}
+        if workers_per_socket is not None:
+            args['workers_per_socket'] = workers_per_socket
+        if dry_run is not None:
+            args['dry_run'] = int(dry_run)
+        if resume is not None:
+            args['resume'] = int(resume)
+        return self._request_bess('auto_place', args)
+
+    def set_module_tc(self, m, tc):
+        args = {'name': m}
+        if tc is not None:
+            args['tc'] = tc
+
+        return self._request_bess('set_module_tc', args)
+
+    def attach_task(self, m, tid=0, tc=None, wid=None, pinned=None):
         if (tc is None) == (wid is None):
             raise self.APIError('You should specify either "tc" or "wid"' \
                     ', but not both')
@@ -225,6 +444,9 @@ class BESS(object):
         else:
             args = {'name': m, 'taskid': tid, 'wid': wid}
 
+        if pinned is not None:
+            args['pinned'] = int(pinned)
+
         return self._request_bess('attach_task', args)
 
     def list_tcs(self, wid = None):
@@ -234,8 +456,22 @@ class BESS(object):
 
         return self._request_bess('list_tcs', args)
 
-    def add_tc(self, name, wid=0, priority=0, limit=None, max_burst=None):
+    def add_tc(self, name, wid=0, priority=0, limit=None, max_burst=None,
+               pinned=False, max_delay_us=None, wait_stats=True,
+               max_run_us=None):
         args = {'name': name, 'wid': wid, 'priority': priority}
+        if pinned:
+            args['pinned'] = 1
+
+        if not wait_stats:
+            args['wait_stats'] = 0
+
+        if max_delay_us:
+            args['max_delay_us'] = max_delay_us
+
+        if max_run_us:
+            args['max_run_us'] = max_run_us
+
         if limit:
             args['limit'] = limit
 
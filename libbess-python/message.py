@@ -8,6 +8,11 @@ TYPE_BLOB   = 4
 TYPE_LIST   = 5
 TYPE_MAP    = 6
 
+# lists of PACKED_MIN or more ints are sent as TYPE_LIST | PACKED_INT,
+# with the values back to back (see snobj_encode() in core/snobj.c)
+PACKED_INT  = 0x100
+PACKED_MIN  = 8
+
 # a custom class that supports both obj[x] and obj.x for convenience
 class SNObjDict(object):
     def __init__(self):
@@ -126,7 +131,11 @@ def encode(obj):
     elif isinstance(obj, (list, set)):
         t = TYPE_LIST
         l = len(obj)
-        v = ''.join(map(encode, obj))
+        if l >= PACKED_MIN and all(isinstance(x, int) for x in obj):
+            t |= PACKED_INT
+            v = struct.pack('<%dq' % l, *obj)
+        else:
+            v = ''.join(map(encode, obj))
     elif isinstance(obj, (dict, SNObjDict)):
         t = TYPE_MAP
         if isinstance(obj, SNObjDict):
@@ -159,6 +168,9 @@ def _decode_recur(buf, offset):
     elif t == TYPE_BLOB:
         v = bytearray(buf[offset:offset + l])
         offset += l
+    elif t == TYPE_LIST | PACKED_INT:
+        v = list(struct.unpack_from('<%dq' % l, buf, offset))
+        offset += l * 8
     elif t == TYPE_LIST:
         v  = list()
         for i in xrange(l):
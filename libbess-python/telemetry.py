@@ -0,0 +1,91 @@
+import mmap
+import struct
+
+# see core/telemetry.h
+TELEMETRY_MAGIC = 0x454c4554
+TELEMETRY_VERSION = 1
+
+HDR_FMT = '=IIQQQQII' + 'IIII' * 5
+NAME_LEN = 64
+
+WORKER_FMT = '=IIQ4QQQ'
+PORT_FMT = '=%ds6Q' % NAME_LEN
+TC_FMT = '=%dsiI4QQ' % NAME_LEN
+MODULE_FMT = '=%ds3Q' % NAME_LEN
+GATE_FMT = '=IIQQ'
+
+def _name(raw):
+    return raw.split(b'\0', 1)[0].decode()
+
+# A read-only view of the counters published by BESS (enable_telemetry).
+# Usage: t = Telemetry(path); snapshot = t.read()
+class Telemetry(object):
+    def __init__(self, path):
+        with open(path, 'rb') as f:
+            self.buf = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+
+    def close(self):
+        self.buf.close()
+
+    def _table(self, fmt, off, num):
+        size = struct.calcsize(fmt)
+        return [struct.unpack_from(fmt, self.buf, off + i * size)
+                for i in range(num)]
+
+    def _parse(self):
+        hdr = struct.unpack_from(HDR_FMT, self.buf, 0)
+
+        magic, version, _, ts_ns, tsc_hz, interval_ns, truncated = hdr[:7]
+        if magic != TELEMETRY_MAGIC or version != TELEMETRY_VERSION:
+            raise ValueError('not a (compatible) telemetry region')
+
+        n_w, _, off_w, _ = hdr[8:12]
+        n_p, _, off_p, _ = hdr[12:16]
+        n_t, _, off_t, _ = hdr[16:20]
+        n_m, _, off_m, _ = hdr[20:24]
+        n_g, _, off_g, _ = hdr[24:28]
+
+        r = {'timestamp': ts_ns / 1e9, 'tsc_hz': tsc_hz,
+                'interval_ns': interval_ns, 'truncated': bool(truncated)}
+
+        r['workers'] = [{'wid': w[0], 'running': w[1], 'silent_drops': w[2],
+                'usage': list(w[3:7]), 'cnt_idle': w[7],
+                'cycles_idle': w[8]}
+                for w in self._table(WORKER_FMT, off_w, n_w)]
+
+        r['ports'] = [{'name': _name(p[0]),
+                'inc': {'packets': p[1], 'dropped': p[2], 'bytes': p[3]},
+                'out': {'packets': p[4], 'dropped': p[5], 'bytes': p[6]}}
+                for p in self._table(PORT_FMT, off_p, n_p)]
+
+        r['tcs'] = [{'name': _name(t[0]), 'wid': t[1],
+                'usage': list(t[3:7]), 'cnt_throttled': t[7]}
+                for t in self._table(TC_FMT, off_t, n_t)]
+
+        modules = self._table(MODULE_FMT, off_m, n_m)
+        r['modules'] = [{'name': _name(m[0]), 'samples': m[1],
+                'pkts': m[2], 'cycles': m[3], 'ogates': []}
+                for m in modules]
+
+        for g in self._table(GATE_FMT, off_g, n_g):
+            if g[0] < len(r['modules']):
+                r['modules'][g[0]]['ogates'].append(
+                        {'ogate': g[1], 'cnt': g[2], 'pkts': g[3]})
+
+        return r
+
+    # a consistent snapshot, retried while BESS is updating it (seqlock)
+    def read(self, max_tries=1000):
+        for _ in range(max_tries):
+            seq1, = struct.unpack_from('=Q', self.buf, 8)
+            if seq1 & 1:
+                continue
+
+            r = self._parse()
+
+            seq2, = struct.unpack_from('=Q', self.buf, 8)
+            if seq1 == seq2:
+                r['seq'] = seq1
+                return r
+
+        raise RuntimeError('telemetry region is being updated too often')